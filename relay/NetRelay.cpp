@@ -0,0 +1,507 @@
+// Self-hostable UDP relay for NetHelper players who can't forward ports.
+//
+// Builds on Windows with NetRelay.vcxproj, and on Linux or other POSIX systems
+// with: g++ -O2 -o netrelay NetRelay.cpp
+//
+// Usage: NetRelay [-p port] [-a publicIp] [-r firstPort-lastPort] [-n maxAllocs]
+//                 [-k token] [-l 1]
+//
+// Clients can only send to peers that sent to their relayed port first, unless
+// they know the token, and never to loopback, private or multicast addresses.
+// -l 1 allows loopback peers, for testing with the relay and players on one
+// computer.
+//
+// One instance runs on one thread; to use more cores, run an instance per core on
+// different ports and list them all in RelayServers.
+
+#ifdef _WIN32
+#define FD_SETSIZE 1024  // Winsock defaults to 64 sockets per select()
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef int socklen_t;
+#define SocketError() WSAGetLastError()
+#define WOULDBLOCK    WSAEWOULDBLOCK
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+typedef int      SOCKET;
+typedef uint8_t  BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+const SOCKET INVALID_SOCKET = -1;
+#define closesocket   close
+#define SocketError() errno
+#define WOULDBLOCK    EWOULDBLOCK
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <memory>
+#include <vector>
+#include "../src/RelayProtocol.h"
+
+namespace {
+
+struct Allocation {
+  SOCKET      socket;
+  sockaddr_in client;    // The game socket's address, as seen by the relay
+  DWORD       lastSeen;  // Ms; from the client
+  DWORD       packets,   // Relayed either way, for the periodic log
+              refused;   // From the client to peers it may not send to
+  std::map<DWORD, DWORD> permissions;  // By peer address; when each expires, ms
+};
+
+struct Settings {
+  WORD  port           = relayDefaultPort;
+  DWORD publicAddress  = 0;  // Network order; 0 = let clients use ours
+  int   firstPort      = 0,  // 0 = any free port
+        lastPort       = 0;
+  int   maxAllocations = 256;
+  const char *token    = nullptr;  // Lets clients permit peers with relayPermit
+  bool  loopbackPeers  = false;
+};
+
+} // anonymous namespace
+
+static Settings settings;
+static SOCKET   controlSocket = INVALID_SOCKET;
+static std::map<unsigned long long, std::unique_ptr<Allocation>> allocations;
+static int      nextPort = 0;
+
+static const DWORD  statsInterval  = 60000;
+static const size_t maxPermissions = 64;  // Per allocation
+
+
+static DWORD Now() {
+#ifdef _WIN32
+  return GetTickCount();
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<DWORD>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+
+static unsigned long long Key(const sockaddr_in &address) {
+  return (static_cast<unsigned long long>(address.sin_addr.s_addr) << 16) |
+         address.sin_port;
+}
+
+
+// False for addresses that would let a client reach into the relay's own network,
+// or many hosts at once
+static bool IsPublicUnicast(DWORD address) {
+  DWORD host = ntohl(address);
+  if (settings.loopbackPeers && (host >> 24) == 127) {
+    return true;
+  }
+  return !((host >> 24) == 0      ||  // "This" network
+           (host >> 24) == 10     ||
+           (host >> 24) == 127    ||  // Loopback
+           (host >> 22) == 0x191  ||  // 100.64.0.0/10, carrier-grade NAT
+           (host >> 16) == 0xA9FE ||  // 169.254.0.0/16, link-local
+           (host >> 20) == 0xAC1  ||  // 172.16.0.0/12
+           (host >> 16) == 0xC0A8 ||  // 192.168.0.0/16
+           (host >> 28) >= 14);       // Multicast, reserved, and broadcast
+}
+
+
+// Lets the client send to a peer address for a while longer
+static void Permit(Allocation &allocation, DWORD address, DWORD now) {
+  if (!IsPublicUnicast(address)) {
+    return;
+  }
+
+  if (allocation.permissions.size() >= maxPermissions &&
+      allocation.permissions.count(address) == 0) {
+    for (auto it = allocation.permissions.begin();
+         it != allocation.permissions.end(); ) {
+      if (static_cast<int>(it->second - now) <= 0) {
+        it = allocation.permissions.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+    if (allocation.permissions.size() >= maxPermissions) {
+      return;
+    }
+  }
+  allocation.permissions[address] = now + relayPermissionSec * 1000;
+}
+
+
+static bool IsPermitted(const Allocation &allocation, DWORD address, DWORD now) {
+  auto it = allocation.permissions.find(address);
+  return it != allocation.permissions.end() && static_cast<int>(it->second - now) > 0;
+}
+
+
+static bool SetNonBlocking(SOCKET s) {
+#ifdef _WIN32
+  u_long nonBlocking = 1;
+  return ioctlsocket(s, FIONBIO, &nonBlocking) == 0;
+#else
+  return fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) == 0;
+#endif
+}
+
+
+static SOCKET OpenSocket(int port) {
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (s == INVALID_SOCKET) {
+    return s;
+  }
+
+#ifndef _WIN32
+  // select() can't watch descriptors past FD_SETSIZE
+  if (s >= FD_SETSIZE) {
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+#endif
+
+  // Relayed game traffic comes in bursts
+  int bufSize = 1 << 20;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<char*>(&bufSize),
+             sizeof(bufSize));
+  setsockopt(s, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<char*>(&bufSize),
+             sizeof(bufSize));
+
+  sockaddr_in local = {};
+  local.sin_family      = AF_INET;
+  local.sin_port        = htons(static_cast<WORD>(port));
+  local.sin_addr.s_addr = INADDR_ANY;
+  if (bind(s, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0 ||
+      !SetNonBlocking(s)) {
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+  return s;
+}
+
+
+// Opens the relayed port for a new allocation, from the configured range if any
+static SOCKET OpenRelayedSocket() {
+  if (settings.firstPort == 0) {
+    return OpenSocket(0);
+  }
+
+  int count = settings.lastPort - settings.firstPort + 1;
+  for (int i = 0; i < count; ++i) {
+    int port = settings.firstPort + (nextPort++ % count);
+    SOCKET s = OpenSocket(port);
+    if (s != INVALID_SOCKET) {
+      return s;
+    }
+  }
+  return INVALID_SOCKET;
+}
+
+
+static void SendHeader(RelayType type, DWORD address, WORD port,
+                       const sockaddr_in &to) {
+  RelayHeader header = { relayMagic, static_cast<BYTE>(type), relayVersion, address,
+                         port };
+  sendto(controlSocket, reinterpret_cast<const char*>(&header), sizeof(header), 0,
+         reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+}
+
+
+static void FreeAllocation(unsigned long long key) {
+  auto it = allocations.find(key);
+  if (it != allocations.end()) {
+    closesocket(it->second->socket);
+    allocations.erase(it);
+  }
+}
+
+
+static void OnAllocate(const sockaddr_in &from) {
+  unsigned long long key = Key(from);
+  auto it = allocations.find(key);
+  Allocation *allocation = (it != allocations.end()) ? it->second.get() : nullptr;
+
+  if (!allocation) {
+    SOCKET s = (static_cast<int>(allocations.size()) < settings.maxAllocations) ?
+               OpenRelayedSocket() : INVALID_SOCKET;
+    if (s == INVALID_SOCKET) {
+      SendHeader(relayError, 0, htons(relayErrorFull), from);
+      return;
+    }
+
+    allocation = new Allocation();
+    allocation->socket = s;
+    allocation->client = from;
+    allocations[key].reset(allocation);
+
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from.sin_addr, address, sizeof(address));
+    printf("NetRelay: Allocated for %s:%d (%d in use)\n", address,
+           ntohs(from.sin_port), static_cast<int>(allocations.size()));
+  }
+  allocation->lastSeen = Now();
+
+  sockaddr_in relayed;
+  socklen_t relayedLen = sizeof(relayed);
+  getsockname(allocation->socket, reinterpret_cast<sockaddr*>(&relayed), &relayedLen);
+  SendHeader(relayAllocated, settings.publicAddress, relayed.sin_port, from);
+}
+
+
+// Handles everything clients send to the control port
+static void OnControl(char *buf, int len, const sockaddr_in &from) {
+  auto *header = reinterpret_cast<RelayHeader*>(buf);
+  if (len < static_cast<int>(sizeof(RelayHeader)) || header->magic != relayMagic ||
+      header->version != relayVersion) {
+    return;
+  }
+
+  switch (header->type) {
+  case relayPing:
+    SendHeader(relayPong, header->address, 0, from);
+    break;
+
+  case relayAllocate:
+    OnAllocate(from);
+    break;
+
+  case relayRelease:
+    FreeAllocation(Key(from));
+    break;
+
+  case relayData: {
+    auto it = allocations.find(Key(from));
+    if (it == allocations.end()) {
+      // Expired; the client allocates again when it hears this
+      SendHeader(relayError, 0, htons(relayErrorNoAllocation), from);
+      break;
+    }
+
+    Allocation &allocation = *it->second;
+    DWORD now = Now();
+    allocation.lastSeen = now;
+
+    // Dropped quietly, since the client has no way to fix it
+    if (!IsPermitted(allocation, header->address, now)) {
+      ++allocation.refused;
+      break;
+    }
+    Permit(allocation, header->address, now);
+    ++allocation.packets;
+
+    sockaddr_in to = {};
+    to.sin_family      = AF_INET;
+    to.sin_addr.s_addr = header->address;
+    to.sin_port        = header->port;
+    sendto(allocation.socket, buf + sizeof(RelayHeader), len - sizeof(RelayHeader), 0,
+           reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+    break;
+  }
+
+  case relayPermit: {
+    auto it = allocations.find(Key(from));
+    size_t tokenLen = settings.token ? strlen(settings.token) : 0;
+    if (it == allocations.end()) {
+      SendHeader(relayError, 0, htons(relayErrorNoAllocation), from);
+    }
+    else if (!tokenLen || len - sizeof(RelayHeader) != tokenLen ||
+             memcmp(buf + sizeof(RelayHeader), settings.token, tokenLen) != 0 ||
+             !IsPublicUnicast(header->address)) {
+      SendHeader(relayError, 0, htons(relayErrorForbidden), from);
+    }
+    else {
+      Permit(*it->second, header->address, Now());
+    }
+    break;
+  }
+  }
+}
+
+
+// Passes on everything that arrived at a relayed port to its client
+static void DrainRelayed(Allocation &allocation) {
+  char buf[sizeof(RelayHeader) + 65536];
+  auto *header = reinterpret_cast<RelayHeader*>(buf);
+
+  for (;;) {
+    sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int len = recvfrom(allocation.socket, buf + sizeof(RelayHeader),
+                       sizeof(buf) - sizeof(RelayHeader), 0,
+                       reinterpret_cast<sockaddr*>(&from), &fromLen);
+    if (len < 0) {
+      // Also ICMP errors from peers that left, which are not worth passing on
+      if (SocketError() == WOULDBLOCK) {
+        break;
+      }
+      continue;
+    }
+
+    header->magic   = relayMagic;
+    header->type    = relayData;
+    header->version = relayVersion;
+    header->address = from.sin_addr.s_addr;
+    header->port    = from.sin_port;
+    ++allocation.packets;
+    // The peer contacted the client first, so the client may answer it
+    Permit(allocation, from.sin_addr.s_addr, Now());
+    sendto(controlSocket, buf, sizeof(RelayHeader) + len, 0,
+           reinterpret_cast<const sockaddr*>(&allocation.client),
+           sizeof(allocation.client));
+  }
+}
+
+
+static void DrainControl() {
+  char buf[sizeof(RelayHeader) + 65536];
+  for (;;) {
+    sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int len = recvfrom(controlSocket, buf, sizeof(buf), 0,
+                       reinterpret_cast<sockaddr*>(&from), &fromLen);
+    if (len < 0) {
+      if (SocketError() == WOULDBLOCK) {
+        break;
+      }
+      continue;
+    }
+    OnControl(buf, len, from);
+  }
+}
+
+
+static void ExpireAllocations(DWORD now) {
+  for (auto it = allocations.begin(); it != allocations.end(); ) {
+    if (now - it->second->lastSeen >= relayLifetimeSec * 1000) {
+      closesocket(it->second->socket);
+      it = allocations.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+
+static bool ParseArgs(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    if (!value || argv[i][0] != '-') {
+      return false;
+    }
+
+    switch (argv[i][1]) {
+    case 'p':
+      settings.port = static_cast<WORD>(atoi(value));
+      break;
+    case 'a':
+      if (inet_pton(AF_INET, value, &settings.publicAddress) != 1) {
+        return false;
+      }
+      break;
+    case 'r':
+      if (sscanf(value, "%d-%d", &settings.firstPort, &settings.lastPort) != 2 ||
+          settings.firstPort < 1 || settings.lastPort > 65535 ||
+          settings.firstPort > settings.lastPort) {
+        return false;
+      }
+      break;
+    case 'n':
+      settings.maxAllocations = atoi(value);
+      break;
+    case 'k':
+      settings.token = value;
+      break;
+    case 'l':
+      settings.loopbackPeers = (atoi(value) != 0);
+      break;
+    default:
+      return false;
+    }
+    ++i;
+  }
+  return settings.port != 0 && settings.maxAllocations > 0;
+}
+
+
+int main(int argc, char **argv) {
+  if (!ParseArgs(argc, argv)) {
+    fprintf(stderr, "Usage: %s [-p port] [-a publicIp] [-r firstPort-lastPort] "
+                    "[-n maxAllocs] [-k token] [-l 1]\n", argv[0]);
+    return 2;
+  }
+
+#ifdef _WIN32
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != NO_ERROR) {
+    return 1;
+  }
+#endif
+
+  if ((controlSocket = OpenSocket(settings.port)) == INVALID_SOCKET) {
+    fprintf(stderr, "NetRelay: Could not bind UDP port %d\n", settings.port);
+    return 1;
+  }
+  printf("NetRelay: Listening on UDP port %d\n", settings.port);
+  fflush(stdout);
+
+  DWORD lastExpiry = Now(),
+        lastStats  = lastExpiry;
+  for (;;) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(controlSocket, &readSet);
+    SOCKET maxSocket = controlSocket;
+    for (auto &entry : allocations) {
+      FD_SET(entry.second->socket, &readSet);
+      maxSocket = (entry.second->socket > maxSocket) ? entry.second->socket : maxSocket;
+    }
+
+    timeval tv = { 1, 0 };
+    int ready = select(static_cast<int>(maxSocket + 1), &readSet, nullptr, nullptr,
+                       &tv);
+    if (ready > 0) {
+      if (FD_ISSET(controlSocket, &readSet)) {
+        DrainControl();
+      }
+      // Draining the control socket may have freed allocations, so look them up
+      // again rather than keeping iterators across it
+      for (auto &entry : allocations) {
+        if (FD_ISSET(entry.second->socket, &readSet)) {
+          DrainRelayed(*entry.second);
+        }
+      }
+    }
+
+    DWORD now = Now();
+    if (now - lastExpiry >= 1000) {
+      ExpireAllocations(now);
+      lastExpiry = now;
+    }
+    if (now - lastStats >= statsInterval) {
+      DWORD packets = 0,
+            refused = 0;
+      for (auto &entry : allocations) {
+        packets += entry.second->packets;
+        refused += entry.second->refused;
+        entry.second->packets = 0;
+        entry.second->refused = 0;
+      }
+      printf("NetRelay: %d allocations, %lu packets relayed and %lu refused in the "
+             "last minute\n", static_cast<int>(allocations.size()),
+             static_cast<unsigned long>(packets), static_cast<unsigned long>(refused));
+      fflush(stdout);
+      lastStats = now;
+    }
+  }
+}
@@ -0,0 +1,283 @@
+// Replays packets from a NetHelper capture file (see CaptureFile in readme.txt)
+// over UDP, at the pace they were captured or faster, so changes to the transport
+// can be benchmarked against the same traffic each time.
+//
+// Builds on Linux or other POSIX systems with: g++ -O2 -o netreplay NetReplay.cpp
+//
+// Usage: NetReplay [-t host:port] [-s speed] [-d send|recv|all] [-p] capture.o2pc
+//
+// Packets go to 127.0.0.1:47776 unless -t says otherwise, and only those the game
+// sent unless -d says otherwise. -s 2 replays twice as fast, and -s 0 as fast as
+// possible. With -p, each captured peer's packets come from a socket of their own,
+// so the receiver can tell the peers apart. Only the bytes captured are sent, which
+// are fewer than the game's for packets longer than the capture's snap length.
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace {
+
+// The capture file's layout, from PacketCapture.h. Fields are little endian, as is
+// every host this is expected to run on.
+const uint32_t captureMagic   = 0x4350324F;  // "O2PC"
+const uint16_t captureVersion = 1;
+const size_t   headerSize     = 48,
+               recordSize     = 32;
+
+struct Packet {
+  uint32_t       sequence;
+  int64_t        counter;
+  uint8_t        direction;  // 0 sent by the game, 1 received
+  uint8_t        peerId;     // 0xFF if unknown
+  uint32_t       capturedLen,
+                 originalLen;
+  const uint8_t *data;
+};
+
+struct Settings {
+  sockaddr_in target    = {};
+  double      speed     = 1;
+  int         direction = 0;  // 0 sent, 1 received, -1 both
+  bool        perPeer   = false;
+  const char *fileName  = nullptr;
+};
+
+} // anonymous namespace
+
+static Settings settings;
+
+
+template <class T>
+static T Read(const uint8_t *p) {
+  T value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+
+static double Seconds(const timespec &ts) {
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Collects the slots that were written, oldest first. Returns false if the file
+// isn't a capture.
+static bool ReadCapture(const uint8_t *file, size_t size, int64_t *frequency,
+                        std::vector<Packet> *packets) {
+  if (size < headerSize || Read<uint32_t>(file) != captureMagic ||
+      Read<uint16_t>(file + 4) != captureVersion) {
+    return false;
+  }
+  size_t   fileHeaderSize = Read<uint16_t>(file + 6);
+  uint32_t slotSize  = Read<uint32_t>(file + 8),
+           slotCount = Read<uint32_t>(file + 12);
+  *frequency = Read<int64_t>(file + 16);
+  if (fileHeaderSize < headerSize || slotSize < recordSize || *frequency <= 0 ||
+      (size - fileHeaderSize) / slotSize < slotCount) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < slotCount; ++i) {
+    const uint8_t *slot = file + fileHeaderSize + static_cast<size_t>(i) * slotSize;
+    Packet packet;
+    packet.sequence    = Read<uint32_t>(slot);
+    packet.capturedLen = Read<uint32_t>(slot + 4);
+    packet.originalLen = Read<uint32_t>(slot + 8);
+    packet.direction   = slot[12];
+    packet.peerId      = slot[13];
+    packet.counter     = Read<int64_t>(slot + 24);
+    packet.data        = slot + recordSize;
+    // Slots still being written when the capture stopped have sequence 0
+    if (packet.sequence != 0 && packet.capturedLen <= slotSize - recordSize) {
+      packets->push_back(packet);
+    }
+  }
+  std::sort(packets->begin(), packets->end(), [](const Packet &a, const Packet &b) {
+    return a.sequence < b.sequence;
+  });
+  return true;
+}
+
+
+static int OpenSocket() {
+  int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (s < 0) {
+    return s;
+  }
+  sockaddr_in local = {};
+  local.sin_family      = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(s, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+
+static bool ParseArgs(int argc, char **argv) {
+  settings.target.sin_family      = AF_INET;
+  settings.target.sin_port        = htons(47776);
+  settings.target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] != '-') {
+      if (settings.fileName) {
+        return false;
+      }
+      settings.fileName = argv[i];
+      continue;
+    }
+    if (strcmp(argv[i], "-p") == 0) {
+      settings.perPeer = true;
+      continue;
+    }
+
+    const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    if (!value) {
+      return false;
+    }
+    switch (argv[i][1]) {
+    case 't': {
+      char host[64];
+      int  port;
+      if (sscanf(value, "%63[^:]:%d", host, &port) != 2 || port < 1 || port > 65535 ||
+          inet_pton(AF_INET, host, &settings.target.sin_addr) != 1) {
+        return false;
+      }
+      settings.target.sin_port = htons(static_cast<uint16_t>(port));
+      break;
+    }
+    case 's':
+      settings.speed = atof(value);
+      if (settings.speed < 0) {
+        return false;
+      }
+      break;
+    case 'd':
+      settings.direction = (strcmp(value, "send") == 0) ? 0 :
+                           (strcmp(value, "recv") == 0) ? 1 :
+                           (strcmp(value, "all")  == 0) ? -1 : -2;
+      if (settings.direction == -2) {
+        return false;
+      }
+      break;
+    default:
+      return false;
+    }
+    ++i;
+  }
+  return settings.fileName != nullptr;
+}
+
+
+int main(int argc, char **argv) {
+  if (!ParseArgs(argc, argv)) {
+    fprintf(stderr, "Usage: %s [-t host:port] [-s speed] [-d send|recv|all] [-p] "
+                    "capture.o2pc\n", argv[0]);
+    return 2;
+  }
+
+  // Maps the capture rather than reading it, as it can be large
+  int fd = open(settings.fileName, O_RDONLY);
+  struct stat status;
+  void *file = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &status) == 0 && status.st_size > 0) {
+    file = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (file == MAP_FAILED) {
+    fprintf(stderr, "NetReplay: Could not read %s\n", settings.fileName);
+    return 1;
+  }
+  int64_t frequency;
+  std::vector<Packet> packets;
+  if (!ReadCapture(static_cast<const uint8_t*>(file), status.st_size, &frequency,
+                   &packets)) {
+    fprintf(stderr, "NetReplay: %s is not a NetHelper capture\n", settings.fileName);
+    return 1;
+  }
+
+  std::map<int, int> sockets;  // By peer ID, or just one with key -1
+  unsigned long long bytes = 0;
+  unsigned packetsSent = 0,
+           truncated   = 0,
+           failed      = 0;
+  double   maxLate     = 0;
+  bool     started     = false;
+  int64_t  firstCounter = 0;
+  timespec start;
+  for (const Packet &packet : packets) {
+    if (settings.direction >= 0 && packet.direction != settings.direction) {
+      continue;
+    }
+    int key = settings.perPeer ? packet.peerId : -1;
+    auto it = sockets.find(key);
+    if (it == sockets.end()) {
+      int s = OpenSocket();
+      if (s < 0) {
+        fprintf(stderr, "NetReplay: Could not open a UDP socket\n");
+        return 1;
+      }
+      it = sockets.emplace(key, s).first;
+    }
+
+    // Waits until the packet is due, relative to the first one
+    if (!started) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      firstCounter = packet.counter;
+      started      = true;
+    }
+    else if (settings.speed > 0) {
+      double due = Seconds(start) +
+                   (packet.counter - firstCounter) / (frequency * settings.speed);
+      timespec dueTs;
+      dueTs.tv_sec  = static_cast<time_t>(due);
+      dueTs.tv_nsec = static_cast<long>((due - dueTs.tv_sec) * 1e9);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &dueTs, nullptr) ==
+             EINTR) { }
+
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      maxLate = std::max(maxLate, Seconds(now) - due);
+    }
+
+    if (sendto(it->second, packet.data, packet.capturedLen, 0,
+               reinterpret_cast<const sockaddr*>(&settings.target),
+               sizeof(settings.target)) >= 0) {
+      ++packetsSent;
+      bytes += packet.capturedLen;
+      truncated += packet.capturedLen < packet.originalLen;
+    }
+    else {
+      ++failed;
+    }
+  }
+
+  timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("NetReplay: Replayed %u packets (%llu bytes, %u truncated) from %d sockets "
+         "in %.3f s, at most %.3f ms late; %u failed\n", packetsSent, bytes,
+         truncated, static_cast<int>(sockets.size()),
+         started ? Seconds(end) - Seconds(start) : 0, maxLate * 1000, failed);
+
+  for (auto &entry : sockets) {
+    close(entry.second);
+  }
+  munmap(file, status.st_size);
+  close(fd);
+  return failed ? 1 : 0;
+}
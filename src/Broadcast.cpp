@@ -0,0 +1,212 @@
+// Fans the game's LAN broadcasts out to every adapter, and drops repeated replies
+
+#include <winsock2.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "Broadcast.h"
+#include "Fnv.h"
+#include "NetMonitor.h"
+#include "PeerTable.h"
+
+namespace {
+
+// Not keyed by the sender's address, since a host with several adapters answers
+// from each of their addresses
+struct Reply {
+  WORD  port;      // Network order
+  int   len;
+  DWORD hash;
+  DWORD received;  // GetTickCount
+};
+
+struct SocketReplies {
+  DWORD lastFanOut;  // GetTickCount
+  std::vector<Reply> recent;
+};
+
+} // anonymous namespace
+
+// Replies to one broadcast arrive within a fraction of a second of each other. The
+// game broadcasts again every so often, and answers to that are new, so only look
+// for repeats briefly.
+static const DWORD  replyWindowMs = 1000,
+                    repeatMs      = 250;
+static const size_t maxReplies    = 64;
+
+static SRWLOCK lock = SRWLOCK_INIT;
+static bool enabled = false;
+static LONG generation = 0;
+static std::vector<DWORD> broadcasts;  // Of each adapter, network order
+static DWORD bestBroadcast = 0;        // Where 255.255.255.255 goes already
+static std::map<SOCKET, SocketReplies> replies;
+static BroadcastStats stats = {};
+
+
+static DWORD DirectedBroadcast(const NetMonitor::Adapter &adapter) {
+  // Point-to-point links and loopback have nothing to broadcast to
+  if (adapter.mask == 0 || adapter.mask == INADDR_BROADCAST ||
+      (ntohl(adapter.address) >> 24) == 127) {
+    return 0;
+  }
+  return (adapter.address & adapter.mask) | ~adapter.mask;
+}
+
+
+// Rebuilds the list of broadcast addresses if the adapter table changed
+static void RefreshBroadcasts() {
+  LONG current = NetMonitor::GetAdapterGeneration();
+  AcquireSRWLockShared(&lock);
+  bool stale = (current != generation) || broadcasts.empty();
+  ReleaseSRWLockShared(&lock);
+  if (!stale) {
+    return;
+  }
+
+  std::vector<DWORD> addresses;
+  for (auto &adapter : NetMonitor::GetAdapters()) {
+    DWORD address = DirectedBroadcast(adapter);
+    if (address &&
+        std::find(addresses.begin(), addresses.end(), address) == addresses.end()) {
+      addresses.push_back(address);
+    }
+  }
+  NetMonitor::Adapter best;
+  DWORD bestAddress = NetMonitor::GetBestAdapter(&best) ? DirectedBroadcast(best) : 0;
+
+  AcquireSRWLockExclusive(&lock);
+  broadcasts.swap(addresses);
+  bestBroadcast = bestAddress;
+  generation    = current;
+  ReleaseSRWLockExclusive(&lock);
+}
+
+
+bool StartBroadcastFanOut() {
+  if (enabled) {
+    return true;
+  }
+  if (!NetMonitor::Start()) {
+    return false;
+  }
+
+  RefreshBroadcasts();
+  return (enabled = true);
+}
+
+
+void StopBroadcastFanOut() {
+  enabled = false;
+
+  AcquireSRWLockExclusive(&lock);
+  broadcasts.clear();
+  replies.clear();
+  ReleaseSRWLockExclusive(&lock);
+}
+
+
+bool IsBroadcastFanOutEnabled() {
+  return enabled;
+}
+
+
+void BroadcastFanOut(SOCKET s, const char *buf, int len, int flags,
+                     const sockaddr *to, int toLen) {
+  if (!enabled || !to || toLen < static_cast<int>(sizeof(sockaddr_in)) ||
+      to->sa_family != AF_INET) {
+    return;
+  }
+  sockaddr_in copyTo = *reinterpret_cast<const sockaddr_in*>(to);
+  DWORD target = copyTo.sin_addr.s_addr;
+
+  RefreshBroadcasts();
+  std::vector<DWORD> others;
+  AcquireSRWLockShared(&lock);
+  if (target == INADDR_BROADCAST ||
+      std::find(broadcasts.begin(), broadcasts.end(), target) != broadcasts.end()) {
+    for (DWORD address : broadcasts) {
+      if (address != target &&
+          !(target == INADDR_BROADCAST && address == bestBroadcast)) {
+        others.push_back(address);
+      }
+    }
+  }
+  ReleaseSRWLockShared(&lock);
+
+  int copies = 0;
+  for (DWORD address : others) {
+    copyTo.sin_addr.s_addr = address;
+    if (sendto(s, buf, len, flags, reinterpret_cast<sockaddr*>(&copyTo),
+               sizeof(copyTo)) == len) {
+      ++copies;
+    }
+  }
+
+  if (copies != 0) {
+    AcquireSRWLockExclusive(&lock);
+    SocketReplies &socketReplies = replies[s];
+    socketReplies.lastFanOut = GetTickCount();
+    socketReplies.recent.clear();
+    ReleaseSRWLockExclusive(&lock);
+
+    InterlockedIncrement(&stats.broadcasts);
+    InterlockedExchangeAdd(&stats.copies, copies);
+  }
+}
+
+
+bool IsDuplicateReply(SOCKET s, const char *buf, int len, const sockaddr *from,
+                      int fromLen) {
+  if (!enabled || !from || fromLen < static_cast<int>(sizeof(sockaddr_in)) ||
+      from->sa_family != AF_INET) {
+    return false;
+  }
+  auto *fromAddr = reinterpret_cast<const sockaddr_in*>(from);
+  DWORD now = GetTickCount();
+  bool duplicate = false;
+
+  AcquireSRWLockShared(&lock);
+  auto it = replies.find(s);
+  bool searching = it != replies.end() && now - it->second.lastFanOut < replyWindowMs;
+  ReleaseSRWLockShared(&lock);
+
+  // Only search replies repeat; traffic from players the game already sends to is
+  // never dropped
+  if (!searching || PeerTable::FindPeerId(from, fromLen) >= 0) {
+    return false;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  it = replies.find(s);
+  if (it != replies.end()) {
+    Reply reply = { fromAddr->sin_port, len, Fnv1a32(fnvBasis32, buf, len), now };
+    for (const Reply &seen : it->second.recent) {
+      if (seen.port == reply.port && seen.len == reply.len &&
+          seen.hash == reply.hash && now - seen.received < repeatMs) {
+        duplicate = true;
+        break;
+      }
+    }
+    if (!duplicate && it->second.recent.size() < maxReplies) {
+      it->second.recent.push_back(reply);
+    }
+  }
+  ReleaseSRWLockExclusive(&lock);
+
+  if (duplicate) {
+    InterlockedIncrement(&stats.duplicates);
+  }
+  return duplicate;
+}
+
+
+void BroadcastDetach(SOCKET s) {
+  AcquireSRWLockExclusive(&lock);
+  replies.erase(s);
+  ReleaseSRWLockExclusive(&lock);
+}
+
+
+const BroadcastStats& GetBroadcastStats() {
+  return stats;
+}
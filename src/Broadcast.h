@@ -0,0 +1,44 @@
+
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <winsock2.h>
+
+// Sends the game's LAN broadcasts out of every adapter. With the game's sockets
+// bound to INADDR_ANY, a broadcast to 255.255.255.255 only leaves through the
+// adapter of the default route, so games on the networks of the other adapters
+// (e.g. the LAN while a VPN is up) are slow to show up in the list, or never do.
+// Each broadcast is also sent to the directed broadcast address of every other
+// adapter, taken from NetMonitor's adapter table.
+//
+// A host that is reachable through more than one adapter answers every copy, so
+// shortly after a broadcast, replies that repeat one just received are dropped.
+// Only datagrams from hosts the game doesn't send to yet count as replies, so a
+// game in progress is never affected. Repeats are matched by content and source
+// port but not address, since a host may answer from the address of each of its
+// adapters.
+
+struct BroadcastStats {
+  LONG broadcasts,  // Game broadcasts that were fanned out
+       copies,      // Copies sent to other adapters
+       duplicates;  // Repeated replies dropped
+};
+
+bool StartBroadcastFanOut();
+void StopBroadcastFanOut();
+bool IsBroadcastFanOutEnabled();
+
+// Sends copies of the datagram to the other adapters' networks if to is a
+// broadcast address. The caller still sends the original.
+void BroadcastFanOut(SOCKET s, const char *buf, int len, int flags,
+                     const sockaddr *to, int toLen);
+// True if the datagram repeats a reply to a fanned out broadcast that was just
+// received, and should be dropped
+bool IsDuplicateReply(SOCKET s, const char *buf, int len, const sockaddr *from,
+                      int fromLen);
+// Forgets the replies received on a socket that is being closed
+void BroadcastDetach(SOCKET s);
+
+const BroadcastStats& GetBroadcastStats();
+
+#endif
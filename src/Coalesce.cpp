@@ -0,0 +1,191 @@
+// Coalesces the game's small datagrams to each peer into fewer, larger ones
+
+#include <winsock2.h>
+#include "Coalesce.h"
+#include "Handshake.h"
+#include "Compress.h"
+#include "PeerTable.h"
+#include "RecvQueue.h"
+
+// Keep bundles under the smallest common path MTU, e.g. through VPNs
+static const int maxBundleSize = 1200;
+
+struct Bundle {
+  SRWLOCK     lock;
+  SOCKET      s;
+  sockaddr_in to;
+  int         peerId;
+  int         count,
+              len;
+  char        data[maxBundleSize];
+};
+
+static Bundle bundles[PeerTable::MaxPeers];
+static CoalesceStats stats = {};
+
+static HANDLE hFlushThread = nullptr,
+              hStopEvent   = nullptr;
+static DWORD  flushWindow  = 0;
+static volatile bool coalescing = false;
+
+static DWORD WINAPI FlushTask(LPVOID lpParam);
+static void Flush(Bundle &bundle);
+
+
+bool StartCoalescing(int windowMs) {
+  if (coalescing) {
+    return true;
+  }
+
+  for (auto &bundle : bundles) {
+    InitializeSRWLock(&bundle.lock);
+    bundle.count = 0;
+  }
+
+  flushWindow = windowMs > 0 ? windowMs : 1;
+  if (!(hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr))) {
+    return false;
+  }
+
+  DWORD threadId = NULL;
+  if (!(hFlushThread = CreateThread(nullptr, 0, FlushTask, nullptr, 0, &threadId))) {
+    CloseHandle(hStopEvent);
+    hStopEvent = nullptr;
+    return false;
+  }
+
+  return (coalescing = true);
+}
+
+
+void StopCoalescing() {
+  if (!coalescing) {
+    return;
+  }
+
+  coalescing = false;
+  SetEvent(hStopEvent);
+  WaitForSingleObject(hFlushThread, INFINITE);
+  CloseHandle(hFlushThread);
+  CloseHandle(hStopEvent);
+  hFlushThread = nullptr;
+  hStopEvent   = nullptr;
+
+  for (auto &bundle : bundles) {
+    AcquireSRWLockExclusive(&bundle.lock);
+    Flush(bundle);
+    ReleaseSRWLockExclusive(&bundle.lock);
+  }
+}
+
+
+bool IsCoalescing() {
+  return coalescing;
+}
+
+
+bool CoalesceSend(SOCKET s, const char *buf, int len, const sockaddr *to, int toLen,
+                  int peerId) {
+  if (!coalescing || peerId < 0 || !(GetPeerCapabilities(peerId) & capCoalesce)) {
+    return false;
+  }
+
+  Bundle &bundle = bundles[peerId];
+  int entryLen = sizeof(WORD) + len;
+
+  AcquireSRWLockExclusive(&bundle.lock);
+
+  // Keep the peer's datagrams in order if this one can't join the bundle
+  if (bundle.count > 0 &&
+      (bundle.s != s || bundle.len + entryLen > maxBundleSize)) {
+    Flush(bundle);
+  }
+  if (static_cast<int>(sizeof(ControlHeader)) + entryLen > maxBundleSize) {
+    ReleaseSRWLockExclusive(&bundle.lock);
+    return false;
+  }
+
+  if (bundle.count == 0) {
+    bundle.s      = s;
+    bundle.peerId = peerId;
+    bundle.len    = sizeof(ControlHeader);
+    memcpy(&bundle.to, to, sizeof(bundle.to));
+  }
+  WORD entrySize = static_cast<WORD>(len);
+  memcpy(&bundle.data[bundle.len], &entrySize, sizeof(entrySize));
+  memcpy(&bundle.data[bundle.len + sizeof(entrySize)], buf, len);
+  bundle.len += entryLen;
+  ++bundle.count;
+  InterlockedIncrement(&stats.datagramsIn);
+
+  ReleaseSRWLockExclusive(&bundle.lock);
+  return true;
+}
+
+
+void CoalesceUnbundle(SOCKET s, const char *buf, int len, const sockaddr *from,
+                      int fromLen) {
+  auto *header = reinterpret_cast<const ControlHeader*>(buf);
+  int pos = sizeof(ControlHeader);
+
+  for (int i = 0; i < header->value && pos + static_cast<int>(sizeof(WORD)) <= len;
+       ++i) {
+    WORD entrySize;
+    memcpy(&entrySize, &buf[pos], sizeof(entrySize));
+    pos += sizeof(entrySize);
+    if (pos + entrySize > len) {
+      break;
+    }
+
+    if (RecvQueuePush(s, &buf[pos], entrySize, from, fromLen)) {
+      InterlockedIncrement(&stats.unbundled);
+    }
+    pos += entrySize;
+  }
+}
+
+
+const CoalesceStats& GetCoalesceStats() {
+  return stats;
+}
+
+
+static DWORD WINAPI FlushTask(LPVOID lpParam) {
+  while (WaitForSingleObject(hStopEvent, flushWindow) == WAIT_TIMEOUT) {
+    for (auto &bundle : bundles) {
+      if (bundle.count > 0) {
+        AcquireSRWLockExclusive(&bundle.lock);
+        Flush(bundle);
+        ReleaseSRWLockExclusive(&bundle.lock);
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+// Must be called with the bundle's lock held
+static void Flush(Bundle &bundle) {
+  if (bundle.count == 0) {
+    return;
+  }
+
+  const sockaddr *to = reinterpret_cast<const sockaddr*>(&bundle.to);
+  if (bundle.count == 1) {
+    // Not worth the framing overhead
+    int pos = sizeof(ControlHeader) + sizeof(WORD);
+    CompressSend(bundle.s, &bundle.data[pos], bundle.len - pos, 0, to,
+                 sizeof(bundle.to), bundle.peerId);
+  }
+  else {
+    ControlHeader header = { controlMagic, ctlBundle, controlVersion,
+                             static_cast<WORD>(bundle.count) };
+    memcpy(bundle.data, &header, sizeof(header));
+    CompressSend(bundle.s, bundle.data, bundle.len, 0, to, sizeof(bundle.to),
+                 bundle.peerId);
+    InterlockedIncrement(&stats.bundlesOut);
+  }
+
+  bundle.count = 0;
+}
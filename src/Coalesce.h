@@ -0,0 +1,35 @@
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <winsock2.h>
+
+// Bundles the game's datagrams to the same peer within a short window into one
+// datagram, for peers that negotiated capCoalesce.
+//
+// A bundle is a ControlHeader of type ctlBundle whose value is the number of
+// datagrams, followed by each datagram as a little endian WORD length and data.
+
+struct CoalesceStats {
+  LONG datagramsIn,   // Game datagrams passed to CoalesceSend
+       bundlesOut,    // Bundled datagrams sent
+       unbundled;     // Game datagrams unpacked from received bundles
+};
+
+// Starts the thread that flushes bundles every windowMs
+bool StartCoalescing(int windowMs);
+// Flushes all bundles and stops the flush thread
+void StopCoalescing();
+bool IsCoalescing();
+
+// Buffers a datagram for the peer if it negotiated coalescing. Returns false if
+// the caller should send the datagram as is.
+bool CoalesceSend(SOCKET s, const char *buf, int len, const sockaddr *to, int toLen,
+                  int peerId);
+// Unpacks a received bundle into the socket's RecvQueue
+void CoalesceUnbundle(SOCKET s, const char *buf, int len, const sockaddr *from,
+                      int fromLen);
+
+const CoalesceStats& GetCoalesceStats();
+
+#endif
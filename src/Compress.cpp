@@ -0,0 +1,350 @@
+// Dictionary-primed LZ77 compression of datagrams between NetHelper peers
+
+#include <winsock2.h>
+#include "Compress.h"
+#include "Fnv.h"
+#include "Handshake.h"
+#include "PeerTable.h"
+#include "RecvQueue.h"
+#include "NetStats.h"
+#include "odprintf.h"
+
+static const int maxDictionarySize = 4096,
+                 maxPacketSize     = 1472,
+                 minMatch          = 4,
+                 hashBits          = 12;
+
+static char  dictionary[maxDictionarySize];
+static int   dictionarySize = 0;
+// Hash table of dictionary positions + 1, copied to prime each compression
+static WORD  dictionaryTable[1 << hashBits] = {};
+static int   minCompressSize = 64;
+static volatile bool compressing = false;
+
+static CompressPeerStats peerStats[PeerTable::MaxPeers] = {};
+
+static DWORD HashSequence(const char *p);
+static bool  EmitSequence(char *out, int outLen, int *outPos, const char *literals,
+                          int literalLen, int offset, int matchLen);
+static void  AddTicks(ULONGLONG *counter, const LARGE_INTEGER &start);
+static void  OnPeerEvicted(int peerId);
+
+
+DWORD StartCompression(int minSize, const char *dictionaryFile) {
+  minCompressSize = minSize > 0 ? minSize : 1;
+  dictionarySize  = 0;
+  memset(dictionaryTable, 0, sizeof(dictionaryTable));
+
+  DWORD dictionaryId = 0;
+  if (dictionaryFile && dictionaryFile[0]) {
+    HANDLE hFile = CreateFileA(dictionaryFile, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    DWORD bytesRead = 0;
+    if (hFile == INVALID_HANDLE_VALUE ||
+        !ReadFile(hFile, dictionary, sizeof(dictionary), &bytesRead, nullptr)) {
+      odprintf("NetHelper: Could not read compression dictionary %s", dictionaryFile);
+    }
+    if (hFile != INVALID_HANDLE_VALUE) {
+      CloseHandle(hFile);
+    }
+    dictionarySize = bytesRead;
+
+    // Identify the dictionary by its FNV-1a hash, so peers can tell if they match
+    if (dictionarySize) {
+      dictionaryId = Fnv1a32(fnvBasis32, dictionary, dictionarySize);
+    }
+
+    for (int i = 0; i + minMatch <= dictionarySize; ++i) {
+      dictionaryTable[HashSequence(&dictionary[i])] = static_cast<WORD>(i + 1);
+    }
+  }
+
+  PeerTable::AddEvictCallback(OnPeerEvicted);
+  compressing = true;
+  return dictionaryId;
+}
+
+
+void StopCompression() {
+  compressing = false;
+
+  for (int i = 0; i < PeerTable::MaxPeers; ++i) {
+    const CompressPeerStats &stats = peerStats[i];
+    if (stats.packetsCompressed || stats.packetsDecompressed) {
+      odprintf("NetHelper: Peer %d compressed %llu of %llu packets to %llu%% size",
+               i, stats.packetsCompressed, stats.packetsCompressed + stats.packetsRaw,
+               stats.rawBytes ? stats.compressedBytes * 100 / stats.rawBytes : 100);
+    }
+  }
+}
+
+
+bool IsCompressing() {
+  return compressing;
+}
+
+
+int CompressSend(SOCKET s, const char *buf, int len, int flags, const sockaddr *to,
+                 int toLen, int peerId) {
+  if (!compressing || flags != 0 || peerId < 0 || len > maxPacketSize ||
+      !(GetPeerCapabilities(peerId) & capCompress)) {
+    return sendto(s, buf, len, flags, to, toLen);
+  }
+
+  CompressPeerStats &stats = peerStats[peerId];
+  if (len < minCompressSize) {
+    InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(&stats.packetsRaw));
+    return sendto(s, buf, len, flags, to, toLen);
+  }
+
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
+
+  // Only worth it if the result is smaller, header included
+  char packet[sizeof(ControlHeader) + maxPacketSize];
+  int compressedLen = LzCompress(buf, len, &packet[sizeof(ControlHeader)],
+                                 len - static_cast<int>(sizeof(ControlHeader)) - 1);
+  AddTicks(&stats.compressTicks, start);
+
+  if (compressedLen <= 0) {
+    InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(&stats.packetsRaw));
+    return sendto(s, buf, len, flags, to, toLen);
+  }
+
+  ControlHeader header = { controlMagic, ctlCompressed, controlVersion,
+                           static_cast<WORD>(len) };
+  memcpy(packet, &header, sizeof(header));
+  int packetLen = sizeof(header) + compressedLen;
+  int result = sendto(s, packet, packetLen, 0, to, toLen);
+  if (result == SOCKET_ERROR) {
+    return result;
+  }
+
+  InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(&stats.packetsCompressed));
+  InterlockedExchangeAdd64(reinterpret_cast<volatile LONG64*>(&stats.rawBytes), len);
+  InterlockedExchangeAdd64(reinterpret_cast<volatile LONG64*>(&stats.compressedBytes),
+                           packetLen);
+  NetStatsOnCompress(peerId, len, packetLen);
+
+  // The game expects to have sent what it asked for
+  return len;
+}
+
+
+void DecompressReceived(SOCKET s, const char *buf, int len, const sockaddr *from,
+                        int fromLen, int peerId) {
+  auto *header = reinterpret_cast<const ControlHeader*>(buf);
+  if (!compressing || header->value > maxPacketSize) {
+    return;
+  }
+
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
+
+  char packet[maxPacketSize];
+  int packetLen = LzDecompress(&buf[sizeof(ControlHeader)],
+                               len - static_cast<int>(sizeof(ControlHeader)), packet,
+                               header->value);
+  if (peerId >= 0) {
+    CompressPeerStats &stats = peerStats[peerId];
+    AddTicks(&stats.decompressTicks, start);
+    InterlockedIncrement64(
+      reinterpret_cast<volatile LONG64*>(&stats.packetsDecompressed));
+  }
+  if (packetLen <= 0) {
+    return;
+  }
+
+  // A bundle may be compressed as a whole, but compressed data is never nested
+  if (IsControlPacket(packet, packetLen)) {
+    if (reinterpret_cast<ControlHeader*>(packet)->type != ctlCompressed) {
+      HandleControlPacket(s, packet, packetLen, from, fromLen, peerId);
+    }
+  }
+  else {
+    RecvQueuePush(s, packet, packetLen, from, fromLen);
+  }
+}
+
+
+bool GetCompressPeerStats(int peerId, CompressPeerStats *out) {
+  if (peerId < 0 || peerId >= PeerTable::MaxPeers || !out) {
+    return false;
+  }
+  *out = peerStats[peerId];
+  return true;
+}
+
+
+int LzCompress(const char *in, int inLen, char *out, int outLen) {
+  if (inLen < 0 || inLen > maxPacketSize || outLen <= 0) {
+    return 0;
+  }
+
+  // Compress the datagram as if it came right after the dictionary
+  char window[maxDictionarySize + maxPacketSize];
+  WORD table[1 << hashBits];
+  memcpy(window, dictionary, dictionarySize);
+  memcpy(&window[dictionarySize], in, inLen);
+  memcpy(table, dictionaryTable, sizeof(table));
+
+  int pos    = dictionarySize,
+      anchor = pos,
+      end    = dictionarySize + inLen,
+      outPos = 0;
+  while (pos + minMatch <= end) {
+    DWORD hash = HashSequence(&window[pos]);
+    int candidate = static_cast<int>(table[hash]) - 1;
+    table[hash] = static_cast<WORD>(pos + 1);
+
+    if (candidate < 0 || pos - candidate > 0xFFFF ||
+        memcmp(&window[candidate], &window[pos], minMatch) != 0) {
+      ++pos;
+      continue;
+    }
+
+    int matchLen = minMatch;
+    while (pos + matchLen < end && window[candidate + matchLen] == window[pos + matchLen]) {
+      ++matchLen;
+    }
+    if (!EmitSequence(out, outLen, &outPos, &window[anchor], pos - anchor,
+                      pos - candidate, matchLen)) {
+      return 0;
+    }
+    pos   += matchLen;
+    anchor = pos;
+  }
+
+  return EmitSequence(out, outLen, &outPos, &window[anchor], end - anchor, 0, 0) ?
+         outPos : 0;
+}
+
+
+int LzDecompress(const char *in, int inLen, char *out, int outLen) {
+  if (outLen <= 0 || outLen > maxPacketSize) {
+    return 0;
+  }
+
+  char window[maxDictionarySize + maxPacketSize];
+  memcpy(window, dictionary, dictionarySize);
+
+  const BYTE *src = reinterpret_cast<const BYTE*>(in);
+  int inPos  = 0,
+      pos    = dictionarySize,
+      end    = dictionarySize + outLen;
+  while (inPos < inLen) {
+    BYTE token = src[inPos++];
+
+    int literalLen = token >> 4;
+    if (literalLen == 15) {
+      BYTE extra;
+      do {
+        if (inPos >= inLen) {
+          return 0;
+        }
+        literalLen += (extra = src[inPos++]);
+      } while (extra == 255);
+    }
+    if (inPos + literalLen > inLen || pos + literalLen > end) {
+      return 0;
+    }
+    memcpy(&window[pos], &src[inPos], literalLen);
+    inPos += literalLen;
+    pos   += literalLen;
+
+    if (inPos >= inLen) {
+      break;  // Last sequence
+    }
+
+    if (inPos + 2 > inLen) {
+      return 0;
+    }
+    int offset = src[inPos] | (src[inPos + 1] << 8);
+    inPos += 2;
+
+    int matchLen = (token & 15) + minMatch;
+    if ((token & 15) == 15) {
+      BYTE extra;
+      do {
+        if (inPos >= inLen) {
+          return 0;
+        }
+        matchLen += (extra = src[inPos++]);
+      } while (extra == 255);
+    }
+    if (offset == 0 || offset > pos || pos + matchLen > end) {
+      return 0;
+    }
+
+    // Byte by byte, since the match may overlap what it is copying
+    for (int i = 0; i < matchLen; ++i, ++pos) {
+      window[pos] = window[pos - offset];
+    }
+  }
+
+  if (pos != end) {
+    return 0;
+  }
+  memcpy(out, &window[dictionarySize], outLen);
+  return outLen;
+}
+
+
+static DWORD HashSequence(const char *p) {
+  DWORD sequence;
+  memcpy(&sequence, p, sizeof(sequence));
+  return (sequence * 2654435761u) >> (32 - hashBits);
+}
+
+
+static bool EmitSequence(char *out, int outLen, int *outPos, const char *literals,
+                         int literalLen, int offset, int matchLen) {
+  int pos = *outPos;
+
+  // Worst case size: token, length bytes, literals, offset, length bytes
+  if (pos + 1 + literalLen / 255 + 1 + literalLen + 2 + matchLen / 255 + 1 > outLen) {
+    return false;
+  }
+
+  int matchCode = matchLen ? matchLen - minMatch : 0;
+  out[pos++] = static_cast<char>(((literalLen < 15 ? literalLen : 15) << 4) |
+                                 (matchCode < 15 ? matchCode : 15));
+
+  if (literalLen >= 15) {
+    int extra = literalLen - 15;
+    for (; extra >= 255; extra -= 255) {
+      out[pos++] = static_cast<char>(255);
+    }
+    out[pos++] = static_cast<char>(extra);
+  }
+  memcpy(&out[pos], literals, literalLen);
+  pos += literalLen;
+
+  if (matchLen) {
+    out[pos++] = static_cast<char>(offset & 0xFF);
+    out[pos++] = static_cast<char>(offset >> 8);
+    if (matchCode >= 15) {
+      int extra = matchCode - 15;
+      for (; extra >= 255; extra -= 255) {
+        out[pos++] = static_cast<char>(255);
+      }
+      out[pos++] = static_cast<char>(extra);
+    }
+  }
+
+  *outPos = pos;
+  return true;
+}
+
+
+static void OnPeerEvicted(int peerId) {
+  memset(&peerStats[peerId], 0, sizeof(peerStats[peerId]));
+}
+
+
+static void AddTicks(ULONGLONG *counter, const LARGE_INTEGER &start) {
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  InterlockedExchangeAdd64(reinterpret_cast<volatile LONG64*>(counter),
+                           now.QuadPart - start.QuadPart);
+}
@@ -0,0 +1,47 @@
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <winsock2.h>
+
+// Compresses datagrams to peers that negotiated capCompress with the same
+// dictionary. Small or incompressible datagrams are sent as is.
+//
+// A compressed datagram is a ControlHeader of type ctlCompressed whose value is
+// the uncompressed length, followed by LZ77 sequences: a token byte whose high
+// and low nibbles are the literal length and the match length minus 4 (15 means
+// more length bytes follow, each added until one is less than 255), the
+// literals, then a little endian WORD match offset and the extra match length
+// bytes. The last sequence only has literals. Matches may reach back into the
+// dictionary, which is treated as coming right before the datagram.
+
+struct CompressPeerStats {
+  ULONGLONG rawBytes,           // Sent before compression
+            compressedBytes,    // Sent after compression, including headers
+            packetsCompressed,
+            packetsRaw,         // Too small or incompressible
+            packetsDecompressed,
+            compressTicks,      // QueryPerformanceCounter ticks spent compressing
+            decompressTicks;
+};
+
+// Loads the dictionary (optional) and enables compression of datagrams of at
+// least minSize bytes. Returns the dictionary ID to announce, or 0 for none.
+DWORD StartCompression(int minSize, const char *dictionaryFile);
+void  StopCompression();
+bool  IsCompressing();
+
+// Sends the datagram, compressed if the peer supports it and it helps
+int CompressSend(SOCKET s, const char *buf, int len, int flags, const sockaddr *to,
+                 int toLen, int peerId);
+// Decompresses a received ctlCompressed datagram into the socket's RecvQueue
+void DecompressReceived(SOCKET s, const char *buf, int len, const sockaddr *from,
+                        int fromLen, int peerId);
+
+bool GetCompressPeerStats(int peerId, CompressPeerStats *out);
+
+// The codec itself. Return the output length, or 0 if it doesn't fit in outLen.
+int LzCompress(const char *in, int inLen, char *out, int outLen);
+int LzDecompress(const char *in, int inLen, char *out, int outLen);
+
+#endif
@@ -0,0 +1,252 @@
+// Reads the mod's settings once into immutable snapshots, and reloads them when
+// Outpost2.ini changes
+
+#include <windows.h>
+#include <map>
+#include <vector>
+#include "Config.h"
+#include "odprintf.h"
+
+static const char iniFile[] = ".\\Outpost2.ini";
+
+static std::shared_ptr<const Config> currentConfig;
+static std::string sectionName;
+
+static HANDLE hChangeEvent = nullptr,
+              hStopEvent   = nullptr,
+              hWatchThread = nullptr;
+
+static std::shared_ptr<Config> ReadConfig(const std::string &section);
+static DWORD WINAPI ConfigWatchProc(LPVOID lpParam);
+
+
+std::shared_ptr<const Config> LoadConfig(const char *iniSectionName) {
+  sectionName = iniSectionName;
+  std::shared_ptr<const Config> config = ReadConfig(sectionName);
+  std::atomic_store(&currentConfig, config);
+  return config;
+}
+
+
+std::shared_ptr<const Config> GetConfig() {
+  std::shared_ptr<const Config> config = std::atomic_load(&currentConfig);
+  if (!config) {
+    // Not loaded yet; everything is at its default
+    config = ReadConfig(std::string());
+  }
+  return config;
+}
+
+
+bool StartConfigWatch() {
+  if (hWatchThread) {
+    return true;
+  }
+
+  if ((!hChangeEvent && !(hChangeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr))) ||
+      (!hStopEvent   && !(hStopEvent   = CreateEvent(nullptr, TRUE, FALSE, nullptr)))) {
+    return false;
+  }
+  ResetEvent(hStopEvent);
+
+  hWatchThread = CreateThread(nullptr, 0, ConfigWatchProc, nullptr, 0, nullptr);
+  return hWatchThread != nullptr;
+}
+
+
+void StopConfigWatch() {
+  if (hWatchThread) {
+    SetEvent(hStopEvent);
+    WaitForSingleObject(hWatchThread, INFINITE);
+    CloseHandle(hWatchThread);
+    hWatchThread = nullptr;
+  }
+}
+
+
+HANDLE GetConfigChangeEvent() {
+  return hChangeEvent;
+}
+
+
+static DWORD WINAPI ConfigWatchProc(LPVOID lpParam) {
+  HANDLE hNotify = FindFirstChangeNotificationA(".", FALSE,
+                                                FILE_NOTIFY_CHANGE_LAST_WRITE);
+  if (hNotify == INVALID_HANDLE_VALUE) {
+    odprintf("NetHelper: Could not watch %s for changes", iniFile);
+    return 1;
+  }
+
+  HANDLE events[] = { hStopEvent, hNotify };
+  while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+    FindNextChangeNotification(hNotify);
+
+    // Editors often save in several writes; let them finish
+    if (WaitForSingleObject(hStopEvent, 250) == WAIT_OBJECT_0) {
+      break;
+    }
+
+    // Anything in the game directory may have changed, so check the section did
+    std::shared_ptr<const Config> config = ReadConfig(sectionName);
+    if (config->source != GetConfig()->source) {
+      std::atomic_store(&currentConfig, config);
+      odprintf("NetHelper: Reloaded settings from %s", iniFile);
+      SetEvent(hChangeEvent);
+    }
+  }
+
+  FindCloseChangeNotification(hNotify);
+  return 0;
+}
+
+
+// Gets an integer setting, clamped to its valid range
+static int GetInt(const std::map<std::string, std::string> &values, const char *key,
+                  int defaultValue, int minValue, int maxValue) {
+  auto it = values.find(key);
+  if (it == values.end() || it->second.empty()) {
+    return defaultValue;
+  }
+
+  long value = strtol(it->second.c_str(), nullptr, 10);
+  if (value < minValue || value > maxValue) {
+    odprintf("NetHelper: %s = %ld is out of range (%d to %d)", key, value, minValue,
+             maxValue);
+    value = (value < minValue) ? minValue : maxValue;
+  }
+  return static_cast<int>(value);
+}
+
+
+static bool GetBool(const std::map<std::string, std::string> &values, const char *key,
+                    bool defaultValue) {
+  auto it = values.find(key);
+  return (it == values.end() || it->second.empty()) ? defaultValue :
+                                                      atoi(it->second.c_str()) != 0;
+}
+
+
+static std::string GetString(const std::map<std::string, std::string> &values,
+                             const char *key) {
+  auto it = values.find(key);
+  return (it != values.end()) ? it->second : std::string();
+}
+
+
+// Gets a comma-separated list setting, skipping empty entries
+static std::vector<std::string> GetList(const std::map<std::string, std::string> &values,
+                                        const char *key) {
+  std::vector<std::string> result;
+  std::string list = GetString(values, key);
+  for (size_t start = 0; start < list.size(); ) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string item = list.substr(start, end - start);
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t") + 1);
+    if (!item.empty()) {
+      result.push_back(item);
+    }
+    start = end + 1;
+  }
+  return result;
+}
+
+
+static std::shared_ptr<Config> ReadConfig(const std::string &section) {
+  // One read of the whole section, rather than one per setting
+  std::vector<char> buffer(4096);
+  DWORD len = 0;
+  if (!section.empty()) {
+    while ((len = GetPrivateProfileSectionA(section.c_str(), buffer.data(),
+                                            static_cast<DWORD>(buffer.size()),
+                                            iniFile)) ==
+             buffer.size() - 2 && buffer.size() < 0x100000) {
+      buffer.resize(buffer.size() * 2);
+    }
+  }
+
+  // "key=value\0key=value\0\0"; keys are case insensitive
+  std::map<std::string, std::string> values;
+  const char *end = buffer.data() + len;
+  for (const char *p = buffer.data(); p < end && *p; p += strlen(p) + 1) {
+    const char *equals = strchr(p, '=');
+    if (!equals) {
+      continue;
+    }
+
+    std::string key(p, equals),
+                value(equals + 1);
+    auto trim = [](std::string &s) {
+      s.erase(0, s.find_first_not_of(" \t"));
+      s.erase(s.find_last_not_of(" \t") + 1);
+      if (s.size() >= 2 && s.front() == '"' && s.back() == '"') {
+        s = s.substr(1, s.size() - 2);
+      }
+    };
+    trim(key);
+    trim(value);
+    for (auto &c : key) {
+      c = static_cast<char>(tolower(static_cast<BYTE>(c)));
+    }
+    values[key] = value;
+  }
+
+  auto config = std::make_shared<Config>();
+  config->source.assign(buffer.data(), len);
+
+  config->forwardMode        = GetInt(values, "forwardmode", 1, 0, 3);
+  config->allowPmpReset      = GetBool(values, "allowpmpreset", false);
+  config->leaseSec           = GetInt(values, "leasesec", 24*60*60, 0, 604800);
+  config->startPort          = GetInt(values, "startport", 47776, 1, 65535);
+  config->endPort            = GetInt(values, "endport", 47807, 1, 65535);
+  config->forwardAllGateways = GetBool(values, "forwardallgateways", false);
+  config->lanCoordination    = GetBool(values, "lancoordination", false);
+  if (config->startPort > config->endPort) {
+    odprintf("NetHelper: StartPort %d is after EndPort %d, using the default port range",
+             config->startPort, config->endPort);
+    config->startPort = 47776;
+    config->endPort   = 47807;
+  }
+
+  // Comma-separated lists of "host" or "host:port"
+  config->stunServers  = GetList(values, "stunservers");
+  config->stunCacheSec = GetInt(values, "stuncachesec", 300, 30, 86400);
+  config->relayServers = GetList(values, "relayservers");
+
+  config->bindAll = GetBool(values, "bindall", true);
+
+  SocketPolicy &policy  = config->socketPolicy;
+  policy.recvBufSize    = GetInt(values, "recvbufsize", 0, 0, 0x4000000);
+  policy.sendBufSize    = GetInt(values, "sendbufsize", 0, 0, 0x4000000);
+  policy.dscp           = GetInt(values, "dscp", -1, -1, 63);
+  policy.noUdpConnReset = GetBool(values, "noudpconnreset", false);
+  policy.tcpNoDelay     = GetBool(values, "tcpnodelay", false);
+  policy.nonBlocking    = GetBool(values, "nonblocking", false);
+
+  config->recvEngine       = GetBool(values, "recvengine", false);
+  config->recvEnginePosted = GetInt(values, "recvengineposted", 8, 1, 32);
+
+  config->captureFile    = GetString(values, "capturefile");
+  config->captureSizeMB  = GetInt(values, "capturesizemb", 16, 1, 1024);
+  config->captureSnapLen = GetInt(values, "capturesnaplen", 1500, 64, 65535);
+
+  config->peerStats = GetBool(values, "peerstats", false);
+
+  config->coalesce         = GetBool(values, "coalesce", false);
+  config->coalesceWindowMs = GetInt(values, "coalescewindowms", 5, 1, 100);
+
+  config->compress           = GetBool(values, "compress", false);
+  config->compressDictionary = GetString(values, "compressdictionary");
+  config->compressMinSize    = GetInt(values, "compressminsize", 64, 0, 1500);
+
+  config->hostAdvisor = GetBool(values, "hostadvisor", false);
+
+  config->broadcastFanOut = GetBool(values, "broadcastfanout", false);
+
+  config->patchManifest = GetString(values, "patchmanifest");
+
+  return config;
+}
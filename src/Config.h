@@ -0,0 +1,64 @@
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <winsock2.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "SocketPolicy.h"
+
+// Settings from the mod's section of Outpost2.ini, read once and validated.
+// Snapshots are immutable; a reload publishes a new one, and anyone still holding
+// the old one keeps a consistent view of it.
+struct Config {
+  // Port forwarding
+  int  forwardMode;         // 0 = off, 1 = NAT-PMP/PCP or UPnP, 2 = UPnP, 3 = NAT-PMP/PCP
+  bool allowPmpReset;
+  int  leaseSec;            // 0 = static mapping, at most 604800 (UPnP maximum)
+  int  startPort,
+       endPort;             // startPort <= endPort
+  bool forwardAllGateways;
+  bool lanCoordination;
+
+  // External address discovery
+  std::vector<std::string> stunServers;
+  int                      stunCacheSec;
+
+  // Hosting through a relay when port forwarding doesn't work
+  std::vector<std::string> relayServers;
+
+  // Sockets and transport
+  bool         bindAll;
+  SocketPolicy socketPolicy;
+  bool         recvEngine;
+  int          recvEnginePosted;
+  std::string  captureFile;
+  int          captureSizeMB;
+  int          captureSnapLen;
+  bool         peerStats;
+  bool         coalesce;
+  int          coalesceWindowMs;
+  bool         compress;
+  std::string  compressDictionary;
+  int          compressMinSize;
+  bool         hostAdvisor;
+  bool         broadcastFanOut;
+
+  std::string patchManifest;
+
+  std::string source;  // Raw section text, for detecting changes
+};
+
+// Reads the given section of Outpost2.ini and publishes it as the current snapshot
+std::shared_ptr<const Config> LoadConfig(const char *iniSectionName);
+// Gets the current snapshot. Safe to call from any thread.
+std::shared_ptr<const Config> GetConfig();
+
+// Watches Outpost2.ini, publishing a new snapshot when the section changes
+bool StartConfigWatch();
+void StopConfigWatch();
+// Event that is signaled when the watcher publishes a new snapshot
+HANDLE GetConfigChangeEvent();
+
+#endif
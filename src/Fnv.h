@@ -0,0 +1,26 @@
+
+#ifndef FNV_H
+#define FNV_H
+
+#include <windows.h>
+
+// FNV-1a, for telling apart data that nobody is trying to collide on purpose.
+// Start from the basis, and pass the result back in to hash more data.
+const DWORD     fnvBasis32 = 2166136261;
+const ULONGLONG fnvBasis64 = 14695981039346656037ULL;
+
+inline DWORD Fnv1a32(DWORD hash, const void *data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ static_cast<const BYTE*>(data)[i]) * 16777619;
+  }
+  return hash;
+}
+
+inline ULONGLONG Fnv1a64(ULONGLONG hash, const void *data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ static_cast<const BYTE*>(data)[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+#endif
@@ -0,0 +1,382 @@
+// Negotiates optional wire features with peers that also run NetHelper
+
+#include <winsock2.h>
+#include <mstcpip.h>
+#include "Handshake.h"
+#include "Coalesce.h"
+#include "Compress.h"
+#include "HostAdvisor.h"
+#include "PeerTable.h"
+#include "odprintf.h"
+
+enum HandshakeState {
+  stateNone = 0,
+  stateHelloSent,
+  stateDone
+};
+
+static const int   maxHellos     = 3;
+static const DWORD helloInterval = 1000;
+static const int   maxAnswered   = 16;
+static const DWORD answeredMs    = 30000;  // How long a confirmation is waited for
+
+static WORD  localCapabilities = 0;
+static DWORD localDictionaryId = 0;
+
+// Our own socket on the handshake port, and the thread answering it
+static SOCKET   controlSocket  = INVALID_SOCKET;
+static WSAEVENT hReadEvent     = WSA_INVALID_EVENT;
+static HANDLE   hStopEvent     = nullptr,
+                hControlThread = nullptr;
+static bool     wsaStarted     = false;
+
+// Indexed by PeerTable ID
+static volatile LONG state[PeerTable::MaxPeers]            = {},
+                     hellosSent[PeerTable::MaxPeers]       = {},
+                     peerCapabilities[PeerTable::MaxPeers] = {},
+                     peerDictionaryId[PeerTable::MaxPeers] = {},
+                     helloNonce[PeerTable::MaxPeers]       = {};
+static DWORD  lastHello[PeerTable::MaxPeers]  = {};
+static SOCKET gameSocket[PeerTable::MaxPeers] = {};  // Socket the game reached it on
+
+// Hellos answered out of band. The sender's ctlHelloConfirm is the only control
+// message taken from a game address that isn't in the PeerTable yet.
+static struct {
+  ULONG address;
+  DWORD nonce,
+        time;
+} answered[maxAnswered] = {};
+static int     nextAnswered = 0;
+static SRWLOCK answeredLock = SRWLOCK_INIT;
+
+static bool StartControl();
+static void StopControl();
+static DWORD WINAPI ControlTask(LPVOID lpParam);
+static void HandleOutOfBand(const char *buf, int len, const sockaddr_in &from);
+static bool TakeAnswered(const sockaddr *from, int fromLen, DWORD nonce);
+static void SetPeerCapabilities(int peerId, WORD capabilities, DWORD dictionaryId);
+static DWORD NewNonce(int peerId);
+static void SendHello(SOCKET s, ControlType type, WORD value, DWORD nonce,
+                      const sockaddr *to, int toLen);
+static void OnPeerEvicted(int peerId);
+
+
+void SetLocalCapabilities(WORD capabilities, DWORD dictionaryId) {
+  localDictionaryId = dictionaryId;
+  if (capabilities) {
+    PeerTable::AddEvictCallback(OnPeerEvicted);
+    if (!hControlThread && !StartControl()) {
+      odprintf("NetHelper: Couldn't open a handshake socket (error %d)",
+               WSAGetLastError());
+      capabilities = 0;
+    }
+  }
+  else {
+    StopControl();
+  }
+  localCapabilities = capabilities;
+}
+
+
+bool IsHandshakeEnabled() {
+  return localCapabilities != 0;
+}
+
+
+WORD GetPeerCapabilities(int peerId) {
+  if (peerId < 0 || peerId >= PeerTable::MaxPeers || state[peerId] != stateDone) {
+    return 0;
+  }
+
+  WORD result = static_cast<WORD>(peerCapabilities[peerId]) & localCapabilities;
+  if (static_cast<DWORD>(peerDictionaryId[peerId]) != localDictionaryId) {
+    // Compressed packets can't be decoded with a different dictionary
+    result &= ~capCompress;
+  }
+  return result;
+}
+
+
+void HandshakeOnSend(SOCKET s, const sockaddr *to, int toLen, int peerId) {
+  if (!localCapabilities || peerId < 0 || state[peerId] == stateDone ||
+      hellosSent[peerId] >= maxHellos) {
+    return;
+  }
+
+  // Peers without NetHelper never answer, so only retry a few times. Racing
+  // threads may send an extra hello, which is harmless.
+  DWORD now = GetTickCount();
+  if (state[peerId] == stateNone || now - lastHello[peerId] >= helloInterval) {
+    lastHello[peerId] = now;
+    if (InterlockedCompareExchange(&state[peerId], stateHelloSent, stateNone) ==
+          stateNone) {
+      gameSocket[peerId] = s;
+      InterlockedExchange(&helloNonce[peerId], static_cast<LONG>(NewNonce(peerId)));
+    }
+    if (InterlockedIncrement(&hellosSent[peerId]) <= maxHellos) {
+      // Never to the game's port; the peer may not run NetHelper
+      sockaddr_in handshake = *reinterpret_cast<const sockaddr_in*>(to);
+      handshake.sin_port = htons(handshakePort);
+      SendHello(controlSocket, ctlHello, localCapabilities, helloNonce[peerId],
+                reinterpret_cast<const sockaddr*>(&handshake), sizeof(handshake));
+    }
+  }
+}
+
+
+bool IsControlPacket(const char *buf, int len) {
+  return len >= static_cast<int>(sizeof(ControlHeader)) &&
+         reinterpret_cast<const ControlHeader*>(buf)->magic == controlMagic;
+}
+
+
+void HandleControlPacket(SOCKET s, const char *buf, int len, const sockaddr *from,
+                         int fromLen, int peerId) {
+  auto *header  = reinterpret_cast<const ControlHeader*>(buf);
+  auto *payload = reinterpret_cast<const HelloPayload*>(header + 1);
+  bool hasPayload = len >= static_cast<int>(sizeof(ControlHeader) +
+                                            sizeof(HelloPayload));
+  if (header->version != controlVersion) {
+    return;
+  }
+
+  if (header->type == ctlHelloConfirm) {
+    // The peer's game address, tied to a hello we answered out of band
+    if (hasPayload && TakeAnswered(from, fromLen, payload->nonce) &&
+        (peerId >= 0 || (peerId = PeerTable::GetPeerId(from, fromLen)) >= 0)) {
+      SetPeerCapabilities(peerId, header->value, payload->dictionaryId);
+    }
+    return;
+  }
+  if (peerId < 0) {
+    return;
+  }
+
+  switch (header->type) {
+  case ctlHello:
+    // Said in-band by older versions, which proves the peer runs NetHelper. Answer
+    // even if we said hello already, in case ours was lost.
+    SendHello(s, ctlHelloAck, localCapabilities, 0, from, fromLen);
+    // Fall through
+  case ctlHelloAck:
+    SetPeerCapabilities(peerId, header->value,
+      len >= static_cast<int>(sizeof(ControlHeader) + sizeof(DWORD)) ?
+        payload->dictionaryId : 0);
+    break;
+
+  case ctlBundle:
+    CoalesceUnbundle(s, buf, len, from, fromLen);
+    break;
+
+  case ctlCompressed:
+    DecompressReceived(s, buf, len, from, fromLen, peerId);
+    break;
+
+  case ctlProbe:
+  case ctlProbeReply:
+  case ctlProbeReport:
+    HostAdvisorOnControl(s, buf, len, from, fromLen, peerId);
+    break;
+  }
+}
+
+
+// Opens the handshake port. Another instance on this computer may hold it; hellos
+// can still be sent then, and answers come back to whichever port we got.
+static bool StartControl() {
+  WSADATA wsaData;
+  if (!(wsaStarted = (WSAStartup(MAKEWORD(2, 2), &wsaData) == NO_ERROR))) {
+    return false;
+  }
+
+  if ((controlSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) != INVALID_SOCKET) {
+    // Peers without NetHelper answer hellos with ICMP port unreachable
+    BOOL  connReset = FALSE;
+    DWORD bytes = 0;
+    WSAIoctl(controlSocket, SIO_UDP_CONNRESET, &connReset, sizeof(connReset), nullptr,
+             0, &bytes, nullptr, nullptr);
+
+    sockaddr_in local = {};
+    local.sin_family      = AF_INET;
+    local.sin_port        = htons(handshakePort);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (bind(controlSocket, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+      local.sin_port = 0;
+      bind(controlSocket, reinterpret_cast<sockaddr*>(&local), sizeof(local));
+    }
+  }
+
+  DWORD threadId = NULL;
+  if (controlSocket == INVALID_SOCKET ||
+      (hReadEvent = WSACreateEvent()) == WSA_INVALID_EVENT ||
+      WSAEventSelect(controlSocket, hReadEvent, FD_READ) != 0 ||
+      !(hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr)) ||
+      !(hControlThread = CreateThread(nullptr, 0, ControlTask, nullptr, 0,
+                                      &threadId))) {
+    StopControl();
+    return false;
+  }
+  return true;
+}
+
+
+static void StopControl() {
+  if (hControlThread) {
+    SetEvent(hStopEvent);
+    WaitForSingleObject(hControlThread, INFINITE);
+    CloseHandle(hControlThread);
+    hControlThread = nullptr;
+  }
+  if (hStopEvent) {
+    CloseHandle(hStopEvent);
+    hStopEvent = nullptr;
+  }
+  if (controlSocket != INVALID_SOCKET) {
+    closesocket(controlSocket);
+    controlSocket = INVALID_SOCKET;
+  }
+  if (hReadEvent != WSA_INVALID_EVENT) {
+    WSACloseEvent(hReadEvent);
+    hReadEvent = WSA_INVALID_EVENT;
+  }
+  if (wsaStarted) {
+    WSACleanup();
+    wsaStarted = false;
+  }
+}
+
+
+static DWORD WINAPI ControlTask(LPVOID lpParam) {
+  HANDLE events[] = { hStopEvent, hReadEvent };
+  while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+    WSAResetEvent(hReadEvent);
+
+    // The socket is non-blocking since WSAEventSelect, so drain it
+    char buf[64];
+    sockaddr_in from;
+    for (;;) {
+      int fromLen = sizeof(from);
+      int len = recvfrom(controlSocket, buf, sizeof(buf), 0,
+                         reinterpret_cast<sockaddr*>(&from), &fromLen);
+      if (len >= 0) {
+        HandleOutOfBand(buf, len, from);
+      }
+      else if (WSAGetLastError() != WSAEMSGSIZE) {
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+static void HandleOutOfBand(const char *buf, int len, const sockaddr_in &from) {
+  auto *header  = reinterpret_cast<const ControlHeader*>(buf);
+  auto *payload = reinterpret_cast<const HelloPayload*>(header + 1);
+  if (len < static_cast<int>(sizeof(ControlHeader) + sizeof(HelloPayload)) ||
+      header->magic != controlMagic || header->version != controlVersion ||
+      !localCapabilities) {
+    return;
+  }
+
+  if (header->type == ctlHello) {
+    // Answer to where the hello came from, and expect the sender to confirm from
+    // its game socket
+    SendHello(controlSocket, ctlHelloAck, localCapabilities, payload->nonce,
+              reinterpret_cast<const sockaddr*>(&from), sizeof(from));
+
+    AcquireSRWLockExclusive(&answeredLock);
+    answered[nextAnswered].address = from.sin_addr.s_addr;
+    answered[nextAnswered].nonce   = payload->nonce;
+    answered[nextAnswered].time    = GetTickCount();
+    nextAnswered = (nextAnswered + 1) % maxAnswered;
+    ReleaseSRWLockExclusive(&answeredLock);
+  }
+  else if (header->type == ctlHelloAck) {
+    for (int peerId = 0; peerId < PeerTable::MaxPeers; ++peerId) {
+      sockaddr_in peer;
+      if (state[peerId] == stateHelloSent &&
+          static_cast<DWORD>(helloNonce[peerId]) == payload->nonce &&
+          PeerTable::GetPeerAddress(peerId, &peer) &&
+          peer.sin_addr.s_addr == from.sin_addr.s_addr) {
+        SetPeerCapabilities(peerId, header->value, payload->dictionaryId);
+        // The peer runs NetHelper, so its game port may now hear from us
+        SendHello(gameSocket[peerId], ctlHelloConfirm, localCapabilities,
+                  payload->nonce, reinterpret_cast<const sockaddr*>(&peer),
+                  sizeof(peer));
+        break;
+      }
+    }
+  }
+}
+
+
+// Checks that a confirmation matches a hello we answered, which it uses up
+static bool TakeAnswered(const sockaddr *from, int fromLen, DWORD nonce) {
+  if (!from || fromLen < static_cast<int>(sizeof(sockaddr_in)) ||
+      from->sa_family != AF_INET) {
+    return false;
+  }
+
+  ULONG address = reinterpret_cast<const sockaddr_in*>(from)->sin_addr.s_addr;
+  DWORD now = GetTickCount();
+  bool  found = false;
+  AcquireSRWLockExclusive(&answeredLock);
+  for (auto &entry : answered) {
+    if (entry.nonce == nonce && entry.address == address &&
+        now - entry.time < answeredMs) {
+      entry = {};
+      found = true;
+      break;
+    }
+  }
+  ReleaseSRWLockExclusive(&answeredLock);
+  return found;
+}
+
+
+static void SetPeerCapabilities(int peerId, WORD capabilities, DWORD dictionaryId) {
+  InterlockedExchange(&peerDictionaryId[peerId], static_cast<LONG>(dictionaryId));
+  InterlockedExchange(&peerCapabilities[peerId], capabilities);
+  if (InterlockedExchange(&state[peerId], stateDone) != stateDone) {
+    odprintf("NetHelper: Peer %d supports features 0x%04X, using 0x%04X", peerId,
+             capabilities, GetPeerCapabilities(peerId));
+  }
+}
+
+
+// Only has to tell our hellos apart from stale or unrelated ones, never 0
+static DWORD NewNonce(int peerId) {
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  DWORD nonce = (GetCurrentProcessId() << 16) ^ counter.LowPart ^
+                (static_cast<DWORD>(peerId) * 0x9E3779B9);
+  return nonce ? nonce : 1;
+}
+
+
+// The next peer to get the ID has to say hello again
+static void OnPeerEvicted(int peerId) {
+  InterlockedExchange(&state[peerId], stateNone);
+  InterlockedExchange(&hellosSent[peerId], 0);
+  InterlockedExchange(&peerCapabilities[peerId], 0);
+  InterlockedExchange(&peerDictionaryId[peerId], 0);
+  InterlockedExchange(&helloNonce[peerId], 0);
+  lastHello[peerId]  = 0;
+  gameSocket[peerId] = 0;
+}
+
+
+static void SendHello(SOCKET s, ControlType type, WORD value, DWORD nonce,
+                      const sockaddr *to, int toLen) {
+  #pragma pack(push, 1)
+  struct {
+    ControlHeader header;
+    HelloPayload  payload;
+  } hello = { { controlMagic, static_cast<BYTE>(type), controlVersion, value },
+              { localDictionaryId, nonce } };
+  #pragma pack(pop)
+
+  sendto(s, reinterpret_cast<const char*>(&hello), sizeof(hello), 0, to, toLen);
+}
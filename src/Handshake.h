@@ -0,0 +1,70 @@
+
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <winsock2.h>
+
+// NetHelper-to-NetHelper control messages, sent alongside the game's own packets.
+// Each starts with a ControlHeader. Features that change what goes on the wire
+// are only used with peers that announced support for them, so players without
+// NetHelper are unaffected.
+//
+// Hellos go out of band, from a socket of our own to the peer's handshakePort,
+// where a computer without NetHelper just drops them. The answer echoes the
+// hello's nonce, and only then is the peer's game port sent anything: a
+// ctlHelloConfirm with the same nonce, so the peer can tie the game address to the
+// hello it answered.
+
+const DWORD   controlMagic   = 0x31484E4E;  // "NNH1"
+const BYTE    controlVersion = 1;
+const u_short handshakePort  = 47775;  // UDP, just below the game's default range
+
+enum ControlType {
+  ctlHello = 1,   // value = sender's capabilities; followed by a HelloPayload
+  ctlHelloAck,    // value = sender's capabilities; followed by a HelloPayload
+  ctlBundle,      // value = number of datagrams; see Coalesce.h
+  ctlCompressed,  // value = uncompressed length; see Compress.h
+  ctlProbe,       // value = sequence; see HostAdvisor.h
+  ctlProbeReply,  // value = echoed sequence
+  ctlProbeReport, // value = number of entries
+  ctlHelloConfirm // value = sender's capabilities; followed by a HelloPayload
+};
+
+enum PeerCapability {
+  capCoalesce = 1 << 0,
+  capCompress = 1 << 1,  // Only used if both peers have the same dictionary
+  capProbe    = 1 << 2
+};
+
+#pragma pack(push, 1)
+struct ControlHeader {
+  DWORD magic;
+  BYTE  type;
+  BYTE  version;
+  WORD  value;
+};
+
+struct HelloPayload {
+  DWORD dictionaryId;  // Compression dictionary ID, or 0 for none
+  DWORD nonce;         // Picked by the hello's sender, and echoed back
+};
+#pragma pack(pop)
+
+// Sets the capabilities this instance announces, opening the handshake port on
+// first use. 0 disables the handshake and closes the port.
+void SetLocalCapabilities(WORD capabilities, DWORD dictionaryId = 0);
+bool IsHandshakeEnabled();
+
+// Gets the capabilities both this instance and the peer support, 0 until known
+WORD GetPeerCapabilities(int peerId);
+
+// Called before the game sends to a peer; says hello out of band if it hasn't yet
+void HandshakeOnSend(SOCKET s, const sockaddr *to, int toLen, int peerId);
+
+bool IsControlPacket(const char *buf, int len);
+// Handles a control message received on a game socket. peerId is -1 for senders
+// not in the PeerTable, which are only heard if they confirm a hello we answered.
+void HandleControlPacket(SOCKET s, const char *buf, int len, const sockaddr *from,
+                         int fromLen, int peerId);
+
+#endif
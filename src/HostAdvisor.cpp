@@ -0,0 +1,487 @@
+// Measures RTT between NetHelper players and advises which of them should host
+
+#include <winsock2.h>
+#include <map>
+#include <set>
+#include <vector>
+#include "HostAdvisor.h"
+#include "Handshake.h"
+#include "NetStats.h"
+#include "PeerTable.h"
+#include "PerfCounter.h"
+#include "odprintf.h"
+
+namespace {
+
+#pragma pack(push, 1)
+// Follows a ControlHeader of type ctlProbe or ctlProbeReply
+struct ProbePayload {
+  DWORD    nodeId;       // Sender's node ID
+  LONGLONG sendCounter;  // Prober's QueryPerformanceCounter, echoed back as is
+};
+
+// A ctlProbeReport is a ControlHeader whose value is the number of entries, then
+// the reporter's node ID, then the entries
+struct ReportEntry {
+  DWORD nodeId;
+  DWORD address;       // As seen by the reporter, network order
+  WORD  port;          // Network order
+  WORD  lossPermille;
+  DWORD rttUs;
+  DWORD jitterUs;
+};
+#pragma pack(pop)
+
+struct PeerProbe {
+  DWORD nodeId;        // 0 until the peer answers
+  DWORD rttUs,         // Smoothed
+        jitterUs;      // Smoothed RTT variation
+  DWORD sent,          // Probes sent in the current report period
+        answered;
+  WORD  lossPermille;  // Over the last report period
+  DWORD lastAnswer;    // GetTickCount
+  bool  reported;      // Listed in another player's report; probe without capProbe
+};
+
+struct RttRow {
+  std::map<DWORD, DWORD> rttUs;  // By node ID
+  DWORD received;                // GetTickCount
+};
+
+} // anonymous namespace
+
+static const int   probesPerBurst   = 3;
+static const int   burstsPerReport  = 5;
+static const DWORD probeInterval    = 1000,
+                   staleMs          = 30000;
+static const int   maxReportEntries = 60;  // Keeps a report within one datagram
+static const size_t maxRows          = PeerTable::MaxPeers;
+
+static SRWLOCK lock = SRWLOCK_INIT;
+static PeerProbe peers[PeerTable::MaxPeers] = {};
+static std::map<DWORD, RttRow> rows;  // Other players' rows, by node ID
+static HostAdvice advice = {};
+static bool haveAdvice = false;
+
+static DWORD nodeId = 0;
+static volatile SOCKET gameSocket = INVALID_SOCKET;
+
+static HANDLE hStopEvent   = nullptr,
+              hProbeThread = nullptr;
+static volatile bool enabled = false;
+
+static DWORD WINAPI ProbeThreadProc(LPVOID lpParam);
+static void SendProbe(SOCKET s, ControlType type, WORD sequence,
+                      const ProbePayload &payload, const sockaddr *to, int toLen);
+static void SendReports(SOCKET s);
+static void UpdateAdvice();
+static void OnPeerEvicted(int peerId);
+
+
+bool StartHostAdvisor() {
+  if (hProbeThread) {
+    return true;
+  }
+
+  if (!hStopEvent && !(hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr))) {
+    return false;
+  }
+  ResetEvent(hStopEvent);
+
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  nodeId = (GetCurrentProcessId() << 16) ^ now.LowPart;
+  nodeId += (nodeId == 0);
+
+  PeerTable::AddEvictCallback(OnPeerEvicted);
+  enabled = true;
+  hProbeThread = CreateThread(nullptr, 0, ProbeThreadProc, nullptr, 0, nullptr);
+  if (!hProbeThread) {
+    enabled = false;
+    return false;
+  }
+  return true;
+}
+
+
+void StopHostAdvisor() {
+  enabled = false;
+  if (hProbeThread) {
+    SetEvent(hStopEvent);
+    WaitForSingleObject(hProbeThread, INFINITE);
+    CloseHandle(hProbeThread);
+    hProbeThread = nullptr;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  memset(peers, 0, sizeof(peers));
+  rows.clear();
+  haveAdvice = false;
+  ReleaseSRWLockExclusive(&lock);
+  gameSocket = INVALID_SOCKET;
+}
+
+
+bool IsHostAdvisorEnabled() {
+  return enabled;
+}
+
+
+void HostAdvisorOnSend(SOCKET s) {
+  gameSocket = s;
+}
+
+
+void HostAdvisorOnControl(SOCKET s, const char *buf, int len, const sockaddr *from,
+                          int fromLen, int peerId) {
+  auto *header = reinterpret_cast<const ControlHeader*>(buf);
+  if (!enabled || peerId < 0) {
+    return;
+  }
+
+  if (header->type == ctlProbe || header->type == ctlProbeReply) {
+    if (len < static_cast<int>(sizeof(ControlHeader) + sizeof(ProbePayload))) {
+      return;
+    }
+    auto *probe = reinterpret_cast<const ProbePayload*>(header + 1);
+
+    if (header->type == ctlProbe) {
+      // Echo the prober's timestamp; only its own clock is used
+      ProbePayload reply = { nodeId, probe->sendCounter };
+      SendProbe(s, ctlProbeReply, header->value, reply, from, fromLen);
+
+      AcquireSRWLockExclusive(&lock);
+      peers[peerId].nodeId = probe->nodeId;
+      ReleaseSRWLockExclusive(&lock);
+      return;
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    LONGLONG elapsed = CounterToMicroseconds(now.QuadPart - probe->sendCounter);
+    if (elapsed < 0 || elapsed > staleMs * 1000) {
+      return;
+    }
+    DWORD rttUs = static_cast<DWORD>(elapsed);
+
+    AcquireSRWLockExclusive(&lock);
+    PeerProbe &peer = peers[peerId];
+    if (peer.rttUs == 0) {
+      peer.rttUs = rttUs;
+    }
+    else {
+      // Same smoothing as TCP's SRTT and RTTVAR
+      DWORD deviation = (rttUs > peer.rttUs) ? rttUs - peer.rttUs : peer.rttUs - rttUs;
+      peer.jitterUs = peer.jitterUs - peer.jitterUs / 4 + deviation / 4;
+      peer.rttUs    = peer.rttUs - peer.rttUs / 8 + rttUs / 8;
+    }
+    peer.nodeId     = probe->nodeId;
+    peer.lastAnswer = GetTickCount();
+    ++peer.answered;
+    ReleaseSRWLockExclusive(&lock);
+  }
+  else if (header->type == ctlProbeReport) {
+    // Only from players that negotiated probing, so anyone else can't fill the
+    // matrix or make us probe addresses of their choosing
+    if (!(GetPeerCapabilities(peerId) & capProbe)) {
+      return;
+    }
+
+    int count = header->value;
+    if (len < static_cast<int>(sizeof(ControlHeader) + sizeof(DWORD) +
+                               count * sizeof(ReportEntry))) {
+      return;
+    }
+    count = (count < maxReportEntries) ? count : maxReportEntries;
+    DWORD reporter = *reinterpret_cast<const DWORD*>(header + 1);
+    auto *entries = reinterpret_cast<const ReportEntry*>(
+      reinterpret_cast<const BYTE*>(header + 1) + sizeof(DWORD));
+
+    RttRow row;
+    row.received = GetTickCount();
+    for (int i = 0; i < count; ++i) {
+      row.rttUs[entries[i].nodeId] = entries[i].rttUs;
+    }
+
+    std::vector<sockaddr_in> unknown;
+    AcquireSRWLockExclusive(&lock);
+    // Each peer has one row, so a peer that changes its node ID replaces it
+    DWORD oldReporter = peers[peerId].nodeId;
+    if (oldReporter != 0 && oldReporter != reporter) {
+      rows.erase(oldReporter);
+    }
+    if (rows.count(reporter) == 0 && rows.size() >= maxRows) {
+      auto oldest = rows.begin();
+      for (auto it = rows.begin(); it != rows.end(); ++it) {
+        if (row.received - it->second.received >
+            row.received - oldest->second.received) {
+          oldest = it;
+        }
+      }
+      rows.erase(oldest);
+    }
+    rows[reporter] = row;
+    peers[peerId].nodeId = reporter;
+
+    // Probe players we don't talk to directly, e.g. the host's other clients
+    for (int i = 0; i < count; ++i) {
+      bool known = (entries[i].nodeId == nodeId) || !entries[i].address;
+      for (int id = 0; !known && id < PeerTable::MaxPeers; ++id) {
+        known = (peers[id].nodeId == entries[i].nodeId);
+      }
+      if (!known) {
+        sockaddr_in address = {};
+        address.sin_family      = AF_INET;
+        address.sin_addr.s_addr = entries[i].address;
+        address.sin_port        = entries[i].port;
+        unknown.push_back(address);
+      }
+    }
+    ReleaseSRWLockExclusive(&lock);
+
+    // Reported players only get IDs while half the table is free, so the players
+    // the game talks to always have room. Not with the lock held, since adding
+    // may evict a peer, which calls back into OnPeerEvicted.
+    for (auto &address : unknown) {
+      auto *to = reinterpret_cast<const sockaddr*>(&address);
+      int id = PeerTable::FindPeerId(to, sizeof(address));
+      if (id < 0 && PeerTable::GetPeerCount() < PeerTable::MaxPeers / 2) {
+        id = PeerTable::GetPeerId(to, sizeof(address));
+      }
+      if (id >= 0) {
+        AcquireSRWLockExclusive(&lock);
+        peers[id].reported = true;
+        ReleaseSRWLockExclusive(&lock);
+      }
+    }
+  }
+}
+
+
+static void OnPeerEvicted(int peerId) {
+  AcquireSRWLockExclusive(&lock);
+  peers[peerId] = PeerProbe();
+  ReleaseSRWLockExclusive(&lock);
+}
+
+
+bool GetHostAdvice(HostAdvice *out) {
+  AcquireSRWLockShared(&lock);
+  bool result = haveAdvice;
+  if (result) {
+    *out = advice;
+  }
+  ReleaseSRWLockShared(&lock);
+  return result;
+}
+
+
+static DWORD WINAPI ProbeThreadProc(LPVOID lpParam) {
+  WORD sequence = 0;
+  for (int burst = 1; WaitForSingleObject(hStopEvent, probeInterval) == WAIT_TIMEOUT;
+       ++burst) {
+    SOCKET s = gameSocket;
+    if (s == INVALID_SOCKET) {
+      continue;
+    }
+
+    for (int id = 0; id < PeerTable::MaxPeers; ++id) {
+      sockaddr_in to;
+      if (!(GetPeerCapabilities(id) & capProbe) && !peers[id].reported) {
+        continue;
+      }
+      if (!PeerTable::GetPeerAddress(id, &to)) {
+        continue;
+      }
+
+      for (int i = 0; i < probesPerBurst; ++i) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        ProbePayload probe = { nodeId, now.QuadPart };
+        SendProbe(s, ctlProbe, ++sequence, probe, reinterpret_cast<sockaddr*>(&to),
+                  sizeof(to));
+      }
+
+      AcquireSRWLockExclusive(&lock);
+      peers[id].sent += probesPerBurst;
+      ReleaseSRWLockExclusive(&lock);
+    }
+
+    if (burst % burstsPerReport == 0) {
+      SendReports(s);
+      UpdateAdvice();
+    }
+  }
+
+  return 0;
+}
+
+
+static void SendProbe(SOCKET s, ControlType type, WORD sequence,
+                      const ProbePayload &payload, const sockaddr *to, int toLen) {
+  #pragma pack(push, 1)
+  struct {
+    ControlHeader header;
+    ProbePayload  payload;
+  } probe = { { controlMagic, static_cast<BYTE>(type), controlVersion, sequence },
+              payload };
+  #pragma pack(pop)
+
+  sendto(s, reinterpret_cast<const char*>(&probe), sizeof(probe), 0, to, toLen);
+}
+
+
+// Sends this player's row of the RTT matrix to every peer being probed, and
+// starts a new loss measurement period
+static void SendReports(SOCKET s) {
+  char packet[sizeof(ControlHeader) + sizeof(DWORD) +
+              maxReportEntries * sizeof(ReportEntry)];
+  auto *header  = reinterpret_cast<ControlHeader*>(packet);
+  auto *entries = reinterpret_cast<ReportEntry*>(packet + sizeof(ControlHeader) +
+                                                 sizeof(DWORD));
+  *reinterpret_cast<DWORD*>(header + 1) = nodeId;
+
+  std::vector<sockaddr_in> targets;
+  int count = 0;
+  DWORD now = GetTickCount();
+
+  AcquireSRWLockExclusive(&lock);
+  for (int id = 0; id < PeerTable::MaxPeers; ++id) {
+    PeerProbe &peer = peers[id];
+    if (peer.sent != 0) {
+      DWORD answered = (peer.answered < peer.sent) ? peer.answered : peer.sent;
+      peer.lossPermille = static_cast<WORD>(1000 * (peer.sent - answered) / peer.sent);
+      peer.sent     = 0;
+      peer.answered = 0;
+    }
+
+    sockaddr_in address;
+    if (!PeerTable::GetPeerAddress(id, &address)) {
+      continue;
+    }
+    if (peer.nodeId != 0 && now - peer.lastAnswer < staleMs &&
+        count < maxReportEntries) {
+      ReportEntry &entry = entries[count++];
+      entry.nodeId       = peer.nodeId;
+      entry.address      = address.sin_addr.s_addr;
+      entry.port         = address.sin_port;
+      entry.lossPermille = peer.lossPermille;
+      entry.rttUs        = peer.rttUs;
+      entry.jitterUs     = peer.jitterUs;
+    }
+    if ((GetPeerCapabilities(id) & capProbe) || peer.reported) {
+      targets.push_back(address);
+    }
+  }
+  ReleaseSRWLockExclusive(&lock);
+
+  header->magic   = controlMagic;
+  header->type    = ctlProbeReport;
+  header->version = controlVersion;
+  header->value   = static_cast<WORD>(count);
+  int len = static_cast<int>(sizeof(ControlHeader) + sizeof(DWORD) +
+                             count * sizeof(ReportEntry));
+  for (auto &to : targets) {
+    sendto(s, packet, len, 0, reinterpret_cast<sockaddr*>(&to), sizeof(to));
+  }
+}
+
+
+// Picks the player whose slowest link to any other player is the fastest. Only
+// players with a measured RTT to every other player are considered.
+static void UpdateAdvice() {
+  DWORD now = GetTickCount();
+  std::map<DWORD, std::map<DWORD, DWORD>> matrix;
+  std::map<DWORD, int> peerIds;
+  std::set<DWORD> nodes = { nodeId };
+
+  AcquireSRWLockExclusive(&lock);
+  for (int id = 0; id < PeerTable::MaxPeers; ++id) {
+    const PeerProbe &peer = peers[id];
+    if (peer.nodeId != 0 && now - peer.lastAnswer < staleMs) {
+      matrix[nodeId][peer.nodeId] = peer.rttUs;
+      peerIds[peer.nodeId] = id;
+    }
+  }
+  for (auto it = rows.begin(); it != rows.end(); ) {
+    if (now - it->second.received >= staleMs) {
+      it = rows.erase(it);
+      continue;
+    }
+    matrix[it->first] = it->second.rttUs;
+    ++it;
+  }
+
+  for (auto &row : matrix) {
+    nodes.insert(row.first);
+    for (auto &entry : row.second) {
+      nodes.insert(entry.first);
+    }
+  }
+
+  // Either direction's measurement will do
+  auto getRtt = [&matrix](DWORD a, DWORD b, DWORD *out) {
+    for (int i = 0; i < 2; ++i, std::swap(a, b)) {
+      auto row = matrix.find(a);
+      if (row != matrix.end()) {
+        auto entry = row->second.find(b);
+        if (entry != row->second.end()) {
+          *out = entry->second;
+          return true;
+        }
+      }
+    }
+    return false;
+  };
+
+  bool found = false;
+  DWORD bestNode = 0,
+        bestRtt  = 0;
+  for (DWORD host : nodes) {
+    DWORD worst = 0,
+          rtt;
+    bool complete = true;
+    for (DWORD other : nodes) {
+      if (other != host) {
+        if (!(complete = getRtt(host, other, &rtt))) {
+          break;
+        }
+        worst = (rtt > worst) ? rtt : worst;
+      }
+    }
+
+    // Ties go to the lowest node ID, so every player gives the same advice
+    if (complete && (!found || worst < bestRtt ||
+                     (worst == bestRtt && host < bestNode))) {
+      found    = true;
+      bestNode = host;
+      bestRtt  = worst;
+    }
+  }
+
+  HostAdvice next = {};
+  if (found && nodes.size() > 1) {
+    auto it = peerIds.find(bestNode);
+    next.peerId   = (bestNode == nodeId)   ? -1 :
+                    (it != peerIds.end()) ? it->second : -2;
+    next.maxRttUs = bestRtt;
+    next.players  = static_cast<int>(nodes.size());
+  }
+  bool changed = (found && nodes.size() > 1) != haveAdvice ||
+                 next.peerId != advice.peerId;
+  haveAdvice = found && nodes.size() > 1;
+  advice     = next;
+  ReleaseSRWLockExclusive(&lock);
+
+  if (haveAdvice) {
+    NetStatsSetHostAdvice(next.peerId, next.maxRttUs);
+    if (changed && next.peerId == -1) {
+      odprintf("NetHelper: Advised host is this computer, slowest RTT %u us among %d "
+               "players", next.maxRttUs, next.players);
+    }
+    else if (changed) {
+      odprintf("NetHelper: Advised host is peer %d, slowest RTT %u us among %d players",
+               next.peerId, next.maxRttUs, next.players);
+    }
+  }
+}
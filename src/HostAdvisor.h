@@ -0,0 +1,38 @@
+
+#ifndef HOSTADVISOR_H
+#define HOSTADVISOR_H
+
+#include <winsock2.h>
+
+// Measures round trip times between every pair of NetHelper players in a lobby,
+// and advises which of them should host so that the slowest link to the host is
+// as fast as possible.
+//
+// Each player sends a burst of ctlProbe messages to each peer that negotiated
+// capProbe every second, through the game's own (forwarded) socket; the peer
+// echoes them back as ctlProbeReply. Every few seconds each player sends its row
+// of the RTT matrix to its peers as a ctlProbeReport, which also lists the
+// peers' addresses, so players that only talk to the host can probe each other.
+
+struct HostAdvice {
+  int   peerId;    // PeerTable ID of the advised host, -1 for this computer, or -2
+                   // for a player this computer doesn't talk to directly
+  DWORD maxRttUs;  // Slowest RTT between the advised host and any other player
+  int   players;   // Number of players measured, including this one
+};
+
+// Starts the probe thread. Probes are only sent to peers with capProbe.
+bool StartHostAdvisor();
+void StopHostAdvisor();
+bool IsHostAdvisorEnabled();
+
+// Called from the transport's sendto hook, to learn the game's socket
+void HostAdvisorOnSend(SOCKET s);
+// Handles ctlProbe, ctlProbeReply, and ctlProbeReport messages
+void HostAdvisorOnControl(SOCKET s, const char *buf, int len, const sockaddr *from,
+                          int fromLen, int peerId);
+
+// Gets the current advice. Returns false until every pair of players is measured.
+bool GetHostAdvice(HostAdvice *out);
+
+#endif
@@ -0,0 +1,178 @@
+// Scans IGD device descriptions for the fields port forwarding uses, in place
+
+#include <string.h>
+#include <algorithm>
+#include "IgdScan.h"
+
+#include "../miniupnp/miniupnpc/miniupnpc.h"
+
+static bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+// Returns the position after what in [from, end), or end if it isn't there
+static const char* SkipPast(const char *from, const char *end, const char *what) {
+  size_t len = strlen(what);
+  const char *found = std::search(from, end, what, what + len);
+  return (found == end) ? end : found + len;
+}
+
+
+bool XmlText::Is(const char *text) const {
+  return strlen(text) == static_cast<size_t>(len) && memcmp(begin, text, len) == 0;
+}
+
+
+bool XmlText::StartsWith(const char *text) const {
+  size_t textLen = strlen(text);
+  return textLen <= static_cast<size_t>(len) && memcmp(begin, text, textLen) == 0;
+}
+
+
+XmlScanner::Event XmlScanner::Next(XmlText *name, XmlText *text) {
+  if (emptyElement) {
+    emptyElement = false;
+    *name = emptyName;
+    *text = { pos, 0 };
+    return elementEnd;
+  }
+
+  while (pos < end) {
+    const char *open = static_cast<const char*>(memchr(pos, '<', end - pos));
+    if (!open || open + 1 == end) {
+      break;
+    }
+    const char *textEnd = open;
+    pos = open + 1;
+
+    if (*pos == '?' || *pos == '!') {
+      if (end - pos >= 3 && memcmp(pos, "!--", 3) == 0) {
+        pos = SkipPast(pos + 3, end, "-->");
+      }
+      else if (end - pos >= 8 && memcmp(pos, "![CDATA[", 8) == 0) {
+        pos = SkipPast(pos + 8, end, "]]>");
+      }
+      else {
+        pos = SkipPast(pos, end, ">");
+      }
+      continue;
+    }
+
+    bool closing = (*pos == '/');
+    if (closing) {
+      ++pos;
+    }
+    const char *nameBegin = pos;
+    while (pos < end && !IsSpace(*pos) && *pos != '>' && *pos != '/') {
+      ++pos;
+    }
+    const char *nameEnd = pos;
+    pos = std::find(pos, end, '>');
+    if (pos == end) {
+      break;
+    }
+    bool empty = !closing && pos[-1] == '/';
+    ++pos;
+
+    const char *colon = static_cast<const char*>(memchr(nameBegin, ':',
+                                                        nameEnd - nameBegin));
+    if (colon) {
+      nameBegin = colon + 1;
+    }
+    *name = { nameBegin, static_cast<int>(nameEnd - nameBegin) };
+
+    if (closing) {
+      // Only an element without children has text
+      const char *first = textBegin ? textBegin : textEnd,
+                 *last  = textEnd;
+      while (first < last && IsSpace(*first)) {
+        ++first;
+      }
+      while (last > first && IsSpace(last[-1])) {
+        --last;
+      }
+      *text = { first, static_cast<int>(last - first) };
+      textBegin = nullptr;
+      return elementEnd;
+    }
+
+    *text = { pos, 0 };
+    textBegin = empty ? nullptr : pos;
+    if (empty) {
+      emptyElement = true;
+      emptyName    = *name;
+    }
+    return elementStart;
+  }
+
+  pos = end;
+  return documentEnd;
+}
+
+
+// Copies the text into a field of IGDdatas, cut to fit as miniupnpc does
+static void CopyField(char *field, const XmlText &text) {
+  int len = std::min(text.len, MINIUPNPC_URL_MAXSIZE - 1);
+  memcpy(field, text.begin, len);
+  field[len] = '\0';
+}
+
+
+bool ScanIgdDescription(const char *xml, int len, IGDdatas *data) {
+  memset(data, 0, sizeof(*data));
+  XmlScanner scanner(xml, len);
+  XmlText name, text;
+  XmlScanner::Event event;
+  while ((event = scanner.Next(&name, &text)) != XmlScanner::documentEnd) {
+    if (event == XmlScanner::elementStart) {
+      ++data->level;
+      if (name.Is("service")) {
+        memset(&data->tmp, 0, sizeof(data->tmp));
+      }
+      continue;
+    }
+
+    --data->level;
+    if (name.Is("URLBase")) {
+      CopyField(data->urlbase, text);
+    }
+    else if (name.Is("presentationURL")) {
+      CopyField(data->presentationurl, text);
+    }
+    else if (name.Is("serviceType")) {
+      CopyField(data->tmp.servicetype, text);
+    }
+    else if (name.Is("controlURL")) {
+      CopyField(data->tmp.controlurl, text);
+    }
+    else if (name.Is("eventSubURL")) {
+      CopyField(data->tmp.eventsuburl, text);
+    }
+    else if (name.Is("SCPDURL")) {
+      CopyField(data->tmp.scpdurl, text);
+    }
+    else if (name.Is("service")) {
+      // Any version of each service
+      XmlText type = { data->tmp.servicetype,
+                       static_cast<int>(strlen(data->tmp.servicetype)) };
+      if (type.StartsWith("urn:schemas-upnp-org:service:WANCommonInterfaceConfig:")) {
+        data->CIF = data->tmp;
+      }
+      else if (type.StartsWith(
+                 "urn:schemas-upnp-org:service:WANIPv6FirewallControl:")) {
+        data->IPv6FC = data->tmp;
+      }
+      else if (type.StartsWith("urn:schemas-upnp-org:service:WANIPConnection:") ||
+               type.StartsWith("urn:schemas-upnp-org:service:WANPPPConnection:")) {
+        if (!data->first.servicetype[0]) {
+          data->first = data->tmp;
+        }
+        else {
+          data->second = data->tmp;
+        }
+      }
+    }
+  }
+  return data->first.servicetype[0] != '\0';
+}
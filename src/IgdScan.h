@@ -0,0 +1,51 @@
+
+#ifndef IGDSCAN_H
+#define IGDSCAN_H
+
+// Reads what port forwarding uses from an IGD's device description: the URL base,
+// and the type and URLs of each WAN service. miniupnpc parses every description
+// into a tree of name/value strings; this scans the tags in the buffer miniwget
+// downloaded instead, without allocating, and copies out only those fields.
+
+struct IGDdatas;
+
+// A run of characters in the buffer being scanned, not null terminated
+struct XmlText {
+  const char *begin;
+  int         len;
+
+  bool Is(const char *text) const;
+  bool StartsWith(const char *text) const;
+};
+
+// Walks the tags of an XML document in place. Declarations, comments and CDATA are
+// skipped, and namespace prefixes dropped from names.
+class XmlScanner {
+public:
+  enum Event {
+    elementStart,
+    elementEnd,
+    documentEnd  // Also for a document cut short
+  };
+
+  XmlScanner(const char *xml, int len)
+    : pos(xml), end(xml + len), textBegin(nullptr), emptyElement(false) { }
+
+  // Gets the next start or end tag. At an end tag, text is the element's text with
+  // the surrounding whitespace trimmed, or empty if it had child elements.
+  Event Next(XmlText *name, XmlText *text);
+
+private:
+  const char *pos,
+             *end,
+             *textBegin;    // After the last start tag, if no tag followed it yet
+  XmlText     emptyName;    // Of an element like <a/>, which ends right away
+  bool        emptyElement;
+};
+
+// Fills in data from a description as miniupnpc's parserootdesc does, for
+// GetUPNPUrls. Returns false if it has no WANIPConnection or WANPPPConnection
+// service.
+bool ScanIgdDescription(const char *xml, int len, IGDdatas *data);
+
+#endif
@@ -1,11 +1,29 @@
-
-
 // Adds UPnP port forwarding and makes the TCP layer bind to all adapters.
 
 #include <windows.h>
+#include <stdlib.h>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include "Patcher.h"
 #include "NetPatches.h"
+#include "PatchManifest.h"
 #include "PortForward.h"
+#include "NetMonitor.h"
+#include "SocketPolicy.h"
+#include "PacketCapture.h"
+#include "NetStats.h"
+#include "Handshake.h"
+#include "Coalesce.h"
+#include "Compress.h"
+#include "RecvEngine.h"
+#include "Config.h"
+#include "PortCoordinator.h"
+#include "Stun.h"
+#include "HostAdvisor.h"
+#include "Relay.h"
+#include "Broadcast.h"
+#include "odprintf.h"
 
 
 DWORD WINAPI PortForwardTask(LPVOID lpParam);
@@ -17,114 +35,786 @@ enum fwdMode {
   pmpOnly
 };
 
+// Port forwarding state for one gateway
+struct Gateway {
+  NetMonitor::Adapter adapter;
+  bool    primary;  // Gateway of the adapter with the best route to the internet
+  fwdMode mode;
+  bool    doPmpReset;
+  int     leaseSec;
+  int     portOffset;  // External port offset claimed from other LAN hosts
+  std::vector<int> pmpPorts;  // Left mapped through NAT-PMP/PCP after the rest of
+                              // the range fell back to UPnP
+  bool    handshakeMapped;    // NetHelper's handshake port, see Handshake.h
+  char    internalIp[INET6_ADDRSTRLEN],
+          externalIp[INET6_ADDRSTRLEN];
+  DWORD   result;
+  DWORD   elapsedMs;      // Time the last forwarding took, including discovery
+  int     requestWindow;  // Requests the gateway took at once by then
+};
+
+static bool  WantBindPatches(bool bindAll);
+static void  StartForwarding(const Config &config);
+static DWORD SyncGateways(const std::vector<DWORD> &changedInterfaces);
+static DWORD ApplyConfig(const Config &config);
+static void  RunGatewayTasks(const std::vector<Gateway*> &which, bool unforward,
+                             const std::vector<int> *ports = nullptr);
+static void  LogSessionStats();
+static DWORD ForwardPorts(Gateway &gateway, const std::vector<int> &ports);
+static DWORD UnforwardPorts(Gateway &gateway, const std::vector<int> &ports,
+                            bool wholeRange);
+static void  UpdateRelay(DWORD forwardResult);
+
 fwdMode mode = noForward;
 
-bool doPmpReset = false;
+bool doPmpReset = false,
+     forwardAll = false,
+     coordinate = false;
 int leaseSec  = 0,
     startPort = 47776,
     endPort   = 47807;
 
-HANDLE hFwdThread = nullptr;
-bool shuttingDown = false;
+std::vector<std::unique_ptr<Gateway>> gateways;
+
+HANDLE hFwdThread = nullptr,
+       hShutdownEvent = nullptr;
+bool forwarding   = false,  // Forwarding was started; mode can change at runtime
+     shuttingDown = false;
 
 
 extern "C" __declspec(dllexport) void InitMod(char* iniSectionName) {
-  mode = (fwdMode)GetPrivateProfileInt(iniSectionName, "ForwardMode", 1,
-                                       ".\\Outpost2.ini");
+  // Also after DestroyMod, if the game loads the mod again
+  shuttingDown = false;
+
+  // Retry jitter differs between instances that share a gateway
+  srand(GetTickCount() ^ GetCurrentProcessId());
 
-  if (GetPrivateProfileInt(iniSectionName, "BindAll", 1, ".\\Outpost2.ini")) {
-    SetBindPatches(true);
+  // Lets patches verify their module without taking the loader lock
+  Patcher::StartModuleTracking();
+
+  // Read Outpost2.ini once; everything below uses this snapshot
+  auto config = LoadConfig(iniSectionName);
+
+  // Patches for other game builds, used in place of the built-in ones
+  if (!config->patchManifest.empty()) {
+    LoadPatchManifest(config->patchManifest.c_str());
   }
 
-  if (mode != noForward) {
-    doPmpReset = GetPrivateProfileInt(iniSectionName, "AllowPMPReset", 0,
-                                      ".\\Outpost2.ini") != 0;
-    leaseSec   = GetPrivateProfileInt(iniSectionName, "LeaseSec", 24*60*60,
-                                      ".\\Outpost2.ini");
-    startPort  = GetPrivateProfileInt(iniSectionName, "StartPort", 47776,
-                                      ".\\Outpost2.ini");
-    endPort    = GetPrivateProfileInt(iniSectionName, "EndPort", 47807,
-                                      ".\\Outpost2.ini");
+  mode = static_cast<fwdMode>(config->forwardMode);
+  bool bindAll = config->bindAll;
+
+  // Overlapped receives on the game's UDP sockets, attached as they are bound
+  if (config->recvEngine) {
+    StartRecvEngine(config->recvEnginePosted);
+  }
+
+  // Relayed addresses for the game's sockets, used while it can't be reached
+  // directly. The sockets are attached as they are bound.
+  if (!config->relayServers.empty() && StartRelay(config->relayServers)) {
+    SetGetIPPatch(true);
+    // Otherwise wait to see whether forwarding works
+    SetRelayActive(mode == noForward);
+  }
+
+  if (WantBindPatches(bindAll)) {
+    SetBindPatches(true, bindAll);
+  }
+
+  // Packet capture for offline replay, off unless a capture file is given
+  if (!config->captureFile.empty()) {
+    StartCapture(config->captureFile.c_str(),
+                 static_cast<size_t>(config->captureSizeMB) << 20,
+                 config->captureSnapLen);
+  }
+
+  // Per-peer stats for external tools to poll
+  if (config->peerStats) {
+    StartNetStats();
+  }
+
+  // Bundle small datagrams to peers that also run NetHelper
+  WORD capabilities = 0;
+  if (config->coalesce && StartCoalescing(config->coalesceWindowMs)) {
+    capabilities |= capCoalesce;
+  }
+
+  // Compress packets to peers that also run NetHelper with the same dictionary
+  DWORD dictionaryId = 0;
+  if (config->compress) {
+    dictionaryId = StartCompression(config->compressMinSize,
+                                    config->compressDictionary.c_str());
+    capabilities |= capCompress;
+  }
+
+  // Measure RTT between NetHelper players to advise who should host
+  if (config->hostAdvisor && StartHostAdvisor()) {
+    capabilities |= capProbe;
+  }
+  SetLocalCapabilities(capabilities, dictionaryId);
+
+  // Send LAN game searches out of every adapter
+  if (config->broadcastFanOut) {
+    StartBroadcastFanOut();
+  }
 
+  if ((IsCapturing() || IsNetStatsEnabled() || IsHandshakeEnabled() ||
+       IsRecvEngineEnabled() || IsRelayEnabled() || IsBroadcastFanOutEnabled()) &&
+      !SetTransportPatches(true)) {
+    StopCapture();
+    StopNetStats();
+    StopCoalescing();
+    StopCompression();
+    StopHostAdvisor();
+    SetLocalCapabilities(0);
+    StopRecvEngine();
+    StopRelay();
+    StopBroadcastFanOut();
+  }
+
+  // Look up the external address alongside gateway discovery, for when no gateway
+  // reports one
+  if (!config->stunServers.empty() &&
+      StartStun(config->stunServers, config->stunCacheSec)) {
     SetGetIPPatch(true);
+  }
+
+  // Pick up changes to Outpost2.ini while the game is running
+  StartConfigWatch();
 
-    // Do port forwarding in its own thread because of network response delay
-    DWORD threadId = NULL;
-    hFwdThread = CreateThread(nullptr, 0, PortForwardTask, nullptr, 0, &threadId);
+  if (mode != noForward) {
+    StartForwarding(*config);
   }
+
+  // Do port forwarding in its own thread because of network response delay. It
+  // also applies reloaded settings, which may turn forwarding on.
+  hShutdownEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+  DWORD threadId = NULL;
+  hFwdThread = CreateThread(nullptr, 0, PortForwardTask, nullptr, 0, &threadId);
+}
+
+
+// Whether the game's bind() needs hooking, both at startup and on reload
+static bool WantBindPatches(bool bindAll) {
+  return bindAll || IsSocketPolicyEnabled() || IsRecvEngineEnabled() ||
+         IsRelayEnabled();
+}
+
+
+// Takes the forwarding settings, and starts tracking the network so forwarding
+// can be redone when it changes
+static void StartForwarding(const Config &config) {
+  doPmpReset = config.allowPmpReset;
+  leaseSec   = config.leaseSec;
+  startPort  = config.startPort;
+  endPort    = config.endPort;
+
+  // Forwarding through every gateway only helps if the game listens on all
+  // adapters
+  forwardAll = config.bindAll && config.forwardAllGateways;
+
+  // Split external ports with other NetHelper hosts behind the same NAT
+  coordinate = config.lanCoordination;
+
+  SetGetIPPatch(true);
+  NetMonitor::Start();
+  forwarding = true;
 }
 
 
 extern "C" __declspec(dllexport) bool DestroyMod() {
   bool result = true;
 
+  // Stop applying reloaded settings before anything is torn down
+  if (hFwdThread) {
+    shuttingDown = true;
+    SetEvent(hShutdownEvent);
+    WaitForSingleObject(hFwdThread, INFINITE);
+  }
+
   if (!SetBindPatches(false)) {
     result = false;
   }
+  if (!SetTransportPatches(false)) {
+    result = false;
+  }
+  LogSessionStats();
+  StopCoalescing();
+  StopCompression();
+  StopHostAdvisor();
+  SetLocalCapabilities(0);
+  StopCapture();
+  StopNetStats();
+  StopRecvEngine();
+  StopRelay();
+  StopBroadcastFanOut();
+  StopConfigWatch();
+
+  if (!SetGetIPPatch(false)) {
+    result = false;
+  }
+  StopStun();
 
-  if (mode != noForward) {
-    if (!SetGetIPPatch(false)) {
-      result = false;
+  if (forwarding) {
+    std::vector<Gateway*> which;
+    for (auto &gateway : gateways) {
+      which.push_back(gateway.get());
+    }
+    RunGatewayTasks(which, true);
+    gateways.clear();
+    StopPortCoordination();
+    forwarding = false;
+  }
+  if (hShutdownEvent) {
+    CloseHandle(hShutdownEvent);
+    hShutdownEvent = nullptr;
+  }
+  // Also started for broadcast fan-out
+  NetMonitor::Stop();
+
+  UnloadPatchManifest();
+  Patcher::StopModuleTracking();
+
+  return result;
+}
+
+
+// Writes what the socket and transport features did this session to the debug log
+static void LogSessionStats() {
+  const SocketPolicyStats &policy = GetSocketPolicyStats();
+  if (policy.sockets > 0 || policy.failures > 0) {
+    odprintf("NetHelper: Socket policy applied to %ld sockets (%ld UDP, %ld TCP): "
+             "receive buffer %ld, send buffer %ld, DSCP %ld, no connreset %ld, "
+             "no delay %ld, non-blocking %ld; %ld failed", policy.sockets,
+             policy.udpSockets, policy.tcpSockets, policy.recvBuf, policy.sendBuf,
+             policy.dscp, policy.noConnReset, policy.noDelay, policy.nonBlocking,
+             policy.failures);
+  }
+
+  const CoalesceStats &coalesce = GetCoalesceStats();
+  if (coalesce.datagramsIn > 0 || coalesce.unbundled > 0) {
+    odprintf("NetHelper: Coalesced %ld datagrams into %ld bundles; unbundled %ld",
+             coalesce.datagramsIn, coalesce.bundlesOut, coalesce.unbundled);
+  }
+
+  const RecvEngineStats &engine = GetRecvEngineStats();
+  if (engine.sockets > 0) {
+    odprintf("NetHelper: Receive engine queued %ld datagrams on %ld sockets, at most "
+             "%ld at once; dropped %ld", engine.received, engine.sockets,
+             engine.maxDepth, engine.dropped);
+  }
+}
+
+
+DWORD WINAPI PortForwardTask(LPVOID lpParam) {
+  DWORD result = forwarding ? SyncGateways(std::vector<DWORD>()) : 0;
+  UpdateRelay(result);
+
+  // Watch for network changes, such as switching Wi-Fi networks or a VPN coming
+  // up, and redo forwarding for the gateways that are affected. Also apply
+  // changes to the settings.
+  for (;;) {
+    // The network is only tracked once forwarding is on, which a reload can do
+    std::vector<HANDLE> events = { hShutdownEvent };
+    for (HANDLE hEvent : { NetMonitor::GetChangeEvent(), GetConfigChangeEvent() }) {
+      if (hEvent) {
+        events.push_back(hEvent);
+      }
+    }
+    if (shuttingDown || events.size() == 1) {
+      break;
     }
 
-    if (hFwdThread) {
-      shuttingDown = true;
-      WaitForSingleObject(hFwdThread, INFINITE);
+    DWORD wait = WaitForMultipleObjects(static_cast<DWORD>(events.size()),
+                                        events.data(), FALSE, INFINITE);
+    if (wait <= WAIT_OBJECT_0 || wait >= WAIT_OBJECT_0 + events.size()) {
+      break;
     }
 
-    PortForwarder forwarder(mode == pmpOrUpnp || mode == upnpOnly,
-                            mode == pmpOrUpnp || mode == pmpOnly);
+    if (events[wait - WAIT_OBJECT_0] == GetConfigChangeEvent()) {
+      result = ApplyConfig(*GetConfig());
+    }
+    else if (mode != noForward) {
+      // Let the burst of notifications from a reconnect settle first
+      if (WaitForSingleObject(hShutdownEvent, 2000) == WAIT_OBJECT_0) {
+        break;
+      }
 
-    for (int i = startPort; i <= endPort; ++i) {
-      forwarder.Unforward(true, i);
+      result = SyncGateways(NetMonitor::TakeChangedInterfaces());
     }
+    UpdateRelay(result);
   }
 
+  hFwdThread = nullptr;
   return result;
 }
 
 
-DWORD WINAPI PortForwardTask(LPVOID lpParam) {
-  PortForwarder forwarder(mode == pmpOrUpnp || mode == upnpOnly,
-                          mode == pmpOrUpnp || mode == pmpOnly);
+// Brings the list of gateways in line with the adapter table, and forwards ports
+// through gateways that are new or whose interface changed. Normally this is
+// just the gateway of the best adapter; with ForwardAllGateways, it's also that
+// of every other adapter on a distinct network.
+static DWORD SyncGateways(const std::vector<DWORD> &changedInterfaces) {
+  std::vector<NetMonitor::Adapter> wanted;
+  NetMonitor::Adapter best;
+  if (NetMonitor::GetBestAdapter(&best)) {
+    wanted.push_back(best);
+  }
+  if (forwardAll) {
+    for (auto &adapter : NetMonitor::GetAdapters()) {
+      bool duplicate = adapter.gateway == INADDR_ANY;
+      for (auto &other : wanted) {
+        duplicate |= (adapter.index == other.index) ||
+                     (adapter.gateway == other.gateway &&
+                      (adapter.address & adapter.mask) == (other.address & other.mask));
+      }
+      if (!duplicate) {
+        wanted.push_back(adapter);
+      }
+    }
+  }
 
-  DWORD result = 0;
+  std::vector<std::unique_ptr<Gateway>> next;
+  std::vector<Gateway*> toForward;
+  for (size_t i = 0; i < wanted.size(); ++i) {
+    auto &adapter = wanted[i];
+    auto it = std::find_if(gateways.begin(), gateways.end(),
+      [&adapter](const std::unique_ptr<Gateway> &g)
+        { return g->adapter.index == adapter.index; });
+
+    if (it != gateways.end() &&
+        std::find(changedInterfaces.begin(), changedInterfaces.end(),
+                  adapter.index) == changedInterfaces.end()) {
+      // Already forwarded through this gateway and nothing changed
+      (*it)->primary = (i == 0);
+      next.emplace_back(std::move(*it));
+      continue;
+    }
+
+    // New or changed; rediscover the gateway and remap with the original settings
+    std::unique_ptr<Gateway> gateway(new Gateway());
+    gateway->adapter    = adapter;
+    gateway->primary    = (i == 0);
+    gateway->mode       = mode;
+    gateway->doPmpReset = doPmpReset;
+    gateway->leaseSec   = leaseSec;
+    gateway->portOffset = 0;
+    toForward.push_back(gateway.get());
+    next.emplace_back(std::move(gateway));
+  }
+
+  // Remove the mappings of gateways that went away or are about to be remapped,
+  // rather than leaving them to hold the ports until their leases run out. This
+  // comes first, as a remapped gateway may well be the same router.
+  std::vector<Gateway*> dropped;
+  for (auto &gateway : gateways) {
+    if (gateway) {
+      dropped.push_back(gateway.get());
+    }
+  }
+  RunGatewayTasks(dropped, true);
+  gateways.swap(next);
+
+  if (gateways.empty() ||
+      std::find(toForward.begin(), toForward.end(), gateways[0].get()) !=
+        toForward.end()) {
+    // The primary gateway is about to be rediscovered, or we're offline
+    SetDisplayedAddresses("", "");
+
+    // Other hosts on the new network may already hold the default ports
+    if (coordinate && !gateways.empty()) {
+      gateways[0]->portOffset =
+        StartPortCoordination(gateways[0]->adapter.address, startPort, endPort);
+    }
+  }
+
+  RunGatewayTasks(toForward, false);
 
+  // Display the primary gateway's addresses in game, and log all of them
+  for (auto &gateway : gateways) {
+    if (gateway->primary) {
+      SetDisplayedAddresses(gateway->internalIp, gateway->externalIp);
+    }
+    if (std::find(toForward.begin(), toForward.end(), gateway.get()) !=
+        toForward.end()) {
+      odprintf("NetHelper: Forwarding via %s on %s (external IP %s) %s after %lu ms, "
+               "%d requests at a time",
+               gateway->primary ? "primary gateway" : "gateway",
+               gateway->internalIp, gateway->externalIp,
+               gateway->result == 0 ? "succeeded" : "failed", gateway->elapsedMs,
+               gateway->requestWindow);
+    }
+  }
+
+  return gateways.empty() ? 1 : gateways[0]->result;
+}
+
+
+// Applies settings that were changed while running. A changed port range only
+// maps and unmaps the difference; other forwarding changes redo forwarding through
+// every gateway, or start it if it was off.
+static DWORD ApplyConfig(const Config &config) {
+  // Also unhooks bind() once nothing needs it
+  bool bindAll = config.bindAll;
+  SetBindPatches(WantBindPatches(bindAll), bindAll);
+
+  std::vector<Gateway*> all;
+  for (auto &gateway : gateways) {
+    all.push_back(gateway.get());
+  }
+
+  auto newMode       = static_cast<fwdMode>(config.forwardMode);
+  bool newForwardAll = bindAll && config.forwardAllGateways;
+  bool rangeChanged  = config.startPort != startPort || config.endPort != endPort;
+  if (newMode != mode || config.leaseSec != leaseSec ||
+      config.allowPmpReset != doPmpReset || newForwardAll != forwardAll ||
+      (rangeChanged && IsPortCoordinating())) {
+    // A changed range also needs a new block claimed from other LAN hosts
+    RunGatewayTasks(all, true);
+    gateways.clear();
+
+    mode       = newMode;
+    doPmpReset = config.allowPmpReset;
+    leaseSec   = config.leaseSec;
+    startPort  = config.startPort;
+    endPort    = config.endPort;
+    forwardAll = newForwardAll;
+
+    if (mode == noForward) {
+      StopPortCoordination();
+      SetDisplayedAddresses("", "");
+      return 0;
+    }
+    if (!forwarding) {
+      StartForwarding(config);
+    }
+    return SyncGateways(std::vector<DWORD>());
+  }
+
+  if (!rangeChanged) {
+    return gateways.empty() ? 1 : gateways[0]->result;
+  }
+
+  std::vector<int> removed,
+                   added;
   for (int i = startPort; i <= endPort; ++i) {
-    if (shuttingDown) {
-      break;
+    if (i < config.startPort || i > config.endPort) {
+      removed.push_back(i);
     }
+  }
+  for (int i = config.startPort; i <= config.endPort; ++i) {
+    if (i < startPort || i > endPort) {
+      added.push_back(i);
+    }
+  }
 
-    if (!forwarder.Forward(true, i, i, nullptr, "Outpost 2",
-        (forwarder.IsUsingPmp() && leaseSec == 0) ? 24*60*60 : leaseSec)) {
-      if (forwarder.IsUsingPmp()) {
-        if (doPmpReset) {
-          // Request to clear all NAT-PMP/PCP UDP port mappings and retry
-          doPmpReset = false;
-          forwarder.Unforward(true, 0);
+  odprintf("NetHelper: Port range changed to %d-%d, unmapping %d and mapping %d ports",
+           config.startPort, config.endPort, static_cast<int>(removed.size()),
+           static_cast<int>(added.size()));
+  if (!removed.empty()) {
+    RunGatewayTasks(all, true, &removed);
+  }
+  startPort = config.startPort;
+  endPort   = config.endPort;
+  if (!added.empty()) {
+    RunGatewayTasks(all, false, &added);
+  }
 
-          i = startPort - 1;
-          continue;
-        }
-        else if (mode == pmpOrUpnp) {
-          // NAT-PMP/PCP is supported but unable to map ports, retry with UPnP
-          mode = upnpOnly;
-          return PortForwardTask(lpParam);
-        }
-      }
-      else if (forwarder.IsUsingUpnp() && leaseSec != 0) {
-        // Failed using dynamic forwarding, retry using static forwarding
-        leaseSec = 0;
+  return gateways.empty() ? 1 : gateways[0]->result;
+}
+
+
+struct GatewayTask {
+  Gateway *gateway;
+  bool unforward;
+  const std::vector<int> *ports;
+  bool wholeRange;
+};
+
+static DWORD WINAPI GatewayTaskProc(LPVOID lpParam) {
+  auto *task = static_cast<GatewayTask*>(lpParam);
+  return task->unforward ?
+    UnforwardPorts(*task->gateway, *task->ports, task->wholeRange) :
+    ForwardPorts(*task->gateway, *task->ports);
+}
+
+// Forwards or unforwards ports through each of the gateways in parallel, since
+// most of the time is spent waiting on network responses. ports defaults to the
+// whole configured range.
+static void RunGatewayTasks(const std::vector<Gateway*> &which, bool unforward,
+                            const std::vector<int> *ports) {
+  std::vector<int> allPorts;
+  bool wholeRange = !ports;
+  if (!ports) {
+    for (int i = startPort; i <= endPort; ++i) {
+      allPorts.push_back(i);
+    }
+    ports = &allPorts;
+  }
+
+  std::vector<GatewayTask> tasks;
+  for (auto *gateway : which) {
+    tasks.push_back({ gateway, unforward, ports, wholeRange });
+  }
 
-        i = startPort - 1;
+  std::vector<HANDLE> threads;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    HANDLE hThread = nullptr;
+    if (i + 1 < tasks.size() && threads.size() < MAXIMUM_WAIT_OBJECTS &&
+        (hThread = CreateThread(nullptr, 0, GatewayTaskProc, &tasks[i], 0,
+                                nullptr))) {
+      threads.push_back(hThread);
+    }
+    else {
+      // Run the last one (or any that couldn't get a thread) on this thread
+      GatewayTaskProc(&tasks[i]);
+    }
+  }
+
+  if (!threads.empty()) {
+    WaitForMultipleObjects(static_cast<DWORD>(threads.size()), threads.data(), TRUE,
+                           INFINITE);
+    for (HANDLE hThread : threads) {
+      CloseHandle(hThread);
+    }
+  }
+}
+
+
+// Progress of one port through ForwardPorts
+enum PortStatus {
+  portPending = 0,  // To be mapped at the current stage
+  portMapped,
+  portFailed        // Out of attempts at the current stage
+};
+
+struct PortState {
+  PortStatus status;
+  int        attempts;  // Failed requests at the current stage
+  DWORD      retryAt;   // GetTickCount
+};
+
+static const int   portAttempts = 3;
+static const DWORD portRetryMs  = 250;
+
+
+// Sets the gateway's addresses from a newly initialized forwarder
+static void UpdateAddresses(Gateway &gateway, PortForwarder &forwarder) {
+  strcpy_s(gateway.internalIp, sizeof(gateway.internalIp), forwarder.GetInternalIp());
+  strcpy_s(gateway.externalIp, sizeof(gateway.externalIp), forwarder.GetExternalIp());
+  if (gateway.primary && !IsExternalIpDisplayed()) {
+    // Show the addresses in game right away, before all ports are mapped
+    SetDisplayedAddresses(gateway.internalIp, gateway.externalIp);
+  }
+}
+
+
+// Maps the pending ports, as many at once as the gateway allows. Each port that
+// fails is retried on its own schedule, with exponential backoff and jitter, until
+// it runs out of attempts.
+static void MapPendingPorts(PortForwarder &forwarder, const Gateway &gateway,
+                            const std::vector<int> &ports,
+                            std::vector<PortState> &states) {
+  int duration = (forwarder.IsUsingPmp() && gateway.leaseSec == 0) ? 24*60*60 :
+                                                                     gateway.leaseSec;
+  std::vector<int>    batch;
+  std::vector<size_t> which;
+
+  while (!shuttingDown) {
+    DWORD now  = GetTickCount(),
+          wait = INFINITE;
+    batch.clear();
+    which.clear();
+    for (size_t i = 0; i < ports.size(); ++i) {
+      if (states[i].status != portPending) {
         continue;
       }
+      LONG left = static_cast<LONG>(states[i].retryAt - now);
+      if (left <= 0) {
+        batch.push_back(ports[i]);
+        which.push_back(i);
+      }
+      else {
+        wait = (static_cast<DWORD>(left) < wait) ? static_cast<DWORD>(left) : wait;
+      }
+    }
+
+    if (batch.empty()) {
+      if (wait == INFINITE ||
+          WaitForSingleObject(hShutdownEvent, wait) == WAIT_OBJECT_0) {
+        break;
+      }
+      continue;
+    }
+
+    std::unique_ptr<bool[]> mapped(new bool[batch.size()]);
+    forwarder.ForwardMany(true, batch.data(), static_cast<int>(batch.size()),
+                          "Outpost 2", duration, mapped.get());
 
+    for (size_t j = 0; j < which.size(); ++j) {
+      PortState &state = states[which[j]];
+      if (mapped[j]) {
+        state.status = portMapped;
+      }
+      else if (++state.attempts >= portAttempts) {
+        state.status = portFailed;
+      }
+      else {
+        // Jitter keeps ports that failed together from being retried together
+        DWORD delay = portRetryMs << (state.attempts - 1);
+        state.retryAt = GetTickCount() + delay + rand() % (delay / 2 + 1);
+      }
+    }
+  }
+}
+
+
+// Queues ports again for the next stage of ForwardPorts, either only those that
+// failed or all of them
+static void RequeuePorts(std::vector<PortState> &states, bool all) {
+  DWORD now = GetTickCount();
+  for (PortState &state : states) {
+    if (all || state.status == portFailed) {
+      state.status   = portPending;
+      state.attempts = 0;
+      state.retryAt  = now;
+    }
+  }
+}
+
+
+// Maps the ports through the gateway. Ports are tracked individually; when some
+// can't be mapped, the next fallback (a NAT-PMP reset, UPnP in place of NAT-PMP/PCP,
+// or static UPnP leases) is only applied to the ports that failed.
+static DWORD ForwardPorts(Gateway &gateway, const std::vector<int> &ports) {
+  DWORD start = GetTickCount();
+  std::unique_ptr<PortForwarder> forwarder(new PortForwarder(
+    gateway.mode == pmpOrUpnp || gateway.mode == upnpOnly,
+    gateway.mode == pmpOrUpnp || gateway.mode == pmpOnly,
+    forwardAll ? &gateway.adapter : nullptr));
+  forwarder->SetExternalPortOffset(gateway.portOffset);
+  UpdateAddresses(gateway, *forwarder);
+
+  std::vector<PortState> states(ports.size(), PortState());
+  RequeuePorts(states, true);
+
+  DWORD result = 0;
+  while (!shuttingDown) {
+    if (!forwarder->IsUsingPmp() && !forwarder->IsUsingUpnp()) {
+      result = 1;
+      break;
+    }
+
+    MapPendingPorts(*forwarder, gateway, ports, states);
+
+    int failed = static_cast<int>(std::count_if(states.begin(), states.end(),
+      [](const PortState &state) { return state.status != portMapped; }));
+    if (failed == 0 || shuttingDown) {
+      break;
+    }
+
+    if (forwarder->IsUsingPmp() && !forwarder->IsUsingPcp() && gateway.doPmpReset) {
+      // Request to clear all NAT-PMP UDP port mappings and retry. This also clears
+      // the ones that worked, so all of them are mapped again.
+      gateway.doPmpReset = false;
+      forwarder->Unforward(true, 0);
+      RequeuePorts(states, true);
+    }
+    else if (forwarder->IsUsingPmp() && gateway.mode == pmpOrUpnp) {
+      // NAT-PMP/PCP is supported but unable to map some ports, map those with UPnP.
+      // The others stay mapped through NAT-PMP/PCP.
+      odprintf("NetHelper: %d ports failed with NAT-PMP/PCP, retrying with UPnP",
+               failed);
+      for (size_t i = 0; i < ports.size(); ++i) {
+        if (states[i].status == portMapped) {
+          gateway.pmpPorts.push_back(ports[i]);
+        }
+      }
+      gateway.mode = upnpOnly;
+      forwarder.reset(new PortForwarder(true, false,
+                                        forwardAll ? &gateway.adapter : nullptr));
+      forwarder->SetExternalPortOffset(gateway.portOffset);
+      UpdateAddresses(gateway, *forwarder);
+      RequeuePorts(states, false);
+    }
+    else if (forwarder->IsUsingUpnp() && gateway.leaseSec != 0) {
+      // Failed using dynamic forwarding, retry using static forwarding
+      odprintf("NetHelper: %d ports failed with a UPnP lease, retrying without one",
+               failed);
+      gateway.leaseSec = 0;
+      RequeuePorts(states, false);
+    }
+    else {
       result = 1;
       break;
     }
   }
 
-  hFwdThread = nullptr;
-  return result;
-}
\ No newline at end of file
+  // Peers say hello to the handshake port, which only the LAN host holding the
+  // unshifted block can have. It's a bonus, and doesn't count toward the result.
+  if (result == 0 && !shuttingDown && IsHandshakeEnabled() &&
+      gateway.portOffset == 0 && !gateway.handshakeMapped) {
+    int port = handshakePort;
+    int duration = (forwarder->IsUsingPmp() && gateway.leaseSec == 0) ?
+                   24*60*60 : gateway.leaseSec;
+    gateway.handshakeMapped =
+      forwarder->ForwardMany(true, &port, 1, "Outpost 2 NetHelper", duration) == 1;
+  }
+
+  // PCP learns the external address from the mappings
+  if (forwarder->GetExternalIp()[0]) {
+    strcpy_s(gateway.externalIp, sizeof(gateway.externalIp),
+             forwarder->GetExternalIp());
+  }
+  gateway.elapsedMs     = GetTickCount() - start;
+  gateway.requestWindow = forwarder->GetRequestWindow();
+  return (gateway.result = result);
+}
+
+
+static DWORD UnforwardPorts(Gateway &gateway, const std::vector<int> &ports,
+                            bool wholeRange) {
+  std::vector<int> pmpPorts,
+                   others;
+  if (wholeRange && gateway.handshakeMapped) {
+    // Mapped last, through whichever protocol the range ended up on
+    others.push_back(handshakePort);
+    gateway.handshakeMapped = false;
+  }
+  for (int port : ports) {
+    auto it = std::find(gateway.pmpPorts.begin(), gateway.pmpPorts.end(), port);
+    if (it != gateway.pmpPorts.end()) {
+      pmpPorts.push_back(port);
+      gateway.pmpPorts.erase(it);
+    }
+    else {
+      others.push_back(port);
+    }
+  }
+
+  // Through the adapter the ports were mapped from, which may no longer be the best
+  if (!pmpPorts.empty()) {
+    // Mapped before the rest of the range fell back to UPnP
+    PortForwarder forwarder(false, true, &gateway.adapter);
+    forwarder.SetExternalPortOffset(gateway.portOffset);
+    forwarder.UnforwardMany(true, pmpPorts.data(), static_cast<int>(pmpPorts.size()));
+  }
+
+  if (!others.empty()) {
+    PortForwarder forwarder(
+      gateway.mode == pmpOrUpnp || gateway.mode == upnpOnly,
+      gateway.mode == pmpOrUpnp || gateway.mode == pmpOnly, &gateway.adapter);
+    forwarder.SetExternalPortOffset(gateway.portOffset);
+    forwarder.UnforwardMany(true, others.data(), static_cast<int>(others.size()));
+  }
+
+  return 0;
+}
+
+
+// Relays the game's traffic while port forwarding is off or failed, and stops once
+// it works, e.g. after the network changes
+static void UpdateRelay(DWORD forwardResult) {
+  if (IsRelayEnabled()) {
+    SetRelayActive(mode == noForward || forwardResult != 0);
+  }
+}
@@ -0,0 +1,413 @@
+// Tracks network adapters and default routes, keeping them up to date from
+// change notifications rather than taking a one-time snapshot
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <map>
+#include <set>
+#include <memory>
+#include "NetMonitor.h"
+
+namespace NetMonitor {
+
+// Vista+ notification functions are resolved at runtime, since WINE may lack them
+typedef DWORD (WINAPI *NotifyIpInterfaceChangeFn)(ADDRESS_FAMILY,
+  PIPINTERFACE_CHANGE_CALLBACK, PVOID, BOOLEAN, HANDLE*);
+typedef DWORD (WINAPI *NotifyUnicastIpAddressChangeFn)(ADDRESS_FAMILY,
+  PUNICAST_IPADDRESS_CHANGE_CALLBACK, PVOID, BOOLEAN, HANDLE*);
+typedef DWORD (WINAPI *NotifyRouteChange2Fn)(ADDRESS_FAMILY,
+  PIPFORWARD_CHANGE_CALLBACK, PVOID, BOOLEAN, HANDLE*);
+typedef DWORD (WINAPI *CancelMibChangeNotify2Fn)(HANDLE);
+typedef DWORD (WINAPI *GetIpForwardTable2Fn)(ADDRESS_FAMILY, PMIB_IPFORWARD_TABLE2*);
+typedef VOID  (WINAPI *FreeMibTableFn)(PVOID);
+
+struct Route {
+  IPAddr nextHop;
+  ULONG  metric;
+};
+
+static SRWLOCK lock = SRWLOCK_INIT;
+// Held from reading a table to applying it, so a refresh that read the table
+// before a change can't overwrite the one that read it after
+static SRWLOCK refreshLock = SRWLOCK_INIT;
+static bool started = false;
+
+static std::map<DWORD, Adapter> adapters;
+static std::map<DWORD, Route>   defaultRoutes;
+static DWORD bestIndex = 0;
+static std::set<DWORD> changed;
+static volatile LONG generation = 0;
+
+static HANDLE hChangeEvent     = nullptr,
+              hInterfaceNotify = nullptr,
+              hAddressNotify   = nullptr,
+              hRouteNotify     = nullptr,
+              hAddrChangeWait  = nullptr;
+static OVERLAPPED addrChangeOverlapped = {};
+static CancelMibChangeNotify2Fn pfnCancelMibChangeNotify2 = nullptr;
+
+static void RefreshAdapters(DWORD onlyIndex = 0);
+static void RefreshBestInterface();
+static void SeedDefaultRoutes(HMODULE iphlpapi);
+
+static void WINAPI OnInterfaceChange(PVOID, PMIB_IPINTERFACE_ROW row,
+                                     MIB_NOTIFICATION_TYPE);
+static void WINAPI OnAddressChange(PVOID, PMIB_UNICASTIPADDRESS_ROW row,
+                                   MIB_NOTIFICATION_TYPE);
+static void WINAPI OnRouteChange(PVOID, PMIB_IPFORWARD_ROW2 row,
+                                 MIB_NOTIFICATION_TYPE type);
+static void CALLBACK OnAddrTableChange(PVOID, BOOLEAN);
+
+
+bool Start() {
+  if (started) {
+    return true;
+  }
+
+  if (!hChangeEvent && !(hChangeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr))) {
+    return false;
+  }
+
+  HMODULE iphlpapi = GetModuleHandleA("iphlpapi.dll");
+  SeedDefaultRoutes(iphlpapi);
+  RefreshAdapters();
+  RefreshBestInterface();
+
+  // The initial snapshot isn't a change; callers read it through GetAdapters()
+  AcquireSRWLockExclusive(&lock);
+  changed.clear();
+  ReleaseSRWLockExclusive(&lock);
+  ResetEvent(hChangeEvent);
+
+  auto pfnNotifyIpInterfaceChange = reinterpret_cast<NotifyIpInterfaceChangeFn>(
+    GetProcAddress(iphlpapi, "NotifyIpInterfaceChange"));
+  auto pfnNotifyUnicastIpAddressChange =
+    reinterpret_cast<NotifyUnicastIpAddressChangeFn>(
+      GetProcAddress(iphlpapi, "NotifyUnicastIpAddressChange"));
+  auto pfnNotifyRouteChange2 = reinterpret_cast<NotifyRouteChange2Fn>(
+    GetProcAddress(iphlpapi, "NotifyRouteChange2"));
+  pfnCancelMibChangeNotify2 = reinterpret_cast<CancelMibChangeNotify2Fn>(
+    GetProcAddress(iphlpapi, "CancelMibChangeNotify2"));
+
+  if (pfnCancelMibChangeNotify2) {
+    if (pfnNotifyIpInterfaceChange) {
+      pfnNotifyIpInterfaceChange(AF_INET, OnInterfaceChange, nullptr, FALSE,
+                                 &hInterfaceNotify);
+    }
+    if (pfnNotifyUnicastIpAddressChange) {
+      pfnNotifyUnicastIpAddressChange(AF_INET, OnAddressChange, nullptr, FALSE,
+                                      &hAddressNotify);
+    }
+    if (pfnNotifyRouteChange2) {
+      pfnNotifyRouteChange2(AF_INET, OnRouteChange, nullptr, FALSE, &hRouteNotify);
+    }
+  }
+
+  // Also listen for the legacy address table notification, which is the only one
+  // that's reliably delivered under WINE
+  if ((addrChangeOverlapped.hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr))) {
+    HANDLE hNotify = nullptr;
+    if (NotifyAddrChange(&hNotify, &addrChangeOverlapped) == ERROR_IO_PENDING) {
+      RegisterWaitForSingleObject(&hAddrChangeWait, addrChangeOverlapped.hEvent,
+                                  OnAddrTableChange, nullptr, INFINITE,
+                                  WT_EXECUTEDEFAULT);
+    }
+  }
+
+  return (started = true);
+}
+
+
+void Stop() {
+  if (!started) {
+    return;
+  }
+
+  if (pfnCancelMibChangeNotify2) {
+    for (HANDLE *h : { &hInterfaceNotify, &hAddressNotify, &hRouteNotify }) {
+      if (*h) {
+        pfnCancelMibChangeNotify2(*h);
+        *h = nullptr;
+      }
+    }
+  }
+
+  if (hAddrChangeWait) {
+    // Wait for any running callback first so it can't re-arm the notification
+    UnregisterWaitEx(hAddrChangeWait, INVALID_HANDLE_VALUE);
+    hAddrChangeWait = nullptr;
+    CancelIPChangeNotify(&addrChangeOverlapped);
+  }
+  if (addrChangeOverlapped.hEvent) {
+    CloseHandle(addrChangeOverlapped.hEvent);
+    addrChangeOverlapped.hEvent = nullptr;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  adapters.clear();
+  defaultRoutes.clear();
+  changed.clear();
+  bestIndex = 0;
+  ReleaseSRWLockExclusive(&lock);
+
+  started = false;
+}
+
+
+bool GetBestAdapter(Adapter *out) {
+  if (!out) {
+    return false;
+  }
+
+  if (!started) {
+    // Not subscribed to notifications, so the tables may be stale
+    RefreshAdapters();
+    RefreshBestInterface();
+  }
+
+  AcquireSRWLockShared(&lock);
+  auto it = adapters.find(bestIndex);
+  bool result = it != adapters.end();
+  if (result) {
+    *out = it->second;
+  }
+  ReleaseSRWLockShared(&lock);
+
+  return result;
+}
+
+
+std::vector<Adapter> GetAdapters() {
+  if (!started) {
+    RefreshAdapters();
+  }
+
+  std::vector<Adapter> result;
+  AcquireSRWLockShared(&lock);
+  result.reserve(adapters.size());
+  for (auto &entry : adapters) {
+    result.push_back(entry.second);
+  }
+  ReleaseSRWLockShared(&lock);
+
+  return result;
+}
+
+
+HANDLE GetChangeEvent() {
+  return hChangeEvent;
+}
+
+
+LONG GetAdapterGeneration() {
+  return generation;
+}
+
+
+std::vector<DWORD> TakeChangedInterfaces() {
+  AcquireSRWLockExclusive(&lock);
+  std::vector<DWORD> result(changed.begin(), changed.end());
+  changed.clear();
+  ReleaseSRWLockExclusive(&lock);
+
+  return result;
+}
+
+
+// Change notification callbacks, called from thread pool threads
+
+static void WINAPI OnInterfaceChange(PVOID, PMIB_IPINTERFACE_ROW row,
+                                     MIB_NOTIFICATION_TYPE) {
+  RefreshAdapters(row ? row->InterfaceIndex : 0);
+  RefreshBestInterface();
+}
+
+static void WINAPI OnAddressChange(PVOID, PMIB_UNICASTIPADDRESS_ROW row,
+                                   MIB_NOTIFICATION_TYPE) {
+  RefreshAdapters(row ? row->InterfaceIndex : 0);
+  RefreshBestInterface();
+}
+
+static void WINAPI OnRouteChange(PVOID, PMIB_IPFORWARD_ROW2 row,
+                                 MIB_NOTIFICATION_TYPE type) {
+  // Only default routes matter for finding the interface to the internet
+  if (row && row->DestinationPrefix.PrefixLength == 0 &&
+      row->NextHop.si_family == AF_INET) {
+    AcquireSRWLockExclusive(&lock);
+    if (type == MibDeleteInstance) {
+      defaultRoutes.erase(row->InterfaceIndex);
+    }
+    else {
+      defaultRoutes[row->InterfaceIndex] =
+        { row->NextHop.Ipv4.sin_addr.s_addr, row->Metric };
+    }
+    ReleaseSRWLockExclusive(&lock);
+
+    RefreshAdapters(row->InterfaceIndex);
+  }
+  RefreshBestInterface();
+}
+
+static void CALLBACK OnAddrTableChange(PVOID, BOOLEAN) {
+  RefreshAdapters();
+  RefreshBestInterface();
+
+  // Re-arm the notification
+  HANDLE hNotify = nullptr;
+  NotifyAddrChange(&hNotify, &addrChangeOverlapped);
+}
+
+
+// Fills the default route table from the current routes, since route change
+// notifications only report later changes
+static void SeedDefaultRoutes(HMODULE iphlpapi) {
+  auto pfnGetIpForwardTable2 = reinterpret_cast<GetIpForwardTable2Fn>(
+    GetProcAddress(iphlpapi, "GetIpForwardTable2"));
+  auto pfnFreeMibTable = reinterpret_cast<FreeMibTableFn>(
+    GetProcAddress(iphlpapi, "FreeMibTable"));
+
+  PMIB_IPFORWARD_TABLE2 table = nullptr;
+  if (!pfnGetIpForwardTable2 || !pfnFreeMibTable ||
+      pfnGetIpForwardTable2(AF_INET, &table) != NO_ERROR) {
+    return;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  for (ULONG i = 0; i < table->NumEntries; ++i) {
+    const MIB_IPFORWARD_ROW2 &row = table->Table[i];
+    if (row.DestinationPrefix.PrefixLength == 0 && row.NextHop.si_family == AF_INET) {
+      // Keep the lowest metric route per interface
+      auto it = defaultRoutes.find(row.InterfaceIndex);
+      if (it == defaultRoutes.end() || row.Metric < it->second.metric) {
+        defaultRoutes[row.InterfaceIndex] =
+          { row.NextHop.Ipv4.sin_addr.s_addr, row.Metric };
+      }
+    }
+  }
+  ReleaseSRWLockExclusive(&lock);
+
+  pfnFreeMibTable(table);
+}
+
+
+// Re-reads the adapter list, and updates the table entry for the given interface
+// index only, or all entries if it's 0. Must not be called with either lock held.
+static void RefreshAdapters(DWORD onlyIndex) {
+  AcquireSRWLockExclusive(&refreshLock);
+
+  // Request list of adapters
+  DWORD numAdapters = 1;
+  GetNumberOfInterfaces(&numAdapters);
+
+  ULONG bufLen  = sizeof(IP_ADAPTER_INFO) * numAdapters,
+        error   = NO_ERROR,
+        resizes = 0;
+  std::unique_ptr<BYTE[]> infos;
+  do {
+    infos.reset(new BYTE[bufLen]);
+    error = GetAdaptersInfo(reinterpret_cast<IP_ADAPTER_INFO*>(infos.get()), &bufLen);
+    ++resizes;
+  } while (error == ERROR_BUFFER_OVERFLOW && resizes < 3);
+
+  if (error != NO_ERROR && error != ERROR_NO_DATA) {
+    ReleaseSRWLockExclusive(&refreshLock);
+    return;
+  }
+
+  std::map<DWORD, Adapter> current;
+  if (error == NO_ERROR) {
+    for (auto *curAdapter = reinterpret_cast<IP_ADAPTER_INFO*>(infos.get());
+         curAdapter != nullptr; curAdapter = curAdapter->Next) {
+      if (onlyIndex && curAdapter->Index != onlyIndex) {
+        continue;
+      }
+
+      Adapter adapter = { curAdapter->Index, 0, 0, 0 };
+      inet_pton(AF_INET, curAdapter->IpAddressList.IpAddress.String, &adapter.address);
+      inet_pton(AF_INET, curAdapter->IpAddressList.IpMask.String, &adapter.mask);
+      inet_pton(AF_INET, curAdapter->GatewayList.IpAddress.String, &adapter.gateway);
+
+      if (adapter.address != INADDR_ANY) {
+        current[adapter.index] = adapter;
+      }
+    }
+  }
+
+  bool anyChanged = false;
+  AcquireSRWLockExclusive(&lock);
+
+  // Prefer the gateway from the route table, it may be more recent
+  for (auto &entry : current) {
+    auto route = defaultRoutes.find(entry.first);
+    if (route != defaultRoutes.end()) {
+      entry.second.gateway = route->second.nextHop;
+    }
+  }
+
+  // Remove adapters that went away
+  for (auto it = adapters.begin(); it != adapters.end();) {
+    if ((!onlyIndex || it->first == onlyIndex) && current.count(it->first) == 0) {
+      changed.insert(it->first);
+      it = adapters.erase(it);
+      anyChanged = true;
+    }
+    else {
+      ++it;
+    }
+  }
+
+  // Add new adapters and update ones whose addresses changed
+  for (auto &entry : current) {
+    auto it = adapters.find(entry.first);
+    if (it == adapters.end() ||
+        it->second.address != entry.second.address ||
+        it->second.mask    != entry.second.mask    ||
+        it->second.gateway != entry.second.gateway) {
+      adapters[entry.first] = entry.second;
+      changed.insert(entry.first);
+      anyChanged = true;
+    }
+  }
+
+  ReleaseSRWLockExclusive(&lock);
+  ReleaseSRWLockExclusive(&refreshLock);
+
+  if (anyChanged) {
+    InterlockedIncrement(&generation);
+  }
+  if (anyChanged && hChangeEvent) {
+    SetEvent(hChangeEvent);
+  }
+}
+
+
+// Re-evaluates which interface has the best route to the internet
+static void RefreshBestInterface() {
+  AcquireSRWLockExclusive(&refreshLock);
+  DWORD index = 0;
+  if (GetBestInterface(INADDR_ANY, &index) != NO_ERROR) {
+    index = 0;
+  }
+
+  bool anyChanged = false;
+  AcquireSRWLockExclusive(&lock);
+  if (index != bestIndex) {
+    if (bestIndex) {
+      changed.insert(bestIndex);
+    }
+    if (index) {
+      changed.insert(index);
+    }
+    bestIndex = index;
+    anyChanged = true;
+  }
+  ReleaseSRWLockExclusive(&lock);
+  ReleaseSRWLockExclusive(&refreshLock);
+
+  if (anyChanged && hChangeEvent) {
+    SetEvent(hChangeEvent);
+  }
+}
+
+} // namespace NetMonitor
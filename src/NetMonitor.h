@@ -0,0 +1,39 @@
+
+#ifndef NETMONITOR_H
+#define NETMONITOR_H
+
+#include <winsock2.h>
+#include <iphlpapi.h>
+#include <vector>
+
+namespace NetMonitor {
+
+struct Adapter {
+  DWORD  index;
+  IPAddr address,
+         mask,
+         gateway;
+};
+
+// Loads the adapter and route tables and subscribes to change notifications
+bool Start();
+// Unsubscribes from change notifications and clears the tables
+void Stop();
+
+// Gets the adapter that has the best route to the internet
+bool GetBestAdapter(Adapter *out);
+// Gets a snapshot of all adapters that have an IPv4 address
+std::vector<Adapter> GetAdapters();
+
+// Event that is signaled whenever an adapter or the best route changes
+HANDLE GetChangeEvent();
+// Counter that changes whenever the adapter table does, for callers that cache
+// what they derive from GetAdapters without waiting on the change event
+LONG GetAdapterGeneration();
+// Gets and clears the set of interface indexes that changed since the last call.
+// If the best interface changed, both the old and new ones are included.
+std::vector<DWORD> TakeChangedInterfaces();
+
+} // namespace NetMonitor
+
+#endif
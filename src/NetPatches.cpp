@@ -1,43 +1,500 @@
 
 
-// Hooks the TCP/IP net transport layer to bind to all network adapters.
+// Hooks the TCP/IP net transport layer to bind to all network adapters, and its
+// Winsock calls for packet capture, stats, coalescing, compression, relaying,
+// broadcast fan-out, and the overlapped receive engine.
 
 #include <windows.h>
 #include <winsock2.h>
+#include <ws2tcpip.h>
+#include "NetPatches.h"
 #include "Patcher.h"
-#include "PortForward.h"
+#include "PatchManifest.h"
+#include "PortCoordinator.h"
+#include "Stun.h"
+#include "HostAdvisor.h"
+#include "Relay.h"
+#include "Broadcast.h"
+#include "SocketPolicy.h"
+#include "PacketCapture.h"
+#include "NetStats.h"
+#include "PeerTable.h"
+#include "Handshake.h"
+#include "Coalesce.h"
+#include "Compress.h"
+#include "RecvQueue.h"
+#include "RecvEngine.h"
 #include <memory>
 #include <vector>
+#include <algorithm>
 
 using namespace Patcher;
 
+static const int maxDatagram = 65507;  // Largest UDP payload over IPv4
+
+static bool bindAllAdapters = true;
+static int (__stdcall *bindOriginal)(SOCKET, const sockaddr*, int) = nullptr;
+
+// Sockets the game or the socket policy made non-blocking. Winsock can't be asked,
+// and SelectWrapper has to put the mode back after using WSAEventSelect.
+static SOCKET  nonBlockingSockets[16] = {};
+static SRWLOCK nonBlockingLock = SRWLOCK_INIT;
+
+// Addresses of the primary gateway, displayed in game
+static char    internalIp[INET6_ADDRSTRLEN] = {},
+               externalIp[INET6_ADDRSTRLEN] = {};
+static SRWLOCK addressLock = SRWLOCK_INIT;
+
+static void SetNonBlockingMode(SOCKET s, bool nonBlocking);
+static bool IsNonBlockingMode(SOCKET s);
+
 
 int __stdcall BindWrapper(SOCKET s, sockaddr_in *name, int namelen) {
-  name->sin_addr.s_addr = INADDR_ANY;
+  if (bindAllAdapters) {
+    name->sin_addr.s_addr = INADDR_ANY;
+  }
 
-  static int (__stdcall *original)(SOCKET,const sockaddr*,int) = nullptr;
-  if (!original) {
-    original = reinterpret_cast<decltype(original)>(FixPtr(0x4C0E40));
+  int result = bindOriginal(s, reinterpret_cast<const sockaddr*>(name), namelen);
+  if (result == 0) {
+    int applied = ApplySocketPolicy(s);
+    if (applied & policyNonBlocking) {
+      SetNonBlockingMode(s, true);
+    }
+    if (IsRecvEngineEnabled()) {
+      RecvEngineAttach(s, (applied & policyNonBlocking) != 0);
+    }
+    if (IsRelayEnabled()) {
+      RelayAttach(s);
+    }
   }
-  return original(s, reinterpret_cast<const sockaddr*>(name), namelen);
+  return result;
 }
 
 
-bool SetBindPatches(bool enable) {
+bool SetBindPatches(bool enable, bool bindAll) {
   static std::vector<std::shared_ptr<patch>> patches;
-  static uintptr_t bindCalls[] = {
-    0x48C0FE, 0x48C12B, 0x48C700, 0x49165C, 0x495F69, 0x4960F5, 0x4964DA
+
+  // The transport's bind() call sites are redirected, leaving other callers of
+  // bind() alone. A loaded patch manifest can relocate them for other game builds.
+  static const char builtInManifest[] =
+    "NetHelperPatches 1\n"
+    "group bind\n"
+    "call 0x48C0FE bind\n"
+    "call 0x48C12B bind\n"
+    "call 0x48C700 bind\n"
+    "call 0x49165C bind\n"
+    "call 0x495F69 bind\n"
+    "call 0x4960F5 bind\n"
+    "call 0x4964DA bind\n";
+
+  if (enable) {
+    bindAllAdapters = bindAll;
+
+    if (patches.empty()) {
+      RegisterManifestHook("bind", &BindWrapper, &bindOriginal);
+      if (!ApplyPatchGroup("bind", builtInManifest, &patches) || !bindOriginal) {
+        SetBindPatches(false, bindAll);
+        return false;
+      }
+    }
+  }
+  else {
+    for (auto &curPatch : patches) {
+      Unpatch(curPatch);
+    }
+    patches.clear();
+    bindOriginal = nullptr;
+  }
+
+  return true;
+}
+
+
+int __stdcall SendToWrapper(SOCKET s, const char *buf, int len, int flags,
+                            const sockaddr *to, int tolen) {
+  // LAN game searches go out of every adapter, not just the default route's
+  if (IsBroadcastFanOutEnabled()) {
+    BroadcastFanOut(s, buf, len, flags, to, tolen);
+  }
+
+  // Players the game sends to are known to the PeerTable, which also tells their
+  // traffic apart from replies to a fanned out broadcast
+  int peerId = -1;
+  if (IsHandshakeEnabled() || IsRelayEnabled() || IsBroadcastFanOutEnabled()) {
+    peerId = PeerTable::GetPeerId(to, tolen);
+  }
+  // Players who reach us through the relay must be answered through it, and can't
+  // be said hello to directly
+  bool relayedPeer = IsRelayEnabled() && IsRelayedPeer(peerId);
+
+  if (IsHandshakeEnabled() && !relayedPeer) {
+    HandshakeOnSend(s, to, tolen, peerId);
+    if (IsHostAdvisorEnabled()) {
+      HostAdvisorOnSend(s);
+    }
+  }
+
+  int result = len;
+  if (relayedPeer) {
+    result = RelaySend(s, buf, len, to, tolen);
+  }
+  else if (flags != 0 || !CoalesceSend(s, buf, len, to, tolen, peerId)) {
+    result = CompressSend(s, buf, len, flags, to, tolen, peerId);
+  }
+
+  if (result > 0) {
+    CapturePacket(captureSend, s, to, tolen, buf, result);
+    NetStatsOnSend(to, tolen, result);
+  }
+  return result;
+}
+
+
+static int ReceiveDatagram(SOCKET s, char *buf, int len, int flags, sockaddr *from,
+                           int *fromlen) {
+  // Datagrams unpacked from a bundle are returned before anything new. Sockets
+  // attached to the receive engine are popped from its queue instead of the OS.
+  bool peek = (flags & MSG_PEEK) != 0;
+  int result;
+  if (RecvQueuePop(s, buf, len, from, fromlen, &result, peek)) {
+    return result;
+  }
+  if (!IsHandshakeEnabled() && !IsRelayEnabled()) {
+    return RecvEnginePop(s, buf, len, flags, from, fromlen);
+  }
+
+  // Control and relay messages are handled and hidden from the game, peeked or
+  // not, so receive into a buffer big enough for any datagram
+  char packet[maxDatagram];
+  sockaddr_in fromAddr;
+  auto *peer = reinterpret_cast<sockaddr*>(&fromAddr);
+  for (;;) {
+    int fromAddrLen = sizeof(fromAddr);
+    if ((result = RecvEnginePop(s, packet, sizeof(packet), flags, peer,
+                                &fromAddrLen)) < 0) {
+      return result;
+    }
+
+    bool relayed = IsRelayEnabled() &&
+                   IsRelayPacket(packet, result, peer, fromAddrLen);
+    bool control = !relayed && IsHandshakeEnabled() &&
+                   IsControlPacket(packet, result);
+    if (!relayed && !control) {
+      if (IsRelayEnabled() && !peek) {
+        RelayOnDirect(PeerTable::FindPeerId(peer, fromAddrLen));
+      }
+      break;
+    }
+
+    if (peek) {
+      // Take it off the socket, so the game's next receive gets what it peeked
+      fromAddrLen = sizeof(fromAddr);
+      if ((result = RecvEnginePop(s, packet, sizeof(packet), flags & ~MSG_PEEK,
+                                  peer, &fromAddrLen)) < 0) {
+        return result;
+      }
+    }
+
+    if (relayed) {
+      // Relayed datagrams are unwrapped to look like they came from the peer
+      if ((result = RelayReceive(s, packet, result, &fromAddr)) >= 0) {
+        fromAddrLen = sizeof(fromAddr);
+        control = IsHandshakeEnabled() && IsControlPacket(packet, result);
+        if (!control) {
+          // A peek leaves the unwrapped datagram queued for the next receive. If
+          // it can't be, it's returned as if received.
+          if (!peek || !RecvQueuePush(s, packet, result, peer, fromAddrLen)) {
+            break;
+          }
+          RecvQueuePop(s, buf, len, from, fromlen, &result, true);
+          return result;
+        }
+      }
+    }
+
+    if (control) {
+      HandleControlPacket(s, packet, result, peer, fromAddrLen,
+                          PeerTable::FindPeerId(peer, fromAddrLen));
+    }
+    if (RecvQueuePop(s, buf, len, from, fromlen, &result, peek)) {
+      return result;
+    }
+  }
+
+  memcpy(buf, packet, result <= len ? result : len);
+  if (from && fromlen) {
+    int copyLen = *fromlen < static_cast<int>(sizeof(fromAddr)) ?
+                  *fromlen : sizeof(fromAddr);
+    memcpy(from, &fromAddr, copyLen);
+    *fromlen = copyLen;
+  }
+  if (result > len) {
+    result = SOCKET_ERROR;
+    WSASetLastError(WSAEMSGSIZE);
+  }
+  return result;
+}
+
+
+int __stdcall RecvFromWrapper(SOCKET s, char *buf, int len, int flags,
+                              sockaddr *from, int *fromlen) {
+  // The same host may answer a fanned out broadcast through several adapters, so
+  // receive again in place of a repeated reply
+  int result;
+  do {
+    result = ReceiveDatagram(s, buf, len, flags, from, fromlen);
+  } while (result > 0 && IsBroadcastFanOutEnabled() && !(flags & MSG_PEEK) &&
+           IsDuplicateReply(s, buf, result, from, fromlen ? *fromlen : 0));
+
+  if (result > 0) {
+    int fromLen = fromlen ? *fromlen : 0;
+    CapturePacket(captureRecv, s, from, fromLen, buf, result);
+    NetStatsOnRecv(from, fromLen, result);
+  }
+  return result;
+}
+
+
+int __stdcall SelectWrapper(int nfds, fd_set *readfds, fd_set *writefds,
+                            fd_set *exceptfds, const timeval *timeout) {
+  // Sockets with queued datagrams are readable, even if the OS has nothing more.
+  // Sockets attached to the receive engine never look readable to the OS.
+  fd_set queued;
+  FD_ZERO(&queued);
+  bool engineSockets = false;
+  if (readfds) {
+    for (u_int i = 0; i < readfds->fd_count; ++i) {
+      SOCKET s = readfds->fd_array[i];
+      if (RecvQueueHasData(s) || RecvEngineHasData(s)) {
+        FD_SET(s, &queued);
+      }
+      else if (IsRecvEngineSocket(s)) {
+        engineSockets = true;
+      }
+    }
+  }
+  if (queued.fd_count == 0 && !engineSockets) {
+    return select(nfds, readfds, writefds, exceptfds, timeout);
+  }
+
+  fd_set readIn, writeIn, exceptIn;
+  FD_ZERO(&readIn);
+  FD_ZERO(&writeIn);
+  FD_ZERO(&exceptIn);
+  if (readfds) {
+    readIn = *readfds;
+  }
+  if (writefds) {
+    writeIn = *writefds;
+  }
+  if (exceptfds) {
+    exceptIn = *exceptfds;
+  }
+
+  // The OS signals the other sockets through WSAEventSelect, and the engine through
+  // its own event
+  struct {
+    SOCKET s;
+    long   events;
+  } watched[3 * FD_SETSIZE];
+  int numWatched = 0;
+  auto watch = [&](const fd_set &set, long events, bool skipEngine) {
+    for (u_int i = 0; i < set.fd_count; ++i) {
+      SOCKET s = set.fd_array[i];
+      if (skipEngine && IsRecvEngineSocket(s)) {
+        continue;
+      }
+      int j = 0;
+      while (j < numWatched && watched[j].s != s) {
+        ++j;
+      }
+      if (j == numWatched) {
+        watched[numWatched++] = { s, 0 };
+      }
+      watched[j].events |= events;
+    }
   };
+  watch(readIn,   FD_READ | FD_ACCEPT | FD_CLOSE, true);
+  watch(writeIn,  FD_WRITE | FD_CONNECT,          false);
+  watch(exceptIn, FD_OOB | FD_CONNECT,            false);
+  WSAEVENT hSocketEvent = (numWatched > 0) ? WSACreateEvent() : WSA_INVALID_EVENT;
+
+  DWORD waitMs = timeout ? timeout->tv_sec * 1000 + timeout->tv_usec / 1000 : INFINITE,
+        start  = GetTickCount();
+  int result;
+  for (;;) {
+    // Announce the wait before polling, so a datagram queued after the poll still
+    // wakes it
+    HANDLE hEngineData = RecvEngineBeginWait();
+
+    // Poll the OS, then add the sockets that have something queued
+    const timeval noWait = { 0, 0 };
+    result = select(nfds, readfds, writefds, exceptfds, &noWait);
+    if (result != SOCKET_ERROR) {
+      for (u_int i = 0; i < readIn.fd_count; ++i) {
+        SOCKET s = readIn.fd_array[i];
+        if ((FD_ISSET(s, &queued) || RecvEngineHasData(s)) && !FD_ISSET(s, readfds)) {
+          FD_SET(s, readfds);
+          ++result;
+        }
+      }
+    }
+
+    DWORD elapsed = GetTickCount() - start;
+    if (result != 0 || (waitMs != INFINITE && elapsed >= waitMs)) {
+      RecvEngineEndWait(hEngineData);
+      break;
+    }
+
+    // Anything the OS already has signals the event as soon as it's selected. If
+    // a socket can't be selected, poll it now and then instead.
+    bool polling = numWatched > 0 && hSocketEvent == WSA_INVALID_EVENT;
+    for (int i = 0; i < numWatched && !polling; ++i) {
+      polling = WSAEventSelect(watched[i].s, hSocketEvent, watched[i].events) != 0;
+    }
+
+    HANDLE events[2];
+    DWORD  numEvents = 0,
+           waitLeft  = (waitMs == INFINITE) ? INFINITE : waitMs - elapsed;
+    if (hEngineData) {
+      events[numEvents++] = hEngineData;
+    }
+    if (numWatched > 0 && !polling) {
+      events[numEvents++] = hSocketEvent;
+    }
+    if (polling || numEvents == 0) {
+      waitLeft = (waitLeft > 10) ? 10 : waitLeft;
+    }
+    if (numEvents > 0) {
+      WaitForMultipleObjects(numEvents, events, FALSE, waitLeft);
+    }
+    else {
+      Sleep(waitLeft);
+    }
+    RecvEngineEndWait(hEngineData);
+
+    // WSAEventSelect made the sockets non-blocking, which the game may not expect
+    for (int i = 0; i < numWatched; ++i) {
+      u_long nonBlocking = IsNonBlockingMode(watched[i].s) ? 1 : 0;
+      WSAEventSelect(watched[i].s, nullptr, 0);
+      ioctlsocket(watched[i].s, FIONBIO, &nonBlocking);
+    }
+    if (hSocketEvent != WSA_INVALID_EVENT) {
+      WSAResetEvent(hSocketEvent);
+    }
+
+    if (readfds) {
+      *readfds = readIn;
+    }
+    if (writefds) {
+      *writefds = writeIn;
+    }
+    if (exceptfds) {
+      *exceptfds = exceptIn;
+    }
+  }
+
+  if (hSocketEvent != WSA_INVALID_EVENT) {
+    WSACloseEvent(hSocketEvent);
+  }
+  return result;
+}
+
+
+int __stdcall CloseSocketWrapper(SOCKET s) {
+  SetNonBlockingMode(s, false);
+  RecvEngineDetach(s);
+  RelayDetach(s);
+  RecvQueueClear(s);
+  BroadcastDetach(s);
+  return closesocket(s);
+}
+
+
+int __stdcall IoctlSocketWrapper(SOCKET s, long cmd, u_long *argp) {
+  int result = ioctlsocket(s, cmd, argp);
+  if (result == 0 && cmd == FIONBIO && argp) {
+    SetNonBlockingMode(s, *argp != 0);
+    RecvEngineSetNonBlocking(s, *argp != 0);
+  }
+  return result;
+}
+
+
+static void SetNonBlockingMode(SOCKET s, bool nonBlocking) {
+  AcquireSRWLockExclusive(&nonBlockingLock);
+  SOCKET *slot = nullptr;
+  for (auto &entry : nonBlockingSockets) {
+    if (entry == s) {
+      slot = &entry;
+      break;
+    }
+    else if (!entry && !slot) {
+      slot = &entry;
+    }
+  }
+  if (slot && (nonBlocking || *slot == s)) {
+    *slot = nonBlocking ? s : 0;
+  }
+  ReleaseSRWLockExclusive(&nonBlockingLock);
+}
+
+
+static bool IsNonBlockingMode(SOCKET s) {
+  AcquireSRWLockShared(&nonBlockingLock);
+  bool result = std::find(std::begin(nonBlockingSockets), std::end(nonBlockingSockets),
+                          s) != std::end(nonBlockingSockets);
+  ReleaseSRWLockShared(&nonBlockingLock);
+  return result;
+}
+
+
+// The game may import Winsock functions from either DLL, by name or by ordinal
+static std::shared_ptr<patch> PatchWinsockImport(const char *name, WORD ordinal,
+                                                 const void *newFunction) {
+  static const char *dllNames[] = { "wsock32.dll", "ws2_32.dll" };
+
+  std::shared_ptr<patch> result;
+  for (size_t i = 0; i < _countof(dllNames) && !result; ++i) {
+    if (!(result = PatchImportedFunction(dllNames[i], name, newFunction))) {
+      result = PatchImportedFunction(dllNames[i], ordinal, newFunction);
+    }
+  }
+  return result;
+}
+
+
+bool SetTransportPatches(bool enable) {
+  static std::vector<std::shared_ptr<patch>> patches;
 
   if (enable) {
     if (patches.empty()) {
-      std::shared_ptr<patch> curPatch;
-      for (int i = 0; i < _countof(bindCalls); ++i) {
-        if (!(curPatch = PatchFunctionCall(FixPtr(bindCalls[i]), &BindWrapper))) {
-          SetBindPatches(false);
-          return false;
+      std::shared_ptr<patch> sendToPatch, recvFromPatch;
+      if (!(sendToPatch   = PatchWinsockImport("sendto",   20, &SendToWrapper)) ||
+          !(recvFromPatch = PatchWinsockImport("recvfrom", 17, &RecvFromWrapper))) {
+        if (sendToPatch) {
+          Unpatch(sendToPatch);
         }
-        else {
+        return false;
+      }
+      patches.emplace_back(std::move(sendToPatch));
+      patches.emplace_back(std::move(recvFromPatch));
+
+      // The rest are only needed by queued datagrams and the receive engine, and
+      // the game may not import all of them
+      static const struct {
+        const char *name;
+        WORD        ordinal;
+        const void *newFunction;
+      } optional[] = {
+        { "select",      18, &SelectWrapper      },
+        { "closesocket",  3, &CloseSocketWrapper },
+        { "ioctlsocket", 12, &IoctlSocketWrapper }
+      };
+      for (auto &entry : optional) {
+        std::shared_ptr<patch> curPatch =
+          PatchWinsockImport(entry.name, entry.ordinal, entry.newFunction);
+        if (curPatch) {
           patches.emplace_back(std::move(curPatch));
         }
       }
@@ -54,12 +511,47 @@ bool SetBindPatches(bool enable) {
 }
 
 
+void SetDisplayedAddresses(const char *internal, const char *external) {
+  AcquireSRWLockExclusive(&addressLock);
+  strcpy_s(internalIp, sizeof(internalIp), internal);
+  strcpy_s(externalIp, sizeof(externalIp), external);
+  ReleaseSRWLockExclusive(&addressLock);
+}
+
+
+bool IsExternalIpDisplayed() {
+  AcquireSRWLockShared(&addressLock);
+  bool result = (externalIp[0] != '\0');
+  ReleaseSRWLockShared(&addressLock);
+  return result;
+}
+
+
 bool __fastcall GetAddressString(void *thisPtr, int, char *buffer, size_t len) {
-  if (PortForwarder::externalIp[0]) {
-    return strcpy_s(buffer, len, PortForwarder::externalIp) == 0;
+  if (GetRelayAddress(buffer, len)) {
+    // Only while the game can't be reached at the gateway's address
+    return true;
   }
-  else if (PortForwarder::internalIp[0]) {
-    return strcpy_s(buffer, len, PortForwarder::internalIp) == 0;
+
+  char internal[INET6_ADDRSTRLEN],
+       external[INET6_ADDRSTRLEN];
+  AcquireSRWLockShared(&addressLock);
+  strcpy_s(internal, sizeof(internal), internalIp);
+  strcpy_s(external, sizeof(external), externalIp);
+  ReleaseSRWLockShared(&addressLock);
+
+  if (external[0]) {
+    // Hosts that share a NAT with another NetHelper host may use other ports
+    int port = GetExternalFirstPort();
+    return (port != 0) ? sprintf_s(buffer, len, "%s:%d", external, port) > 0 :
+                         strcpy_s(buffer, len, external) == 0;
+  }
+  else if (GetStunAddress(buffer, len)) {
+    // No gateway reported the external address, but a STUN server did
+    return true;
+  }
+  else if (internal[0]) {
+    return strcpy_s(buffer, len, internal) == 0;
   }
   else {
     // Fall back to original function
@@ -72,19 +564,38 @@ bool __fastcall GetAddressString(void *thisPtr, int, char *buffer, size_t len) {
 }
 
 
+// Finds the game's pointer to its local IP address message. Checks the known
+// location first, then falls back to scanning for any pointer to the string.
+static char** FindIpMessage() {
+  static const char message[] = "Your local IP address is %s.";
+
+  void *text = FindSignature(MakeSignature(message, sizeof(message)).c_str(),
+                             scanReadOnlyData | scanData);
+  if (!text) {
+    return nullptr;
+  }
+
+  auto **known = reinterpret_cast<char**>(FixPtr(0x4E9220));
+  if (*known == text) {
+    return known;
+  }
+  return static_cast<char**>(FindSignature(MakeSignature(&text, sizeof(text)).c_str(),
+                                           scanData));
+}
+
+
 bool SetGetIPPatch(bool enable) {
   static std::shared_ptr<patch> getIpPatch,
                                 ipMsgPatch;
+  char **ipMessage;
 
   if (enable) {
     if (!(getIpPatch ||
-          (getIpPatch = PatchFunctionVirtual(FixPtr(0x4D64F8), FixPtr(0x491400),
-                                             &GetAddressString))) ||
-        (strcmp(*reinterpret_cast<char**>(FixPtr(0x4E9220)),
-                                          "Your local IP address is %s.") == 0 &&
-         !(ipMsgPatch ||
-           (ipMsgPatch = Patch<char*>(FixPtr(0x4E9220),
-                                      "Your IP address is %s."))))) {
+          (getIpPatch = PatchFunctionVirtual(
+             FixPtr(0x4D64F8), FixPtr(0x491400),
+             reinterpret_cast<const void*>(&GetAddressString)))) ||
+        (!ipMsgPatch && (ipMessage = FindIpMessage()) != nullptr &&
+         !(ipMsgPatch = Patch<char*>(ipMessage, "Your IP address is %s.")))) {
       SetGetIPPatch(false);
       return false;
     }
@@ -3,7 +3,15 @@
 #ifndef NETPATCHES_H
 #define NETPATCHES_H
 
-bool SetBindPatches(bool enable);
+// If bindAll is false, sockets are bound as usual, but still get the socket policy
+bool SetBindPatches(bool enable, bool bindAll = true);
+// Hooks the transport's sendto, recvfrom, and select imports
+bool SetTransportPatches(bool enable);
 bool SetGetIPPatch(bool enable);
 
+// Sets the primary gateway's addresses, which the game displays as this computer's
+// unless it is only reachable through the relay. Either may be empty.
+void SetDisplayedAddresses(const char *internalIp, const char *externalIp);
+bool IsExternalIpDisplayed();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+// Keeps per-peer latency, jitter, and loss stats in a shared memory segment
+
+#include <winsock2.h>
+#include "NetStats.h"
+#include "PerfCounter.h"
+#include "odprintf.h"
+
+static HANDLE hMapping = nullptr;
+static NetStatsHeader *header = nullptr;
+static NetPeerStats *entries = nullptr;
+
+static volatile bool enabled = false;
+static volatile LONG activeWriters = 0;
+
+static NetPeerStats* BeginWrite(int peerId, const sockaddr *peer);
+static void EndWrite(NetPeerStats *entry);
+static void OnPeerEvicted(int peerId);
+
+
+bool StartNetStats() {
+  if (header) {
+    return true;
+  }
+
+  char name[64];
+  sprintf_s(name, sizeof(name), "Local\\NetHelperStats.%u", GetCurrentProcessId());
+
+  DWORD size = sizeof(NetStatsHeader) + sizeof(NetPeerStats) * PeerTable::MaxPeers;
+  if (!(hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                      0, size, name)) ||
+      !(header = static_cast<NetStatsHeader*>(
+          MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, size)))) {
+    StopNetStats();
+    return false;
+  }
+
+  // Pagefile-backed views start out zeroed
+
+  header->version    = netStatsVersion;
+  header->headerSize = sizeof(NetStatsHeader);
+  header->entrySize  = sizeof(NetPeerStats);
+  header->maxPeers   = PeerTable::MaxPeers;
+  header->processId  = GetCurrentProcessId();
+  header->frequency  = GetCounterFrequency();
+  entries = reinterpret_cast<NetPeerStats*>(header + 1);
+  MemoryBarrier();
+  header->magic = netStatsMagic;
+
+  PeerTable::AddEvictCallback(OnPeerEvicted);
+  enabled = true;
+  odprintf("NetHelper: Publishing peer stats to %s", name);
+  return true;
+}
+
+
+void StopNetStats() {
+  enabled = false;
+  while (activeWriters > 0) {
+    Sleep(1);
+  }
+
+  if (header) {
+    UnmapViewOfFile(header);
+    header  = nullptr;
+    entries = nullptr;
+  }
+  if (hMapping) {
+    CloseHandle(hMapping);
+    hMapping = nullptr;
+  }
+}
+
+
+bool IsNetStatsEnabled() {
+  return enabled;
+}
+
+
+void NetStatsOnSend(const sockaddr *to, int toLen, int bytes) {
+  if (!enabled) {
+    return;
+  }
+
+  InterlockedIncrement(&activeWriters);
+  NetPeerStats *entry;
+  if (enabled && (entry = BeginWrite(PeerTable::GetPeerId(to, toLen), to))) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    ++entry->packetsSent;
+    entry->bytesSent += bytes;
+    if (entry->lastSendCounter == 0) {
+      entry->lastSendCounter = now.QuadPart;
+    }
+    EndWrite(entry);
+  }
+  InterlockedDecrement(&activeWriters);
+}
+
+
+void NetStatsOnRecv(const sockaddr *from, int fromLen, int bytes) {
+  if (!enabled) {
+    return;
+  }
+
+  InterlockedIncrement(&activeWriters);
+  NetPeerStats *entry;
+  if (enabled && (entry = BeginWrite(PeerTable::FindPeerId(from, fromLen), from))) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    ++entry->packetsRecv;
+    entry->bytesRecv += bytes;
+
+    if (entry->lastRecvCounter) {
+      // Smoothed like RFC 3550 jitter, but from the inter-arrival times alone,
+      // since game packets don't carry a send timestamp
+      DWORD interval = static_cast<DWORD>(
+        CounterToMicroseconds(now.QuadPart - entry->lastRecvCounter));
+      if (entry->intervalUs == 0) {
+        entry->intervalUs = interval;
+      }
+      else {
+        // A gap is a silence much longer than usual, which is likely loss
+        if (interval > 4 * entry->intervalUs && interval > 100000) {
+          ++entry->gaps;
+        }
+        LONG deviation = static_cast<LONG>(interval - entry->intervalUs);
+        if (deviation < 0) {
+          deviation = -deviation;
+        }
+        entry->jitterUs += (deviation - static_cast<LONG>(entry->jitterUs)) / 16;
+        entry->intervalUs += (static_cast<LONG>(interval - entry->intervalUs)) / 8;
+      }
+    }
+    entry->lastRecvCounter = now.QuadPart;
+
+    // Treat the first packet back since an unanswered send as its reply
+    if (entry->lastSendCounter) {
+      DWORD rtt = static_cast<DWORD>(
+        CounterToMicroseconds(now.QuadPart - entry->lastSendCounter));
+      entry->rttUs = entry->rttUs ?
+        entry->rttUs + (static_cast<LONG>(rtt - entry->rttUs)) / 8 : rtt;
+      if (entry->rttMinUs == 0 || rtt < entry->rttMinUs) {
+        entry->rttMinUs = rtt;
+      }
+      entry->lastSendCounter = 0;
+    }
+    EndWrite(entry);
+  }
+  InterlockedDecrement(&activeWriters);
+}
+
+
+void NetStatsOnCompress(int peerId, int rawBytes, int wireBytes) {
+  if (!enabled) {
+    return;
+  }
+
+  InterlockedIncrement(&activeWriters);
+  NetPeerStats *entry;
+  sockaddr_in peer;
+  if (enabled && PeerTable::GetPeerAddress(peerId, &peer) &&
+      (entry = BeginWrite(peerId, reinterpret_cast<sockaddr*>(&peer)))) {
+    entry->compressRawBytes  += rawBytes;
+    entry->compressWireBytes += wireBytes;
+    EndWrite(entry);
+  }
+  InterlockedDecrement(&activeWriters);
+}
+
+
+void NetStatsSetHostAdvice(int peerId, DWORD maxRttUs) {
+  if (!enabled) {
+    return;
+  }
+
+  // Only the host advisor's thread writes these
+  InterlockedIncrement(&activeWriters);
+  if (enabled) {
+    InterlockedIncrement(&header->adviceSequence);
+    header->advisedPeerId   = peerId;
+    header->advisedMaxRttUs = maxRttUs;
+    InterlockedIncrement(&header->adviceSequence);
+  }
+  InterlockedDecrement(&activeWriters);
+}
+
+
+bool GetNetPeerStats(int peerId, NetPeerStats *out) {
+  if (!entries || peerId < 0 || peerId >= PeerTable::MaxPeers || !out) {
+    return false;
+  }
+
+  const NetPeerStats &entry = entries[peerId];
+  for (;;) {
+    LONG before = entry.sequence;
+    if (before & 1) {
+      YieldProcessor();
+      continue;
+    }
+    _ReadWriteBarrier();
+    memcpy(out, const_cast<NetPeerStats*>(&entry), sizeof(*out));
+    _ReadWriteBarrier();
+    if (entry.sequence == before) {
+      return before != 0;
+    }
+  }
+}
+
+
+// The send and receive threads may update the same peer, so writers take the
+// entry by making its sequence odd; readers never block writers
+static NetPeerStats* BeginWrite(int peerId, const sockaddr *peer) {
+  if (peerId < 0) {
+    return nullptr;
+  }
+
+  NetPeerStats *entry = &entries[peerId];
+  for (;;) {
+    LONG sequence = entry->sequence;
+    if (!(sequence & 1) &&
+        InterlockedCompareExchange(&entry->sequence, sequence + 1, sequence) ==
+          sequence) {
+      break;
+    }
+    YieldProcessor();
+  }
+
+  if (entry->peerAddress == 0) {
+    auto *peerIn = reinterpret_cast<const sockaddr_in*>(peer);
+    entry->peerAddress = peerIn->sin_addr.s_addr;
+    entry->peerPort    = peerIn->sin_port;
+  }
+  return entry;
+}
+
+
+static void EndWrite(NetPeerStats *entry) {
+  InterlockedIncrement(&entry->sequence);
+}
+
+
+// Clears the stats of an evicted peer, so its ID starts afresh for the next one
+static void OnPeerEvicted(int peerId) {
+  InterlockedIncrement(&activeWriters);
+  sockaddr_in none = {};
+  NetPeerStats *entry;
+  if (enabled && (entry = BeginWrite(peerId, reinterpret_cast<sockaddr*>(&none)))) {
+    LONG sequence = entry->sequence;
+    memset(entry, 0, sizeof(*entry));
+    entry->sequence = sequence;
+    EndWrite(entry);
+  }
+  InterlockedDecrement(&activeWriters);
+}
@@ -0,0 +1,72 @@
+
+#ifndef NETSTATS_H
+#define NETSTATS_H
+
+#include <winsock2.h>
+#include "PeerTable.h"
+
+// Per-peer transport statistics, published in a named shared memory segment so
+// that an external overlay or tool can poll them while the game is running.
+//
+// The segment is named "Local\NetHelperStats.<process ID>" and holds a
+// NetStatsHeader followed by maxPeers NetPeerStats entries, indexed by PeerTable
+// ID. Each entry is guarded by a sequence lock: readers copy the entry, and retry
+// if its sequence was odd or changed while copying. When a peer that went idle is
+// evicted from the PeerTable, its entry is cleared for the next peer to use.
+
+const DWORD netStatsMagic   = 0x5453324F;  // "O2ST"
+const WORD  netStatsVersion = 2;
+
+struct NetStatsHeader {
+  DWORD    magic;
+  WORD     version;
+  WORD     headerSize;  // sizeof(NetStatsHeader)
+  DWORD    entrySize;   // sizeof(NetPeerStats)
+  DWORD    maxPeers;
+  DWORD    processId;
+  DWORD    reserved;
+  LONGLONG frequency;   // QueryPerformanceFrequency
+  // Version 2: host advice (see HostAdvisor.h), guarded by its own sequence lock
+  volatile LONG adviceSequence;
+  LONG     advisedPeerId;    // -1 for this computer, -2 for an indirect peer
+  DWORD    advisedMaxRttUs;  // 0 while there is no advice
+  BYTE     padding[20];
+};
+
+struct __declspec(align(64)) NetPeerStats {
+  volatile LONG sequence;    // Odd while being written
+  DWORD     peerAddress;     // IPv4, network byte order
+  WORD      peerPort;        // Network byte order
+  WORD      reserved;
+  DWORD     gaps;            // Receive gaps much longer than the usual interval
+  ULONGLONG packetsSent,
+            packetsRecv,
+            bytesSent,
+            bytesRecv;
+  DWORD     jitterUs;        // Smoothed inter-arrival time variation
+  DWORD     intervalUs;      // Smoothed inter-arrival time
+  DWORD     rttUs;           // Smoothed send-to-reply time
+  DWORD     rttMinUs;
+  LONGLONG  lastSendCounter; // Oldest send not yet answered, or 0
+  LONGLONG  lastRecvCounter;
+  ULONGLONG compressRawBytes,   // Bytes sent compressed, before compression
+            compressWireBytes;  // The same after compression
+};
+
+// Creates the shared memory segment and starts collecting stats
+bool StartNetStats();
+void StopNetStats();
+bool IsNetStatsEnabled();
+
+// Called from the transport's sendto and recvfrom hooks
+void NetStatsOnSend(const sockaddr *to, int toLen, int bytes);
+void NetStatsOnRecv(const sockaddr *from, int fromLen, int bytes);
+// Called when a datagram to a peer was sent compressed
+void NetStatsOnCompress(int peerId, int rawBytes, int wireBytes);
+// Publishes which player should host
+void NetStatsSetHostAdvice(int peerId, DWORD maxRttUs);
+
+// Takes a consistent snapshot of a peer's stats. Returns false if unused.
+bool GetNetPeerStats(int peerId, NetPeerStats *out);
+
+#endif
@@ -0,0 +1,142 @@
+// Captures the game's packets into a memory-mapped ring file for offline replay
+
+#include <winsock2.h>
+#include "PacketCapture.h"
+#include "PeerTable.h"
+#include "odprintf.h"
+
+static HANDLE hFile    = INVALID_HANDLE_VALUE,
+              hMapping = nullptr;
+static CaptureFileHeader *header = nullptr;
+static BYTE *slots = nullptr;
+
+static volatile bool capturing = false;
+static volatile LONG activeWriters = 0;
+
+
+bool StartCapture(const char *fileName, size_t sizeBytes, int snapLen) {
+  if (header || !fileName || !fileName[0] || snapLen <= 0 || snapLen > 65536) {
+    return false;
+  }
+
+  // Keep slots 16-byte aligned
+  DWORD slotSize  = (sizeof(CaptureRecord) + snapLen + 15) & ~15,
+        slotCount = static_cast<DWORD>(
+          (sizeBytes > sizeof(CaptureFileHeader) ?
+             sizeBytes - sizeof(CaptureFileHeader) : 0) / slotSize);
+  if (slotCount == 0) {
+    return false;
+  }
+  DWORD fileSize = sizeof(CaptureFileHeader) + slotCount * slotSize;
+
+  hFile = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                      nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  // Size the file up front so the hot path never has to grow it
+  if (!(hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READWRITE, 0, fileSize,
+                                      nullptr)) ||
+      !(header = static_cast<CaptureFileHeader*>(
+          MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, fileSize)))) {
+    StopCapture();
+    return false;
+  }
+
+  memset(header, 0, sizeof(*header));
+  header->magic      = captureMagic;
+  header->version    = captureVersion;
+  header->headerSize = sizeof(CaptureFileHeader);
+  header->slotSize   = slotSize;
+  header->slotCount  = slotCount;
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  header->frequency    = frequency.QuadPart;
+  header->startCounter = counter.QuadPart;
+  GetSystemTimeAsFileTime(&header->startTime);
+
+  slots = reinterpret_cast<BYTE*>(header) + sizeof(CaptureFileHeader);
+  capturing = true;
+
+  odprintf("NetHelper: Capturing packets to %s (%u slots of %u bytes)", fileName,
+           slotCount, slotSize);
+  return true;
+}
+
+
+void StopCapture() {
+  capturing = false;
+  while (activeWriters > 0) {
+    Sleep(1);
+  }
+
+  if (header) {
+    FlushViewOfFile(header, 0);
+    UnmapViewOfFile(header);
+    header = nullptr;
+    slots  = nullptr;
+  }
+  if (hMapping) {
+    CloseHandle(hMapping);
+    hMapping = nullptr;
+  }
+  if (hFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(hFile);
+    hFile = INVALID_HANDLE_VALUE;
+  }
+}
+
+
+bool IsCapturing() {
+  return capturing;
+}
+
+
+void CapturePacket(CaptureDirection direction, SOCKET s, const sockaddr *peer,
+                   int peerLen, const char *data, int len) {
+  if (!capturing || len < 0) {
+    return;
+  }
+
+  InterlockedIncrement(&activeWriters);
+  if (capturing) {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    // Claim a slot; the sequence is only published once the slot is filled in
+    LONG sequence = InterlockedIncrement(&header->lastSequence);
+    auto *record = reinterpret_cast<CaptureRecord*>(
+      slots + (static_cast<DWORD>(sequence - 1) % header->slotCount) *
+              header->slotSize);
+    InterlockedExchange(&record->sequence, 0);
+
+    DWORD maxLen = header->slotSize - sizeof(CaptureRecord);
+    record->capturedLen = static_cast<DWORD>(len) < maxLen ? len : maxLen;
+    record->originalLen = len;
+    record->direction   = static_cast<BYTE>(direction);
+    record->socket      = static_cast<DWORD>(s);
+    record->counter     = counter.QuadPart;
+
+    int peerId = (direction == captureSend) ? PeerTable::GetPeerId(peer, peerLen) :
+                                              PeerTable::FindPeerId(peer, peerLen);
+    record->peerId = peerId >= 0 ? static_cast<BYTE>(peerId) : 0xFF;
+    if (peerId >= 0) {
+      auto *peerIn = reinterpret_cast<const sockaddr_in*>(peer);
+      record->peerAddress = peerIn->sin_addr.s_addr;
+      record->peerPort    = peerIn->sin_port;
+    }
+    else {
+      record->peerAddress = 0;
+      record->peerPort    = 0;
+    }
+
+    if (data && record->capturedLen) {
+      memcpy(record + 1, data, record->capturedLen);
+    }
+
+    InterlockedExchange(&record->sequence, sequence);
+  }
+  InterlockedDecrement(&activeWriters);
+}
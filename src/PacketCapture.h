@@ -0,0 +1,61 @@
+
+#ifndef PACKETCAPTURE_H
+#define PACKETCAPTURE_H
+
+#include <winsock2.h>
+
+// Packet capture file format. All fields are little endian.
+//
+// The file is a CaptureFileHeader followed by slotCount fixed-size slots, each a
+// CaptureRecord followed by up to (slotSize - sizeof(CaptureRecord)) bytes of
+// packet data. Slots are reused as a ring once the file is full. To read a
+// capture, collect the slots with a nonzero sequence and sort them by it; gaps
+// are slots that were being written when the capture stopped.
+// Timestamps are QueryPerformanceCounter values; (counter - startCounter) /
+// frequency is the number of seconds since startTime.
+
+const DWORD captureMagic   = 0x4350324F;  // "O2PC"
+const WORD  captureVersion = 1;
+
+enum CaptureDirection {
+  captureSend = 0,
+  captureRecv
+};
+
+struct CaptureFileHeader {
+  DWORD    magic;
+  WORD     version;
+  WORD     headerSize;      // sizeof(CaptureFileHeader)
+  DWORD    slotSize;        // Bytes per slot, including the CaptureRecord
+  DWORD    slotCount;
+  LONGLONG frequency;       // QueryPerformanceFrequency
+  LONGLONG startCounter;    // QueryPerformanceCounter when the capture started
+  FILETIME startTime;       // UTC
+  volatile LONG lastSequence;  // Sequence of the most recently claimed slot
+  DWORD    reserved;
+};
+
+struct CaptureRecord {
+  volatile LONG sequence;   // 1-based; 0 while the slot is being written
+  DWORD    capturedLen;     // Bytes of packet data stored in this slot
+  DWORD    originalLen;     // Bytes the game actually sent or received
+  BYTE     direction;       // CaptureDirection
+  BYTE     peerId;          // PeerTable ID, or 0xFF if unknown
+  WORD     peerPort;        // Network byte order
+  DWORD    peerAddress;     // IPv4, network byte order
+  DWORD    socket;
+  LONGLONG counter;         // QueryPerformanceCounter
+};
+
+// Creates the capture file and starts capturing. sizeBytes is rounded down to a
+// whole number of slots; snapLen is the most packet data kept per packet.
+bool StartCapture(const char *fileName, size_t sizeBytes, int snapLen = 1500);
+// Waits for in-progress writes, then closes the capture file
+void StopCapture();
+bool IsCapturing();
+
+// Copies a packet into the next slot. Does not allocate or take locks.
+void CapturePacket(CaptureDirection direction, SOCKET s, const sockaddr *peer,
+                   int peerLen, const char *data, int len);
+
+#endif
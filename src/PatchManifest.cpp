@@ -0,0 +1,347 @@
+// Loads declarative patch manifests and applies them as all-or-nothing groups
+
+#include <windows.h>
+#include "PatchManifest.h"
+#include "odprintf.h"
+#include <string>
+#include <unordered_map>
+
+using namespace Patcher;
+
+static const char manifestMagic[] = "NetHelperPatches";
+static const int  manifestVersion = 1;
+
+namespace {
+
+enum EntryType {
+  entryBytes,
+  entryHook,
+  entryCall     // Rewrites a call instruction's target, leaving the callee alone
+};
+
+struct ManifestEntry {
+  EntryType         type;
+  int               line;
+  std::string       module;       // Empty for the game executable
+  uintptr_t         address;      // Preferred address, if no signature
+  std::string       signature;
+  int               offset;       // Added to the signature match
+  std::vector<BYTE> expected,
+                    replacement;
+  std::string       hook;
+};
+
+typedef std::unordered_map<std::string, std::vector<ManifestEntry>> ManifestGroups;
+
+struct ManifestHook {
+  const void *function;
+  void       *original;
+};
+
+} // anonymous namespace
+
+static std::unordered_map<std::string, ManifestHook> hooks;
+static ManifestGroups loadedGroups;
+
+static bool ParseManifest(const char *text, const char *name, ManifestGroups *out);
+static bool ResolveEntry(const ManifestEntry &entry, BYTE **addressOut);
+static const void* GetCallTarget(const BYTE *callAddress);
+
+
+void RegisterManifestHook(const char *name, const void *function, void *original) {
+  ManifestHook hook = { function, original };
+  hooks[name] = hook;
+}
+
+
+bool LoadPatchManifest(const char *fileName) {
+  HANDLE hFile = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    odprintf("NetHelper: Could not open patch manifest %s", fileName);
+    return false;
+  }
+
+  std::string text;
+  char  buffer[4096];
+  DWORD bytesRead;
+  while (ReadFile(hFile, buffer, sizeof(buffer), &bytesRead, nullptr) && bytesRead) {
+    text.append(buffer, bytesRead);
+  }
+  CloseHandle(hFile);
+
+  ManifestGroups groups;
+  if (!ParseManifest(text.c_str(), fileName, &groups)) {
+    return false;
+  }
+  loadedGroups.swap(groups);
+  return true;
+}
+
+
+void UnloadPatchManifest() {
+  loadedGroups.clear();
+}
+
+
+bool ApplyPatchGroup(const char *group, const char *builtInManifest,
+                     std::vector<std::shared_ptr<patch>> *out) {
+  const std::vector<ManifestEntry> *entries = nullptr;
+  ManifestGroups builtInGroups;
+
+  auto it = loadedGroups.find(group);
+  if (it != loadedGroups.end()) {
+    entries = &it->second;
+  }
+  else if (builtInManifest &&
+           ParseManifest(builtInManifest, "built-in manifest", &builtInGroups) &&
+           (it = builtInGroups.find(group)) != builtInGroups.end()) {
+    entries = &it->second;
+  }
+  if (!entries) {
+    odprintf("NetHelper: No patches for %s", group);
+    return false;
+  }
+
+  // Validate the whole group against the image before changing anything
+  std::vector<BYTE*> addresses(entries->size());
+  std::unordered_map<std::string, const void*> callees;
+  for (size_t i = 0; i < entries->size(); ++i) {
+    const ManifestEntry &entry = (*entries)[i];
+    bool valid = (entry.type == entryBytes || hooks.count(entry.hook)) &&
+                 ResolveEntry(entry, &addresses[i]);
+
+    // Call sites sharing a hook must all call the same function, which is what the
+    // hook's original gets
+    if (valid && entry.type == entryCall) {
+      const void *callee = GetCallTarget(addresses[i]);
+      auto calleeIt = callees.find(entry.hook);
+      valid = calleeIt == callees.end() || calleeIt->second == callee;
+      callees[entry.hook] = callee;
+    }
+
+    if (!valid) {
+      odprintf("NetHelper: Patch on line %d of %s doesn't match this game build",
+               entry.line, group);
+      return false;
+    }
+  }
+
+  // Create everything disabled, then enable as one group
+  std::vector<std::shared_ptr<patch>> patches;
+  bool result = true;
+  for (size_t i = 0; result && i < entries->size(); ++i) {
+    const ManifestEntry &entry = (*entries)[i];
+    std::shared_ptr<patch> curPatch =
+      (entry.type == entryBytes) ?
+        Patch(addresses[i], entry.replacement.size(), entry.replacement.data(),
+              entry.expected.empty() ? nullptr : entry.expected.data(), false) :
+      (entry.type == entryCall) ?
+        PatchFunctionCall(addresses[i], hooks[entry.hook].function, false) :
+        PatchFunction(addresses[i], hooks[entry.hook].function, false);
+
+    if ((result = (curPatch != nullptr))) {
+      patches.emplace_back(std::move(curPatch));
+    }
+  }
+
+  if (!result || !EnablePatches(patches)) {
+    for (auto &curPatch : patches) {
+      Unpatch(curPatch);
+    }
+    odprintf("NetHelper: Could not apply patches for %s", group);
+    return false;
+  }
+
+  // Hand out trampolines and callees only once everything is in place
+  for (size_t i = 0; i < entries->size(); ++i) {
+    const ManifestEntry &entry = (*entries)[i];
+    if (entry.type != entryBytes && hooks[entry.hook].original) {
+      *static_cast<const void**>(hooks[entry.hook].original) =
+        (entry.type == entryCall) ? callees[entry.hook] :
+                                    patches[i]->GetTrampoline();
+    }
+  }
+
+  out->insert(out->end(), patches.begin(), patches.end());
+  return true;
+}
+
+
+// Splits a line into tokens, keeping quoted strings whole and dropping comments
+static std::vector<std::string> Tokenize(const std::string &line) {
+  std::vector<std::string> tokens;
+  for (size_t i = 0; i < line.size(); ) {
+    char c = line[i];
+    if (c == ';' || c == '#') {
+      break;
+    }
+    else if (isspace(static_cast<BYTE>(c))) {
+      ++i;
+    }
+    else if (c == '"') {
+      size_t end = line.find('"', i + 1);
+      if (end == std::string::npos) {
+        end = line.size();
+      }
+      tokens.push_back(line.substr(i, end - i));  // Keeps the opening quote
+      i = end + 1;
+    }
+    else {
+      size_t end = i;
+      while (end < line.size() && !isspace(static_cast<BYTE>(line[end]))) {
+        ++end;
+      }
+      tokens.push_back(line.substr(i, end - i));
+      i = end;
+    }
+  }
+  return tokens;
+}
+
+
+static bool ParseManifest(const char *text, const char *name, ManifestGroups *out) {
+  std::string module,
+              group;
+  int  lineNumber = 0;
+  bool haveHeader = false;
+
+  for (const char *p = text; *p; ) {
+    const char *end = p + strcspn(p, "\r\n");
+    auto tokens = Tokenize(std::string(p, end));
+    p = end + (end[0] == '\r' && end[1] == '\n' ? 2 : end[0] ? 1 : 0);
+    ++lineNumber;
+
+    if (tokens.empty()) {
+      continue;
+    }
+
+    const std::string &keyword = tokens[0];
+    bool valid = true;
+    if (!haveHeader) {
+      // Newer versions may use entries this one can't apply correctly
+      valid = haveHeader = (tokens.size() == 2 && keyword == manifestMagic &&
+                            atoi(tokens[1].c_str()) == manifestVersion);
+    }
+    else if (keyword == "group" && tokens.size() == 2) {
+      group = tokens[1];
+      module.clear();
+    }
+    else if (keyword == "module" && tokens.size() == 2) {
+      module = tokens[1];
+    }
+    else if ((keyword == "bytes" || keyword == "hook" || keyword == "call") &&
+             !group.empty() && tokens.size() >= 3) {
+      ManifestEntry entry = {};
+      entry.type   = (keyword == "bytes") ? entryBytes :
+                     (keyword == "call")  ? entryCall  : entryHook;
+      entry.line   = lineNumber;
+      entry.module = module;
+
+      size_t i = 1;
+      if (tokens[i] == "sig" && i + 1 < tokens.size() && tokens[i + 1][0] == '"') {
+        entry.signature = tokens[i + 1].substr(1);
+        i += 2;
+        if (i < tokens.size() && (tokens[i][0] == '+' || tokens[i][0] == '-')) {
+          entry.offset = static_cast<int>(strtol(tokens[i++].c_str(), nullptr, 0));
+        }
+      }
+      else {
+        char *numberEnd;
+        entry.address = strtoul(tokens[i].c_str(), &numberEnd, 16);
+        valid = (*numberEnd == '\0') && entry.address;
+        ++i;
+      }
+
+      if (entry.type != entryBytes) {
+        if ((valid = valid && (i + 1 == tokens.size()))) {
+          entry.hook = tokens[i];
+        }
+      }
+      else {
+        // [expect <hex bytes>] replace <hex bytes>
+        std::vector<BYTE> *bytes = nullptr;
+        for (; valid && i < tokens.size(); ++i) {
+          char *numberEnd;
+          if (tokens[i] == "expect" && !bytes) {
+            bytes = &entry.expected;
+          }
+          else if (tokens[i] == "replace" && bytes != &entry.replacement) {
+            bytes = &entry.replacement;
+          }
+          else if (bytes && tokens[i].size() == 2) {
+            bytes->push_back(static_cast<BYTE>(strtoul(tokens[i].c_str(),
+                                                       &numberEnd, 16)));
+            valid = (*numberEnd == '\0');
+          }
+          else {
+            valid = false;
+          }
+        }
+        valid = valid && !entry.replacement.empty() &&
+                (entry.expected.empty() ||
+                 entry.expected.size() == entry.replacement.size());
+      }
+
+      if (valid) {
+        (*out)[group].push_back(std::move(entry));
+      }
+    }
+    else {
+      valid = false;
+    }
+
+    if (!valid) {
+      odprintf("NetHelper: Invalid patch manifest entry on line %d of %s",
+               lineNumber, name);
+      out->clear();
+      return false;
+    }
+  }
+
+  return haveHeader;
+}
+
+
+// Finds where an entry applies in the loaded image, and checks its expected bytes
+static bool ResolveEntry(const ManifestEntry &entry, BYTE **addressOut) {
+  HMODULE module = entry.module.empty() ? reinterpret_cast<HMODULE>(-1) :
+                                          GetModuleHandleA(entry.module.c_str());
+  if (!module) {
+    return false;
+  }
+
+  BYTE *address;
+  if (!entry.signature.empty()) {
+    address = static_cast<BYTE*>(FindSignature(entry.signature.c_str(),
+                                               scanCode | scanReadOnlyData | scanData,
+                                               module));
+    if (address) {
+      address += entry.offset;
+    }
+  }
+  else {
+    address = static_cast<BYTE*>(FixPtr(entry.address, module));
+  }
+
+  if (!address || (!entry.expected.empty() &&
+                   memcmp(address, entry.expected.data(), entry.expected.size()) != 0)) {
+    return false;
+  }
+
+  // Call sites must still be a CALL near pcrel32
+  if (entry.type == entryCall && *address != 0xE8) {
+    return false;
+  }
+
+  *addressOut = address;
+  return true;
+}
+
+
+// Returns the function a CALL near pcrel32 instruction calls
+static const void* GetCallTarget(const BYTE *callAddress) {
+  LONG displacement;
+  memcpy(&displacement, callAddress + 1, sizeof(displacement));
+  return callAddress + 5 + displacement;
+}
@@ -0,0 +1,40 @@
+
+#ifndef PATCHMANIFEST_H
+#define PATCHMANIFEST_H
+
+#include "Patcher.h"
+#include <memory>
+#include <vector>
+
+// Patch manifests describe patches as data, so other game builds can be supported
+// by shipping a manifest instead of a new DLL. Example:
+//
+//   NetHelperPatches 1
+//   group bind
+//   module Outpost2.exe                      ; Optional; defaults to the game
+//   call  0x48C0FE bind                      ; Preferred address, relocated
+//   hook  sig "FF 25 ? ? ? ? FF 25" bind     ; Or first signature match
+//   bytes sig "74 1C 8B 4C 24" +0 expect 74 1C replace EB 1C
+//
+// Hooks refer to functions registered with RegisterManifestHook by name. A hook
+// replaces the function at the address, and a call redirects the call instruction
+// there; all calls to one hook must call the same function.
+// Each group is validated against the image as a whole, then applied all or
+// nothing.
+
+// Registers a hook function manifests can refer to. original (optional) points to
+// a function pointer that receives the trampoline for calling the original, or the
+// function the redirected calls called.
+void RegisterManifestHook(const char *name, const void *function,
+                          void *original = nullptr);
+
+// Loads a manifest file whose groups are used in place of the built-in ones
+bool LoadPatchManifest(const char *fileName);
+void UnloadPatchManifest();
+
+// Validates and applies the group from the loaded manifest if it has it, otherwise
+// from builtInManifest. Created patches are appended to out.
+bool ApplyPatchGroup(const char *group, const char *builtInManifest,
+                     std::vector<std::shared_ptr<Patcher::patch>> *out);
+
+#endif
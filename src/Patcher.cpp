@@ -4,21 +4,57 @@
 #ifdef PATCHER_MINHOOK
 #include "MinHook.h"
 #endif
+#include <tlhelp32.h>
 #include <unordered_map>
 #include <algorithm>
+#include <string>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PATCHER_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef PATCHER_MSVC
+#include <intrin.h>
+#define PATCHER_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define PATCHER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 namespace Patcher {
 
 static std::vector<std::shared_ptr<patch>> allPatches;
-static std::unordered_map<BYTE*, BYTE> originalBytes;
+// Bytes as they were before any patch, kept while patches covering them exist so
+// memory later reused for other code isn't restored to stale bytes
+struct OriginalByte {
+  BYTE value;
+  int  patches;
+};
+static std::unordered_map<BYTE*, OriginalByte> originalBytes;
 static std::unordered_map<HMODULE, uintptr_t> modulePrefAddr;
 static HMODULE baseModule = nullptr;
 #ifdef PATCHER_MINHOOK
 static int minHookCount = 0;
+#else
+static const size_t trampolineSlotSize  = 64,
+                    trampolineBlockSize = 0x10000;
+static std::vector<BYTE*> freeTrampolines;
 #endif
 
 static bool InitBaseModule();
 static HMODULE GetModuleFromAddress(void *address);
+static size_t GetModuleHash(HMODULE module);
+static bool FindTrackedModule(void *address, HMODULE &moduleOut, size_t &hashOut,
+                              LONG &generationOut);
+static void** FindImport(HMODULE module, const char *dllName,
+                         const char *functionName, WORD ordinal);
+#ifndef PATCHER_MINHOOK
+static BYTE* AllocTrampoline(const void *nearAddress);
+static void FreeTrampoline(void *trampoline);
+static size_t RelocateInstructions(const BYTE *source, BYTE *dest, size_t destSize,
+                                   size_t minSize, bool is64, size_t *written);
+#endif
 
 // Memory patch class functions
 
@@ -29,6 +65,7 @@ MemPatch::MemPatch(void *_address, size_t patchSize, const void *newBytes,
                    const void *expectedBytes, bool enable) {
   address = _address;
   size = patchSize;
+  hasOriginalBytes = false;
 
   if ((invalid = !address || !size || !newBytes)) {
     return;
@@ -51,10 +88,15 @@ MemPatch::MemPatch(void *_address, size_t patchSize, const void *newBytes,
     // Store old bytes in map if they weren't already
     for (size_t i = 0; i < size; ++i) {
       auto *p = reinterpret_cast<BYTE*>(address) + i;
-      if (originalBytes.count(p) == 0) {
-        originalBytes[p] = *p;
+      auto it = originalBytes.find(p);
+      if (it == originalBytes.end()) {
+        originalBytes[p] = { *p, 1 };
+      }
+      else {
+        ++(it->second.patches);
       }
     }
+    hasOriginalBytes = true;
   }
 
   VirtualProtect(address, size, oldAttr, &oldAttr);
@@ -73,6 +115,15 @@ MemPatch::MemPatch(void *_address, size_t patchSize, const void *newBytes,
 
 MemPatch::~MemPatch() {
   Disable();
+
+  if (hasOriginalBytes) {
+    for (size_t i = 0; i < size; ++i) {
+      auto it = originalBytes.find(reinterpret_cast<BYTE*>(address) + i);
+      if (--(it->second.patches) == 0) {
+        originalBytes.erase(it);
+      }
+    }
+  }
 }
 
 bool MemPatch::Enable(bool force) {
@@ -115,7 +166,7 @@ bool MemPatch::Disable(bool force) {
   }
   for (size_t i = 0; i < size; ++i) {
     auto *p = reinterpret_cast<BYTE*>(address) + i;
-    *p = originalBytes[p];
+    *p = originalBytes[p].value;
   }
   VirtualProtect(address, size, oldAttr, &oldAttr);
 
@@ -214,6 +265,25 @@ bool MHPatch::Disable(bool unused) {
 const void* MHPatch::GetTrampoline() {
   return !invalid ? trampoline : nullptr;
 }
+#else
+// Inline patch class functions
+
+InlinePatch::InlinePatch(void *function, const void *jumpBytes, size_t jumpSize,
+                         void *_trampoline, bool enable)
+  : MemPatch(function, jumpSize, jumpBytes, nullptr, enable) {
+  trampoline = _trampoline;
+}
+
+InlinePatch::~InlinePatch() {
+  // Remove the jump before anything can be left running in the trampoline
+  Disable();
+  FreeTrampoline(trampoline);
+}
+
+// Returns a pointer to the function trampoline
+const void* InlinePatch::GetTrampoline() {
+  return !invalid ? trampoline : nullptr;
+}
 #endif
 
 // Ensure the module associated with the patch address is still loaded
@@ -228,29 +298,42 @@ bool patch::VerifyModule() {
 
   HMODULE curModule;
   size_t curHash;
+  LONG generation;
+  if (FindTrackedModule(address, curModule, curHash, generation)) {
+    // Nothing has been loaded or unloaded since this was last verified
+    if (generation == verifiedGeneration) {
+      return true;
+    }
+    if (module == curModule && moduleHash == curHash) {
+      verifiedGeneration = generation;
+      return true;
+    }
+    return false;
+  }
+
   GetModuleInfo(curModule, curHash);
 
   return module == curModule && moduleHash == curHash;
 }
 
 void patch::GetModuleInfo(HMODULE &moduleOut, size_t &hashOut) {
-  if ((moduleOut = GetModuleFromAddress(address))) {
+  LONG generation;
+  if (FindTrackedModule(address, moduleOut, hashOut, generation)) {
+    if (InitBaseModule() && moduleOut == baseModule) {
+      hashOut = 0;
+    }
+    else if (!moduleOut) {
+      hashOut = moduleHash - 1;
+    }
+  }
+  else if ((moduleOut = GetModuleFromAddress(address))) {
     if (InitBaseModule() && moduleOut == baseModule) {
       // Base module is unloaded last, this sanity checking isn't necessary
       hashOut = 0;
       return;
     }
 
-    auto *header = reinterpret_cast<IMAGE_NT_HEADERS*>(
-      reinterpret_cast<uintptr_t>(moduleOut) +
-      reinterpret_cast<IMAGE_DOS_HEADER*>(moduleOut)->e_lfanew);
-
-    auto sizeOfCode = header->OptionalHeader.Magic
-      != IMAGE_NT_OPTIONAL_HDR64_MAGIC ? header->OptionalHeader.SizeOfCode :
-      reinterpret_cast<IMAGE_NT_HEADERS64*>(header)->OptionalHeader.SizeOfCode;
-
-    hashOut = std::hash<ULONGLONG>()(
-      (static_cast<ULONGLONG>(header->FileHeader.TimeDateStamp) << 32) + sizeOfCode);
+    hashOut = GetModuleHash(moduleOut);
   }
   else {
     hashOut = moduleHash - 1;
@@ -280,7 +363,8 @@ std::shared_ptr<patch> Patch(void *address, size_t patchSize, const void *newByt
 }
 
 
-// Inserts a jump instruction. Can use MinHook.
+// Hooks a function by inserting a jump to newFunction, relocating the overwritten
+// instructions to a trampoline. Can use MinHook.
 std::shared_ptr<patch> PatchFunction(void *address, const void *newFunction,
                                      bool enable) {
   if (!address || !newFunction) {
@@ -306,12 +390,56 @@ std::shared_ptr<patch> PatchFunction(void *address, const void *newFunction,
   } jmp32;
   #pragma pack(pop)
 
+  const bool is64 = sizeof(void*) == 8;
+
+  BYTE *slot = AllocTrampoline(address);
+  if (!slot) {
+    return nullptr;
+  }
+
+  // On x64, newFunction may be out of rel32 range, so jump to it through an
+  // absolute JMP [RIP+0] at the start of the trampoline slot
+  BYTE *jumpTarget = static_cast<BYTE*>(const_cast<void*>(newFunction)),
+       *trampoline = slot;
+  if (is64) {
+    slot[0] = 0xFF;
+    slot[1] = 0x25;
+    memset(&slot[2], 0, sizeof(DWORD));
+    memcpy(&slot[6], &newFunction, sizeof(void*));
+    jumpTarget = slot;
+    trampoline = slot + 16;
+  }
+
+  // Relocate the instructions the jump will overwrite, then jump back
+  size_t written  = 0,
+         copySize = RelocateInstructions(
+           static_cast<BYTE*>(address), trampoline,
+           trampolineSlotSize - (trampoline - slot) - sizeof(jmp32), sizeof(jmp32),
+           is64, &written);
+  if (copySize == 0) {
+    FreeTrampoline(trampoline);
+    return nullptr;
+  }
+
   jmp32.opcode = 0xE9; // JMP near pcrel32
-  jmp32.address = static_cast<DWORD>(reinterpret_cast<uintptr_t>(newFunction) -
+  jmp32.address = static_cast<DWORD>(
+    (reinterpret_cast<uintptr_t>(address) + copySize) -
+    (reinterpret_cast<uintptr_t>(trampoline) + written + sizeof(jmp32)));
+  memcpy(trampoline + written, &jmp32, sizeof(jmp32));
+  FlushInstructionCache(GetCurrentProcess(), slot, trampolineSlotSize);
+
+  jmp32.address = static_cast<DWORD>(reinterpret_cast<uintptr_t>(jumpTarget) -
                                      (reinterpret_cast<uintptr_t>(address) +
                                       sizeof(jmp32)));
 
-  return Patch(address, sizeof(jmp32), &jmp32, nullptr, enable);
+  auto result = std::make_shared<InlinePatch>(address, &jmp32, sizeof(jmp32),
+                                              trampoline, enable);
+  if (!result || !result->GetValid()) {
+    return nullptr;
+  }
+  allPatches.push_back(result);
+
+  return result;
 
   #endif
 }
@@ -330,15 +458,48 @@ std::shared_ptr<patch> PatchFunctionCall(void *address, const void *newFunction,
   } call32;
   #pragma pack(pop)
 
+  intptr_t displacement = reinterpret_cast<intptr_t>(newFunction) -
+                          (reinterpret_cast<intptr_t>(address) + sizeof(call32));
+  if (displacement != static_cast<INT32>(displacement)) {
+    // Out of reach of a rel32 on x64
+    return nullptr;
+  }
+
   call32.opcode = 0xE8; // CALL near pcrel32
-  call32.address = static_cast<DWORD>(reinterpret_cast<uintptr_t>(newFunction) -
-                                      (reinterpret_cast<uintptr_t>(address) +
-                                       sizeof(call32)));
+  call32.address = static_cast<DWORD>(displacement);
 
   return Patch(address, sizeof(call32), &call32, nullptr, enable);
 }
 
 
+// Replaces an import address table entry, found by DLL and function name
+std::shared_ptr<patch> PatchImportedFunction(const char *dllName,
+                                             const char *functionName,
+                                             const void *newFunction, bool enable,
+                                             HMODULE module) {
+  if (!dllName || !functionName || !newFunction) {
+    return nullptr;
+  }
+
+  void **entry = FindImport(module, dllName, functionName, 0);
+  return entry ?
+    Patch(entry, sizeof(void*), &newFunction, nullptr, enable) : nullptr;
+}
+
+// Replaces an import address table entry, found by DLL name and ordinal
+std::shared_ptr<patch> PatchImportedFunction(const char *dllName, WORD ordinal,
+                                             const void *newFunction, bool enable,
+                                             HMODULE module) {
+  if (!dllName || !ordinal || !newFunction) {
+    return nullptr;
+  }
+
+  void **entry = FindImport(module, dllName, nullptr, ordinal);
+  return entry ?
+    Patch(entry, sizeof(void*), &newFunction, nullptr, enable) : nullptr;
+}
+
+
 // Replaces virtual function table entry by function address
 std::shared_ptr<patch> PatchFunctionVirtual(void *vftableAddress,
                                             const void *oldFunction,
@@ -373,6 +534,42 @@ std::shared_ptr<patch> PatchFunctionVirtual(void *vftableAddress,
                enable);
 }
 
+// Replaces several virtual function table entries as a group
+bool PatchFunctionsVirtual(void *vftableAddress,
+                           const std::vector<VirtualHook> &hooks,
+                           std::vector<std::shared_ptr<patch>> *out, bool enable) {
+  if (!vftableAddress) {
+    return false;
+  }
+
+  // Create everything disabled so nothing is changed until all entries resolve
+  std::vector<std::shared_ptr<patch>> result;
+  bool success = true;
+  for (size_t i = 0; success && i < hooks.size(); ++i) {
+    const VirtualHook &hook = hooks[i];
+    std::shared_ptr<patch> curPatch = (hook.vftableEntryIndex >= 0) ?
+      PatchFunctionVirtual(vftableAddress, hook.vftableEntryIndex, hook.newFunction,
+                           false) :
+      PatchFunctionVirtual(vftableAddress, hook.oldFunction, hook.newFunction, false);
+
+    if ((success = (curPatch != nullptr))) {
+      result.emplace_back(std::move(curPatch));
+    }
+  }
+
+  if (!success || (enable && !EnablePatches(result))) {
+    for (auto &curPatch : result) {
+      Unpatch(curPatch);
+    }
+    return false;
+  }
+
+  if (out) {
+    out->insert(out->end(), result.begin(), result.end());
+  }
+  return true;
+}
+
 
 // Patches all references to a global variable/object in base relocation table
 bool PatchGlobalReferences(const void *oldGlobalAddress,
@@ -405,8 +602,8 @@ bool PatchGlobalReferences(const void *oldGlobalAddress,
     out = &result;
   }
 
-  std::vector<std::shared_ptr<patch>>::iterator first = out->end();
-  bool firstInserted = false;
+  // An index rather than an iterator, which adding patches would invalidate
+  size_t first = out->size();
 
   // Locate the base relocation table via the PE header
   auto *optionalHeader = &reinterpret_cast<IMAGE_NT_HEADERS*>(
@@ -432,7 +629,7 @@ bool PatchGlobalReferences(const void *oldGlobalAddress,
   }
 
   auto *baseRelocTable = reinterpret_cast<IMAGE_BASE_RELOCATION*>(
-    module + relocDataDir->VirtualAddress);
+    reinterpret_cast<uintptr_t>(module) + relocDataDir->VirtualAddress);
 
   // Relocation table starts with the first block's header
   IMAGE_BASE_RELOCATION *curBlock = baseRelocTable;
@@ -447,43 +644,37 @@ bool PatchGlobalReferences(const void *oldGlobalAddress,
 
     // Enumerate relocations, find references to the global and replace them
     for (size_t i = 0; i < numRelocs; ++i) {
-      void *address = reinterpret_cast<void*>(
+      void *location = reinterpret_cast<void*>(
         reinterpret_cast<uintptr_t>(module) + curBlock->VirtualAddress +
         relocArray[i].offset);
-      size_t ptrSize;
+      const void *target;
 
-      if (relocArray[i].type == IMAGE_REL_BASED_HIGHLOW) {
-        address = reinterpret_cast<void*>(
-          static_cast<uintptr_t>(*reinterpret_cast<DWORD*>(address)));
-        ptrSize = sizeof(DWORD);
+      // Only references of the native pointer size can point to the global
+      if (relocArray[i].type == IMAGE_REL_BASED_HIGHLOW && sizeof(void*) == 4) {
+        target = reinterpret_cast<const void*>(
+          static_cast<uintptr_t>(*reinterpret_cast<DWORD*>(location)));
       }
-      else if (relocArray[i].type == IMAGE_REL_BASED_DIR64) {
-        address = reinterpret_cast<void*>(
-          static_cast<uintptr_t>(*reinterpret_cast<ULONGLONG*>(address)));
-        ptrSize = sizeof(ULONGLONG);
+      else if (relocArray[i].type == IMAGE_REL_BASED_DIR64 && sizeof(void*) == 8) {
+        target = reinterpret_cast<const void*>(
+          static_cast<uintptr_t>(*reinterpret_cast<ULONGLONG*>(location)));
       }
       else {
         continue;
       }
 
-      if (address == oldGlobalAddress) {
+      if (target == oldGlobalAddress) {
         // Found a reference to the global we want to patch
         std::shared_ptr<patch> curPatch;
-        if ((curPatch = Patch(address, ptrSize, &newGlobalAddress,
+        if ((curPatch = Patch(location, sizeof(void*), &newGlobalAddress,
                               &oldGlobalAddress, enable))) {
           out->emplace_back(std::move(curPatch));
-
-          if (!firstInserted) {
-            first = out->end() - 1;
-            firstInserted = true;
-          }
         }
         else {
           // Clean up any previously created reference patches
-          for (auto it = first; it != out->end(); ++it) {
-            Unpatch(*it);
+          for (size_t j = first; j < out->size(); ++j) {
+            Unpatch((*out)[j]);
           }
-          out->erase(first, out->end());
+          out->erase(out->begin() + first, out->end());
           return false;
         }
       }
@@ -494,7 +685,135 @@ bool PatchGlobalReferences(const void *oldGlobalAddress,
       reinterpret_cast<uintptr_t>(curBlock) + curBlock->SizeOfBlock);
   }
 
-  return firstInserted;
+  return out->size() > first;
+}
+
+
+// Signature scanning
+
+namespace {
+
+struct Signature {
+  std::vector<BYTE> bytes,
+                    mask;      // 0xFF where the byte must match, 0 for wildcards
+  size_t anchor;               // Offset of the byte(s) used to prefilter matches
+  bool   anchorPair;           // Whether bytes[anchor + 1] is part of the prefilter
+  BYTE  *result;
+};
+
+// Matches cached per module; rebuilt if a different build is loaded at the address
+struct SignatureCache {
+  size_t moduleHash;
+  std::unordered_map<std::string, uintptr_t> rvas;  // 0 if not found
+};
+
+} // anonymous namespace
+
+static std::unordered_map<HMODULE, SignatureCache> signatureCaches;
+
+static bool ParseSignature(const char *text, Signature *out);
+static void ScanRange(BYTE *begin, size_t size, std::vector<Signature*> &pending);
+
+// Finds the first match of each IDA-style signature in one pass over the module
+size_t FindSignatures(const char *const *signatures, void **results, size_t count,
+                      int sections, HMODULE module) {
+  if (!signatures || !results) {
+    return 0;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    results[i] = nullptr;
+  }
+
+  if (module == reinterpret_cast<HMODULE>(-1)) {
+    if (!InitBaseModule()) {
+      return 0;
+    }
+    module = baseModule;
+  }
+  else if (!module) {
+    return 0;
+  }
+
+  auto base = reinterpret_cast<uintptr_t>(module);
+  SignatureCache &cache = signatureCaches[module];
+  size_t moduleHash = GetModuleHash(module);
+  if (cache.moduleHash != moduleHash) {
+    cache.moduleHash = moduleHash;
+    cache.rvas.clear();
+  }
+
+  // Answer what we can from the cache, and parse the rest
+  std::vector<Signature> parsed(count);
+  std::vector<Signature*> pending;
+  std::vector<std::string> keys(count);
+  size_t found = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!signatures[i]) {
+      continue;
+    }
+    keys[i] = std::to_string(sections) + ':' + signatures[i];
+    auto it = cache.rvas.find(keys[i]);
+    if (it != cache.rvas.end()) {
+      if (it->second) {
+        results[i] = reinterpret_cast<void*>(base + it->second);
+        ++found;
+      }
+    }
+    else if (ParseSignature(signatures[i], &parsed[i])) {
+      pending.push_back(&parsed[i]);
+    }
+  }
+
+  if (!pending.empty()) {
+    auto *ntHeaders = reinterpret_cast<IMAGE_NT_HEADERS*>(
+      base + reinterpret_cast<IMAGE_DOS_HEADER*>(module)->e_lfanew);
+    IMAGE_SECTION_HEADER *section = IMAGE_FIRST_SECTION(ntHeaders);
+
+    for (WORD i = 0; i < ntHeaders->FileHeader.NumberOfSections && !pending.empty();
+         ++i) {
+      DWORD characteristics = section[i].Characteristics;
+      int type =
+        (characteristics & (IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE)) ? scanCode :
+        !(characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA)              ? 0 :
+        (characteristics & IMAGE_SCN_MEM_WRITE) ? scanData : scanReadOnlyData;
+      size_t size = section[i].Misc.VirtualSize ? section[i].Misc.VirtualSize :
+                                                  section[i].SizeOfRawData;
+      if (type & sections) {
+        ScanRange(reinterpret_cast<BYTE*>(base + section[i].VirtualAddress), size,
+                  pending);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!parsed[i].bytes.empty()) {
+      cache.rvas[keys[i]] =
+        parsed[i].result ? reinterpret_cast<uintptr_t>(parsed[i].result) - base : 0;
+      if (parsed[i].result) {
+        results[i] = parsed[i].result;
+        ++found;
+      }
+    }
+  }
+
+  return found;
+}
+
+// Makes a signature that matches the given bytes exactly
+std::string MakeSignature(const void *bytes, size_t size) {
+  static const char hexDigits[] = "0123456789ABCDEF";
+
+  std::string result;
+  result.reserve(size * 3);
+  for (size_t i = 0; i < size; ++i) {
+    BYTE b = static_cast<const BYTE*>(bytes)[i];
+    if (i) {
+      result += ' ';
+    }
+    result += hexDigits[b >> 4];
+    result += hexDigits[b & 0xF];
+  }
+  return result;
 }
 
 
@@ -515,6 +834,28 @@ bool Unpatch(std::shared_ptr<patch> &which, bool doDelete, bool force) {
   return result;
 }
 
+// Enables or disables a group of patches, restoring the group's previous state if
+// any of them fail
+bool EnablePatches(const std::vector<std::shared_ptr<patch>> &patches, bool enable) {
+  std::vector<patch*> changed;
+
+  for (auto &curPatch : patches) {
+    if (!curPatch || curPatch->GetEnabled() == enable) {
+      continue;
+    }
+    if (!(enable ? curPatch->Enable() : curPatch->Disable())) {
+      for (auto it = changed.rbegin(); it != changed.rend(); ++it) {
+        enable ? (*it)->Disable() : (*it)->Enable();
+      }
+      return false;
+    }
+    changed.push_back(curPatch.get());
+  }
+
+  return true;
+}
+
+
 // Enables all unapplied patches and optionally reapplies enabled patches
 bool PatchAll(bool force) {
   bool result = true;
@@ -543,6 +884,184 @@ bool UnpatchAll(bool doDelete, bool force) {
 }
 
 
+// Module tracking
+
+namespace {
+
+struct TrackedModule {
+  uintptr_t begin,
+            end;
+  HMODULE   module;
+  size_t    hash;
+};
+
+// Immutable once published; replaced as a whole when a module is loaded/unloaded
+struct ModuleTable {
+  LONG generation;
+  std::vector<TrackedModule> modules;  // Sorted by address
+};
+
+struct DllNotificationData {
+  ULONG       flags;
+  const void *fullDllName;
+  const void *baseDllName;
+  void       *dllBase;
+  ULONG       sizeOfImage;
+};
+
+typedef void (CALLBACK *DllNotificationFunction)(ULONG reason,
+                                                 const DllNotificationData *data,
+                                                 void *context);
+typedef LONG (NTAPI *LdrRegisterDllNotificationFunction)(
+  ULONG flags, DllNotificationFunction function, void *context, void **cookie);
+typedef LONG (NTAPI *LdrUnregisterDllNotificationFunction)(void *cookie);
+
+const ULONG dllNotificationLoaded   = 1,
+            dllNotificationUnloaded = 2;
+
+} // anonymous namespace
+
+static ModuleTable *volatile moduleTable = nullptr;
+static std::vector<ModuleTable*> retiredTables;  // Freed when tracking stops
+static SRWLOCK moduleTableLock = SRWLOCK_INIT;
+static void *dllNotificationCookie = nullptr;
+
+// Publishes a copy of the current table with a module added or removed.
+// Must hold moduleTableLock.
+static void UpdateModuleTable(const TrackedModule *add, uintptr_t removeBase) {
+  ModuleTable *oldTable = moduleTable;
+  auto *newTable = new ModuleTable;
+  newTable->generation = oldTable ? oldTable->generation + 1 : 1;
+  if (oldTable) {
+    newTable->modules = oldTable->modules;
+  }
+
+  auto &modules = newTable->modules;
+  auto compare = [](const TrackedModule &a, uintptr_t b) { return a.begin < b; };
+  if (removeBase) {
+    auto it = std::lower_bound(modules.begin(), modules.end(), removeBase, compare);
+    if (it != modules.end() && it->begin == removeBase) {
+      modules.erase(it);
+    }
+  }
+  if (add) {
+    auto it = std::lower_bound(modules.begin(), modules.end(), add->begin, compare);
+    if (it != modules.end() && it->begin == add->begin) {
+      *it = *add;
+    }
+    else {
+      modules.insert(it, *add);
+    }
+  }
+
+  // Readers may still be using the old table, so keep it around
+  InterlockedExchangePointer(reinterpret_cast<void*volatile*>(&moduleTable), newTable);
+  if (oldTable) {
+    retiredTables.push_back(oldTable);
+  }
+}
+
+
+// Called with the loader lock held; must not call anything that loads modules
+static void CALLBACK OnDllNotification(ULONG reason, const DllNotificationData *data,
+                                       void *context) {
+  auto base = reinterpret_cast<uintptr_t>(data->dllBase);
+
+  AcquireSRWLockExclusive(&moduleTableLock);
+  if (reason == dllNotificationLoaded) {
+    TrackedModule module = { base, base + data->sizeOfImage,
+                             static_cast<HMODULE>(data->dllBase),
+                             GetModuleHash(static_cast<HMODULE>(data->dllBase)) };
+    UpdateModuleTable(&module, 0);
+  }
+  else if (reason == dllNotificationUnloaded) {
+    UpdateModuleTable(nullptr, base);
+  }
+  ReleaseSRWLockExclusive(&moduleTableLock);
+}
+
+
+bool StartModuleTracking() {
+  if (dllNotificationCookie) {
+    return true;
+  }
+
+  HMODULE ntdll = GetModuleHandleA("ntdll.dll");
+  auto registerFunction = reinterpret_cast<LdrRegisterDllNotificationFunction>(
+    ntdll ? GetProcAddress(ntdll, "LdrRegisterDllNotification") : nullptr);
+  if (!registerFunction ||
+      registerFunction(0, &OnDllNotification, nullptr, &dllNotificationCookie) != 0) {
+    // Not available before Vista; patches fall back to querying the loader
+    dllNotificationCookie = nullptr;
+    return false;
+  }
+
+  // Add the modules already loaded. The snapshot can't be taken while holding the
+  // table lock, as notifications arrive under the loader lock, so retry if a
+  // module was loaded or unloaded meanwhile.
+  for (int tries = 0; tries < 8; ++tries) {
+    LONG generation = moduleTable ? moduleTable->generation : 0;
+
+    std::vector<TrackedModule> loaded;
+    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, 0);
+    if (hSnapshot != INVALID_HANDLE_VALUE) {
+      MODULEENTRY32 entry = { sizeof(entry) };
+      for (BOOL ok = Module32First(hSnapshot, &entry); ok;
+           ok = Module32Next(hSnapshot, &entry)) {
+        auto base = reinterpret_cast<uintptr_t>(entry.modBaseAddr);
+        TrackedModule module = { base, base + entry.modBaseSize, entry.hModule,
+                                 GetModuleHash(entry.hModule) };
+        loaded.push_back(module);
+      }
+      CloseHandle(hSnapshot);
+    }
+
+    AcquireSRWLockExclusive(&moduleTableLock);
+    bool changed = (moduleTable ? moduleTable->generation : 0) != generation;
+    if (!changed) {
+      for (auto &module : loaded) {
+        UpdateModuleTable(&module, 0);
+      }
+      if (!moduleTable) {
+        UpdateModuleTable(nullptr, 0);
+      }
+    }
+    ReleaseSRWLockExclusive(&moduleTableLock);
+
+    if (!changed) {
+      return true;
+    }
+  }
+
+  StopModuleTracking();
+  return false;
+}
+
+
+void StopModuleTracking() {
+  if (dllNotificationCookie) {
+    auto unregisterFunction = reinterpret_cast<LdrUnregisterDllNotificationFunction>(
+      GetProcAddress(GetModuleHandleA("ntdll.dll"), "LdrUnregisterDllNotification"));
+    if (unregisterFunction) {
+      unregisterFunction(dllNotificationCookie);
+    }
+    dllNotificationCookie = nullptr;
+  }
+
+  AcquireSRWLockExclusive(&moduleTableLock);
+  ModuleTable *table = static_cast<ModuleTable*>(
+    InterlockedExchangePointer(reinterpret_cast<void*volatile*>(&moduleTable), nullptr));
+  if (table) {
+    retiredTables.push_back(table);
+  }
+  for (auto *retired : retiredTables) {
+    delete retired;
+  }
+  retiredTables.clear();
+  ReleaseSRWLockExclusive(&moduleTableLock);
+}
+
+
 // Fixes up a pointer address to correct for module relocation
 void* FixPtr(const void *pointer, HMODULE module) {
   if (module == reinterpret_cast<HMODULE>(-1)) {
@@ -590,6 +1109,722 @@ static bool InitBaseModule() {
   return baseModule || (baseModule = GetModuleHandle(nullptr));
 }
 
+
+void SetBaseModule(HMODULE module) {
+  baseModule = module ? module : GetModuleHandle(nullptr);
+}
+
+// Parses "8B 4C 24 ? 85 C9" style signatures, where ? or ?? is any byte
+static bool ParseSignature(const char *text, Signature *out) {
+  for (const char *p = text; *p; ) {
+    if (*p == ' ') {
+      ++p;
+    }
+    else if (*p == '?') {
+      out->bytes.push_back(0);
+      out->mask.push_back(0);
+      p += (p[1] == '?') ? 2 : 1;
+    }
+    else if (isxdigit(static_cast<BYTE>(p[0])) && isxdigit(static_cast<BYTE>(p[1]))) {
+      char hex[3] = { p[0], p[1], '\0' };
+      out->bytes.push_back(static_cast<BYTE>(strtoul(hex, nullptr, 16)));
+      out->mask.push_back(0xFF);
+      p += 2;
+    }
+    else {
+      out->bytes.clear();
+      return false;
+    }
+  }
+
+  // Prefilter on the rarest-looking pair of known bytes, skipping bytes that are
+  // common in x86 code and data (padding, mov, call)
+  auto isCommon = [](BYTE b) {
+    return b == 0x00 || b == 0xFF || b == 0xCC || b == 0x90 || b == 0x8B ||
+           b == 0x89 || b == 0xE8;
+  };
+  const std::vector<BYTE> &bytes = out->bytes,
+                          &mask  = out->mask;
+  size_t len = bytes.size(),
+         best = len;
+  int bestScore = -1;
+  for (size_t i = 0; i < len; ++i) {
+    if (!mask[i]) {
+      continue;
+    }
+    bool pair  = (i + 1 < len) && mask[i + 1];
+    int  score = (pair ? 2 : 0) + (!isCommon(bytes[i]) ? 1 : 0) +
+                 ((pair && !isCommon(bytes[i + 1])) ? 1 : 0);
+    if (score > bestScore) {
+      bestScore = score;
+      best = i;
+    }
+  }
+  if (best == len) {
+    // Nothing but wildcards
+    out->bytes.clear();
+    return false;
+  }
+
+  out->anchor     = best;
+  out->anchorPair = (best + 1 < len) && mask[best + 1];
+  out->result     = nullptr;
+  return true;
+}
+
+static inline bool MatchesAt(const BYTE *p, const Signature &signature) {
+  for (size_t i = 0; i < signature.bytes.size(); ++i) {
+    if ((p[i] ^ signature.bytes[i]) & signature.mask[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Prefilter kernels. Mask() returns a bit for each of the Width positions starting
+// at p whose anchor byte(s) match.
+struct ScalarKernel {
+  static const size_t Width = 1;
+  static DWORD Mask(const BYTE *p, const Signature &signature) {
+    return p[signature.anchor] == signature.bytes[signature.anchor] &&
+           (!signature.anchorPair ||
+            p[signature.anchor + 1] == signature.bytes[signature.anchor + 1]);
+  }
+};
+
+#ifdef PATCHER_X86
+struct Sse2Kernel {
+  static const size_t Width = 16;
+  static DWORD Mask(const BYTE *p, const Signature &signature) {
+    const BYTE *a = p + signature.anchor;
+    __m128i match = _mm_cmpeq_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)),
+      _mm_set1_epi8(static_cast<char>(signature.bytes[signature.anchor])));
+    if (signature.anchorPair) {
+      match = _mm_and_si128(match, _mm_cmpeq_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + 1)),
+        _mm_set1_epi8(static_cast<char>(signature.bytes[signature.anchor + 1]))));
+    }
+    return static_cast<DWORD>(_mm_movemask_epi8(match));
+  }
+};
+
+struct Avx2Kernel {
+  static const size_t Width = 32;
+  PATCHER_TARGET_AVX2 static DWORD Mask(const BYTE *p, const Signature &signature) {
+    const BYTE *a = p + signature.anchor;
+    __m256i match = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)),
+      _mm256_set1_epi8(static_cast<char>(signature.bytes[signature.anchor])));
+    if (signature.anchorPair) {
+      match = _mm256_and_si256(match, _mm256_cmpeq_epi8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + 1)),
+        _mm256_set1_epi8(static_cast<char>(signature.bytes[signature.anchor + 1]))));
+    }
+    return static_cast<DWORD>(_mm256_movemask_epi8(match));
+  }
+};
+
+// 0 = none, 1 = SSE2, 2 = AVX2
+static int GetSimdLevel() {
+  static int level = -1;
+  if (level < 0) {
+    unsigned int info[4] = {}, info7[4] = {};
+    #ifdef PATCHER_MSVC
+    __cpuid(reinterpret_cast<int*>(info), 1);
+    __cpuidex(reinterpret_cast<int*>(info7), 7, 0);
+    #else
+    __get_cpuid(1, &info[0], &info[1], &info[2], &info[3]);
+    __get_cpuid_count(7, 0, &info7[0], &info7[1], &info7[2], &info7[3]);
+    #endif
+
+    level = (info[3] & (1 << 26)) ? 1 : 0;  // SSE2
+
+    // AVX2 also needs the OS to save the YMM registers
+    if (level && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+        (info7[1] & (1 << 5))) {
+      #ifdef PATCHER_MSVC
+      unsigned long long xcr0 = _xgetbv(0);
+      #else
+      unsigned int xcr0Lo, xcr0Hi;
+      __asm__ ("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+      unsigned long long xcr0 = xcr0Lo;
+      #endif
+      if ((xcr0 & 6) == 6) {
+        level = 2;
+      }
+    }
+  }
+  return level;
+}
+#endif
+
+// Scans blocks of Kernel::Width positions, trying every pending signature on each
+// block while it is in cache, then finishes the tail one position at a time
+template <class Kernel>
+static void ScanRangeWith(BYTE *begin, size_t size, std::vector<Signature*> &pending) {
+  size_t maxReach = 0;
+  for (auto *signature : pending) {
+    maxReach = (std::max)(maxReach, signature->anchor + 2);
+  }
+
+  size_t pos = 0;
+  for (; !pending.empty() && pos + Kernel::Width + maxReach <= size;
+       pos += Kernel::Width) {
+    for (auto it = pending.begin(); it != pending.end(); ) {
+      Signature &signature = **it;
+      bool found = false;
+      for (DWORD bits = Kernel::Mask(begin + pos, signature); bits && !found;
+           bits &= bits - 1) {
+        DWORD bit = 0;
+        while (!(bits & (1u << bit))) {
+          ++bit;
+        }
+        size_t start = pos + bit;
+        if (start + signature.bytes.size() <= size &&
+            MatchesAt(begin + start, signature)) {
+          signature.result = begin + start;
+          found = true;
+        }
+      }
+      it = found ? pending.erase(it) : it + 1;
+    }
+  }
+
+  for (auto it = pending.begin(); it != pending.end(); ) {
+    Signature &signature = **it;
+    for (size_t start = pos; start + signature.bytes.size() <= size; ++start) {
+      if (MatchesAt(begin + start, signature)) {
+        signature.result = begin + start;
+        break;
+      }
+    }
+    it = signature.result ? pending.erase(it) : it + 1;
+  }
+}
+
+static void ScanRange(BYTE *begin, size_t size, std::vector<Signature*> &pending) {
+  // Signatures not found in this range carry on to the next one
+  std::vector<Signature*> remaining(pending);
+
+  #ifdef PATCHER_X86
+  switch (GetSimdLevel()) {
+  case 2:  ScanRangeWith<Avx2Kernel>(begin, size, remaining);   break;
+  case 1:  ScanRangeWith<Sse2Kernel>(begin, size, remaining);   break;
+  default: ScanRangeWith<ScalarKernel>(begin, size, remaining); break;
+  }
+  #else
+  ScanRangeWith<ScalarKernel>(begin, size, remaining);
+  #endif
+
+  pending.swap(remaining);
+}
+
+// Computes the hash of the module's timestamp and code size that identifies its
+// build
+static size_t GetModuleHash(HMODULE module) {
+  auto *header = reinterpret_cast<IMAGE_NT_HEADERS*>(
+    reinterpret_cast<uintptr_t>(module) +
+    reinterpret_cast<IMAGE_DOS_HEADER*>(module)->e_lfanew);
+
+  auto sizeOfCode = header->OptionalHeader.Magic
+    != IMAGE_NT_OPTIONAL_HDR64_MAGIC ? header->OptionalHeader.SizeOfCode :
+    reinterpret_cast<IMAGE_NT_HEADERS64*>(header)->OptionalHeader.SizeOfCode;
+
+  return std::hash<ULONGLONG>()(
+    (static_cast<ULONGLONG>(header->FileHeader.TimeDateStamp) << 32) + sizeOfCode);
+}
+
+// Finds the import address table entry for a function imported by name (or by
+// ordinal if functionName is null) from the given DLL
+static void** FindImport(HMODULE module, const char *dllName,
+                         const char *functionName, WORD ordinal) {
+  if (module == reinterpret_cast<HMODULE>(-1)) {
+    if (!InitBaseModule()) {
+      return nullptr;
+    }
+    module = baseModule;
+  }
+  else if (!module) {
+    return nullptr;
+  }
+
+  auto base = reinterpret_cast<uintptr_t>(module);
+  auto *optionalHeader = &reinterpret_cast<IMAGE_NT_HEADERS*>(
+    base + reinterpret_cast<IMAGE_DOS_HEADER*>(module)->e_lfanew)->OptionalHeader;
+
+  // Imports are only walked for the native pointer size
+  #ifdef _WIN64
+  if (optionalHeader->Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+    return nullptr;
+  }
+  IMAGE_DATA_DIRECTORY *importDataDir =
+    &reinterpret_cast<IMAGE_OPTIONAL_HEADER64*>(optionalHeader)
+      ->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+  #else
+  if (optionalHeader->Magic != IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+    return nullptr;
+  }
+  IMAGE_DATA_DIRECTORY *importDataDir =
+    &optionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+  #endif
+
+  if (!importDataDir->VirtualAddress || !importDataDir->Size) {
+    // No import table
+    return nullptr;
+  }
+
+  for (auto *descriptor = reinterpret_cast<IMAGE_IMPORT_DESCRIPTOR*>(
+         base + importDataDir->VirtualAddress);
+       descriptor->Name; ++descriptor) {
+    if (_stricmp(reinterpret_cast<const char*>(base + descriptor->Name),
+                 dllName) != 0) {
+      continue;
+    }
+
+    // The lookup table still has the names after binding overwrites the IAT
+    auto *iat = reinterpret_cast<IMAGE_THUNK_DATA*>(base + descriptor->FirstThunk);
+    auto *lookup = descriptor->OriginalFirstThunk ?
+      reinterpret_cast<IMAGE_THUNK_DATA*>(base + descriptor->OriginalFirstThunk) :
+      iat;
+
+    for (; lookup->u1.AddressOfData; ++lookup, ++iat) {
+      if (IMAGE_SNAP_BY_ORDINAL(lookup->u1.Ordinal)) {
+        if (!functionName && IMAGE_ORDINAL(lookup->u1.Ordinal) == ordinal) {
+          return reinterpret_cast<void**>(&iat->u1.Function);
+        }
+      }
+      else if (functionName) {
+        auto *importByName = reinterpret_cast<IMAGE_IMPORT_BY_NAME*>(
+          base + static_cast<uintptr_t>(lookup->u1.AddressOfData));
+        if (strcmp(reinterpret_cast<const char*>(importByName->Name),
+                   functionName) == 0) {
+          return reinterpret_cast<void**>(&iat->u1.Function);
+        }
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+#ifndef PATCHER_MINHOOK
+// Allocates a trampoline slot within rel32 range of nearAddress
+static BYTE* AllocTrampoline(const void *nearAddress) {
+  auto target = reinterpret_cast<uintptr_t>(nearAddress);
+  auto isNear = [target](const BYTE *slot) {
+    auto address = reinterpret_cast<uintptr_t>(slot);
+    return sizeof(void*) == 4 ||
+      (address > target ? address - target : target - address) < 0x7FF00000;
+  };
+
+  for (auto it = freeTrampolines.begin(); it != freeTrampolines.end(); ++it) {
+    if (isNear(*it)) {
+      BYTE *slot = *it;
+      freeTrampolines.erase(it);
+      return slot;
+    }
+  }
+
+  BYTE *block = nullptr;
+  if (sizeof(void*) == 4) {
+    block = static_cast<BYTE*>(VirtualAlloc(nullptr, trampolineBlockSize,
+                                            MEM_COMMIT | MEM_RESERVE,
+                                            PAGE_EXECUTE_READWRITE));
+  }
+  else {
+    // Search for a free region below, then above the target
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uintptr_t granularity = info.dwAllocationGranularity,
+              minAddress  = (std::max)(
+                reinterpret_cast<uintptr_t>(info.lpMinimumApplicationAddress),
+                target > 0x7FF00000 ? target - 0x7FF00000 : 0),
+              maxAddress  = (std::min)(
+                reinterpret_cast<uintptr_t>(info.lpMaximumApplicationAddress),
+                target + 0x7FF00000 - trampolineBlockSize);
+    MEMORY_BASIC_INFORMATION region;
+
+    for (uintptr_t address = target - (target % granularity);
+         !block && address > minAddress + granularity; ) {
+      address -= granularity;
+      if (!VirtualQuery(reinterpret_cast<void*>(address), &region, sizeof(region))) {
+        break;
+      }
+      if (region.State == MEM_FREE) {
+        block = static_cast<BYTE*>(VirtualAlloc(reinterpret_cast<void*>(address),
+                                                trampolineBlockSize,
+                                                MEM_COMMIT | MEM_RESERVE,
+                                                PAGE_EXECUTE_READWRITE));
+      }
+      else {
+        address = reinterpret_cast<uintptr_t>(region.AllocationBase);
+      }
+    }
+
+    for (uintptr_t address = target - (target % granularity) + granularity;
+         !block && address < maxAddress; ) {
+      if (!VirtualQuery(reinterpret_cast<void*>(address), &region, sizeof(region))) {
+        break;
+      }
+      if (region.State == MEM_FREE) {
+        block = static_cast<BYTE*>(VirtualAlloc(reinterpret_cast<void*>(address),
+                                                trampolineBlockSize,
+                                                MEM_COMMIT | MEM_RESERVE,
+                                                PAGE_EXECUTE_READWRITE));
+      }
+      address = reinterpret_cast<uintptr_t>(region.BaseAddress) + region.RegionSize;
+      address += granularity - 1;
+      address -= address % granularity;
+    }
+  }
+
+  if (!block) {
+    return nullptr;
+  }
+  memset(block, 0xCC, trampolineBlockSize);
+  for (size_t offset = trampolineSlotSize; offset < trampolineBlockSize;
+       offset += trampolineSlotSize) {
+    freeTrampolines.push_back(block + offset);
+  }
+  return block;
+}
+
+
+static void FreeTrampoline(void *trampoline) {
+  if (trampoline) {
+    // Slots are aligned to their size, and the trampoline is near the slot start
+    auto *slot = reinterpret_cast<BYTE*>(
+      reinterpret_cast<uintptr_t>(trampoline) & ~(trampolineSlotSize - 1));
+    memset(slot, 0xCC, trampolineSlotSize);
+    freeTrampolines.push_back(slot);
+  }
+}
+
+
+namespace {
+
+struct Instruction {
+  size_t length;
+  size_t relOffset;    // Offset of a relative branch target or RIP-relative disp32
+  size_t relSize;      // 0, 1 or 4
+  bool   branch;       // Relative jmp, call, or jcc
+  bool   ripRelative;  // x64 RIP-relative memory operand
+  bool   endsFlow;     // Unconditional jmp or ret
+  bool   twoByte;      // 0F xx opcode
+  BYTE   opcode;
+};
+
+} // anonymous namespace
+
+// Decodes the length and relative operands of one x86 or x64 instruction.
+// Returns false for instructions that can't be relocated (VEX/EVEX, 3DNow!,
+// 16-bit addressing, loop/jcxz, far branches on x64).
+static bool DecodeInstruction(const BYTE *code, bool is64, Instruction *out) {
+  // Bit n of row r is set if one-byte opcode (r << 4) | n has a ModRM byte
+  static const WORD hasModRm[16] = {
+    0x0F0F, 0x0F0F, 0x0F0F, 0x0F0F, 0x0000, 0x0000, 0x0A0C, 0x0000,
+    0xFFFF, 0x0000, 0x0000, 0x0000, 0x00F3, 0xFF0F, 0x0000, 0xC0C0
+  };
+
+  *out = Instruction();
+  const BYTE *p = code;
+  bool opSize16   = false,
+       addrSize16 = false,
+       rexW       = false;
+
+  for (;; ++p) {
+    BYTE b = *p;
+    if (b == 0x66) {
+      opSize16 = true;
+    }
+    else if (b == 0x67) {
+      addrSize16 = true;
+    }
+    else if (b != 0xF0 && b != 0xF2 && b != 0xF3 && b != 0x26 && b != 0x2E &&
+             b != 0x36 && b != 0x3E && b != 0x64 && b != 0x65) {
+      break;
+    }
+    if (p - code >= 14) {
+      return false;
+    }
+  }
+  if (is64 && (*p & 0xF0) == 0x40) {
+    rexW = (*p & 0x08) != 0;
+    ++p;
+  }
+  if (addrSize16 && !is64) {
+    return false;
+  }
+
+  size_t immz = opSize16 ? 2 : 4,
+         imm  = 0;
+  bool   modRm = false;
+  BYTE   op = *p++;
+
+  if (op == 0x0F) {
+    out->twoByte = true;
+    op = *p++;
+    if (op == 0x38) {
+      ++p;
+      modRm = true;
+    }
+    else if (op == 0x3A) {
+      ++p;
+      modRm = true;
+      imm = 1;
+    }
+    else if (op >= 0x80 && op <= 0x8F) {
+      if (opSize16) {
+        return false;
+      }
+      out->branch  = true;
+      out->relSize = 4;
+    }
+    else if (op == 0x0F) {
+      return false;
+    }
+    else if (!((op >= 0x05 && op <= 0x0B && op != 0x0A) || op == 0x0E ||
+               (op >= 0x30 && op <= 0x37) || op == 0x77 ||
+               op == 0xA0 || op == 0xA1 || op == 0xA2 ||
+               op == 0xA8 || op == 0xA9 || op == 0xAA || (op >= 0xC8 && op <= 0xCF))) {
+      modRm = true;
+      if ((op >= 0x70 && op <= 0x73) || op == 0xA4 || op == 0xAC || op == 0xBA ||
+          (op >= 0xC2 && op <= 0xC6)) {
+        imm = 1;
+      }
+    }
+  }
+  else {
+    modRm = (hasModRm[op >> 4] & (1 << (op & 0xF))) != 0;
+
+    if (op < 0x40 && (op & 0x7) == 0x4) {
+      imm = 1;
+    }
+    else if (op < 0x40 && (op & 0x7) == 0x5) {
+      imm = immz;
+    }
+    else if (is64 && (op >= 0x40 && op <= 0x4F)) {
+      return false;  // Misplaced REX prefix
+    }
+    else if (op == 0x62 || op == 0xC4 || op == 0xC5) {
+      // BOUND/LES/LDS on x86, but VEX/EVEX on x64 or with a register operand
+      if (is64 || (*p & 0xC0) == 0xC0) {
+        return false;
+      }
+    }
+    else if (op == 0x68 || op == 0x69 || op == 0x81 || op == 0xA9 || op == 0xC7) {
+      imm = immz;
+    }
+    else if (op == 0x6A || op == 0x6B || op == 0x80 || op == 0x83 || op == 0xA8 ||
+             (op >= 0xB0 && op <= 0xB7) || op == 0xC0 || op == 0xC1 || op == 0xC6 ||
+             op == 0xCD || op == 0xD4 || op == 0xD5 || (op >= 0xE4 && op <= 0xE7)) {
+      imm = 1;
+    }
+    else if (op == 0x82 || op == 0x9A || op == 0xEA) {
+      if (is64) {
+        return false;
+      }
+      imm = (op == 0x82) ? 1 : immz + 2;
+      out->endsFlow = (op == 0xEA);
+    }
+    else if (op >= 0xA0 && op <= 0xA3) {
+      imm = !is64 ? 4 : addrSize16 ? 4 : 8;  // moffs
+    }
+    else if (op >= 0xB8 && op <= 0xBF) {
+      imm = rexW ? 8 : immz;
+    }
+    else if (op == 0xC2 || op == 0xCA) {
+      imm = 2;
+      out->endsFlow = true;
+    }
+    else if (op == 0xC3 || op == 0xCB || op == 0xCF) {
+      out->endsFlow = true;
+    }
+    else if (op == 0xC8) {
+      imm = 3;
+    }
+    else if ((op >= 0x70 && op <= 0x7F) || op == 0xEB) {
+      if (opSize16) {
+        return false;
+      }
+      out->branch   = true;
+      out->relSize  = 1;
+      out->endsFlow = (op == 0xEB);
+    }
+    else if (op == 0xE8 || op == 0xE9) {
+      if (opSize16) {
+        return false;
+      }
+      out->branch   = true;
+      out->relSize  = 4;
+      out->endsFlow = (op == 0xE9);
+    }
+    else if (op >= 0xE0 && op <= 0xE3) {
+      return false;
+    }
+  }
+  out->opcode = op;
+
+  if (modRm) {
+    BYTE modRmByte = *p++,
+         mod = modRmByte >> 6,
+         reg = (modRmByte >> 3) & 7,
+         rm  = modRmByte & 7;
+    if (mod != 3) {
+      if (rm == 4) {
+        BYTE sib = *p++;
+        if (mod == 0 && (sib & 7) == 5) {
+          p += 4;
+        }
+      }
+      else if (mod == 0 && rm == 5) {
+        if (is64) {
+          out->ripRelative = true;
+          out->relOffset   = p - code;
+          out->relSize     = 4;
+        }
+        p += 4;
+      }
+      p += (mod == 1) ? 1 : (mod == 2) ? 4 : 0;
+    }
+
+    if (!out->twoByte) {
+      if ((op == 0xF6 || op == 0xF7) && reg < 2) {
+        imm = (op == 0xF6) ? 1 : immz;  // TEST r/m, imm
+      }
+      else if (op == 0xFF && (reg == 4 || reg == 5)) {
+        out->endsFlow = true;           // JMP r/m
+      }
+    }
+  }
+
+  if (out->branch) {
+    out->relOffset = p - code;
+    p += out->relSize;
+  }
+  p += imm;
+
+  out->length = p - code;
+  return out->length <= 15;
+}
+
+
+// Copies whole instructions from source to dest until at least minSize bytes are
+// covered, fixing up relative branches and RIP-relative operands for their new
+// location. Short branches are widened to rel32. Returns the number of source
+// bytes copied, or 0 if they can't be relocated; written receives the bytes output.
+static size_t RelocateInstructions(const BYTE *source, BYTE *dest, size_t destSize,
+                                   size_t minSize, bool is64, size_t *written) {
+  auto fitsRel32 = [](intptr_t value) {
+    return value == static_cast<intptr_t>(static_cast<int32_t>(value));
+  };
+
+  size_t in  = 0,
+         out = 0;
+  while (in < minSize) {
+    Instruction instruction;
+    if (!DecodeInstruction(source + in, is64, &instruction) ||
+        (instruction.endsFlow && in + instruction.length < minSize)) {
+      return 0;
+    }
+
+    const BYTE *next = source + in + instruction.length;
+    BYTE buffer[16];
+    size_t length = instruction.length;
+    memcpy(buffer, source + in, length);
+
+    if (instruction.branch) {
+      intptr_t rel = (instruction.relSize == 1) ?
+        static_cast<int8_t>(source[in + instruction.relOffset]) :
+        static_cast<int32_t>(*reinterpret_cast<const DWORD*>(
+                               &source[in + instruction.relOffset]));
+      const BYTE *target = next + rel;
+
+      // Branches into the overwritten bytes, including back to the start, would
+      // land on the jump rather than the instructions it replaced
+      if (target >= source && target < source + minSize) {
+        return 0;
+      }
+
+      BYTE op = instruction.opcode;
+      if (instruction.twoByte) {
+        length = 6;
+        buffer[0] = 0x0F;
+        buffer[1] = op;
+      }
+      else if (op >= 0x70 && op <= 0x7F) {
+        length = 6;
+        buffer[0] = 0x0F;
+        buffer[1] = 0x80 | (op & 0xF);
+      }
+      else {
+        length = 5;
+        buffer[0] = (op == 0xE8) ? 0xE8 : 0xE9;
+      }
+      if (instruction.length != (instruction.twoByte ? 2u : 1u) + instruction.relSize) {
+        return 0;  // Prefixed branch
+      }
+
+      intptr_t newRel = target - (dest + out + length);
+      if (!fitsRel32(newRel)) {
+        return 0;
+      }
+      *reinterpret_cast<int32_t*>(&buffer[length - 4]) = static_cast<int32_t>(newRel);
+    }
+    else if (instruction.ripRelative) {
+      intptr_t disp = static_cast<int32_t>(*reinterpret_cast<const DWORD*>(
+                                             &source[in + instruction.relOffset])),
+               newDisp = (next + disp) - (dest + out + length);
+      if (!fitsRel32(newDisp)) {
+        return 0;
+      }
+      *reinterpret_cast<int32_t*>(&buffer[instruction.relOffset]) =
+        static_cast<int32_t>(newDisp);
+    }
+
+    if (out + length > destSize) {
+      return 0;
+    }
+    memcpy(dest + out, buffer, length);
+    in  += instruction.length;
+    out += length;
+  }
+
+  *written = out;
+  return in;
+}
+#endif
+
+
+// Looks up the module containing the address in the tracked module table, without
+// locking. Returns false if modules aren't being tracked. moduleOut is nullptr if
+// the address isn't in any module.
+static bool FindTrackedModule(void *address, HMODULE &moduleOut, size_t &hashOut,
+                              LONG &generationOut) {
+  const ModuleTable *table = moduleTable;
+  if (!table) {
+    return false;
+  }
+
+  auto target = reinterpret_cast<uintptr_t>(address);
+  auto it = std::upper_bound(
+    table->modules.begin(), table->modules.end(), target,
+    [](uintptr_t a, const TrackedModule &b) { return a < b.begin; });
+
+  if (it != table->modules.begin() && target < (--it)->end) {
+    moduleOut = it->module;
+    hashOut   = it->hash;
+  }
+  else {
+    moduleOut = nullptr;
+    hashOut   = 0;
+  }
+  generationOut = table->generation;
+  return true;
+}
+
+
 static HMODULE GetModuleFromAddress(void *address) {
   HMODULE result;
   if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
@@ -13,13 +13,14 @@
 #include <windows.h>
 #include <memory>
 #include <vector>
+#include <string>
 #include <type_traits>
 
 namespace Patcher {
 
 // Forward declarations
 class patch;
-namespace Util { template <class T> inline T* _MakeDummy(); }
+template <class T> void* GetVftable();
 
 // Recommended to use one of the Patch factory functions to instantiate
 // Use Unpatch to handle deletion of patches created by Patch functions
@@ -38,13 +39,28 @@ std::shared_ptr<patch> Patch(void *address, T newValue, bool enable = true) {
   return Patch(address, sizeof(T), &newValue, nullptr, enable);
 }
 
-// Inserts a jump instruction. Can use MinHook.
+// Hooks a function by inserting a jump to newFunction at its start. The original
+// function can be called through the patch's GetTrampoline(). Can use MinHook.
 std::shared_ptr<patch> PatchFunction(void *address, const void *newFunction,
                                      bool enable = true);
 // Inserts/rewrites a call instruction
 std::shared_ptr<patch> PatchFunctionCall(void *address, const void *newFunction,
                                          bool enable = true);
 
+// Replaces an import address table entry, found by DLL and function name
+std::shared_ptr<patch> PatchImportedFunction(const char *dllName,
+                                             const char *functionName,
+                                             const void *newFunction,
+                                             bool enable = true,
+                                             HMODULE module =
+                                               reinterpret_cast<HMODULE>(-1));
+// Replaces an import address table entry, found by DLL name and ordinal
+std::shared_ptr<patch> PatchImportedFunction(const char *dllName, WORD ordinal,
+                                             const void *newFunction,
+                                             bool enable = true,
+                                             HMODULE module =
+                                               reinterpret_cast<HMODULE>(-1));
+
 // Replaces virtual function table entry by function address
 std::shared_ptr<patch> PatchFunctionVirtual(void *vftableAddress,
                                             const void *oldFunction,
@@ -61,10 +77,7 @@ template <class T>
 std::shared_ptr<patch> PatchFunctionVirtual(const void *oldFunction,
                                             const void *newFunction,
                                             bool enable = true) {
-  std::unique_ptr<T> obj(Util::_MakeDummy<T>()); // Dummy for getting vftable
-  return obj ?
-    PatchFunctionVirtual(*reinterpret_cast<void**>(obj.get()), oldFunction,
-                         newFunction, enable) : nullptr;
+  return PatchFunctionVirtual(GetVftable<T>(), oldFunction, newFunction, enable);
 }
 
 // Replaces virtual function table entry by index
@@ -83,10 +96,33 @@ template <class T>
 std::shared_ptr<patch> PatchFunctionVirtual(int vftableEntryIndex,
                                             const void *newFunction,
                                             bool enable = true) {
-  std::unique_ptr<T> obj(Util::_MakeDummy<T>()); // Dummy for getting vftable
-  return obj ?
-    PatchFunctionVirtual(*reinterpret_cast<void**>(obj.get()), vftableEntryIndex,
-                         newFunction, enable) : nullptr;
+  return PatchFunctionVirtual(GetVftable<T>(), vftableEntryIndex, newFunction,
+                              enable);
+}
+
+// Virtual function table entry to replace, by index or by its current function
+struct VirtualHook {
+  VirtualHook(int index, const void *_newFunction)
+    : vftableEntryIndex(index), oldFunction(nullptr), newFunction(_newFunction) {}
+  VirtualHook(const void *_oldFunction, const void *_newFunction)
+    : vftableEntryIndex(-1), oldFunction(_oldFunction), newFunction(_newFunction) {}
+
+  int vftableEntryIndex;  // -1 to look up oldFunction
+  const void *oldFunction,
+             *newFunction;
+};
+
+// Replaces several virtual function table entries as a group; if any entry can't
+// be found or patched, none are
+bool PatchFunctionsVirtual(void *vftableAddress,
+                           const std::vector<VirtualHook> &hooks,
+                           std::vector<std::shared_ptr<patch>> *out = nullptr,
+                           bool enable = true);
+template <class T>
+bool PatchFunctionsVirtual(const std::vector<VirtualHook> &hooks,
+                           std::vector<std::shared_ptr<patch>> *out = nullptr,
+                           bool enable = true) {
+  return PatchFunctionsVirtual(GetVftable<T>(), hooks, out, enable);
 }
 
 // Patches all references to a global variable/object in base relocation table
@@ -101,11 +137,22 @@ bool PatchGlobalReferences(const void *oldGlobalAddress,
 bool Unpatch(std::shared_ptr<patch> &which, bool doDelete = true,
              bool force = false);
 
+// Enables or disables a group of patches, restoring the group's previous state if
+// any of them fail
+bool EnablePatches(const std::vector<std::shared_ptr<patch>> &patches,
+                   bool enable = true);
+
 // Enables all unapplied patches and optionally reapplies enabled patches
 bool PatchAll(bool force = false);
 // Disables and optionally deletes all patches
 bool UnpatchAll(bool doDelete = true, bool force = false);
 
+// Tracks module loads and unloads through loader notifications, so patches can
+// check their module is still loaded without taking the loader lock each time.
+// Must be stopped before this module is unloaded.
+bool StartModuleTracking();
+void StopModuleTracking();
+
 
 // Patch abstract class
 class patch {
@@ -118,8 +165,13 @@ public:
   bool GetEnabled() { return enabled; }
   bool GetValid() { return !invalid; }
 
+  // Returns a pointer for calling the original function, if this hooks one
+  virtual const void* GetTrampoline() { return nullptr; }
+
 protected:
-  patch() { enabled = false; module = reinterpret_cast<HMODULE>(-1); }
+  patch() {
+    enabled = false; module = reinterpret_cast<HMODULE>(-1); verifiedGeneration = 0;
+  }
 
   bool VerifyModule();
   void GetModuleInfo(HMODULE &moduleOut, size_t &hashOut);
@@ -130,6 +182,7 @@ protected:
   void *address;
   HMODULE module;
   size_t moduleHash;
+  LONG verifiedGeneration;  // Module table generation last verified against
 };
 
 // Memory patch class
@@ -145,6 +198,7 @@ public:
 private:
   std::unique_ptr<BYTE[]> newBytesBuffer;
   size_t size;
+  bool hasOriginalBytes;  // Whether this holds a reference to the original bytes
 };
 
 #ifdef PATCHER_MINHOOK
@@ -158,15 +212,57 @@ public:
   virtual bool Disable(bool unused = false);
 
   // Returns a pointer to a MinHook function trampoline
-  const void* GetTrapoline();
+  virtual const void* GetTrampoline();
 
 private:
   const void *newFunction,
              *trampoline;
 };
+#else
+// Inline function hook patch class. The instructions overwritten by the jump are
+// relocated to a trampoline, which jumps back to the rest of the function.
+class InlinePatch : public MemPatch {
+public:
+  InlinePatch(void *function, const void *jumpBytes, size_t jumpSize,
+              void *_trampoline, bool enable = true);
+  virtual ~InlinePatch();
+
+  // Returns a pointer to the function trampoline
+  virtual const void* GetTrampoline();
+
+private:
+  void *trampoline;
+};
 #endif
 
 
+// Signature scanning
+
+// Module sections that signature scans look in
+enum ScanSections {
+  scanCode         = 1 << 0,  // Executable sections, e.g. .text
+  scanReadOnlyData = 1 << 1,  // Read-only initialized data, e.g. .rdata
+  scanData         = 1 << 2,  // Writable initialized data, e.g. .data
+  scanDefault      = scanCode | scanReadOnlyData
+};
+
+// Finds the first match of each IDA-style signature, e.g. "E8 ? ? ? ? 85 C0 74 ??",
+// in one pass over the module's sections. Unfound signatures get nullptr.
+// Results are cached per module build. Returns the number of signatures found.
+size_t FindSignatures(const char *const *signatures, void **results, size_t count,
+                      int sections = scanDefault,
+                      HMODULE module = reinterpret_cast<HMODULE>(-1));
+inline void* FindSignature(const char *signature, int sections = scanDefault,
+                           HMODULE module = reinterpret_cast<HMODULE>(-1)) {
+  void *result = nullptr;
+  FindSignatures(&signature, &result, 1, sections, module);
+  return result;
+}
+
+// Makes a signature that matches the given bytes exactly
+std::string MakeSignature(const void *bytes, size_t size);
+
+
 // Helper functions
 
 // Fixes up a pointer to correct for module relocation
@@ -176,9 +272,71 @@ inline void* FixPtr(uintptr_t address,
   return FixPtr(reinterpret_cast<const void*>(address), module);
 }
 
+// Sets the module that FixPtr, signature scans, and import patches use by default,
+// e.g. a copy of the game image mapped elsewhere to test patches against. nullptr
+// restores the process's executable. Set it before creating any patches.
+void SetBaseModule(HMODULE module);
+
+
+// Virtual function tables
+
+namespace Util {
+template <class T> inline T* _MakeDummy();
+template <class T> inline void*& _VftableCache() {
+  static void *vftable = nullptr;
+  return vftable;
+}
+}
+
+// Gets the vftable of class T. Unless it was set, a dummy T is constructed to read
+// it the first time, and the result is cached for every later call.
+template <class T>
+void* GetVftable() {
+  void *&cache = Util::_VftableCache<T>();
+  if (!cache) {
+    std::unique_ptr<T> obj(Util::_MakeDummy<T>());
+    if (obj) {
+      InterlockedCompareExchangePointer(&cache, *reinterpret_cast<void**>(obj.get()),
+                                        nullptr);
+    }
+  }
+  return cache;
+}
+
+// Sets the vftable of class T, so no dummy object needs to be constructed
+template <class T>
+void SetVftable(void *vftableAddress) {
+  InterlockedExchangePointer(&Util::_VftableCache<T>(), vftableAddress);
+}
+template <class T>
+void SetVftable(uintptr_t address, HMODULE module = reinterpret_cast<HMODULE>(-1)) {
+  SetVftable<T>(FixPtr(address, module));
+}
+
+// Sets the vftable of class T from code that references it, such as the
+// "mov dword ptr [esi], offset vftable" in its constructor ("C7 06 ? ? ? ?", with
+// operandOffset 2). On x64, the operand is a RIP-relative displacement as in
+// "lea rax, [vftable]", and must be the instruction's last 4 bytes.
+template <class T>
+bool FindVftable(const char *signature, int operandOffset, int sections = scanCode,
+                 HMODULE module = reinterpret_cast<HMODULE>(-1)) {
+  auto *operand = static_cast<BYTE*>(FindSignature(signature, sections, module));
+  if (operand) {
+    operand += operandOffset;
+    #if defined(_M_X64) || defined(__x86_64__)
+    SetVftable<T>(operand + 4 + *reinterpret_cast<INT32*>(operand));
+    #else
+    SetVftable<T>(*reinterpret_cast<void**>(operand));
+    #endif
+  }
+  return operand != nullptr;
+}
+
+
 // Cast pointer to member function to void*. May be used by _GetPointer() macro.
-// NOTE: For virtual PMFs, an object instance must be passed or class is default,
-// copy, or move constructible. Class cannot multiply inherit.
+// NOTE: For virtual PMFs, an object instance must be passed, the vftable must be
+// set with SetVftable or FindVftable, or the class must be default, copy, or move
+// constructible. Class cannot multiply inherit.
 template <class T, class U>
 typename std::enable_if<std::is_member_function_pointer<U T::*>::value>::type*
   PMFCast(U T::*pmf, const T *self = nullptr) {
@@ -203,13 +361,11 @@ typename std::enable_if<std::is_member_function_pointer<U T::*>::value>::type*
   #else
   if (u.vftOffset & 1) {
   #endif
-    // Virtual; requires an object instance to get the vftable pointer
-    std::unique_ptr<T> dummy;
-    if (!self) {
-      dummy.reset(Util::_MakeDummy<T>());
-      if (!(self = dummy.get())) {
-        return nullptr;
-      }
+    // Virtual; requires an object instance or the class's cached vftable
+    const void *vftable = self ? *reinterpret_cast<void *const*>(self) :
+                                 GetVftable<T>();
+    if (!vftable) {
+      return nullptr;
     }
 
     uintptr_t offset =
@@ -220,8 +376,8 @@ typename std::enable_if<std::is_member_function_pointer<U T::*>::value>::type*
       u.vftOffset - 1;
       #endif
 
-    return *reinterpret_cast<void**>(*reinterpret_cast<const uintptr_t*>(self) +
-                                     offset);
+    return *reinterpret_cast<void *const*>(reinterpret_cast<uintptr_t>(vftable) +
+                                           offset);
   }
   else {
     return u.out;
@@ -256,8 +412,8 @@ template <class T>
 T* _MakeDummy_impl() { return new T(); }
 #endif
 
-// Ancillary function for PatchFunctionVirtual and PMFCast. Creates dummy object
-// from which vftable can be obtained using default, move, or copy constructor.
+// Ancillary function for GetVftable. Creates dummy object from which vftable can be
+// obtained using default, move, or copy constructor.
 template <class T>
 inline T* _MakeDummy() { return _MakeDummy_impl<T>(); }
 
@@ -0,0 +1,315 @@
+// Implements a minimal Port Control Protocol (RFC 6887) client for the MAP opcode
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <memory>
+#include "Fnv.h"
+#include "Pcp.h"
+#include "RequestLimiter.h"
+
+static const BYTE pcpVersion       = 2,
+                  natPmpVersion    = 0,
+                  opcodeAnnounce   = 0,
+                  opcodeMap        = 1,
+                  opcodeResponse   = 0x80,
+                  optThirdParty    = 1,
+                  optPreferFailure = 2;
+
+static const int headerSize     = 24,
+                 mapPayloadSize = 36,
+                 maxPacketSize  = 1100;
+
+static RequestOutcome PcpOutcome(int result);
+
+
+PcpClient::PcpClient() {
+  s = INVALID_SOCKET;
+  memset(&clientIp, 0, sizeof(clientIp));
+
+  // Salt nonces with something unique to this host that survives restarts
+  char  name[MAX_COMPUTERNAME_LENGTH + 1] = {};
+  DWORD nameLen = sizeof(name),
+        volumeSerial = 0;
+  GetComputerNameA(name, &nameLen);
+  GetVolumeInformationA("C:\\", nullptr, 0, &volumeSerial, nullptr, nullptr,
+                        nullptr, 0);
+
+  for (size_t i = 0; i < sizeof(secret); i += sizeof(DWORD)) {
+    ULONGLONG hash = Fnv1a64(fnvBasis64 + i, name, nameLen);
+    hash = Fnv1a64(hash, &volumeSerial, sizeof(volumeSerial));
+    memcpy(&secret[i], &hash, sizeof(DWORD));
+  }
+}
+
+
+PcpClient::~PcpClient() {
+  Close();
+}
+
+
+bool PcpClient::Open(const sockaddr *server, int serverLen) {
+  Close();
+
+  if (!server || (server->sa_family != AF_INET && server->sa_family != AF_INET6)) {
+    return false;
+  }
+
+  if ((s = socket(server->sa_family, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+    return false;
+  }
+
+  // Connecting lets the OS pick the source address, which the server requires to
+  // match the client IP field, and filters out datagrams from anyone else
+  sockaddr_storage local = {};
+  int localLen = sizeof(local);
+  if (connect(s, server, serverLen) != 0 ||
+      getsockname(s, reinterpret_cast<sockaddr*>(&local), &localLen) != 0) {
+    Close();
+    return false;
+  }
+
+  if (local.ss_family == AF_INET) {
+    PcpMapIPv4(reinterpret_cast<sockaddr_in*>(&local)->sin_addr, &clientIp);
+  }
+  else {
+    clientIp = reinterpret_cast<sockaddr_in6*>(&local)->sin6_addr;
+  }
+
+  return true;
+}
+
+
+void PcpClient::Close() {
+  if (s != INVALID_SOCKET) {
+    closesocket(s);
+    s = INVALID_SOCKET;
+  }
+}
+
+
+PcpServerType PcpClient::Probe(int maxTries) {
+  if (s == INVALID_SOCKET) {
+    return pcpServerNone;
+  }
+
+  BYTE request[headerSize] = { pcpVersion, opcodeAnnounce };
+  memcpy(&request[8], &clientIp, sizeof(clientIp));
+
+  DWORD timeout = 250;
+  for (int tries = 0; tries < maxTries; ++tries, timeout *= 2) {
+    if (send(s, reinterpret_cast<char*>(request), sizeof(request), 0) !=
+        sizeof(request)) {
+      return pcpServerNone;
+    }
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    timeval tv = { static_cast<long>(timeout / 1000),
+                   static_cast<long>((timeout % 1000) * 1000) };
+    if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) <= 0) {
+      continue;
+    }
+
+    BYTE response[maxPacketSize];
+    int len = recv(s, reinterpret_cast<char*>(response), sizeof(response), 0);
+    if (len < 2) {
+      // Most likely ICMP port unreachable, so there's no server at all
+      int error = (len < 0) ? WSAGetLastError() : 0;
+      return (error == WSAECONNRESET || error == WSAECONNREFUSED) ?
+             pcpServerUnreachable : pcpServerNone;
+    }
+
+    // NAT-PMP servers answer other versions with a version 0 error response
+    if (response[0] == natPmpVersion) {
+      return pcpServerNatPmp;
+    }
+    if (response[0] == pcpVersion && response[1] == (opcodeResponse | opcodeAnnounce)) {
+      return pcpServerPcp;
+    }
+  }
+
+  return pcpServerNone;
+}
+
+
+int PcpClient::Map(PcpMapping *mappings, int count, int maxTries) {
+  if (s == INVALID_SOCKET || !mappings || count <= 0) {
+    return 0;
+  }
+
+  std::unique_ptr<BYTE[]> nonces(new BYTE[count * 12]);
+  for (int i = 0; i < count; ++i) {
+    mappings[i].result = pcpNoResponse;
+    MakeNonce(mappings[i], &nonces[i * 12]);
+  }
+
+  int pending   = count,
+      succeeded = 0;
+  DWORD timeout = 250;
+  for (int tries = 0; pending > 0 && tries < maxTries; ++tries, timeout *= 2) {
+    // Send every unanswered request back-to-back
+    BYTE packet[maxPacketSize];
+    for (int i = 0; i < count; ++i) {
+      if (mappings[i].result == pcpNoResponse) {
+        int len = BuildMapRequest(mappings[i], packet, sizeof(packet));
+        if (len <= 0 || send(s, reinterpret_cast<char*>(packet), len, 0) != len) {
+          return succeeded;
+        }
+      }
+    }
+
+    // Collect responses until all are answered or the retransmit timeout expires
+    DWORD start = GetTickCount();
+    while (pending > 0) {
+      DWORD elapsed = GetTickCount() - start;
+      if (elapsed >= timeout) {
+        break;
+      }
+
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(s, &fds);
+      timeval tv = { static_cast<long>((timeout - elapsed) / 1000),
+                     static_cast<long>(((timeout - elapsed) % 1000) * 1000) };
+      if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) <= 0) {
+        break;
+      }
+
+      int len = recv(s, reinterpret_cast<char*>(packet), sizeof(packet), 0);
+      if (len < headerSize + mapPayloadSize || packet[0] != pcpVersion ||
+          packet[1] != (opcodeResponse | opcodeMap)) {
+        continue;
+      }
+
+      // Match the response to its request by nonce, protocol, and internal port
+      const BYTE *payload = &packet[headerSize];
+      WORD internalPort = ntohs(*reinterpret_cast<const WORD*>(&payload[16]));
+      for (int i = 0; i < count; ++i) {
+        PcpMapping &mapping = mappings[i];
+        if (mapping.result != pcpNoResponse ||
+            memcmp(payload, &nonces[i * 12], 12) != 0 ||
+            payload[12] != mapping.protocol || internalPort != mapping.internalPort) {
+          continue;
+        }
+
+        mapping.result = packet[3];
+        if (mapping.result == pcpSuccess) {
+          mapping.lifetime     = ntohl(*reinterpret_cast<const DWORD*>(&packet[4]));
+          mapping.externalPort = ntohs(*reinterpret_cast<const WORD*>(&payload[18]));
+          memcpy(&mapping.externalIp, &payload[20], sizeof(mapping.externalIp));
+          ++succeeded;
+        }
+        --pending;
+        break;
+      }
+    }
+  }
+
+  return succeeded;
+}
+
+
+// Derives the mapping nonce from the mapping and the per-host secret, so the same
+// mapping can be refreshed or deleted later, e.g. after the game is restarted
+void PcpClient::MakeNonce(const PcpMapping &mapping, BYTE nonce[12]) {
+  const in6_addr &internalIp = mapping.thirdParty ? mapping.thirdPartyIp : clientIp;
+
+  for (int i = 0; i < 12; i += sizeof(DWORD)) {
+    ULONGLONG hash = Fnv1a64(fnvBasis64 + i, secret, sizeof(secret));
+    hash = Fnv1a64(hash, &internalIp, sizeof(internalIp));
+    hash = Fnv1a64(hash, &mapping.protocol, sizeof(mapping.protocol));
+    hash = Fnv1a64(hash, &mapping.internalPort, sizeof(mapping.internalPort));
+    memcpy(&nonce[i], &hash, sizeof(DWORD));
+  }
+}
+
+
+int PcpClient::BuildMapRequest(const PcpMapping &mapping, BYTE *buffer,
+                               int bufferLen) {
+  if (bufferLen < headerSize + mapPayloadSize + 20 + 4) {
+    return 0;
+  }
+  memset(buffer, 0, headerSize + mapPayloadSize);
+
+  // Common request header
+  buffer[0] = pcpVersion;
+  buffer[1] = opcodeMap;
+  *reinterpret_cast<DWORD*>(&buffer[4]) = htonl(mapping.lifetime);
+  memcpy(&buffer[8], &clientIp, sizeof(clientIp));
+
+  // MAP opcode payload
+  BYTE *payload = &buffer[headerSize];
+  MakeNonce(mapping, payload);
+  payload[12] = mapping.protocol;
+  *reinterpret_cast<WORD*>(&payload[16]) = htons(mapping.internalPort);
+  *reinterpret_cast<WORD*>(&payload[18]) = htons(mapping.externalPort);
+  if (IN6_IS_ADDR_V4MAPPED(&clientIp)) {
+    // Suggest ::ffff:0.0.0.0 to ask for an IPv4 external address
+    payload[30] = 0xFF;
+    payload[31] = 0xFF;
+  }
+
+  int len = headerSize + mapPayloadSize;
+
+  // Options
+  if (mapping.thirdParty) {
+    buffer[len++] = optThirdParty;
+    buffer[len++] = 0;
+    *reinterpret_cast<WORD*>(&buffer[len]) = htons(sizeof(in6_addr));
+    len += sizeof(WORD);
+    memcpy(&buffer[len], &mapping.thirdPartyIp, sizeof(in6_addr));
+    len += sizeof(in6_addr);
+  }
+  if (mapping.preferFailure && mapping.lifetime != 0) {
+    buffer[len++] = optPreferFailure;
+    buffer[len++] = 0;
+    *reinterpret_cast<WORD*>(&buffer[len]) = 0;
+    len += sizeof(WORD);
+  }
+
+  return len;
+}
+
+
+int PcpMapInBatches(PcpClient &pcp, RequestLimiter &limiter, PcpMapping *mappings,
+                    int count) {
+  int succeeded = 0;
+  std::unique_ptr<RequestTicket[]> tickets(new RequestTicket[count]);
+  for (int start = 0; start < count; ) {
+    // Claims the whole batch at once, since other forwarders to the same gateway
+    // may be holding part of the window
+    int batch = limiter.Acquire(tickets.get(), count - start);
+
+    succeeded += pcp.Map(&mappings[start], batch);
+
+    for (int i = 0; i < batch; ++i) {
+      limiter.Release(tickets[i], PcpOutcome(mappings[start + i].result));
+    }
+    start += batch;
+  }
+  return succeeded;
+}
+
+
+void PcpMapIPv4(const in_addr &in, in6_addr *out) {
+  memset(out, 0, sizeof(*out));
+  out->s6_addr[10] = 0xFF;
+  out->s6_addr[11] = 0xFF;
+  memcpy(&out->s6_addr[12], &in, sizeof(in));
+}
+
+
+bool PcpUnmapIPv4(const in6_addr &in, in_addr *out) {
+  if (!IN6_IS_ADDR_V4MAPPED(&in)) {
+    return false;
+  }
+  memcpy(out, &in.s6_addr[12], sizeof(*out));
+  return true;
+}
+
+
+static RequestOutcome PcpOutcome(int result) {
+  return (result == pcpSuccess)    ? requestOk :
+         (result == pcpNoResponse) ? requestOverloaded : requestRejected;
+}
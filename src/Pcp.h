@@ -0,0 +1,87 @@
+
+#ifndef PCP_H
+#define PCP_H
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+class RequestLimiter;
+
+// PCP (RFC 6887) result codes
+enum PcpResult {
+  pcpNoResponse = -1,
+  pcpSuccess = 0,
+  pcpUnsuppVersion,
+  pcpNotAuthorized,
+  pcpMalformedRequest,
+  pcpUnsuppOpcode,
+  pcpUnsuppOption,
+  pcpMalformedOption,
+  pcpNetworkFailure,
+  pcpNoResources,
+  pcpUnsuppProtocol,
+  pcpUserExQuota,
+  pcpCannotProvideExternal,
+  pcpAddressMismatch,
+  pcpExcessiveRemotePeers
+};
+
+// What a PCP server probe found
+enum PcpServerType {
+  pcpServerNone = 0,     // No response in time
+  pcpServerUnreachable,  // Nothing listens on the port (ICMP port unreachable)
+  pcpServerNatPmp,       // Only speaks NAT-PMP (version 0)
+  pcpServerPcp
+};
+
+struct PcpMapping {
+  BYTE     protocol;       // IPPROTO_UDP or IPPROTO_TCP
+  WORD     internalPort;
+  WORD     externalPort;   // Suggested external port; receives the assigned one
+  DWORD    lifetime;       // Requested lifetime; receives the granted one. 0 deletes.
+  bool     preferFailure;  // Fail rather than assign a different external port
+  bool     thirdParty;     // Map for thirdPartyIp rather than this host
+  in6_addr thirdPartyIp;   // IPv6 or IPv4-mapped IPv6 address
+  in6_addr externalIp;     // Receives the assigned external address
+  int      result;         // Receives a PcpResult
+};
+
+// Minimal PCP client supporting the MAP opcode over IPv4 or IPv6.
+// Requests for many mappings are sent back-to-back and matched to responses by
+// their mapping nonces, rather than one request/response round trip at a time.
+class PcpClient {
+public:
+  PcpClient();
+  ~PcpClient();
+
+  // Connects a socket to the PCP server (normally the gateway, port 5351)
+  bool Open(const sockaddr *server, int serverLen);
+  void Close();
+  bool IsOpen() { return s != INVALID_SOCKET; }
+
+  // Checks whether the server speaks PCP using the ANNOUNCE opcode
+  PcpServerType Probe(int maxTries = 4);
+
+  // Requests all of the mappings at once, and retransmits the unanswered ones
+  // until all are answered or maxTries is reached. Returns the number succeeded.
+  int Map(PcpMapping *mappings, int count, int maxTries = 4);
+
+private:
+  void MakeNonce(const PcpMapping &mapping, BYTE nonce[12]);
+  int  BuildMapRequest(const PcpMapping &mapping, BYTE *buffer, int bufferLen);
+
+  SOCKET   s;
+  in6_addr clientIp;   // As seen by the server, IPv4 addresses are IPv4-mapped
+  BYTE     secret[12]; // Per-host salt that keeps nonces stable across restarts
+};
+
+// Sends PCP MAP requests a window at a time, so the gateway is never sent more than
+// its limiter allows. Returns the number succeeded.
+int PcpMapInBatches(PcpClient &pcp, RequestLimiter &limiter, PcpMapping *mappings,
+                    int count);
+
+// Converts between IPv4 addresses and IPv4-mapped IPv6 addresses
+void PcpMapIPv4(const in_addr &in, in6_addr *out);
+bool PcpUnmapIPv4(const in6_addr &in, in_addr *out);
+
+#endif
@@ -0,0 +1,183 @@
+// Lock-free table of the remote addresses seen by the game's transport layer
+
+#include <winsock2.h>
+#include "PeerTable.h"
+
+namespace PeerTable {
+
+// 0 is an empty slot. Slots are never emptied again, only taken over by eviction,
+// so a lookup can stop at the first empty slot.
+static volatile LONG64 keys[MaxPeers] = {};
+static volatile DWORD  lastUsed[MaxPeers] = {};  // GetTickCount
+static volatile LONG   count = 0;
+
+// Held while a slot is taken over, which is rare
+static SRWLOCK evictLock = SRWLOCK_INIT;
+static void (*callbacks[8])(int id) = {};
+static int numCallbacks = 0;
+
+// A slot being taken over; never matches a real key
+static const LONG64 evictingKey = 1;
+
+static int Evict(LONG64 key);
+
+
+static LONG64 MakeKey(const sockaddr *address, int addressLen) {
+  if (!address || addressLen < static_cast<int>(sizeof(sockaddr_in)) ||
+      address->sa_family != AF_INET) {
+    return 0;
+  }
+  auto *addressIn = reinterpret_cast<const sockaddr_in*>(address);
+  return (1LL << 48) | (static_cast<LONG64>(addressIn->sin_addr.s_addr) << 16) |
+         addressIn->sin_port;
+}
+
+
+static int StartSlot(LONG64 key) {
+  return static_cast<int>((key * 0x9E3779B97F4A7C15ULL) >> 58) % MaxPeers;
+}
+
+
+static void Touch(int slot) {
+  DWORD now = GetTickCount();
+  if (lastUsed[slot] != now) {
+    lastUsed[slot] = now;
+  }
+}
+
+
+static int Find(LONG64 key) {
+  int start = StartSlot(key);
+  for (int i = 0; i < MaxPeers; ++i) {
+    int slot = (start + i) % MaxPeers;
+    // 64-bit reads aren't atomic on x86, so read through a no-op exchange
+    LONG64 cur = InterlockedCompareExchange64(&keys[slot], 0, 0);
+    if (cur == key) {
+      return slot;
+    }
+    if (cur == 0) {
+      break;
+    }
+  }
+  return -1;
+}
+
+
+int GetPeerId(const sockaddr *address, int addressLen) {
+  LONG64 key = MakeKey(address, addressLen);
+  if (key == 0) {
+    return -1;
+  }
+
+  // Broadcasts and multicasts reach many hosts, none of which is a peer
+  auto *addressIn = reinterpret_cast<const sockaddr_in*>(address);
+  ULONG host = ntohl(addressIn->sin_addr.s_addr);
+  if (host == INADDR_ANY || host == INADDR_BROADCAST || (host >> 28) == 14 ||
+      addressIn->sin_port == 0) {
+    return -1;
+  }
+
+  int start = StartSlot(key);
+  for (int i = 0; i < MaxPeers; ++i) {
+    int slot = (start + i) % MaxPeers;
+
+    LONG64 cur = InterlockedCompareExchange64(&keys[slot], 0, 0);
+    if (cur == 0) {
+      lastUsed[slot] = GetTickCount();
+      cur = InterlockedCompareExchange64(&keys[slot], key, 0);
+      if (cur == 0) {
+        InterlockedIncrement(&count);
+        return slot;
+      }
+    }
+    if (cur == key) {
+      Touch(slot);
+      return slot;
+    }
+  }
+
+  return Evict(key);
+}
+
+
+int FindPeerId(const sockaddr *address, int addressLen) {
+  LONG64 key = MakeKey(address, addressLen);
+  int slot = (key != 0) ? Find(key) : -1;
+  if (slot >= 0) {
+    Touch(slot);
+  }
+  return slot;
+}
+
+
+bool GetPeerAddress(int id, sockaddr_in *out) {
+  if (id < 0 || id >= MaxPeers || !out) {
+    return false;
+  }
+
+  LONG64 key = InterlockedCompareExchange64(&keys[id], 0, 0);
+  if (key == 0 || key == evictingKey) {
+    return false;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->sin_family      = AF_INET;
+  out->sin_addr.s_addr = static_cast<ULONG>(key >> 16);
+  out->sin_port        = static_cast<USHORT>(key);
+  return true;
+}
+
+
+int GetPeerCount() {
+  return count;
+}
+
+
+void AddEvictCallback(void (*callback)(int id)) {
+  AcquireSRWLockExclusive(&evictLock);
+  bool found = false;
+  for (int i = 0; i < numCallbacks && !found; ++i) {
+    found = (callbacks[i] == callback);
+  }
+  if (!found && numCallbacks < _countof(callbacks)) {
+    callbacks[numCallbacks++] = callback;
+  }
+  ReleaseSRWLockExclusive(&evictLock);
+}
+
+
+// Gives the slot of the peer idle the longest to the new key, if it has been idle
+// long enough. The slot is marked while the callbacks reset its state, so that
+// nothing finds the new peer's ID before then.
+static int Evict(LONG64 key) {
+  AcquireSRWLockExclusive(&evictLock);
+
+  // Another thread may have added it meanwhile
+  int slot = Find(key);
+  if (slot < 0) {
+    DWORD now = GetTickCount(),
+          longestIdle = 0;
+    for (int i = 0; i < MaxPeers; ++i) {
+      DWORD idle = now - lastUsed[i];
+      if (idle >= IdleEvictMs && idle >= longestIdle &&
+          InterlockedCompareExchange64(&keys[i], 0, 0) != evictingKey) {
+        slot = i;
+        longestIdle = idle;
+      }
+    }
+
+    if (slot >= 0) {
+      InterlockedExchange64(&keys[slot], evictingKey);
+      for (int i = 0; i < numCallbacks; ++i) {
+        callbacks[i](slot);
+      }
+      lastUsed[slot] = now;
+      InterlockedExchange64(&keys[slot], key);
+    }
+  }
+
+  ReleaseSRWLockExclusive(&evictLock);
+  return slot;
+}
+
+} // namespace PeerTable
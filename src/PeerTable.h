@@ -0,0 +1,36 @@
+
+#ifndef PEERTABLE_H
+#define PEERTABLE_H
+
+#include <winsock2.h>
+
+// Assigns small IDs to the remote addresses the game sends to, so that per-peer
+// data can be kept in fixed-size arrays. Lookups are lock-free.
+//
+// Only unicast addresses are added, and only by the send path, so datagrams from
+// senders the game never answered can't use up the table. Once it is full, the
+// peer idle the longest is evicted to make room if it has been idle for at least
+// IdleEvictMs, and its ID is reused. Modules that keep per-peer state reset it
+// from an eviction callback.
+namespace PeerTable {
+
+const int   MaxPeers    = 64;
+const DWORD IdleEvictMs = 60000;
+
+// Gets the ID of the peer at the given IPv4 unicast address, adding it if it is
+// new. Returns -1 for other addresses, or if every peer in the table is active.
+int GetPeerId(const sockaddr *address, int addressLen);
+// Gets the ID of a peer that is already in the table, or -1
+int FindPeerId(const sockaddr *address, int addressLen);
+// Gets the address of a peer by ID
+bool GetPeerAddress(int id, sockaddr_in *out);
+// Gets the number of IDs in use
+int GetPeerCount();
+
+// Adds a function to call with the ID of an evicted peer, before the ID is given
+// to the new one. Adding the same function again has no effect.
+void AddEvictCallback(void (*callback)(int id));
+
+} // namespace PeerTable
+
+#endif
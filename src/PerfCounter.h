@@ -0,0 +1,27 @@
+
+#ifndef PERFCOUNTER_H
+#define PERFCOUNTER_H
+
+#include <windows.h>
+
+// Gets the QueryPerformanceCounter frequency, which is fixed at boot
+inline LONGLONG GetCounterFrequency() {
+  static volatile LONGLONG frequency = 0;
+  if (frequency == 0) {
+    LARGE_INTEGER value;
+    QueryPerformanceFrequency(&value);
+    frequency = value.QuadPart;
+  }
+  return frequency;
+}
+
+// Converts a QueryPerformanceCounter interval to microseconds. Dividing the ticks
+// by an integer (frequency / 1000000) instead is off when the frequency isn't a
+// multiple of 1 MHz, e.g. by 19% with the 3.579545 MHz ACPI timer.
+inline LONGLONG CounterToMicroseconds(LONGLONG ticks) {
+  LONGLONG frequency = GetCounterFrequency();
+  // Split up so that ticks * 1000000 can't overflow for long intervals
+  return (ticks / frequency) * 1000000 + (ticks % frequency) * 1000000 / frequency;
+}
+
+#endif
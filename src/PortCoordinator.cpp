@@ -0,0 +1,315 @@
+// Hands out non-overlapping external port blocks to NetHelper instances on a LAN
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <vector>
+#include "PortCoordinator.h"
+#include "odprintf.h"
+
+namespace {
+
+enum CoordType {
+  coordClaim = 1,  // Sender wants this block; holders answer with coordHeld
+  coordHeld        // Sender holds this block
+};
+
+#pragma pack(push, 1)
+struct CoordPacket {
+  DWORD magic;
+  BYTE  type;
+  BYTE  version;
+  WORD  firstPort;   // First external port of the block, network order
+  WORD  portCount;   // Network order
+  DWORD instanceId;  // Breaks ties between simultaneous claims; lowest wins
+};
+#pragma pack(pop)
+
+struct PortBlock {
+  int firstPort,
+      portCount;
+};
+
+} // anonymous namespace
+
+static const DWORD coordMagic   = 0x43484E4E;  // "NNHC"
+static const BYTE  coordVersion = 1;
+static const char  coordGroup[] = "239.255.47.76";  // Organization-local scope
+static const DWORD replyWait    = 300;
+static const int   maxClaims    = 3;
+
+static SOCKET   coordSocket  = INVALID_SOCKET;
+static WSAEVENT hReadEvent   = WSA_INVALID_EVENT;
+static HANDLE   hStopEvent   = nullptr,
+                hCoordThread = nullptr;
+static bool     wsaStarted   = false;
+
+static sockaddr_in groupAddr = {};
+static DWORD instanceId = 0;
+static PortBlock claimed = {};
+static int portOffset = 0;
+
+static bool OpenCoordSocket(IPAddr adapterAddress);
+static void CloseCoordSocket();
+static void SendPacket(CoordType type, const PortBlock &block);
+static bool ReceivePacket(CoordPacket *out, DWORD timeout);
+static int  FindFreeOffset(const std::vector<PortBlock> &held, int startPort,
+                           int portCount);
+static DWORD WINAPI CoordThreadProc(LPVOID lpParam);
+
+
+int StartPortCoordination(IPAddr adapterAddress, int startPort, int endPort) {
+  StopPortCoordination();
+
+  if (!OpenCoordSocket(adapterAddress)) {
+    odprintf("NetHelper: Could not join the LAN port coordination group (error %d)",
+             WSAGetLastError());
+    CloseCoordSocket();
+    return 0;
+  }
+  instanceId = (GetCurrentProcessId() << 16) ^ GetTickCount() ^ adapterAddress;
+
+  // Claim the lowest block nobody is known to hold. Every holder answers a claim,
+  // so after the first round trip the blocks in use are known, and more rounds
+  // are only needed when another instance claims at the same time.
+  int portCount = endPort - startPort + 1;
+  std::vector<PortBlock> held;
+  bool won = false;
+  int offset = 0;
+  for (int attempt = 0; attempt < maxClaims && !won; ++attempt) {
+    if ((offset = FindFreeOffset(held, startPort, portCount)) < 0) {
+      break;
+    }
+
+    PortBlock block = { startPort + offset, portCount };
+    SendPacket(coordClaim, block);
+    won = true;
+    bool contended = false;  // Whether another instance claimed meanwhile
+
+    DWORD start = GetTickCount(),
+          elapsed;
+    CoordPacket packet;
+    while ((elapsed = GetTickCount() - start) < replyWait &&
+           ReceivePacket(&packet, replyWait - elapsed)) {
+      if (packet.instanceId == instanceId) {
+        continue;
+      }
+      if (packet.type == coordClaim) {
+        contended = true;
+        if (packet.instanceId > instanceId) {
+          // It yields to us, but may have joined the group after our claim went
+          // out, so make sure it hears it
+          SendPacket(coordClaim, block);
+          continue;
+        }
+      }
+
+      PortBlock other = { ntohs(packet.firstPort), ntohs(packet.portCount) };
+      held.push_back(other);
+      if (other.firstPort < block.firstPort + block.portCount &&
+          block.firstPort < other.firstPort + other.portCount) {
+        won = false;
+      }
+    }
+
+    // Only holders answered, so every block in use is known and the lowest free
+    // one can be taken without another round
+    if (!won && !contended) {
+      won = (offset = FindFreeOffset(held, startPort, portCount)) >= 0;
+    }
+  }
+
+  if (!won) {
+    odprintf("NetHelper: Could not claim a block for ports %d-%d from other LAN hosts",
+             startPort, endPort);
+    CloseCoordSocket();
+    return 0;
+  }
+
+  claimed.firstPort = startPort + offset;
+  claimed.portCount = portCount;
+  portOffset = offset;
+  odprintf("NetHelper: Claimed external ports %d-%d from other LAN hosts",
+           claimed.firstPort, claimed.firstPort + portCount - 1);
+
+  // Keep answering claims from instances that start later
+  if (!hStopEvent && !(hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr))) {
+    CloseCoordSocket();
+    return 0;
+  }
+  ResetEvent(hStopEvent);
+  hCoordThread = CreateThread(nullptr, 0, CoordThreadProc, nullptr, 0, nullptr);
+  if (!hCoordThread) {
+    CloseCoordSocket();
+    return 0;
+  }
+
+  return portOffset;
+}
+
+
+void StopPortCoordination() {
+  if (hCoordThread) {
+    SetEvent(hStopEvent);
+    WaitForSingleObject(hCoordThread, INFINITE);
+    CloseHandle(hCoordThread);
+    hCoordThread = nullptr;
+  }
+  CloseCoordSocket();
+
+  claimed.firstPort = 0;
+  claimed.portCount = 0;
+  portOffset = 0;
+}
+
+
+bool IsPortCoordinating() {
+  return hCoordThread != nullptr;
+}
+
+
+int GetExternalPortOffset() {
+  return portOffset;
+}
+
+
+int GetExternalFirstPort() {
+  return (portOffset != 0) ? claimed.firstPort : 0;
+}
+
+
+static DWORD WINAPI CoordThreadProc(LPVOID lpParam) {
+  HANDLE events[] = { hStopEvent, hReadEvent };
+  while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+    WSAResetEvent(hReadEvent);
+
+    CoordPacket packet;
+    while (ReceivePacket(&packet, 0)) {
+      if (packet.type == coordClaim && packet.instanceId != instanceId) {
+        // Answer every claim, not just overlapping ones, so the claimer learns all
+        // of the blocks in use at once
+        SendPacket(coordHeld, claimed);
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+static bool OpenCoordSocket(IPAddr adapterAddress) {
+  WSADATA wsaData;
+  if (!(wsaStarted = (WSAStartup(MAKEWORD(2, 2), &wsaData) == NO_ERROR))) {
+    return false;
+  }
+
+  if ((coordSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+    return false;
+  }
+
+  // Several instances may run on one computer, e.g. on loopback aliases
+  BOOL reuse = TRUE;
+  setsockopt(coordSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&reuse),
+             sizeof(reuse));
+
+  sockaddr_in local = {};
+  local.sin_family      = AF_INET;
+  local.sin_port        = htons(coordPort);
+  local.sin_addr.s_addr = INADDR_ANY;
+  if (bind(coordSocket, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+    return false;
+  }
+
+  groupAddr.sin_family = AF_INET;
+  groupAddr.sin_port   = htons(coordPort);
+  inet_pton(AF_INET, coordGroup, &groupAddr.sin_addr);
+
+  ip_mreq membership = {};
+  membership.imr_multiaddr        = groupAddr.sin_addr;
+  membership.imr_interface.s_addr = adapterAddress;
+  in_addr  outInterface = {};
+  outInterface.s_addr   = adapterAddress;
+  DWORD ttl  = 1,  // Stay on the LAN
+        loop = 1;  // Reach other instances on this computer
+  if (setsockopt(coordSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                 reinterpret_cast<char*>(&membership), sizeof(membership)) != 0 ||
+      setsockopt(coordSocket, IPPROTO_IP, IP_MULTICAST_IF,
+                 reinterpret_cast<char*>(&outInterface), sizeof(outInterface)) != 0) {
+    return false;
+  }
+  setsockopt(coordSocket, IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<char*>(&ttl),
+             sizeof(ttl));
+  setsockopt(coordSocket, IPPROTO_IP, IP_MULTICAST_LOOP,
+             reinterpret_cast<char*>(&loop), sizeof(loop));
+
+  // Used by the answering thread once the block is claimed
+  return ((hReadEvent = WSACreateEvent()) != WSA_INVALID_EVENT) &&
+         WSAEventSelect(coordSocket, hReadEvent, FD_READ) == 0;
+}
+
+
+static void CloseCoordSocket() {
+  if (coordSocket != INVALID_SOCKET) {
+    closesocket(coordSocket);
+    coordSocket = INVALID_SOCKET;
+  }
+  if (hReadEvent != WSA_INVALID_EVENT) {
+    WSACloseEvent(hReadEvent);
+    hReadEvent = WSA_INVALID_EVENT;
+  }
+  if (wsaStarted) {
+    WSACleanup();
+    wsaStarted = false;
+  }
+}
+
+
+static void SendPacket(CoordType type, const PortBlock &block) {
+  CoordPacket packet = { coordMagic, static_cast<BYTE>(type), coordVersion,
+                         htons(static_cast<u_short>(block.firstPort)),
+                         htons(static_cast<u_short>(block.portCount)), instanceId };
+  sendto(coordSocket, reinterpret_cast<const char*>(&packet), sizeof(packet), 0,
+         reinterpret_cast<const sockaddr*>(&groupAddr), sizeof(groupAddr));
+}
+
+
+// Receives the next valid packet, waiting up to timeout milliseconds for one
+static bool ReceivePacket(CoordPacket *out, DWORD timeout) {
+  for (;;) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(coordSocket, &readSet);
+    timeval tv = { static_cast<long>(timeout / 1000),
+                   static_cast<long>((timeout % 1000) * 1000) };
+    if (select(0, &readSet, nullptr, nullptr, &tv) != 1) {
+      return false;
+    }
+
+    int len = recvfrom(coordSocket, reinterpret_cast<char*>(out), sizeof(*out), 0,
+                       nullptr, nullptr);
+    if (len == SOCKET_ERROR && WSAGetLastError() != WSAEMSGSIZE) {
+      return false;
+    }
+    if (len == sizeof(*out) && out->magic == coordMagic &&
+        out->version == coordVersion && ntohs(out->portCount) != 0) {
+      return true;
+    }
+  }
+}
+
+
+// Finds the offset of the lowest block of portCount ports, starting at startPort,
+// that doesn't overlap any held block. Returns -1 if no block fits below 65536.
+static int FindFreeOffset(const std::vector<PortBlock> &held, int startPort,
+                          int portCount) {
+  for (int first = startPort; first + portCount - 1 <= 65535; first += portCount) {
+    bool overlaps = false;
+    for (auto &block : held) {
+      overlaps |= (block.firstPort < first + portCount) &&
+                  (first < block.firstPort + block.portCount);
+    }
+    if (!overlaps) {
+      return first - startPort;
+    }
+  }
+  return -1;
+}
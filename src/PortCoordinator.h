@@ -0,0 +1,30 @@
+
+#ifndef PORTCOORDINATOR_H
+#define PORTCOORDINATOR_H
+
+#include <winsock2.h>
+#include <iphlpapi.h>
+
+// Coordinates port forwarding between NetHelper instances on the same LAN, so
+// several hosts behind one NAT map distinct blocks of external ports instead of
+// overwriting each other's mappings. Block 0 is the game's port range itself;
+// each later block follows the previous one. Instances announce the block they
+// hold over multicast, and every holder answers a claim, so a new instance learns
+// the blocks in use in one round trip.
+
+const WORD coordPort = 47775;  // Just below the game's default port range
+
+// Joins the coordination group on the adapter with the given address and claims
+// the lowest free block for startPort-endPort, then keeps answering claims from
+// other instances. Waits up to about a second for replies. Returns the offset to
+// add to each port to get its external port, or 0 if coordination failed.
+int StartPortCoordination(IPAddr adapterAddress, int startPort, int endPort);
+void StopPortCoordination();
+
+bool IsPortCoordinating();
+// Gets the external port offset of the claimed block, 0 for block 0
+int GetExternalPortOffset();
+// Gets the first external port of the claimed block, or 0 for block 0
+int GetExternalFirstPort();
+
+#endif
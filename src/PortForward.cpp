@@ -5,10 +5,15 @@
 
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <winsock2.h>
 #include <iphlpapi.h>
 #include <memory>
+#include <map>
+#include <string>
 #include "PortForward.h"
+#include "IgdScan.h"
+#include "NetMonitor.h"
 
 #include "../miniupnp/miniupnpc/miniwget.h"
 #include "../miniupnp/miniupnpc/upnpcommands.h"
@@ -16,12 +21,45 @@
 #include "../miniupnp/miniupnpc/miniupnpcstrings.h"
 #include "../libnatpmp/natpmp.h"
 
-static bool GetInterfaceToInternet(in_addr_t *outGateway);
 static int ListenForPmpResponse(natpmp_t &natPmp, natpmpresp_t *response = nullptr,
                                 int maxTries = 9);
-
-char PortForwarder::internalIp[INET6_ADDRSTRLEN] = {},
-     PortForwarder::externalIp[INET6_ADDRSTRLEN] = {};
+static void MakePcpMapping(PcpMapping *out, bool udp, int externalPort,
+                           int internalPort, const char *ipAddress,
+                           const char *localIp, int duration);
+static RequestOutcome UpnpOutcome(int error);
+static RequestOutcome PmpOutcome(int error);
+static int RunInParallel(PortForwarder *forwarder, bool unforward, bool udp,
+                         const int *ports, int count, int externalOffset,
+                         char *description, int duration, bool *results);
+static bool FindIgd(UPNPDev *devices, UPNPUrls *urls, IGDdatas *data, char *lanIp,
+                    int lanIpLen, char *wanIp);
+
+// An IGD found by discovery. Each PortForwarder would otherwise redo SSDP
+// discovery and download and parse the IGD's description again.
+struct CachedIgd {
+  std::string rootDescUrl;
+  IGDdatas    data;
+  char        lanIp[INET6_ADDRSTRLEN];  // Local address that reaches the IGD
+};
+
+static SRWLOCK igdCacheLock = SRWLOCK_INIT;
+static std::map<std::string, CachedIgd> igdCache;  // By adapter and gateway address
+
+// Which of PCP and NAT-PMP a gateway answered, so each PortForwarder through it
+// doesn't wait on the probe again
+struct CachedProbe {
+  PcpServerType found;
+  int           tries;       // Of the probe, when nothing answered
+  LONG          generation;  // NetMonitor's adapter generation
+};
+
+static SRWLOCK probeCacheLock = SRWLOCK_INIT;
+static std::map<std::string, CachedProbe> probeCache;  // Keyed as igdCache
+
+static bool FindProbe(const std::string &key, LONG generation, int tries,
+                      PcpServerType *found);
+static void StoreProbe(const std::string &key, LONG generation, int tries,
+                       PcpServerType found);
 
 
 PortForwarder::PortForwarder() {
@@ -29,9 +67,19 @@ PortForwarder::PortForwarder() {
 }
 
 
-PortForwarder::PortForwarder(bool useUpnp, bool usePmp) {
+PortForwarder::PortForwarder(bool useUpnp, bool usePmp)
+  : PortForwarder(useUpnp, usePmp, nullptr) { }
+
+
+PortForwarder::PortForwarder(bool useUpnp, bool usePmp,
+                             const NetMonitor::Adapter *_adapter) {
   upnpInited = false;
   pmpInited  = false;
+  pcpInited  = false;
+  hasAdapter = false;
+  lanIp[0]   = '\0';
+  wanIp[0]   = '\0';
+  externalOffset = 0;
 
   WSADATA wsaData;
   wsaStarted = WSAStartup(MAKEWORD(2, 2), &wsaData) == NO_ERROR;
@@ -42,11 +90,25 @@ PortForwarder::PortForwarder(bool useUpnp, bool usePmp) {
   memset(&urls, 0, sizeof(urls));
   memset(&data, 0, sizeof(data));
 
+  // Get the adapter interface that reaches the internet if one wasn't given, and
+  // use its gateway. (Libnatpmp's built-in gateway detection is broken in WINE)
+  adapterOnly = (_adapter != nullptr);
+  if ((hasAdapter = adapterOnly)) {
+    adapter = *_adapter;
+  }
+  else {
+    hasAdapter = NetMonitor::GetBestAdapter(&adapter);
+  }
+  if (hasAdapter) {
+    inet_ntop(AF_INET, &adapter.address, lanIp, sizeof(lanIp));
+  }
+
   Initialize(useUpnp, usePmp);
 }
 
 
 PortForwarder::~PortForwarder() {
+  pcp.Close();
   if (pmpInited) {
     closenatpmp(&natPmp);
   }
@@ -62,24 +124,49 @@ PortForwarder::~PortForwarder() {
 // Adds a new port forward mapping
 bool PortForwarder::Forward(bool udp, int externalPort, int internalPort,
                             char *ipAddress, char *description, int duration) {
-  // Use NAT-PMP/PCP if it was initialized
+  // Use PCP if it was initialized. Existing mappings made by this host are
+  // replaced, since the mapping nonce is the same.
+  if (pcpInited) {
+    PcpMapping mapping;
+    MakePcpMapping(&mapping, udp, externalPort, internalPort, ipAddress, lanIp,
+                   duration);
+    PcpMapInBatches(pcp, *limiter, &mapping, 1);
+    if (mapping.result != pcpSuccess || mapping.externalPort != externalPort) {
+      return false;
+    }
+
+    in_addr addr;
+    if (!wanIp[0] && PcpUnmapIPv4(mapping.externalIp, &addr)) {
+      inet_ntop(AF_INET, &addr, wanIp, sizeof(wanIp));
+    }
+    return true;
+  }
+
+  // Use NAT-PMP if it was initialized
   if (pmpInited) {
     // Remove any mapping that already exists for the protocol and port first
+    RequestTicket ticket = limiter->Acquire();
     sendnewportmappingrequest(&natPmp, udp ? NATPMP_PROTOCOL_UDP :
       NATPMP_PROTOCOL_TCP, internalPort, 0, 0);
-    if (ListenForPmpResponse(natPmp) == NATPMP_TRYAGAIN) {
+    int error = ListenForPmpResponse(natPmp);
+    limiter->Release(ticket, PmpOutcome(error));
+    if (error == NATPMP_TRYAGAIN) {
       return false;
     }
 
     // Request the new port mapping
+    ticket = limiter->Acquire();
     if (sendnewportmappingrequest(&natPmp, udp ? NATPMP_PROTOCOL_UDP :
         NATPMP_PROTOCOL_TCP, internalPort, externalPort, duration) != 12) {
+      limiter->Release(ticket, requestRejected);
       return false;
     }
 
     // Listen for response and test if the correct ports were mapped
     natpmpresp_t response;
-    if (ListenForPmpResponse(natPmp, &response) != 0) {
+    error = ListenForPmpResponse(natPmp, &response);
+    limiter->Release(ticket, PmpOutcome(error));
+    if (error != 0) {
       return false;
     }
     if (response.pnu.newportmapping.mappedpublicport != externalPort ||
@@ -97,10 +184,10 @@ bool PortForwarder::Forward(bool udp, int externalPort, int internalPort,
   }
 
   if (!ipAddress || strlen(ipAddress) < 7) {
-    if (!internalIp[0]) {
+    if (!lanIp[0]) {
       return false;
     }
-    ipAddress = internalIp;
+    ipAddress = lanIp;
   }
 
   char *protocol = udp ? "UDP" : "TCP",
@@ -114,26 +201,40 @@ bool PortForwarder::Forward(bool udp, int externalPort, int internalPort,
   }
 
   // Remove any mapping that already exists for the protocol and port first
-  UPNP_DeletePortMapping(urls.controlURL, data.first.servicetype, ePort, protocol,
-    nullptr);
+  RequestTicket ticket = limiter->Acquire();
+  int error = UPNP_DeletePortMapping(urls.controlURL, data.first.servicetype, ePort,
+                                     protocol, nullptr);
+  limiter->Release(ticket, UpnpOutcome(error));
 
   // Add the new mapping
-  return UPNP_AddPortMapping(urls.controlURL, data.first.servicetype, ePort,
-    iPort, ipAddress, description, protocol, 0, time) == UPNPCOMMAND_SUCCESS;
+  ticket = limiter->Acquire();
+  error = UPNP_AddPortMapping(urls.controlURL, data.first.servicetype, ePort, iPort,
+                              ipAddress, description, protocol, 0, time);
+  limiter->Release(ticket, UpnpOutcome(error));
+  return error == UPNPCOMMAND_SUCCESS;
 }
 
 
 // Removes a port forward mapping.
 // For UPnP, port is external port. For NAT-PMP/PCP, port is internal port.
-bool PortForwarder::Unforward(bool udp, int port) {
-  // Use NAT-PMP/PCP if it was initialized
+bool PortForwarder::Unforward(bool udp, int externalPort, int internalPort) {
+  // Use PCP if it was initialized; a lifetime of 0 deletes the mapping
+  if (pcpInited) {
+    PcpMapping mapping;
+    MakePcpMapping(&mapping, udp, externalPort, internalPort, nullptr, lanIp, 0);
+    PcpMapInBatches(pcp, *limiter, &mapping, 1);
+    return mapping.result == pcpSuccess;
+  }
+
+  // Use NAT-PMP if it was initialized; mappings are identified by internal port
   if (pmpInited) {
     // Request to remove the specified mapping
-    if (sendnewportmappingrequest(&natPmp, udp ? NATPMP_PROTOCOL_UDP :
-          NATPMP_PROTOCOL_TCP, port, 0, 0) != 12 ||
-        ListenForPmpResponse(natPmp) != 0) {
-      return false;
-    }
+    RequestTicket ticket = limiter->Acquire();
+    int error = (sendnewportmappingrequest(&natPmp, udp ? NATPMP_PROTOCOL_UDP :
+                   NATPMP_PROTOCOL_TCP, internalPort, 0, 0) != 12) ? -1 :
+                ListenForPmpResponse(natPmp);
+    limiter->Release(ticket, PmpOutcome(error));
+    return error == 0;
   }
   else if (!upnpInited) {
     return false;
@@ -141,56 +242,241 @@ bool PortForwarder::Unforward(bool udp, int port) {
 
   char *protocol = udp ? "UDP" : "TCP",
        ePort[11];
-  if (sprintf_s(ePort, sizeof(ePort), "%i", port) < 0) {
+  if (sprintf_s(ePort, sizeof(ePort), "%i", externalPort) < 0) {
     return false;
   }
 
   // Request to remove the specified mapping
-  return UPNP_DeletePortMapping(urls.controlURL, data.first.servicetype, ePort,
-    protocol, nullptr) == UPNPCOMMAND_SUCCESS;
+  RequestTicket ticket = limiter->Acquire();
+  int error = UPNP_DeletePortMapping(urls.controlURL, data.first.servicetype, ePort,
+                                     protocol, nullptr);
+  limiter->Release(ticket, UpnpOutcome(error));
+  return error == UPNPCOMMAND_SUCCESS;
 }
 
 
-// Initialize NAT-PMP/PCP or UPnP
+// Adds mappings for many ports
+int PortForwarder::ForwardMany(bool udp, const int *ports, int count,
+                               char *description, int duration, bool *results) {
+  if (!ports || count <= 0) {
+    return 0;
+  }
+
+  int succeeded = 0;
+  if (pcpInited) {
+    // Send the MAP requests back-to-back instead of one round trip each, as many
+    // at a time as the gateway takes
+    std::unique_ptr<PcpMapping[]> mappings(new PcpMapping[count]);
+    for (int i = 0; i < count; ++i) {
+      MakePcpMapping(&mappings[i], udp, ports[i] + externalOffset, ports[i], nullptr,
+                     lanIp, duration);
+    }
+    PcpMapInBatches(pcp, *limiter, mappings.get(), count);
+
+    for (int i = 0; i < count; ++i) {
+      bool mapped = mappings[i].result == pcpSuccess &&
+                    mappings[i].externalPort == ports[i] + externalOffset;
+      in_addr addr;
+      if (mapped && !wanIp[0] && PcpUnmapIPv4(mappings[i].externalIp, &addr)) {
+        inet_ntop(AF_INET, &addr, wanIp, sizeof(wanIp));
+      }
+      if (results) {
+        results[i] = mapped;
+      }
+      succeeded += mapped;
+    }
+  }
+  else if (upnpInited) {
+    succeeded = RunInParallel(this, false, udp, ports, count, externalOffset,
+                              description, duration, results);
+  }
+  else {
+    // libnatpmp only has one request outstanding per handle
+    for (int i = 0; i < count; ++i) {
+      bool mapped = Forward(udp, ports[i] + externalOffset, ports[i], nullptr,
+                            description, duration);
+      if (results) {
+        results[i] = mapped;
+      }
+      succeeded += mapped;
+    }
+  }
+
+  return succeeded;
+}
+
+
+// Removes mappings for many ports
+int PortForwarder::UnforwardMany(bool udp, const int *ports, int count,
+                                 bool *results) {
+  if (!ports || count <= 0) {
+    return 0;
+  }
+
+  int succeeded = 0;
+  if (pcpInited) {
+    std::unique_ptr<PcpMapping[]> mappings(new PcpMapping[count]);
+    for (int i = 0; i < count; ++i) {
+      MakePcpMapping(&mappings[i], udp, ports[i] + externalOffset, ports[i], nullptr,
+                     lanIp, 0);
+    }
+    PcpMapInBatches(pcp, *limiter, mappings.get(), count);
+
+    for (int i = 0; i < count; ++i) {
+      bool removed = mappings[i].result == pcpSuccess;
+      if (results) {
+        results[i] = removed;
+      }
+      succeeded += removed;
+    }
+  }
+  else if (upnpInited) {
+    succeeded = RunInParallel(this, true, udp, ports, count, externalOffset, nullptr,
+                              0, results);
+  }
+  else {
+    for (int i = 0; i < count; ++i) {
+      bool removed = Unforward(udp, ports[i] + externalOffset, ports[i]);
+      if (results) {
+        results[i] = removed;
+      }
+      succeeded += removed;
+    }
+  }
+
+  return succeeded;
+}
+
+
+// Initialize PCP, NAT-PMP, or UPnP
 bool PortForwarder::Initialize(bool useUpnp, bool usePmp) {
-  if (pmpInited || upnpInited) {
+  if (pcpInited || pmpInited || upnpInited) {
     return true;
   }
 
-  // Try NAT-PMP/PCP first. If it succeeds, use that and ignore UPnP
-  if (usePmp && !pmpInited) {
-    in_addr_t gateway = NULL;
-    bool forceGateway = GetInterfaceToInternet(&gateway);
-    if (initnatpmp(&natPmp, forceGateway, gateway) == 0 &&
-        sendpublicaddressrequest(&natPmp) == 2) {
+  // Try PCP, then NAT-PMP. If either succeeds, use that and ignore UPnP
+  bool tryNatPmp = usePmp,
+       haveGateway = hasAdapter && adapter.gateway != INADDR_ANY;
+  char gatewayIp[INET_ADDRSTRLEN] = "default gateway";
+  if (haveGateway) {
+    inet_ntop(AF_INET, &adapter.gateway, gatewayIp, sizeof(gatewayIp));
+  }
+  std::string cacheKey = std::string(lanIp) + " " + gatewayIp;
+  LONG generation = NetMonitor::GetAdapterGeneration();
+  int  probeTries = useUpnp ? 2 : 4;
+
+  if (usePmp && haveGateway) {
+    // Skip the probe if this gateway was probed before
+    PcpServerType found = pcpServerNone;
+    bool known = FindProbe(cacheKey, generation, probeTries, &found);
+
+    sockaddr_in server = {};
+    server.sin_family      = AF_INET;
+    server.sin_port        = htons(NATPMP_PORT);
+    server.sin_addr.s_addr = adapter.gateway;
+
+    if ((!known || found == pcpServerPcp) &&
+        pcp.Open(reinterpret_cast<sockaddr*>(&server), sizeof(server))) {
+      if (!known) {
+        found = pcp.Probe(probeTries);
+      }
+      if (found == pcpServerPcp) {
+        StoreProbe(cacheKey, generation, probeTries, found);
+        limiter = RequestLimiter::ForGateway(std::string("PCP ") + gatewayIp);
+        return (pcpInited = true);
+      }
+      pcp.Close();
+    }
+
+    // Fall back to NAT-PMP version 0 if the server said it only speaks that, or if
+    // nothing answered, as some NAT-PMP servers drop other versions. Not if nothing
+    // listens on the port, or neither answered before.
+    tryNatPmp = (found == pcpServerNatPmp) || (!known && found == pcpServerNone);
+    if (!tryNatPmp) {
+      StoreProbe(cacheKey, generation, probeTries, found);
+    }
+  }
+
+  if (tryNatPmp && !pmpInited) {
+    in_addr_t gateway = hasAdapter ? adapter.gateway : INADDR_ANY;
+    bool forceGateway = gateway != INADDR_ANY;
+    if (initnatpmp(&natPmp, forceGateway, gateway) == 0) {
       // Try to communicate via NAT-PMP/PCP packets
       natpmpresp_t response;
-      int error = ListenForPmpResponse(natPmp, &response, useUpnp ? 2 : 9);
+      int error = (sendpublicaddressrequest(&natPmp) != 2) ? -1 :
+                  ListenForPmpResponse(natPmp, &response, useUpnp ? 2 : 9);
 
       // Successfully initialized NAT-PMP/PCP, store external IP
       if (!error) {
-        if (!externalIp[0]) {
-          inet_ntop(AF_INET, &response.pnu.publicaddress.addr, &externalIp[0], sizeof(externalIp));
+        if (haveGateway) {
+          StoreProbe(cacheKey, generation, probeTries, pcpServerNatPmp);
         }
+        inet_ntop(AF_INET, &response.pnu.publicaddress.addr, wanIp, sizeof(wanIp));
+        limiter = RequestLimiter::ForGateway(std::string("NAT-PMP ") + gatewayIp);
         return (pmpInited = true);
       }
+      closenatpmp(&natPmp);
+    }
+    if (haveGateway) {
+      StoreProbe(cacheKey, generation, probeTries, pcpServerNone);
     }
   }
 
   if (useUpnp && !upnpInited) {
+    // Reuse the IGD found through this adapter and gateway before, if it still
+    // answers. The URLs are rebuilt from its parsed description, so that takes one
+    // SOAP round trip rather than discovery and a download of the description.
+    CachedIgd cached;
+    AcquireSRWLockShared(&igdCacheLock);
+    auto it = igdCache.find(cacheKey);
+    bool haveCached = (it != igdCache.end());
+    if (haveCached) {
+      cached = it->second;
+    }
+    ReleaseSRWLockShared(&igdCacheLock);
+
+    if (haveCached) {
+      data = cached.data;
+      GetUPNPUrls(&urls, &data, cached.rootDescUrl.c_str(), 0);
+      if (urls.controlURL &&
+          UPNP_GetExternalIPAddress(urls.controlURL, data.first.servicetype, wanIp) ==
+            UPNPCOMMAND_SUCCESS) {
+        strcpy_s(lanIp, sizeof(lanIp), cached.lanIp);
+        limiter = RequestLimiter::ForGateway(std::string("UPnP ") + urls.controlURL);
+        return (upnpInited = true);
+      }
+
+      // Gone or replaced; discover it again
+      FreeUPNPUrls(&urls);
+      memset(&urls, 0, sizeof(urls));
+      memset(&data, 0, sizeof(data));
+      wanIp[0] = '\0';
+      AcquireSRWLockExclusive(&igdCacheLock);
+      igdCache.erase(cacheKey);
+      ReleaseSRWLockExclusive(&igdCacheLock);
+    }
+
     // Get list of UPnP devices, then find the IGD, internal IP, and external IP
     int error = 0;
     bool result = false;
-    UPNPDev *devices = upnpDiscover(2000, nullptr, nullptr, 0, false, 2, &error);
+    // If forwarding through a specific adapter, only search from that one
+    UPNPDev *devices = upnpDiscover(2000, adapterOnly ? lanIp : nullptr, nullptr, 0,
+                                    false, 2, &error);
     if (!devices) {
       return false;
     }
-    if (UPNP_GetValidIGD(devices, &urls, &data, internalIp, sizeof(internalIp))) {
-      if (!externalIp[0]) {
-        UPNP_GetExternalIPAddress(urls.controlURL, data.first.servicetype,
-                                  externalIp);
-      }
+    if (FindIgd(devices, &urls, &data, lanIp, sizeof(lanIp), wanIp)) {
+      limiter = RequestLimiter::ForGateway(std::string("UPnP ") + urls.controlURL);
       upnpInited = true;
+
+      if (urls.rootdescURL) {
+        cached.rootDescUrl = urls.rootdescURL;
+        cached.data        = data;
+        strcpy_s(cached.lanIp, sizeof(cached.lanIp), lanIp);
+        AcquireSRWLockExclusive(&igdCacheLock);
+        igdCache[cacheKey] = cached;
+        ReleaseSRWLockExclusive(&igdCacheLock);
+      }
     }
     freeUPNPDevlist(devices);
 
@@ -200,7 +486,7 @@ bool PortForwarder::Initialize(bool useUpnp, bool usePmp) {
     }
   }
 
-  return pmpInited || upnpInited;
+  return pcpInited || pmpInited || upnpInited;
 }
 
 
@@ -210,56 +496,102 @@ bool PortForwarder::IsUsingUpnp() {
 
 
 bool PortForwarder::IsUsingPmp() {
-  return pmpInited;
+  return pmpInited || pcpInited;
 }
 
 
-// Obtains the adapter interface that reaches the internet, get its gateway, and
-// store local IP. (Libnatpmp's built-in gateway detection is broken in WINE)
-static bool GetInterfaceToInternet(in_addr_t *outGateway) {
-  if (!outGateway) {
-    return false;
-  }
-
-  // Get the best network interface for 0.0.0.0
-  DWORD bestInterfaceIndex = NULL;
-  if (GetBestInterface(ADDR_ANY, &bestInterfaceIndex) != NO_ERROR) {
-    return false;
-  }
+bool PortForwarder::IsUsingPcp() {
+  return pcpInited;
+}
 
-  // Request list of adapters
-  DWORD numAdapters = 1;
-  GetNumberOfInterfaces(&numAdapters);
 
-  ULONG bufLen  = sizeof(IP_ADAPTER_INFO) * numAdapters,
-        error   = NO_ERROR,
-        resizes = 0;
-  std::unique_ptr<BYTE[]> infos;
-  do {
-    infos.reset(new BYTE[bufLen]);
-    if (!infos) {
-      return false;
+// Finds the first connected IGD among the devices, or failing that the first IGD,
+// as UPNP_GetValidIGD does, and gets the host's address on its LAN and its external
+// address. Each description is scanned in the buffer it was downloaded to.
+static bool FindIgd(UPNPDev *devices, UPNPUrls *urls, IGDdatas *data, char *lanIp,
+                    int lanIpLen, char *wanIp) {
+  bool connected = false;
+  for (UPNPDev *device = devices; device && !connected; device = device->pNext) {
+    int  size   = 0,
+         status = 0;
+    char address[INET6_ADDRSTRLEN] = "";
+    char *description = static_cast<char*>(
+      miniwget_getaddr(device->descURL, &size, address, sizeof(address),
+                       device->scope_id, &status));
+    IGDdatas scanned;
+    bool isIgd = description && status == 200 &&
+                 ScanIgdDescription(description, size, &scanned);
+    free(description);
+    if (!isIgd) {
+      continue;
     }
 
-    error = GetAdaptersInfo(reinterpret_cast<IP_ADAPTER_INFO*>(infos.get()), &bufLen);
-    ++resizes;
-  } while (error == ERROR_BUFFER_OVERFLOW && resizes < 3);
-
-  // Enumerate through adapters and get the one with the index we're looking for
-  if (error == NO_ERROR) {
-    for (auto *curAdapter = reinterpret_cast<IP_ADAPTER_INFO*>(infos.get());
-         curAdapter != nullptr; curAdapter = curAdapter->Next) {
-      if (curAdapter->Index == bestInterfaceIndex) {
-        if (!PortForwarder::internalIp[0]) {
-          strcpy_s(PortForwarder::internalIp, sizeof(PortForwarder::internalIp),
-                   curAdapter->IpAddressList.IpAddress.String);
-        }
-        return inet_pton(AF_INET, curAdapter->GatewayList.IpAddress.String, outGateway) == 1;
-      }
+    UPNPUrls deviceUrls;
+    GetUPNPUrls(&deviceUrls, &scanned, device->descURL, device->scope_id);
+    char externalIp[INET6_ADDRSTRLEN] = "";
+    connected = deviceUrls.controlURL &&
+                UPNP_GetExternalIPAddress(deviceUrls.controlURL,
+                                          scanned.first.servicetype, externalIp) ==
+                  UPNPCOMMAND_SUCCESS &&
+                externalIp[0] && strcmp(externalIp, "0.0.0.0") != 0;
+    if (!connected && urls->controlURL) {
+      FreeUPNPUrls(&deviceUrls);
+      continue;
     }
+    FreeUPNPUrls(urls);
+    *urls = deviceUrls;
+    *data = scanned;
+    if (address[0]) {
+      strcpy_s(lanIp, lanIpLen, address);
+    }
+    strcpy_s(wanIp, INET6_ADDRSTRLEN, externalIp);
   }
+  return urls->controlURL != nullptr;
+}
 
-  return false;
+// Finds what the probe of the gateway found before, unless an adapter changed
+// since. That nothing answered only counts if the probe waited as long.
+static bool FindProbe(const std::string &key, LONG generation, int tries,
+                      PcpServerType *found) {
+  AcquireSRWLockShared(&probeCacheLock);
+  auto it = probeCache.find(key);
+  bool known = it != probeCache.end() && it->second.generation == generation &&
+               (it->second.found != pcpServerNone || it->second.tries >= tries);
+  if (known) {
+    *found = it->second.found;
+  }
+  ReleaseSRWLockShared(&probeCacheLock);
+  return known;
+}
+
+
+static void StoreProbe(const std::string &key, LONG generation, int tries,
+                       PcpServerType found) {
+  AcquireSRWLockExclusive(&probeCacheLock);
+  probeCache[key] = { found, tries, generation };
+  ReleaseSRWLockExclusive(&probeCacheLock);
+}
+
+
+// Fills in a PCP MAP request. If ipAddress is another host's, the THIRD_PARTY
+// option is used to map ports for it.
+static void MakePcpMapping(PcpMapping *out, bool udp, int externalPort,
+                           int internalPort, const char *ipAddress,
+                           const char *localIp, int duration) {
+  memset(out, 0, sizeof(*out));
+  out->protocol     = udp ? IPPROTO_UDP : IPPROTO_TCP;
+  out->internalPort = static_cast<WORD>(internalPort);
+  out->externalPort = static_cast<WORD>(externalPort);
+  out->lifetime     = static_cast<DWORD>(duration);
+  // Other players connect to the same port numbers, so any other port is useless
+  out->preferFailure = true;
+
+  in_addr addr;
+  if (ipAddress && strlen(ipAddress) >= 7 && strcmp(ipAddress, localIp) != 0 &&
+      inet_pton(AF_INET, ipAddress, &addr) == 1) {
+    out->thirdParty = true;
+    PcpMapIPv4(addr, &out->thirdPartyIp);
+  }
 }
 
 
@@ -287,4 +619,91 @@ static int ListenForPmpResponse(natpmp_t &natPmp, natpmpresp_t *response,
     ++tries;
   } while (error == NATPMP_TRYAGAIN && tries < maxTries);
   return error;
-}
\ No newline at end of file
+}
+
+
+// Transport failures (miniupnpc's negative codes) and 5xx codes such as 501 Action
+// Failed suggest the router is struggling; other errors are real answers
+static RequestOutcome UpnpOutcome(int error) {
+  return (error == UPNPCOMMAND_SUCCESS)               ? requestOk :
+         (error < 0 || (error >= 500 && error < 600)) ? requestOverloaded :
+                                                        requestRejected;
+}
+
+
+static RequestOutcome PmpOutcome(int error) {
+  return (error == 0)               ? requestOk :
+         (error == NATPMP_TRYAGAIN) ? requestOverloaded : requestRejected;
+}
+
+
+namespace {
+
+struct ParallelJob {
+  PortForwarder *forwarder;
+  bool           unforward,
+                 udp;
+  const int     *ports;
+  int            count,
+                 externalOffset;
+  char          *description;
+  int            duration;
+  bool          *results;
+  volatile LONG  next,
+                 succeeded;
+};
+
+} // anonymous namespace
+
+
+// Takes the next port until there are none left. The limiter decides how many of
+// the workers actually have a request out at once.
+static DWORD WINAPI ParallelWorkerProc(LPVOID lpParam) {
+  auto *job = static_cast<ParallelJob*>(lpParam);
+  for (LONG i; (i = InterlockedIncrement(&job->next) - 1) < job->count; ) {
+    int port = job->ports[i];
+    bool result = job->unforward ?
+      job->forwarder->Unforward(job->udp, port + job->externalOffset, port) :
+      job->forwarder->Forward(job->udp, port + job->externalOffset, port, nullptr,
+                              job->description, job->duration);
+    if (job->results) {
+      job->results[i] = result;
+    }
+    if (result) {
+      InterlockedIncrement(&job->succeeded);
+    }
+  }
+  return 0;
+}
+
+
+// Forwards or unforwards the ports from several threads, since each UPnP request
+// blocks on its own HTTP connection
+static int RunInParallel(PortForwarder *forwarder, bool unforward, bool udp,
+                         const int *ports, int count, int externalOffset,
+                         char *description, int duration, bool *results) {
+  static const int maxWorkers = 16;
+
+  ParallelJob job = { forwarder, unforward, udp, ports, count, externalOffset,
+                      description, duration, results, 0, 0 };
+
+  HANDLE threads[maxWorkers];
+  int numThreads = 0;
+  for (; numThreads < count - 1 && numThreads < maxWorkers - 1; ++numThreads) {
+    if (!(threads[numThreads] =
+            CreateThread(nullptr, 0, ParallelWorkerProc, &job, 0, nullptr))) {
+      break;
+    }
+  }
+
+  // This thread is a worker as well, so the job finishes even if none started
+  ParallelWorkerProc(&job);
+  if (numThreads > 0) {
+    WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+  }
+  for (int i = 0; i < numThreads; ++i) {
+    CloseHandle(threads[i]);
+  }
+
+  return job.succeeded;
+}
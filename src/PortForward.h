@@ -4,6 +4,10 @@
 #define PORTFORWARD_H
 
 #include <ws2tcpip.h>
+#include <memory>
+#include "NetMonitor.h"
+#include "Pcp.h"
+#include "RequestLimiter.h"
 #include "../miniupnp/miniupnpc/miniupnpc.h"
 #include "../libnatpmp/natpmp.h"
 
@@ -11,26 +15,53 @@ class PortForwarder {
 public:
   PortForwarder();
   PortForwarder(bool useUpnp, bool usePmp);
+  // Forwards only through the given adapter's gateway, or the best one if null
+  PortForwarder(bool useUpnp, bool usePmp, const NetMonitor::Adapter *adapter);
   ~PortForwarder();
 
   bool Forward(bool udp, int externalPort, int internalPort, char *ipAddress,
                char *description, int duration);
-  bool Unforward(bool udp, int port);
+  bool Unforward(bool udp, int port) { return Unforward(udp, port, port); }
+  bool Unforward(bool udp, int externalPort, int internalPort);
 
+  // Adds or removes mappings for each of the ports, with the external port offset
+  // by SetExternalPortOffset. As many requests are kept in flight at once as the
+  // gateway's RequestLimiter allows, except with NAT-PMP, which is one at a time.
+  // Returns the number of ports that succeeded; results (optional) receives the
+  // status of each port.
+  int ForwardMany(bool udp, const int *ports, int count, char *description,
+                  int duration, bool *results = nullptr);
+  int UnforwardMany(bool udp, const int *ports, int count, bool *results = nullptr);
+
+  // Maps each internal port p to external port p + offset in ForwardMany and
+  // UnforwardMany, so LAN hosts behind one NAT can use distinct external ports
+  void SetExternalPortOffset(int offset) { externalOffset = offset; }
   bool Initialize(bool useUpnp, bool usePmp);
 
   bool IsUsingUpnp();
-  bool IsUsingPmp();
+  bool IsUsingPmp();  // True for both NAT-PMP and PCP
+  bool IsUsingPcp();
 
-  static char internalIp[INET6_ADDRSTRLEN],
-              externalIp[INET6_ADDRSTRLEN];
+  const char* GetInternalIp() { return lanIp; }
+  const char* GetExternalIp() { return wanIp; }
+  // Requests the gateway currently takes at once, for diagnostics
+  int GetRequestWindow() { return limiter ? limiter->GetWindow() : 0; }
 
 private:
+  NetMonitor::Adapter adapter;
+  bool hasAdapter,
+       adapterOnly;
+  int  externalOffset;
+  char lanIp[INET6_ADDRSTRLEN],
+       wanIp[INET6_ADDRSTRLEN];
   bool upnpInited,
-       pmpInited;
+       pmpInited,
+       pcpInited;
   UPNPUrls urls;
   IGDdatas data;
   natpmp_t natPmp;
+  PcpClient pcp;
+  std::shared_ptr<RequestLimiter> limiter;  // Set once a protocol is initialized
   bool wsaStarted;
 };
 
@@ -0,0 +1,397 @@
+// Overlapped receive engine for the game's UDP sockets, fed by a completion port
+
+#include <winsock2.h>
+#include "RecvEngine.h"
+#include "odprintf.h"
+
+static const int maxSockets  = 8,
+                 maxPosted   = 32,
+                 queueSize   = 128,  // Must be a power of 2
+                 maxDatagram = 1500;
+
+// One outstanding WSARecvFrom
+struct Receive {
+  OVERLAPPED overlapped;  // Must be first
+  struct EngineSocket *owner;
+  WSABUF      wsaBuf;
+  sockaddr_in from;
+  INT         fromLen;
+  DWORD       flags;
+  char        data[maxDatagram];
+};
+
+struct QueuedDatagram {
+  sockaddr_in from;
+  int         len;
+  char        data[maxDatagram];
+};
+
+// The queue is single producer (the completion thread), single consumer (the
+// game's network thread), so head and tail are only ever advanced by one side
+struct EngineSocket {
+  volatile SOCKET s;
+  volatile bool   closing,
+                  nonBlocking;
+  volatile LONG   pending,     // Receives outstanding
+                  waiters,     // Consumers blocked on hEvent
+                  generation,  // Bumped each time the slot is attached
+                  head,
+                  tail;
+  HANDLE          hEvent;
+  QueuedDatagram  queue[queueSize];
+  Receive         receives[maxPosted];
+};
+
+static EngineSocket *volatile sockets[maxSockets] = {};
+static SRWLOCK socketsLock = SRWLOCK_INIT;
+
+static HANDLE hPort             = nullptr,
+              hCompletionThread = nullptr,
+              hAnyData          = nullptr;
+static volatile LONG anyWaiters = 0;
+static int numPosted = 8;
+static RecvEngineStats stats = {};
+
+static DWORD WINAPI CompletionTask(LPVOID lpParam);
+static bool PostReceive(EngineSocket &sock, Receive &receive);
+static void Push(EngineSocket &sock, const Receive &receive, DWORD bytes);
+static EngineSocket* FindSocket(SOCKET s);
+
+
+bool StartRecvEngine(int postedPerSocket) {
+  if (hPort) {
+    return true;
+  }
+
+  numPosted = postedPerSocket < 1 ? 1 :
+              postedPerSocket > maxPosted ? maxPosted : postedPerSocket;
+
+  if (!(hAnyData = CreateEvent(nullptr, FALSE, FALSE, nullptr)) ||
+      !(hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1))) {
+    StopRecvEngine();
+    return false;
+  }
+
+  DWORD threadId = NULL;
+  if (!(hCompletionThread = CreateThread(nullptr, 0, CompletionTask, nullptr, 0,
+                                         &threadId))) {
+    StopRecvEngine();
+    return false;
+  }
+
+  return true;
+}
+
+
+void StopRecvEngine() {
+  for (auto *sock : sockets) {
+    if (sock && sock->s != INVALID_SOCKET) {
+      RecvEngineDetach(sock->s);
+    }
+  }
+
+  if (hCompletionThread) {
+    // Let the cancelled receives drain before the thread quits
+    for (auto *sock : sockets) {
+      while (sock && sock->pending > 0) {
+        Sleep(1);
+      }
+    }
+    PostQueuedCompletionStatus(hPort, 0, 0, nullptr);
+    WaitForSingleObject(hCompletionThread, INFINITE);
+    CloseHandle(hCompletionThread);
+    hCompletionThread = nullptr;
+  }
+  if (hPort) {
+    CloseHandle(hPort);
+    hPort = nullptr;
+  }
+  if (hAnyData) {
+    CloseHandle(hAnyData);
+    hAnyData = nullptr;
+  }
+}
+
+
+bool IsRecvEngineEnabled() {
+  return hPort != nullptr;
+}
+
+
+bool RecvEngineAttach(SOCKET s, bool nonBlocking) {
+  int type = 0,
+      len  = sizeof(type);
+  if (!hPort || FindSocket(s) ||
+      getsockopt(s, SOL_SOCKET, SO_TYPE, reinterpret_cast<char*>(&type), &len) != 0 ||
+      type != SOCK_DGRAM) {
+    return false;
+  }
+
+  // Take a free slot, or one whose socket was detached and fully drained, and that
+  // nobody is still blocked on
+  EngineSocket *sock = nullptr;
+  AcquireSRWLockExclusive(&socketsLock);
+  for (int i = 0; i < maxSockets && !sock; ++i) {
+    if (!sockets[i]) {
+      auto *newSock = new EngineSocket;
+      newSock->s          = INVALID_SOCKET;
+      newSock->pending    = 0;
+      newSock->waiters    = 0;
+      newSock->generation = 0;
+      if (!(newSock->hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr))) {
+        delete newSock;
+        break;
+      }
+      InterlockedExchangePointer(reinterpret_cast<void* volatile*>(&sockets[i]),
+                                 newSock);
+    }
+    if (sockets[i]->s == INVALID_SOCKET && sockets[i]->pending == 0 &&
+        sockets[i]->waiters == 0) {
+      sock = sockets[i];
+      InterlockedIncrement(&sock->generation);
+      sock->closing     = false;
+      sock->nonBlocking = nonBlocking;
+      sock->head        = 0;
+      sock->tail        = 0;
+      sock->s           = s;
+    }
+  }
+  ReleaseSRWLockExclusive(&socketsLock);
+
+  if (!sock) {
+    return false;
+  }
+
+  if (!CreateIoCompletionPort(reinterpret_cast<HANDLE>(s), hPort, 0, 0)) {
+    sock->s = INVALID_SOCKET;
+    return false;
+  }
+
+  int posted = 0;
+  for (int i = 0; i < numPosted; ++i) {
+    sock->receives[i].owner = sock;
+    if (PostReceive(*sock, sock->receives[i])) {
+      ++posted;
+    }
+  }
+
+  InterlockedIncrement(&stats.sockets);
+  odprintf("NetHelper: Receive engine attached to socket %u with %d receives posted",
+           static_cast<unsigned>(s), posted);
+  return posted > 0;
+}
+
+
+void RecvEngineDetach(SOCKET s) {
+  EngineSocket *sock = FindSocket(s);
+  if (!sock) {
+    return;
+  }
+
+  sock->closing = true;
+  sock->s = INVALID_SOCKET;
+  CancelIoEx(reinterpret_cast<HANDLE>(s), nullptr);
+  SetEvent(sock->hEvent);  // Wake a blocked recvfrom
+}
+
+
+bool IsRecvEngineSocket(SOCKET s) {
+  return FindSocket(s) != nullptr;
+}
+
+
+void RecvEngineSetNonBlocking(SOCKET s, bool nonBlocking) {
+  EngineSocket *sock = FindSocket(s);
+  if (sock) {
+    sock->nonBlocking = nonBlocking;
+  }
+}
+
+
+int RecvEnginePop(SOCKET s, char *buf, int len, int flags, sockaddr *from,
+                  int *fromLen) {
+  EngineSocket *sock = FindSocket(s);
+  if (!sock) {
+    return recvfrom(s, buf, len, flags, from, fromLen);
+  }
+
+  // A slot detached while this waits may be attached to another socket, whose
+  // datagrams aren't ours to pop
+  LONG generation = sock->generation;
+  for (;;) {
+    if (sock->generation != generation) {
+      WSASetLastError(WSAENOTSOCK);
+      return SOCKET_ERROR;
+    }
+
+    LONG head = sock->head;
+    if (head != sock->tail) {
+      const QueuedDatagram &datagram = sock->queue[head & (queueSize - 1)];
+
+      int result = datagram.len;
+      memcpy(buf, datagram.data, datagram.len <= len ? datagram.len : len);
+      if (datagram.len > len) {
+        result = SOCKET_ERROR;
+        WSASetLastError(WSAEMSGSIZE);
+      }
+      if (from && fromLen) {
+        int copyLen = *fromLen < static_cast<int>(sizeof(datagram.from)) ?
+                      *fromLen : sizeof(datagram.from);
+        memcpy(from, &datagram.from, copyLen);
+        *fromLen = copyLen;
+      }
+
+      if (!(flags & MSG_PEEK)) {
+        InterlockedExchange(&sock->head, head + 1);
+      }
+      return result;
+    }
+
+    if (sock->closing) {
+      WSASetLastError(WSAEINTR);
+      return SOCKET_ERROR;
+    }
+    if (sock->nonBlocking) {
+      WSASetLastError(WSAEWOULDBLOCK);
+      return SOCKET_ERROR;
+    }
+
+    // Check again after announcing the wait, so a push in between isn't missed
+    InterlockedIncrement(&sock->waiters);
+    if (sock->head == sock->tail && !sock->closing) {
+      WaitForSingleObject(sock->hEvent, INFINITE);
+    }
+    InterlockedDecrement(&sock->waiters);
+  }
+}
+
+
+bool RecvEngineHasData(SOCKET s) {
+  EngineSocket *sock = FindSocket(s);
+  return sock && sock->head != sock->tail;
+}
+
+
+HANDLE RecvEngineBeginWait() {
+  HANDLE hData = hAnyData;
+  if (hData) {
+    InterlockedIncrement(&anyWaiters);
+  }
+  return hData;
+}
+
+
+void RecvEngineEndWait(HANDLE hData) {
+  if (hData) {
+    InterlockedDecrement(&anyWaiters);
+  }
+}
+
+
+const RecvEngineStats& GetRecvEngineStats() {
+  return stats;
+}
+
+
+static DWORD WINAPI CompletionTask(LPVOID lpParam) {
+  for (;;) {
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED *overlapped = nullptr;
+    BOOL success = GetQueuedCompletionStatus(hPort, &bytes, &key, &overlapped,
+                                             INFINITE);
+    if (!overlapped) {
+      break;  // Quit posted by StopRecvEngine, or the port was closed
+    }
+
+    auto *receive = reinterpret_cast<Receive*>(overlapped);
+    EngineSocket &sock = *receive->owner;
+    if (success) {
+      Push(sock, *receive, bytes);
+    }
+
+    // Failures such as WSAECONNRESET from ICMP port unreachable just need a new
+    // receive; the replacement is posted before this one stops counting as pending
+    if (!sock.closing) {
+      PostReceive(sock, *receive);
+    }
+    InterlockedDecrement(&sock.pending);
+  }
+
+  return 0;
+}
+
+
+static bool PostReceive(EngineSocket &sock, Receive &receive) {
+  SOCKET s = sock.s;
+  if (s == INVALID_SOCKET) {
+    return false;
+  }
+
+  for (int tries = 0; tries < 4; ++tries) {
+    memset(&receive.overlapped, 0, sizeof(receive.overlapped));
+    receive.wsaBuf.buf = receive.data;
+    receive.wsaBuf.len = sizeof(receive.data);
+    receive.fromLen    = sizeof(receive.from);
+    receive.flags      = 0;
+
+    InterlockedIncrement(&sock.pending);
+    if (WSARecvFrom(s, &receive.wsaBuf, 1, nullptr, &receive.flags,
+                    reinterpret_cast<sockaddr*>(&receive.from), &receive.fromLen,
+                    &receive.overlapped, nullptr) == 0 ||
+        WSAGetLastError() == WSA_IO_PENDING) {
+      // Completes through the port either way
+      return true;
+    }
+    InterlockedDecrement(&sock.pending);
+
+    if (WSAGetLastError() != WSAECONNRESET) {
+      break;
+    }
+  }
+
+  return false;
+}
+
+
+static void Push(EngineSocket &sock, const Receive &receive, DWORD bytes) {
+  LONG tail  = sock.tail,
+       depth = tail - sock.head;
+  if (depth >= queueSize) {
+    InterlockedIncrement(&stats.dropped);
+    return;
+  }
+
+  QueuedDatagram &datagram = sock.queue[tail & (queueSize - 1)];
+  memcpy(&datagram.from, &receive.from, sizeof(datagram.from));
+  memcpy(datagram.data, receive.data, bytes);
+  datagram.len = bytes;
+
+  // Publishing the tail is a full barrier, so the waiter counts read below are
+  // current
+  InterlockedExchange(&sock.tail, tail + 1);
+  InterlockedIncrement(&stats.received);
+  if (depth + 1 > stats.maxDepth) {
+    stats.maxDepth = depth + 1;
+  }
+
+  if (sock.waiters > 0) {
+    SetEvent(sock.hEvent);
+  }
+  if (anyWaiters > 0) {
+    SetEvent(hAnyData);
+  }
+}
+
+
+static EngineSocket* FindSocket(SOCKET s) {
+  if (s == INVALID_SOCKET) {
+    return nullptr;
+  }
+  for (int i = 0; i < maxSockets && sockets[i]; ++i) {
+    if (sockets[i]->s == s) {
+      return sockets[i];
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,45 @@
+
+#ifndef RECVENGINE_H
+#define RECVENGINE_H
+
+#include <winsock2.h>
+
+// Receives on the game's UDP sockets with overlapped I/O on a completion port,
+// keeping several receives posted per socket so bursts aren't dropped while the
+// game is busy. The hooked recvfrom then only has to pop from a per-socket queue.
+
+struct RecvEngineStats {
+  LONG sockets,   // Sockets attached so far
+       received,  // Datagrams queued
+       dropped,   // Datagrams dropped because a queue was full
+       maxDepth;  // Most datagrams queued on one socket at once
+};
+
+// Starts the completion port and its thread. postedPerSocket is the number of
+// receives kept outstanding on each socket.
+bool StartRecvEngine(int postedPerSocket);
+// Detaches all sockets and stops the thread
+void StopRecvEngine();
+bool IsRecvEngineEnabled();
+
+// Starts receiving on a newly bound socket. Only UDP sockets are attached.
+bool RecvEngineAttach(SOCKET s, bool nonBlocking);
+// Stops receiving on a socket, e.g. before it is closed
+void RecvEngineDetach(SOCKET s);
+bool IsRecvEngineSocket(SOCKET s);
+// Records whether the game made the socket non-blocking
+void RecvEngineSetNonBlocking(SOCKET s, bool nonBlocking);
+
+// Pops a datagram like recvfrom would, blocking if the socket is blocking
+int  RecvEnginePop(SOCKET s, char *buf, int len, int flags, sockaddr *from,
+                   int *fromLen);
+bool RecvEngineHasData(SOCKET s);
+// Gets an event that is signaled when any attached socket queues a datagram, or
+// null if the engine isn't running. Check for data after calling this, so a
+// datagram queued in between still signals the event; then call RecvEngineEndWait.
+HANDLE RecvEngineBeginWait();
+void   RecvEngineEndWait(HANDLE hData);
+
+const RecvEngineStats& GetRecvEngineStats();
+
+#endif
@@ -0,0 +1,169 @@
+// Per-socket queues of datagrams waiting to be returned to the game
+
+#include <winsock2.h>
+#include "RecvQueue.h"
+
+static const int maxSockets   = 8,
+                 maxDatagrams = 64,
+                 maxDatagram  = 1472;  // Largest UDP payload without fragmenting
+
+struct QueuedDatagram {
+  sockaddr_in from;
+  int         len;
+  char        data[maxDatagram];
+};
+
+struct SocketQueue {
+  volatile SOCKET s;
+  SRWLOCK lock;
+  int     head,
+          count;
+  QueuedDatagram datagrams[maxDatagrams];
+};
+
+// Created on first use and kept for the life of the process, so lookups don't
+// need to hold queuesLock
+static SocketQueue *volatile queues[maxSockets] = {};
+static SRWLOCK queuesLock = SRWLOCK_INIT;
+static volatile LONG numQueued = 0;
+
+static SocketQueue* FindQueue(SOCKET s, bool create);
+
+
+bool RecvQueuePush(SOCKET s, const char *data, int len, const sockaddr *from,
+                   int fromLen) {
+  if (len < 0 || len > maxDatagram || !from ||
+      fromLen < static_cast<int>(sizeof(sockaddr_in))) {
+    return false;
+  }
+
+  SocketQueue *queue = FindQueue(s, true);
+  if (!queue) {
+    return false;
+  }
+
+  bool result = false;
+  AcquireSRWLockExclusive(&queue->lock);
+  if (queue->count < maxDatagrams) {
+    QueuedDatagram &datagram =
+      queue->datagrams[(queue->head + queue->count) % maxDatagrams];
+    memcpy(&datagram.from, from, sizeof(datagram.from));
+    memcpy(datagram.data, data, len);
+    datagram.len = len;
+    ++queue->count;
+    InterlockedIncrement(&numQueued);
+    result = true;
+  }
+  ReleaseSRWLockExclusive(&queue->lock);
+
+  return result;
+}
+
+
+bool RecvQueuePop(SOCKET s, char *buf, int len, sockaddr *from, int *fromLen,
+                  int *result, bool peek) {
+  SocketQueue *queue;
+  if (numQueued == 0 || !(queue = FindQueue(s, false))) {
+    return false;
+  }
+
+  bool popped = false;
+  AcquireSRWLockExclusive(&queue->lock);
+  if (queue->count > 0) {
+    QueuedDatagram &datagram = queue->datagrams[queue->head];
+
+    // Same as recvfrom: a datagram too big for the buffer is truncated
+    if (datagram.len <= len) {
+      *result = datagram.len;
+    }
+    else {
+      *result = SOCKET_ERROR;
+      WSASetLastError(WSAEMSGSIZE);
+    }
+    memcpy(buf, datagram.data, datagram.len <= len ? datagram.len : len);
+
+    if (from && fromLen) {
+      int copyLen = *fromLen < static_cast<int>(sizeof(datagram.from)) ?
+                    *fromLen : sizeof(datagram.from);
+      memcpy(from, &datagram.from, copyLen);
+      *fromLen = copyLen;
+    }
+
+    if (!peek) {
+      queue->head = (queue->head + 1) % maxDatagrams;
+      --queue->count;
+      InterlockedDecrement(&numQueued);
+    }
+    popped = true;
+  }
+  ReleaseSRWLockExclusive(&queue->lock);
+
+  return popped;
+}
+
+
+bool RecvQueueHasData(SOCKET s) {
+  SocketQueue *queue;
+  if (numQueued == 0 || !(queue = FindQueue(s, false))) {
+    return false;
+  }
+
+  AcquireSRWLockShared(&queue->lock);
+  bool result = queue->count > 0;
+  ReleaseSRWLockShared(&queue->lock);
+  return result;
+}
+
+
+void RecvQueueClear(SOCKET s) {
+  SocketQueue *queue = FindQueue(s, false);
+  if (queue) {
+    AcquireSRWLockExclusive(&queue->lock);
+    InterlockedExchangeAdd(&numQueued, -queue->count);
+    queue->head  = 0;
+    queue->count = 0;
+    ReleaseSRWLockExclusive(&queue->lock);
+  }
+}
+
+
+static SocketQueue* FindQueue(SOCKET s, bool create) {
+  for (int i = 0; i < maxSockets && queues[i]; ++i) {
+    if (queues[i]->s == s) {
+      return queues[i];
+    }
+  }
+  if (!create) {
+    return nullptr;
+  }
+
+  SocketQueue *result = nullptr;
+  AcquireSRWLockExclusive(&queuesLock);
+  for (int i = 0; i < maxSockets && !result; ++i) {
+    if (!queues[i]) {
+      auto *queue  = new SocketQueue;
+      queue->s     = s;
+      queue->head  = 0;
+      queue->count = 0;
+      InitializeSRWLock(&queue->lock);
+      InterlockedExchangePointer(reinterpret_cast<void* volatile*>(&queues[i]),
+                                 queue);
+    }
+    if (queues[i]->s == s) {
+      result = queues[i];
+    }
+  }
+
+  // Out of queues; take over an empty one, as the game has likely closed its socket
+  for (int i = 0; i < maxSockets && !result; ++i) {
+    AcquireSRWLockExclusive(&queues[i]->lock);
+    if (queues[i]->count == 0) {
+      queues[i]->s = s;
+      result = queues[i];
+    }
+    ReleaseSRWLockExclusive(&queues[i]->lock);
+  }
+  ReleaseSRWLockExclusive(&queuesLock);
+
+  return result;
+}
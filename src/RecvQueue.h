@@ -0,0 +1,21 @@
+
+#ifndef RECVQUEUE_H
+#define RECVQUEUE_H
+
+#include <winsock2.h>
+
+// Datagrams that NetHelper received on the game's behalf (e.g. unpacked from a
+// bundle), waiting to be returned by the game's next recvfrom on that socket
+
+// Queues a datagram. Returns false if the queue for the socket is full.
+bool RecvQueuePush(SOCKET s, const char *data, int len, const sockaddr *from,
+                   int fromLen);
+// Dequeues a datagram, and sets result to what recvfrom would have returned. A peek
+// leaves it queued. Returns false if nothing is queued.
+bool RecvQueuePop(SOCKET s, char *buf, int len, sockaddr *from, int *fromLen,
+                  int *result, bool peek = false);
+bool RecvQueueHasData(SOCKET s);
+// Drops everything queued, e.g. when the socket is closed
+void RecvQueueClear(SOCKET s);
+
+#endif
@@ -0,0 +1,530 @@
+// Relays the game's traffic through a NetRelay server when it can't be reached
+// directly
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "Relay.h"
+#include "PeerTable.h"
+#include "odprintf.h"
+
+namespace {
+
+struct RelaySocket {
+  SOCKET      socket;
+  bool        allocated;
+  sockaddr_in relayed;      // Valid once allocated
+  DWORD       firstRequest, // Of the current attempt, 0 when not trying
+              lastRequest,
+              lastAnswer,
+              lastTraffic;  // Relayed data either way
+};
+
+} // anonymous namespace
+
+static const DWORD retryInterval   = 1000,
+                   refreshInterval = relayLifetimeSec * 1000 / 4,
+                   allocateTimeout = 5000,
+                   lostTimeout     = refreshInterval * 3,
+                   idleRelease     = 30000,  // Of allocations no longer wanted
+                   pingTimeout     = 1000,
+                   reselectDelay   = 30000;  // After no relay answered
+static const int   maxSockets      = 8,
+                   pingsPerServer  = 3;
+
+static SRWLOCK lock = SRWLOCK_INIT;
+static std::vector<std::string> serverNames;
+static std::vector<sockaddr_in> servers;   // Resolved
+static sockaddr_in server = {};            // The chosen one; sin_port 0 if none
+static RelaySocket sockets[maxSockets] = {};
+
+// Indexed by PeerTable ID
+static volatile LONG relayed[PeerTable::MaxPeers] = {};
+
+static volatile bool enabled = false,
+                     active  = false;
+static HANDLE hStopEvent    = nullptr,
+              hRelayThread  = nullptr;
+
+static DWORD WINAPI RelayThreadProc(LPVOID lpParam);
+static bool SelectServer();
+static void SendHeader(SOCKET s, RelayType type, const sockaddr_in &to);
+static RelaySocket* FindSocket(SOCKET s);
+static void OnPeerEvicted(int peerId);
+
+
+bool StartRelay(const std::vector<std::string> &servers) {
+  if (hRelayThread || servers.empty()) {
+    return hRelayThread != nullptr;
+  }
+
+  if (!hStopEvent && !(hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr))) {
+    return false;
+  }
+  ResetEvent(hStopEvent);
+
+  serverNames = servers;
+  PeerTable::AddEvictCallback(OnPeerEvicted);
+  enabled = true;
+  hRelayThread = CreateThread(nullptr, 0, RelayThreadProc, nullptr, 0, nullptr);
+  if (!hRelayThread) {
+    enabled = false;
+    return false;
+  }
+  return true;
+}
+
+
+void StopRelay() {
+  active = false;
+  if (hRelayThread) {
+    SetEvent(hStopEvent);
+    WaitForSingleObject(hRelayThread, INFINITE);
+    CloseHandle(hRelayThread);
+    hRelayThread = nullptr;
+  }
+  enabled = false;
+
+  // Let the relay free our ports now rather than when they expire
+  AcquireSRWLockExclusive(&lock);
+  for (auto &entry : sockets) {
+    if (entry.socket && entry.allocated && server.sin_port) {
+      SendHeader(entry.socket, relayRelease, server);
+    }
+    entry = RelaySocket();
+  }
+  servers.clear();
+  server = sockaddr_in();
+  ReleaseSRWLockExclusive(&lock);
+
+  for (auto &flag : relayed) {
+    flag = 0;
+  }
+}
+
+
+bool IsRelayEnabled() {
+  return enabled;
+}
+
+
+void SetRelayActive(bool newActive) {
+  if (enabled && active != newActive) {
+    active = newActive;
+    odprintf("NetHelper: %s hosting through a relay",
+             newActive ? "Started" : "Stopped");
+  }
+}
+
+
+void RelayAttach(SOCKET s) {
+  int type = 0,
+      len  = sizeof(type);
+  if (getsockopt(s, SOL_SOCKET, SO_TYPE, reinterpret_cast<char*>(&type), &len) != 0 ||
+      type != SOCK_DGRAM) {
+    return;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  RelaySocket *entry = FindSocket(s);
+  for (int i = 0; i < maxSockets && !entry; ++i) {
+    if (!sockets[i].socket) {
+      entry = &sockets[i];
+    }
+  }
+  if (entry) {
+    *entry = RelaySocket();
+    entry->socket = s;
+  }
+  ReleaseSRWLockExclusive(&lock);
+}
+
+
+void RelayDetach(SOCKET s) {
+  AcquireSRWLockExclusive(&lock);
+  RelaySocket *entry = FindSocket(s);
+  if (entry) {
+    if (entry->allocated && server.sin_port) {
+      SendHeader(s, relayRelease, server);
+    }
+    *entry = RelaySocket();
+  }
+  ReleaseSRWLockExclusive(&lock);
+}
+
+
+static void OnPeerEvicted(int peerId) {
+  InterlockedExchange(&relayed[peerId], 0);
+}
+
+
+bool IsRelayedPeer(int peerId) {
+  return peerId >= 0 && peerId < PeerTable::MaxPeers && relayed[peerId] != 0;
+}
+
+
+int RelaySend(SOCKET s, const char *buf, int len, const sockaddr *to, int toLen) {
+  auto *peer = reinterpret_cast<const sockaddr_in*>(to);
+
+  char frame[sizeof(RelayHeader) + 1500];
+  std::vector<char> bigFrame;
+  char *p = frame;
+  if (len > static_cast<int>(sizeof(frame) - sizeof(RelayHeader))) {
+    bigFrame.resize(sizeof(RelayHeader) + len);
+    p = bigFrame.data();
+  }
+
+  auto *header = reinterpret_cast<RelayHeader*>(p);
+  header->magic   = relayMagic;
+  header->type    = relayData;
+  header->version = relayVersion;
+  header->address = peer->sin_addr.s_addr;
+  header->port    = peer->sin_port;
+  memcpy(p + sizeof(RelayHeader), buf, len);
+
+  AcquireSRWLockExclusive(&lock);
+  RelaySocket *entry = FindSocket(s);
+  sockaddr_in relay = server;
+  bool allocated = entry && entry->allocated && relay.sin_port;
+  if (allocated) {
+    entry->lastTraffic = GetTickCount();
+  }
+  ReleaseSRWLockExclusive(&lock);
+
+  if (!allocated) {
+    // The relay was lost; the peer can only be reached directly now, if at all
+    return sendto(s, buf, len, 0, to, toLen);
+  }
+
+  int result = sendto(s, p, sizeof(RelayHeader) + len, 0,
+                      reinterpret_cast<const sockaddr*>(&relay), sizeof(relay));
+  return (result > 0) ? len : result;
+}
+
+
+bool IsRelayPacket(const char *buf, int len, const sockaddr *from, int fromLen) {
+  auto *header = reinterpret_cast<const RelayHeader*>(buf);
+  auto *address = reinterpret_cast<const sockaddr_in*>(from);
+  if (len < static_cast<int>(sizeof(RelayHeader)) || header->magic != relayMagic ||
+      header->version != relayVersion || !from ||
+      fromLen < static_cast<int>(sizeof(sockaddr_in)) ||
+      address->sin_family != AF_INET) {
+    return false;
+  }
+
+  // Any of the configured relays, so late datagrams from one we left aren't taken
+  // for the game's own
+  AcquireSRWLockShared(&lock);
+  bool result = false;
+  for (auto &relay : servers) {
+    result |= (relay.sin_addr.s_addr == address->sin_addr.s_addr &&
+               relay.sin_port == address->sin_port);
+  }
+  ReleaseSRWLockShared(&lock);
+  return result;
+}
+
+
+int RelayReceive(SOCKET s, char *buf, int len, sockaddr_in *from) {
+  RelayHeader header = *reinterpret_cast<const RelayHeader*>(buf);
+  DWORD now = GetTickCount();
+
+  if (header.type == relayData) {
+    sockaddr_in peer = {};
+    peer.sin_family      = AF_INET;
+    peer.sin_addr.s_addr = header.address;
+    peer.sin_port        = header.port;
+
+    // Added even though the game hasn't answered yet: the relay only passes on
+    // datagrams from peers it let in, and the answer must go back through it
+    int peerId = PeerTable::GetPeerId(reinterpret_cast<const sockaddr*>(&peer),
+                                      sizeof(peer));
+    if (peerId >= 0 && InterlockedExchange(&relayed[peerId], 1) == 0) {
+      odprintf("NetHelper: Peer %d is reaching us through the relay", peerId);
+    }
+
+    AcquireSRWLockExclusive(&lock);
+    RelaySocket *entry = FindSocket(s);
+    if (entry) {
+      entry->lastTraffic = now;
+    }
+    ReleaseSRWLockExclusive(&lock);
+
+    len -= sizeof(RelayHeader);
+    memmove(buf, buf + sizeof(RelayHeader), len);
+    *from = peer;
+    return len;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  RelaySocket *entry = FindSocket(s);
+  if (entry) {
+    switch (header.type) {
+    case relayAllocated:
+      if (!entry->allocated) {
+        entry->allocated    = true;
+        entry->lastTraffic  = now;
+        entry->relayed      = server;
+        if (header.address != 0) {
+          entry->relayed.sin_addr.s_addr = header.address;
+        }
+        entry->relayed.sin_port = header.port;
+
+        char address[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, &entry->relayed.sin_addr, address, sizeof(address));
+        odprintf("NetHelper: Relayed address is %s:%d", address,
+                 ntohs(entry->relayed.sin_port));
+      }
+      entry->firstRequest = 0;
+      entry->lastAnswer   = now;
+      break;
+
+    case relayError:
+      // Expired allocations are requested again by the relay thread
+      if (ntohs(header.port) == relayErrorFull && !entry->allocated) {
+        odprintf("NetHelper: The relay has no ports left (socket %u)",
+                 static_cast<unsigned>(s));
+      }
+      if (ntohs(header.port) == relayErrorFull ||
+          ntohs(header.port) == relayErrorNoAllocation) {
+        entry->allocated = false;
+      }
+      break;
+    }
+  }
+  ReleaseSRWLockExclusive(&lock);
+
+  return -1;
+}
+
+
+void RelayOnDirect(int peerId) {
+  if (IsRelayedPeer(peerId) && InterlockedExchange(&relayed[peerId], 0) != 0) {
+    odprintf("NetHelper: Peer %d is reachable directly, no longer relaying", peerId);
+  }
+}
+
+
+bool GetRelayAddress(char *buffer, size_t len) {
+  if (!active) {
+    return false;
+  }
+
+  // Show the first socket bound, which is the one other players join
+  AcquireSRWLockShared(&lock);
+  bool result = false;
+  for (auto &entry : sockets) {
+    if (entry.socket && entry.allocated) {
+      char address[INET_ADDRSTRLEN] = "";
+      inet_ntop(AF_INET, &entry.relayed.sin_addr, address, sizeof(address));
+      result = sprintf_s(buffer, len, "%s:%d", address,
+                         ntohs(entry.relayed.sin_port)) > 0;
+      break;
+    }
+  }
+  ReleaseSRWLockShared(&lock);
+  return result;
+}
+
+
+// Picks a relay, then keeps the game's sockets allocated on it while wanted. The
+// requests go out from the game's own sockets, so the relay sees the address its
+// peers' datagrams must be passed on to; the answers come back through recvfrom.
+static DWORD WINAPI RelayThreadProc(LPVOID lpParam) {
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != NO_ERROR) {
+    return 1;
+  }
+
+  DWORD lastSelect = 0;
+  do {
+    DWORD now = GetTickCount();
+
+    bool haveServer;
+    AcquireSRWLockShared(&lock);
+    haveServer = server.sin_port != 0;
+    ReleaseSRWLockShared(&lock);
+    if (!haveServer && (lastSelect == 0 || now - lastSelect >= reselectDelay)) {
+      lastSelect = now;
+      haveServer = SelectServer();
+      now = GetTickCount();
+    }
+    if (!haveServer) {
+      continue;
+    }
+
+    bool lost = false;
+    AcquireSRWLockExclusive(&lock);
+    for (auto &entry : sockets) {
+      if (!entry.socket) {
+        continue;
+      }
+
+      bool wanted = active || (entry.allocated && now - entry.lastTraffic < idleRelease);
+      if (!wanted) {
+        if (entry.allocated) {
+          SendHeader(entry.socket, relayRelease, server);
+          entry.allocated = false;
+        }
+        entry.firstRequest = 0;
+        continue;
+      }
+
+      // Stop using a relay that doesn't answer, and pick another
+      if ((entry.allocated && now - entry.lastAnswer >= lostTimeout) ||
+          (!entry.allocated && entry.firstRequest &&
+           now - entry.firstRequest >= allocateTimeout)) {
+        lost = true;
+        break;
+      }
+
+      DWORD interval = entry.allocated ? refreshInterval : retryInterval;
+      if (entry.lastRequest == 0 || now - entry.lastRequest >= interval) {
+        SendHeader(entry.socket, relayAllocate, server);
+        entry.lastRequest = now;
+        if (!entry.allocated && !entry.firstRequest) {
+          entry.firstRequest = now;
+        }
+      }
+    }
+
+    if (lost) {
+      odprintf("NetHelper: Lost the relay, picking another one (%d configured)",
+               static_cast<int>(servers.size()));
+      for (auto &entry : sockets) {
+        SOCKET s = entry.socket;
+        entry = RelaySocket();
+        entry.socket = s;
+      }
+      server = sockaddr_in();
+      lastSelect = 0;
+    }
+    ReleaseSRWLockExclusive(&lock);
+  } while (WaitForSingleObject(hStopEvent, retryInterval) == WAIT_TIMEOUT);
+
+  WSACleanup();
+  return 0;
+}
+
+
+// Resolves the relays and pings them all from a socket of our own, choosing the
+// one that answers the soonest
+static bool SelectServer() {
+  std::vector<sockaddr_in> resolved;
+  std::vector<const char*> names;
+  for (auto &name : serverNames) {
+    std::string host = name,
+                port = std::to_string(relayDefaultPort);
+    size_t colon = name.rfind(':');
+    if (colon != std::string::npos) {
+      host = name.substr(0, colon);
+      port = name.substr(colon + 1);
+    }
+
+    addrinfo hints = {},
+             *info = nullptr;
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0 || !info) {
+      odprintf("NetHelper: Could not resolve relay %s", name.c_str());
+      continue;
+    }
+    resolved.push_back(*reinterpret_cast<sockaddr_in*>(info->ai_addr));
+    names.push_back(name.c_str());
+    freeaddrinfo(info);
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  servers = resolved;
+  ReleaseSRWLockExclusive(&lock);
+
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (resolved.empty() || s == INVALID_SOCKET) {
+    if (s != INVALID_SOCKET) {
+      closesocket(s);
+    }
+    return false;
+  }
+
+  LARGE_INTEGER frequency, start;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&start);
+
+  // The token is the server's index, so answers map back without a lookup
+  for (int ping = 0; ping < pingsPerServer; ++ping) {
+    for (size_t i = 0; i < resolved.size(); ++i) {
+      RelayHeader header = {};
+      header.magic   = relayMagic;
+      header.type    = relayPing;
+      header.version = relayVersion;
+      header.address = static_cast<DWORD>(i);
+      sendto(s, reinterpret_cast<const char*>(&header), sizeof(header), 0,
+             reinterpret_cast<const sockaddr*>(&resolved[i]), sizeof(resolved[i]));
+    }
+  }
+
+  // The first pong to come back is from the relay with the lowest RTT
+  int best = -1;
+  LONGLONG bestCounter = 0;
+  DWORD startTick = GetTickCount(),
+        elapsed;
+  while (best < 0 && (elapsed = GetTickCount() - startTick) < pingTimeout) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(s, &readSet);
+    timeval tv = { 0, static_cast<long>((pingTimeout - elapsed) * 1000) };
+    if (select(0, &readSet, nullptr, nullptr, &tv) != 1) {
+      break;
+    }
+
+    RelayHeader header;
+    sockaddr_in from;
+    int fromLen = sizeof(from);
+    int len = recvfrom(s, reinterpret_cast<char*>(&header), sizeof(header), 0,
+                       reinterpret_cast<sockaddr*>(&from), &fromLen);
+    if (len == static_cast<int>(sizeof(header)) && header.magic == relayMagic &&
+        header.type == relayPong && header.address < resolved.size() &&
+        resolved[header.address].sin_addr.s_addr == from.sin_addr.s_addr &&
+        resolved[header.address].sin_port == from.sin_port) {
+      LARGE_INTEGER now;
+      QueryPerformanceCounter(&now);
+      best = static_cast<int>(header.address);
+      bestCounter = now.QuadPart - start.QuadPart;
+    }
+  }
+  closesocket(s);
+
+  if (best < 0) {
+    odprintf("NetHelper: None of the %d relays answered",
+             static_cast<int>(resolved.size()));
+    return false;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  server = resolved[best];
+  ReleaseSRWLockExclusive(&lock);
+
+  odprintf("NetHelper: Using relay %s (RTT %d ms)", names[best],
+           static_cast<int>(bestCounter * 1000 / frequency.QuadPart));
+  return true;
+}
+
+
+static void SendHeader(SOCKET s, RelayType type, const sockaddr_in &to) {
+  RelayHeader header = {};
+  header.magic   = relayMagic;
+  header.type    = static_cast<BYTE>(type);
+  header.version = relayVersion;
+  sendto(s, reinterpret_cast<const char*>(&header), sizeof(header), 0,
+         reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+}
+
+
+static RelaySocket* FindSocket(SOCKET s) {
+  for (auto &entry : sockets) {
+    if (entry.socket == s) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,49 @@
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include "RelayProtocol.h"
+
+// Hosts games through a NetRelay server (see relay/NetRelay.cpp) when the game
+// can't be reached directly, e.g. when no gateway supports port forwarding.
+//
+// The relay gives each of the game's UDP sockets a relayed address, which is shown
+// in game in place of the external IP. Players join that address as usual, without
+// needing NetHelper; their datagrams reach the game wrapped in a RelayHeader, and
+// replies to them go back through the relay. A player whose datagrams later arrive
+// directly is answered directly from then on.
+
+// Starts picking the relay with the lowest RTT from the given servers ("host" or
+// "host:port"). Nothing is relayed until SetRelayActive(true).
+bool StartRelay(const std::vector<std::string> &servers);
+void StopRelay();
+bool IsRelayEnabled();
+
+// Sets whether to get relayed addresses for the game's sockets. Allocations that
+// still carry traffic are kept until it stops, so games in progress aren't cut off.
+void SetRelayActive(bool active);
+
+// Called from the bind and closesocket hooks
+void RelayAttach(SOCKET s);
+void RelayDetach(SOCKET s);
+
+// True if the peer's datagrams come through the relay, so replies must as well
+bool IsRelayedPeer(int peerId);
+// Sends a datagram to a relayed peer through the relay
+int RelaySend(SOCKET s, const char *buf, int len, const sockaddr *to, int toLen);
+
+bool IsRelayPacket(const char *buf, int len, const sockaddr *from, int fromLen);
+// Handles a datagram from the relay server. A relayed datagram is unwrapped in
+// place, with from set to the peer that sent it, and its length is returned.
+// Returns -1 for the relay's own messages.
+int RelayReceive(SOCKET s, char *buf, int len, sockaddr_in *from);
+// Called when a game datagram arrives from the peer without going through the relay
+void RelayOnDirect(int peerId);
+
+// Gets the relayed address of the game's socket while relaying is active
+bool GetRelayAddress(char *buffer, size_t len);
+
+#endif
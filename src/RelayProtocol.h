@@ -0,0 +1,52 @@
+
+#ifndef RELAYPROTOCOL_H
+#define RELAYPROTOCOL_H
+
+// Wire format between NetHelper and a NetRelay server. Shared by both, so it only
+// uses the integer typedefs from windows.h, which NetRelay defines elsewhere.
+//
+// A client sends relayAllocate from one of the game's sockets. The server opens a
+// UDP port for it (the relayed address), and every datagram someone sends there
+// is passed on to the client as relayData. relayData from the client is sent out
+// of the relayed port to the given peer. Allocations expire unless refreshed.
+//
+// Like TURN permissions, the server only sends to a peer that sent to the relayed
+// port within relayPermissionSec, or that the client permitted with relayPermit
+// and the server's token. Loopback, private, multicast and other non-public
+// destinations are always refused, so the relay can't be used to reach into its
+// own network or to flood others.
+
+const WORD  relayMagic       = 0x524E;  // "NR"
+const BYTE  relayVersion     = 1;
+const WORD  relayDefaultPort = 47750;
+const DWORD relayLifetimeSec = 60;      // Without a relayAllocate to refresh it
+const DWORD relayPermissionSec = 300;   // Without traffic to or from the peer
+
+enum RelayType {
+  relayPing = 1,    // address = token; answered with relayPong and the same token
+  relayPong,
+  relayAllocate,    // Requests or refreshes the sender's allocation
+  relayAllocated,   // address/port = relayed address; address 0 = the server's own
+  relayRelease,     // Frees the sender's allocation
+  relayData,        // address/port = peer; followed by the datagram
+  relayError,       // port = a RelayError
+  relayPermit       // address = peer; followed by the server's token
+};
+
+enum RelayError {
+  relayErrorFull = 1,      // No more allocations or ports
+  relayErrorNoAllocation,  // relayData from a client without an allocation
+  relayErrorForbidden      // relayPermit with a wrong token or address
+};
+
+#pragma pack(push, 1)
+struct RelayHeader {
+  WORD  magic;
+  BYTE  type;
+  BYTE  version;
+  DWORD address;  // Network order
+  WORD  port;     // Network order
+};
+#pragma pack(pop)
+
+#endif
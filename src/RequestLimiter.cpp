@@ -0,0 +1,127 @@
+// Learns how many concurrent requests each gateway can take
+
+#include <windows.h>
+#include <map>
+#include "RequestLimiter.h"
+#include "odprintf.h"
+
+static const double initialWindow = 2,
+                    maxWindow     = 16;
+static const int    maxProbeCost  = 64;
+// Answers within this of twice the fastest one seen count as fast; GetTickCount
+// only has a resolution of about 16 ms
+static const DWORD  latencySlack  = 16;
+
+static SRWLOCK mapLock = SRWLOCK_INIT;
+static std::map<std::string, std::shared_ptr<RequestLimiter>> limiters;
+
+
+std::shared_ptr<RequestLimiter> RequestLimiter::ForGateway(const std::string &key) {
+  AcquireSRWLockExclusive(&mapLock);
+  std::shared_ptr<RequestLimiter> &limiter = limiters[key];
+  if (!limiter) {
+    limiter = std::make_shared<RequestLimiter>(key);
+  }
+  std::shared_ptr<RequestLimiter> result = limiter;
+  ReleaseSRWLockExclusive(&mapLock);
+  return result;
+}
+
+
+RequestLimiter::RequestLimiter(const std::string &_key)
+  : key(_key), window(initialWindow), ceiling(0), probeCost(1), inFlight(0),
+    minLatency(MAXDWORD), nextSequence(0), decreaseSequence(0) {
+  InitializeSRWLock(&lock);
+  InitializeConditionVariable(&canSend);
+}
+
+
+RequestTicket RequestLimiter::Acquire() {
+  RequestTicket ticket;
+  Acquire(&ticket, 1);
+  return ticket;
+}
+
+
+int RequestLimiter::Acquire(RequestTicket *tickets, int maxCount) {
+  AcquireSRWLockExclusive(&lock);
+  while (inFlight >= static_cast<int>(window)) {
+    SleepConditionVariableSRW(&canSend, &lock, INFINITE, 0);
+  }
+
+  int count = static_cast<int>(window) - inFlight;
+  count = (count < maxCount) ? count : maxCount;
+  DWORD now = GetTickCount();
+  for (int i = 0; i < count; ++i) {
+    tickets[i].start    = now;
+    tickets[i].sequence = nextSequence++;
+    pending.push_back(tickets[i]);
+  }
+  inFlight += count;
+  ReleaseSRWLockExclusive(&lock);
+
+  return count;
+}
+
+
+void RequestLimiter::Release(const RequestTicket &ticket, RequestOutcome outcome) {
+  DWORD latency = GetTickCount() - ticket.start;
+  int oldWindow, newWindow;
+
+  AcquireSRWLockExclusive(&lock);
+  --inFlight;
+  for (auto it = pending.begin(); it != pending.end(); ++it) {
+    if (it->sequence == ticket.sequence) {
+      pending.erase(it);
+      break;
+    }
+  }
+  oldWindow = static_cast<int>(window);
+
+  if (outcome == requestOverloaded) {
+    // Requests that were already out when the window shrank would only repeat the
+    // same news, so halve at most once per round of requests
+    if (static_cast<LONG>(ticket.sequence - decreaseSequence) >= 0) {
+      // A timeout costs far more than a request, so don't keep probing a size the
+      // gateway can't handle
+      if (oldWindow <= ceiling) {
+        probeCost = (probeCost * 2 < maxProbeCost) ? probeCost * 2 : maxProbeCost;
+      }
+      ceiling = oldWindow;
+      window = (window / 2 > 1) ? window / 2 : 1;
+      decreaseSequence = nextSequence;
+    }
+  }
+  else if (outcome == requestOk) {
+    minLatency = (latency < minLatency) ? latency : minLatency;
+    DWORD fast = minLatency * 2 + latencySlack;
+    // A request that is taking long may yet time out, so wait for it before growing.
+    // Compare its age, since send times wrap around with GetTickCount.
+    bool stalled = !pending.empty() &&
+                   GetTickCount() - pending.front().start > fast;
+    if (latency <= fast && !stalled && window < maxWindow) {
+      window += (window + 1 >= ceiling) ? 1 / (window * probeCost) : 1 / window;
+      if (window >= ceiling + 1) {
+        probeCost = 1;
+      }
+      window = (window < maxWindow) ? window : maxWindow;
+    }
+  }
+
+  newWindow = static_cast<int>(window);
+  ReleaseSRWLockExclusive(&lock);
+  WakeAllConditionVariable(&canSend);
+
+  if (newWindow < oldWindow) {
+    odprintf("NetHelper: Gateway %s is overloaded, sending %d requests at a time",
+             key.c_str(), newWindow);
+  }
+}
+
+
+int RequestLimiter::GetWindow() {
+  AcquireSRWLockShared(&lock);
+  int result = static_cast<int>(window);
+  ReleaseSRWLockShared(&lock);
+  return result;
+}
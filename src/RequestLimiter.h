@@ -0,0 +1,65 @@
+
+#ifndef REQUESTLIMITER_H
+#define REQUESTLIMITER_H
+
+#include <windows.h>
+#include <deque>
+#include <memory>
+#include <string>
+
+// Limits how many requests may be outstanding to one gateway at once. Some
+// routers handle dozens of concurrent requests, others drop them or crash when
+// flooded, so the limit is learned AIMD-style: it starts small, grows by about
+// one per window of requests answered quickly and without error while none is
+// still waiting unusually long for an answer, and halves on a timeout or an
+// error that suggests overload. Each time it overloads again at the same size,
+// it grows back to that size more slowly. What was learned is kept for as long
+// as the mod is loaded, so later forwarding through the same gateway starts
+// from it.
+
+enum RequestOutcome {
+  requestOk = 0,
+  requestRejected,   // The gateway answered with an error that isn't about load
+  requestOverloaded  // Timed out, or a transport or server error
+};
+
+struct RequestTicket {
+  DWORD start;     // GetTickCount
+  DWORD sequence;
+};
+
+class RequestLimiter {
+public:
+  RequestLimiter(const std::string &key);
+
+  // Gets the limiter for a gateway, identified by its address or control URL
+  // and protocol
+  static std::shared_ptr<RequestLimiter> ForGateway(const std::string &key);
+
+  // Blocks until another request may be sent
+  RequestTicket Acquire();
+  // Blocks until at least one request may be sent, then starts as many as are
+  // allowed, up to maxCount. Returns how many tickets were written. Use this
+  // rather than calling Acquire() repeatedly while holding tickets, which can
+  // wait forever once the window shrinks.
+  int Acquire(RequestTicket *tickets, int maxCount);
+  // Ends a request started with Acquire
+  void Release(const RequestTicket &ticket, RequestOutcome outcome);
+
+  int GetWindow();
+
+private:
+  std::string        key;
+  std::deque<RequestTicket> pending;  // Requests in flight, oldest first
+  SRWLOCK            lock;
+  CONDITION_VARIABLE canSend;
+  double             window;
+  int                ceiling,    // Window at the last overload
+                     probeCost,  // Fast answers per step near the ceiling
+                     inFlight;
+  DWORD              minLatency,
+                     nextSequence,
+                     decreaseSequence;  // Older requests' failures are ignored
+};
+
+#endif
@@ -0,0 +1,133 @@
+// Applies configurable socket options to the game's sockets as they are bound
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+#include "SocketPolicy.h"
+#include "Config.h"
+#include "odprintf.h"
+
+static SocketPolicyStats stats = {};
+
+// Which options were applied to the most recently bound sockets
+static struct {
+  SOCKET socket;
+  int    applied;
+} records[64] = {};
+static int     nextRecord  = 0;
+static SRWLOCK recordsLock = SRWLOCK_INIT;
+
+
+bool IsSocketPolicyEnabled() {
+  std::shared_ptr<const Config> config = GetConfig();
+  const SocketPolicy &policy = config->socketPolicy;
+  return policy.recvBufSize || policy.sendBufSize || policy.dscp >= 0 ||
+         policy.noUdpConnReset || policy.tcpNoDelay || policy.nonBlocking;
+}
+
+
+int ApplySocketPolicy(SOCKET s) {
+  int type = 0,
+      len  = sizeof(type);
+  if (getsockopt(s, SOL_SOCKET, SO_TYPE, reinterpret_cast<char*>(&type), &len) != 0) {
+    InterlockedIncrement(&stats.failures);
+    return 0;
+  }
+
+  InterlockedIncrement(&stats.sockets);
+  InterlockedIncrement(type == SOCK_DGRAM ? &stats.udpSockets : &stats.tcpSockets);
+
+  // The policy in effect when the socket is bound, even if settings are reloaded
+  std::shared_ptr<const Config> config = GetConfig();
+  const SocketPolicy &policy = config->socketPolicy;
+
+  int applied = 0;
+
+  if (policy.recvBufSize &&
+      setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+                 reinterpret_cast<const char*>(&policy.recvBufSize),
+                 sizeof(policy.recvBufSize)) == 0) {
+    applied |= policyRecvBuf;
+    InterlockedIncrement(&stats.recvBuf);
+  }
+
+  if (policy.sendBufSize &&
+      setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+                 reinterpret_cast<const char*>(&policy.sendBufSize),
+                 sizeof(policy.sendBufSize)) == 0) {
+    applied |= policySendBuf;
+    InterlockedIncrement(&stats.sendBuf);
+  }
+
+  // Windows ignores IP_TOS unless allowed by group policy, but WINE passes it on
+  if (policy.dscp >= 0) {
+    DWORD tos = static_cast<DWORD>(policy.dscp) << 2;
+    if (setsockopt(s, IPPROTO_IP, IP_TOS, reinterpret_cast<const char*>(&tos),
+                   sizeof(tos)) == 0) {
+      applied |= policyDscp;
+      InterlockedIncrement(&stats.dscp);
+    }
+  }
+
+  if (type == SOCK_DGRAM && policy.noUdpConnReset) {
+    // Otherwise ICMP port unreachable from a peer that left makes recvfrom fail
+    BOOL  connReset = FALSE;
+    DWORD bytes = 0;
+    if (WSAIoctl(s, SIO_UDP_CONNRESET, &connReset, sizeof(connReset), nullptr, 0,
+                 &bytes, nullptr, nullptr) == 0) {
+      applied |= policyNoConnReset;
+      InterlockedIncrement(&stats.noConnReset);
+    }
+  }
+
+  if (type == SOCK_STREAM && policy.tcpNoDelay) {
+    BOOL noDelay = TRUE;
+    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay),
+                   sizeof(noDelay)) == 0) {
+      applied |= policyNoDelay;
+      InterlockedIncrement(&stats.noDelay);
+    }
+  }
+
+  if (policy.nonBlocking) {
+    u_long nonBlocking = 1;
+    if (ioctlsocket(s, FIONBIO, &nonBlocking) == 0) {
+      applied |= policyNonBlocking;
+      InterlockedIncrement(&stats.nonBlocking);
+    }
+  }
+
+  AcquireSRWLockExclusive(&recordsLock);
+  records[nextRecord].socket  = s;
+  records[nextRecord].applied = applied;
+  nextRecord = (nextRecord + 1) % _countof(records);
+  ReleaseSRWLockExclusive(&recordsLock);
+
+  odprintf("NetHelper: Bound %s socket %u, applied socket policy 0x%02X",
+           type == SOCK_DGRAM ? "UDP" : "TCP", static_cast<unsigned>(s), applied);
+
+  return applied;
+}
+
+
+int GetSocketPolicyApplied(SOCKET s) {
+  int applied = 0;
+
+  // Search newest first, since a closed socket's handle may be reused
+  AcquireSRWLockShared(&recordsLock);
+  for (int i = 1; i <= _countof(records); ++i) {
+    auto &record = records[(nextRecord + _countof(records) - i) % _countof(records)];
+    if (record.socket == s) {
+      applied = record.applied;
+      break;
+    }
+  }
+  ReleaseSRWLockShared(&recordsLock);
+
+  return applied;
+}
+
+
+const SocketPolicyStats& GetSocketPolicyStats() {
+  return stats;
+}
@@ -0,0 +1,51 @@
+
+#ifndef SOCKETPOLICY_H
+#define SOCKETPOLICY_H
+
+#include <winsock2.h>
+
+// Options that a socket policy can apply
+enum SocketPolicyOption {
+  policyRecvBuf     = 1 << 0,  // SO_RCVBUF
+  policySendBuf     = 1 << 1,  // SO_SNDBUF
+  policyDscp        = 1 << 2,  // IP_TOS
+  policyNoConnReset = 1 << 3,  // SIO_UDP_CONNRESET off (UDP only)
+  policyNoDelay     = 1 << 4,  // TCP_NODELAY (TCP only)
+  policyNonBlocking = 1 << 5   // FIONBIO
+};
+
+struct SocketPolicy {
+  int  recvBufSize;     // 0 to leave as is
+  int  sendBufSize;     // 0 to leave as is
+  int  dscp;            // DiffServ code point (0-63), or -1 to leave as is
+  bool noUdpConnReset;  // Don't fail recvfrom when ICMP port unreachable arrives
+  bool tcpNoDelay;
+  bool nonBlocking;
+};
+
+// Number of sockets each option was applied to
+struct SocketPolicyStats {
+  LONG sockets,
+       udpSockets,
+       tcpSockets,
+       recvBuf,
+       sendBuf,
+       dscp,
+       noConnReset,
+       noDelay,
+       nonBlocking,
+       failures;
+};
+
+// True if the current policy (see Config.h) changes anything
+bool IsSocketPolicyEnabled();
+
+// Applies the current policy to a newly bound socket according to its type.
+// Returns the SocketPolicyOption flags that were applied.
+int ApplySocketPolicy(SOCKET s);
+
+// Gets the SocketPolicyOption flags applied to a recently bound socket
+int GetSocketPolicyApplied(SOCKET s);
+const SocketPolicyStats& GetSocketPolicyStats();
+
+#endif
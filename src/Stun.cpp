@@ -0,0 +1,336 @@
+// Minimal STUN binding client for finding the external address and NAT behavior
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include "Stun.h"
+#include "odprintf.h"
+
+namespace {
+
+#pragma pack(push, 1)
+struct StunHeader {
+  WORD  type;
+  WORD  length;         // Of the attributes that follow
+  DWORD magicCookie;
+  BYTE  transactionId[12];
+};
+#pragma pack(pop)
+
+struct StunServer {
+  sockaddr_in address;
+  BYTE        transactionId[12];
+  bool        answered;
+};
+
+} // anonymous namespace
+
+static const WORD  stunBindingRequest   = 0x0001,
+                   stunBindingResponse  = 0x0101,
+                   stunMappedAddress    = 0x0001,
+                   stunXorMappedAddress = 0x0020;
+static const DWORD stunMagicCookie      = 0x2112A442;
+static const char  defaultStunPort[]    = "3478";
+
+static const DWORD retransmitMs  = 500,
+                   queryTimeout  = 1500,
+                   retryInterval = 30000;  // After a query with no answers
+
+static SRWLOCK lock = SRWLOCK_INIT;
+static char    cachedAddress[INET_ADDRSTRLEN] = "";
+static DWORD   cachedTime = 0,
+               cacheMs    = 0;
+static NatType natType    = natUnknown;
+
+static std::vector<std::string> serverNames;
+static HANDLE hStopEvent  = nullptr,
+              hStunThread = nullptr;
+
+static DWORD WINAPI StunThreadProc(LPVOID lpParam);
+static bool Query();
+static bool ParseResponse(const char *buf, int len, const StunServer &server,
+                          sockaddr_in *mapped);
+static bool IsLocalAddress(const in_addr &address);
+
+
+bool StartStun(const std::vector<std::string> &servers, int cacheSec) {
+  if (hStunThread || servers.empty()) {
+    return hStunThread != nullptr;
+  }
+
+  if (!hStopEvent && !(hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr))) {
+    return false;
+  }
+  ResetEvent(hStopEvent);
+
+  serverNames = servers;
+  cacheMs     = static_cast<DWORD>(cacheSec) * 1000;
+
+  hStunThread = CreateThread(nullptr, 0, StunThreadProc, nullptr, 0, nullptr);
+  return hStunThread != nullptr;
+}
+
+
+void StopStun() {
+  if (hStunThread) {
+    SetEvent(hStopEvent);
+    WaitForSingleObject(hStunThread, INFINITE);
+    CloseHandle(hStunThread);
+    hStunThread = nullptr;
+  }
+
+  AcquireSRWLockExclusive(&lock);
+  cachedAddress[0] = '\0';
+  natType = natUnknown;
+  ReleaseSRWLockExclusive(&lock);
+}
+
+
+bool GetStunAddress(char *buffer, size_t len) {
+  AcquireSRWLockShared(&lock);
+  bool result = cachedAddress[0] && (GetTickCount() - cachedTime) < cacheMs &&
+                strcpy_s(buffer, len, cachedAddress) == 0;
+  ReleaseSRWLockShared(&lock);
+  return result;
+}
+
+
+NatType GetNatType() {
+  AcquireSRWLockShared(&lock);
+  NatType result = natType;
+  ReleaseSRWLockShared(&lock);
+  return result;
+}
+
+
+// Queries when started, then again whenever the cached address is due to expire
+static DWORD WINAPI StunThreadProc(LPVOID lpParam) {
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != NO_ERROR) {
+    return 1;
+  }
+
+  DWORD wait;
+  do {
+    // Refresh a bit early so the cached address never lapses while it's valid
+    wait = Query()                  ? (cacheMs - cacheMs / 10) :
+           (retryInterval < cacheMs) ? retryInterval : cacheMs;
+  } while (WaitForSingleObject(hStopEvent, wait) == WAIT_TIMEOUT);
+
+  WSACleanup();
+  return 0;
+}
+
+
+// Sends a binding request to every server at once from one socket. The first
+// answer is published right away; later ones only tell whether the NAT maps the
+// socket the same way toward each server.
+static bool Query() {
+  // Transaction IDs only need to be unlikely to match stray packets, and rand()
+  // would disturb the game's own sequence
+  static DWORD random = GetTickCount() ^ (GetCurrentProcessId() << 16);
+
+  std::vector<StunServer> servers;
+  for (auto &name : serverNames) {
+    std::string host = name,
+                port = defaultStunPort;
+    size_t colon = name.rfind(':');
+    if (colon != std::string::npos) {
+      host = name.substr(0, colon);
+      port = name.substr(colon + 1);
+    }
+
+    addrinfo hints = {},
+             *info = nullptr;
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0 || !info) {
+      odprintf("NetHelper: Could not resolve STUN server %s", name.c_str());
+      continue;
+    }
+
+    StunServer server = {};
+    server.address = *reinterpret_cast<sockaddr_in*>(info->ai_addr);
+    for (auto &b : server.transactionId) {
+      random = random * 1103515245 + 12345;
+      b = static_cast<BYTE>(random >> 16);
+    }
+    servers.push_back(server);
+    freeaddrinfo(info);
+  }
+
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (servers.empty() || s == INVALID_SOCKET) {
+    if (s != INVALID_SOCKET) {
+      closesocket(s);
+    }
+    return false;
+  }
+
+  int answers = 0;
+  bool published = false,
+       symmetric = false;
+  sockaddr_in first = {};
+
+  DWORD start = GetTickCount(),
+        nextSend = 0,
+        elapsed;
+  while (answers < static_cast<int>(servers.size()) &&
+         (elapsed = GetTickCount() - start) < queryTimeout) {
+    // Retransmit to the servers that haven't answered yet
+    if (elapsed >= nextSend) {
+      for (auto &server : servers) {
+        if (!server.answered) {
+          StunHeader request = { htons(stunBindingRequest), 0,
+                                 htonl(stunMagicCookie) };
+          memcpy(request.transactionId, server.transactionId,
+                 sizeof(request.transactionId));
+          sendto(s, reinterpret_cast<const char*>(&request), sizeof(request), 0,
+                 reinterpret_cast<const sockaddr*>(&server.address),
+                 sizeof(server.address));
+        }
+      }
+      nextSend = elapsed + retransmitMs;
+    }
+
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(s, &readSet);
+    DWORD waitMs = ((nextSend < queryTimeout) ? nextSend : queryTimeout) - elapsed;
+    timeval tv = { 0, static_cast<long>(waitMs * 1000) };
+    if (select(0, &readSet, nullptr, nullptr, &tv) != 1) {
+      continue;
+    }
+
+    char buf[576];
+    sockaddr_in from;
+    int fromLen = sizeof(from);
+    int len = recvfrom(s, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from),
+                       &fromLen);
+
+    for (auto &server : servers) {
+      sockaddr_in mapped;
+      if (server.answered || !ParseResponse(buf, len, server, &mapped)) {
+        continue;
+      }
+
+      server.answered = true;
+      ++answers;
+
+      if (!published) {
+        first = mapped;
+        published = true;
+
+        AcquireSRWLockExclusive(&lock);
+        inet_ntop(AF_INET, &mapped.sin_addr, cachedAddress, sizeof(cachedAddress));
+        cachedTime = GetTickCount();
+        ReleaseSRWLockExclusive(&lock);
+      }
+      else if (mapped.sin_addr.s_addr != first.sin_addr.s_addr ||
+               mapped.sin_port != first.sin_port) {
+        symmetric = true;
+      }
+      break;
+    }
+  }
+  closesocket(s);
+
+  if (!published) {
+    return false;
+  }
+
+  // One answer can't tell the mapping behavior apart
+  NatType type = IsLocalAddress(first.sin_addr) ? natNone :
+                 symmetric                      ? natSymmetric :
+                 (answers > 1)                  ? natEndpointIndependent :
+                                                  natUnknown;
+  AcquireSRWLockExclusive(&lock);
+  natType = type;
+  ReleaseSRWLockExclusive(&lock);
+
+  odprintf("NetHelper: STUN reports external IP %s from %d of %d servers (NAT type %d)",
+           cachedAddress, answers, static_cast<int>(servers.size()),
+           static_cast<int>(type));
+  return true;
+}
+
+
+// Checks a binding response is from the server and for its transaction, and gets
+// the mapped address from it
+static bool ParseResponse(const char *buf, int len, const StunServer &server,
+                          sockaddr_in *mapped) {
+  if (len < static_cast<int>(sizeof(StunHeader))) {
+    return false;
+  }
+
+  auto *header = reinterpret_cast<const StunHeader*>(buf);
+  if (ntohs(header->type) != stunBindingResponse ||
+      ntohl(header->magicCookie) != stunMagicCookie ||
+      memcmp(header->transactionId, server.transactionId,
+             sizeof(server.transactionId)) != 0 ||
+      sizeof(StunHeader) + ntohs(header->length) > static_cast<size_t>(len)) {
+    return false;
+  }
+
+  // Attributes are TLVs padded to 4 bytes. Prefer XOR-MAPPED-ADDRESS, which NATs
+  // that rewrite addresses in payloads can't mangle.
+  const BYTE *p   = reinterpret_cast<const BYTE*>(buf) + sizeof(StunHeader),
+             *end = p + ntohs(header->length);
+  bool found = false;
+  while (p + 4 <= end) {
+    WORD type      = (p[0] << 8) | p[1],
+         attrLen   = (p[2] << 8) | p[3];
+    const BYTE *value = p + 4;
+    if (value + attrLen > end) {
+      break;
+    }
+
+    // Value: reserved, family (1 = IPv4), port, address
+    if ((type == stunXorMappedAddress || (type == stunMappedAddress && !found)) &&
+        attrLen >= 8 && value[1] == 0x01) {
+      WORD  port;
+      DWORD address;
+      memcpy(&port, value + 2, sizeof(port));
+      memcpy(&address, value + 4, sizeof(address));
+      if (type == stunXorMappedAddress) {
+        port    ^= htons(static_cast<WORD>(stunMagicCookie >> 16));
+        address ^= htonl(stunMagicCookie);
+      }
+
+      mapped->sin_family      = AF_INET;
+      mapped->sin_port        = port;
+      mapped->sin_addr.s_addr = address;
+      found = true;
+      if (type == stunXorMappedAddress) {
+        break;
+      }
+    }
+
+    p = value + ((attrLen + 3) & ~3);
+  }
+
+  return found;
+}
+
+
+// True if the address belongs to one of this computer's adapters
+static bool IsLocalAddress(const in_addr &address) {
+  ULONG size = 0;
+  if (GetIpAddrTable(nullptr, &size, FALSE) != ERROR_INSUFFICIENT_BUFFER) {
+    return false;
+  }
+
+  std::vector<BYTE> buffer(size);
+  auto *table = reinterpret_cast<MIB_IPADDRTABLE*>(buffer.data());
+  if (GetIpAddrTable(table, &size, FALSE) != NO_ERROR) {
+    return false;
+  }
+
+  for (DWORD i = 0; i < table->dwNumEntries; ++i) {
+    if (table->table[i].dwAddr == address.s_addr) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,29 @@
+
+#ifndef STUN_H
+#define STUN_H
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+
+// Discovers the external address with STUN (RFC 5389) binding requests, so it can
+// be shown in game even when no gateway does port mapping
+
+enum NatType {
+  natUnknown = 0,
+  natNone,                 // The mapped address is a local one
+  natEndpointIndependent,  // Same mapping toward every server
+  natSymmetric             // A different mapping toward each server
+};
+
+// Starts querying the given servers ("host" or "host:port") in parallel in the
+// background, refreshing the result every cacheSec seconds
+bool StartStun(const std::vector<std::string> &servers, int cacheSec);
+void StopStun();
+
+// Gets the external IP address, if one was found and hasn't expired
+bool GetStunAddress(char *buffer, size_t len);
+// Gets the NAT mapping behavior seen by the last query, for diagnostics
+NatType GetNatType();
+
+#endif
@@ -0,0 +1,1190 @@
+// Benchmarks the patcher with its signature scans and module tracking, port
+// forwarding through PCP and NAT-PMP, IGD description scans, the socket hook
+// wrappers, coalescing and the receive engine, and compares the results against a
+// stored baseline. Everything runs offline: the patches go to the synthetic game
+// image and to DLLs made known to the shim's loader, scans to a multi-MB synthetic
+// module, forwarding goes to FakeGateways on loopback that answer after an injected
+// latency, with NAT-PMP through the libnatpmp stand-in, the IGD description is
+// a FakeGateway's, as miniupnpd words it, coalesced datagrams go to our own
+// handshake port and game sockets on loopback, and relayed ones through a NetRelay
+// server started on loopback.
+//
+// Usage: Bench [--output file] [--baseline file] [--threshold percent]
+//
+// Results are written as JSON, one benchmark per line, with percentiles of the
+// time per operation and the heap allocations per operation. Against a baseline,
+// a benchmark regresses if its median is slower by more than the threshold, or
+// it allocates more; the exit code is then 1.
+
+#include "FakeGateway.h"
+#include "GameImage.h"
+#include "NetStandIns.h"
+#include "Shim.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "Coalesce.h"
+#include "Handshake.h"
+#include "IgdScan.h"
+#include "Patcher.h"
+#include "PeerTable.h"
+#include "Pcp.h"
+#include "RecvEngine.h"
+#include "PortForward.h"
+#include "RelayProtocol.h"
+#include "RequestLimiter.h"
+
+#include "../miniupnp/miniupnpc/miniwget.h"
+
+#ifndef NETRELAY
+#define NETRELAY "build/NetRelay"
+#endif
+
+using namespace Patcher;
+
+// Defined in NetPatches.cpp, for the transport to call
+int __stdcall SendToWrapper(SOCKET s, const char *buf, int len, int flags,
+                            const sockaddr *to, int tolen);
+int __stdcall RecvFromWrapper(SOCKET s, char *buf, int len, int flags,
+                              sockaddr *from, int *fromlen);
+
+typedef std::chrono::steady_clock Clock;
+
+// Heap allocations made by the thread being measured, while it is measured
+static thread_local bool counting = false;
+static ULONGLONG allocations = 0;
+
+
+// The replacements pair malloc with free, which GCC can't tell
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+  if (counting) {
+    ++allocations;
+  }
+  void *memory = malloc(size ? size : 1);
+  if (!memory) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return operator new(size);
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return operator new(size, std::nothrow);
+}
+void operator delete(void *memory) noexcept { free(memory); }
+void operator delete[](void *memory) noexcept { free(memory); }
+void operator delete(void *memory, size_t) noexcept { free(memory); }
+void operator delete[](void *memory, size_t) noexcept { free(memory); }
+
+
+namespace {
+
+// The time per operation of one benchmark, a sample per timed batch
+class Series {
+public:
+  Series(const char *_name, const char *_unit, double _nsPerUnit)
+    : name(_name), unit(_unit), nsPerUnit(_nsPerUnit), allocs(0), ops(0) { }
+
+  void Begin() {
+    counting = true;
+    allocsAtBegin = allocations;
+    begin = Clock::now();
+  }
+  void End(int batchOps) {
+    auto end = Clock::now();
+    counting = false;
+    double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+    samples.push_back(ns / batchOps / nsPerUnit);
+    allocs += allocations - allocsAtBegin;
+    ops    += batchOps;
+  }
+  // Adds a sample that was counted rather than timed
+  void Add(double value) {
+    samples.push_back(value);
+  }
+
+  // The sample at or above the given fraction of them, by nearest rank
+  double Percentile(double fraction) const {
+    std::vector<double> sorted(samples);
+    std::sort(sorted.begin(), sorted.end());
+    size_t rank = static_cast<size_t>(ceil(fraction * sorted.size()));
+    return sorted[(rank > 0) ? rank - 1 : 0];
+  }
+
+  // Writes the benchmark as one line of JSON
+  void Write(FILE *file) const {
+    fprintf(file, "    { \"name\": \"%s\", \"unit\": \"%s\", \"samples\": %d, "
+            "\"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, "
+            "\"max\": %.4f, \"allocs\": %.2f }", name.c_str(), unit,
+            static_cast<int>(samples.size()), Percentile(0), Percentile(0.5),
+            Percentile(0.9), Percentile(0.99), Percentile(1), AllocsPerOp());
+  }
+
+  double Median() const { return Percentile(0.5); }
+  double AllocsPerOp() const { return ops ? static_cast<double>(allocs) / ops : 0; }
+
+  std::string name;
+  const char *unit;
+
+private:
+  double nsPerUnit;
+  std::vector<double> samples;
+  ULONGLONG allocs,
+            allocsAtBegin,
+            ops;
+  Clock::time_point begin;
+};
+
+} // anonymous namespace
+
+static std::vector<Series> results;
+static int setupFailures = 0;
+
+
+static void SetupFailed(const char *what) {
+  fprintf(stderr, "Bench: %s failed\n", what);
+  ++setupFailures;
+}
+
+
+// Creates, enables, disables and deletes byte patches across the image's code
+static void BenchPatches() {
+  const int ops = 256, samples = 200;
+  const BYTE nops[] = { 0x90, 0x90, 0x90, 0x90 },
+             int3s[] = { 0xCC, 0xCC, 0xCC, 0xCC };
+
+  Series create("patch.create", "us", 1000), enable("patch.enable", "us", 1000),
+         disable("patch.disable", "us", 1000), unpatch("patch.unpatch", "us", 1000);
+  std::vector<std::shared_ptr<patch>> patches(ops);
+  for (int sample = 0; sample < samples; ++sample) {
+    bool ok = true;
+
+    create.Begin();
+    for (int i = 0; i < ops; ++i) {
+      patches[i] = Patch(FixPtr(GameImage::preferredBase + 0x1000 + i * 16),
+                         sizeof(nops), nops, int3s, false);
+    }
+    create.End(ops);
+
+    enable.Begin();
+    for (auto &curPatch : patches) {
+      ok &= curPatch && curPatch->Enable();
+    }
+    enable.End(ops);
+
+    disable.Begin();
+    for (auto &curPatch : patches) {
+      ok &= curPatch && curPatch->Disable();
+    }
+    disable.End(ops);
+
+    unpatch.Begin();
+    for (auto &curPatch : patches) {
+      ok &= Unpatch(curPatch);
+    }
+    unpatch.End(ops);
+
+    if (!ok) {
+      SetupFailed("Patching the game image");
+      return;
+    }
+  }
+  results.insert(results.end(), { create, enable, disable, unpatch });
+}
+
+
+static void BenchFixPtr() {
+  const int ops = 10000, samples = 200;
+  Series fixPtr("fixptr", "ns", 1);
+  volatile uintptr_t sink = 0;
+  for (int sample = 0; sample < samples; ++sample) {
+    fixPtr.Begin();
+    for (int i = 0; i < ops; ++i) {
+      sink = sink + reinterpret_cast<uintptr_t>(
+        FixPtr(GameImage::preferredBase + 0x1000 + i));
+    }
+    fixPtr.End(ops);
+  }
+  results.push_back(fixPtr);
+}
+
+
+// Redirects every reference to the image's global, and back
+static void BenchGlobalReferences() {
+  const int samples = 200;
+  static int replacement = 0;
+  Series patchRefs("globalrefs.patch", "us", 1000),
+         unpatchRefs("globalrefs.unpatch", "us", 1000);
+  void *global = FixPtr(GameImage::globalObject);
+  std::vector<std::shared_ptr<patch>> patches;
+  for (int sample = 0; sample < samples; ++sample) {
+    patchRefs.Begin();
+    bool patched = PatchGlobalReferences(global, &replacement, &patches);
+    patchRefs.End(1);
+
+    unpatchRefs.Begin();
+    for (auto &curPatch : patches) {
+      Unpatch(curPatch);
+    }
+    patches.clear();
+    unpatchRefs.End(1);
+
+    if (!patched) {
+      SetupFailed("PatchGlobalReferences");
+      return;
+    }
+  }
+  results.insert(results.end(), { patchRefs, unpatchRefs });
+}
+
+
+// A module of a few MB of code-like bytes and read-only data, for signature scans
+class SyntheticModule {
+public:
+  static const DWORD textBegin = 0x1000,
+                     textSize  = 6 << 20,
+                     rdataSize = 2 << 20;
+
+  SyntheticModule() : image(textBegin + textSize + rdataSize) {
+    // Mostly the bytes common in x86 code, which the prefilter's anchors avoid
+    static const BYTE common[] = { 0x00, 0xFF, 0xCC, 0x90, 0x8B, 0x89, 0xE8, 0x55,
+                                   0x83, 0xC4, 0x04, 0x50, 0x51, 0x6A, 0x74, 0xC3 };
+    DWORD state = 0x2545F491;
+    for (size_t i = textBegin; i < image.size(); ++i) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      image[i] = (state & 0x100) ? common[state & 0xF] : static_cast<BYTE>(state >> 24);
+    }
+
+    auto *dos = reinterpret_cast<IMAGE_DOS_HEADER*>(&image[0]);
+    dos->e_magic  = IMAGE_DOS_SIGNATURE;
+    dos->e_lfanew = 0x80;
+    auto *nt = reinterpret_cast<IMAGE_NT_HEADERS64*>(&image[dos->e_lfanew]);
+    nt->Signature                       = IMAGE_NT_SIGNATURE;
+    nt->FileHeader.Machine              = IMAGE_FILE_MACHINE_AMD64;
+    nt->FileHeader.NumberOfSections     = 2;
+    nt->FileHeader.SizeOfOptionalHeader = sizeof(nt->OptionalHeader);
+    nt->OptionalHeader.Magic            = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+    nt->OptionalHeader.SizeOfCode       = textSize;
+    nt->OptionalHeader.SizeOfImage      = static_cast<DWORD>(image.size());
+
+    IMAGE_SECTION_HEADER *section = IMAGE_FIRST_SECTION(nt);
+    memcpy(section[0].Name, ".text", 6);
+    section[0].Misc.VirtualSize = textSize;
+    section[0].VirtualAddress   = textBegin;
+    section[0].Characteristics  = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE |
+                                  IMAGE_SCN_MEM_READ;
+    memcpy(section[1].Name, ".rdata", 7);
+    section[1].Misc.VirtualSize = rdataSize;
+    section[1].VirtualAddress   = textBegin + textSize;
+    section[1].Characteristics  = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ;
+  }
+
+  HMODULE Module() { return reinterpret_cast<HMODULE>(&image[0]); }
+
+  // Makes a signature of the 16 bytes at the RVA, with its third and every fifth
+  // byte after a wildcard
+  std::string SignatureAt(DWORD rva) const {
+    std::string signature;
+    for (int i = 0; i < 16; ++i) {
+      signature += (i ? " " : "") + ((i % 5 == 2) ? std::string("?") :
+                                     MakeSignature(&image[rva + i], 1));
+    }
+    return signature;
+  }
+
+  // Makes the next scan a new build, so it isn't answered from the cache
+  void NewBuild() {
+    auto *nt = reinterpret_cast<IMAGE_NT_HEADERS64*>(&image[0x80]);
+    ++nt->FileHeader.TimeDateStamp;
+  }
+
+private:
+  std::vector<BYTE> image;
+};
+
+
+// Finds signatures near the end of a multi-MB synthetic module: one at a time and
+// many in one pass, against a plain masked compare at each position, and again
+// from the cache
+static void BenchSignatureScan() {
+  const int samples = 20, many = 32;
+  SyntheticModule module;
+  HMODULE base = module.Module();
+
+  // Spread over the last part of .text and .rdata, so every scan reads most of
+  // the module
+  std::vector<std::string> signatures;
+  std::vector<const char*> texts;
+  std::vector<DWORD> rvas;
+  for (int i = 0; i < many; ++i) {
+    DWORD rva = SyntheticModule::textBegin + SyntheticModule::textSize * 3 / 4 +
+                i * (SyntheticModule::textSize / 4 + SyntheticModule::rdataSize) / many;
+    rvas.push_back(rva);
+    signatures.push_back(module.SignatureAt(rva));
+  }
+  for (const std::string &signature : signatures) {
+    texts.push_back(signature.c_str());
+  }
+
+  Series naive("scan.naive.1", "ms", 1e6),
+         one("scan.one.1", "ms", 1e6),
+         separate("scan.separate.32", "ms", 1e6),
+         onePass("scan.onepass.32", "ms", 1e6),
+         cached("scan.cached.32", "us", 1e3);
+  std::vector<void*> found(many);
+  volatile uintptr_t sink = 0;
+  for (int sample = 0; sample < samples; ++sample) {
+    // What the prefilter saves: the last signature, compared at every position
+    naive.Begin();
+    const BYTE *image = reinterpret_cast<const BYTE*>(base),
+               *want  = image + rvas[many - 1];
+    const BYTE *match = nullptr;
+    for (const BYTE *p = image + SyntheticModule::textBegin; !match; ++p) {
+      int i = 0;
+      while (i < 16 && (i % 5 == 2 || p[i] == want[i])) {
+        ++i;
+      }
+      match = (i == 16) ? p : nullptr;
+    }
+    naive.End(1);
+    sink = sink + reinterpret_cast<uintptr_t>(match);
+
+    module.NewBuild();
+    one.Begin();
+    found[0] = FindSignature(texts[many - 1], scanDefault, base);
+    one.End(1);
+    bool ok = found[0] == image + rvas[many - 1];
+
+    module.NewBuild();
+    separate.Begin();
+    for (int i = 0; i < many; ++i) {
+      found[i] = FindSignature(texts[i], scanDefault, base);
+    }
+    separate.End(1);
+
+    module.NewBuild();
+    onePass.Begin();
+    ok &= FindSignatures(&texts[0], &found[0], many, scanDefault, base) == many;
+    onePass.End(1);
+
+    cached.Begin();
+    ok &= FindSignatures(&texts[0], &found[0], many, scanDefault, base) == many;
+    cached.End(1);
+    for (int i = 0; i < many; ++i) {
+      ok &= found[i] == image + rvas[i];
+    }
+    if (!ok || match != want) {
+      SetupFailed("Finding signatures in the synthetic module");
+      return;
+    }
+  }
+  results.insert(results.end(), { naive, one, separate, onePass, cached });
+}
+
+
+// Enables and disables patches in one of many loaded DLLs, with each patch
+// verifying its module through the loader, then through the tracked module table,
+// and loads and unloads a DLL while modules are tracked. The DLLs are made known
+// to the shim's loader, which stands in for the process's module list.
+static void BenchModuleVerify() {
+  const int dlls = 128, ops = 256, samples = 100;
+  const SIZE_T dllSize = 0x2000;
+  const BYTE nops[] = { 0x90, 0x90, 0x90, 0x90 },
+             int3s[] = { 0xCC, 0xCC, 0xCC, 0xCC };
+
+  // Headers with a build hash, then a page of code
+  std::vector<BYTE*> images;
+  for (int i = 0; i <= dlls; ++i) {
+    auto *image = static_cast<BYTE*>(VirtualAlloc(nullptr, dllSize,
+                                                  MEM_COMMIT | MEM_RESERVE,
+                                                  PAGE_EXECUTE_READWRITE));
+    if (!image) {
+      SetupFailed("Mapping the DLLs");
+      return;
+    }
+    memset(image + 0x1000, 0xCC, 0x1000);
+    auto *dos = reinterpret_cast<IMAGE_DOS_HEADER*>(image);
+    dos->e_magic  = IMAGE_DOS_SIGNATURE;
+    dos->e_lfanew = 0x80;
+    auto *nt = reinterpret_cast<IMAGE_NT_HEADERS64*>(image + dos->e_lfanew);
+    nt->Signature                   = IMAGE_NT_SIGNATURE;
+    nt->FileHeader.TimeDateStamp    = 0x50000000 + i;
+    nt->OptionalHeader.Magic        = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+    nt->OptionalHeader.SizeOfCode   = 0x1000;
+    nt->OptionalHeader.SizeOfImage  = static_cast<DWORD>(dllSize);
+    images.push_back(image);
+  }
+  for (int i = 0; i < dlls; ++i) {
+    ShimAddModule(reinterpret_cast<HMODULE>(images[i]), dllSize,
+                  ("Dll" + std::to_string(i) + ".dll").c_str());
+  }
+
+  Series enableLoader("modules.enable.loader", "us", 1000),
+         disableLoader("modules.disable.loader", "us", 1000),
+         enableTracked("modules.enable.tracked", "us", 1000),
+         disableTracked("modules.disable.tracked", "us", 1000),
+         load("modules.load.tracked", "us", 1000);
+  BYTE *code = images[dlls / 2] + 0x1000;
+  std::vector<std::shared_ptr<patch>> patches(ops);
+  for (int i = 0; i < ops; ++i) {
+    patches[i] = Patch(code + i * 8, sizeof(int3s), nops, int3s, false);
+  }
+
+  bool ok = true;
+  for (bool tracked : { false, true }) {
+    if (tracked && !StartModuleTracking()) {
+      SetupFailed("StartModuleTracking");
+      break;
+    }
+    Series &enable  = tracked ? enableTracked : enableLoader,
+           &disable = tracked ? disableTracked : disableLoader;
+    for (int sample = 0; sample < samples; ++sample) {
+      enable.Begin();
+      for (auto &curPatch : patches) {
+        ok &= curPatch && curPatch->Enable();
+      }
+      enable.End(ops);
+
+      disable.Begin();
+      for (auto &curPatch : patches) {
+        ok &= curPatch && curPatch->Disable();
+      }
+      disable.End(ops);
+    }
+  }
+
+  // Each load and unload publishes a new table, and the next verify rereads it
+  auto extra = reinterpret_cast<HMODULE>(images[dlls]);
+  for (int sample = 0; sample < samples && ok; ++sample) {
+    load.Begin();
+    ShimAddModule(extra, dllSize, "Extra.dll");
+    ShimRemoveModule(extra);
+    load.End(1);
+    ok &= patches[0]->Enable() && patches[0]->Disable();
+  }
+
+  StopModuleTracking();
+  for (auto &curPatch : patches) {
+    Unpatch(curPatch);
+  }
+  for (int i = 0; i < dlls; ++i) {
+    ShimRemoveModule(reinterpret_cast<HMODULE>(images[i]));
+  }
+  for (BYTE *image : images) {
+    VirtualFree(image, 0, MEM_RELEASE);
+  }
+  if (!ok) {
+    SetupFailed("Patching the DLLs");
+    return;
+  }
+  results.insert(results.end(),
+                 { enableLoader, disableLoader, enableTracked, disableTracked, load });
+}
+
+
+// Forwards the game's whole UDP port range through PCP with a limiter that knows
+// nothing about the gateway yet, then unforwards it with what the limiter learned
+static void BenchForwarding(int latencyMs) {
+  const int firstPort = 47776, numPorts = 32, samples = 10;
+  std::string suffix = "." + std::to_string(latencyMs) + "ms";
+  Series forward(("pcp.forward" + suffix).c_str(), "ms", 1e6),
+         unforward(("pcp.unforward" + suffix).c_str(), "ms", 1e6);
+
+  FakeGateway::Settings settings;
+  settings.address   = "127.0.70." + std::to_string(latencyMs + 1);
+  settings.protocols = FakeGateway::protoPcp;
+  settings.latencyMs = latencyMs;
+  FakeGateway gateway(settings);
+
+  sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port   = htons(5351);
+  inet_pton(AF_INET, settings.address.c_str(), &server.sin_addr);
+  PcpClient pcp;
+  if (!gateway.IsRunning() ||
+      !pcp.Open(reinterpret_cast<sockaddr*>(&server), sizeof(server))) {
+    SetupFailed("Starting the PCP gateway");
+    return;
+  }
+
+  PcpMapping mappings[numPorts];
+  auto map = [&mappings, &pcp](RequestLimiter &limiter, DWORD lifetime) {
+    for (int i = 0; i < numPorts; ++i) {
+      mappings[i] = {};
+      mappings[i].protocol      = IPPROTO_UDP;
+      mappings[i].internalPort  = static_cast<WORD>(firstPort + i);
+      mappings[i].externalPort  = static_cast<WORD>(firstPort + i);
+      mappings[i].lifetime      = lifetime;
+      mappings[i].preferFailure = true;
+    }
+    return PcpMapInBatches(pcp, limiter, mappings, numPorts);
+  };
+
+  for (int sample = 0; sample < samples; ++sample) {
+    RequestLimiter limiter("bench" + suffix);
+    forward.Begin();
+    int forwarded = map(limiter, 7200);
+    forward.End(1);
+
+    unforward.Begin();
+    int unforwarded = map(limiter, 0);
+    unforward.End(1);
+
+    if (forwarded != numPorts || unforwarded != numPorts) {
+      SetupFailed("Forwarding to the PCP gateway");
+      return;
+    }
+  }
+  results.insert(results.end(), { forward, unforward });
+}
+
+
+// Forwards and unforwards the port range with PortForwarder, through a gateway that
+// speaks PCP and through one that only speaks NAT-PMP, which libnatpmp does a
+// round trip at a time
+static void BenchForwarder(const char *protocol, int latencyMs) {
+  const int firstPort = 47776, numPorts = 32;
+  bool natPmp = strcmp(protocol, "natpmp") == 0;
+  int samples = natPmp ? 3 : 10;
+  std::string prefix = std::string("forwarder.") + protocol + ".",
+              suffix = "." + std::to_string(latencyMs) + "ms";
+  Series forward((prefix + "forward" + suffix).c_str(), "ms", 1e6),
+         unforward((prefix + "unforward" + suffix).c_str(), "ms", 1e6);
+
+  // A gateway of its own, as what the forwarder learns about one is kept
+  std::string net = "127.0." + std::to_string(natPmp ? 72 : 71) + ".";
+  FakeGateway::Settings settings;
+  settings.address    = net + std::to_string(latencyMs + 1);
+  settings.lanAddress = net + "200";
+  settings.protocols  = natPmp ? FakeGateway::protoNatPmp : FakeGateway::protoPcp;
+  settings.latencyMs  = latencyMs;
+  FakeGateway gateway(settings);
+
+  NetMonitor::Adapter adapter = {};
+  inet_pton(AF_INET, settings.lanAddress.c_str(), &adapter.address);
+  inet_pton(AF_INET, "255.255.255.0", &adapter.mask);
+  inet_pton(AF_INET, settings.address.c_str(), &adapter.gateway);
+  PortForwarder forwarder(false, true, &adapter);
+  if (!gateway.IsRunning() || forwarder.IsUsingPcp() == natPmp ||
+      !forwarder.IsUsingPmp()) {
+    SetupFailed("Starting the forwarder's gateway");
+    return;
+  }
+
+  int ports[numPorts];
+  for (int i = 0; i < numPorts; ++i) {
+    ports[i] = firstPort + i;
+  }
+  for (int sample = 0; sample < samples; ++sample) {
+    forward.Begin();
+    int forwarded = forwarder.ForwardMany(true, ports, numPorts,
+                                          const_cast<char*>("Bench"), 7200);
+    forward.End(1);
+
+    unforward.Begin();
+    int unforwarded = forwarder.UnforwardMany(true, ports, numPorts);
+    unforward.End(1);
+
+    if (forwarded != numPorts || unforwarded != numPorts) {
+      SetupFailed("Forwarding with PortForwarder");
+      return;
+    }
+  }
+  results.insert(results.end(), { forward, unforward });
+}
+
+
+// Scans the description a UPnP gateway serves for the IGD's services, in the buffer
+// miniwget downloaded it to
+static void BenchIgdScan() {
+  const int ops = 1000, samples = 100;
+  Series scan("upnp.scan.rootdesc", "ns", 1);
+
+  FakeGateway::Settings settings;
+  settings.address    = "127.0.73.1";
+  settings.lanAddress = "127.0.73.200";
+  settings.protocols  = FakeGateway::protoUpnp;
+  FakeGateway gateway(settings);
+  int size = 0, status = 0;
+  char *description = static_cast<char*>(miniwget(gateway.GetDescUrl().c_str(),
+                                                  &size, 0, &status));
+  IGDdatas data;
+  if (!description || !ScanIgdDescription(description, size, &data)) {
+    SetupFailed("Downloading the IGD description");
+    free(description);
+    return;
+  }
+
+  for (int sample = 0; sample < samples; ++sample) {
+    scan.Begin();
+    for (int i = 0; i < ops; ++i) {
+      ScanIgdDescription(description, size, &data);
+    }
+    scan.End(ops);
+  }
+  free(description);
+  results.push_back(scan);
+}
+
+
+// Sends and receives small datagrams over loopback, directly and through the
+// game's hook wrappers, which pass them through with every feature disabled
+static void BenchHookWrappers() {
+  const int ops = 64, samples = 500;
+  SOCKET sender   = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP),
+         receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  sockaddr_in address = {};
+  address.sin_family      = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int len = sizeof(address);
+  auto *name = reinterpret_cast<sockaddr*>(&address);
+  if (sender == INVALID_SOCKET || receiver == INVALID_SOCKET ||
+      bind(receiver, name, len) != 0 || getsockname(receiver, name, &len) != 0) {
+    SetupFailed("Opening loopback sockets");
+    return;
+  }
+
+  typedef int (__stdcall *SendTo)(SOCKET, const char*, int, int, const sockaddr*, int);
+  typedef int (__stdcall *RecvFrom)(SOCKET, char*, int, int, sockaddr*, int*);
+  SendTo   directSend = [](SOCKET s, const char *buf, int len, int flags,
+                           const sockaddr *to, int tolen) {
+    return sendto(s, buf, len, flags, to, tolen);
+  };
+  RecvFrom directRecv = [](SOCKET s, char *buf, int len, int flags, sockaddr *from,
+                           int *fromlen) {
+    return recvfrom(s, buf, len, flags, from, fromlen);
+  };
+
+  // Fills the receiver's queue, then drains it, timing each
+  bool ok = true;
+  auto exchange = [&](Series &sendSeries, SendTo sendTo, Series &recvSeries,
+                      RecvFrom recvFrom) {
+    char packet[64] = {};
+    sendSeries.Begin();
+    for (int i = 0; i < ops; ++i) {
+      ok &= sendTo(sender, packet, sizeof(packet), 0, name, len) == sizeof(packet);
+    }
+    sendSeries.End(ops);
+
+    recvSeries.Begin();
+    for (int i = 0; i < ops; ++i) {
+      sockaddr_in from;
+      int fromLen = sizeof(from);
+      ok &= recvFrom(receiver, packet, sizeof(packet), 0,
+                     reinterpret_cast<sockaddr*>(&from), &fromLen) == sizeof(packet);
+    }
+    recvSeries.End(ops);
+  };
+
+  // Alternating, so both see the same caches and system load
+  Series sendDirect("hook.sendto.direct", "ns", 1),
+         recvDirect("hook.recvfrom.direct", "ns", 1),
+         sendWrapped("hook.sendto.wrapper", "ns", 1),
+         recvWrapped("hook.recvfrom.wrapper", "ns", 1);
+  for (int sample = 0; sample < samples; ++sample) {
+    exchange(sendDirect, directSend, recvDirect, directRecv);
+    exchange(sendWrapped, &SendToWrapper, recvWrapped, &RecvFromWrapper);
+  }
+  if (ok) {
+    results.insert(results.end(), { sendDirect, recvDirect, sendWrapped, recvWrapped });
+  }
+  else {
+    SetupFailed("Sending over loopback");
+  }
+
+  closesocket(sender);
+  closesocket(receiver);
+}
+
+
+// Sends bursts of small datagrams between two game sockets on loopback through the
+// hook wrappers, directly and coalesced, timing the sends and the receives per game
+// datagram and counting the datagrams that went on the wire. The sockets negotiate
+// coalescing with our own handshake port, as two NetHelpers on one computer would.
+static void BenchCoalescing() {
+  const int ops = 64, samples = 200, windowMs = 1;
+  SOCKET sender   = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP),
+         receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  sockaddr_in senderAddress = {}, receiverAddress = {};
+  for (sockaddr_in *address : { &senderAddress, &receiverAddress }) {
+    address->sin_family      = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  }
+  auto *senderName   = reinterpret_cast<sockaddr*>(&senderAddress),
+       *receiverName = reinterpret_cast<sockaddr*>(&receiverAddress);
+  int len = sizeof(sockaddr_in);
+  if (sender == INVALID_SOCKET || receiver == INVALID_SOCKET ||
+      bind(sender, senderName, len) != 0 || getsockname(sender, senderName, &len) ||
+      bind(receiver, receiverName, len) != 0 ||
+      getsockname(receiver, receiverName, &len) != 0) {
+    SetupFailed("Opening loopback sockets");
+    return;
+  }
+
+  // The receiver learns the sender's capabilities from its confirmation
+  char packet[48] = {};
+  int peerId = -1;
+  if (StartCoalescing(windowMs)) {
+    SetLocalCapabilities(capCoalesce);
+    DWORD start = GetTickCount();
+    SendToWrapper(sender, packet, sizeof(packet), 0, receiverName, len);
+    peerId = PeerTable::FindPeerId(receiverName, len);
+    while (!(GetPeerCapabilities(peerId) & capCoalesce) &&
+           GetTickCount() - start < 2000) {
+      Sleep(1);
+    }
+    // The receiver takes the first datagram and the confirmation, which the hook
+    // hides, so without blocking
+    u_long nonBlocking = 1;
+    ioctlsocket(receiver, FIONBIO, &nonBlocking);
+    while (!(GetPeerCapabilities(PeerTable::FindPeerId(senderName, len)) &
+             capCoalesce) && GetTickCount() - start < 2000) {
+      sockaddr_in from;
+      int fromLen = sizeof(from);
+      if (RecvFromWrapper(receiver, packet, sizeof(packet), 0,
+                          reinterpret_cast<sockaddr*>(&from), &fromLen) < 0) {
+        Sleep(1);
+      }
+    }
+    nonBlocking = 0;
+    ioctlsocket(receiver, FIONBIO, &nonBlocking);
+  }
+  if (!(GetPeerCapabilities(peerId) & capCoalesce)) {
+    SetupFailed("Negotiating coalescing");
+  }
+  else {
+    typedef int (__stdcall *SendTo)(SOCKET, const char*, int, int, const sockaddr*,
+                                    int);
+    typedef int (__stdcall *RecvFrom)(SOCKET, char*, int, int, sockaddr*, int*);
+    SendTo   directSend = [](SOCKET s, const char *buf, int len, int flags,
+                             const sockaddr *to, int tolen) {
+      return sendto(s, buf, len, flags, to, tolen);
+    };
+    RecvFrom directRecv = [](SOCKET s, char *buf, int len, int flags, sockaddr *from,
+                             int *fromlen) {
+      return recvfrom(s, buf, len, flags, from, fromlen);
+    };
+
+    // Sends a burst, waits for the last bundle to be flushed, then drains it
+    bool ok = true;
+    auto exchange = [&](Series &sendSeries, SendTo sendTo, Series &recvSeries,
+                        RecvFrom recvFrom) {
+      sendSeries.Begin();
+      for (int i = 0; i < ops; ++i) {
+        ok &= sendTo(sender, packet, sizeof(packet), 0, receiverName, len) ==
+              sizeof(packet);
+      }
+      sendSeries.End(ops);
+      Sleep(2 * windowMs + 1);
+
+      recvSeries.Begin();
+      for (int i = 0; i < ops; ++i) {
+        sockaddr_in from;
+        int fromLen = sizeof(from);
+        ok &= recvFrom(receiver, packet, sizeof(packet), 0,
+                       reinterpret_cast<sockaddr*>(&from), &fromLen) ==
+              sizeof(packet);
+      }
+      recvSeries.End(ops);
+    };
+
+    Series sendDirect("coalesce.sendto.direct", "ns", 1),
+           recvDirect("coalesce.recvfrom.direct", "ns", 1),
+           sendBundled("coalesce.sendto.bundled", "ns", 1),
+           recvBundled("coalesce.recvfrom.bundled", "ns", 1),
+           wire("coalesce.wire.bundled", "%", 1);
+    for (int sample = 0; sample < samples; ++sample) {
+      exchange(sendDirect, directSend, recvDirect, directRecv);
+
+      // Each bundle and each datagram sent on its own is one sendto
+      CoalesceStats before = GetCoalesceStats();
+      exchange(sendBundled, &SendToWrapper, recvBundled, &RecvFromWrapper);
+      const CoalesceStats &after = GetCoalesceStats();
+      int bundles = after.bundlesOut - before.bundlesOut,
+          alone   = ops - (after.unbundled - before.unbundled);
+      wire.Add(100.0 * (bundles + alone) / ops);
+    }
+    if (ok) {
+      results.insert(results.end(), { sendDirect, recvDirect, sendBundled, recvBundled,
+                                      wire });
+    }
+    else {
+      SetupFailed("Sending coalesced datagrams");
+    }
+  }
+
+  SetLocalCapabilities(0);
+  StopCoalescing();
+  closesocket(sender);
+  closesocket(receiver);
+}
+
+
+// Sends bursts of datagrams at a socket with a small receive buffer while the game
+// is busy with a tick, then drains them, directly and through the receive engine:
+// the share of the datagrams lost, what each receive costs, and how long a
+// datagram takes from sendto until the game's receive returns it
+static void BenchRecvEngine() {
+  const int bursts = 5, burst = 20, burstMs = 2, samples = 50, pings = 200;
+  SOCKET sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sender == INVALID_SOCKET || !StartRecvEngine(32)) {
+    SetupFailed("Starting the receive engine");
+    return;
+  }
+
+  for (bool engine : { false, true }) {
+    // As small as Windows' default, which a burst overflows
+    SOCKET receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int bufferSize = 8192;
+    u_long nonBlocking = 1;
+    sockaddr_in address = {};
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int len = sizeof(address);
+    auto *name = reinterpret_cast<sockaddr*>(&address);
+    if (receiver == INVALID_SOCKET ||
+        setsockopt(receiver, SOL_SOCKET, SO_RCVBUF,
+                   reinterpret_cast<const char*>(&bufferSize), sizeof(bufferSize)) ||
+        bind(receiver, name, len) != 0 || getsockname(receiver, name, &len) != 0 ||
+        ioctlsocket(receiver, FIONBIO, &nonBlocking) != 0 ||
+        (engine && !RecvEngineAttach(receiver, true))) {
+      SetupFailed("Opening the receive engine's socket");
+      closesocket(receiver);
+      continue;
+    }
+
+    // The hook pops from the engine's queue for attached sockets
+    std::string suffix = engine ? ".engine" : ".direct";
+    Series lost(("recvengine.burst.lost" + suffix).c_str(), "%", 1),
+           recv(("recvengine.recvfrom" + suffix).c_str(), "ns", 1),
+           latency(("recvengine.latency" + suffix).c_str(), "us", 1000);
+    char packet[100] = {};
+    for (int sample = 0; sample < samples; ++sample) {
+      for (int i = 0; i < bursts * burst; ++i) {
+        sendto(sender, packet, sizeof(packet), 0, name, len);
+        if ((i + 1) % burst == 0) {
+          Sleep(burstMs);
+        }
+      }
+
+      int received = 0;
+      recv.Begin();
+      while (RecvEnginePop(receiver, packet, sizeof(packet), 0, nullptr, nullptr) ==
+             sizeof(packet)) {
+        ++received;
+      }
+      recv.End(received > 0 ? received : 1);
+      lost.Add(100.0 * (bursts * burst - received) / (bursts * burst));
+    }
+
+    for (int ping = 0; ping < pings; ++ping) {
+      latency.Begin();
+      sendto(sender, packet, sizeof(packet), 0, name, len);
+      while (RecvEnginePop(receiver, packet, sizeof(packet), 0, nullptr, nullptr) !=
+             sizeof(packet)) { }
+      latency.End(1);
+    }
+    results.insert(results.end(), { lost, recv, latency });
+
+    if (engine) {
+      RecvEngineDetach(receiver);
+    }
+    closesocket(receiver);
+  }
+
+  StopRecvEngine();
+  closesocket(sender);
+}
+
+
+// Waits up to timeoutMs for a datagram. Returns its length, or -1.
+static int ReceiveWithin(SOCKET s, char *buf, int len, int timeoutMs) {
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(s, &fds);
+  timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+  return (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) == 1) ?
+         recv(s, buf, len, 0) : -1;
+}
+
+
+// Plays a game's datagrams through a NetRelay server on loopback, as a client that
+// can't forward ports and a peer that reaches it at its relayed port: the round
+// trip time with and without the relay, and the time the relay takes per datagram
+// on its one core while a peer sends as fast as the relay keeps up
+static void BenchRelay() {
+  const u_short port = 47850;
+  const int pings = 500, samples = 20, packets = 2000, window = 32, payload = 100;
+
+  char portArg[8];
+  sprintf_s(portArg, sizeof(portArg), "%d", port);
+  fflush(nullptr);
+  pid_t relay = fork();
+  if (relay == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    execl(NETRELAY, NETRELAY, "-p", portArg, "-l", "1", static_cast<char*>(nullptr));
+    _exit(127);
+  }
+
+  sockaddr_in control = {},
+              client  = {},
+              peer    = {};
+  for (sockaddr_in *address : { &control, &client, &peer }) {
+    address->sin_family      = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  }
+  control.sin_port = htons(port);
+  SOCKET game  = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP),
+         other = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  int len = sizeof(client);
+  if (relay < 0 || game == INVALID_SOCKET || other == INVALID_SOCKET ||
+      bind(game, reinterpret_cast<sockaddr*>(&client), len) != 0 ||
+      getsockname(game, reinterpret_cast<sockaddr*>(&client), &len) != 0 ||
+      bind(other, reinterpret_cast<sockaddr*>(&peer), len) != 0 ||
+      getsockname(other, reinterpret_cast<sockaddr*>(&peer), &len) != 0) {
+    SetupFailed("Opening the relay's sockets");
+  }
+
+  // Allocate once the relay is listening
+  char packet[sizeof(RelayHeader) + payload] = {};
+  auto *header = reinterpret_cast<RelayHeader*>(packet);
+  sockaddr_in relayed = control;
+  bool allocated = false;
+  for (int attempt = 0; !allocated && attempt < 50 && relay > 0; ++attempt) {
+    *header = { relayMagic, relayAllocate, relayVersion, 0, 0 };
+    sendto(game, packet, sizeof(RelayHeader), 0,
+           reinterpret_cast<sockaddr*>(&control), sizeof(control));
+    allocated = ReceiveWithin(game, packet, sizeof(packet), 20) ==
+                  static_cast<int>(sizeof(RelayHeader)) &&
+                header->type == relayAllocated;
+  }
+  relayed.sin_port = header->port;
+
+  // The peer's first datagram lets the client answer it
+  char data[payload] = {};
+  sendto(other, data, payload, 0, reinterpret_cast<sockaddr*>(&relayed),
+         sizeof(relayed));
+  if (!allocated || ReceiveWithin(game, packet, sizeof(packet), 500) !=
+                      static_cast<int>(sizeof(packet))) {
+    SetupFailed("Allocating on the relay");
+  }
+  else {
+    Series direct("relay.rtt.direct", "us", 1000),
+           through("relay.rtt.relayed", "us", 1000),
+           forward("relay.forward", "ns", 1);
+    for (int ping = 0; ping < pings; ++ping) {
+      direct.Begin();
+      sendto(other, data, payload, 0, reinterpret_cast<sockaddr*>(&client),
+             sizeof(client));
+      ReceiveWithin(game, data, payload, 500);
+      sendto(game, data, payload, 0, reinterpret_cast<sockaddr*>(&peer), sizeof(peer));
+      ReceiveWithin(other, data, payload, 500);
+      direct.End(1);
+
+      // The client answers through the relay what reached it through the relay
+      through.Begin();
+      sendto(other, data, payload, 0, reinterpret_cast<sockaddr*>(&relayed),
+             sizeof(relayed));
+      ReceiveWithin(game, packet, sizeof(packet), 500);
+      *header = { relayMagic, relayData, relayVersion, peer.sin_addr.s_addr,
+                  peer.sin_port };
+      sendto(game, packet, sizeof(packet), 0, reinterpret_cast<sockaddr*>(&control),
+             sizeof(control));
+      ReceiveWithin(other, data, payload, 500);
+      through.End(1);
+    }
+
+    // Keeps a window of datagrams in flight, so the relay is never idle and its
+    // sockets never overflow. A datagram not seen within 100 ms is counted lost.
+    for (int sample = 0; sample < samples; ++sample) {
+      int sent = 0,
+          done = 0;
+      forward.Begin();
+      while (done < packets) {
+        while (sent < packets && sent - done < window) {
+          sendto(other, data, payload, 0, reinterpret_cast<sockaddr*>(&relayed),
+                 sizeof(relayed));
+          ++sent;
+        }
+        done = (ReceiveWithin(game, packet, sizeof(packet), 100) >= 0) ? done + 1 :
+                                                                         sent;
+      }
+      forward.End(packets);
+    }
+    results.insert(results.end(), { direct, through, forward });
+  }
+
+  closesocket(game);
+  closesocket(other);
+  if (relay > 0) {
+    kill(relay, SIGTERM);
+    waitpid(relay, nullptr, 0);
+  }
+}
+
+
+// Finds "key": in a line of JSON and reads the string or number after it
+static bool ReadField(const std::string &line, const char *key, std::string *value) {
+  std::string quoted = std::string("\"") + key + "\":";
+  size_t at = line.find(quoted);
+  if (at == std::string::npos) {
+    return false;
+  }
+  at = line.find_first_not_of(' ', at + quoted.size());
+  if (at == std::string::npos) {
+    return false;
+  }
+  if (line[at] == '"') {
+    size_t end = line.find('"', at + 1);
+    *value = line.substr(at + 1, end - at - 1);
+  }
+  else {
+    *value = line.substr(at, line.find_first_of(",}", at) - at);
+  }
+  return true;
+}
+
+
+// Compares the medians and allocations with the baseline's. Returns the number of
+// benchmarks that regressed.
+static int CompareWithBaseline(const char *path, double threshold) {
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Bench: can't read baseline %s\n", path);
+    return -1;
+  }
+
+  struct Baseline { double p50, allocs; };
+  std::map<std::string, Baseline> baseline;
+  std::string line, name, p50, allocs;
+  while (std::getline(file, line)) {
+    if (ReadField(line, "name", &name) && ReadField(line, "p50", &p50) &&
+        ReadField(line, "allocs", &allocs)) {
+      baseline[name] = { atof(p50.c_str()), atof(allocs.c_str()) };
+    }
+  }
+
+  int regressions = 0;
+  fprintf(stderr, "%-32s %12s %12s %8s %14s\n", "benchmark", "p50", "baseline",
+          "change", "allocs/op");
+  for (const Series &series : results) {
+    auto it = baseline.find(series.name);
+    if (it == baseline.end()) {
+      fprintf(stderr, "%-32s %9.3f %-2s %12s\n", series.name.c_str(), series.Median(),
+              series.unit, "(new)");
+      continue;
+    }
+    double change = (it->second.p50 > 0) ?
+                    (series.Median() / it->second.p50 - 1) * 100 : 0;
+    bool slower = change > threshold,
+         allocates = series.AllocsPerOp() > it->second.allocs + 0.005;
+    fprintf(stderr, "%-32s %9.3f %-2s %9.3f %-2s %+7.1f%% %6.2f vs %-5.2f%s\n",
+            series.name.c_str(), series.Median(), series.unit, it->second.p50,
+            series.unit, change, series.AllocsPerOp(), it->second.allocs,
+            (slower || allocates) ? "  REGRESSED" : "");
+    regressions += (slower || allocates) ? 1 : 0;
+  }
+  return regressions;
+}
+
+
+int main(int argc, char **argv) {
+  const char *outputPath   = nullptr,
+             *baselinePath = nullptr;
+  double threshold = 25;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      outputPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baselinePath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    }
+    else {
+      fprintf(stderr, "Usage: %s [--output file] [--baseline file] "
+              "[--threshold percent]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  HMODULE image = GameImage::Load(GameImage::gameLayout, nullptr);
+  if (!image) {
+    SetupFailed("Loading the game image");
+    return 2;
+  }
+  BenchPatches();
+  BenchFixPtr();
+  BenchGlobalReferences();
+  GameImage::Unload(image);
+  BenchSignatureScan();
+  BenchModuleVerify();
+
+  for (int latencyMs : { 0, 2, 10 }) {
+    BenchForwarding(latencyMs);
+  }
+  for (const char *protocol : { "pcp", "natpmp" }) {
+    for (int latencyMs : { 0, 2, 10 }) {
+      BenchForwarder(protocol, latencyMs);
+    }
+  }
+  BenchIgdScan();
+  BenchHookWrappers();
+  BenchCoalescing();
+  BenchRecvEngine();
+  BenchRelay();
+
+  FILE *output = outputPath ? fopen(outputPath, "w") : stdout;
+  if (!output) {
+    fprintf(stderr, "Bench: can't write %s\n", outputPath);
+    return 2;
+  }
+  fprintf(output, "{\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    results[i].Write(output);
+    fprintf(output, (i + 1 < results.size()) ? ",\n" : "\n");
+  }
+  fprintf(output, "  ]\n}\n");
+  if (output != stdout) {
+    fclose(output);
+  }
+
+  int regressions = baselinePath ? CompareWithBaseline(baselinePath, threshold) : 0;
+  if (regressions < 0 || setupFailures > 0) {
+    return 2;
+  }
+  if (regressions > 0) {
+    fprintf(stderr, "Bench: %d of %d benchmarks regressed by more than %.0f%%\n",
+            regressions, static_cast<int>(results.size()), threshold);
+    return 1;
+  }
+  return 0;
+}
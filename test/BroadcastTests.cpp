@@ -0,0 +1,303 @@
+// Tests broadcast fan-out with session hosts on several networks, each given its
+// own subnet on loopback in a network namespace of the test's. Each host listens on
+// its network's directed broadcast address, as a host on that network would only
+// hear broadcasts sent there, or on 255.255.255.255 for the network of the default
+// route. Measures the time until the game has seen every session, and that a host
+// on two of the networks is only listed once.
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Broadcast.h"
+#include "NetMonitor.h"
+#include "Netlink.h"
+
+namespace {
+
+const int searchPort = 47800;
+
+sockaddr_in Address(const char *ip, int port) {
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port   = htons(port);
+  inet_pton(AF_INET, ip, &address.sin_addr);
+  return address;
+}
+
+
+SOCKET Bind(const sockaddr_in &address) {
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (s != INVALID_SOCKET &&
+      bind(s, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+  return s;
+}
+
+
+// Waits up to timeoutMs for a datagram. Returns its length, or -1.
+int Receive(SOCKET s, int timeoutMs, char *buf, int len, sockaddr_in *from) {
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(s, &fds);
+  timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+  if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) <= 0) {
+    return -1;
+  }
+  int fromLen = sizeof(*from);
+  return recvfrom(s, buf, len, 0, reinterpret_cast<sockaddr*>(from), &fromLen);
+}
+
+
+// Hosts a game session. It answers searches heard on each of its networks from its
+// own address there, with the session's name, from the same port on each.
+class SessionHost {
+public:
+  // Pairs of the broadcast address heard on and the host's address
+  SessionHost(const char *session,
+              std::vector<std::pair<const char*, const char*>> networks)
+    : session(session), stopping(false) {
+    for (auto &network : networks) {
+      listeners.push_back(Bind(Address(network.first, searchPort)));
+      answerers.push_back(Bind(Address(network.second, searchPort + 1)));
+    }
+    thread = std::thread([this] { Serve(); });
+  }
+  ~SessionHost() {
+    stopping = true;
+    thread.join();
+    for (SOCKET s : listeners) {
+      closesocket(s);
+    }
+    for (SOCKET s : answerers) {
+      closesocket(s);
+    }
+  }
+
+  bool IsListening() const {
+    for (size_t i = 0; i < listeners.size(); ++i) {
+      if (listeners[i] == INVALID_SOCKET || answerers[i] == INVALID_SOCKET) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  void Serve() {
+    while (!stopping) {
+      for (size_t i = 0; i < listeners.size(); ++i) {
+        char buf[64];
+        sockaddr_in from;
+        if (Receive(listeners[i], 5, buf, sizeof(buf), &from) > 0) {
+          sendto(answerers[i], session.c_str(), static_cast<int>(session.size()), 0,
+                 reinterpret_cast<const sockaddr*>(&from), sizeof(from));
+        }
+      }
+    }
+  }
+
+  std::string         session;
+  std::vector<SOCKET> listeners,
+                      answerers;
+  std::atomic<bool>   stopping;
+  std::thread         thread;
+};
+
+
+// The game's socket, which searches as the sendto and recvfrom hooks would have it
+class Game {
+public:
+  Game() : s(Bind(Address("0.0.0.0", 0))) {
+    BOOL broadcast = TRUE;
+    setsockopt(s, SOL_SOCKET, SO_BROADCAST, reinterpret_cast<const char*>(&broadcast),
+               sizeof(broadcast));
+  }
+  ~Game() {
+    BroadcastDetach(s);
+    closesocket(s);
+  }
+
+  // Broadcasts a search and lists the sessions that answer within windowMs, with
+  // the milliseconds each first took to show up, if not listed already. Returns
+  // the number of replies dropped.
+  int Search(DWORD windowMs, std::map<std::string, DWORD> *sessions) {
+    sockaddr_in to = Address("255.255.255.255", searchPort);
+    auto *toAddr = reinterpret_cast<const sockaddr*>(&to);
+    DWORD start = GetTickCount();
+    BroadcastFanOut(s, "search", 6, 0, toAddr, sizeof(to));
+    sendto(s, "search", 6, 0, toAddr, sizeof(to));
+
+    std::set<std::string> heard;
+    int dropped = 0;
+    for (DWORD elapsed = 0; elapsed < windowMs; elapsed = GetTickCount() - start) {
+      char buf[64];
+      sockaddr_in from;
+      int len = Receive(s, windowMs - elapsed, buf, sizeof(buf), &from);
+      if (len <= 0) {
+        continue;
+      }
+      std::string session(buf, len);
+      if (IsDuplicateReply(s, buf, len, reinterpret_cast<sockaddr*>(&from),
+                           sizeof(from))) {
+        ++dropped;
+      }
+      else if (heard.insert(session).second) {
+        sessions->emplace(session, GetTickCount() - start);
+      }
+      else {
+        // Listed twice
+        (*sessions)[session + " again"] = GetTickCount() - start;
+      }
+    }
+    return dropped;
+  }
+
+private:
+  SOCKET s;
+};
+
+} // anonymous namespace
+
+
+// Moves the test into a network namespace of its own, with a wired LAN that has the
+// default route, a second LAN, and a VPN, each a subnet on loopback. The adapters
+// are described to the IP helper shim as the same networks.
+static bool SetUpNetworks() {
+  static bool done = false;
+  if (!done) {
+    if (unshare(CLONE_NEWNET) != 0) {
+      printf("BroadcastTests needs to create a network namespace, as root\n");
+      return false;
+    }
+    for (const char *command : {
+           "ip link set lo up",
+           "ip addr add 10.47.1.10/24 brd 10.47.1.255 dev lo",
+           "ip addr add 10.47.2.10/24 brd 10.47.2.255 dev lo",
+           "ip addr add 10.47.3.10/24 brd 10.47.3.255 dev lo",
+           "ip route add default dev lo" }) {
+      if (system(command) != 0) {
+        return false;
+      }
+    }
+    done = true;
+  }
+
+  ShimResetNetwork();
+  return Netlink()
+    .Link(2, "eth0", true)
+    .Address(2, "10.47.1.10", 24)
+    .DefaultRoute(2, "10.47.1.1", 100)
+    .Link(3, "eth1", true)
+    .Address(3, "10.47.2.10", 24)
+    .Link(4, "tun0", true)
+    .Address(4, "10.47.3.10", 24)
+    .Apply();
+}
+
+
+TEST(FindsTheSessionsOnEveryNetworkInOneSearch) {
+  REQUIRE(SetUpNetworks());
+  SessionHost wired("Wired", { { "255.255.255.255", "10.47.1.20" } }),
+              lan("LAN", { { "10.47.2.255", "10.47.2.20" } }),
+              vpn("VPN", { { "10.47.3.255", "10.47.3.20" } });
+  REQUIRE(wired.IsListening() && lan.IsListening() && vpn.IsListening());
+  REQUIRE(StartBroadcastFanOut());
+  LONG copies = GetBroadcastStats().copies;
+
+  Game game;
+  std::map<std::string, DWORD> sessions;
+  CHECK(game.Search(300, &sessions) == 0);
+  CHECK(sessions.size() == 3);
+  DWORD allSeenMs = 0;
+  for (auto &session : sessions) {
+    allSeenMs = (session.second > allSeenMs) ? session.second : allSeenMs;
+  }
+  CHECK(sessions.count("LAN") && sessions.count("VPN"));
+  CHECK(allSeenMs < 100);
+  // The default route's network gets the original only
+  CHECK(GetBroadcastStats().copies - copies == 2);
+  StopBroadcastFanOut();
+  NetMonitor::Stop();
+}
+
+
+TEST(OnlyFindsTheDefaultNetworksSessionsWithoutFanOut) {
+  REQUIRE(SetUpNetworks());
+  SessionHost wired("Wired", { { "255.255.255.255", "10.47.1.20" } }),
+              lan("LAN", { { "10.47.2.255", "10.47.2.20" } });
+  REQUIRE(wired.IsListening() && lan.IsListening());
+
+  // However often the game searches
+  Game game;
+  std::map<std::string, DWORD> sessions;
+  for (int i = 0; i < 3; ++i) {
+    game.Search(300, &sessions);
+  }
+  CHECK(sessions.size() == 1);
+  CHECK(sessions.count("Wired"));
+}
+
+
+TEST(ListsAHostOnTwoNetworksOnce) {
+  REQUIRE(SetUpNetworks());
+  SessionHost both("Both", { { "10.47.2.255", "10.47.2.30" },
+                             { "10.47.3.255", "10.47.3.30" } });
+  REQUIRE(both.IsListening());
+  REQUIRE(StartBroadcastFanOut());
+
+  Game game;
+  std::map<std::string, DWORD> sessions;
+  CHECK(game.Search(300, &sessions) == 1);
+  CHECK(sessions.size() == 1);
+  CHECK(sessions.count("Both"));
+
+  // Its answer to the next search isn't taken for a repeat
+  sessions.clear();
+  CHECK(game.Search(300, &sessions) == 1);
+  CHECK(sessions.size() == 1);
+  StopBroadcastFanOut();
+  NetMonitor::Stop();
+}
+
+
+TEST(ReachesANetworkThatComesUpLater) {
+  REQUIRE(SetUpNetworks());
+  SessionHost lan("LAN", { { "10.47.2.255", "10.47.2.20" } }),
+              vpn("VPN", { { "10.47.3.255", "10.47.3.20" } });
+  REQUIRE(lan.IsListening() && vpn.IsListening());
+  REQUIRE(Netlink().Address(4, "10.47.3.10", 24, true).Apply());
+  REQUIRE(StartBroadcastFanOut());
+
+  Game game;
+  std::map<std::string, DWORD> sessions;
+  game.Search(300, &sessions);
+  CHECK(sessions.size() == 1);
+  CHECK(sessions.count("LAN"));
+
+  // The VPN connects, and the next search goes there as well
+  LONG generation = NetMonitor::GetAdapterGeneration();
+  REQUIRE(Netlink().Address(4, "10.47.3.10", 24).Apply());
+  DWORD start = GetTickCount();
+  while (NetMonitor::GetAdapterGeneration() == generation &&
+         GetTickCount() - start < 5000) {
+    Sleep(10);
+  }
+  sessions.clear();
+  game.Search(300, &sessions);
+  CHECK(sessions.size() == 2);
+  CHECK(sessions.count("VPN"));
+  StopBroadcastFanOut();
+  NetMonitor::Stop();
+}
@@ -0,0 +1,344 @@
+// Tests the datagram compressor: round trips, truncated and corrupt input, and
+// the send and receive paths
+
+#include "Test.h"
+#include <winsock2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "Compress.h"
+#include "Fnv.h"
+#include "Handshake.h"
+#include "NetStats.h"
+#include "PeerTable.h"
+#include "RecvQueue.h"
+
+typedef std::vector<char> Bytes;
+
+static const int maxPacketSize = 1472,
+                 testPeer      = 3;
+
+// Stand-ins for the rest of NetHelper and Winsock, recording what Compress passes
+// on to them
+static Bytes sent,
+             pushed,
+             handled;
+
+int sendto(SOCKET, const char *buf, int len, int, const sockaddr*, int) {
+  sent.assign(buf, buf + len);
+  return len;
+}
+
+WORD GetPeerCapabilities(int peerId) {
+  return (peerId == testPeer) ? capCompress : 0;
+}
+
+bool IsControlPacket(const char *buf, int len) {
+  DWORD magic;
+  return len >= static_cast<int>(sizeof(ControlHeader)) &&
+         (memcpy(&magic, buf, sizeof(magic)), magic == controlMagic);
+}
+
+void HandleControlPacket(SOCKET, const char *buf, int len, const sockaddr*, int,
+                         int) {
+  handled.assign(buf, buf + len);
+}
+
+bool RecvQueuePush(SOCKET, const char *data, int len, const sockaddr*, int) {
+  pushed.assign(data, data + len);
+  return true;
+}
+
+void NetStatsOnCompress(int, int, int) {}
+
+void PeerTable::AddEvictCallback(void (*)(int id)) {}
+
+
+// Deterministic, so failures can be reproduced
+static DWORD Random() {
+  static DWORD state = 2463534242u;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+
+// Test datagrams of a kind: 0 zeros, 1 noise, 2 a short repeated pattern, 3
+// records that partly repeat, 4 a pattern with some noise in it
+static Bytes MakePacket(int len, int kind) {
+  Bytes packet(len);
+  for (int i = 0; i < len; ++i) {
+    DWORD value;
+    switch (kind) {
+    case 0:  value = 0;                                        break;
+    case 1:  value = Random();                                 break;
+    case 2:  value = "abcd"[i % 4];                            break;
+    case 3:  value = (i % 16 < 12) ? i / 16 : Random();        break;
+    default: value = (Random() % 8 == 0) ? Random() : i % 7;
+    }
+    packet[i] = static_cast<char>(value);
+  }
+  return packet;
+}
+
+
+static bool RoundTrips(const Bytes &packet, int *compressedLen = nullptr) {
+  int len = static_cast<int>(packet.size());
+  Bytes compressed(2 * maxPacketSize + 64),
+        decompressed(len + 16, '\x5A');
+  int outLen = LzCompress(packet.data(), len, compressed.data(),
+                          static_cast<int>(compressed.size()));
+  if (compressedLen) {
+    *compressedLen = outLen;
+  }
+  if (outLen <= 0) {
+    return false;
+  }
+
+  // Nothing may be written past the declared length
+  if (LzDecompress(compressed.data(), outLen, decompressed.data(), len) != len) {
+    return false;
+  }
+  for (int i = len; i < len + 16; ++i) {
+    if (decompressed[i] != '\x5A') {
+      return false;
+    }
+  }
+  return memcmp(decompressed.data(), packet.data(), len) == 0;
+}
+
+
+static Bytes Compress(const Bytes &packet) {
+  Bytes compressed(2 * maxPacketSize + 64);
+  int len = LzCompress(packet.data(), static_cast<int>(packet.size()),
+                       compressed.data(), static_cast<int>(compressed.size()));
+  compressed.resize(len > 0 ? len : 0);
+  return compressed;
+}
+
+
+// Writes a dictionary file for StartCompression, and returns its path
+static std::string WriteDictionary(const Bytes &dictionary) {
+  char path[] = "/tmp/NetHelperDictionaryXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return std::string();
+  }
+  bool written = write(fd, dictionary.data(), dictionary.size()) ==
+                 static_cast<ssize_t>(dictionary.size());
+  close(fd);
+  return written ? path : std::string();
+}
+
+
+TEST(RoundTripsWithoutDictionary) {
+  CHECK(StartCompression(1, nullptr) == 0);
+
+  for (int kind = 0; kind < 5; ++kind) {
+    for (int len = 1; len <= maxPacketSize; len += (len < 64) ? 1 : 37) {
+      if (!RoundTrips(MakePacket(len, kind))) {
+        printf("  kind %d, length %d\n", kind, len);
+        CHECK(false);
+      }
+    }
+    CHECK(RoundTrips(MakePacket(maxPacketSize, kind)));
+  }
+
+  // Runs long enough for extra length bytes, and repeats that overlap themselves
+  int compressedLen;
+  CHECK(RoundTrips(MakePacket(maxPacketSize, 0), &compressedLen));
+  CHECK(compressedLen > 0 && compressedLen < 16);
+  CHECK(RoundTrips(MakePacket(maxPacketSize, 1), &compressedLen));
+  CHECK(compressedLen > maxPacketSize);
+
+  StopCompression();
+}
+
+
+TEST(RoundTripsWithDictionary) {
+  Bytes dictionary = MakePacket(4096, 4);
+  std::string path = WriteDictionary(dictionary);
+  REQUIRE(!path.empty());
+  DWORD id = StartCompression(1, path.c_str());
+  unlink(path.c_str());
+  CHECK(id == Fnv1a32(fnvBasis32, dictionary.data(), dictionary.size()));
+
+  // Datagrams that repeat parts of the dictionary shrink well
+  for (int i = 0; i < 200; ++i) {
+    int len    = 16 + Random() % (maxPacketSize - 16),
+        offset = Random() % (4096 - 16);
+    Bytes packet(&dictionary[offset],
+                 &dictionary[offset] + (len < 4096 - offset ? len : 4096 - offset));
+    int compressedLen;
+    CHECK(RoundTrips(packet, &compressedLen));
+    CHECK(compressedLen < static_cast<int>(packet.size()) / 4 + 8);
+  }
+  for (int kind = 0; kind < 5; ++kind) {
+    CHECK(RoundTrips(MakePacket(maxPacketSize, kind)));
+  }
+
+  // Without the dictionary, matches into it can't be decoded
+  Bytes packet(&dictionary[100], &dictionary[1100]),
+        compressed = Compress(packet),
+        out(packet.size());
+  REQUIRE(!compressed.empty());
+  StartCompression(1, nullptr);
+  CHECK(LzDecompress(compressed.data(), static_cast<int>(compressed.size()),
+                     out.data(), static_cast<int>(out.size())) == 0);
+
+  StopCompression();
+}
+
+
+TEST(RejectsOutputThatDoesNotFit) {
+  StartCompression(1, nullptr);
+  Bytes packet = MakePacket(1000, 4),
+        compressed = Compress(packet);
+  int len = static_cast<int>(compressed.size());
+  REQUIRE(len > 0);
+
+  Bytes out(len + 64);
+  CHECK(LzCompress(packet.data(), 1000, out.data(), len - 1) == 0);
+  CHECK(LzCompress(packet.data(), 1000, out.data(), 0) == 0);
+  CHECK(LzCompress(packet.data(), maxPacketSize + 1, out.data(), len + 64) == 0);
+  CHECK(LzCompress(packet.data(), -1, out.data(), len + 64) == 0);
+  StopCompression();
+}
+
+
+TEST(RejectsTruncatedInput) {
+  StartCompression(1, nullptr);
+  for (int kind = 0; kind < 5; ++kind) {
+    Bytes packet = MakePacket(600, kind),
+          compressed = Compress(packet),
+          out(packet.size());
+    int len = static_cast<int>(compressed.size());
+    REQUIRE(len > 0);
+
+    // Only the final empty sequence may go missing without changing the result
+    for (int cut = 0; cut < len; ++cut) {
+      int result = LzDecompress(compressed.data(), cut, out.data(), 600);
+      bool emptyTail = (cut == len - 1 && compressed[cut] == 0);
+      if (result != 0 && !(emptyTail && result == 600 &&
+                           memcmp(out.data(), packet.data(), 600) == 0)) {
+        printf("  kind %d, %d of %d bytes decoded to %d\n", kind, cut, len, result);
+        CHECK(false);
+      }
+    }
+
+    // The declared length must match what the sequences produce
+    CHECK(LzDecompress(compressed.data(), len, out.data(), 599) == 0);
+    Bytes longer(601);
+    CHECK(LzDecompress(compressed.data(), len, longer.data(), 601) == 0);
+  }
+  StopCompression();
+}
+
+
+TEST(RejectsCorruptInput) {
+  StartCompression(1, nullptr);
+  char out[maxPacketSize + 16];
+
+  // Token 0x10: one literal, then a match of 4 at the given offset
+  const char offsetZero[]   = { 0x10, 'a', 0, 0 },
+             offsetBefore[] = { 0x10, 'a', 2, 0 },
+             offsetValid[]  = { 0x10, 'a', 1, 0, 0 };
+  CHECK(LzDecompress(offsetZero, sizeof(offsetZero), out, 5) == 0);
+  CHECK(LzDecompress(offsetBefore, sizeof(offsetBefore), out, 5) == 0);
+  CHECK(LzDecompress(offsetValid, sizeof(offsetValid), out, 5) == 5);
+  CHECK(memcmp(out, "aaaaa", 5) == 0);
+
+  // Lengths that run off the end of the input, or past the output
+  const char literalsMissing[] = { static_cast<char>(0xF0), static_cast<char>(255) },
+             matchCut[]        = { 0x1F, 'a', 1, 0, static_cast<char>(255) };
+  CHECK(LzDecompress(literalsMissing, sizeof(literalsMissing), out, 300) == 0);
+  CHECK(LzDecompress(matchCut, sizeof(matchCut), out, maxPacketSize) == 0);
+  CHECK(LzDecompress(offsetValid, sizeof(offsetValid), out, 4) == 0);
+  Bytes matchTooLong = { 0x1F, 'a', 1, 0 };
+  matchTooLong.insert(matchTooLong.end(), 30, static_cast<char>(255));
+  matchTooLong.push_back(0);
+  CHECK(LzDecompress(matchTooLong.data(), static_cast<int>(matchTooLong.size()), out,
+                     maxPacketSize) == 0);
+
+  CHECK(LzDecompress(offsetValid, sizeof(offsetValid), out, 0) == 0);
+  CHECK(LzDecompress(offsetValid, sizeof(offsetValid), out, maxPacketSize + 1) == 0);
+
+  // Random damage to valid input must be caught, or decode to the right length
+  // without writing past it
+  for (int i = 0; i < 20000; ++i) {
+    int len = 1 + Random() % 800;
+    Bytes packet = MakePacket(len, 2 + Random() % 3),
+          compressed = Compress(packet);
+    REQUIRE(!compressed.empty());
+    for (int flips = 1 + Random() % 3; flips > 0; --flips) {
+      compressed[Random() % compressed.size()] ^=
+        static_cast<char>(1 + Random() % 255);
+    }
+
+    memset(out, 0x5A, sizeof(out));
+    int result = LzDecompress(compressed.data(), static_cast<int>(compressed.size()),
+                              out, len);
+    bool intact = true;
+    for (int j = len; j < len + 16; ++j) {
+      intact = intact && out[j] == 0x5A;
+    }
+    if ((result != 0 && result != len) || !intact) {
+      printf("  iteration %d: decoded to %d of %d\n", i, result, len);
+      CHECK(false);
+      break;
+    }
+  }
+  StopCompression();
+}
+
+
+TEST(SendsAndReceivesCompressed) {
+  StartCompression(64, nullptr);
+  sockaddr_in peer = {};
+  peer.sin_family = AF_INET;
+  const sockaddr *to = reinterpret_cast<const sockaddr*>(&peer);
+
+  // Compressible datagrams go out as ctlCompressed, and come back out unchanged
+  Bytes packet = MakePacket(500, 3);
+  CHECK(CompressSend(1, packet.data(), 500, 0, to, sizeof(peer), testPeer) == 500);
+  REQUIRE(sent.size() > sizeof(ControlHeader) && sent.size() < 500);
+  ControlHeader header;
+  memcpy(&header, sent.data(), sizeof(header));
+  CHECK(header.magic == controlMagic && header.type == ctlCompressed &&
+        header.value == 500);
+
+  pushed.clear();
+  DecompressReceived(1, sent.data(), static_cast<int>(sent.size()), to, sizeof(peer),
+                     testPeer);
+  CHECK(pushed == packet);
+
+  // A header claiming more than the datagram holds is dropped
+  Bytes wrongLength = sent;
+  header.value = 501;
+  memcpy(wrongLength.data(), &header, sizeof(header));
+  pushed.clear();
+  DecompressReceived(1, wrongLength.data(), static_cast<int>(wrongLength.size()), to,
+                     sizeof(peer), testPeer);
+  CHECK(pushed.empty());
+
+  // Small, incompressible, or to peers that don't support it: sent as is
+  Bytes small = MakePacket(63, 0),
+        noise = MakePacket(500, 1);
+  CHECK(CompressSend(1, small.data(), 63, 0, to, sizeof(peer), testPeer) == 63);
+  CHECK(sent == small);
+  CHECK(CompressSend(1, noise.data(), 500, 0, to, sizeof(peer), testPeer) == 500);
+  CHECK(sent == noise);
+  CHECK(CompressSend(1, packet.data(), 500, 0, to, sizeof(peer), testPeer + 1) == 500);
+  CHECK(sent == packet);
+
+  CompressPeerStats stats;
+  REQUIRE(GetCompressPeerStats(testPeer, &stats));
+  CHECK(stats.packetsCompressed == 1 && stats.packetsRaw == 2 &&
+        stats.packetsDecompressed == 2 && stats.rawBytes == 500 &&
+        stats.compressedBytes < 500);
+
+  StopCompression();
+}
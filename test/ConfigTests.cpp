@@ -0,0 +1,138 @@
+// Tests the settings snapshots against Outpost2.ini files the tests write: the
+// defaults, range checks, and reloads the watcher publishes when the section
+// changes. The tests run in a directory of their own, which stands in for the
+// game's.
+
+#include "Test.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include "Config.h"
+
+static const char section[] = "NetHelper";
+
+
+// Makes a new directory the current one the first time, as the INI path is relative
+static void EnterGameDirectory() {
+  static bool entered = false;
+  if (!entered) {
+    char path[] = "/tmp/ConfigTestsXXXXXX";
+    entered = mkdtemp(path) && chdir(path) == 0;
+  }
+}
+
+
+static void WriteIni(const std::string &text) {
+  EnterGameDirectory();
+  FILE *file = fopen("Outpost2.ini", "w");
+  if (file) {
+    fputs(text.c_str(), file);
+    fclose(file);
+  }
+}
+
+
+TEST(DefaultsWithoutTheSection) {
+  WriteIni("[Game]\nForwardMode=3\n");
+  std::shared_ptr<const Config> config = LoadConfig(section);
+  REQUIRE(config);
+  CHECK(config->forwardMode == 1);
+  CHECK(config->leaseSec == 24*60*60);
+  CHECK(config->startPort == 47776 && config->endPort == 47807);
+  CHECK(config->bindAll);
+  CHECK(config->socketPolicy.dscp == -1);
+  CHECK(config->stunServers.empty());
+  CHECK(config->source.empty());
+  CHECK(GetConfig() == config);
+}
+
+
+TEST(ReadsTheSection) {
+  WriteIni("[Game]\n"
+           "LeaseSec=60\n"
+           "[nethelper]\n"
+           "; Comments are skipped\n"
+           "ForwardMode = 2\n"
+           "leasesec=3600\n"
+           "STARTPORT=50000\n"
+           "EndPort=50010\n"
+           "BindAll=0\n"
+           "Dscp=46\n"
+           "CaptureFile=\"C:\\Temp\\capture.o2pc\"\n"
+           "StunServers= stun.example.com:3478 ,, 192.0.2.1 \n"
+           "[Other]\n"
+           "StartPort=1\n");
+  std::shared_ptr<const Config> config = LoadConfig(section);
+  REQUIRE(config);
+  CHECK(config->forwardMode == 2);
+  CHECK(config->leaseSec == 3600);
+  CHECK(config->startPort == 50000 && config->endPort == 50010);
+  CHECK(!config->bindAll);
+  CHECK(config->socketPolicy.dscp == 46);
+  CHECK(config->captureFile == "C:\\Temp\\capture.o2pc");
+  REQUIRE(config->stunServers.size() == 2);
+  CHECK(config->stunServers[0] == "stun.example.com:3478");
+  CHECK(config->stunServers[1] == "192.0.2.1");
+}
+
+
+TEST(ClampsToValidRanges) {
+  WriteIni("[NetHelper]\n"
+           "ForwardMode=7\n"
+           "LeaseSec=999999\n"
+           "Dscp=70\n"
+           "RecvEnginePosted=0\n"
+           "StunCacheSec=5\n");
+  std::shared_ptr<const Config> config = LoadConfig(section);
+  REQUIRE(config);
+  CHECK(config->forwardMode == 3);
+  CHECK(config->leaseSec == 604800);
+  CHECK(config->socketPolicy.dscp == 63);
+  CHECK(config->recvEnginePosted == 1);
+  CHECK(config->stunCacheSec == 30);
+
+  WriteIni("[NetHelper]\nDscp=-5\n");
+  CHECK(LoadConfig(section)->socketPolicy.dscp == -1);
+}
+
+
+TEST(KeepsThePortRangeInOrder) {
+  WriteIni("[NetHelper]\nStartPort=50010\nEndPort=50000\n");
+  std::shared_ptr<const Config> config = LoadConfig(section);
+  REQUIRE(config);
+  CHECK(config->startPort == 47776 && config->endPort == 47807);
+
+  WriteIni("[NetHelper]\nStartPort=50000\nEndPort=50000\n");
+  config = LoadConfig(section);
+  CHECK(config->startPort == 50000 && config->endPort == 50000);
+}
+
+
+TEST(PublishesReloadsOfTheSection) {
+  WriteIni("[NetHelper]\nLeaseSec=3600\n");
+  std::shared_ptr<const Config> before = LoadConfig(section);
+  REQUIRE(StartConfigWatch());
+  HANDLE hChanged = GetConfigChangeEvent();
+  REQUIRE(hChanged);
+
+  WriteIni("[NetHelper]\nLeaseSec=7200\nStartPort=50000\nEndPort=50031\n");
+  CHECK(WaitForSingleObject(hChanged, 3000) == WAIT_OBJECT_0);
+  std::shared_ptr<const Config> after = GetConfig();
+  CHECK(after->leaseSec == 7200);
+  CHECK(after->startPort == 50000 && after->endPort == 50031);
+  // Whoever still holds the old snapshot sees it unchanged
+  CHECK(before->leaseSec == 3600 && before->startPort == 47776);
+
+  // Changes elsewhere in the file aren't published
+  WriteIni("[NetHelper]\nLeaseSec=7200\nStartPort=50000\nEndPort=50031\n"
+           "[Game]\nSound=0\n");
+  CHECK(WaitForSingleObject(hChanged, 1000) == WAIT_TIMEOUT);
+  CHECK(GetConfig() == after);
+
+  StopConfigWatch();
+  WriteIni("[NetHelper]\nLeaseSec=60\n");
+  CHECK(WaitForSingleObject(hChanged, 500) == WAIT_TIMEOUT);
+  CHECK(GetConfig()->leaseSec == 7200);
+}
@@ -0,0 +1,175 @@
+// Tests LAN port coordination between several instances on loopback aliases, each
+// in a process of its own as each game is: that claims converge on distinct blocks
+// in one round trip, even when made at once, and that a stopped instance's block
+// is handed out again
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "PortCoordinator.h"
+
+namespace {
+
+struct Claim {
+  int   offset;
+  DWORD elapsedMs;
+  bool  coordinating;
+};
+
+// An instance of the coordinator in a child process, which claims a block for the
+// game's default port range, reports it, and holds it until stopped
+class Instance {
+public:
+  // If gated, the instance waits for Release before claiming
+  explicit Instance(const char *adapter, bool gated = false) : pid(-1) {
+    int results[2], control[2], gate[2];
+    if (pipe(results) != 0 || pipe(control) != 0 || pipe(gate) != 0) {
+      return;
+    }
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+      // Including other instances' pipes, so they see the test close its ends
+      for (int fd = 3; fd < 1024; ++fd) {
+        if (fd != results[1] && fd != control[0] && fd != gate[0]) {
+          close(fd);
+        }
+      }
+      char c;
+      if (gated && read(gate[0], &c, 1) != 1) {
+        _exit(1);
+      }
+      IPAddr address = 0;
+      inet_pton(AF_INET, adapter, &address);
+      DWORD start  = GetTickCount();
+      int   offset = StartPortCoordination(address, 47776, 47807);
+      dprintf(results[1], "%d %u %d\n", offset, GetTickCount() - start,
+              IsPortCoordinating() ? 1 : 0);
+      // Until the test closes its end
+      while (read(control[0], &c, 1) > 0) { }
+      StopPortCoordination();
+      _exit(0);
+    }
+    close(results[1]);
+    close(control[0]);
+    close(gate[0]);
+    resultsFd = results[0];
+    controlFd = control[1];
+    gateFd    = gate[1];
+  }
+  ~Instance() { Stop(); }
+
+  void Release() {
+    char c = 1;
+    if (write(gateFd, &c, 1) != 1) {
+      Stop();
+    }
+  }
+
+  // Waits for the instance's claim. Returns false if it didn't report one.
+  bool Result(Claim *out) {
+    if (pid <= 0) {
+      return false;
+    }
+    pollfd readable = { resultsFd, POLLIN, 0 };
+    char line[64] = {};
+    int coordinating = 0;
+    if (poll(&readable, 1, 5000) != 1 || read(resultsFd, line, sizeof(line) - 1) <= 0 ||
+        sscanf(line, "%d %u %d", &out->offset, &out->elapsedMs, &coordinating) != 3) {
+      return false;
+    }
+    out->coordinating = (coordinating != 0);
+    return true;
+  }
+
+  // Stops coordinating, giving up the block, and waits for the process to exit
+  void Stop() {
+    if (pid > 0) {
+      close(controlFd);
+      close(gateFd);
+      close(resultsFd);
+      int status;
+      waitpid(pid, &status, 0);
+      pid = -1;
+    }
+  }
+
+private:
+  pid_t pid;
+  int   resultsFd,
+        controlFd,
+        gateFd;
+};
+
+} // anonymous namespace
+
+
+// A claim makes one round, waiting 300 ms for the holders' answers
+const DWORD oneRoundMs = 450;
+
+
+TEST(ClaimsBlocksInOneRoundTrip) {
+  Instance first("127.0.0.1");
+  Claim claim;
+  REQUIRE(first.Result(&claim));
+  CHECK(claim.coordinating);
+  CHECK(claim.offset == 0);
+
+  // Each later instance learns every block held from the answers to its claim
+  Instance second("127.0.0.2");
+  REQUIRE(second.Result(&claim));
+  CHECK(claim.coordinating);
+  CHECK(claim.offset == 32);
+  CHECK(claim.elapsedMs < oneRoundMs);
+
+  Instance third("127.0.0.3");
+  REQUIRE(third.Result(&claim));
+  CHECK(claim.offset == 64);
+  CHECK(claim.elapsedMs < oneRoundMs);
+}
+
+
+TEST(HandsOutDistinctBlocksToSimultaneousClaims) {
+  std::vector<std::unique_ptr<Instance>> instances;
+  for (const char *adapter : { "127.0.0.4", "127.0.0.5", "127.0.0.6" }) {
+    instances.emplace_back(new Instance(adapter, true));
+  }
+  for (auto &instance : instances) {
+    instance->Release();
+  }
+
+  // The lowest instance ID wins each round, and the others claim the next block
+  std::vector<int> offsets;
+  for (auto &instance : instances) {
+    Claim claim;
+    REQUIRE(instance->Result(&claim));
+    CHECK(claim.coordinating);
+    offsets.push_back(claim.offset);
+  }
+  std::sort(offsets.begin(), offsets.end());
+  CHECK(offsets == std::vector<int>({ 0, 32, 64 }));
+}
+
+
+TEST(HandsOutAStoppedInstancesBlockAgain) {
+  Instance first("127.0.0.7"),
+           second("127.0.0.8", true);
+  Claim claim;
+  REQUIRE(first.Result(&claim));
+  CHECK(claim.offset == 0);
+  second.Release();
+  REQUIRE(second.Result(&claim));
+  CHECK(claim.offset == 32);
+
+  first.Stop();
+  Instance third("127.0.0.9");
+  REQUIRE(third.Result(&claim));
+  CHECK(claim.coordinating);
+  CHECK(claim.offset == 0);
+}
@@ -0,0 +1,589 @@
+// Simulates home routers on loopback addresses, speaking PCP and NAT-PMP over UDP
+// and UPnP to the miniupnpc stand-in
+
+#include "FakeGateway.h"
+#include <ws2tcpip.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+
+typedef std::chrono::steady_clock Clock;
+
+static const int pmpPort  = 5351,
+                 upnpPort = 5000;
+
+// PCP result codes (RFC 6887) and NAT-PMP ones (RFC 6886)
+static const BYTE pcpSuccess = 0, pcpUnsuppVersion = 1, pcpNotAuthorized = 2,
+                  pcpMalformedRequest = 3,
+                  pcpUnsuppOpcode = 4, pcpNoResources = 8,
+                  pcpCannotProvideExternal = 11, pcpAddressMismatch = 12;
+static const BYTE pmpUnsuppVersion = 1, pmpOutOfResources = 4, pmpUnsuppOpcode = 5;
+
+// UPnP errors the IGD answers with
+static const int upnpActionFailed = 501, upnpNoSuchEntry = 714, upnpConflict = 718;
+
+std::atomic<int> FakeGateway::busy(0),
+                 FakeGateway::maxBusy(0);
+
+static std::mutex& RegistryLock() {
+  static std::mutex lock;
+  return lock;
+}
+
+
+static std::vector<FakeGateway*>& Registry() {
+  static std::vector<FakeGateway*> gateways;
+  return gateways;
+}
+
+
+static void RaiseTo(std::atomic<int> &maximum, int value) {
+  int seen = maximum;
+  while (value > seen && !maximum.compare_exchange_weak(seen, value)) { }
+}
+
+
+static in_addr Ip(const std::string &address) {
+  in_addr value = {};
+  inet_pton(AF_INET, address.c_str(), &value);
+  return value;
+}
+
+
+static std::string IpText(const void *address) {
+  char text[INET_ADDRSTRLEN] = "";
+  inet_ntop(AF_INET, address, text, sizeof(text));
+  return text;
+}
+
+
+static void PutWord(BYTE *at, int value) {
+  at[0] = static_cast<BYTE>(value >> 8);
+  at[1] = static_cast<BYTE>(value);
+}
+
+
+static void PutDword(BYTE *at, DWORD value) {
+  PutWord(at, static_cast<int>(value >> 16));
+  PutWord(&at[2], static_cast<int>(value & 0xFFFF));
+}
+
+
+static int GetWord(const BYTE *at) {
+  return (at[0] << 8) | at[1];
+}
+
+
+static DWORD GetDword(const BYTE *at) {
+  return (static_cast<DWORD>(GetWord(at)) << 16) | GetWord(&at[2]);
+}
+
+
+struct FakeGateway::Answer {
+  Clock::time_point due;
+  sockaddr_in       to;
+  BYTE              packet[1100];
+  int               len;
+};
+
+
+FakeGateway::FakeGateway(const Settings &_settings)
+  : settings(_settings), s(INVALID_SOCKET), running(true), startTick(GetTickCount()),
+    dropped(0), discoveries(0), inFlight(0), maxInFlight(0), users(0) {
+  for (auto &count : requests) {
+    count = 0;
+  }
+
+  // Without a server on the port, requests get ICMP port unreachable back
+  if (settings.protocols & (protoPcp | protoNatPmp)) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port   = htons(pmpPort);
+    address.sin_addr   = Ip(settings.address);
+    s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET ||
+        bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      running = false;
+      return;
+    }
+    thread = std::thread([this]() { Serve(); });
+  }
+
+  std::lock_guard<std::mutex> guard(RegistryLock());
+  Registry().push_back(this);
+}
+
+
+FakeGateway::~FakeGateway() {
+  {
+    std::lock_guard<std::mutex> guard(RegistryLock());
+    auto &registry = Registry();
+    registry.erase(std::remove(registry.begin(), registry.end(), this),
+                   registry.end());
+  }
+  // Let UPnP actions already under way finish
+  while (users > 0) {
+    Sleep(1);
+  }
+
+  running = false;
+  if (thread.joinable()) {
+    thread.join();
+  }
+  if (s != INVALID_SOCKET) {
+    closesocket(s);
+  }
+}
+
+
+void FakeGateway::FailPort(int port, int times, int protocols) {
+  std::lock_guard<std::mutex> guard(lock);
+  failures[port] = std::make_pair(times, protocols);
+}
+
+
+bool FakeGateway::FindMapping(bool udp, int externalPort, Mapping *mapping) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = mappings.find(std::make_pair(udp ? IPPROTO_UDP : IPPROTO_TCP,
+                                         externalPort));
+  if (it == mappings.end()) {
+    return false;
+  }
+  if (mapping) {
+    *mapping = it->second;
+  }
+  return true;
+}
+
+
+size_t FakeGateway::CountMappings() {
+  std::lock_guard<std::mutex> guard(lock);
+  return mappings.size();
+}
+
+
+int FakeGateway::GetRequests(int protocols) {
+  int total = 0;
+  for (int i = 0; i < 3; ++i) {
+    if (protocols & (1 << i)) {
+      total += requests[i];
+    }
+  }
+  return total;
+}
+
+
+// Counts a request, and whether it can be worked on now
+bool FakeGateway::BeginRequest(Protocol protocol) {
+  ++requests[(protocol == protoPcp) ? 0 : (protocol == protoNatPmp) ? 1 : 2];
+  int working = ++inFlight;
+  if (settings.capacity > 0 && working > settings.capacity) {
+    --inFlight;
+    ++dropped;
+    return false;
+  }
+
+  RaiseTo(maxInFlight, working);
+  if (working == 1) {
+    RaiseTo(maxBusy, ++busy);
+  }
+  return true;
+}
+
+
+void FakeGateway::EndRequest() {
+  if (--inFlight == 0) {
+    --busy;
+  }
+}
+
+
+bool FakeGateway::TakeFailure(int port, Protocol protocol) {
+  auto it = failures.find(port);
+  if (it == failures.end() || !(it->second.second & protocol)) {
+    return false;
+  }
+  if (it->second.first > 0 && --it->second.first == 0) {
+    failures.erase(it);
+  }
+  return true;
+}
+
+
+// Maps the external port if it's free or already the internal host's, or else the
+// next free one. Returns the port mapped. The lock must be held.
+int FakeGateway::AssignPort(int protocol, int externalPort,
+                            const std::string &internalIp, int internalPort) {
+  for (int port = externalPort; port <= 0xFFFF; ++port) {
+    auto it = mappings.find(std::make_pair(protocol, port));
+    if (it == mappings.end() || (it->second.internalIp == internalIp &&
+                                 it->second.internalPort == internalPort)) {
+      return port;
+    }
+  }
+  return 0;
+}
+
+
+// Answers requests from the socket, each after the latency
+void FakeGateway::Serve() {
+  std::deque<Answer> answers;
+  while (running) {
+    // Wake for the next answer due, or now and then to notice being stopped
+    auto now = Clock::now();
+    LONG waitUs = 10000;
+    if (!answers.empty()) {
+      auto untilDue = std::chrono::duration_cast<std::chrono::microseconds>(
+        answers.front().due - now).count();
+      waitUs = static_cast<LONG>(std::max<long long>(0, std::min<long long>(waitUs,
+                                                                          untilDue)));
+    }
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    timeval tv = { 0, waitUs };
+    if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) > 0) {
+      Answer answer;
+      BYTE request[1100];
+      int fromLen = sizeof(answer.to);
+      int len = recvfrom(s, reinterpret_cast<char*>(request), sizeof(request), 0,
+                         reinterpret_cast<sockaddr*>(&answer.to), &fromLen);
+      if (len >= 2) {
+        Protocol protocol = (request[0] == 0) ? protoNatPmp : protoPcp;
+        if (BeginRequest(protocol)) {
+          answer.len = (protocol == protoNatPmp) ?
+            AnswerNatPmp(request, len, answer.to, answer.packet) :
+            AnswerPcp(request, len, answer.to, answer.packet);
+          answer.due = Clock::now() + std::chrono::milliseconds(settings.latencyMs);
+          answers.push_back(answer);
+        }
+      }
+    }
+
+    for (now = Clock::now(); !answers.empty() && answers.front().due <= now; ) {
+      const Answer &answer = answers.front();
+      if (answer.len > 0) {
+        sendto(s, reinterpret_cast<const char*>(answer.packet), answer.len, 0,
+               reinterpret_cast<const sockaddr*>(&answer.to), sizeof(answer.to));
+      }
+      answers.pop_front();
+      EndRequest();
+    }
+  }
+
+  while (!answers.empty()) {
+    answers.pop_front();
+    EndRequest();
+  }
+}
+
+
+// Returns the length of the response, or 0 to ignore the request
+int FakeGateway::AnswerPcp(const BYTE *request, int len, const sockaddr_in &from,
+                           BYTE *response) {
+  if (!(settings.protocols & protoPcp)) {
+    if (settings.dropsPcp || !(settings.protocols & protoNatPmp)) {
+      return 0;
+    }
+    // A NAT-PMP server answers other versions with its own
+    memset(response, 0, 8);
+    response[1] = static_cast<BYTE>(0x80 | request[1]);
+    PutWord(&response[2], pmpUnsuppVersion);
+    PutDword(&response[4], (GetTickCount() - startTick) / 1000);
+    return 8;
+  }
+
+  if (len < 24 || (request[1] & 0x80)) {
+    return 0;
+  }
+  int opcode = request[1];
+  memset(response, 0, 60);
+  response[0] = 2;
+  response[1] = static_cast<BYTE>(0x80 | opcode);
+  PutDword(&response[8], (GetTickCount() - startTick) / 1000);
+  if (request[0] != 2 || opcode != 1 || len < 60) {
+    response[3] = (request[0] != 2) ? pcpUnsuppVersion :
+                  (opcode == 0)     ? pcpSuccess :
+                  (opcode != 1)     ? pcpUnsuppOpcode : pcpMalformedRequest;
+    return 24;
+  }
+
+  // Errors keep the request's MAP payload, so the client can match them
+  const BYTE *payload = &request[24];
+  memcpy(&response[24], payload, 36);
+  const int size = 60;
+
+  // The client IP field has to be the address the request came from
+  static const BYTE v4Mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+  if (memcmp(&request[8], v4Mapped, sizeof(v4Mapped)) != 0 ||
+      memcmp(&request[20], &from.sin_addr, 4) != 0) {
+    response[3] = pcpAddressMismatch;
+    return size;
+  }
+
+  std::string internalIp = IpText(&request[20]);
+  bool preferFailure = false;
+  for (int at = 60; at + 4 <= len; ) {
+    int code = request[at], optionLen = GetWord(&request[at + 2]);
+    if (at + 4 + optionLen > len) {
+      response[3] = pcpMalformedRequest;
+      return size;
+    }
+    if (code == 1 && optionLen == 16) {
+      internalIp = IpText(&request[at + 4 + 12]);
+    }
+    preferFailure |= (code == 2);
+    at += 4 + optionLen;
+  }
+
+  int   protocol     = payload[12],
+        internalPort = GetWord(&payload[16]),
+        externalPort = GetWord(&payload[18]);
+  DWORD lifetime     = GetDword(&request[4]);
+  std::string nonce(reinterpret_cast<const char*>(payload), 12);
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (lifetime == 0) {
+    // Deletes the host's mapping of the internal port
+    for (auto it = mappings.begin(); it != mappings.end(); ++it) {
+      if (it->first.first == protocol && it->second.internalIp == internalIp &&
+          it->second.internalPort == internalPort) {
+        if (it->second.madeWith == protoPcp && it->second.nonce != nonce) {
+          response[3] = pcpNotAuthorized;
+          return size;
+        }
+        PutWord(&response[24 + 18], it->first.second);
+        mappings.erase(it);
+        break;
+      }
+    }
+    response[3] = pcpSuccess;
+    return size;
+  }
+
+  if (TakeFailure(externalPort, protoPcp)) {
+    response[3] = pcpNoResources;
+    return size;
+  }
+  int assigned = AssignPort(protocol, externalPort, internalIp, internalPort);
+  if (assigned == 0 || (preferFailure && assigned != externalPort)) {
+    response[3] = pcpCannotProvideExternal;
+    return size;
+  }
+  Mapping &mapping = mappings[std::make_pair(protocol, assigned)];
+  if (mapping.madeWith == protoPcp && mapping.nonce != nonce) {
+    // Someone else's, or made by the host before it forgot the nonce
+    response[3] = pcpNotAuthorized;
+    return size;
+  }
+  mapping = Mapping{ internalIp, internalPort, lifetime, protoPcp, nonce };
+
+  response[3] = pcpSuccess;
+  PutDword(&response[4], lifetime);
+  PutWord(&response[24 + 18], assigned);
+  memset(&response[24 + 20], 0, 16);
+  response[24 + 30] = 0xFF;
+  response[24 + 31] = 0xFF;
+  in_addr externalIp = Ip(settings.externalIp);
+  memcpy(&response[24 + 32], &externalIp, 4);
+  return size;
+}
+
+
+int FakeGateway::AnswerNatPmp(const BYTE *request, int len, const sockaddr_in &from,
+                              BYTE *response) {
+  if (!(settings.protocols & protoNatPmp) || (request[1] & 0x80)) {
+    return 0;
+  }
+
+  int opcode = request[1];
+  memset(response, 0, 16);
+  response[1] = static_cast<BYTE>(0x80 | opcode);
+  PutDword(&response[4], (GetTickCount() - startTick) / 1000);
+
+  if (opcode == 0) {
+    in_addr externalIp = Ip(settings.externalIp);
+    memcpy(&response[8], &externalIp, 4);
+    return 12;
+  }
+  if ((opcode != 1 && opcode != 2) || len < 12) {
+    PutWord(&response[2], pmpUnsuppOpcode);
+    return 8;
+  }
+
+  int   protocol     = (opcode == 1) ? IPPROTO_UDP : IPPROTO_TCP,
+        internalPort = GetWord(&request[4]),
+        externalPort = GetWord(&request[6]);
+  DWORD lifetime     = GetDword(&request[8]);
+  std::string internalIp = IpText(&from.sin_addr);
+  PutWord(&response[8], internalPort);
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (lifetime == 0) {
+    // Deletes the host's mapping of the internal port, or all of them for port 0
+    for (auto it = mappings.begin(); it != mappings.end(); ) {
+      if (it->first.first == protocol && it->second.internalIp == internalIp &&
+          (internalPort == 0 || it->second.internalPort == internalPort)) {
+        it = mappings.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+    return 16;
+  }
+
+  int assigned = 0;
+  if (TakeFailure(externalPort, protoNatPmp) ||
+      (assigned = AssignPort(protocol, externalPort, internalIp, internalPort)) == 0) {
+    PutWord(&response[2], pmpOutOfResources);
+    return 16;
+  }
+  mappings[std::make_pair(protocol, assigned)] =
+    Mapping{ internalIp, internalPort, lifetime, protoNatPmp };
+  PutWord(&response[10], assigned);
+  PutDword(&response[12], lifetime);
+  return 16;
+}
+
+
+std::vector<FakeGateway*> FakeGateway::AcquireDiscovered(const char *lanAddress) {
+  std::vector<FakeGateway*> found;
+  std::lock_guard<std::mutex> guard(RegistryLock());
+  for (auto *gateway : Registry()) {
+    if ((gateway->settings.protocols & protoUpnp) &&
+        (!lanAddress || gateway->settings.lanAddress == lanAddress)) {
+      ++gateway->users;
+      ++gateway->discoveries;
+      found.push_back(gateway);
+    }
+  }
+  return found;
+}
+
+
+FakeGateway* FakeGateway::AcquireByUrl(const char *url) {
+  std::lock_guard<std::mutex> guard(RegistryLock());
+  for (auto *gateway : Registry()) {
+    std::string prefix = "http://" + gateway->settings.address + ":" +
+                         std::to_string(upnpPort) + "/";
+    if ((gateway->settings.protocols & protoUpnp) && url &&
+        strncmp(url, prefix.c_str(), prefix.size()) == 0) {
+      ++gateway->users;
+      return gateway;
+    }
+  }
+  return nullptr;
+}
+
+
+void FakeGateway::Release() {
+  --users;
+}
+
+
+std::string FakeGateway::GetDescUrl() const {
+  return "http://" + settings.address + ":" + std::to_string(upnpPort) +
+         "/rootDesc.xml";
+}
+
+
+std::string FakeGateway::UpnpGetDescription() {
+  Sleep(settings.latencyMs);
+  const std::string udn = "uuid:fa4e0000-0000-4000-8000-" + settings.address;
+  return
+    "<?xml version=\"1.0\"?>\r\n"
+    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\"><specVersion><major>1</major>"
+    "<minor>0</minor></specVersion><device><deviceType>"
+    "urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>"
+    "<friendlyName>FakeGateway router</friendlyName><manufacturer>MiniUPnP"
+    "</manufacturer><manufacturerURL>http://miniupnp.free.fr/</manufacturerURL>"
+    "<modelDescription>FakeGateway router</modelDescription><modelName>"
+    "FakeGateway router</modelName><modelNumber>1</modelNumber><modelURL>"
+    "http://miniupnp.free.fr/</modelURL><serialNumber>00000000</serialNumber><UDN>" +
+    udn + "-1</UDN><serviceList><service><serviceType>"
+    "urn:schemas-upnp-org:service:Layer3Forwarding:1</serviceType><serviceId>"
+    "urn:upnp-org:serviceId:L3Forwarding1</serviceId><SCPDURL>/L3F.xml</SCPDURL>"
+    "<controlURL>/ctl/L3F</controlURL><eventSubURL>/evt/L3F</eventSubURL></service>"
+    "</serviceList><deviceList><device><deviceType>"
+    "urn:schemas-upnp-org:device:WANDevice:1</deviceType><friendlyName>WANDevice"
+    "</friendlyName><manufacturer>MiniUPnP</manufacturer><manufacturerURL>"
+    "http://miniupnp.free.fr/</manufacturerURL><modelDescription>WAN Device"
+    "</modelDescription><modelName>WAN Device</modelName><modelNumber>20230113"
+    "</modelNumber><modelURL>http://miniupnp.free.fr/</modelURL><serialNumber>"
+    "00000000</serialNumber><UDN>" + udn + "-2</UDN><UPC>000000000000</UPC>"
+    "<serviceList><service><serviceType>"
+    "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1</serviceType>"
+    "<serviceId>urn:upnp-org:serviceId:WANCommonIFC1</serviceId><SCPDURL>"
+    "/WANCfg.xml</SCPDURL><controlURL>/ctl/CmnIfCfg</controlURL><eventSubURL>"
+    "/evt/CmnIfCfg</eventSubURL></service></serviceList><deviceList><device>"
+    "<deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:1</deviceType>"
+    "<friendlyName>WANConnectionDevice</friendlyName><manufacturer>MiniUPnP"
+    "</manufacturer><manufacturerURL>http://miniupnp.free.fr/</manufacturerURL>"
+    "<modelDescription>MiniUPnP daemon</modelDescription><modelName>MiniUPnPd"
+    "</modelName><modelNumber>20230113</modelNumber><modelURL>"
+    "http://miniupnp.free.fr/</modelURL><serialNumber>00000000</serialNumber><UDN>" +
+    udn + "-3</UDN><UPC>000000000000</UPC><serviceList><service><serviceType>"
+    "urn:schemas-upnp-org:service:WANIPConnection:1</serviceType><serviceId>"
+    "urn:upnp-org:serviceId:WANIPConn1</serviceId><SCPDURL>/WANIPCn.xml</SCPDURL>"
+    "<controlURL>/ctl/IPConn</controlURL><eventSubURL>/evt/IPConn</eventSubURL>"
+    "</service></serviceList></device></deviceList></device></deviceList>"
+    "<presentationURL>http://" + settings.address + "/</presentationURL></device>"
+    "</root>";
+}
+
+
+int FakeGateway::UpnpGetExternalIp(char *externalIp) {
+  if (!BeginRequest(protoUpnp)) {
+    Sleep(settings.latencyMs);
+    return upnpActionFailed;
+  }
+  Sleep(settings.latencyMs);
+  strcpy(externalIp, settings.externalIp.c_str());
+  EndRequest();
+  return 0;
+}
+
+
+int FakeGateway::UpnpAddPortMapping(bool udp, int externalPort, int internalPort,
+                                    const char *internalIp, int leaseSec) {
+  if (!BeginRequest(protoUpnp)) {
+    Sleep(settings.latencyMs);
+    return upnpActionFailed;
+  }
+  Sleep(settings.latencyMs);
+
+  int result = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    int protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
+    if (TakeFailure(externalPort, protoUpnp) ||
+        AssignPort(protocol, externalPort, internalIp, internalPort) != externalPort) {
+      result = upnpConflict;
+    }
+    else {
+      mappings[std::make_pair(protocol, externalPort)] =
+        Mapping{ internalIp, internalPort, static_cast<DWORD>(leaseSec), protoUpnp };
+    }
+  }
+  EndRequest();
+  return result;
+}
+
+
+int FakeGateway::UpnpDeletePortMapping(bool udp, int externalPort) {
+  if (!BeginRequest(protoUpnp)) {
+    Sleep(settings.latencyMs);
+    return upnpActionFailed;
+  }
+  Sleep(settings.latencyMs);
+
+  size_t erased;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    erased = mappings.erase(std::make_pair(udp ? IPPROTO_UDP : IPPROTO_TCP,
+                                           externalPort));
+  }
+  EndRequest();
+  return erased ? 0 : upnpNoSuchEntry;
+}
@@ -0,0 +1,121 @@
+
+#ifndef FAKEGATEWAY_H
+#define FAKEGATEWAY_H
+
+// Home routers on loopback for port forwarding to find, each on its own address
+// such as 127.0.1.1: a PCP and NAT-PMP server on UDP port 5351, and a UPnP IGD that
+// the miniupnpc stand-in calls in process. Tests describe the host's side of each
+// LAN to the IP helper shim, with the router's address as the adapter's gateway.
+
+#include <winsock2.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class FakeGateway {
+public:
+  enum Protocol {
+    protoPcp    = 1,
+    protoNatPmp = 2,
+    protoUpnp   = 4,
+    protoAll    = protoPcp | protoNatPmp | protoUpnp
+  };
+
+  struct Settings {
+    std::string address    = "127.0.1.1";
+    std::string lanAddress = "127.0.1.10";  // The host's, as UPnP discovery finds it
+    std::string externalIp = "203.0.113.1";
+    int  protocols = protoAll;
+    bool dropsPcp  = false;  // Without PCP, ignore its requests instead of answering
+                             // them as a NAT-PMP server should
+    int  latencyMs = 0;      // Before each answer
+    int  capacity  = 0;      // Requests worked on at once, or 0 for no limit. PCP
+                             // and NAT-PMP requests beyond it are dropped, and UPnP
+                             // ones fail with 501 Action Failed.
+  };
+
+  struct Mapping {
+    std::string internalIp;
+    int         internalPort;
+    DWORD       lifetime;  // 0 for a static UPnP mapping
+    Protocol    madeWith;
+    std::string nonce;     // PCP's, which requests for the mapping must repeat
+  };
+
+  explicit FakeGateway(const Settings &settings);
+  ~FakeGateway();
+
+  bool IsRunning() const { return running; }
+  const Settings& GetSettings() const { return settings; }
+
+  // Makes the next requests to map the external port through the given protocols
+  // fail, or all of them if times is negative. PCP answers NO_RESOURCES, NAT-PMP
+  // out of resources, and UPnP 718 ConflictInMappingEntry.
+  void FailPort(int port, int times = -1, int protocols = protoAll);
+
+  bool   FindMapping(bool udp, int externalPort, Mapping *mapping = nullptr);
+  size_t CountMappings();
+
+  // Requests received through the given protocols, including dropped ones
+  int GetRequests(int protocols = protoAll);
+  int GetDropped() { return dropped; }
+  int GetDiscoveries() { return discoveries; }
+  int GetMaxInFlight() { return maxInFlight; }  // Most requests worked on at once
+  // Most gateways that were working on requests at the same time
+  static int GetMaxBusyGateways() { return maxBusy; }
+  static void ResetMaxBusyGateways() { maxBusy = busy.load(); }
+
+  // The UPnP side, for the miniupnpc stand-in. Each action takes the latency.
+  // Gateways are returned acquired, and must be released after use.
+  static std::vector<FakeGateway*> AcquireDiscovered(const char *lanAddress);
+  static FakeGateway* AcquireByUrl(const char *url);
+  void Release();
+
+  std::string GetDescUrl() const;
+  // The device description at GetDescUrl, as miniupnpd words it
+  std::string UpnpGetDescription();
+  int UpnpGetExternalIp(char *externalIp);
+  int UpnpAddPortMapping(bool udp, int externalPort, int internalPort,
+                         const char *internalIp, int leaseSec);
+  int UpnpDeletePortMapping(bool udp, int externalPort);
+
+private:
+  struct Answer;
+
+  void Serve();
+  int  AnswerPcp(const BYTE *request, int len, const sockaddr_in &from,
+                 BYTE *response);
+  int  AnswerNatPmp(const BYTE *request, int len, const sockaddr_in &from,
+                    BYTE *response);
+  bool TakeFailure(int port, Protocol protocol);
+  int  AssignPort(int protocol, int externalPort, const std::string &internalIp,
+                  int internalPort);
+  bool BeginRequest(Protocol protocol);
+  void EndRequest();
+
+  Settings          settings;
+  SOCKET            s;
+  std::atomic<bool> running;
+  std::thread       thread;
+  DWORD             startTick;
+
+  std::mutex lock;
+  std::map<std::pair<int, int>, Mapping> mappings;  // By protocol and external port
+  std::map<int, std::pair<int, int>>     failures;  // By port: times and protocols
+
+  std::atomic<int> requests[3],
+                   dropped,
+                   discoveries,
+                   inFlight,
+                   maxInFlight,
+                   users;  // Stand-in calls holding it
+
+  static std::atomic<int> busy,
+                          maxBusy;
+};
+
+#endif
@@ -0,0 +1,251 @@
+// Tests port forwarding end to end, from InitMod to DestroyMod, through routers
+// simulated on loopback: each adapter of the network described to the IP helper
+// shim has a FakeGateway as its gateway. Failures injected on single ports show
+// that only those are retried, and fall back, while the others stay mapped.
+
+#include "Test.h"
+#include <functional>
+#include <memory>
+#include <vector>
+#include "FakeGateway.h"
+#include "MainStandIns.h"
+#include "Netlink.h"
+
+extern "C" void InitMod(char *iniSectionName);
+extern "C" bool DestroyMod();
+
+static const int firstPort = 47776,
+                 numPorts  = 8;
+
+
+// Adds an adapter at 127.0.<net>.10/24 whose default route goes through
+// 127.0.<net>.1, and a gateway there if protocols isn't 0
+static std::unique_ptr<FakeGateway> AddNetwork(Netlink &netlink, int index, int net,
+                                               int metric, int protocols,
+                                               int latencyMs = 0) {
+  std::string prefix = "127.0." + std::to_string(net) + ".",
+              name   = "eth" + std::to_string(index);
+  netlink.Link(index, name.c_str(), true)
+         .Address(index, (prefix + "10").c_str(), 24)
+         .DefaultRoute(index, (prefix + "1").c_str(), metric);
+  if (protocols == 0) {
+    return nullptr;
+  }
+
+  FakeGateway::Settings settings;
+  settings.address    = prefix + "1";
+  settings.lanAddress = prefix + "10";
+  settings.externalIp = "203.0.113." + std::to_string(net);
+  settings.protocols  = protocols;
+  settings.latencyMs  = latencyMs;
+  return std::unique_ptr<FakeGateway>(new FakeGateway(settings));
+}
+
+
+static Config ForwardingConfig(bool allGateways) {
+  Config config = StandIns::DefaultConfig();
+  config.forwardMode        = 1;
+  config.bindAll            = true;
+  config.forwardAllGateways = allGateways;
+  config.startPort          = firstPort;
+  config.endPort            = firstPort + numPorts - 1;
+  return config;
+}
+
+
+static bool WaitFor(const std::function<bool()> &condition, DWORD timeoutMs = 5000) {
+  for (DWORD start = GetTickCount(); !condition(); Sleep(10)) {
+    if (GetTickCount() - start > timeoutMs) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static bool HasAllPorts(FakeGateway &gateway) {
+  for (int port = firstPort; port < firstPort + numPorts; ++port) {
+    if (!gateway.FindMapping(true, port)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+TEST(ForwardsThroughEveryGatewayAtOnce) {
+  ShimResetNetwork();
+  Netlink netlink;
+  auto pcp    = AddNetwork(netlink, 2, 11, 100, FakeGateway::protoPcp, 20),
+       natPmp = AddNetwork(netlink, 3, 12, 600, FakeGateway::protoNatPmp, 20),
+       upnp   = AddNetwork(netlink, 4, 13, 700, FakeGateway::protoUpnp, 20);
+  REQUIRE(netlink.Apply());
+  REQUIRE(pcp->IsRunning() && natPmp->IsRunning() && upnp->IsRunning());
+  FakeGateway::ResetMaxBusyGateways();
+
+  StandIns::SetConfig(ForwardingConfig(true));
+  InitMod(const_cast<char*>("NetHelper"));
+
+  // Each through the protocol its gateway speaks, for the host's address there
+  CHECK(WaitFor([&]() { return HasAllPorts(*pcp) && HasAllPorts(*natPmp) &&
+                               HasAllPorts(*upnp); }));
+  FakeGateway::Mapping mapping;
+  REQUIRE(pcp->FindMapping(true, firstPort, &mapping));
+  CHECK(mapping.madeWith == FakeGateway::protoPcp);
+  REQUIRE(natPmp->FindMapping(true, firstPort, &mapping));
+  CHECK(mapping.madeWith == FakeGateway::protoNatPmp);
+  REQUIRE(upnp->FindMapping(true, firstPort, &mapping));
+  CHECK(mapping.madeWith == FakeGateway::protoUpnp);
+  CHECK(mapping.internalIp == "127.0.13.10");
+  CHECK(FakeGateway::GetMaxBusyGateways() >= 2);
+
+  // The game shows the primary gateway's external address
+  CHECK(WaitFor([]() {
+    return StandIns::GetDisplayedExternalIp() == "203.0.113.11";
+  }));
+
+  CHECK(DestroyMod());
+  CHECK(pcp->CountMappings() == 0);
+  CHECK(natPmp->CountMappings() == 0);
+  CHECK(upnp->CountMappings() == 0);
+}
+
+
+TEST(ForwardsOnlyThroughTheBestGatewayByDefault) {
+  ShimResetNetwork();
+  Netlink netlink;
+  auto best  = AddNetwork(netlink, 2, 21, 100, FakeGateway::protoAll),
+       other = AddNetwork(netlink, 3, 22, 600, FakeGateway::protoAll);
+  REQUIRE(netlink.Apply());
+
+  StandIns::SetConfig(ForwardingConfig(false));
+  InitMod(const_cast<char*>("NetHelper"));
+
+  CHECK(WaitFor([&]() { return HasAllPorts(*best); }));
+  CHECK(other->GetRequests() == 0);
+  CHECK(DestroyMod());
+  CHECK(best->CountMappings() == 0);
+}
+
+
+TEST(ForwardsOnceThroughAGatewaySharedByAdapters) {
+  ShimResetNetwork();
+  Netlink netlink;
+  auto shared = AddNetwork(netlink, 2, 31, 100, FakeGateway::protoPcp);
+  // Wi-Fi on the same LAN as the wired adapter
+  netlink.Link(3, "wlan0", true)
+         .Address(3, "127.0.31.11", 24)
+         .DefaultRoute(3, "127.0.31.1", 600);
+  REQUIRE(netlink.Apply());
+
+  StandIns::SetConfig(ForwardingConfig(true));
+  InitMod(const_cast<char*>("NetHelper"));
+
+  CHECK(WaitFor([&]() { return HasAllPorts(*shared); }));
+  // One probe and one request per port, give or take a retransmission
+  CHECK(shared->GetRequests() < 2 * numPorts);
+  CHECK(DestroyMod());
+}
+
+
+TEST(UnforwardsAGatewayThatGoesAway) {
+  ShimResetNetwork();
+  Netlink netlink;
+  auto wired = AddNetwork(netlink, 2, 41, 100, FakeGateway::protoPcp),
+       wifi  = AddNetwork(netlink, 3, 42, 600, FakeGateway::protoUpnp);
+  REQUIRE(netlink.Apply());
+
+  StandIns::SetConfig(ForwardingConfig(true));
+  InitMod(const_cast<char*>("NetHelper"));
+  REQUIRE(WaitFor([&]() { return HasAllPorts(*wired) && HasAllPorts(*wifi); }));
+
+  // Redone once the notifications settle, which takes 2 seconds
+  REQUIRE(Netlink().Link(3, "wlan0", false).Apply());
+  CHECK(WaitFor([&]() { return wifi->CountMappings() == 0; }));
+  CHECK(HasAllPorts(*wired));
+  CHECK(DestroyMod());
+  CHECK(wired->CountMappings() == 0);
+}
+
+
+TEST(RetriesOnlyTheFailedPortWithBackoff) {
+  ShimResetNetwork();
+  Netlink netlink;
+  auto gateway = AddNetwork(netlink, 2, 51, 100, FakeGateway::protoPcp);
+  REQUIRE(netlink.Apply());
+  gateway->FailPort(firstPort + 3, 2);
+
+  StandIns::SetConfig(ForwardingConfig(true));
+  DWORD start = GetTickCount();
+  InitMod(const_cast<char*>("NetHelper"));
+
+  // The others are mapped at once, without waiting for it
+  CHECK(WaitFor([&]() {
+    for (int port = firstPort; port < firstPort + numPorts; ++port) {
+      if (port != firstPort + 3 && !gateway->FindMapping(true, port)) {
+        return false;
+      }
+    }
+    return true;
+  }, 200));
+  CHECK(!gateway->FindMapping(true, firstPort + 3));
+
+  // Then it is, after backing off 250 ms and 500 ms, plus jitter
+  CHECK(WaitFor([&]() { return HasAllPorts(*gateway); }));
+  DWORD elapsed = GetTickCount() - start;
+  CHECK(elapsed >= 750 && elapsed < 1200);
+  // One probe, a request per port, and the two retries
+  CHECK(gateway->GetRequests() < numPorts + 4);
+  CHECK(DestroyMod());
+  CHECK(gateway->CountMappings() == 0);
+}
+
+
+TEST(FallsBackToUpnpOnlyForPortsThatFailed) {
+  ShimResetNetwork();
+  Netlink netlink;
+  auto gateway = AddNetwork(netlink, 2, 52, 100,
+                            FakeGateway::protoPcp | FakeGateway::protoUpnp);
+  REQUIRE(netlink.Apply());
+  gateway->FailPort(firstPort + 5, -1, FakeGateway::protoPcp);
+
+  StandIns::SetConfig(ForwardingConfig(true));
+  InitMod(const_cast<char*>("NetHelper"));
+
+  // Out of PCP attempts, it is mapped through UPnP, and the others stay as they are
+  CHECK(WaitFor([&]() { return HasAllPorts(*gateway); }));
+  FakeGateway::Mapping mapping;
+  for (int port = firstPort; port < firstPort + numPorts; ++port) {
+    REQUIRE(gateway->FindMapping(true, port, &mapping));
+    CHECK(mapping.madeWith == ((port == firstPort + 5) ? FakeGateway::protoUpnp :
+                                                         FakeGateway::protoPcp));
+  }
+  CHECK(gateway->GetRequests(FakeGateway::protoPcp) < numPorts + 4);
+
+  // Each is unforwarded through the protocol that mapped it
+  CHECK(DestroyMod());
+  CHECK(gateway->CountMappings() == 0);
+}
+
+
+TEST(GivesUpOnAPortThatAlwaysFails) {
+  ShimResetNetwork();
+  Netlink netlink;
+  auto gateway = AddNetwork(netlink, 2, 53, 100, FakeGateway::protoUpnp);
+  REQUIRE(netlink.Apply());
+  gateway->FailPort(firstPort);
+
+  StandIns::SetConfig(ForwardingConfig(true));
+  InitMod(const_cast<char*>("NetHelper"));
+
+  // Three attempts with a lease, and three without, after which it stops asking
+  CHECK(WaitFor([&]() { return gateway->CountMappings() == numPorts - 1; }));
+  Sleep(4000);
+  int requests = gateway->GetRequests();
+  Sleep(1000);
+  CHECK(gateway->GetRequests() == requests);
+  CHECK(!gateway->FindMapping(true, firstPort));
+  CHECK(gateway->CountMappings() == numPorts - 1);
+  CHECK(DestroyMod());
+  CHECK(gateway->CountMappings() == 0);
+}
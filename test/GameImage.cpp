@@ -0,0 +1,259 @@
+// Builds, relocates, and maps the synthetic game image
+
+#include "GameImage.h"
+#include "Patcher.h"
+#include "Shim.h"
+#include <string.h>
+#include <algorithm>
+#include <initializer_list>
+
+namespace {
+
+// Section layout, as RVAs
+const DWORD headersSize = 0x1000,
+            textBegin   = 0x1000,   textEnd  = 0xC6000,
+            rdataBegin  = 0xC6000,  rdataEnd = 0xDE000,
+            dataBegin   = 0xDE000,  dataEnd  = 0xEE000,
+            relocBegin  = 0xEE000,  relocEnd = 0xEF000,
+            imageSize   = relocEnd;
+
+const DWORD bindImportSlot = 0xC6000;  // Where the bind thunk jumps through
+
+const DWORD firstTimeDateStamp = 0x4E1B8A00;
+
+const uintptr_t otherVirtuals[] = { 0x491380, 0x4913C0, 0x491440 };
+
+// Everything a loader needs to know about each section
+const struct {
+  char  name[8];
+  DWORD begin,
+        end,
+        characteristics,
+        protect;
+} sections[] = {
+  { ".text",  textBegin,  textEnd,
+    IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ,
+    PAGE_EXECUTE_READ },
+  { ".rdata", rdataBegin, rdataEnd,
+    IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ,
+    PAGE_READONLY },
+  { ".data",  dataBegin,  dataEnd,
+    IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE,
+    PAGE_READWRITE },
+  { ".reloc", relocBegin, relocEnd,
+    IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ,
+    PAGE_READONLY }
+};
+
+// The image as the linker would have written it, before it is mapped
+class Builder {
+public:
+  // Code between functions is int 3 padding
+  Builder() : image(imageSize, 0) {
+    memset(&image[textBegin], 0xCC, textEnd - textBegin);
+  }
+
+  BYTE* At(uintptr_t address) { return &image[address - GameImage::preferredBase]; }
+
+  void Code(uintptr_t address, std::initializer_list<BYTE> bytes) {
+    memcpy(At(address), bytes.begin(), bytes.size());
+  }
+  void Rel32(uintptr_t address, uintptr_t target) {
+    auto displacement = static_cast<INT32>(target - (address + 4));
+    memcpy(At(address), &displacement, sizeof(displacement));
+  }
+
+  // An absolute pointer, which needs a base relocation
+  void Pointer(uintptr_t address, uintptr_t target) {
+    ULONGLONG value = target;
+    memcpy(At(address), &value, sizeof(value));
+    relocations.push_back(static_cast<DWORD>(address - GameImage::preferredBase));
+  }
+
+  std::vector<BYTE> Finish(DWORD timeDateStamp);
+
+  std::vector<BYTE> image;
+  std::vector<DWORD> relocations;
+};
+
+} // anonymous namespace
+
+static uintptr_t imageBase = 0;
+static DWORD     loads     = 0;
+
+
+// Writes the base relocation table and the headers
+std::vector<BYTE> Builder::Finish(DWORD timeDateStamp) {
+  // One block per page, each padded to a multiple of 4 bytes
+  std::sort(relocations.begin(), relocations.end());
+  DWORD offset = relocBegin;
+  for (size_t i = 0; i < relocations.size();) {
+    DWORD page = relocations[i] & ~0xFFFu;
+    size_t end = i;
+    while (end < relocations.size() && (relocations[end] & ~0xFFFu) == page) {
+      ++end;
+    }
+
+    IMAGE_BASE_RELOCATION block = { page, static_cast<DWORD>(
+      sizeof(block) + ((end - i + 1) & ~size_t(1)) * sizeof(WORD)) };
+    memcpy(&image[offset], &block, sizeof(block));
+    auto *entries = &image[offset + sizeof(block)];
+    for (size_t j = i; j < end; ++j, entries += sizeof(WORD)) {
+      WORD entry = static_cast<WORD>((IMAGE_REL_BASED_DIR64 << 12) |
+                                     (relocations[j] & 0xFFF));
+      memcpy(entries, &entry, sizeof(entry));
+    }
+    offset += block.SizeOfBlock;
+    i = end;
+  }
+
+  auto *dos = reinterpret_cast<IMAGE_DOS_HEADER*>(&image[0]);
+  dos->e_magic  = IMAGE_DOS_SIGNATURE;
+  dos->e_lfanew = 0x80;
+
+  auto *nt = reinterpret_cast<IMAGE_NT_HEADERS64*>(&image[dos->e_lfanew]);
+  nt->Signature                      = IMAGE_NT_SIGNATURE;
+  nt->FileHeader.Machine             = IMAGE_FILE_MACHINE_AMD64;
+  nt->FileHeader.NumberOfSections    = _countof(sections);
+  nt->FileHeader.TimeDateStamp       = timeDateStamp;
+  nt->FileHeader.SizeOfOptionalHeader = sizeof(nt->OptionalHeader);
+  nt->FileHeader.Characteristics     = 0x0022;  // Executable, large address aware
+
+  IMAGE_OPTIONAL_HEADER64 &optional = nt->OptionalHeader;
+  optional.Magic               = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+  optional.SizeOfCode          = textEnd - textBegin;
+  optional.BaseOfCode          = textBegin;
+  optional.ImageBase           = GameImage::preferredBase;
+  optional.SectionAlignment    = 0x1000;
+  optional.FileAlignment       = 0x200;
+  optional.SizeOfImage         = imageSize;
+  optional.SizeOfHeaders       = headersSize;
+  optional.NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+  optional.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress = relocBegin;
+  optional.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size = offset - relocBegin;
+
+  IMAGE_SECTION_HEADER *section = IMAGE_FIRST_SECTION(nt);
+  for (const auto &source : sections) {
+    memcpy(section->Name, source.name, sizeof(section->Name));
+    section->Misc.VirtualSize = source.end - source.begin;
+    section->VirtualAddress   = source.begin;
+    section->SizeOfRawData    = source.end - source.begin;
+    section->Characteristics  = source.characteristics;
+    ++section;
+  }
+
+  return std::move(image);
+}
+
+
+// Finds free address space near this program's code, so rel32 calls from the image
+// reach it, and hooks in the image can jump to the test's functions directly
+static uintptr_t FindImageBase() {
+  const uintptr_t step = 0x4000000;  // 64 MB
+  auto code = reinterpret_cast<uintptr_t>(&FindImageBase) & ~uintptr_t(0xFFFF);
+  for (uintptr_t distance = step * 4; distance < 0x60000000; distance += step) {
+    for (uintptr_t candidate : { code - distance, code + distance }) {
+      void *memory = VirtualAlloc(reinterpret_cast<void*>(candidate), imageSize,
+                                  MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+      if (memory) {
+        VirtualFree(memory, 0, MEM_RELEASE);
+        if (candidate != GameImage::preferredBase) {
+          return candidate;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+
+HMODULE GameImage::Load(const Layout &layout, const void *bindFunction) {
+  Builder builder;
+
+  // Each bind call site is in "sub rsp, 8; call bind; add rsp, 8; ret"
+  for (uintptr_t site : bindCalls) {
+    site += layout.bindShift;
+    builder.Code(site - 4, { 0x48, 0x83, 0xEC, 0x08, 0xE8 });
+    builder.Rel32(site + 1, bindThunk + layout.bindShift);
+    builder.Code(site + 5, { 0x48, 0x83, 0xC4, 0x08, 0xC3 });
+  }
+  // jmp qword ptr [bindImportSlot]
+  uintptr_t thunk = bindThunk + layout.bindShift;
+  builder.Code(thunk, { 0xFF, 0x25 });
+  builder.Rel32(thunk + 2, preferredBase + bindImportSlot);
+  builder.Code(thunk + 6, { 0xCC, 0xCC });
+
+  // mov byte ptr [rsi], 'A'; mov byte ptr [rsi+1], 0; mov al, 1; ret
+  builder.Code(getIp, { 0xC6, 0x06, 0x41, 0xC6, 0x46, 0x01, 0x00, 0xB0, 0x01, 0xC3 });
+  for (uintptr_t function : otherVirtuals) {
+    builder.Code(function, { 0x31, 0xC0, 0xC3 });  // xor eax, eax; ret
+  }
+  builder.Pointer(getIpVftable,      otherVirtuals[0]);
+  builder.Pointer(getIpVftable + 8,  otherVirtuals[1]);
+  builder.Pointer(getIpVftable + 16, getIp);
+  builder.Pointer(getIpVftable + 24, otherVirtuals[2]);
+
+  static const char message[] = "Your local IP address is %s.";
+  memcpy(builder.At(ipMessage), message, sizeof(message));
+  builder.Pointer(layout.ipMessagePtr, ipMessage);
+
+  for (int i = 0; i < numGlobalReferences; ++i) {
+    builder.Pointer(globalReferences + i * sizeof(ULONGLONG), globalObject);
+  }
+
+  std::vector<BYTE> image = builder.Finish(firstTimeDateStamp + loads++);
+
+  if (!imageBase && !(imageBase = FindImageBase())) {
+    return nullptr;
+  }
+  auto *base = static_cast<BYTE*>(VirtualAlloc(reinterpret_cast<void*>(imageBase),
+                                               imageSize, MEM_RESERVE | MEM_COMMIT,
+                                               PAGE_READWRITE));
+  if (!base) {
+    return nullptr;
+  }
+  memcpy(base, image.data(), image.size());
+
+  // Load it as the loader would: relocate, bind the import, and protect sections
+  auto delta = imageBase - preferredBase;
+  for (DWORD rva : builder.relocations) {
+    ULONGLONG value;
+    memcpy(&value, base + rva, sizeof(value));
+    value += delta;
+    memcpy(base + rva, &value, sizeof(value));
+  }
+  memcpy(base + bindImportSlot, &bindFunction, sizeof(bindFunction));
+
+  DWORD oldProtect;
+  VirtualProtect(base, headersSize, PAGE_READONLY, &oldProtect);
+  for (const auto &section : sections) {
+    VirtualProtect(base + section.begin, section.end - section.begin, section.protect,
+                   &oldProtect);
+  }
+
+  auto module = reinterpret_cast<HMODULE>(base);
+  ShimAddModule(module, imageSize, "Outpost2.exe");
+  Patcher::SetBaseModule(module);
+  return module;
+}
+
+
+void GameImage::Unload(HMODULE image) {
+  Patcher::SetBaseModule(nullptr);
+  ShimRemoveModule(image);
+  VirtualFree(image, 0, MEM_RELEASE);
+}
+
+
+std::vector<BYTE> GameImage::Snapshot(HMODULE image) {
+  auto *begin = reinterpret_cast<const BYTE*>(image);
+  return std::vector<BYTE>(begin, begin + imageSize);
+}
+
+
+int GameImage::CallBindSite(uintptr_t site, SOCKET s, sockaddr_in *name,
+                            int nameLen) {
+  auto *function = reinterpret_cast<int (*)(SOCKET, sockaddr_in*, int)>(
+    Patcher::FixPtr(site - 4));
+  return function(s, name, nameLen);
+}
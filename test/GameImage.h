@@ -0,0 +1,60 @@
+
+#ifndef GAMEIMAGE_H
+#define GAMEIMAGE_H
+
+// A synthetic stand-in for Outpost2.exe, with code and data at the addresses
+// NetPatches patches. It is a PE32+ image, as the tests run on x86-64 only, but
+// keeps the game's preferred base and layout, so the patches' addresses and
+// manifests apply to it unchanged.
+
+#include <winsock2.h>
+#include <vector>
+
+namespace GameImage {
+
+const uintptr_t preferredBase = 0x400000;
+
+// The transport's bind() call sites, each in a function that calls bind() with its
+// arguments and returns its result, and the import thunk they call
+const uintptr_t bindCalls[] = { 0x48C0FE, 0x48C12B, 0x48C700, 0x49165C, 0x495F69,
+                                0x4960F5, 0x4964DA };
+const uintptr_t bindThunk   = 0x4C0E40;
+
+// The vftable with the get-address function, which writes "A" and returns true
+const uintptr_t getIpVftable = 0x4D64F8;
+const uintptr_t getIp        = 0x491400;
+
+// The local IP address message, and the known location of the pointer to it
+const uintptr_t ipMessage    = 0x4D8000;
+const uintptr_t ipMessagePtr = 0x4E9220;
+
+// A global in .data, and a table in .rdata of pointers to it, each with a base
+// relocation, for PatchGlobalReferences to find
+const uintptr_t globalObject        = 0x4E2000;
+const uintptr_t globalReferences    = 0x4DA000;
+const int       numGlobalReferences = 64;
+
+// What can differ between builds of the game
+struct Layout {
+  uintptr_t bindShift;     // Added to the bind call sites and thunk
+  uintptr_t ipMessagePtr;  // Where the pointer to the IP message is
+};
+const Layout gameLayout = { 0, ipMessagePtr };
+
+// Maps the image near this program's code, relocated from preferredBase, with its
+// bind thunk jumping to bindFunction. It is made known as the loaded Outpost2.exe
+// and set as the patcher's base module. The image is always mapped at the same
+// base, as NetHelper keeps pointers it fixed up. Each load counts as a new build
+// for signature caches.
+HMODULE Load(const Layout &layout, const void *bindFunction);
+void    Unload(HMODULE image);
+
+// Returns a copy of the mapped image, to compare against after patches revert
+std::vector<BYTE> Snapshot(HMODULE image);
+
+// Calls the function around the bind call site at the preferred address
+int CallBindSite(uintptr_t site, SOCKET s, sockaddr_in *name, int nameLen);
+
+} // namespace GameImage
+
+#endif
@@ -0,0 +1,318 @@
+// Tests the host advisor against simulated players on loopback, each behind a delay
+// line that holds its answers for the link's round trip time, and reporting its own
+// RTTs to the other players as NetHelper does: the advised host, the RTTs it
+// measured itself, and reports from peers that didn't negotiate probing. Peers'
+// capabilities stand in for the handshake's.
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Handshake.h"
+#include "HostAdvisor.h"
+#include "NetStats.h"
+#include "PeerTable.h"
+
+static WORD capabilities[PeerTable::MaxPeers] = {};
+
+WORD GetPeerCapabilities(int peerId) {
+  return (peerId >= 0 && peerId < PeerTable::MaxPeers) ? capabilities[peerId] : 0;
+}
+
+
+namespace {
+
+#pragma pack(push, 1)
+// HostAdvisor.cpp's wire format
+struct Probe {
+  ControlHeader header;
+  DWORD         nodeId;
+  LONGLONG      sendCounter;
+};
+
+struct ReportEntry {
+  DWORD nodeId;
+  DWORD address;
+  WORD  port;
+  WORD  lossPermille;
+  DWORD rttUs;
+  DWORD jitterUs;
+};
+#pragma pack(pop)
+
+sockaddr_in Address(const char *ip, int port) {
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port   = htons(port);
+  inet_pton(AF_INET, ip, &address.sin_addr);
+  return address;
+}
+
+
+SOCKET Bind(const sockaddr_in &address) {
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (s != INVALID_SOCKET &&
+      bind(s, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+  return s;
+}
+
+
+// Waits up to timeoutMs for a datagram. Returns its length, or -1.
+int Receive(SOCKET s, int timeoutMs, char *buf, int len, sockaddr_in *from) {
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(s, &fds);
+  timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+  if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) <= 0) {
+    return -1;
+  }
+  int fromLen = sizeof(*from);
+  return recvfrom(s, buf, len, 0, reinterpret_cast<sockaddr*>(from), &fromLen);
+}
+
+
+// Sends datagrams once they have been held for the link's delay
+class DelayLine {
+public:
+  DelayLine(SOCKET s, DWORD delayMs) : s(s), delayMs(delayMs) {}
+
+  void Hold(const char *buf, int len, const sockaddr_in &to) {
+    std::lock_guard<std::mutex> lock(mutex);
+    held.push_back({ GetTickCount() + delayMs, std::vector<char>(buf, buf + len), to });
+  }
+
+  // Sends what is due. Returns the milliseconds until the next is.
+  DWORD Release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    DWORD now = GetTickCount();
+    while (!held.empty() && static_cast<LONG>(held.front().due - now) <= 0) {
+      Datagram &datagram = held.front();
+      sendto(s, datagram.data.data(), static_cast<int>(datagram.data.size()), 0,
+             reinterpret_cast<const sockaddr*>(&datagram.to), sizeof(datagram.to));
+      held.pop_front();
+    }
+    return held.empty() ? 20 : held.front().due - now;
+  }
+
+private:
+  struct Datagram {
+    DWORD             due;
+    std::vector<char> data;
+    sockaddr_in       to;
+  };
+
+  SOCKET               s;
+  DWORD                delayMs;
+  std::mutex           mutex;
+  std::deque<Datagram> held;
+};
+
+
+// A NetHelper player in the lobby. It echoes the advisor's probes after its RTT
+// to this computer, and reports the RTTs it has to the other players.
+class Player {
+public:
+  Player(const char *ip, DWORD nodeId, DWORD rttMs, bool negotiated = true)
+    : address(Address(ip, 47777)), nodeId(nodeId), stopping(false),
+      s(Bind(address)), delay(s, rttMs) {
+    sockaddr_in game = address;
+    peerId = PeerTable::GetPeerId(reinterpret_cast<sockaddr*>(&game), sizeof(game));
+    if (peerId >= 0) {
+      capabilities[peerId] = negotiated ? capProbe : 0;
+    }
+  }
+  ~Player() { Stop(); closesocket(s); }
+
+  void ReportRtt(const Player &other, DWORD rttMs) {
+    rttsMs[&other] = rttMs;
+  }
+
+  // Serves probes, and reports every 500 ms to the game at the given address
+  void Start(const sockaddr_in &game) {
+    thread = std::thread([this, game] { Serve(game); });
+  }
+
+  void Stop() {
+    stopping = true;
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  sockaddr_in address;
+  DWORD       nodeId;
+  int         peerId;
+
+private:
+  void Serve(const sockaddr_in &game) {
+    DWORD lastReport = GetTickCount();
+    while (!stopping) {
+      DWORD waitMs = delay.Release();
+      char buf[1500];
+      sockaddr_in from;
+      int len = Receive(s, (waitMs < 20) ? waitMs : 20, buf, sizeof(buf), &from);
+      if (len == sizeof(Probe)) {
+        Probe probe;
+        memcpy(&probe, buf, sizeof(probe));
+        if (probe.header.magic == controlMagic && probe.header.type == ctlProbe) {
+          probe.header.type = ctlProbeReply;
+          probe.nodeId      = nodeId;
+          delay.Hold(reinterpret_cast<char*>(&probe), sizeof(probe), from);
+        }
+      }
+      if (GetTickCount() - lastReport >= 500) {
+        SendReport(game);
+        lastReport = GetTickCount();
+      }
+    }
+  }
+
+  void SendReport(const sockaddr_in &game) {
+    char packet[sizeof(ControlHeader) + sizeof(DWORD) + 8 * sizeof(ReportEntry)];
+    ControlHeader header = { controlMagic, ctlProbeReport, controlVersion,
+                             static_cast<WORD>(rttsMs.size()) };
+    memcpy(packet, &header, sizeof(header));
+    memcpy(packet + sizeof(header), &nodeId, sizeof(nodeId));
+    auto *entry = reinterpret_cast<ReportEntry*>(packet + sizeof(header) +
+                                                 sizeof(nodeId));
+    for (auto &rtt : rttsMs) {
+      *entry++ = { rtt.first->nodeId, rtt.first->address.sin_addr.s_addr,
+                   rtt.first->address.sin_port, 0, rtt.second * 1000, 0 };
+    }
+    int len = static_cast<int>(reinterpret_cast<char*>(entry) - packet);
+    sendto(s, packet, len, 0, reinterpret_cast<const sockaddr*>(&game), sizeof(game));
+  }
+
+  std::atomic<bool>            stopping;
+  SOCKET                       s;
+  DelayLine                    delay;
+  std::map<const Player*, DWORD> rttsMs;
+  std::thread                  thread;
+};
+
+
+// The game's socket, whose receive hook hands control messages to the advisor
+class Game {
+public:
+  explicit Game(const char *ip) : address(Address(ip, 47777)), stopping(false) {
+    s = Bind(address);
+    HostAdvisorOnSend(s);
+    thread = std::thread([this] { Receive(); });
+  }
+  ~Game() {
+    stopping = true;
+    thread.join();
+    closesocket(s);
+  }
+
+  sockaddr_in address;
+
+private:
+  void Receive() {
+    while (!stopping) {
+      char buf[1500];
+      sockaddr_in from;
+      int len = ::Receive(s, 20, buf, sizeof(buf), &from);
+      if (len >= static_cast<int>(sizeof(ControlHeader)) &&
+          reinterpret_cast<ControlHeader*>(buf)->magic == controlMagic) {
+        auto *address = reinterpret_cast<sockaddr*>(&from);
+        HostAdvisorOnControl(s, buf, len, address, sizeof(from),
+                             PeerTable::FindPeerId(address, sizeof(from)));
+      }
+    }
+  }
+
+  SOCKET            s;
+  std::atomic<bool> stopping;
+  std::thread       thread;
+};
+
+} // anonymous namespace
+
+
+// Advice comes with the fifth burst of probes, a second apart
+static bool WaitForAdvice(HostAdvice *advice) {
+  DWORD start = GetTickCount();
+  while (!GetHostAdvice(advice) && GetTickCount() - start < 8000) {
+    Sleep(50);
+  }
+  return GetHostAdvice(advice);
+}
+
+
+TEST(AdvisesThePlayerWhoseSlowestLinkIsFastest) {
+  REQUIRE(StartNetStats());
+  Game game("127.0.100.1");
+  Player a("127.0.100.2", 0x1000, 60),
+         b("127.0.100.3", 0x2000, 40),
+         c("127.0.100.4", 0x3000, 80);
+  REQUIRE(a.peerId >= 0 && b.peerId >= 0 && c.peerId >= 0);
+  a.ReportRtt(b, 20);
+  a.ReportRtt(c, 30);
+  b.ReportRtt(a, 20);
+  b.ReportRtt(c, 100);
+  c.ReportRtt(a, 30);
+  c.ReportRtt(b, 100);
+  for (Player *player : { &a, &b, &c }) {
+    player->Start(game.address);
+  }
+  REQUIRE(StartHostAdvisor());
+
+  // This computer's slowest link is 80 ms, B's and C's 100 ms, but A's is the 60 ms
+  // one to this computer, as measured through the delay line, give or take a tick
+  HostAdvice advice;
+  REQUIRE(WaitForAdvice(&advice));
+  CHECK(advice.peerId == a.peerId);
+  CHECK(advice.players == 4);
+  CHECK(advice.maxRttUs >= 55000 && advice.maxRttUs < 80000);
+
+  // And published for overlays
+  char name[64];
+  sprintf_s(name, sizeof(name), "Local\\NetHelperStats.%u", GetCurrentProcessId());
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+  REQUIRE(mapping);
+  auto *header = static_cast<const NetStatsHeader*>(
+    MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(NetStatsHeader)));
+  REQUIRE(header);
+  CHECK(header->advisedPeerId == a.peerId);
+  CHECK(header->advisedMaxRttUs == advice.maxRttUs);
+  UnmapViewOfFile(header);
+  CloseHandle(mapping);
+
+  StopHostAdvisor();
+  StopNetStats();
+}
+
+
+TEST(IgnoresReportsFromPeersThatDidntNegotiateProbing) {
+  Game game("127.0.101.1");
+  Player a("127.0.101.2", 0x1000, 10),
+         b("127.0.101.3", 0x2000, 20),
+         other("127.0.101.4", 0x0500, 0, false);
+  a.ReportRtt(b, 150);
+  b.ReportRtt(a, 150);
+  // Which would make this computer's row incomplete, and the advice A
+  other.ReportRtt(a, 1);
+  other.ReportRtt(b, 1);
+  for (Player *player : { &a, &b, &other }) {
+    player->Start(game.address);
+  }
+  REQUIRE(StartHostAdvisor());
+
+  HostAdvice advice;
+  REQUIRE(WaitForAdvice(&advice));
+  CHECK(advice.peerId == -1);
+  CHECK(advice.players == 3);
+  CHECK(advice.maxRttUs >= 15000 && advice.maxRttUs < 40000);
+  StopHostAdvisor();
+  CHECK(!GetHostAdvice(&advice));
+}
@@ -0,0 +1,180 @@
+// Tests the IGD description scanner against descriptions recorded from routers:
+// the services miniupnpc would have parsed out of them, a URL base, and documents
+// that are cut short or aren't for an IGD. Also the scanner on a SOAP answer,
+// whose tags have namespace prefixes.
+
+#include "Test.h"
+#include <string.h>
+#include <string>
+#include "IgdScan.h"
+#include "../miniupnp/miniupnpc/miniupnpc.h"
+
+// miniupnpd on OpenWrt, which sends it on one line
+static const char miniupnpd[] =
+  "<?xml version=\"1.0\"?>\r\n"
+  "<root xmlns=\"urn:schemas-upnp-org:device-1-0\" configId=\"1337\"><specVersion>"
+  "<major>1</major><minor>1</minor></specVersion><device><deviceType>"
+  "urn:schemas-upnp-org:device:InternetGatewayDevice:2</deviceType><friendlyName>"
+  "OpenWrt router</friendlyName><manufacturer>OpenWrt</manufacturer>"
+  "<UDN>uuid:8f0e1a7c-2a9b-4d3e-9f4e-1d2c3b4a5f60</UDN><serviceList><service>"
+  "<serviceType>urn:schemas-upnp-org:service:Layer3Forwarding:1</serviceType>"
+  "<serviceId>urn:upnp-org:serviceId:L3Forwarding1</serviceId><SCPDURL>/L3F.xml"
+  "</SCPDURL><controlURL>/ctl/L3F</controlURL><eventSubURL>/evt/L3F</eventSubURL>"
+  "</service></serviceList><deviceList><device><deviceType>"
+  "urn:schemas-upnp-org:device:WANDevice:2</deviceType><serviceList><service>"
+  "<serviceType>urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1"
+  "</serviceType><serviceId>urn:upnp-org:serviceId:WANCommonIFC1</serviceId>"
+  "<SCPDURL>/WANCfg.xml</SCPDURL><controlURL>/ctl/CmnIfCfg</controlURL>"
+  "<eventSubURL>/evt/CmnIfCfg</eventSubURL></service></serviceList><deviceList>"
+  "<device><deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:2"
+  "</deviceType><serviceList><service><serviceType>"
+  "urn:schemas-upnp-org:service:WANIPConnection:2</serviceType><serviceId>"
+  "urn:upnp-org:serviceId:WANIPConn1</serviceId><SCPDURL>/WANIPCn.xml</SCPDURL>"
+  "<controlURL>/ctl/IPConn</controlURL><eventSubURL>/evt/IPConn</eventSubURL>"
+  "</service><service><serviceType>"
+  "urn:schemas-upnp-org:service:WANIPv6FirewallControl:1</serviceType><serviceId>"
+  "urn:upnp-org:serviceId:WANIPv6Firewall1</serviceId><SCPDURL>/WANIP6FC.xml"
+  "</SCPDURL><controlURL>/ctl/IP6FCtl</controlURL><eventSubURL>/evt/IP6FCtl"
+  "</eventSubURL></service></serviceList></device></deviceList></device>"
+  "</deviceList><presentationURL>http://192.168.1.1/</presentationURL></device>"
+  "</root>";
+
+// A DSL router with a PPP connection, which words its description over many lines
+// and gives a URL base
+static const char pppRouter[] =
+  "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+  "<!-- Generated by the router's UPnP daemon -->\n"
+  "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+  "  <specVersion>\n    <major>1</major>\n    <minor>0</minor>\n  </specVersion>\n"
+  "  <URLBase>http://192.168.178.1:49000</URLBase>\n"
+  "  <device>\n"
+  "    <deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>\n"
+  "    <friendlyName><![CDATA[<Home> router]]></friendlyName>\n"
+  "    <iconList>\n"
+  "      <icon><mimetype>image/gif</mimetype><width>118</width><url>/ligd.gif</url>"
+  "</icon>\n"
+  "    </iconList>\n"
+  "    <deviceList>\n"
+  "      <device>\n"
+  "        <deviceType>urn:schemas-upnp-org:device:WANDevice:1</deviceType>\n"
+  "        <serviceList>\n"
+  "          <service>\n"
+  "            <serviceType>urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1"
+  "</serviceType>\n"
+  "            <controlURL>/igdupnp/control/WANCommonIFC1</controlURL>\n"
+  "            <eventSubURL>/igdupnp/control/WANCommonIFC1</eventSubURL>\n"
+  "            <SCPDURL>/igdicfgSCPD.xml</SCPDURL>\n"
+  "          </service>\n"
+  "        </serviceList>\n"
+  "        <deviceList>\n"
+  "          <device>\n"
+  "            <deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:1"
+  "</deviceType>\n"
+  "            <serviceList>\n"
+  "              <service>\n"
+  "                <serviceType>urn:schemas-upnp-org:service:WANPPPConnection:1"
+  "</serviceType>\n"
+  "                <controlURL> /igdupnp/control/WANPPPConn1 </controlURL>\n"
+  "                <eventSubURL>/igdupnp/control/WANPPPConn1</eventSubURL>\n"
+  "                <SCPDURL>/igdconnSCPD.xml</SCPDURL>\n"
+  "              </service>\n"
+  "              <service>\n"
+  "                <serviceType>urn:schemas-upnp-org:service:WANIPConnection:1"
+  "</serviceType>\n"
+  "                <controlURL>/igdupnp/control/WANIPConn1</controlURL>\n"
+  "                <eventSubURL>/igdupnp/control/WANIPConn1</eventSubURL>\n"
+  "                <SCPDURL>/igddslSCPD.xml</SCPDURL>\n"
+  "              </service>\n"
+  "            </serviceList>\n"
+  "          </device>\n"
+  "        </deviceList>\n"
+  "      </device>\n"
+  "    </deviceList>\n"
+  "    <presentationURL>http://192.168.178.1</presentationURL>\n"
+  "  </device>\n"
+  "</root>\n";
+
+
+static bool Scan(const char *xml, IGDdatas *data) {
+  return ScanIgdDescription(xml, static_cast<int>(strlen(xml)), data);
+}
+
+
+TEST(ReadsTheServicesOfAMiniupnpdDescription) {
+  IGDdatas data;
+  REQUIRE(Scan(miniupnpd, &data));
+  CHECK(strcmp(data.first.servicetype,
+               "urn:schemas-upnp-org:service:WANIPConnection:2") == 0);
+  CHECK(strcmp(data.first.controlurl, "/ctl/IPConn") == 0);
+  CHECK(strcmp(data.first.eventsuburl, "/evt/IPConn") == 0);
+  CHECK(strcmp(data.first.scpdurl, "/WANIPCn.xml") == 0);
+  CHECK(strcmp(data.CIF.controlurl, "/ctl/CmnIfCfg") == 0);
+  CHECK(strcmp(data.IPv6FC.controlurl, "/ctl/IP6FCtl") == 0);
+  CHECK(data.second.servicetype[0] == '\0');
+  CHECK(data.urlbase[0] == '\0');
+  CHECK(strcmp(data.presentationurl, "http://192.168.1.1/") == 0);
+  CHECK(data.level == 0);
+}
+
+
+TEST(ReadsAPppRoutersDescriptionWithAUrlBase) {
+  IGDdatas data;
+  REQUIRE(Scan(pppRouter, &data));
+  CHECK(strcmp(data.urlbase, "http://192.168.178.1:49000") == 0);
+  // In the order listed, with the whitespace around the URL trimmed
+  CHECK(strcmp(data.first.servicetype,
+               "urn:schemas-upnp-org:service:WANPPPConnection:1") == 0);
+  CHECK(strcmp(data.first.controlurl, "/igdupnp/control/WANPPPConn1") == 0);
+  CHECK(strcmp(data.second.controlurl, "/igdupnp/control/WANIPConn1") == 0);
+  CHECK(strcmp(data.CIF.scpdurl, "/igdicfgSCPD.xml") == 0);
+}
+
+
+TEST(RejectsDescriptionsOfOtherDevicesAndCutOnes) {
+  IGDdatas data;
+  // A media server
+  CHECK(!Scan("<?xml version=\"1.0\"?><root><device><deviceType>"
+              "urn:schemas-upnp-org:device:MediaServer:1</deviceType><serviceList>"
+              "<service><serviceType>urn:schemas-upnp-org:service:ContentDirectory:1"
+              "</serviceType><controlURL>/ctl/ContentDir</controlURL></service>"
+              "</serviceList></device></root>", &data));
+
+  // Cut anywhere before the connection service ends
+  std::string description(miniupnpd);
+  size_t serviceEnd = description.find("</service>",
+                                       description.find("WANIPConnection"));
+  for (size_t len = 0; len < serviceEnd; len += 7) {
+    CHECK(!ScanIgdDescription(description.data(), static_cast<int>(len), &data));
+  }
+  CHECK(ScanIgdDescription(description.data(),
+                           static_cast<int>(serviceEnd + strlen("</service>")),
+                           &data));
+  CHECK(strcmp(data.first.controlurl, "/ctl/IPConn") == 0);
+}
+
+
+TEST(ScansSoapAnswersWithPrefixedTags) {
+  const char answer[] =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>"
+    "<u:GetExternalIPAddressResponse "
+    "xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:1\">"
+    "<NewExternalIPAddress>203.0.113.9</NewExternalIPAddress><Empty/>"
+    "</u:GetExternalIPAddressResponse></s:Body></s:Envelope>";
+  XmlScanner scanner(answer, sizeof(answer) - 1);
+  XmlText name, text;
+  std::string events;
+  XmlScanner::Event event;
+  while ((event = scanner.Next(&name, &text)) != XmlScanner::documentEnd) {
+    events += (event == XmlScanner::elementStart) ? "+" : "-";
+    events += std::string(name.begin, name.len);
+    if (text.len > 0) {
+      events += "=" + std::string(text.begin, text.len);
+    }
+    events += " ";
+  }
+  CHECK(events == "+Envelope +Body +GetExternalIPAddressResponse "
+                  "+NewExternalIPAddress -NewExternalIPAddress=203.0.113.9 "
+                  "+Empty -Empty -GetExternalIPAddressResponse -Body -Envelope ");
+}
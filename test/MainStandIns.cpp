@@ -0,0 +1,149 @@
+// Stand-ins for the settings, the game patches, and the optional modules Main
+// starts and stops
+
+#include "MainStandIns.h"
+#include <mutex>
+#include "Broadcast.h"
+#include "Coalesce.h"
+#include "Compress.h"
+#include "Handshake.h"
+#include "HostAdvisor.h"
+#include "NetPatches.h"
+#include "NetStats.h"
+#include "PacketCapture.h"
+#include "PortCoordinator.h"
+#include "RecvEngine.h"
+#include "Relay.h"
+#include "SocketPolicy.h"
+#include "Stun.h"
+
+static std::mutex lock;
+static std::shared_ptr<const Config> config;
+static HANDLE hChangeEvent = nullptr;
+static std::string displayedInternalIp,
+                   displayedExternalIp;
+
+
+Config StandIns::DefaultConfig() {
+  Config result = Config();
+  result.startPort = 47776;
+  result.endPort   = 47807;
+  result.socketPolicy.dscp = -1;
+  return result;
+}
+
+
+void StandIns::SetConfig(const Config &newConfig) {
+  std::lock_guard<std::mutex> guard(lock);
+  config = std::make_shared<const Config>(newConfig);
+}
+
+
+void StandIns::ReloadConfig(const Config &newConfig) {
+  SetConfig(newConfig);
+  SetEvent(hChangeEvent);
+}
+
+
+std::string StandIns::GetDisplayedInternalIp() {
+  std::lock_guard<std::mutex> guard(lock);
+  return displayedInternalIp;
+}
+
+
+std::string StandIns::GetDisplayedExternalIp() {
+  std::lock_guard<std::mutex> guard(lock);
+  return displayedExternalIp;
+}
+
+
+std::shared_ptr<const Config> LoadConfig(const char*) {
+  return GetConfig();
+}
+
+
+std::shared_ptr<const Config> GetConfig() {
+  std::lock_guard<std::mutex> guard(lock);
+  if (!config) {
+    config = std::make_shared<const Config>(StandIns::DefaultConfig());
+  }
+  return config;
+}
+
+
+bool StartConfigWatch() {
+  if (!hChangeEvent) {
+    hChangeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+  }
+  return hChangeEvent != nullptr;
+}
+
+
+void StopConfigWatch() {}
+HANDLE GetConfigChangeEvent() { return hChangeEvent; }
+
+
+bool SetBindPatches(bool, bool) { return true; }
+bool SetTransportPatches(bool) { return true; }
+bool SetGetIPPatch(bool) { return true; }
+
+
+void SetDisplayedAddresses(const char *internalIp, const char *externalIp) {
+  std::lock_guard<std::mutex> guard(lock);
+  displayedInternalIp = internalIp;
+  displayedExternalIp = externalIp;
+}
+
+
+bool IsExternalIpDisplayed() {
+  std::lock_guard<std::mutex> guard(lock);
+  return !displayedExternalIp.empty();
+}
+
+
+bool IsSocketPolicyEnabled() { return false; }
+const SocketPolicyStats& GetSocketPolicyStats() {
+  static SocketPolicyStats stats = {};
+  return stats;
+}
+
+bool StartRecvEngine(int) { return false; }
+void StopRecvEngine() {}
+const RecvEngineStats& GetRecvEngineStats() {
+  static RecvEngineStats stats = {};
+  return stats;
+}
+
+bool StartRelay(const std::vector<std::string>&) { return false; }
+void StopRelay() {}
+void SetRelayActive(bool) {}
+
+bool StartCapture(const char*, size_t, int) { return false; }
+void StopCapture() {}
+bool IsCapturing() { return false; }
+
+bool StartNetStats() { return false; }
+void StopNetStats() {}
+bool IsNetStatsEnabled() { return false; }
+
+bool  StartCoalescing(int) { return false; }
+void  StopCoalescing() {}
+const CoalesceStats& GetCoalesceStats() {
+  static CoalesceStats stats = {};
+  return stats;
+}
+DWORD StartCompression(int, const char*) { return 0; }
+void  StopCompression() {}
+bool  StartHostAdvisor() { return false; }
+void  StopHostAdvisor() {}
+void  SetLocalCapabilities(WORD, DWORD) {}
+
+bool StartBroadcastFanOut() { return false; }
+void StopBroadcastFanOut() {}
+
+bool StartStun(const std::vector<std::string>&, int) { return false; }
+void StopStun() {}
+
+int  StartPortCoordination(IPAddr, int, int) { return 0; }
+void StopPortCoordination() {}
+bool IsPortCoordinating() { return false; }
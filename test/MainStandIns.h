@@ -0,0 +1,27 @@
+
+#ifndef MAINSTANDINS_H
+#define MAINSTANDINS_H
+
+// Stand-ins for what Main calls besides port forwarding and the network monitor:
+// the settings, which the tests give, the game patches, and the optional modules,
+// which all stay off. Link with NetStandIns for the rest of the modules.
+
+#include <string>
+#include "Config.h"
+
+namespace StandIns {
+
+// Settings with forwarding off and everything else at its default
+Config DefaultConfig();
+// Makes the settings the next LoadConfig publishes
+void SetConfig(const Config &config);
+// Publishes new settings, as the watcher does when Outpost2.ini changes
+void ReloadConfig(const Config &config);
+
+// The addresses last shown in game
+std::string GetDisplayedInternalIp();
+std::string GetDisplayedExternalIp();
+
+} // namespace StandIns
+
+#endif
@@ -0,0 +1,192 @@
+// Tests the network monitor against the shim's IP helper, whose interfaces,
+// addresses and routes the tests change with rtnetlink messages: the initial
+// snapshot, and which interfaces each kind of change reports
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <algorithm>
+#include <vector>
+#include "NetMonitor.h"
+#include "Netlink.h"
+
+// A wired adapter with the default route, and a Wi-Fi one with a worse one
+static void SetUpHomeNetwork() {
+  ShimResetNetwork();
+  Netlink()
+    .Link(2, "eth0", true)
+    .Address(2, "192.168.1.10", 24)
+    .DefaultRoute(2, "192.168.1.1", 100)
+    .Link(3, "wlan0", true)
+    .Address(3, "10.0.0.5", 8)
+    .DefaultRoute(3, "10.0.0.1", 600)
+    .Apply();
+}
+
+
+static std::vector<DWORD> TakeChanged() {
+  std::vector<DWORD> result = NetMonitor::TakeChangedInterfaces();
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+
+static bool FindAdapter(DWORD index, NetMonitor::Adapter *out) {
+  for (auto &adapter : NetMonitor::GetAdapters()) {
+    if (adapter.index == index) {
+      *out = adapter;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static bool IsSignaled(HANDLE event) {
+  return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+}
+
+
+TEST(ReadsTheInitialSnapshot) {
+  SetUpHomeNetwork();
+  REQUIRE(NetMonitor::Start());
+
+  CHECK(NetMonitor::GetAdapters().size() == 2);
+  NetMonitor::Adapter adapter;
+  REQUIRE(FindAdapter(2, &adapter));
+  CHECK(adapter.address == Ip("192.168.1.10"));
+  CHECK(adapter.mask    == Ip("255.255.255.0"));
+  CHECK(adapter.gateway == Ip("192.168.1.1"));
+  REQUIRE(FindAdapter(3, &adapter));
+  CHECK(adapter.mask    == Ip("255.0.0.0"));
+  CHECK(adapter.gateway == Ip("10.0.0.1"));
+
+  REQUIRE(NetMonitor::GetBestAdapter(&adapter));
+  CHECK(adapter.index == 2);
+
+  // The snapshot isn't a change
+  CHECK(TakeChanged().empty());
+  CHECK(!IsSignaled(NetMonitor::GetChangeEvent()));
+  NetMonitor::Stop();
+}
+
+
+TEST(SwitchesToAVpnWithABetterRoute) {
+  SetUpHomeNetwork();
+  REQUIRE(NetMonitor::Start());
+  LONG generation = NetMonitor::GetAdapterGeneration();
+
+  REQUIRE(Netlink()
+            .Link(7, "tun0", true)
+            .Address(7, "10.8.0.2", 24)
+            .DefaultRoute(7, "10.8.0.1", 50)
+            .Apply());
+
+  NetMonitor::Adapter best;
+  REQUIRE(NetMonitor::GetBestAdapter(&best));
+  CHECK(best.index == 7);
+  CHECK(best.gateway == Ip("10.8.0.1"));
+  // Both the old and the new best interface changed
+  CHECK((TakeChanged() == std::vector<DWORD>{ 2, 7 }));
+  CHECK(IsSignaled(NetMonitor::GetChangeEvent()));
+  CHECK(NetMonitor::GetAdapterGeneration() != generation);
+
+  // The VPN disconnecting hands the internet back to the wired adapter
+  REQUIRE(Netlink().DefaultRoute(7, "10.8.0.1", 50, true).Apply());
+  REQUIRE(NetMonitor::GetBestAdapter(&best));
+  CHECK(best.index == 2);
+  std::vector<DWORD> changed = TakeChanged();
+  CHECK(std::count(changed.begin(), changed.end(), 2) == 1);
+  CHECK(std::count(changed.begin(), changed.end(), 7) == 1);
+  NetMonitor::Stop();
+}
+
+
+TEST(ReportsOnlyTheAdapterWhoseAddressChanged) {
+  SetUpHomeNetwork();
+  REQUIRE(NetMonitor::Start());
+
+  REQUIRE(Netlink()
+            .Address(3, "10.0.0.5", 8, true)
+            .Address(3, "10.0.0.77", 8)
+            .Apply());
+
+  CHECK((TakeChanged() == std::vector<DWORD>{ 3 }));
+  NetMonitor::Adapter adapter;
+  REQUIRE(FindAdapter(3, &adapter));
+  CHECK(adapter.address == Ip("10.0.0.77"));
+  REQUIRE(NetMonitor::GetBestAdapter(&adapter));
+  CHECK(adapter.index == 2);
+
+  // Nothing changing reports nothing
+  REQUIRE(Netlink().Address(3, "10.0.0.77", 8).Apply());
+  CHECK(TakeChanged().empty());
+  NetMonitor::Stop();
+}
+
+
+TEST(ForgetsAnAdapterThatGoesDown) {
+  SetUpHomeNetwork();
+  REQUIRE(NetMonitor::Start());
+  LONG generation = NetMonitor::GetAdapterGeneration();
+
+  REQUIRE(Netlink().Link(2, "eth0", false).Apply());
+
+  NetMonitor::Adapter adapter;
+  CHECK(!FindAdapter(2, &adapter));
+  REQUIRE(NetMonitor::GetBestAdapter(&adapter));
+  CHECK(adapter.index == 3);
+  CHECK((TakeChanged() == std::vector<DWORD>{ 2, 3 }));
+  CHECK(NetMonitor::GetAdapterGeneration() != generation);
+  NetMonitor::Stop();
+}
+
+
+TEST(FollowsAGatewayChangeFromTheRouteTable) {
+  SetUpHomeNetwork();
+  REQUIRE(NetMonitor::Start());
+
+  REQUIRE(Netlink().ReplaceDefaultRoute(2, "192.168.1.254", 100).Apply());
+
+  NetMonitor::Adapter adapter;
+  REQUIRE(NetMonitor::GetBestAdapter(&adapter));
+  CHECK(adapter.index == 2);
+  CHECK(adapter.gateway == Ip("192.168.1.254"));
+  CHECK((TakeChanged() == std::vector<DWORD>{ 2 }));
+  NetMonitor::Stop();
+}
+
+
+TEST(StopsListeningWhenStopped) {
+  SetUpHomeNetwork();
+  REQUIRE(NetMonitor::Start());
+  NetMonitor::Stop();
+  ResetEvent(NetMonitor::GetChangeEvent());
+
+  REQUIRE(Netlink()
+            .Link(7, "tun0", true)
+            .Address(7, "10.8.0.2", 24)
+            .DefaultRoute(7, "10.8.0.1", 50)
+            .Apply());
+  Sleep(20);
+  CHECK(TakeChanged().empty());
+  CHECK(!IsSignaled(NetMonitor::GetChangeEvent()));
+
+  // Without notifications, the tables are read on demand
+  NetMonitor::Adapter best;
+  REQUIRE(NetMonitor::GetBestAdapter(&best));
+  CHECK(best.index == 7);
+  TakeChanged();
+}
+
+
+TEST(RejectsMalformedMessages) {
+  ShimResetNetwork();
+  nlmsghdr truncated = {};
+  truncated.nlmsg_len  = NLMSG_LENGTH(2);
+  truncated.nlmsg_type = RTM_NEWADDR;
+  CHECK(!ShimApplyNetlink(&truncated, sizeof(truncated)));
+  DWORD count = 1;
+  CHECK(GetNumberOfInterfaces(&count) == NO_ERROR && count == 0);
+}
@@ -0,0 +1,274 @@
+// Tests the game patches against the synthetic game image: the built-in bind
+// patches, bind patch manifests for other builds, the get-IP patch, and global
+// reference patches. Each is applied and reverted, checking the bytes in between
+// and after.
+
+#include "Test.h"
+#include "GameImage.h"
+#include "NetStandIns.h"
+#include <winsock2.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "NetPatches.h"
+#include "PatchManifest.h"
+#include "Patcher.h"
+
+using namespace Patcher;
+
+// Defined in NetPatches.cpp, for the transport and the game's vftable to call
+int __stdcall BindWrapper(SOCKET s, sockaddr_in *name, int namelen);
+bool __fastcall GetAddressString(void *thisPtr, int, char *buffer, size_t len);
+
+static const SOCKET testSocket = 42;
+
+// What the game image's bind import resolves to, recording what it was passed
+static SOCKET boundSocket  = INVALID_SOCKET;
+static u_long boundAddress = 0;
+
+static int FakeBind(SOCKET s, const sockaddr *name, int) {
+  boundSocket  = s;
+  boundAddress = reinterpret_cast<const sockaddr_in*>(name)->sin_addr.s_addr;
+  return 0;
+}
+static const void *const fakeBind = reinterpret_cast<const void*>(&FakeBind);
+
+
+static const void* GetCallTarget(uintptr_t site) {
+  auto *call = static_cast<const BYTE*>(FixPtr(site));
+  INT32 displacement;
+  memcpy(&displacement, call + 1, sizeof(displacement));
+  return (*call == 0xE8) ? call + 5 + displacement : nullptr;
+}
+
+
+// Binds through the call site at the preferred address, returning the address the
+// game image's bind import got
+static u_long BindThrough(uintptr_t site) {
+  sockaddr_in name = {};
+  name.sin_family           = AF_INET;
+  name.sin_port             = htons(47800);
+  name.sin_addr.s_addr      = htonl(0xC0A80105);  // 192.168.1.5
+  boundSocket  = INVALID_SOCKET;
+  boundAddress = 0xFFFFFFFF;
+  StandIns::policySocket = INVALID_SOCKET;
+  return (GameImage::CallBindSite(site, testSocket, &name, sizeof(name)) == 0 &&
+          boundSocket == testSocket) ? boundAddress : 0xFFFFFFFF;
+}
+
+
+// Loads a manifest with the given groups from a temporary file
+static bool LoadManifest(const std::string &groups) {
+  char path[] = "/tmp/NetHelperManifestXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return false;
+  }
+  std::string text = "NetHelperPatches 1\n" + groups;
+  bool written = write(fd, text.data(), text.size()) ==
+                 static_cast<ssize_t>(text.size());
+  close(fd);
+  bool result = written && LoadPatchManifest(path);
+  unlink(path);
+  return result;
+}
+
+
+TEST(AppliesAndRevertsBindPatches) {
+  HMODULE image = GameImage::Load(GameImage::gameLayout, fakeBind);
+  REQUIRE(image);
+  std::vector<BYTE> pristine = GameImage::Snapshot(image);
+
+  for (uintptr_t site : GameImage::bindCalls) {
+    CHECK(BindThrough(site) == htonl(0xC0A80105));
+  }
+
+  REQUIRE(SetBindPatches(true, true));
+  for (uintptr_t site : GameImage::bindCalls) {
+    CHECK(GetCallTarget(site) == reinterpret_cast<const void*>(&BindWrapper));
+    CHECK(BindThrough(site) == INADDR_ANY);
+    CHECK(StandIns::policySocket == testSocket);
+  }
+  SetBindPatches(false);
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  // Without bindAll, addresses pass through, but the socket policy still applies
+  REQUIRE(SetBindPatches(true, false));
+  CHECK(BindThrough(GameImage::bindCalls[0]) == htonl(0xC0A80105));
+  CHECK(StandIns::policySocket == testSocket);
+  SetBindPatches(false);
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  GameImage::Unload(image);
+}
+
+
+TEST(AppliesBindManifestToOtherBuild) {
+  const GameImage::Layout layout = { 0x30, GameImage::ipMessagePtr };
+  HMODULE image = GameImage::Load(layout, fakeBind);
+  REQUIRE(image);
+  std::vector<BYTE> pristine = GameImage::Snapshot(image);
+
+  // The built-in sites don't match this build, and nothing is patched
+  CHECK(!SetBindPatches(true, true));
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  // Call sites moved by the manifest
+  std::string groups = "group bind\n";
+  for (uintptr_t site : GameImage::bindCalls) {
+    char entry[32];
+    snprintf(entry, sizeof(entry), "call 0x%lX bind\n",
+             static_cast<unsigned long>(site + layout.bindShift));
+    groups += entry;
+  }
+  REQUIRE(LoadManifest(groups));
+  CHECK(SetBindPatches(true, true));
+  for (uintptr_t site : GameImage::bindCalls) {
+    CHECK(GetCallTarget(site + layout.bindShift) ==
+          reinterpret_cast<const void*>(&BindWrapper));
+    CHECK(BindThrough(site + layout.bindShift) == INADDR_ANY);
+  }
+  SetBindPatches(false);
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  // A hook on the import thunk, found by signature, catches every call site
+  REQUIRE(LoadManifest("group bind\nhook sig \"FF 25 ? ? ? ? CC CC\" bind\n"));
+  CHECK(SetBindPatches(true, true));
+  for (uintptr_t site : GameImage::bindCalls) {
+    CHECK(BindThrough(site + layout.bindShift) == INADDR_ANY);
+  }
+  SetBindPatches(false);
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  // Any entry that doesn't match fails the whole group
+  REQUIRE(LoadManifest(groups + "call 0x401000 bind\n"));
+  CHECK(!SetBindPatches(true, true));
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  UnloadPatchManifest();
+  GameImage::Unload(image);
+}
+
+
+TEST(AppliesAndRevertsGetIpPatch) {
+  HMODULE image = GameImage::Load(GameImage::gameLayout, fakeBind);
+  REQUIRE(image);
+  std::vector<BYTE> pristine = GameImage::Snapshot(image);
+
+  REQUIRE(SetGetIPPatch(true));
+  auto **vftable = static_cast<void**>(FixPtr(GameImage::getIpVftable));
+  auto **message = static_cast<char**>(FixPtr(GameImage::ipMessagePtr));
+  CHECK(vftable[2] == reinterpret_cast<void*>(&GetAddressString));
+  CHECK(strcmp(*message, "Your IP address is %s.") == 0);
+
+  // The game calls it through the vftable; with no address, the original runs
+  auto *getAddress = reinterpret_cast<decltype(&GetAddressString)>(vftable[2]);
+  char buffer[64] = {};
+  SetDisplayedAddresses("", "");
+  CHECK(getAddress(nullptr, 0, buffer, sizeof(buffer)) && strcmp(buffer, "A") == 0);
+  SetDisplayedAddresses("192.168.1.5", "");
+  CHECK(getAddress(nullptr, 0, buffer, sizeof(buffer)) &&
+        strcmp(buffer, "192.168.1.5") == 0);
+  SetDisplayedAddresses("192.168.1.5", "203.0.113.7");
+  CHECK(getAddress(nullptr, 0, buffer, sizeof(buffer)) &&
+        strcmp(buffer, "203.0.113.7") == 0);
+  StandIns::externalPort = 47810;
+  CHECK(getAddress(nullptr, 0, buffer, sizeof(buffer)) &&
+        strcmp(buffer, "203.0.113.7:47810") == 0);
+  StandIns::externalPort = 0;
+  SetDisplayedAddresses("", "");
+
+  SetGetIPPatch(false);
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  GameImage::Unload(image);
+}
+
+
+TEST(FindsMovedIpMessage) {
+  const GameImage::Layout layout = { 0, 0x4E9400 };
+  HMODULE image = GameImage::Load(layout, fakeBind);
+  REQUIRE(image);
+  std::vector<BYTE> pristine = GameImage::Snapshot(image);
+
+  REQUIRE(SetGetIPPatch(true));
+  CHECK(strcmp(*static_cast<char**>(FixPtr(layout.ipMessagePtr)),
+               "Your IP address is %s.") == 0);
+  CHECK(*static_cast<char**>(FixPtr(GameImage::ipMessagePtr)) == nullptr);
+  SetGetIPPatch(false);
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  GameImage::Unload(image);
+}
+
+
+TEST(RedirectsGlobalReferences) {
+  HMODULE image = GameImage::Load(GameImage::gameLayout, fakeBind);
+  REQUIRE(image);
+  std::vector<BYTE> pristine = GameImage::Snapshot(image);
+
+  static int replacement = 0;
+  void *global = FixPtr(GameImage::globalObject);
+  auto **references = static_cast<void**>(FixPtr(GameImage::globalReferences));
+  std::vector<std::shared_ptr<patch>> patches;
+  REQUIRE(PatchGlobalReferences(global, &replacement, &patches));
+  CHECK(patches.size() == GameImage::numGlobalReferences);
+  for (int i = 0; i < GameImage::numGlobalReferences; ++i) {
+    CHECK(references[i] == &replacement);
+  }
+
+  // Other relocated pointers are left alone
+  auto **message = static_cast<char**>(FixPtr(GameImage::ipMessagePtr));
+  CHECK(*message == FixPtr(GameImage::ipMessage));
+
+  // A global nothing refers to isn't found, and the list is left as it was
+  CHECK(!PatchGlobalReferences(FixPtr(GameImage::globalObject + 8), &replacement,
+                               &patches));
+  CHECK(patches.size() == GameImage::numGlobalReferences);
+  for (auto &curPatch : patches) {
+    CHECK(Unpatch(curPatch));
+  }
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  GameImage::Unload(image);
+}
+
+
+// Times applying and reverting each patch set, reporting the median and worst of
+// many runs
+TEST(TimesApplyAndRevert) {
+  HMODULE image = GameImage::Load(GameImage::gameLayout, fakeBind);
+  REQUIRE(image);
+
+  typedef std::chrono::steady_clock Clock;
+  const int runs = 200;
+  auto time = [](const char *name, bool (*apply)(), void (*revert)()) {
+    std::vector<double> applyUs, revertUs;
+    for (int i = 0; i < runs; ++i) {
+      auto start = Clock::now();
+      bool applied = apply();
+      auto middle = Clock::now();
+      revert();
+      auto end = Clock::now();
+      CHECK(applied);
+      applyUs.push_back(std::chrono::duration<double, std::micro>(middle - start).count());
+      revertUs.push_back(std::chrono::duration<double, std::micro>(end - middle).count());
+    }
+    std::sort(applyUs.begin(), applyUs.end());
+    std::sort(revertUs.begin(), revertUs.end());
+    printf("  %-6s apply %7.1f us median, %7.1f us max; "
+           "revert %7.1f us median, %7.1f us max\n", name,
+           applyUs[runs / 2], applyUs.back(), revertUs[runs / 2], revertUs.back());
+  };
+
+  std::vector<BYTE> pristine = GameImage::Snapshot(image);
+  time("bind",  []() { return SetBindPatches(true, true); },
+                []() { SetBindPatches(false); });
+  time("get-ip", []() { return SetGetIPPatch(true); },
+                 []() { SetGetIPPatch(false); });
+  CHECK(GameImage::Snapshot(image) == pristine);
+
+  GameImage::Unload(image);
+}
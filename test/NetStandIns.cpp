@@ -0,0 +1,42 @@
+// Stand-ins for the modules NetPatches calls into. Sends and receives go straight
+// to Winsock, as the real modules do while disabled. The transport's own are in
+// TransportStandIns.cpp.
+
+#include "NetStandIns.h"
+#include "Broadcast.h"
+#include "HostAdvisor.h"
+#include "NetStats.h"
+#include "PacketCapture.h"
+#include "PortCoordinator.h"
+#include "Relay.h"
+#include "Stun.h"
+
+int StandIns::externalPort = 0;
+
+int GetExternalFirstPort() { return StandIns::externalPort; }
+
+bool GetStunAddress(char*, size_t) { return false; }
+
+bool IsRelayEnabled() { return false; }
+void RelayAttach(SOCKET) {}
+void RelayDetach(SOCKET) {}
+bool IsRelayedPeer(int) { return false; }
+int  RelaySend(SOCKET, const char*, int len, const sockaddr*, int) { return len; }
+bool IsRelayPacket(const char*, int, const sockaddr*, int) { return false; }
+int  RelayReceive(SOCKET, char*, int, sockaddr_in*) { return 0; }
+void RelayOnDirect(int) {}
+bool GetRelayAddress(char*, size_t) { return false; }
+
+bool IsBroadcastFanOutEnabled() { return false; }
+void BroadcastFanOut(SOCKET, const char*, int, int, const sockaddr*, int) {}
+bool IsDuplicateReply(SOCKET, const char*, int, const sockaddr*, int) { return false; }
+void BroadcastDetach(SOCKET) {}
+
+bool IsHostAdvisorEnabled() { return false; }
+void HostAdvisorOnSend(SOCKET) {}
+void HostAdvisorOnControl(SOCKET, const char*, int, const sockaddr*, int, int) {}
+
+void NetStatsOnSend(const sockaddr*, int, int) {}
+void NetStatsOnRecv(const sockaddr*, int, int) {}
+void NetStatsOnCompress(int, int, int) {}
+void CapturePacket(CaptureDirection, SOCKET, const sockaddr*, int, const char*, int) {}
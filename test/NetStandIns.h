@@ -0,0 +1,19 @@
+
+#ifndef NETSTANDINS_H
+#define NETSTANDINS_H
+
+// Stand-ins for the modules NetPatches calls into, so it links on its own. All of
+// them are disabled and pass packets through untouched. The socket policy's is in
+// SocketPolicyStandIn.cpp and the transport's own in TransportStandIns.cpp, apart
+// from the rest so tests and benchmarks can use the real ones.
+
+#include <winsock2.h>
+
+namespace StandIns {
+
+extern SOCKET policySocket;  // The last socket the socket policy was applied to
+extern int    externalPort;  // What GetExternalFirstPort returns
+
+} // namespace StandIns
+
+#endif
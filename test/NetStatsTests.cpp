@@ -0,0 +1,339 @@
+// Tests the peer stats with a synthetic sender on loopback: a peer that sends at a
+// steady pace, goes silent, or answers after a delay, with the game's side calling
+// the hooks as its sendto and recvfrom do. The shared segment is read the way an
+// external tool would, through a mapping of its own.
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include "NetStats.h"
+
+static sockaddr_in Address(const char *ip, int port) {
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port   = htons(port);
+  inet_pton(AF_INET, ip, &address.sin_addr);
+  return address;
+}
+
+
+static SOCKET Bind(const sockaddr_in &address) {
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (s != INVALID_SOCKET &&
+      bind(s, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+  return s;
+}
+
+
+// Waits up to timeoutMs for a datagram. Returns its length, or -1.
+static int Receive(SOCKET s, int timeoutMs, sockaddr_in *from = nullptr) {
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(s, &fds);
+  timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+  if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) <= 0) {
+    return -1;
+  }
+  char buffer[2048];
+  sockaddr_in address;
+  int addressLen = sizeof(address);
+  int len = recvfrom(s, buffer, sizeof(buffer), 0,
+                     reinterpret_cast<sockaddr*>(&address), &addressLen);
+  if (from) {
+    *from = address;
+  }
+  return len;
+}
+
+
+// The game's socket, calling the stats hooks for what it sends and receives
+class Game {
+public:
+  explicit Game(const char *ip) : address(Address(ip, 0)) {
+    s = Bind(address);
+    int len = sizeof(address);
+    getsockname(s, reinterpret_cast<sockaddr*>(&address), &len);
+  }
+  ~Game() { closesocket(s); }
+
+  void SendTo(const sockaddr_in &peer, int bytes) {
+    char buffer[2048] = {};
+    sendto(s, buffer, bytes, 0, reinterpret_cast<const sockaddr*>(&peer),
+           sizeof(peer));
+    NetStatsOnSend(reinterpret_cast<const sockaddr*>(&peer), sizeof(peer), bytes);
+  }
+
+  // Receives until nothing arrives for timeoutMs. Returns the number received.
+  int ReceiveAll(int timeoutMs) {
+    int count = 0;
+    sockaddr_in from;
+    int len;
+    while ((len = Receive(s, timeoutMs, &from)) >= 0) {
+      NetStatsOnRecv(reinterpret_cast<sockaddr*>(&from), sizeof(from), len);
+      ++count;
+    }
+    return count;
+  }
+
+  sockaddr_in address;
+  SOCKET s;
+};
+
+
+// A peer that sends to the game on a schedule
+class SyntheticSender {
+public:
+  explicit SyntheticSender(const char *ip) : address(Address(ip, 47777)) {
+    s = Bind(address);
+  }
+  ~SyntheticSender() { closesocket(s); }
+
+  // Sends count datagrams of the given size intervalMs apart, going silent for
+  // silenceMs after the first silenceAfter of them
+  void Send(const sockaddr_in &to, int count, int bytes, int intervalMs,
+            int silenceAfter = -1, int silenceMs = 0) {
+    char buffer[2048] = {};
+    for (int i = 0; i < count; ++i) {
+      if (i > 0) {
+        Sleep(i == silenceAfter ? silenceMs : intervalMs);
+      }
+      sendto(s, buffer, bytes, 0, reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+    }
+  }
+
+  // Answers each datagram from the game after delayMs, until count are answered
+  void Echo(int count, int delayMs) {
+    for (int i = 0; i < count; ++i) {
+      sockaddr_in from;
+      int len = Receive(s, 2000, &from);
+      if (len < 0) {
+        return;
+      }
+      Sleep(delayMs);
+      char buffer[2048] = {};
+      sendto(s, buffer, len, 0, reinterpret_cast<sockaddr*>(&from), sizeof(from));
+    }
+  }
+
+  sockaddr_in address;
+  SOCKET s;
+};
+
+
+// Maps the segment the way an overlay would, by the process ID in its name
+class StatsReader {
+public:
+  StatsReader() : view(nullptr) {
+    char name[64];
+    sprintf_s(name, sizeof(name), "Local\\NetHelperStats.%u", GetCurrentProcessId());
+    mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (mapping) {
+      view = static_cast<const BYTE*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+  }
+  ~StatsReader() {
+    if (view) {
+      UnmapViewOfFile(view);
+    }
+    if (mapping) {
+      CloseHandle(mapping);
+    }
+  }
+
+  const NetStatsHeader* Header() const {
+    return reinterpret_cast<const NetStatsHeader*>(view);
+  }
+
+  // Copies an entry under its sequence lock. Returns false if it is unused.
+  bool Read(int peerId, NetPeerStats *out) const {
+    const NetStatsHeader *header = Header();
+    const volatile NetPeerStats *entry = reinterpret_cast<const NetPeerStats*>(
+      view + header->headerSize + peerId * header->entrySize);
+    for (;;) {
+      LONG before = entry->sequence;
+      if (!(before & 1)) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        memcpy(out, const_cast<const NetPeerStats*>(entry), sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (entry->sequence == before) {
+          return before != 0;
+        }
+      }
+      YieldProcessor();
+    }
+  }
+
+  const BYTE *view;
+
+private:
+  HANDLE mapping;
+};
+
+
+static int PeerIdOf(const sockaddr_in &peer) {
+  return PeerTable::FindPeerId(reinterpret_cast<const sockaddr*>(&peer), sizeof(peer));
+}
+
+
+TEST(PublishesTheSegmentForToolsToOpen) {
+  REQUIRE(StartNetStats());
+  CHECK(IsNetStatsEnabled());
+  StatsReader reader;
+  REQUIRE(reader.view);
+  const NetStatsHeader *header = reader.Header();
+  CHECK(header->magic == netStatsMagic);
+  CHECK(header->version == netStatsVersion);
+  CHECK(header->headerSize == sizeof(NetStatsHeader));
+  CHECK(header->entrySize == sizeof(NetPeerStats));
+  CHECK(header->maxPeers == PeerTable::MaxPeers);
+  CHECK(header->processId == GetCurrentProcessId());
+  CHECK(header->frequency > 0);
+}
+
+
+TEST(MeasuresASteadySender) {
+  REQUIRE(StartNetStats());
+  Game game("127.0.80.1");
+  SyntheticSender peer("127.0.80.2");
+  REQUIRE(game.s != INVALID_SOCKET && peer.s != INVALID_SOCKET);
+
+  // The game has to send first for the peer to get an ID
+  game.SendTo(peer.address, 64);
+  int peerId = PeerIdOf(peer.address);
+  REQUIRE(peerId >= 0);
+  std::thread sender([&] { peer.Send(game.address, 50, 100, 10); });
+  int received = game.ReceiveAll(200);
+  sender.join();
+  CHECK(received == 50);
+
+  StatsReader reader;
+  NetPeerStats stats;
+  REQUIRE(reader.Read(peerId, &stats));
+  CHECK(stats.peerAddress == peer.address.sin_addr.s_addr);
+  CHECK(stats.peerPort == peer.address.sin_port);
+  CHECK(stats.packetsSent == 1 && stats.bytesSent == 64);
+  CHECK(stats.packetsRecv == 50 && stats.bytesRecv == 5000);
+  // Paced 10 ms apart, give or take the scheduler
+  CHECK(stats.intervalUs >= 8000 && stats.intervalUs < 15000);
+  CHECK(stats.jitterUs < 5000);
+  CHECK(stats.gaps == 0);
+
+  // The process's own view agrees
+  NetPeerStats own;
+  REQUIRE(GetNetPeerStats(peerId, &own));
+  CHECK(own.packetsRecv == stats.packetsRecv);
+}
+
+
+TEST(CountsASilenceAsAGap) {
+  REQUIRE(StartNetStats());
+  Game game("127.0.81.1");
+  SyntheticSender peer("127.0.81.2");
+  game.SendTo(peer.address, 64);
+  int peerId = PeerIdOf(peer.address);
+  REQUIRE(peerId >= 0);
+
+  // As if a burst of packets was lost after the 20th
+  std::thread sender([&] { peer.Send(game.address, 40, 100, 10, 20, 300); });
+  CHECK(game.ReceiveAll(500) == 40);
+  sender.join();
+
+  NetPeerStats stats;
+  REQUIRE(GetNetPeerStats(peerId, &stats));
+  CHECK(stats.gaps == 1);
+  // The silence moves the smoothed interval and jitter, but doesn't take it over
+  CHECK(stats.jitterUs > 5000);
+  CHECK(stats.intervalUs < 100000);
+}
+
+
+TEST(MeasuresTheRoundTrip) {
+  REQUIRE(StartNetStats());
+  Game game("127.0.82.1");
+  SyntheticSender peer("127.0.82.2");
+  std::thread echo([&] { peer.Echo(10, 20); });
+
+  int peerId = -1;
+  for (int i = 0; i < 10; ++i) {
+    game.SendTo(peer.address, 32);
+    peerId = PeerIdOf(peer.address);
+    sockaddr_in from;
+    int len = Receive(game.s, 1000, &from);
+    REQUIRE(len == 32);
+    NetStatsOnRecv(reinterpret_cast<sockaddr*>(&from), sizeof(from), len);
+  }
+  echo.join();
+
+  NetPeerStats stats;
+  REQUIRE(GetNetPeerStats(peerId, &stats));
+  CHECK(stats.rttMinUs >= 20000);
+  CHECK(stats.rttUs >= 20000 && stats.rttUs < 40000);
+  // Each reply answered the send before it
+  CHECK(stats.lastSendCounter == 0);
+}
+
+
+TEST(ReadersNeverSeeAHalfWrittenEntry) {
+  REQUIRE(StartNetStats());
+  SyntheticSender peer("127.0.83.2");
+  sockaddr_in to = peer.address;
+  NetStatsOnSend(reinterpret_cast<sockaddr*>(&to), sizeof(to), 0);
+  int peerId = PeerIdOf(to);
+  REQUIRE(peerId >= 0);
+
+  // Every datagram is 100 bytes, so a consistent copy has bytes = 100 * packets
+  std::atomic<bool> done(false);
+  std::thread writers[2];
+  for (std::thread &writer : writers) {
+    writer = std::thread([&] {
+      for (int i = 0; i < 200000; ++i) {
+        NetStatsOnRecv(reinterpret_cast<sockaddr*>(&to), sizeof(to), 100);
+      }
+    });
+  }
+  std::thread compressor([&] {
+    for (int i = 0; i < 200000; ++i) {
+      NetStatsOnCompress(peerId, 100, 50);
+    }
+    done = true;
+  });
+
+  StatsReader reader;
+  REQUIRE(reader.view);
+  int reads = 0,
+      torn  = 0;
+  NetPeerStats stats;
+  while (!done) {
+    if (reader.Read(peerId, &stats)) {
+      torn += stats.bytesRecv != stats.packetsRecv * 100 ||
+              stats.compressWireBytes * 2 != stats.compressRawBytes;
+      ++reads;
+    }
+  }
+  for (std::thread &writer : writers) {
+    writer.join();
+  }
+  compressor.join();
+  CHECK(reads > 0);
+  CHECK(torn == 0);
+  REQUIRE(reader.Read(peerId, &stats));
+  CHECK(stats.packetsRecv == 400000);
+  CHECK(stats.compressRawBytes == 200000 * 100);
+}
+
+
+TEST(StopsPublishing) {
+  REQUIRE(StartNetStats());
+  StopNetStats();
+  CHECK(!IsNetStatsEnabled());
+  NetPeerStats stats;
+  CHECK(!GetNetPeerStats(0, &stats));
+  StatsReader reader;
+  CHECK(!reader.view);
+}
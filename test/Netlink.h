@@ -0,0 +1,110 @@
+
+#ifndef NETLINK_H
+#define NETLINK_H
+
+// Describes a network to the IP helper shim with rtnetlink messages
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <vector>
+#include "Shim.h"
+
+inline IPAddr Ip(const char *address) {
+  IPAddr value = INADDR_ANY;
+  inet_pton(AF_INET, address, &value);
+  return value;
+}
+
+
+// Builds a batch of rtnetlink messages, as the kernel sends them on a NETLINK_ROUTE
+// socket
+class Netlink {
+public:
+  Netlink& Link(int index, const char *name, bool up) {
+    ifinfomsg link = {};
+    link.ifi_family = AF_UNSPEC;
+    link.ifi_index  = index;
+    link.ifi_flags  = up ? 0x1 : 0;  // IFF_UP
+    Begin(RTM_NEWLINK, &link, sizeof(link));
+    Attribute(IFLA_IFNAME, name, strlen(name) + 1);
+    return *this;
+  }
+
+  Netlink& Address(int index, const char *address, int prefixLength,
+                   bool remove = false) {
+    ifaddrmsg header = {};
+    header.ifa_family    = AF_INET;
+    header.ifa_prefixlen = static_cast<unsigned char>(prefixLength);
+    header.ifa_index     = index;
+    Begin(remove ? RTM_DELADDR : RTM_NEWADDR, &header, sizeof(header));
+    AddressAttribute(IFA_LOCAL, address);
+    AddressAttribute(IFA_ADDRESS, address);
+    return *this;
+  }
+
+  Netlink& DefaultRoute(int index, const char *gateway, int metric,
+                        bool remove = false) {
+    rtmsg header = {};
+    header.rtm_family   = AF_INET;
+    header.rtm_dst_len  = 0;
+    header.rtm_table    = RT_TABLE_MAIN;
+    header.rtm_protocol = RTPROT_BOOT;
+    header.rtm_scope    = RT_SCOPE_UNIVERSE;
+    header.rtm_type     = RTN_UNICAST;
+    Begin(remove ? RTM_DELROUTE : RTM_NEWROUTE, &header, sizeof(header));
+    AddressAttribute(RTA_GATEWAY, gateway);
+    Attribute(RTA_OIF, &index, sizeof(index));
+    Attribute(RTA_PRIORITY, &metric, sizeof(metric));
+    return *this;
+  }
+
+  // Replaces the interface's default routes, as "ip route replace" does
+  Netlink& ReplaceDefaultRoute(int index, const char *gateway, int metric) {
+    DefaultRoute(index, gateway, metric);
+    reinterpret_cast<nlmsghdr*>(&buffer[current])->nlmsg_flags |= NLM_F_REPLACE;
+    return *this;
+  }
+
+  // Applies the batch, and starts a new one
+  bool Apply() {
+    bool result = ShimApplyNetlink(buffer.data(), buffer.size());
+    buffer.clear();
+    return result;
+  }
+
+private:
+  void Begin(int type, const void *header, size_t size) {
+    size_t offset = buffer.size();
+    buffer.resize(offset + NLMSG_SPACE(size));
+    auto *message = reinterpret_cast<nlmsghdr*>(&buffer[offset]);
+    message->nlmsg_len   = NLMSG_LENGTH(size);
+    message->nlmsg_type  = static_cast<unsigned short>(type);
+    message->nlmsg_flags = NLM_F_CREATE;
+    memcpy(NLMSG_DATA(message), header, size);
+    current = offset;
+  }
+
+  void Attribute(int type, const void *data, size_t size) {
+    size_t offset = buffer.size();
+    buffer.resize(offset + RTA_SPACE(size));
+    auto *attribute = reinterpret_cast<rtattr*>(&buffer[offset]);
+    attribute->rta_len  = static_cast<unsigned short>(RTA_LENGTH(size));
+    attribute->rta_type = static_cast<unsigned short>(type);
+    memcpy(RTA_DATA(attribute), data, size);
+    reinterpret_cast<nlmsghdr*>(&buffer[current])->nlmsg_len =
+      static_cast<unsigned int>(buffer.size() - current);
+  }
+
+  void AddressAttribute(int type, const char *address) {
+    IPAddr value = Ip(address);
+    Attribute(type, &value, sizeof(value));
+  }
+
+  std::vector<char> buffer;
+  size_t current = 0;
+};
+
+#endif
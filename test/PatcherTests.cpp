@@ -0,0 +1,683 @@
+// Tests Patcher's instruction decoder and relocator, and inline hooks and vftable
+// patches on functions and classes compiled into this program
+
+#include "Test.h"
+#include "../src/Patcher.cpp"  // For DecodeInstruction and RelocateInstructions
+
+using namespace Patcher;
+
+// Instruction samples, assembled with a table of where each instruction ends so
+// the decoder can be checked against the assembler. Branches in the samples go to
+// the start of their sample, and RIP-relative operands point to x64SampleEnd.
+asm(R"(
+  .pushsection .text
+  .intel_syntax noprefix
+
+  .macro INSN base, insn:vararg
+    \insn
+  9:
+    .pushsection .rodata
+    .long 9b - \base
+    .popsection
+  .endm
+
+  .pushsection .rodata
+  .balign 4
+  .globl x64SampleEnds
+x64SampleEnds:
+  .popsection
+
+  .globl x64Sample, x64SampleEnd
+x64Sample:
+  INSN x64Sample, push rbp
+  INSN x64Sample, mov rbp, rsp
+  INSN x64Sample, sub rsp, 0x28
+  INSN x64Sample, sub rsp, 0x1000
+  INSN x64Sample, mov eax, dword ptr [rip + x64SampleEnd]
+  INSN x64Sample, lea rcx, [rip + x64SampleEnd]
+  INSN x64Sample, mov qword ptr [rip + x64SampleEnd], 5
+  INSN x64Sample, movzx eax, byte ptr [rip + x64SampleEnd]
+  INSN x64Sample, cmp byte ptr [rip + x64SampleEnd], 1
+  INSN x64Sample, jmp qword ptr [rip + x64SampleEnd]
+  INSN x64Sample, movabs rax, 0x1122334455667788
+  INSN x64Sample, mov eax, 1
+  INSN x64Sample, mov ax, 1
+  INSN x64Sample, mov r9d, 2
+  INSN x64Sample, add byte ptr [rax], 1
+  INSN x64Sample, test ecx, 0x100
+  INSN x64Sample, test cl, 1
+  INSN x64Sample, test word ptr [rcx], 0x100
+  INSN x64Sample, mov dword ptr [rsp + 8], 0x12345678
+  INSN x64Sample, mov eax, dword ptr [rax + rcx*4 + 0x12345678]
+  INSN x64Sample, mov rax, qword ptr gs:[0x30]
+  INSN x64Sample, mov r12, qword ptr [r13 + 8]
+  INSN x64Sample, imul eax, ecx, 0x12345
+  INSN x64Sample, imul eax, ecx, 5
+  INSN x64Sample, shl eax, 3
+  INSN x64Sample, lock xadd dword ptr [rcx], eax
+  INSN x64Sample, cmovz eax, ecx
+  INSN x64Sample, setz al
+  INSN x64Sample, bt eax, 5
+  INSN x64Sample, nop dword ptr [rax + rax]
+  INSN x64Sample, movdqu xmm0, xmmword ptr [rsp + 0x10]
+  INSN x64Sample, pshufb xmm0, xmm1
+  INSN x64Sample, palignr xmm0, xmm1, 8
+  INSN x64Sample, cpuid
+  INSN x64Sample, rdtsc
+  INSN x64Sample, rep movsb
+  INSN x64Sample, enter 0x10, 0
+  INSN x64Sample, leave
+  INSN x64Sample, call x64Sample
+  INSN x64Sample, call qword ptr [rax]
+  INSN x64Sample, jz x64Sample
+  INSN x64Sample, jmp x64Sample
+  INSN x64Sample, int3
+  INSN x64Sample, ret 8
+  INSN x64Sample, ret
+x64SampleEnd:
+  .quad 0
+
+  .pushsection .rodata
+  .globl x86SampleEnds
+x86SampleEnds:
+  .popsection
+
+  .code32
+  .globl x86Sample
+x86Sample:
+  INSN x86Sample, push ebp
+  INSN x86Sample, mov ebp, esp
+  INSN x86Sample, sub esp, 0x10
+  INSN x86Sample, inc eax
+  INSN x86Sample, mov eax, dword ptr ds:[0x4E9220]
+  INSN x86Sample, mov ecx, dword ptr ds:[0x4D64F8]
+  INSN x86Sample, mov eax, dword ptr [esp + 4]
+  INSN x86Sample, lea eax, [eax + ecx*2 + 8]
+  INSN x86Sample, push 0x12345678
+  INSN x86Sample, push 8
+  INSN x86Sample, mov ax, word ptr [ebx]
+  INSN x86Sample, pusha
+  INSN x86Sample, call x86Sample
+  INSN x86Sample, jnz x86Sample
+  INSN x86Sample, call 0x10:0x12345678
+  INSN x86Sample, jmp dword ptr ds:[0x4C0E40]
+  INSN x86Sample, ret
+  .code64
+
+  .pushsection .rodata
+  .globl x86SampleEndsEnd
+x86SampleEndsEnd:
+  .popsection
+
+  // Too short to hook, as it returns within the first 5 bytes
+  .globl shortFunction
+shortFunction:
+  xor eax, eax
+  ret
+
+  .purgem INSN
+  .att_syntax prefix
+  .popsection
+)");
+
+extern "C" const BYTE  x64Sample[], x64SampleEnd[], x86Sample[], shortFunction[];
+extern "C" const DWORD x64SampleEnds[], x86SampleEnds[], x86SampleEndsEnd[];
+
+
+static bool Decode(const BYTE *code, bool is64, Instruction *out) {
+  return DecodeInstruction(code, is64, out);
+}
+
+static const BYTE* BranchTarget(const BYTE *code, const Instruction &instruction) {
+  const BYTE *next = code + instruction.length;
+  if (instruction.relSize == 1) {
+    return next + static_cast<int8_t>(code[instruction.relOffset]);
+  }
+  int32_t rel;
+  memcpy(&rel, &code[instruction.relOffset], sizeof(rel));
+  return next + rel;
+}
+
+
+TEST(DecodesAssembledLengths) {
+  for (int pass = 0; pass < 2; ++pass) {
+    const bool is64 = (pass == 0);
+    const BYTE *sample = is64 ? x64Sample : x86Sample;
+    const DWORD *begin = is64 ? x64SampleEnds : x86SampleEnds,
+                *end   = is64 ? x86SampleEnds : x86SampleEndsEnd;
+    CHECK(end - begin > 15);
+
+    DWORD offset = 0;
+    for (const DWORD *it = begin; it != end; ++it) {
+      Instruction instruction;
+      bool decoded = Decode(sample + offset, is64, &instruction);
+      CHECK(decoded);
+      if (!decoded || instruction.length != *it - offset) {
+        printf("  %s instruction at +%u: decoded length %zu, assembled %u\n",
+               is64 ? "x64" : "x86", offset, decoded ? instruction.length : 0,
+               *it - offset);
+        CHECK(instruction.length == *it - offset);
+      }
+      offset = *it;
+    }
+  }
+}
+
+
+TEST(DecodesRelativeOperands) {
+  DWORD offset = 0;
+  int branches = 0,
+      ripRelatives = 0;
+  for (const DWORD *end = x64SampleEnds; end != x86SampleEnds; ++end) {
+    Instruction instruction;
+    REQUIRE(Decode(x64Sample + offset, true, &instruction));
+    const BYTE *code = x64Sample + offset;
+
+    if (instruction.branch) {
+      CHECK(BranchTarget(code, instruction) == x64Sample);
+      ++branches;
+    }
+    if (instruction.ripRelative) {
+      CHECK(instruction.relSize == 4);
+      CHECK(instruction.relOffset + 4 <= instruction.length);
+      int32_t disp;
+      memcpy(&disp, &code[instruction.relOffset], sizeof(disp));
+      // The displacement is from the end of the instruction, immediate included
+      CHECK(code + instruction.length + disp == x64SampleEnd);
+      ++ripRelatives;
+    }
+    offset = *end;
+  }
+  CHECK(branches == 3);      // call, jz and jmp
+  CHECK(ripRelatives == 6);
+}
+
+
+TEST(DecodesFlowEnds) {
+  static const struct {
+    BYTE bytes[8];
+    bool is64;
+    size_t length;
+    bool endsFlow,
+         branch;
+  } cases[] = {
+    { { 0xC3 },                               false, 1, true,  false },  // ret
+    { { 0xC2, 0x08, 0x00 },                   false, 3, true,  false },  // ret 8
+    { { 0xEB, 0x10 },                         false, 2, true,  true  },  // jmp short
+    { { 0xE9, 0x00, 0x00, 0x00, 0x00 },       false, 5, true,  true  },  // jmp
+    { { 0xE8, 0x00, 0x00, 0x00, 0x00 },       false, 5, false, true  },  // call
+    { { 0x74, 0x10 },                         false, 2, false, true  },  // jz short
+    { { 0x0F, 0x84, 0x00, 0x00, 0x00, 0x00 }, false, 6, false, true  },  // jz
+    { { 0xFF, 0x25, 0x40, 0x0E, 0x4C, 0x00 }, false, 6, true,  false },  // jmp [abs]
+    { { 0xFF, 0xE0 },                         true,  2, true,  false },  // jmp rax
+    { { 0xFF, 0xD0 },                         true,  2, false, false },  // call rax
+    { { 0xEA, 1, 2, 3, 4, 5, 6 },             false, 7, true,  false },  // jmp far
+  };
+
+  for (const auto &test : cases) {
+    Instruction instruction;
+    CHECK(Decode(test.bytes, test.is64, &instruction));
+    CHECK(instruction.length == test.length);
+    CHECK(instruction.endsFlow == test.endsFlow);
+    CHECK(instruction.branch == test.branch);
+  }
+}
+
+
+TEST(RejectsUndecodable) {
+  static const struct {
+    BYTE bytes[16];
+    bool is64;
+  } cases[] = {
+    { { 0xE3, 0x10 },                         false },  // jecxz
+    { { 0xE2, 0x10 },                         true  },  // loop
+    { { 0x66, 0xE8, 0x00, 0x00 },             false },  // call rel16
+    { { 0x66, 0x74, 0x10 },                   false },  // jz with operand size prefix
+    { { 0x67, 0x8B, 0x00 },                   false },  // 16-bit addressing
+    { { 0x48, 0x48, 0x8B, 0xC1 },             true  },  // Misplaced REX prefix
+    { { 0xC5, 0xF9, 0x6F, 0xC1 },             true  },  // VEX
+    { { 0x62, 0xF1, 0x7C, 0x48, 0x10, 0xC1 }, true  },  // EVEX
+    { { 0x0F, 0x0F, 0xC1, 0xB4 },             false },  // 3DNow!
+    { { 0x9A, 1, 2, 3, 4, 5, 6 },             true  },  // call far, invalid on x64
+    { { 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+        0x66, 0x66, 0x66, 0x90 },             false },  // Too many prefixes
+  };
+
+  for (const auto &test : cases) {
+    Instruction instruction;
+    CHECK(!Decode(test.bytes, test.is64, &instruction));
+  }
+}
+
+
+// Relocation keeps source and destination in one buffer, so distances are known
+
+struct RelocationBuffer {
+  RelocationBuffer() { memset(bytes, 0xCC, sizeof(bytes)); }
+
+  BYTE *Source() { return bytes + 0x200; }
+  BYTE *Dest()   { return bytes + 0x40; }
+
+  BYTE bytes[0x400];
+};
+
+
+TEST(RelocatesPlainInstructions) {
+  static const BYTE prologue[] = { 0x55, 0x8B, 0xEC, 0x83, 0xEC, 0x10, 0x90 };
+  RelocationBuffer buffer;
+  memcpy(buffer.Source(), prologue, sizeof(prologue));
+
+  size_t written = 0;
+  CHECK(RelocateInstructions(buffer.Source(), buffer.Dest(), 32, 5, false,
+                             &written) == 6);
+  CHECK(written == 6);
+  CHECK(memcmp(buffer.Dest(), prologue, 6) == 0);
+}
+
+
+TEST(RelocatesRelativeCall) {
+  for (int is64 = 0; is64 < 2; ++is64) {
+    RelocationBuffer buffer;
+    BYTE *source = buffer.Source();
+    source[0] = 0xE8;
+    int32_t rel = 0x100;
+    memcpy(&source[1], &rel, sizeof(rel));
+    const BYTE *target = source + 5 + rel;
+
+    size_t written = 0;
+    CHECK(RelocateInstructions(source, buffer.Dest(), 32, 5, is64 != 0,
+                               &written) == 5);
+    CHECK(written == 5);
+    Instruction instruction;
+    REQUIRE(Decode(buffer.Dest(), is64 != 0, &instruction));
+    CHECK(buffer.Dest()[0] == 0xE8);
+    CHECK(BranchTarget(buffer.Dest(), instruction) == target);
+  }
+}
+
+
+TEST(WidensShortBranches) {
+  // jz +0x10; nop; nop; nop
+  RelocationBuffer buffer;
+  BYTE *source = buffer.Source();
+  static const BYTE jz[] = { 0x74, 0x10, 0x90, 0x90, 0x90 };
+  memcpy(source, jz, sizeof(jz));
+
+  size_t written = 0;
+  CHECK(RelocateInstructions(source, buffer.Dest(), 32, 5, false, &written) == 5);
+  CHECK(written == 9);
+  CHECK(buffer.Dest()[0] == 0x0F && buffer.Dest()[1] == 0x84);
+  Instruction instruction;
+  REQUIRE(Decode(buffer.Dest(), false, &instruction));
+  CHECK(BranchTarget(buffer.Dest(), instruction) == source + 2 + 0x10);
+  CHECK(memcmp(buffer.Dest() + 6, jz + 2, 3) == 0);
+
+  // A jmp short may end the copied bytes
+  static const BYTE jmp[] = { 0x90, 0x90, 0x90, 0xEB, 0x10 };
+  memcpy(source, jmp, sizeof(jmp));
+  CHECK(RelocateInstructions(source, buffer.Dest(), 32, 5, false, &written) == 5);
+  CHECK(written == 8);
+  CHECK(buffer.Dest()[3] == 0xE9);
+  REQUIRE(Decode(buffer.Dest() + 3, false, &instruction));
+  CHECK(BranchTarget(buffer.Dest() + 3, instruction) == source + 5 + 0x10);
+}
+
+
+TEST(RelocatesRipRelative) {
+  // mov rax, [rip + 0x10]; nop
+  static const BYTE load[] = { 0x48, 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00, 0x90 };
+  RelocationBuffer buffer;
+  BYTE *source = buffer.Source();
+  memcpy(source, load, sizeof(load));
+
+  size_t written = 0;
+  CHECK(RelocateInstructions(source, buffer.Dest(), 32, 5, true, &written) == 7);
+  CHECK(written == 7);
+  CHECK(memcmp(buffer.Dest(), load, 3) == 0);
+  int32_t disp;
+  memcpy(&disp, buffer.Dest() + 3, sizeof(disp));
+  CHECK(buffer.Dest() + 7 + disp == source + 7 + 0x10);
+}
+
+
+TEST(RejectsUnrelocatable) {
+  static const struct {
+    BYTE bytes[8];
+    bool is64;
+  } cases[] = {
+    { { 0xC3, 0x90, 0x90, 0x90, 0x90 },       false },  // Returns early
+    { { 0xEB, 0x10, 0x90, 0x90, 0x90 },       false },  // Jumps away early
+    { { 0x74, 0x01, 0x90, 0x90, 0x90, 0x90 }, false },  // Into the copied bytes
+    { { 0x90, 0x90, 0x75, 0xFC, 0x90 },       false },  // Back to the start
+    { { 0x2E, 0x74, 0x10, 0x90, 0x90 },       false },  // Prefixed branch
+    { { 0xE3, 0x10, 0x90, 0x90, 0x90 },       false },  // Undecodable
+  };
+
+  for (const auto &test : cases) {
+    RelocationBuffer buffer;
+    memcpy(buffer.Source(), test.bytes, sizeof(test.bytes));
+    size_t written = 0;
+    CHECK(RelocateInstructions(buffer.Source(), buffer.Dest(), 32, 5, test.is64,
+                               &written) == 0);
+  }
+}
+
+
+TEST(RejectsOutOfRangeOrTooSmall) {
+  RelocationBuffer buffer;
+  BYTE *source = buffer.Source();
+
+  // The call reaches just within rel32 of the source, but not of the destination
+  source[0] = 0xE8;
+  int32_t rel = 0x7FFFFFF0;
+  memcpy(&source[1], &rel, sizeof(rel));
+  size_t written = 0;
+  CHECK(RelocateInstructions(source, buffer.Dest(), 32, 5, true, &written) == 0);
+
+  static const BYTE prologue[] = { 0x55, 0x8B, 0xEC, 0x83, 0xEC, 0x10 };
+  memcpy(source, prologue, sizeof(prologue));
+  CHECK(RelocateInstructions(source, buffer.Dest(), 5, 5, false, &written) == 0);
+}
+
+
+// Functions compiled into this program, hooked for real
+
+#define TEST_FUNCTION __attribute__((noinline, noipa))
+
+static volatile int counter = 20;
+
+TEST_FUNCTION int Helper(int x)       { return x * 3; }
+TEST_FUNCTION int OtherHelper(int x)  { return x * 5; }
+TEST_FUNCTION int CallsHelper(int x)  { return Helper(x) + 1; }
+TEST_FUNCTION int ReadsCounter(int x) { return counter * 2 + x; }
+TEST_FUNCTION int Clamps(int x) {
+  if (x < 0) {
+    return 0;
+  }
+  return (x > 100) ? 100 : x + counter;
+}
+
+typedef int (*IntFunction)(int);
+
+static IntFunction originalFunction = nullptr;
+
+TEST_FUNCTION int AddsThousand(int x) {
+  return originalFunction(x) + 1000;
+}
+
+// Calls through a volatile pointer, so the compiler can't assume what it calls
+static int Call(IntFunction function, int x) {
+  IntFunction volatile pointer = function;
+  return pointer(x);
+}
+
+
+// Each function decodes up to its first ret, without failing
+TEST(DecodesCompiledFunctions) {
+  const IntFunction functions[] = { &Helper, &CallsHelper, &ReadsCounter, &Clamps,
+                                    &AddsThousand };
+  for (IntFunction function : functions) {
+    auto *code = reinterpret_cast<const BYTE*>(function);
+    bool returned = false;
+    for (size_t offset = 0; offset < 512 && !returned; ) {
+      Instruction instruction;
+      bool decoded = Decode(code + offset, true, &instruction);
+      CHECK(decoded);
+      if (!decoded) {
+        break;
+      }
+      returned = (code[offset] == 0xC3);
+      offset += instruction.length;
+    }
+    CHECK(returned);
+  }
+}
+
+
+TEST(HooksCompiledFunctions) {
+  const struct {
+    IntFunction function;
+    int argument;
+  } cases[] = {
+    { &CallsHelper,  4   },  // Starts with a relative call, or code before one
+    { &ReadsCounter, 1   },  // Reads a global RIP-relative
+    { &Clamps,       -5  },  // Branches early
+    { &Clamps,       7   },
+    { &Clamps,       500 },
+  };
+
+  for (const auto &test : cases) {
+    int expected = Call(test.function, test.argument);
+    BYTE before[16];
+    memcpy(before, reinterpret_cast<void*>(test.function), sizeof(before));
+
+    auto hook = PatchFunction(reinterpret_cast<void*>(test.function),
+                              reinterpret_cast<void*>(&AddsThousand));
+    REQUIRE(hook != nullptr);
+    originalFunction = reinterpret_cast<IntFunction>(hook->GetTrampoline());
+    REQUIRE(originalFunction != nullptr);
+
+    CHECK(Call(test.function, test.argument) == expected + 1000);
+    CHECK(Call(originalFunction, test.argument) == expected);
+
+    CHECK(hook->Disable());
+    CHECK(Call(test.function, test.argument) == expected);
+    CHECK(hook->Enable());
+    CHECK(Call(test.function, test.argument) == expected + 1000);
+
+    CHECK(Unpatch(hook));
+    CHECK(memcmp(before, reinterpret_cast<void*>(test.function), sizeof(before)) == 0);
+    CHECK(Call(test.function, test.argument) == expected);
+  }
+}
+
+
+TEST(RejectsTooShortFunction) {
+  BYTE before[4];
+  memcpy(before, shortFunction, sizeof(before));
+  CHECK(PatchFunction(const_cast<BYTE*>(shortFunction),
+                      reinterpret_cast<void*>(&AddsThousand)) == nullptr);
+  CHECK(memcmp(before, shortFunction, sizeof(before)) == 0);
+}
+
+
+// Redirects the call in CallsHelper, as the bind hook does the game's call sites
+TEST(RedirectsCompiledCallSite) {
+  auto *code = reinterpret_cast<BYTE*>(&CallsHelper);
+  BYTE *callSite = nullptr;
+  for (size_t offset = 0; offset < 64 && !callSite; ) {
+    Instruction instruction;
+    REQUIRE(Decode(code + offset, true, &instruction));
+    if (code[offset] == 0xE8 &&
+        BranchTarget(code + offset, instruction) ==
+          reinterpret_cast<const BYTE*>(&Helper)) {
+      callSite = code + offset;
+    }
+    offset += instruction.length;
+  }
+  REQUIRE(callSite != nullptr);
+
+  auto redirect = PatchFunctionCall(callSite, reinterpret_cast<void*>(&OtherHelper));
+  REQUIRE(redirect != nullptr);
+  CHECK(Call(&CallsHelper, 4) == 21);
+  CHECK(Call(&Helper, 4) == 12);  // Only the call site changed
+  CHECK(Unpatch(redirect));
+  CHECK(Call(&CallsHelper, 4) == 13);
+}
+
+
+// Classes compiled into this program, with vftables laid out by the Itanium C++
+// ABI that GCC and Clang follow: a virtual destructor takes two entries, complete
+// and deleting, and the object's first pointer is to the first entry, past the
+// offset to top and the type info
+
+class Shape {
+public:
+  Shape() { ++constructed; }
+  virtual ~Shape() {}
+  virtual int Area() const;
+  virtual int Sides() const;
+
+  static int constructed;
+};
+int Shape::constructed = 0;
+
+TEST_FUNCTION int Shape::Area() const  { return 12; }
+TEST_FUNCTION int Shape::Sides() const { return 4; }
+
+// Can only be made from an int, so no dummy can be constructed for its vftable
+class Unconstructible {
+public:
+  explicit Unconstructible(int _value) : value(_value) {}
+  Unconstructible(const Unconstructible&) = delete;
+  virtual int Value() const;
+
+  int value;
+};
+
+TEST_FUNCTION int Unconstructible::Value() const { return value; }
+
+class Found : public Shape {
+public:
+  virtual int Area() const;
+};
+
+TEST_FUNCTION int Found::Area() const { return 6; }
+
+// Replacements, taking the object as their first argument as member functions do
+TEST_FUNCTION int DoubledArea(const Shape *self) { return 100; }
+TEST_FUNCTION int NoSides(const Shape *self)     { return 0; }
+
+// Calls through a volatile pointer to the object, so the call stays virtual
+static int CallArea(const Shape &shape) {
+  const Shape *volatile pointer = &shape;
+  return pointer->Area();
+}
+static int CallSides(const Shape &shape) {
+  const Shape *volatile pointer = &shape;
+  return pointer->Sides();
+}
+
+
+static void* const* VftableOf(const void *object) {
+  return *reinterpret_cast<void* const* const*>(object);
+}
+
+
+TEST(FollowsTheItaniumVftableLayout) {
+  Shape shape;
+  void *const *vftable = VftableOf(&shape);
+  CHECK(GetVftable<Shape>() == vftable);
+  CHECK(PMFCast(&Shape::Area)  == vftable[2]);
+  CHECK(PMFCast(&Shape::Sides) == vftable[3]);
+  CHECK(PMFCast(&Shape::Sides, &shape) == vftable[3]);
+}
+
+
+TEST(ConstructsOneDummyPerClass) {
+  Shape::constructed = 0;
+  void *vftable = GetVftable<Found>();
+  CHECK(vftable != nullptr);
+  CHECK(Shape::constructed <= 1);
+  for (int i = 0; i < 100; ++i) {
+    CHECK(GetVftable<Found>() == vftable);
+    PMFCast(&Found::Area);
+  }
+  CHECK(Shape::constructed <= 1);
+  Found found;
+  CHECK(VftableOf(&found) == vftable);
+}
+
+
+TEST(UsesTheVftableItWasGiven) {
+  CHECK(GetVftable<Unconstructible>() == nullptr);
+  CHECK(PMFCast(&Unconstructible::Value) == nullptr);
+
+  Unconstructible object(7);
+  SetVftable<Unconstructible>(const_cast<void**>(VftableOf(&object)));
+  CHECK(GetVftable<Unconstructible>() == VftableOf(&object));
+  CHECK(PMFCast(&Unconstructible::Value) == VftableOf(&object)[0]);
+}
+
+
+// Headers, and a section of code constructing a Found as MSVC's x64 constructors
+// do: "lea rax, [vftable]; mov [rcx], rax". In this program's image, so the
+// RIP-relative operand reaches the vftable.
+alignas(0x1000) static BYTE codeModule[0x2000];
+
+TEST(FindsTheVftableInCode) {
+  auto *dos = reinterpret_cast<IMAGE_DOS_HEADER*>(codeModule);
+  dos->e_magic  = IMAGE_DOS_SIGNATURE;
+  dos->e_lfanew = 0x80;
+  auto *nt = reinterpret_cast<IMAGE_NT_HEADERS64*>(codeModule + dos->e_lfanew);
+  nt->Signature                       = IMAGE_NT_SIGNATURE;
+  nt->FileHeader.NumberOfSections     = 1;
+  nt->FileHeader.SizeOfOptionalHeader = sizeof(nt->OptionalHeader);
+  nt->OptionalHeader.Magic            = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+  nt->OptionalHeader.SizeOfCode       = 0x1000;
+  IMAGE_SECTION_HEADER *section = IMAGE_FIRST_SECTION(nt);
+  section->Misc.VirtualSize = 0x1000;
+  section->VirtualAddress   = 0x1000;
+  section->Characteristics  = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE;
+
+  Found found;
+  const BYTE constructor[] = { 0x48, 0x8D, 0x05, 0, 0, 0, 0,  // lea rax, [vftable]
+                               0x48, 0x89, 0x01,              // mov [rcx], rax
+                               0xC3 };                        // ret
+  BYTE *code = codeModule + 0x1234;
+  memcpy(code, constructor, sizeof(constructor));
+  auto displacement = static_cast<INT32>(
+    reinterpret_cast<intptr_t>(VftableOf(&found)) -
+    reinterpret_cast<intptr_t>(code + 7));
+  memcpy(code + 3, &displacement, sizeof(displacement));
+
+  SetVftable<Found>(nullptr);
+  CHECK(!FindVftable<Found>("48 8D 05 ? ? ? ? 48 89 02 C3", 3, scanCode,
+                            reinterpret_cast<HMODULE>(codeModule)));
+  CHECK(FindVftable<Found>("48 8D 05 ? ? ? ? 48 89 01 C3", 3, scanCode,
+                           reinterpret_cast<HMODULE>(codeModule)));
+  CHECK(GetVftable<Found>() == VftableOf(&found));
+}
+
+
+TEST(HooksSeveralVirtualFunctionsAtOnce) {
+  Shape shape;
+  void *const *vftable = VftableOf(&shape);
+  void *before[4];
+  memcpy(before, vftable, sizeof(before));
+
+  std::vector<std::shared_ptr<patch>> patches;
+  REQUIRE(PatchFunctionsVirtual<Shape>(
+    { VirtualHook(PMFCast(&Shape::Area), reinterpret_cast<void*>(&DoubledArea)),
+      VirtualHook(3, reinterpret_cast<void*>(&NoSides)) }, &patches));
+  CHECK(patches.size() == 2);
+  CHECK(CallArea(shape) == 100);
+  CHECK(CallSides(shape) == 0);
+  // Derived classes have vftables of their own
+  Found found;
+  CHECK(CallArea(found) == 6);
+
+  for (auto &curPatch : patches) {
+    CHECK(Unpatch(curPatch));
+  }
+  CHECK(memcmp(before, vftable, sizeof(before)) == 0);
+  CHECK(CallArea(shape) == 12);
+  CHECK(CallSides(shape) == 4);
+}
+
+
+TEST(HooksNoneIfAnEntryIsMissing) {
+  Shape shape;
+  void *const *vftable = VftableOf(&shape);
+  void *before[4];
+  memcpy(before, vftable, sizeof(before));
+
+  std::vector<std::shared_ptr<patch>> patches;
+  CHECK(!PatchFunctionsVirtual<Shape>(
+    { VirtualHook(2, reinterpret_cast<void*>(&DoubledArea)),
+      VirtualHook(reinterpret_cast<void*>(&Helper),
+                  reinterpret_cast<void*>(&NoSides)) }, &patches));
+  CHECK(patches.empty());
+  CHECK(memcmp(before, vftable, sizeof(before)) == 0);
+  CHECK(CallArea(shape) == 12);
+}
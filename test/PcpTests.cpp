@@ -0,0 +1,277 @@
+// Tests the PCP client against a FakeGateway on loopback: telling PCP servers from
+// NAT-PMP ones, batched MAP requests and their options, and retransmission. Also
+// how a PortForwarder falls back to NAT-PMP, and reuses what a probe found and a
+// UPnP IGD it checked still answers.
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <memory>
+#include <string>
+#include "FakeGateway.h"
+#include "Netlink.h"
+#include "Pcp.h"
+#include "PortForward.h"
+
+static std::unique_ptr<FakeGateway> StartGateway(int net, int protocols,
+                                                 bool dropsPcp = false,
+                                                 int latencyMs = 0, int capacity = 0) {
+  std::string prefix = "127.0." + std::to_string(net) + ".";
+  FakeGateway::Settings settings;
+  settings.address    = prefix + "1";
+  settings.lanAddress = prefix + "10";
+  settings.externalIp = "203.0.113." + std::to_string(net);
+  settings.protocols  = protocols;
+  settings.dropsPcp   = dropsPcp;
+  settings.latencyMs  = latencyMs;
+  settings.capacity   = capacity;
+  return std::unique_ptr<FakeGateway>(new FakeGateway(settings));
+}
+
+
+static bool OpenTo(PcpClient &pcp, const std::string &address) {
+  sockaddr_in server = {};
+  server.sin_family      = AF_INET;
+  server.sin_port        = htons(5351);
+  server.sin_addr.s_addr = Ip(address.c_str());
+  return pcp.Open(reinterpret_cast<sockaddr*>(&server), sizeof(server));
+}
+
+
+static PcpMapping UdpMapping(int port, DWORD lifetime = 3600) {
+  PcpMapping mapping = {};
+  mapping.protocol     = IPPROTO_UDP;
+  mapping.internalPort = port;
+  mapping.externalPort = port;
+  mapping.lifetime     = lifetime;
+  mapping.result       = pcpNoResponse;
+  return mapping;
+}
+
+
+static std::string ExternalIp(const PcpMapping &mapping) {
+  in_addr address;
+  char text[INET_ADDRSTRLEN] = "";
+  if (PcpUnmapIPv4(mapping.externalIp, &address)) {
+    inet_ntop(AF_INET, &address, text, sizeof(text));
+  }
+  return text;
+}
+
+
+static NetMonitor::Adapter AdapterOn(int net) {
+  std::string prefix = "127.0." + std::to_string(net) + ".";
+  NetMonitor::Adapter adapter = {};
+  adapter.index   = 2;
+  adapter.address = Ip((prefix + "10").c_str());
+  adapter.mask    = Ip("255.255.255.0");
+  adapter.gateway = Ip((prefix + "1").c_str());
+  return adapter;
+}
+
+
+TEST(ProbeTellsPcpFromNatPmp) {
+  auto pcpGateway    = StartGateway(51, FakeGateway::protoPcp),
+       natPmpGateway = StartGateway(52, FakeGateway::protoNatPmp),
+       silent        = StartGateway(53, FakeGateway::protoNatPmp, true);
+  PcpClient pcp;
+
+  REQUIRE(OpenTo(pcp, "127.0.51.1"));
+  CHECK(pcp.Probe() == pcpServerPcp);
+  REQUIRE(OpenTo(pcp, "127.0.52.1"));
+  CHECK(pcp.Probe() == pcpServerNatPmp);
+  REQUIRE(OpenTo(pcp, "127.0.53.1"));
+  CHECK(pcp.Probe(1) == pcpServerNone);
+  CHECK(silent->GetRequests(FakeGateway::protoPcp) == 1);
+  // Nothing listens there at all
+  REQUIRE(OpenTo(pcp, "127.0.54.1"));
+  CHECK(pcp.Probe() == pcpServerUnreachable);
+}
+
+
+TEST(MapsABatchOfPortsAtOnce) {
+  auto gateway = StartGateway(55, FakeGateway::protoPcp, false, 20);
+  PcpClient pcp;
+  REQUIRE(OpenTo(pcp, "127.0.55.1"));
+
+  const int count = 64;
+  PcpMapping mappings[count];
+  for (int i = 0; i < count; ++i) {
+    mappings[i] = UdpMapping(40000 + i);
+  }
+  DWORD start = GetTickCount();
+  CHECK(pcp.Map(mappings, count) == count);
+  // Sent back to back rather than a round trip each
+  CHECK(GetTickCount() - start < 20 * count / 4);
+  CHECK(gateway->GetRequests() == count);
+
+  for (int i = 0; i < count; ++i) {
+    CHECK(mappings[i].result == pcpSuccess);
+    CHECK(mappings[i].externalPort == 40000 + i);
+    CHECK(mappings[i].lifetime == 3600);
+    CHECK(ExternalIp(mappings[i]) == "203.0.113.55");
+    CHECK(gateway->FindMapping(true, 40000 + i));
+  }
+
+  // Lifetime 0 deletes them
+  for (int i = 0; i < count; ++i) {
+    mappings[i] = UdpMapping(40000 + i, 0);
+  }
+  CHECK(pcp.Map(mappings, count) == count);
+  CHECK(gateway->CountMappings() == 0);
+}
+
+
+TEST(PreferFailureKeepsTheExternalPort) {
+  auto gateway = StartGateway(56, FakeGateway::protoPcp);
+  PcpClient pcp;
+  REQUIRE(OpenTo(pcp, "127.0.56.1"));
+
+  // Another LAN host has the port, mapped on its behalf
+  PcpMapping other = UdpMapping(40100);
+  other.thirdParty = true;
+  in_addr otherIp;
+  otherIp.s_addr = Ip("127.0.56.20");
+  PcpMapIPv4(otherIp, &other.thirdPartyIp);
+  REQUIRE(pcp.Map(&other, 1) == 1);
+  FakeGateway::Mapping mapping;
+  REQUIRE(gateway->FindMapping(true, 40100, &mapping));
+  CHECK(mapping.internalIp == "127.0.56.20");
+
+  PcpMapping mine = UdpMapping(40100);
+  mine.preferFailure = true;
+  CHECK(pcp.Map(&mine, 1) == 0);
+  CHECK(mine.result == pcpCannotProvideExternal);
+
+  // Without the option, the gateway picks another
+  mine = UdpMapping(40100);
+  CHECK(pcp.Map(&mine, 1) == 1);
+  CHECK(mine.externalPort != 40100);
+  CHECK(gateway->FindMapping(true, mine.externalPort));
+}
+
+
+TEST(RefreshesAMappingAfterARestart) {
+  auto gateway = StartGateway(57, FakeGateway::protoPcp);
+  PcpMapping mapping = UdpMapping(40200);
+  {
+    PcpClient pcp;
+    REQUIRE(OpenTo(pcp, "127.0.57.1"));
+    REQUIRE(pcp.Map(&mapping, 1) == 1);
+  }
+
+  // The gateway only accepts the nonce the mapping was made with
+  PcpClient pcp;
+  REQUIRE(OpenTo(pcp, "127.0.57.1"));
+  mapping = UdpMapping(40200, 0);
+  CHECK(pcp.Map(&mapping, 1) == 1);
+  CHECK(gateway->CountMappings() == 0);
+}
+
+
+TEST(RetransmitsWhatTheGatewayDropped) {
+  // Takes a few at a time, and drops the rest
+  auto gateway = StartGateway(58, FakeGateway::protoPcp, false, 20, 4);
+  PcpClient pcp;
+  REQUIRE(OpenTo(pcp, "127.0.58.1"));
+
+  const int count = 10;
+  PcpMapping mappings[count];
+  for (int i = 0; i < count; ++i) {
+    mappings[i] = UdpMapping(40300 + i);
+  }
+  CHECK(pcp.Map(mappings, count) == count);
+  CHECK(gateway->GetDropped() > 0);
+  CHECK(gateway->CountMappings() == count);
+}
+
+
+TEST(FallsBackToNatPmpWhenPcpGoesUnanswered) {
+  // Some NAT-PMP servers drop requests of other versions instead of answering them
+  auto gateway = StartGateway(61, FakeGateway::protoNatPmp | FakeGateway::protoUpnp,
+                              true);
+  NetMonitor::Adapter adapter = AdapterOn(61);
+  {
+    PortForwarder forwarder(true, true, &adapter);
+    CHECK(forwarder.IsUsingPmp() && !forwarder.IsUsingPcp());
+    CHECK(std::string(forwarder.GetExternalIp()) == "203.0.113.61");
+    int port = 40400;
+    CHECK(forwarder.ForwardMany(true, &port, 1, const_cast<char*>("Test"),
+                                3600) == 1);
+    CHECK(gateway->FindMapping(true, port));
+  }
+  CHECK(gateway->GetDiscoveries() == 0);
+
+  // The next forwarder through the gateway doesn't wait on the probe again
+  int probes = gateway->GetRequests(FakeGateway::protoPcp);
+  DWORD start = GetTickCount();
+  PortForwarder forwarder(true, true, &adapter);
+  CHECK(forwarder.IsUsingPmp() && !forwarder.IsUsingPcp());
+  CHECK(gateway->GetRequests(FakeGateway::protoPcp) == probes);
+  CHECK(GetTickCount() - start < 250);
+}
+
+
+TEST(ReusesAPcpProbe) {
+  auto gateway = StartGateway(62, FakeGateway::protoAll);
+  NetMonitor::Adapter adapter = AdapterOn(62);
+  {
+    PortForwarder forwarder(true, true, &adapter);
+    CHECK(forwarder.IsUsingPcp());
+  }
+  int probes = gateway->GetRequests(FakeGateway::protoPcp);
+  CHECK(probes == 1);
+
+  PortForwarder forwarder(true, true, &adapter);
+  CHECK(forwarder.IsUsingPcp());
+  CHECK(gateway->GetRequests() == probes);
+}
+
+
+TEST(GoesStraightToUpnpWithoutAPcpServer) {
+  auto gateway = StartGateway(63, FakeGateway::protoUpnp);
+  NetMonitor::Adapter adapter = AdapterOn(63);
+  DWORD start = GetTickCount();
+  PortForwarder forwarder(true, true, &adapter);
+  CHECK(forwarder.IsUsingUpnp());
+  // No waiting on NAT-PMP once the port turned out to be closed
+  CHECK(GetTickCount() - start < 250);
+}
+
+
+TEST(ChecksACachedIgdStillAnswersBeforeReusingIt) {
+  auto gateway = StartGateway(64, FakeGateway::protoUpnp);
+  NetMonitor::Adapter adapter = AdapterOn(64);
+  {
+    PortForwarder forwarder(true, false, &adapter);
+    CHECK(forwarder.IsUsingUpnp());
+  }
+  CHECK(gateway->GetDiscoveries() == 1);
+
+  // Without discovery, but with one SOAP call
+  int requests = gateway->GetRequests();
+  {
+    PortForwarder forwarder(true, false, &adapter);
+    CHECK(forwarder.IsUsingUpnp());
+    CHECK(std::string(forwarder.GetExternalIp()) == "203.0.113.64");
+  }
+  CHECK(gateway->GetDiscoveries() == 1);
+  CHECK(gateway->GetRequests() == requests + 1);
+
+  // A router that restarted with another external address answers for it
+  FakeGateway::Settings settings = gateway->GetSettings();
+  settings.externalIp = "198.51.100.64";
+  gateway.reset();
+  gateway.reset(new FakeGateway(settings));
+  {
+    PortForwarder forwarder(true, false, &adapter);
+    CHECK(forwarder.IsUsingUpnp());
+    CHECK(std::string(forwarder.GetExternalIp()) == "198.51.100.64");
+  }
+  CHECK(gateway->GetDiscoveries() == 0);
+
+  // One that is gone isn't used
+  gateway.reset();
+  PortForwarder forwarder(true, false, &adapter);
+  CHECK(!forwarder.IsUsingUpnp());
+}
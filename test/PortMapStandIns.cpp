@@ -0,0 +1,380 @@
+// Stand-ins for miniupnpc and libnatpmp, so port forwarding links without the
+// submodules. UPnP goes to the FakeGateway that owns the URL, in process; NAT-PMP
+// goes over UDP to the gateway given, as libnatpmp does.
+
+#include "FakeGateway.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdlib.h>
+#include <string>
+#include "../miniupnp/miniupnpc/miniupnpc.h"
+#include "../miniupnp/miniupnpc/miniwget.h"
+#include "../miniupnp/miniupnpc/upnpcommands.h"
+#include "../miniupnp/miniupnpc/upnperrors.h"
+#include "../libnatpmp/natpmp.h"
+
+static const char igdType[] = "urn:schemas-upnp-org:device:InternetGatewayDevice:1";
+
+
+static char* CopyString(const std::string &text) {
+  char *copy = static_cast<char*>(malloc(text.size() + 1));
+  memcpy(copy, text.c_str(), text.size() + 1);
+  return copy;
+}
+
+
+// Acquires the gateway that owns the URL for one call
+class UrlOwner {
+public:
+  explicit UrlOwner(const char *url) : gateway(FakeGateway::AcquireByUrl(url)) { }
+  ~UrlOwner() {
+    if (gateway) {
+      gateway->Release();
+    }
+  }
+  FakeGateway* operator->() { return gateway; }
+  explicit operator bool() const { return gateway != nullptr; }
+
+private:
+  FakeGateway *gateway;
+};
+
+
+UPNPDev* upnpDiscover(int, const char *multicastif, const char*, int, int,
+                      unsigned char, int *error) {
+  if (error) {
+    *error = UPNPDISCOVER_SUCCESS;
+  }
+
+  // Each device and its strings are one allocation, as in miniupnpc
+  UPNPDev *list = nullptr;
+  for (FakeGateway *gateway : FakeGateway::AcquireDiscovered(multicastif)) {
+    std::string descUrl = gateway->GetDescUrl(),
+                usn     = "uuid:fake-" + gateway->GetSettings().address + "::" +
+                          igdType;
+    gateway->Release();
+
+    size_t size = sizeof(UPNPDev) + descUrl.size() + sizeof(igdType) + usn.size() + 1;
+    auto *device = static_cast<UPNPDev*>(calloc(1, size));
+    device->descURL = reinterpret_cast<char*>(device + 1);
+    device->st      = device->descURL + descUrl.size() + 1;
+    device->usn     = device->st + sizeof(igdType);
+    strcpy(device->descURL, descUrl.c_str());
+    strcpy(device->st, igdType);
+    strcpy(device->usn, usn.c_str());
+
+    // Keeps the order they were found in
+    UPNPDev **last = &list;
+    while (*last) {
+      last = &(*last)->pNext;
+    }
+    *last = device;
+  }
+  return list;
+}
+
+
+void freeUPNPDevlist(UPNPDev *devlist) {
+  while (devlist) {
+    UPNPDev *next = devlist->pNext;
+    free(devlist);
+    devlist = next;
+  }
+}
+
+
+void* miniwget_getaddr(const char *url, int *size, char *addr, int addrlen,
+                       unsigned int, int *status_code) {
+  UrlOwner gateway(url);
+  *size = 0;
+  if (addr && addrlen > 0) {
+    addr[0] = '\0';
+  }
+  if (!gateway || !url || strcmp(url, gateway->GetDescUrl().c_str()) != 0) {
+    if (status_code) {
+      *status_code = gateway ? 404 : 0;
+    }
+    return nullptr;
+  }
+
+  std::string description = gateway->UpnpGetDescription();
+  if (addr) {
+    snprintf(addr, addrlen, "%s", gateway->GetSettings().lanAddress.c_str());
+  }
+  if (status_code) {
+    *status_code = 200;
+  }
+  *size = static_cast<int>(description.size());
+  char *copy = static_cast<char*>(malloc(description.size()));
+  memcpy(copy, description.data(), description.size());
+  return copy;
+}
+
+
+void* miniwget(const char *url, int *size, unsigned int scope_id, int *status_code) {
+  return miniwget_getaddr(url, size, nullptr, 0, scope_id, status_code);
+}
+
+
+// URLs are relative to the URLBase of the description, or to the description's
+void GetUPNPUrls(UPNPUrls *urls, IGDdatas *data, const char *descURL, unsigned int) {
+  std::string base = data->urlbase[0] ? data->urlbase : descURL;
+  size_t host = base.find("://");
+  base = base.substr(0, base.find('/', (host == std::string::npos) ? 0 : host + 3));
+
+  memset(urls, 0, sizeof(*urls));
+  urls->controlURL     = CopyString(base + data->first.controlurl);
+  urls->ipcondescURL   = CopyString(base + data->first.scpdurl);
+  urls->controlURL_CIF = CopyString(base + data->CIF.controlurl);
+  urls->controlURL_6FC = CopyString(base + data->IPv6FC.controlurl);
+  urls->rootdescURL    = CopyString(descURL);
+}
+
+
+void FreeUPNPUrls(UPNPUrls *urls) {
+  if (urls) {
+    free(urls->controlURL);
+    free(urls->ipcondescURL);
+    free(urls->controlURL_CIF);
+    free(urls->controlURL_6FC);
+    free(urls->rootdescURL);
+    memset(urls, 0, sizeof(*urls));
+  }
+}
+
+
+int UPNP_GetExternalIPAddress(const char *controlURL, const char*, char *extIpAdd) {
+  UrlOwner gateway(controlURL);
+  if (!extIpAdd) {
+    return UPNPCOMMAND_INVALID_ARGS;
+  }
+  return gateway ? gateway->UpnpGetExternalIp(extIpAdd) : UPNPCOMMAND_HTTP_ERROR;
+}
+
+
+int UPNP_AddPortMapping(const char *controlURL, const char*, const char *extPort,
+                        const char *inPort, const char *inClient, const char*,
+                        const char *proto, const char*, const char *leaseDuration) {
+  UrlOwner gateway(controlURL);
+  if (!extPort || !inPort || !inClient || !proto) {
+    return UPNPCOMMAND_INVALID_ARGS;
+  }
+  return gateway ?
+    gateway->UpnpAddPortMapping(strcmp(proto, "UDP") == 0, atoi(extPort), atoi(inPort),
+                                inClient, leaseDuration ? atoi(leaseDuration) : 0) :
+    UPNPCOMMAND_HTTP_ERROR;
+}
+
+
+int UPNP_DeletePortMapping(const char *controlURL, const char*, const char *extPort,
+                           const char *proto, const char*) {
+  UrlOwner gateway(controlURL);
+  if (!extPort || !proto) {
+    return UPNPCOMMAND_INVALID_ARGS;
+  }
+  return gateway ?
+    gateway->UpnpDeletePortMapping(strcmp(proto, "UDP") == 0, atoi(extPort)) :
+    UPNPCOMMAND_HTTP_ERROR;
+}
+
+
+const char* strupnperror(int err) {
+  switch (err) {
+  case UPNPCOMMAND_SUCCESS:    return "Success";
+  case UPNPCOMMAND_HTTP_ERROR: return "Miniupnpc HTTP error";
+  case 501:                    return "Action Failed";
+  case 714:                    return "NoSuchEntryInArray";
+  case 718:                    return "ConflictInMappingEntry";
+  default:                     return nullptr;
+  }
+}
+
+
+static void SetRetryTime(natpmp_t *p, DWORD delayMs) {
+  DWORD at = GetTickCount() + delayMs;
+  p->retry_time.tv_sec  = static_cast<LONG>(at / 1000);
+  p->retry_time.tv_usec = static_cast<LONG>((at % 1000) * 1000);
+}
+
+
+static int SendPendingRequest(natpmp_t *p) {
+  return (send(p->s, reinterpret_cast<char*>(p->pending_request),
+               p->pending_request_len, 0) == p->pending_request_len) ?
+         p->pending_request_len : NATPMP_ERR_SENDERR;
+}
+
+
+static int SendRequest(natpmp_t *p, const unsigned char *request, int len) {
+  if (!p || p->s == INVALID_SOCKET) {
+    return NATPMP_ERR_INVALIDARGS;
+  }
+  memcpy(p->pending_request, request, len);
+  p->pending_request_len = len;
+  p->has_pending_request = 1;
+  p->try_number = 1;
+  SetRetryTime(p, 250);
+  return SendPendingRequest(p);
+}
+
+
+int initnatpmp(natpmp_t *p, int forcegw, in_addr_t forcedgw) {
+  if (!p) {
+    return NATPMP_ERR_INVALIDARGS;
+  }
+  memset(p, 0, sizeof(*p));
+  p->s = INVALID_SOCKET;
+  if (!forcegw) {
+    return NATPMP_ERR_CANNOTGETGATEWAY;
+  }
+
+  if ((p->s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+    return NATPMP_ERR_SOCKETERROR;
+  }
+  u_long nonBlocking = 1;
+  if (ioctlsocket(p->s, FIONBIO, &nonBlocking) != 0) {
+    closenatpmp(p);
+    return NATPMP_ERR_FCNTLERROR;
+  }
+
+  sockaddr_in gateway = {};
+  gateway.sin_family      = AF_INET;
+  gateway.sin_port        = htons(NATPMP_PORT);
+  gateway.sin_addr.s_addr = forcedgw;
+  p->gateway = forcedgw;
+  if (connect(p->s, reinterpret_cast<sockaddr*>(&gateway), sizeof(gateway)) != 0) {
+    closenatpmp(p);
+    return NATPMP_ERR_CONNECTERR;
+  }
+  return 0;
+}
+
+
+int closenatpmp(natpmp_t *p) {
+  if (!p) {
+    return NATPMP_ERR_INVALIDARGS;
+  }
+  if (p->s != INVALID_SOCKET && closesocket(p->s) != 0) {
+    return NATPMP_ERR_CLOSEERR;
+  }
+  p->s = INVALID_SOCKET;
+  return 0;
+}
+
+
+int sendpublicaddressrequest(natpmp_t *p) {
+  const unsigned char request[2] = { 0, 0 };
+  return SendRequest(p, request, sizeof(request));
+}
+
+
+int sendnewportmappingrequest(natpmp_t *p, int protocol, unsigned short privateport,
+                              unsigned short publicport, unsigned int lifetime) {
+  if (protocol != NATPMP_PROTOCOL_UDP && protocol != NATPMP_PROTOCOL_TCP) {
+    return NATPMP_ERR_INVALIDARGS;
+  }
+  unsigned char request[12] = { 0, static_cast<unsigned char>(protocol) };
+  *reinterpret_cast<u_short*>(&request[4]) = htons(privateport);
+  *reinterpret_cast<u_short*>(&request[6]) = htons(publicport);
+  *reinterpret_cast<u_long*>(&request[8])  = htonl(lifetime);
+  return SendRequest(p, request, sizeof(request));
+}
+
+
+int getnatpmprequesttimeout(natpmp_t *p, timeval *timeout) {
+  if (!p || !timeout) {
+    return NATPMP_ERR_INVALIDARGS;
+  }
+  if (!p->has_pending_request) {
+    return NATPMP_ERR_NOPENDINGREQ;
+  }
+  DWORD at   = static_cast<DWORD>(p->retry_time.tv_sec) * 1000 +
+               static_cast<DWORD>(p->retry_time.tv_usec) / 1000;
+  LONG  left = static_cast<LONG>(at - GetTickCount());
+  left = (left > 0) ? left : 0;
+  timeout->tv_sec  = left / 1000;
+  timeout->tv_usec = (left % 1000) * 1000;
+  return 0;
+}
+
+
+static int ReadResponse(natpmp_t *p, natpmpresp_t *response) {
+  unsigned char buf[16];
+  int len = recv(p->s, reinterpret_cast<char*>(buf), sizeof(buf), 0);
+  if (len < 0) {
+    int error = WSAGetLastError();
+    return (error == WSAEWOULDBLOCK) ? NATPMP_TRYAGAIN :
+           (error == WSAECONNREFUSED || error == WSAECONNRESET) ?
+             NATPMP_ERR_NOGATEWAYSUPPORT : NATPMP_ERR_RECVFROM;
+  }
+  if (len < 8) {
+    return NATPMP_ERR_UNDEFINEDERROR;
+  }
+  if (buf[0] != 0) {
+    return NATPMP_ERR_UNSUPPORTEDVERSION;
+  }
+  if (buf[1] < 128 || buf[1] > 130) {
+    return NATPMP_ERR_UNSUPPORTEDOPCODE;
+  }
+
+  memset(response, 0, sizeof(*response));
+  response->type       = buf[1] & 0x7F;
+  response->resultcode = ntohs(*reinterpret_cast<u_short*>(&buf[2]));
+  response->epoch      = ntohl(*reinterpret_cast<u_long*>(&buf[4]));
+  switch (response->resultcode) {
+  case 0: break;
+  case 1: return NATPMP_ERR_UNSUPPORTEDVERSION;
+  case 2: return NATPMP_ERR_NOTAUTHORIZED;
+  case 3: return NATPMP_ERR_NETWORKFAILURE;
+  case 4: return NATPMP_ERR_OUTOFRESOURCES;
+  case 5: return NATPMP_ERR_UNSUPPORTEDOPCODE;
+  default: return NATPMP_ERR_UNDEFINEDERROR;
+  }
+
+  if (response->type == NATPMP_RESPTYPE_PUBLICADDRESS) {
+    if (len < 12) {
+      return NATPMP_ERR_UNDEFINEDERROR;
+    }
+    memcpy(&response->pnu.publicaddress.addr, &buf[8], 4);
+  }
+  else {
+    if (len < 16) {
+      return NATPMP_ERR_UNDEFINEDERROR;
+    }
+    response->pnu.newportmapping.privateport =
+      ntohs(*reinterpret_cast<u_short*>(&buf[8]));
+    response->pnu.newportmapping.mappedpublicport =
+      ntohs(*reinterpret_cast<u_short*>(&buf[10]));
+    response->pnu.newportmapping.lifetime = ntohl(*reinterpret_cast<u_long*>(&buf[12]));
+  }
+  return 0;
+}
+
+
+int readnatpmpresponseorretry(natpmp_t *p, natpmpresp_t *response) {
+  if (!p || !response) {
+    return NATPMP_ERR_INVALIDARGS;
+  }
+  if (!p->has_pending_request) {
+    return NATPMP_ERR_NOPENDINGREQ;
+  }
+
+  int result = ReadResponse(p, response);
+  if (result != NATPMP_TRYAGAIN) {
+    p->has_pending_request = 0;
+    return result;
+  }
+
+  timeval timeout;
+  getnatpmprequesttimeout(p, &timeout);
+  if (timeout.tv_sec == 0 && timeout.tv_usec == 0) {
+    if (p->try_number >= 9) {
+      p->has_pending_request = 0;
+      return NATPMP_ERR_NOGATEWAYSUPPORT;
+    }
+    SetRetryTime(p, 250 << p->try_number);
+    ++p->try_number;
+    SendPendingRequest(p);
+  }
+  return NATPMP_TRYAGAIN;
+}
+
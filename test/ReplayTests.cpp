@@ -0,0 +1,212 @@
+// Tests NetReplay against captures PacketCapture writes: that it sends the packets
+// it should, oldest first, at the pace asked for, from a socket per peer with -p,
+// and only what a ring that wrapped around still holds
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+#include <vector>
+#include "PacketCapture.h"
+
+// Built by the Makefile, which passes its path
+#ifndef NETREPLAY
+#define NETREPLAY "build/NetReplay"
+#endif
+
+static const char capturePath[] = "/tmp/NetReplayTest.o2pc";
+
+struct Received {
+  std::string data;
+  WORD        fromPort;
+};
+
+
+static sockaddr_in Address(const char *ip, int port) {
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port   = htons(port);
+  inet_pton(AF_INET, ip, &address.sin_addr);
+  return address;
+}
+
+
+static void Capture(CaptureDirection direction, const sockaddr_in &peer,
+                    const std::string &data) {
+  CapturePacket(direction, 1, reinterpret_cast<const sockaddr*>(&peer), sizeof(peer),
+                data.data(), static_cast<int>(data.size()));
+}
+
+
+// A socket for NetReplay to send to
+class Receiver {
+public:
+  Receiver() {
+    s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in local = Address("127.0.0.1", 0);
+    int len = sizeof(local);
+    port = (bind(s, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == 0 &&
+            getsockname(s, reinterpret_cast<sockaddr*>(&local), &len) == 0) ?
+           ntohs(local.sin_port) : 0;
+  }
+  ~Receiver() { closesocket(s); }
+
+  std::string Target() const { return "127.0.0.1:" + std::to_string(port); }
+
+  // Takes what arrived, waiting until nothing more does for a while
+  std::vector<Received> Take() {
+    std::vector<Received> result;
+    for (;;) {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(s, &fds);
+      timeval tv = { 0, 200000 };
+      if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) <= 0) {
+        return result;
+      }
+      char buffer[2048];
+      sockaddr_in from;
+      int fromLen = sizeof(from);
+      int len = recvfrom(s, buffer, sizeof(buffer), 0,
+                         reinterpret_cast<sockaddr*>(&from), &fromLen);
+      if (len >= 0) {
+        result.push_back({ std::string(buffer, len), ntohs(from.sin_port) });
+      }
+    }
+  }
+
+  int port;
+
+private:
+  SOCKET s;
+};
+
+
+// Runs NetReplay on the capture, returning its exit code and what it printed
+static int Replay(const std::string &arguments, std::string *output) {
+  std::string command = std::string(NETREPLAY) + " " + arguments + " " + capturePath;
+  FILE *pipe = popen(command.c_str(), "r");
+  if (!pipe) {
+    return -1;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), pipe)) {
+    *output += line;
+  }
+  int status = pclose(pipe);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+
+// The replay's duration in seconds, from its summary
+static double ReplaySeconds(const std::string &output) {
+  size_t at = output.find(" in ");
+  double seconds = -1;
+  return (at != std::string::npos && sscanf(&output[at], " in %lf s", &seconds) == 1) ?
+         seconds : -1;
+}
+
+
+TEST(ReplaysWhatTheGameSentAtItsPace) {
+  REQUIRE(StartCapture(capturePath, 64 * 1024, 256));
+  sockaddr_in host   = Address("127.0.10.2", 47776),
+              player = Address("127.0.10.3", 47777);
+  DWORD start = GetTickCount();
+  for (int i = 0; i < 10; ++i) {
+    Capture(captureSend, (i % 2) ? player : host, "packet " + std::to_string(i));
+    Capture(captureRecv, host, "reply " + std::to_string(i));
+    Sleep(30);
+  }
+  DWORD capturedMs = GetTickCount() - start - 30;
+  StopCapture();
+
+  Receiver receiver;
+  REQUIRE(receiver.port != 0);
+  std::string output;
+  CHECK(Replay("-t " + receiver.Target() + " -s 2", &output) == 0);
+  std::vector<Received> received = receiver.Take();
+  REQUIRE(received.size() == 10);
+  for (int i = 0; i < 10; ++i) {
+    CHECK(received[i].data == "packet " + std::to_string(i));
+  }
+
+  // Twice as fast as captured, give or take the scheduler
+  double seconds = ReplaySeconds(output);
+  CHECK(seconds >= capturedMs / 2000.0 * 0.9);
+  CHECK(seconds < capturedMs / 1000.0);
+  unlink(capturePath);
+}
+
+
+TEST(ReplaysEachPeerFromItsOwnSocket) {
+  REQUIRE(StartCapture(capturePath, 64 * 1024, 256));
+  sockaddr_in host   = Address("127.0.11.2", 47776),
+              player = Address("127.0.11.3", 47777);
+  for (int i = 0; i < 6; ++i) {
+    Capture(captureSend, (i % 2) ? player : host, "packet " + std::to_string(i));
+    Capture(captureRecv, (i % 2) ? player : host, "reply " + std::to_string(i));
+  }
+  StopCapture();
+
+  Receiver receiver;
+  std::string output;
+  CHECK(Replay("-t " + receiver.Target() + " -s 0 -d all -p", &output) == 0);
+  std::vector<Received> received = receiver.Take();
+  REQUIRE(received.size() == 12);
+  CHECK(received[0].data == "packet 0");
+  CHECK(received[1].data == "reply 0");
+  // Each peer's packets, sent and received, come from one port of its own
+  std::set<WORD> ports;
+  for (size_t i = 0; i < received.size(); ++i) {
+    ports.insert(received[i].fromPort);
+    CHECK(received[i].fromPort == received[i % 4].fromPort);
+  }
+  CHECK(ports.size() == 2);
+
+  // Or just what the game received
+  output.clear();
+  CHECK(Replay("-t " + receiver.Target() + " -s 0 -d recv", &output) == 0);
+  received = receiver.Take();
+  REQUIRE(received.size() == 6);
+  CHECK(received[5].data == "reply 5");
+  unlink(capturePath);
+}
+
+
+TEST(ReplaysWhatAWrappedRingHolds) {
+  // Eight slots of 64 bytes of data each
+  const int slotSize = (sizeof(CaptureRecord) + 64 + 15) & ~15;
+  REQUIRE(StartCapture(capturePath, sizeof(CaptureFileHeader) + 8 * slotSize, 64));
+  sockaddr_in host = Address("127.0.12.2", 47776);
+  for (int i = 0; i < 20; ++i) {
+    Capture(captureSend, host, std::string(100, static_cast<char>('A' + i)));
+  }
+  StopCapture();
+
+  Receiver receiver;
+  std::string output;
+  CHECK(Replay("-t " + receiver.Target() + " -s 0", &output) == 0);
+  CHECK(output.find("8 truncated") != std::string::npos);
+  std::vector<Received> received = receiver.Take();
+  REQUIRE(received.size() == 8);
+  for (int i = 0; i < 8; ++i) {
+    CHECK(received[i].data == std::string(64, static_cast<char>('A' + 12 + i)));
+  }
+  unlink(capturePath);
+}
+
+
+TEST(RefusesOtherFiles) {
+  FILE *file = fopen(capturePath, "w");
+  REQUIRE(file);
+  fputs("Not a capture at all, but long enough to have a header's worth of bytes\n",
+        file);
+  fclose(file);
+  std::string output;
+  CHECK(Replay("-s 0", &output) == 1);
+  unlink(capturePath);
+}
@@ -0,0 +1,158 @@
+// Tests the gateway request limiter against a simulated gateway that can only work
+// on so many requests at once, and times out the rest: that the window settles
+// near the gateway's capacity, with throughput close to what the capacity allows
+// and few requests lost to overload. Also that a stalled request holds back
+// growth even across the GetTickCount wraparound.
+
+#include "Test.h"
+#include <windows.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "RequestLimiter.h"
+#include "Shim.h"
+
+namespace {
+
+// Answers after latencyMs while it works on at most capacity requests, or 0 for
+// no limit; requests beyond that go unanswered, as they time out after timeoutMs
+class CapacityGateway {
+public:
+  CapacityGateway(int capacity, int latencyMs, int timeoutMs = 250)
+    : capacity(capacity), latencyMs(latencyMs), timeoutMs(timeoutMs), working(0),
+      maxWorking(0), overloads(0) {}
+
+  RequestOutcome Serve() {
+    int now = ++working;
+    if (capacity > 0 && now > capacity) {
+      --working;
+      ++overloads;
+      Sleep(timeoutMs);
+      return requestOverloaded;
+    }
+    int max = maxWorking;
+    while (now > max && !maxWorking.compare_exchange_weak(max, now)) { }
+    Sleep(latencyMs);
+    --working;
+    return requestOk;
+  }
+
+  int capacity,
+      latencyMs,
+      timeoutMs;
+  std::atomic<int> working,
+                   maxWorking,
+                   overloads;
+};
+
+} // anonymous namespace
+
+
+// Has clients threads send requests through the limiter until count of them
+// succeeded, retrying the ones that timed out. Returns the milliseconds taken.
+static DWORD Drive(RequestLimiter &limiter, CapacityGateway &gateway, int count,
+                   int clients) {
+  std::atomic<int> remaining(count);
+  DWORD start = GetTickCount();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < clients; ++i) {
+    threads.emplace_back([&] {
+      while (remaining-- > 0) {
+        RequestTicket ticket = limiter.Acquire();
+        RequestOutcome outcome = gateway.Serve();
+        limiter.Release(ticket, outcome);
+        if (outcome != requestOk) {
+          ++remaining;
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return GetTickCount() - start;
+}
+
+
+TEST(SettlesNearTheGatewaysCapacity) {
+  RequestLimiter limiter("capacity 6");
+  CapacityGateway gateway(6, 20);
+  const int count = 600;
+  DWORD elapsed = Drive(limiter, gateway, count, 16);
+
+  // At best the gateway answers 6 requests every 20 ms
+  DWORD optimal = count / 6 * 20;
+  CHECK(elapsed < optimal * 10 / 7);
+  // Only the requests that probe past the capacity time out, fewer as it learns
+  CHECK(gateway.overloads < count / 40);
+  CHECK(limiter.GetWindow() >= 3 && limiter.GetWindow() <= 7);
+}
+
+
+TEST(SendsOneAtATimeToAGatewayThatTakesOne) {
+  RequestLimiter limiter("capacity 1");
+  CapacityGateway gateway(1, 10);
+  const int count = 200;
+  DWORD elapsed = Drive(limiter, gateway, count, 8);
+
+  CHECK(elapsed < count * 10 * 10 / 7);
+  CHECK(gateway.overloads < count / 20);
+  CHECK(limiter.GetWindow() == 1);
+}
+
+
+TEST(GrowsToItsLimitWithAGatewayThatTakesAny) {
+  RequestLimiter limiter("unlimited");
+  CapacityGateway gateway(0, 10);
+  Drive(limiter, gateway, 1000, 32);
+
+  CHECK(limiter.GetWindow() == 16);
+  // The limiter never lets more out than its window
+  CHECK(gateway.maxWorking <= 16);
+  CHECK(gateway.maxWorking >= 14);
+}
+
+
+TEST(KeepsWhatItLearnedPerGateway) {
+  std::shared_ptr<RequestLimiter> limiter = RequestLimiter::ForGateway("PCP 10.0.0.1");
+  CapacityGateway gateway(4, 10);
+  Drive(*limiter, gateway, 200, 8);
+  int learned = limiter->GetWindow();
+
+  CHECK(RequestLimiter::ForGateway("PCP 10.0.0.1") == limiter);
+  CHECK(RequestLimiter::ForGateway("PCP 10.0.0.1")->GetWindow() == learned);
+  CHECK(RequestLimiter::ForGateway("NAT-PMP 10.0.0.1")->GetWindow() == 2);
+}
+
+
+TEST(WaitsForAStalledRequestAcrossTheTickWrap) {
+  RequestLimiter limiter("wrap");
+  // Fast answers grow the window from 2 to 3
+  for (int i = 0; i < 4; ++i) {
+    limiter.Release(limiter.Acquire(), requestOk);
+  }
+  REQUIRE(limiter.GetWindow() == 3);
+
+  // One request goes out just before GetTickCount wraps, and stalls
+  ShimSetTickCount(MAXDWORD - 20);
+  RequestTicket stalled = limiter.Acquire();
+  Sleep(60);
+  REQUIRE(GetTickCount() < 1000);
+
+  // Fast answers after the wrap don't grow the window while it is out, although
+  // their send times are lower than its
+  for (int i = 0; i < 8; ++i) {
+    RequestTicket tickets[2];
+    int count = limiter.Acquire(tickets, 2);
+    for (int j = 0; j < count; ++j) {
+      limiter.Release(tickets[j], requestOk);
+    }
+  }
+  CHECK(limiter.GetWindow() == 3);
+
+  limiter.Release(stalled, requestOk);
+  for (int i = 0; i < 8; ++i) {
+    limiter.Release(limiter.Acquire(), requestOk);
+  }
+  CHECK(limiter.GetWindow() > 3);
+}
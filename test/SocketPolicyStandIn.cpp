@@ -0,0 +1,11 @@
+// Stand-in for the socket policy, recording which socket it was applied to last
+
+#include "NetStandIns.h"
+#include "SocketPolicy.h"
+
+SOCKET StandIns::policySocket = INVALID_SOCKET;
+
+int ApplySocketPolicy(SOCKET s) {
+  StandIns::policySocket = s;
+  return 0;
+}
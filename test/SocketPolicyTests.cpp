@@ -0,0 +1,183 @@
+// Tests the socket policy on real loopback sockets, bound through the game image's
+// bind call sites with the bind patches applied, checking the options the sockets
+// end up with and what GetSocketPolicyApplied and the stats report
+
+#include "Test.h"
+#include "GameImage.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <memory>
+#include "Config.h"
+#include "NetPatches.h"
+#include "SocketPolicy.h"
+
+// The settings the policy is read from, in place of Config.cpp
+static std::shared_ptr<const Config> config = std::make_shared<Config>();
+
+std::shared_ptr<const Config> GetConfig() {
+  return config;
+}
+
+
+static void SetPolicy(const SocketPolicy &policy) {
+  auto newConfig = std::make_shared<Config>();
+  newConfig->socketPolicy = policy;
+  config = newConfig;
+}
+
+
+static SocketPolicy NoPolicy() {
+  SocketPolicy policy = {};
+  policy.dscp = -1;
+  return policy;
+}
+
+
+// Makes a socket and binds it to a loopback port the OS picks, through the
+// game's first bind call site
+static SOCKET BindThroughGame(int type) {
+  SOCKET s = socket(AF_INET, type, (type == SOCK_DGRAM) ? IPPROTO_UDP : IPPROTO_TCP);
+  if (s == INVALID_SOCKET) {
+    return s;
+  }
+  sockaddr_in name = {};
+  name.sin_family = AF_INET;
+  inet_pton(AF_INET, "127.0.0.1", &name.sin_addr);
+  if (GameImage::CallBindSite(GameImage::bindCalls[0], s, &name, sizeof(name)) != 0) {
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+  return s;
+}
+
+
+static int GetIntOption(SOCKET s, int level, int name) {
+  int value = -1,
+      len   = sizeof(value);
+  return (getsockopt(s, level, name, reinterpret_cast<char*>(&value), &len) == 0) ?
+         value : -1;
+}
+
+
+static bool IsNonBlocking(SOCKET s) {
+  char buffer[16];
+  return recv(s, buffer, sizeof(buffer), 0) == SOCKET_ERROR &&
+         WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+
+// Loads the game image with its bind import going to Winsock, and patches it
+class PatchedGame {
+public:
+  PatchedGame() {
+    image   = GameImage::Load(GameImage::gameLayout,
+                              reinterpret_cast<const void*>(&bind));
+    patched = image && SetBindPatches(true, false);
+  }
+  ~PatchedGame() {
+    SetBindPatches(false);
+    if (image) {
+      GameImage::Unload(image);
+    }
+  }
+
+  bool IsPatched() { return patched; }
+
+private:
+  HMODULE image;
+  bool    patched;
+};
+
+
+TEST(AppliesThePolicyToUdpSockets) {
+  PatchedGame game;
+  REQUIRE(game.IsPatched());
+
+  SocketPolicy policy = NoPolicy();
+  policy.recvBufSize    = 64 * 1024;
+  policy.sendBufSize    = 32 * 1024;
+  policy.dscp           = 46;  // Expedited forwarding
+  policy.noUdpConnReset = true;
+  policy.tcpNoDelay     = true;
+  policy.nonBlocking    = true;
+  SetPolicy(policy);
+  SocketPolicyStats before = GetSocketPolicyStats();
+
+  SOCKET s = BindThroughGame(SOCK_DGRAM);
+  REQUIRE(s != INVALID_SOCKET);
+  CHECK(GetSocketPolicyApplied(s) == (policyRecvBuf | policySendBuf | policyDscp |
+                                      policyNoConnReset | policyNonBlocking));
+  // Linux doubles buffer sizes for its bookkeeping
+  CHECK(GetIntOption(s, SOL_SOCKET, SO_RCVBUF) >= 64 * 1024);
+  CHECK(GetIntOption(s, SOL_SOCKET, SO_SNDBUF) >= 32 * 1024);
+  CHECK(GetIntOption(s, IPPROTO_IP, IP_TOS) == 46 << 2);
+  CHECK(IsNonBlocking(s));
+
+  const SocketPolicyStats &after = GetSocketPolicyStats();
+  CHECK(after.udpSockets  == before.udpSockets + 1);
+  CHECK(after.tcpSockets  == before.tcpSockets);
+  CHECK(after.dscp        == before.dscp + 1);
+  CHECK(after.noConnReset == before.noConnReset + 1);
+  CHECK(after.noDelay     == before.noDelay);
+  closesocket(s);
+}
+
+
+TEST(AppliesNoDelayToTcpSockets) {
+  PatchedGame game;
+  REQUIRE(game.IsPatched());
+
+  SocketPolicy policy = NoPolicy();
+  policy.noUdpConnReset = true;
+  policy.tcpNoDelay     = true;
+  SetPolicy(policy);
+  SocketPolicyStats before = GetSocketPolicyStats();
+
+  SOCKET s = BindThroughGame(SOCK_STREAM);
+  REQUIRE(s != INVALID_SOCKET);
+  CHECK(GetSocketPolicyApplied(s) == policyNoDelay);
+  CHECK(GetIntOption(s, IPPROTO_TCP, TCP_NODELAY) != 0);
+  CHECK(!IsNonBlocking(s));
+  CHECK(GetSocketPolicyStats().tcpSockets == before.tcpSockets + 1);
+  CHECK(GetSocketPolicyStats().noDelay == before.noDelay + 1);
+  closesocket(s);
+}
+
+
+TEST(LeavesSocketsAloneWithoutAPolicy) {
+  PatchedGame game;
+  REQUIRE(game.IsPatched());
+  SetPolicy(NoPolicy());
+  CHECK(!IsSocketPolicyEnabled());
+
+  SOCKET plain = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  SOCKET s = BindThroughGame(SOCK_DGRAM);
+  REQUIRE(plain != INVALID_SOCKET && s != INVALID_SOCKET);
+  CHECK(GetSocketPolicyApplied(s) == 0);
+  CHECK(GetIntOption(s, SOL_SOCKET, SO_RCVBUF) ==
+        GetIntOption(plain, SOL_SOCKET, SO_RCVBUF));
+  CHECK(GetIntOption(s, IPPROTO_IP, IP_TOS) == 0);
+  closesocket(s);
+  closesocket(plain);
+}
+
+
+TEST(ReportsTheNewestSocketWithAReusedHandle) {
+  PatchedGame game;
+  REQUIRE(game.IsPatched());
+
+  SocketPolicy policy = NoPolicy();
+  policy.dscp = 34;
+  SetPolicy(policy);
+  SOCKET first = BindThroughGame(SOCK_DGRAM);
+  REQUIRE(first != INVALID_SOCKET);
+  CHECK(GetSocketPolicyApplied(first) == policyDscp);
+  closesocket(first);
+
+  // POSIX hands out the lowest free descriptor, so the handle comes back
+  SetPolicy(NoPolicy());
+  SOCKET second = BindThroughGame(SOCK_DGRAM);
+  REQUIRE(second == first);
+  CHECK(GetSocketPolicyApplied(second) == 0);
+  closesocket(second);
+}
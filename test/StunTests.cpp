@@ -0,0 +1,274 @@
+// Tests STUN discovery against stand-in servers on loopback, each answering binding
+// requests with the mapping a NAT in front of the game would give it: the address
+// published from the first answer, the NAT type told from several, retransmission,
+// classic servers, stray answers, and the cache lifetime
+
+#include "Test.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "Netlink.h"
+#include "Stun.h"
+
+namespace {
+
+// A STUN server answering binding requests on its own address
+class StunStandIn {
+public:
+  struct Settings {
+    std::string address    = "127.0.90.1";
+    std::string mappedIp   = "203.0.113.7";
+    int  mappedPort        = 0;      // Or 0 to keep the requester's, as cone NATs
+                                     // commonly do
+    bool xorMapped         = true;   // Or MAPPED-ADDRESS only, as RFC 3489 servers
+    bool wrongTransaction  = false;  // Answer with a transaction ID of its own
+    int  ignoreFirst       = 0;      // Requests dropped before answering
+    int  delayMs           = 0;      // Before each answer
+  };
+
+  explicit StunStandIn(const Settings &settings)
+    : settings(settings), silent(false), stopping(false), requests(0) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, settings.address.c_str(), &address.sin_addr);
+    s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int len = sizeof(address);
+    if (s == INVALID_SOCKET ||
+        bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        getsockname(s, reinterpret_cast<sockaddr*>(&address), &len) != 0) {
+      return;
+    }
+    char name[64];
+    sprintf_s(name, sizeof(name), "%s:%d", settings.address.c_str(),
+              ntohs(address.sin_port));
+    this->name = name;
+    thread = std::thread([this] { Serve(); });
+  }
+  ~StunStandIn() {
+    stopping = true;
+    if (thread.joinable()) {
+      thread.join();
+    }
+    closesocket(s);
+  }
+
+  // As given to StartStun
+  const std::string& Name() const { return name; }
+  int  Requests() const { return requests; }
+  // Stops answering, as if the server went away
+  void Silence() { silent = true; }
+
+private:
+  void Serve() {
+    int ignored = 0;
+    while (!stopping) {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(s, &fds);
+      timeval tv = { 0, 20000 };
+      if (select(FD_SETSIZE, &fds, nullptr, nullptr, &tv) != 1) {
+        continue;
+      }
+      BYTE request[576];
+      sockaddr_in from;
+      int fromLen = sizeof(from);
+      int len = recvfrom(s, reinterpret_cast<char*>(request), sizeof(request), 0,
+                         reinterpret_cast<sockaddr*>(&from), &fromLen);
+      // A binding request has no attributes here
+      if (len != 20 || request[0] != 0x00 || request[1] != 0x01) {
+        continue;
+      }
+      ++requests;
+      if (silent || ignored++ < settings.ignoreFirst) {
+        continue;
+      }
+      if (settings.delayMs > 0) {
+        Sleep(settings.delayMs);
+      }
+      Answer(request, from);
+    }
+  }
+
+  void Answer(const BYTE *request, const sockaddr_in &from) {
+    BYTE answer[32] = { 0x01, 0x01, 0x00, 12 };
+    memcpy(answer + 4, request + 4, 16);  // Magic cookie and transaction ID
+    if (settings.wrongTransaction) {
+      answer[19] ^= 0xFF;
+    }
+
+    WORD  port = settings.mappedPort ? htons(settings.mappedPort) : from.sin_port;
+    DWORD address;
+    inet_pton(AF_INET, settings.mappedIp.c_str(), &address);
+    BYTE *attribute = answer + 20;
+    attribute[1] = settings.xorMapped ? 0x20 : 0x01;
+    attribute[3] = 8;
+    attribute[5] = 0x01;  // IPv4
+    if (settings.xorMapped) {
+      port    ^= htons(0x2112);
+      address ^= htonl(0x2112A442);
+    }
+    memcpy(attribute + 6, &port, sizeof(port));
+    memcpy(attribute + 8, &address, sizeof(address));
+    sendto(s, reinterpret_cast<const char*>(answer), sizeof(answer), 0,
+           reinterpret_cast<const sockaddr*>(&from), sizeof(from));
+  }
+
+  Settings          settings;
+  SOCKET            s;
+  std::string       name;
+  std::thread       thread;
+  std::atomic<bool> silent,
+                    stopping;
+  std::atomic<int>  requests;
+};
+
+
+StunStandIn::Settings Server(const char *address) {
+  StunStandIn::Settings settings;
+  settings.address = address;
+  return settings;
+}
+
+} // anonymous namespace
+
+
+// Waits up to timeoutMs for an address. Returns it, or an empty string.
+static std::string WaitForAddress(DWORD timeoutMs) {
+  DWORD start = GetTickCount();
+  char address[INET_ADDRSTRLEN];
+  do {
+    if (GetStunAddress(address, sizeof(address))) {
+      return address;
+    }
+    Sleep(10);
+  } while (GetTickCount() - start < timeoutMs);
+  return "";
+}
+
+
+// The type is only known once the query ends
+static NatType WaitForNatType(DWORD timeoutMs) {
+  DWORD start = GetTickCount();
+  while (GetNatType() == natUnknown && GetTickCount() - start < timeoutMs) {
+    Sleep(10);
+  }
+  return GetNatType();
+}
+
+
+TEST(PublishesTheFirstAnswer) {
+  StunStandIn::Settings slow = Server("127.0.90.2");
+  slow.delayMs = 700;
+  StunStandIn fast(Server("127.0.90.1")),
+              late(slow);
+  REQUIRE(StartStun({ fast.Name(), late.Name() }, 60));
+
+  // Without waiting for the slow server
+  DWORD start = GetTickCount();
+  CHECK(WaitForAddress(1000) == "203.0.113.7");
+  CHECK(GetTickCount() - start < 400);
+  // Which maps the socket the same way
+  CHECK(WaitForNatType(2000) == natEndpointIndependent);
+  StopStun();
+}
+
+
+TEST(TellsASymmetricNatFromItsPorts) {
+  StunStandIn::Settings first = Server("127.0.91.1"),
+                        second = Server("127.0.91.2");
+  first.mappedPort  = 40001;
+  second.mappedPort = 40002;
+  StunStandIn one(first),
+              two(second);
+  REQUIRE(StartStun({ one.Name(), two.Name() }, 60));
+  CHECK(WaitForAddress(1000) == "203.0.113.7");
+  CHECK(WaitForNatType(2000) == natSymmetric);
+  StopStun();
+}
+
+
+TEST(ReadsClassicServersMappedAddress) {
+  StunStandIn::Settings classic = Server("127.0.92.1");
+  classic.xorMapped = false;
+  classic.mappedIp  = "198.51.100.9";
+  StunStandIn server(classic);
+  REQUIRE(StartStun({ server.Name() }, 60));
+  CHECK(WaitForAddress(1000) == "198.51.100.9");
+  // One answer can't tell the mapping behavior
+  Sleep(100);
+  CHECK(GetNatType() == natUnknown);
+  StopStun();
+}
+
+
+TEST(RetransmitsUntilAnswered) {
+  StunStandIn::Settings lossy = Server("127.0.93.1");
+  lossy.ignoreFirst = 2;
+  StunStandIn server(lossy);
+  REQUIRE(StartStun({ server.Name() }, 60));
+  // Every 500 ms, within the 1.5 s a query lasts
+  CHECK(WaitForAddress(1500) == "203.0.113.7");
+  CHECK(server.Requests() == 3);
+  StopStun();
+}
+
+
+TEST(IgnoresAnswersToOtherTransactions) {
+  StunStandIn::Settings stray = Server("127.0.94.1");
+  stray.wrongTransaction = true;
+  StunStandIn server(stray);
+  REQUIRE(StartStun({ server.Name() }, 60));
+  CHECK(WaitForAddress(1700) == "");
+  CHECK(GetNatType() == natUnknown);
+  StopStun();
+}
+
+
+TEST(ReportsNoNatForALocalAddress) {
+  ShimResetNetwork();
+  Netlink()
+    .Link(2, "eth0", true)
+    .Address(2, "198.51.100.20", 24)
+    .Apply();
+  StunStandIn::Settings direct = Server("127.0.95.1");
+  direct.mappedIp = "198.51.100.20";
+  StunStandIn server(direct);
+  REQUIRE(StartStun({ server.Name() }, 60));
+  CHECK(WaitForAddress(1000) == "198.51.100.20");
+  CHECK(WaitForNatType(1000) == natNone);
+  StopStun();
+  ShimResetNetwork();
+}
+
+
+TEST(RefreshesTheAddressBeforeItExpires) {
+  StunStandIn server(Server("127.0.96.1"));
+  REQUIRE(StartStun({ server.Name() }, 1));
+  CHECK(WaitForAddress(1000) == "203.0.113.7");
+
+  // Queried again at 900 ms, and at 1.8 s
+  Sleep(2000);
+  CHECK(WaitForAddress(0) == "203.0.113.7");
+  CHECK(server.Requests() == 3);
+
+  // Stopping forgets it
+  StopStun();
+  CHECK(WaitForAddress(0) == "");
+}
+
+
+TEST(ExpiresTheAddressWhenServersStopAnswering) {
+  StunStandIn server(Server("127.0.97.1"));
+  REQUIRE(StartStun({ server.Name() }, 1));
+  CHECK(WaitForAddress(1000) == "203.0.113.7");
+  server.Silence();
+
+  // The refresh at 900 ms goes unanswered, and the address lapses at 1 s
+  Sleep(1300);
+  CHECK(WaitForAddress(0) == "");
+  StopStun();
+}
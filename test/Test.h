@@ -0,0 +1,47 @@
+
+#ifndef TEST_H
+#define TEST_H
+
+// A minimal test framework. Tests are registered with TEST(name) { ... }, and
+// CHECK failures are reported without stopping the test; REQUIRE stops it.
+
+#include <stdio.h>
+#include <vector>
+
+namespace Test {
+
+typedef void (*TestFunction)();
+
+struct TestCase {
+  const char   *name;
+  TestFunction  function;
+};
+
+std::vector<TestCase>& Registry();
+void Fail(const char *file, int line, const char *expression);
+
+struct Registrar {
+  Registrar(const char *name, TestFunction function) {
+    Registry().push_back({ name, function });
+  }
+};
+
+} // namespace Test
+
+#define TEST(name) \
+  static void name(); \
+  static Test::Registrar name##Registrar(#name, &name); \
+  static void name()
+
+#define CHECK(expression) \
+  ((expression) ? (void)0 : Test::Fail(__FILE__, __LINE__, #expression))
+
+#define REQUIRE(expression) \
+  do { \
+    if (!(expression)) { \
+      Test::Fail(__FILE__, __LINE__, #expression); \
+      return; \
+    } \
+  } while (0)
+
+#endif
@@ -0,0 +1,51 @@
+// Runs the tests registered in the program, or those named on the command line
+
+#include "Test.h"
+#include <string.h>
+
+namespace Test {
+
+static int failures = 0;
+
+
+std::vector<TestCase>& Registry() {
+  static std::vector<TestCase> registry;
+  return registry;
+}
+
+
+void Fail(const char *file, int line, const char *expression) {
+  printf("  %s(%d): %s failed\n", file, line, expression);
+  ++failures;
+}
+
+} // namespace Test
+
+
+int main(int argc, char **argv) {
+  int run    = 0,
+      failed = 0;
+  for (const Test::TestCase &test : Test::Registry()) {
+    bool selected = (argc < 2);
+    for (int i = 1; i < argc; ++i) {
+      selected = selected || strcmp(argv[i], test.name) == 0;
+    }
+    if (!selected) {
+      continue;
+    }
+
+    int before = Test::failures;
+    test.function();
+    ++run;
+    if (Test::failures != before) {
+      printf("FAIL %s\n", test.name);
+      ++failed;
+    }
+    else {
+      printf("ok   %s\n", test.name);
+    }
+  }
+
+  printf("%d of %d tests passed\n", run - failed, run);
+  return failed ? 1 : 0;
+}
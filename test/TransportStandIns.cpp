@@ -0,0 +1,46 @@
+// Stand-ins for the transport's own modules: the handshake, coalescing and
+// compression that peers negotiate, the receive engine, and the PeerTable and
+// RecvQueue they share. Apart from the rest so benchmarks can use the real ones.
+
+#include "NetStandIns.h"
+#include "Coalesce.h"
+#include "Compress.h"
+#include "Handshake.h"
+#include "PeerTable.h"
+#include "RecvEngine.h"
+#include "RecvQueue.h"
+
+bool CoalesceSend(SOCKET, const char*, int, const sockaddr*, int, int) {
+  return false;
+}
+
+int CompressSend(SOCKET s, const char *buf, int len, int flags, const sockaddr *to,
+                 int toLen, int) {
+  return sendto(s, buf, len, flags, to, toLen);
+}
+
+bool IsHandshakeEnabled() { return false; }
+void HandshakeOnSend(SOCKET, const sockaddr*, int, int) {}
+bool IsControlPacket(const char*, int) { return false; }
+void HandleControlPacket(SOCKET, const char*, int, const sockaddr*, int, int) {}
+
+int PeerTable::GetPeerId(const sockaddr*, int)  { return -1; }
+int PeerTable::FindPeerId(const sockaddr*, int) { return -1; }
+
+bool IsRecvEngineEnabled() { return false; }
+bool RecvEngineAttach(SOCKET, bool) { return false; }
+void RecvEngineDetach(SOCKET) {}
+bool IsRecvEngineSocket(SOCKET) { return false; }
+void RecvEngineSetNonBlocking(SOCKET, bool) {}
+int  RecvEnginePop(SOCKET s, char *buf, int len, int flags, sockaddr *from,
+                   int *fromLen) {
+  return recvfrom(s, buf, len, flags, from, fromLen);
+}
+bool RecvEngineHasData(SOCKET) { return false; }
+HANDLE RecvEngineBeginWait() { return nullptr; }
+void   RecvEngineEndWait(HANDLE) {}
+
+bool RecvQueuePush(SOCKET, const char*, int, const sockaddr*, int) { return false; }
+bool RecvQueuePop(SOCKET, char*, int, sockaddr*, int*, int*, bool) { return false; }
+bool RecvQueueHasData(SOCKET) { return false; }
+void RecvQueueClear(SOCKET) {}
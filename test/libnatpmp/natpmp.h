@@ -0,0 +1,89 @@
+
+#ifndef NATPMP_H_INCLUDED
+#define NATPMP_H_INCLUDED
+
+// Stand-in for libnatpmp, with the same types, signatures and retry schedule: a
+// request is sent again after 250 ms, doubling each time, and given up on after 9
+// tries. Unlike libnatpmp, the gateway must be given. src includes it as
+// ../libnatpmp/natpmp.h, which resolves here through -Ishim while the submodule
+// isn't checked out.
+
+#include <winsock2.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NATPMP_PORT 5351
+
+typedef u_long in_addr_t;
+
+typedef struct {
+  SOCKET        s;
+  in_addr_t     gateway;
+  int           has_pending_request;
+  unsigned char pending_request[12];
+  int           pending_request_len;
+  int           try_number;
+  struct timeval retry_time;
+} natpmp_t;
+
+typedef struct {
+  unsigned short type;
+  unsigned short resultcode;
+  unsigned int   epoch;
+  union {
+    struct {
+      struct in_addr addr;
+    } publicaddress;
+    struct {
+      unsigned short privateport;
+      unsigned short mappedpublicport;
+      unsigned int   lifetime;
+    } newportmapping;
+  } pnu;
+} natpmpresp_t;
+
+#define NATPMP_RESPTYPE_PUBLICADDRESS  0
+#define NATPMP_RESPTYPE_UDPPORTMAPPING 1
+#define NATPMP_RESPTYPE_TCPPORTMAPPING 2
+
+#define NATPMP_PROTOCOL_UDP 1
+#define NATPMP_PROTOCOL_TCP 2
+
+#define NATPMP_ERR_INVALIDARGS        (-1)
+#define NATPMP_ERR_SOCKETERROR        (-2)
+#define NATPMP_ERR_CANNOTGETGATEWAY   (-3)
+#define NATPMP_ERR_CLOSEERR           (-4)
+#define NATPMP_ERR_RECVFROM           (-5)
+#define NATPMP_ERR_NOPENDINGREQ       (-6)
+#define NATPMP_ERR_NOGATEWAYSUPPORT   (-7)
+#define NATPMP_ERR_CONNECTERR         (-8)
+#define NATPMP_ERR_WRONGPACKETSOURCE  (-9)
+#define NATPMP_ERR_SENDERR            (-10)
+#define NATPMP_ERR_FCNTLERROR         (-11)
+#define NATPMP_ERR_GETTIMEOFDAYERR    (-12)
+#define NATPMP_ERR_UNSUPPORTEDVERSION (-14)
+#define NATPMP_ERR_UNSUPPORTEDOPCODE  (-15)
+#define NATPMP_ERR_UNDEFINEDERROR     (-49)
+#define NATPMP_ERR_NOTAUTHORIZED      (-51)
+#define NATPMP_ERR_NETWORKFAILURE     (-52)
+#define NATPMP_ERR_OUTOFRESOURCES     (-53)
+#define NATPMP_TRYAGAIN               (-100)
+
+int initnatpmp(natpmp_t *p, int forcegw, in_addr_t forcedgw);
+int closenatpmp(natpmp_t *p);
+// Return the length of the request sent, or a negative error
+int sendpublicaddressrequest(natpmp_t *p);
+int sendnewportmappingrequest(natpmp_t *p, int protocol, unsigned short privateport,
+                              unsigned short publicport, unsigned int lifetime);
+int getnatpmprequesttimeout(natpmp_t *p, struct timeval *timeout);
+// Reads the response to the pending request, or sends it again if it's time to.
+// Returns 0 with the response, NATPMP_TRYAGAIN until then, or an error.
+int readnatpmpresponseorretry(natpmp_t *p, natpmpresp_t *response);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
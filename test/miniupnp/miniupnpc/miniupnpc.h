@@ -0,0 +1,70 @@
+
+#ifndef MINIUPNPC_H_INCLUDED
+#define MINIUPNPC_H_INCLUDED
+
+// Stand-in for miniupnpc's discovery API, with the same types and signatures.
+// Discovery finds the UPnP gateways of FakeGateway.h in process instead of sending
+// SSDP searches. src includes it as ../miniupnp/miniupnpc/miniupnpc.h, which
+// resolves here through -Ishim while the submodule isn't checked out.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MINIUPNPC_URL_MAXSIZE 128
+
+#define UPNPDISCOVER_SUCCESS       0
+#define UPNPDISCOVER_UNKNOWN_ERROR (-1)
+
+struct UPNPDev {
+  struct UPNPDev *pNext;
+  char           *descURL;
+  char           *st;
+  char           *usn;
+  unsigned int    scope_id;
+  char            buffer[3];
+};
+
+struct IGDdatas_service {
+  char controlurl[MINIUPNPC_URL_MAXSIZE];
+  char eventsuburl[MINIUPNPC_URL_MAXSIZE];
+  char scpdurl[MINIUPNPC_URL_MAXSIZE];
+  char servicetype[MINIUPNPC_URL_MAXSIZE];
+};
+
+struct IGDdatas {
+  char cureltname[MINIUPNPC_URL_MAXSIZE];
+  char urlbase[MINIUPNPC_URL_MAXSIZE];
+  char presentationurl[MINIUPNPC_URL_MAXSIZE];
+  int  level;
+  struct IGDdatas_service CIF;
+  struct IGDdatas_service first;
+  struct IGDdatas_service second;
+  struct IGDdatas_service IPv6FC;
+  struct IGDdatas_service tmp;
+};
+
+struct UPNPUrls {
+  char *controlURL;
+  char *ipcondescURL;
+  char *controlURL_CIF;
+  char *controlURL_6FC;
+  char *rootdescURL;
+};
+
+// Finds the gateways with UPnP enabled, or only the one on multicastif's LAN if
+// given. Answers at once rather than waiting out delay.
+struct UPNPDev* upnpDiscover(int delay, const char *multicastif,
+                             const char *minissdpdsock, int localport, int ipv6,
+                             unsigned char ttl, int *error);
+void freeUPNPDevlist(struct UPNPDev *devlist);
+
+void GetUPNPUrls(struct UPNPUrls *urls, struct IGDdatas *data, const char *descURL,
+                 unsigned int scope_id);
+void FreeUPNPUrls(struct UPNPUrls *urls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,9 @@
+
+#ifndef MINIUPNPCSTRINGS_H_INCLUDED
+#define MINIUPNPCSTRINGS_H_INCLUDED
+
+#define OS_STRING                "NetHelper tests"
+#define MINIUPNPC_VERSION_STRING "2.2"
+#define UPNP_VERSION_STRING      "UPnP/1.1"
+
+#endif
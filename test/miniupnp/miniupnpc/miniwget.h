@@ -0,0 +1,21 @@
+
+#ifndef MINIWGET_H_INCLUDED
+#define MINIWGET_H_INCLUDED
+
+// Stand-in for miniupnpc's HTTP GET, which serves the descriptions of the
+// FakeGateway that owns the URL. The result is allocated with malloc.
+// miniwget_getaddr also gets the host's address on the gateway's LAN.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* miniwget(const char *url, int *size, unsigned int scope_id, int *status_code);
+void* miniwget_getaddr(const char *url, int *size, char *addr, int addrlen,
+                       unsigned int scope_id, int *status_code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
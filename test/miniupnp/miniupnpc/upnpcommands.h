@@ -0,0 +1,36 @@
+
+#ifndef UPNPCOMMANDS_H_INCLUDED
+#define UPNPCOMMANDS_H_INCLUDED
+
+// Stand-in for miniupnpc's SOAP actions on a WANIPConnection, which go to the
+// FakeGateway that owns the control URL. A control URL nobody owns fails as an
+// unreachable router does.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UPNPCOMMAND_SUCCESS         0
+#define UPNPCOMMAND_UNKNOWN_ERROR   (-1)
+#define UPNPCOMMAND_INVALID_ARGS    (-2)
+#define UPNPCOMMAND_HTTP_ERROR      (-3)
+#define UPNPCOMMAND_INVALID_RESPONSE (-4)
+#define UPNPCOMMAND_MEM_ALLOC_ERROR (-5)
+
+int UPNP_GetExternalIPAddress(const char *controlURL, const char *servicetype,
+                              char *extIpAdd);
+
+int UPNP_AddPortMapping(const char *controlURL, const char *servicetype,
+                        const char *extPort, const char *inPort,
+                        const char *inClient, const char *desc, const char *proto,
+                        const char *remoteHost, const char *leaseDuration);
+
+int UPNP_DeletePortMapping(const char *controlURL, const char *servicetype,
+                           const char *extPort, const char *proto,
+                           const char *remoteHost);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,17 @@
+
+#ifndef UPNPERRORS_H_INCLUDED
+#define UPNPERRORS_H_INCLUDED
+
+// Stand-in for miniupnpc's error strings
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const char* strupnperror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
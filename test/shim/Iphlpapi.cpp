@@ -0,0 +1,579 @@
+// IP helper functions of the Win32 shim, over interface, address and route tables
+// that tests change with rtnetlink messages, as the kernel reports changes
+
+#include <windows.h>
+#include <iphlpapi.h>
+#include "Shim.h"
+#include "ShimInternal.h"
+#include <linux/rtnetlink.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+const unsigned linkUp = 0x1;  // IFF_UP, whose header clashes with Winsock's
+
+struct Interface {
+  std::string name;
+  bool        up;
+};
+
+struct Address {
+  DWORD  index;
+  IPAddr address;
+  UCHAR  prefixLength;
+};
+
+struct Route {
+  DWORD  index;
+  IPAddr destination;
+  UCHAR  prefixLength;
+  IPAddr gateway;
+  ULONG  metric;
+};
+
+enum NotificationKind {
+  notifyInterface,
+  notifyAddress,
+  notifyRoute
+};
+
+struct Notification {
+  NotificationKind kind;
+  void            *callback;
+  PVOID            context;
+};
+
+} // anonymous namespace
+
+static std::mutex tableLock;
+static std::map<DWORD, Interface> interfaces;
+static std::vector<Address> addresses;
+static std::vector<Route>   routes;
+
+// Held while notifications are delivered, so cancelling one waits for it
+static std::recursive_mutex notifyLock;
+static std::vector<Notification*> notifications;
+static std::vector<OVERLAPPED*>   addrChangeWaiters;
+
+
+static IPAddr PrefixMask(UCHAR prefixLength) {
+  return prefixLength ? htonl(~0u << (32 - prefixLength)) : 0;
+}
+
+
+static void ToString(IPAddr address, IP_ADDRESS_STRING *out) {
+  inet_ntop(AF_INET, &address, out->String, sizeof(out->String));
+}
+
+
+// Must hold tableLock
+static bool IsUp(DWORD index) {
+  auto it = interfaces.find(index);
+  return it != interfaces.end() && it->second.up;
+}
+
+
+// Must hold tableLock. The default route with the lowest metric is the adapter's
+// gateway.
+static IPAddr DefaultGateway(DWORD index) {
+  const Route *best = nullptr;
+  for (const Route &route : routes) {
+    if (route.index == index && route.prefixLength == 0 &&
+        (!best || route.metric < best->metric)) {
+      best = &route;
+    }
+  }
+  return best ? best->gateway : INADDR_ANY;
+}
+
+
+DWORD GetNumberOfInterfaces(PDWORD count) {
+  if (!count) {
+    return ERROR_INVALID_PARAMETER;
+  }
+  std::lock_guard<std::mutex> lock(tableLock);
+  *count = static_cast<DWORD>(interfaces.size());
+  return NO_ERROR;
+}
+
+
+// Adapters that are down are listed without addresses, as disconnected ones are
+ULONG GetAdaptersInfo(IP_ADAPTER_INFO *adapterInfo, PULONG size) {
+  if (!size) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  std::lock_guard<std::mutex> lock(tableLock);
+  if (interfaces.empty()) {
+    return ERROR_NO_DATA;
+  }
+
+  // Addresses after an adapter's first go after all the adapters
+  size_t extraAddresses = 0;
+  for (auto &entry : interfaces) {
+    size_t count = 0;
+    for (const Address &address : addresses) {
+      count += (address.index == entry.first && entry.second.up) ? 1 : 0;
+    }
+    extraAddresses += (count > 1) ? count - 1 : 0;
+  }
+  size_t needed = interfaces.size() * sizeof(IP_ADAPTER_INFO) +
+                  extraAddresses * sizeof(IP_ADDR_STRING);
+  if (!adapterInfo || *size < needed) {
+    *size = static_cast<ULONG>(needed);
+    return ERROR_BUFFER_OVERFLOW;
+  }
+
+  memset(adapterInfo, 0, needed);
+  auto *extra = reinterpret_cast<IP_ADDR_STRING*>(adapterInfo + interfaces.size());
+  IP_ADAPTER_INFO *info = adapterInfo;
+  for (auto &entry : interfaces) {
+    info->Index      = entry.first;
+    info->ComboIndex = entry.first;
+    strcpy_s(info->AdapterName, entry.second.name.c_str());
+    strcpy_s(info->Description, entry.second.name.c_str());
+    info->Type = 6;  // MIB_IF_TYPE_ETHERNET
+
+    IP_ADDR_STRING *last = nullptr;
+    for (const Address &address : addresses) {
+      if (address.index != entry.first || !entry.second.up) {
+        continue;
+      }
+      IP_ADDR_STRING *string = last ? extra++ : &info->IpAddressList;
+      ToString(address.address, &string->IpAddress);
+      ToString(PrefixMask(address.prefixLength), &string->IpMask);
+      if (last) {
+        last->Next = string;
+      }
+      last = string;
+    }
+    if (!last) {
+      ToString(INADDR_ANY, &info->IpAddressList.IpAddress);
+      ToString(INADDR_ANY, &info->IpAddressList.IpMask);
+    }
+    info->CurrentIpAddress = &info->IpAddressList;
+    ToString(entry.second.up ? DefaultGateway(entry.first) : INADDR_ANY,
+             &info->GatewayList.IpAddress);
+    ToString(INADDR_ANY, &info->GatewayList.IpMask);
+
+    info->Next = (info + 1 < adapterInfo + interfaces.size()) ? info + 1 : nullptr;
+    ++info;
+  }
+  return NO_ERROR;
+}
+
+
+// The route with the longest matching prefix wins, then the one with the lowest
+// metric
+DWORD GetBestInterface(IPAddr destination, PDWORD bestIndex) {
+  if (!bestIndex) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  std::lock_guard<std::mutex> lock(tableLock);
+  const Route *best = nullptr;
+  for (const Route &route : routes) {
+    IPAddr mask = PrefixMask(route.prefixLength);
+    if (!IsUp(route.index) || (destination & mask) != (route.destination & mask)) {
+      continue;
+    }
+    if (!best || route.prefixLength > best->prefixLength ||
+        (route.prefixLength == best->prefixLength && route.metric < best->metric)) {
+      best = &route;
+    }
+  }
+  if (!best) {
+    return ERROR_NOT_FOUND;
+  }
+  *bestIndex = best->index;
+  return NO_ERROR;
+}
+
+
+ULONG GetIpAddrTable(PMIB_IPADDRTABLE table, PULONG size, BOOL) {
+  if (!size) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  std::lock_guard<std::mutex> lock(tableLock);
+  std::vector<const Address*> up;
+  for (const Address &address : addresses) {
+    if (IsUp(address.index)) {
+      up.push_back(&address);
+    }
+  }
+  size_t needed = offsetof(MIB_IPADDRTABLE, table) + up.size() * sizeof(MIB_IPADDRROW);
+  if (!table || *size < needed) {
+    *size = static_cast<ULONG>(needed);
+    return ERROR_INSUFFICIENT_BUFFER;
+  }
+
+  memset(table, 0, needed);
+  table->dwNumEntries = static_cast<DWORD>(up.size());
+  for (size_t i = 0; i < up.size(); ++i) {
+    MIB_IPADDRROW &row = table->table[i];
+    row.dwAddr      = up[i]->address;
+    row.dwIndex     = up[i]->index;
+    row.dwMask      = PrefixMask(up[i]->prefixLength);
+    row.dwBCastAddr = 1;
+    row.dwReasmSize = 65535;
+  }
+  return NO_ERROR;
+}
+
+
+DWORD NotifyAddrChange(HANDLE *handle, OVERLAPPED *overlapped) {
+  if (!overlapped || !overlapped->hEvent) {
+    return ERROR_NOT_SUPPORTED;  // Blocking until a change isn't needed
+  }
+  std::lock_guard<std::recursive_mutex> lock(notifyLock);
+  addrChangeWaiters.push_back(overlapped);
+  if (handle) {
+    *handle = nullptr;
+  }
+  return ERROR_IO_PENDING;
+}
+
+
+BOOL CancelIPChangeNotify(OVERLAPPED *overlapped) {
+  std::lock_guard<std::recursive_mutex> lock(notifyLock);
+  for (auto it = addrChangeWaiters.begin(); it != addrChangeWaiters.end(); ++it) {
+    if (*it == overlapped) {
+      addrChangeWaiters.erase(it);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+// Exports of the stand-in iphlpapi.dll
+
+static DWORD WINAPI Subscribe(NotificationKind kind, ADDRESS_FAMILY family,
+                              void *callback, PVOID context, HANDLE *handle) {
+  if ((family != AF_INET && family != AF_UNSPEC) || !callback || !handle) {
+    return ERROR_INVALID_PARAMETER;
+  }
+  std::lock_guard<std::recursive_mutex> lock(notifyLock);
+  notifications.push_back(new Notification{ kind, callback, context });
+  *handle = notifications.back();
+  return NO_ERROR;
+}
+
+
+// Initial notifications aren't sent
+static DWORD WINAPI NotifyIpInterfaceChange(ADDRESS_FAMILY family,
+                                            PIPINTERFACE_CHANGE_CALLBACK callback,
+                                            PVOID context, BOOLEAN,
+                                            HANDLE *handle) {
+  return Subscribe(notifyInterface, family, reinterpret_cast<void*>(callback),
+                   context, handle);
+}
+
+
+static DWORD WINAPI NotifyUnicastIpAddressChange(
+    ADDRESS_FAMILY family, PUNICAST_IPADDRESS_CHANGE_CALLBACK callback,
+    PVOID context, BOOLEAN, HANDLE *handle) {
+  return Subscribe(notifyAddress, family, reinterpret_cast<void*>(callback), context,
+                   handle);
+}
+
+
+static DWORD WINAPI NotifyRouteChange2(ADDRESS_FAMILY family,
+                                       PIPFORWARD_CHANGE_CALLBACK callback,
+                                       PVOID context, BOOLEAN, HANDLE *handle) {
+  return Subscribe(notifyRoute, family, reinterpret_cast<void*>(callback), context,
+                   handle);
+}
+
+
+static DWORD WINAPI CancelMibChangeNotify2(HANDLE handle) {
+  std::lock_guard<std::recursive_mutex> lock(notifyLock);
+  for (auto it = notifications.begin(); it != notifications.end(); ++it) {
+    if (*it == handle) {
+      delete *it;
+      notifications.erase(it);
+      return NO_ERROR;
+    }
+  }
+  return ERROR_INVALID_HANDLE;
+}
+
+
+static DWORD WINAPI GetIpForwardTable2(ADDRESS_FAMILY family,
+                                       PMIB_IPFORWARD_TABLE2 *table) {
+  if ((family != AF_INET && family != AF_UNSPEC) || !table) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  std::lock_guard<std::mutex> lock(tableLock);
+  size_t size = offsetof(MIB_IPFORWARD_TABLE2, Table) +
+                (routes.size() + 1) * sizeof(MIB_IPFORWARD_ROW2);
+  *table = static_cast<PMIB_IPFORWARD_TABLE2>(calloc(1, size));
+  if (!*table) {
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  for (const Route &route : routes) {
+    MIB_IPFORWARD_ROW2 &row = (*table)->Table[(*table)->NumEntries++];
+    row.InterfaceIndex = route.index;
+    row.DestinationPrefix.Prefix.Ipv4.sin_family      = AF_INET;
+    row.DestinationPrefix.Prefix.Ipv4.sin_addr.s_addr = route.destination;
+    row.DestinationPrefix.PrefixLength                = route.prefixLength;
+    row.NextHop.Ipv4.sin_family      = AF_INET;
+    row.NextHop.Ipv4.sin_addr.s_addr = route.gateway;
+    row.Metric = route.metric;
+  }
+  return NO_ERROR;
+}
+
+
+static void WINAPI FreeMibTable(PVOID table) {
+  free(table);
+}
+
+
+static const StandInExport iphlpapiExports[] = {
+  { "NotifyIpInterfaceChange",      reinterpret_cast<void*>(&NotifyIpInterfaceChange) },
+  { "NotifyUnicastIpAddressChange",
+    reinterpret_cast<void*>(&NotifyUnicastIpAddressChange) },
+  { "NotifyRouteChange2",           reinterpret_cast<void*>(&NotifyRouteChange2) },
+  { "CancelMibChangeNotify2",       reinterpret_cast<void*>(&CancelMibChangeNotify2) },
+  { "GetIpForwardTable2",           reinterpret_cast<void*>(&GetIpForwardTable2) },
+  { "FreeMibTable",                 reinterpret_cast<void*>(&FreeMibTable) }
+};
+
+static bool iphlpapiAdded = (AddStandInDll("iphlpapi.dll", iphlpapiExports,
+                                           _countof(iphlpapiExports)), true);
+
+
+// Netlink messages
+
+// Calls the subscribers of a kind with a row describing the change
+template <class Row, class Callback>
+static void Notify(NotificationKind kind, Row *row, MIB_NOTIFICATION_TYPE type) {
+  std::lock_guard<std::recursive_mutex> lock(notifyLock);
+  for (Notification *notification : notifications) {
+    if (notification->kind == kind) {
+      reinterpret_cast<Callback>(notification->callback)(notification->context, row,
+                                                         type);
+    }
+  }
+}
+
+
+// The legacy notification is one-shot, and re-armed by whoever wants the next
+static void NotifyAddrChangeWaiters() {
+  std::vector<OVERLAPPED*> waiters;
+  {
+    std::lock_guard<std::recursive_mutex> lock(notifyLock);
+    waiters.swap(addrChangeWaiters);
+  }
+  for (OVERLAPPED *overlapped : waiters) {
+    SetEvent(overlapped->hEvent);
+  }
+}
+
+
+// Attributes of a message, by type
+static std::map<int, const rtattr*> ReadAttributes(const rtattr *attribute,
+                                                   int length) {
+  std::map<int, const rtattr*> result;
+  for (; RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+    result[attribute->rta_type] = attribute;
+  }
+  return result;
+}
+
+
+static IPAddr AttributeAddress(const std::map<int, const rtattr*> &attributes,
+                               int type) {
+  auto it = attributes.find(type);
+  IPAddr address = INADDR_ANY;
+  if (it != attributes.end() && RTA_PAYLOAD(it->second) >= sizeof(address)) {
+    memcpy(&address, RTA_DATA(it->second), sizeof(address));
+  }
+  return address;
+}
+
+
+static bool ApplyLink(const nlmsghdr *message) {
+  if (message->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) {
+    return false;
+  }
+  auto *link = static_cast<const ifinfomsg*>(NLMSG_DATA(message));
+  auto attributes = ReadAttributes(IFLA_RTA(link), IFLA_PAYLOAD(message));
+  MIB_IPINTERFACE_ROW row = { AF_INET, static_cast<NET_IFINDEX>(link->ifi_index),
+                              FALSE };
+  MIB_NOTIFICATION_TYPE type;
+  {
+    std::lock_guard<std::mutex> lock(tableLock);
+    DWORD index = row.InterfaceIndex;
+    if (message->nlmsg_type == RTM_DELLINK) {
+      interfaces.erase(index);
+      for (size_t i = addresses.size(); i-- > 0;) {
+        if (addresses[i].index == index) {
+          addresses.erase(addresses.begin() + i);
+        }
+      }
+      for (size_t i = routes.size(); i-- > 0;) {
+        if (routes[i].index == index) {
+          routes.erase(routes.begin() + i);
+        }
+      }
+      type = MibDeleteInstance;
+    }
+    else {
+      type = interfaces.count(index) ? MibParameterNotification : MibAddInstance;
+      Interface &entry = interfaces[index];
+      auto name = attributes.find(IFLA_IFNAME);
+      if (name != attributes.end()) {
+        entry.name.assign(static_cast<const char*>(RTA_DATA(name->second)),
+                          strnlen(static_cast<const char*>(RTA_DATA(name->second)),
+                                  RTA_PAYLOAD(name->second)));
+      }
+      entry.up = (link->ifi_flags & linkUp) != 0;
+      row.Connected = entry.up;
+    }
+  }
+
+  Notify<MIB_IPINTERFACE_ROW, PIPINTERFACE_CHANGE_CALLBACK>(notifyInterface, &row,
+                                                           type);
+  // Its addresses come or go with it
+  NotifyAddrChangeWaiters();
+  return true;
+}
+
+
+static bool ApplyAddress(const nlmsghdr *message) {
+  if (message->nlmsg_len < NLMSG_LENGTH(sizeof(ifaddrmsg))) {
+    return false;
+  }
+  auto *header = static_cast<const ifaddrmsg*>(NLMSG_DATA(message));
+  if (header->ifa_family != AF_INET) {
+    return true;
+  }
+  auto attributes = ReadAttributes(IFA_RTA(header), IFA_PAYLOAD(message));
+  Address address = { header->ifa_index,
+                      AttributeAddress(attributes, attributes.count(IFA_LOCAL) ?
+                                                   IFA_LOCAL : IFA_ADDRESS),
+                      header->ifa_prefixlen };
+  bool remove = (message->nlmsg_type == RTM_DELADDR);
+  {
+    std::lock_guard<std::mutex> lock(tableLock);
+    if (!interfaces.count(address.index)) {
+      interfaces[address.index] = { "eth" + std::to_string(address.index), true };
+    }
+    for (size_t i = addresses.size(); i-- > 0;) {
+      if (addresses[i].index == address.index &&
+          addresses[i].address == address.address) {
+        addresses.erase(addresses.begin() + i);
+      }
+    }
+    if (!remove) {
+      addresses.push_back(address);
+    }
+  }
+
+  MIB_UNICASTIPADDRESS_ROW row = {};
+  row.Address.Ipv4.sin_family      = AF_INET;
+  row.Address.Ipv4.sin_addr.s_addr = address.address;
+  row.InterfaceIndex     = address.index;
+  row.OnLinkPrefixLength = address.prefixLength;
+  Notify<MIB_UNICASTIPADDRESS_ROW, PUNICAST_IPADDRESS_CHANGE_CALLBACK>(
+    notifyAddress, &row, remove ? MibDeleteInstance : MibAddInstance);
+  NotifyAddrChangeWaiters();
+  return true;
+}
+
+
+static bool ApplyRoute(const nlmsghdr *message) {
+  if (message->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg))) {
+    return false;
+  }
+  auto *header = static_cast<const rtmsg*>(NLMSG_DATA(message));
+  if (header->rtm_family != AF_INET) {
+    return true;
+  }
+  auto attributes = ReadAttributes(RTM_RTA(header), RTM_PAYLOAD(message));
+  auto oif      = attributes.find(RTA_OIF),
+       priority = attributes.find(RTA_PRIORITY);
+  Route route = { 0, AttributeAddress(attributes, RTA_DST), header->rtm_dst_len,
+                  AttributeAddress(attributes, RTA_GATEWAY), 0 };
+  if (oif == attributes.end() || RTA_PAYLOAD(oif->second) < sizeof(DWORD)) {
+    return false;
+  }
+  memcpy(&route.index, RTA_DATA(oif->second), sizeof(route.index));
+  if (priority != attributes.end() && RTA_PAYLOAD(priority->second) >= sizeof(ULONG)) {
+    memcpy(&route.metric, RTA_DATA(priority->second), sizeof(route.metric));
+  }
+
+  // Replacing removes the interface's routes to the destination through any gateway
+  bool remove  = (message->nlmsg_type == RTM_DELROUTE),
+       replace = !remove && (message->nlmsg_flags & NLM_F_REPLACE);
+  {
+    std::lock_guard<std::mutex> lock(tableLock);
+    for (size_t i = routes.size(); i-- > 0;) {
+      const Route &existing = routes[i];
+      if (existing.index == route.index &&
+          existing.destination == route.destination &&
+          existing.prefixLength == route.prefixLength &&
+          (replace || existing.gateway == route.gateway)) {
+        routes.erase(routes.begin() + i);
+      }
+    }
+    if (!remove) {
+      routes.push_back(route);
+    }
+  }
+
+  MIB_IPFORWARD_ROW2 row = {};
+  row.InterfaceIndex = route.index;
+  row.DestinationPrefix.Prefix.Ipv4.sin_family      = AF_INET;
+  row.DestinationPrefix.Prefix.Ipv4.sin_addr.s_addr = route.destination;
+  row.DestinationPrefix.PrefixLength                = route.prefixLength;
+  row.NextHop.Ipv4.sin_family      = AF_INET;
+  row.NextHop.Ipv4.sin_addr.s_addr = route.gateway;
+  row.Metric = route.metric;
+  Notify<MIB_IPFORWARD_ROW2, PIPFORWARD_CHANGE_CALLBACK>(
+    notifyRoute, &row, remove  ? MibDeleteInstance :
+                       replace ? MibParameterNotification : MibAddInstance);
+  return true;
+}
+
+
+bool ShimApplyNetlink(const void *messages, size_t size) {
+  auto *message = static_cast<const nlmsghdr*>(messages);
+  unsigned int length = static_cast<unsigned int>(size);
+  for (; NLMSG_OK(message, length); message = NLMSG_NEXT(message, length)) {
+    bool applied = true;
+    switch (message->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+      applied = ApplyLink(message);
+      break;
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+      applied = ApplyAddress(message);
+      break;
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+      applied = ApplyRoute(message);
+      break;
+    }
+    if (!applied) {
+      return false;
+    }
+  }
+  return length == 0;
+}
+
+
+void ShimResetNetwork() {
+  std::lock_guard<std::mutex> lock(tableLock);
+  interfaces.clear();
+  addresses.clear();
+  routes.clear();
+}
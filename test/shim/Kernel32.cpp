@@ -0,0 +1,1608 @@
+// Memory, module, thread, synchronization, file, time and system information
+// functions of the Win32 shim
+
+#include <windows.h>
+#include <tlhelp32.h>
+#include "Shim.h"
+#include "ShimInternal.h"
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <link.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+static_assert(sizeof(void*) == 8, "The shim only supports x86-64");
+static_assert(sizeof(IMAGE_OPTIONAL_HEADER32) == 224 &&
+              sizeof(IMAGE_OPTIONAL_HEADER64) == 240 &&
+              sizeof(IMAGE_NT_HEADERS64) == 264 && sizeof(IMAGE_DOS_HEADER) == 64,
+              "PE structures must match winnt.h");
+
+static thread_local DWORD lastError = 0;
+
+
+DWORD GetLastError() {
+  return lastError;
+}
+
+
+void SetLastError(DWORD error) {
+  lastError = error;
+}
+
+
+// Debug output goes nowhere unless SHIM_DEBUG_OUTPUT is set, as with no debugger
+void OutputDebugStringA(LPCSTR text) {
+  static const bool enabled = getenv("SHIM_DEBUG_OUTPUT") != nullptr;
+  if (enabled && text) {
+    fprintf(stderr, "%s\n", text);
+  }
+}
+
+
+// Memory
+
+static const size_t pageSize    = 0x1000,
+                    granularity = 0x10000;
+
+// Protection of pages whose protection has been set through the shim, and the
+// size of each VirtualAlloc allocation
+static std::mutex memoryLock;
+static std::map<uintptr_t, DWORD>  pageProtection;
+static std::map<uintptr_t, size_t> allocations;
+
+static int ToPosixProtection(DWORD protect) {
+  switch (protect & 0xFF) {
+  case PAGE_READONLY:          return PROT_READ;
+  case PAGE_READWRITE:         return PROT_READ | PROT_WRITE;
+  case PAGE_EXECUTE:           return PROT_EXEC;
+  case PAGE_EXECUTE_READ:      return PROT_READ | PROT_EXEC;
+  case PAGE_EXECUTE_READWRITE: return PROT_READ | PROT_WRITE | PROT_EXEC;
+  case PAGE_NOACCESS:          return PROT_NONE;
+  default:                     return -1;
+  }
+}
+
+static DWORD FromPosixProtection(const char *perms) {
+  bool r = perms[0] == 'r', w = perms[1] == 'w', x = perms[2] == 'x';
+  return x ? (w ? PAGE_EXECUTE_READWRITE : r ? PAGE_EXECUTE_READ : PAGE_EXECUTE) :
+             (w ? PAGE_READWRITE : r ? PAGE_READONLY : PAGE_NOACCESS);
+}
+
+// One line of /proc/self/maps
+struct Mapping {
+  uintptr_t begin,
+            end;
+  DWORD     protect;
+};
+
+static std::vector<Mapping> ReadMappings() {
+  std::vector<Mapping> result;
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps) {
+    char line[512];
+    while (fgets(line, sizeof(line), maps)) {
+      unsigned long begin, end;
+      char perms[5];
+      if (sscanf(line, "%lx-%lx %4s", &begin, &end, perms) == 3) {
+        result.push_back({ begin, end, FromPosixProtection(perms) });
+      }
+    }
+    fclose(maps);
+  }
+  return result;
+}
+
+// Must hold memoryLock
+static DWORD GetPageProtection(uintptr_t page) {
+  auto it = pageProtection.find(page);
+  if (it != pageProtection.end()) {
+    return it->second;
+  }
+  for (const Mapping &mapping : ReadMappings()) {
+    if (page >= mapping.begin && page < mapping.end) {
+      return mapping.protect;
+    }
+  }
+  return 0;
+}
+
+
+LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD allocationType,
+                    DWORD protect) {
+  int prot = ToPosixProtection(protect);
+  if (!size || !(allocationType & MEM_COMMIT) || prot < 0 ||
+      reinterpret_cast<uintptr_t>(address) % granularity) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return nullptr;
+  }
+
+  size = (size + pageSize - 1) & ~(pageSize - 1);
+  void *result = mmap(address, size, prot, MAP_PRIVATE | MAP_ANONYMOUS |
+                      (address ? MAP_FIXED_NOREPLACE : 0), -1, 0);
+  if (result == MAP_FAILED || (address && result != address)) {
+    if (result != MAP_FAILED) {
+      munmap(result, size);
+    }
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(memoryLock);
+  auto begin = reinterpret_cast<uintptr_t>(result);
+  allocations[begin] = size;
+  for (uintptr_t page = begin; page < begin + size; page += pageSize) {
+    pageProtection[page] = protect;
+  }
+  return result;
+}
+
+
+BOOL VirtualFree(LPVOID address, SIZE_T size, DWORD freeType) {
+  std::lock_guard<std::mutex> lock(memoryLock);
+  auto begin = reinterpret_cast<uintptr_t>(address);
+  auto it = allocations.find(begin);
+  if (freeType != MEM_RELEASE || size || it == allocations.end()) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+
+  munmap(address, it->second);
+  pageProtection.erase(pageProtection.lower_bound(begin),
+                       pageProtection.lower_bound(begin + it->second));
+  allocations.erase(it);
+  return TRUE;
+}
+
+
+BOOL VirtualProtect(LPVOID address, SIZE_T size, DWORD newProtect,
+                    PDWORD oldProtect) {
+  int prot = ToPosixProtection(newProtect);
+  if (!size || !oldProtect || prot < 0) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+
+  auto begin = reinterpret_cast<uintptr_t>(address) & ~(pageSize - 1),
+       end   = (reinterpret_cast<uintptr_t>(address) + size + pageSize - 1) &
+               ~(pageSize - 1);
+
+  std::lock_guard<std::mutex> lock(memoryLock);
+  DWORD old = GetPageProtection(begin);
+  if (!old || mprotect(reinterpret_cast<void*>(begin), end - begin, prot) != 0) {
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+  for (uintptr_t page = begin; page < end; page += pageSize) {
+    pageProtection[page] = newProtect;
+  }
+  *oldProtect = old;
+  return TRUE;
+}
+
+
+// Regions are whole mappings or the gaps between them. Mappings are their own
+// allocation, which is enough for finding free address space.
+SIZE_T VirtualQuery(LPCVOID address, MEMORY_BASIC_INFORMATION *buffer,
+                    SIZE_T length) {
+  if (!buffer || length < sizeof(*buffer)) {
+    SetLastError(ERROR_INSUFFICIENT_BUFFER);
+    return 0;
+  }
+
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  auto target = reinterpret_cast<uintptr_t>(address) & ~(pageSize - 1);
+  if (target < reinterpret_cast<uintptr_t>(info.lpMinimumApplicationAddress) ||
+      target > reinterpret_cast<uintptr_t>(info.lpMaximumApplicationAddress)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return 0;
+  }
+
+  // Free regions run from the queried page to the next mapping
+  MEMORY_BASIC_INFORMATION result = {};
+  result.BaseAddress = reinterpret_cast<PVOID>(target);
+  result.RegionSize  = reinterpret_cast<uintptr_t>(info.lpMaximumApplicationAddress) +
+                       1 - target;
+  result.State       = MEM_FREE;
+  result.Protect     = PAGE_NOACCESS;
+
+  for (const Mapping &mapping : ReadMappings()) {
+    if (target < mapping.begin) {
+      result.RegionSize = mapping.begin - target;
+      break;
+    }
+    else if (target < mapping.end) {
+      result.BaseAddress       = reinterpret_cast<PVOID>(mapping.begin);
+      result.AllocationBase    = result.BaseAddress;
+      result.AllocationProtect = mapping.protect;
+      result.RegionSize        = mapping.end - mapping.begin;
+      result.State             = MEM_COMMIT;
+      result.Protect           = mapping.protect;
+      result.Type              = MEM_PRIVATE;
+      break;
+    }
+  }
+
+  *buffer = result;
+  return sizeof(result);
+}
+
+
+void GetSystemInfo(SYSTEM_INFO *info) {
+  memset(info, 0, sizeof(*info));
+  info->wProcessorArchitecture      = 9;  // PROCESSOR_ARCHITECTURE_AMD64
+  info->dwPageSize                  = pageSize;
+  info->lpMinimumApplicationAddress = reinterpret_cast<LPVOID>(granularity);
+  info->lpMaximumApplicationAddress = reinterpret_cast<LPVOID>(0x7FFFFFFEFFFF);
+  info->dwNumberOfProcessors        =
+    static_cast<DWORD>(sysconf(_SC_NPROCESSORS_ONLN));
+  info->dwAllocationGranularity     = granularity;
+}
+
+
+HANDLE GetCurrentProcess() {
+  return reinterpret_cast<HANDLE>(static_cast<LONG_PTR>(-1));
+}
+
+
+BOOL FlushInstructionCache(HANDLE, LPCVOID, SIZE_T) {
+  return TRUE;  // x86 keeps instruction caches coherent
+}
+
+
+// Modules
+
+namespace {
+
+struct Module {
+  uintptr_t   begin,
+              end;
+  HMODULE     handle;
+  std::string name;
+};
+
+// What LdrRegisterDllNotification callbacks receive
+struct DllNotificationData {
+  ULONG       flags;
+  const void *fullDllName;
+  const void *baseDllName;
+  void       *dllBase;
+  ULONG       sizeOfImage;
+};
+
+typedef void (CALLBACK *DllNotificationFunction)(ULONG reason,
+                                                 const DllNotificationData *data,
+                                                 void *context);
+
+struct DllNotification {
+  DllNotificationFunction function;
+  void *context;
+};
+
+struct StandInDll {
+  IMAGE_DOS_HEADER     header;  // What its handle points to
+  std::string          name;
+  const StandInExport *exports;
+  size_t               count;
+};
+
+class SnapshotObject : public KernelObject {
+public:
+  std::vector<Module> modules;
+  size_t next;
+};
+
+} // anonymous namespace
+
+// Held while modules are added or removed, like the loader lock
+static std::recursive_mutex loaderLock;
+static std::vector<Module> modules;
+static std::vector<DllNotification*> dllNotifications;
+static HMODULE executable = nullptr;
+
+// Stands in for ntdll.dll, which exports the DLL notification functions
+static IMAGE_DOS_HEADER ntdllStandIn = {};
+
+// The test program's own ELF image, which GetModuleHandleEx resolves addresses in
+static const Module &GetProgramModule() {
+  static Module program = []() {
+    Module result = { UINTPTR_MAX, 0, nullptr, "" };
+    dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data) {
+      auto *module = static_cast<Module*>(data);
+      for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const auto &header = info->dlpi_phdr[i];
+        if (header.p_type == PT_LOAD) {
+          uintptr_t begin = info->dlpi_addr + header.p_vaddr;
+          module->begin = begin < module->begin ? begin : module->begin;
+          module->end = begin + header.p_memsz > module->end ?
+                        begin + header.p_memsz : module->end;
+        }
+      }
+      return 1;  // The program is listed first
+    }, &result);
+    result.handle = reinterpret_cast<HMODULE>(result.begin);
+    return result;
+  }();
+  return program;
+}
+
+
+// Stand-ins for other system DLLs, added while the shim is initialized
+static std::vector<StandInDll*>& StandInDlls() {
+  static std::vector<StandInDll*> dlls;
+  return dlls;
+}
+
+
+void AddStandInDll(const char *name, const StandInExport *exports, size_t count) {
+  StandInDlls().push_back(new StandInDll{ {}, name, exports, count });
+}
+
+
+static LONG NTAPI LdrRegisterDllNotification(ULONG flags,
+                                             DllNotificationFunction function,
+                                             void *context, void **cookie) {
+  if (flags || !function || !cookie) {
+    return static_cast<LONG>(0xC000000D);  // STATUS_INVALID_PARAMETER
+  }
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  dllNotifications.push_back(new DllNotification{ function, context });
+  *cookie = dllNotifications.back();
+  return 0;
+}
+
+
+static LONG NTAPI LdrUnregisterDllNotification(void *cookie) {
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  for (auto it = dllNotifications.begin(); it != dllNotifications.end(); ++it) {
+    if (*it == cookie) {
+      delete *it;
+      dllNotifications.erase(it);
+      return 0;
+    }
+  }
+  return static_cast<LONG>(0xC0000225);  // STATUS_NOT_FOUND
+}
+
+
+static void NotifyDll(ULONG reason, const Module &module) {
+  DllNotificationData data = { 0, nullptr, nullptr, module.handle,
+                               static_cast<ULONG>(module.end - module.begin) };
+  for (auto *notification : dllNotifications) {
+    notification->function(reason, &data, notification->context);
+  }
+}
+
+
+void ShimAddModule(HMODULE module, SIZE_T size, const char *name) {
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  auto begin = reinterpret_cast<uintptr_t>(module);
+  modules.push_back({ begin, begin + size, module, name });
+  NotifyDll(1, modules.back());  // LDR_DLL_NOTIFICATION_REASON_LOADED
+}
+
+
+void ShimRemoveModule(HMODULE module) {
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  for (auto it = modules.begin(); it != modules.end(); ++it) {
+    if (it->handle == module) {
+      Module removed = *it;
+      modules.erase(it);
+      if (executable == module) {
+        executable = nullptr;
+      }
+      NotifyDll(2, removed);  // LDR_DLL_NOTIFICATION_REASON_UNLOADED
+      return;
+    }
+  }
+}
+
+
+void ShimSetExecutable(HMODULE module) {
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  executable = module;
+}
+
+
+HMODULE GetModuleHandleA(LPCSTR moduleName) {
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  if (!moduleName) {
+    return executable ? executable : GetProgramModule().handle;
+  }
+  if (_stricmp(moduleName, "ntdll.dll") == 0 || _stricmp(moduleName, "ntdll") == 0) {
+    return reinterpret_cast<HMODULE>(&ntdllStandIn);
+  }
+  for (StandInDll *dll : StandInDlls()) {
+    if (_stricmp(dll->name.c_str(), moduleName) == 0) {
+      return reinterpret_cast<HMODULE>(&dll->header);
+    }
+  }
+  for (const Module &module : modules) {
+    if (_stricmp(module.name.c_str(), moduleName) == 0) {
+      return module.handle;
+    }
+  }
+  SetLastError(ERROR_MOD_NOT_FOUND);
+  return nullptr;
+}
+
+
+BOOL GetModuleHandleExA(DWORD flags, LPCSTR moduleName, HMODULE *module) {
+  if (!module) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  if (!(flags & GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS)) {
+    return (*module = GetModuleHandleA(moduleName)) != nullptr;
+  }
+
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  auto address = reinterpret_cast<uintptr_t>(moduleName);
+  const Module &program = GetProgramModule();
+  *module = nullptr;
+  if (address >= program.begin && address < program.end) {
+    *module = program.handle;
+  }
+  for (const Module &loaded : modules) {
+    if (address >= loaded.begin && address < loaded.end) {
+      *module = loaded.handle;
+    }
+  }
+  if (!*module) {
+    SetLastError(ERROR_MOD_NOT_FOUND);
+  }
+  return *module != nullptr;
+}
+
+
+// Only the stand-in system DLLs export anything
+void* GetProcAddress(HMODULE module, LPCSTR procName) {
+  if (module == reinterpret_cast<HMODULE>(&ntdllStandIn) &&
+      reinterpret_cast<uintptr_t>(procName) > 0xFFFF) {
+    if (strcmp(procName, "LdrRegisterDllNotification") == 0) {
+      return reinterpret_cast<void*>(&LdrRegisterDllNotification);
+    }
+    else if (strcmp(procName, "LdrUnregisterDllNotification") == 0) {
+      return reinterpret_cast<void*>(&LdrUnregisterDllNotification);
+    }
+  }
+  for (StandInDll *dll : StandInDlls()) {
+    if (module != reinterpret_cast<HMODULE>(&dll->header) ||
+        reinterpret_cast<uintptr_t>(procName) <= 0xFFFF) {
+      continue;
+    }
+    for (size_t i = 0; i < dll->count; ++i) {
+      if (strcmp(procName, dll->exports[i].name) == 0) {
+        return dll->exports[i].function;
+      }
+    }
+  }
+  SetLastError(127);  // ERROR_PROC_NOT_FOUND
+  return nullptr;
+}
+
+
+// The test program isn't a PE image, so only modules added by the test are listed
+HANDLE CreateToolhelp32Snapshot(DWORD flags, DWORD processId) {
+  if (!(flags & TH32CS_SNAPMODULE) ||
+      (processId && processId != GetCurrentProcessId())) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return INVALID_HANDLE_VALUE;
+  }
+  auto *snapshot = new SnapshotObject;
+  std::lock_guard<std::recursive_mutex> lock(loaderLock);
+  snapshot->modules = modules;
+  snapshot->next = 0;
+  return NewHandle(snapshot);
+}
+
+
+static BOOL NextModule(HANDLE snapshot, MODULEENTRY32 *entry, bool first) {
+  auto *object = GetObject<SnapshotObject>(snapshot);
+  if (!object || !entry || entry->dwSize < sizeof(*entry)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  if (first) {
+    object->next = 0;
+  }
+  if (object->next >= object->modules.size()) {
+    SetLastError(18);  // ERROR_NO_MORE_FILES
+    return FALSE;
+  }
+
+  const Module &module = object->modules[object->next++];
+  memset(entry, 0, sizeof(*entry));
+  entry->dwSize        = sizeof(*entry);
+  entry->th32ProcessID = GetCurrentProcessId();
+  entry->modBaseAddr   = reinterpret_cast<BYTE*>(module.begin);
+  entry->modBaseSize   = static_cast<DWORD>(module.end - module.begin);
+  entry->hModule       = module.handle;
+  strcpy_s(entry->szModule, module.name.c_str());
+  strcpy_s(entry->szExePath, module.name.c_str());
+  return TRUE;
+}
+
+
+BOOL Module32First(HANDLE snapshot, MODULEENTRY32 *entry) {
+  return NextModule(snapshot, entry, true);
+}
+
+
+BOOL Module32Next(HANDLE snapshot, MODULEENTRY32 *entry) {
+  return NextModule(snapshot, entry, false);
+}
+
+
+// Handles
+
+static std::mutex handleLock;
+static std::set<KernelObject*> handles;
+static std::mutex waitLock;
+static std::condition_variable waitCondition;
+
+
+HANDLE NewHandle(KernelObject *object) {
+  std::lock_guard<std::mutex> lock(handleLock);
+  handles.insert(object);
+  return object;
+}
+
+
+KernelObject* GetKernelObject(HANDLE handle) {
+  std::lock_guard<std::mutex> lock(handleLock);
+  auto *object = static_cast<KernelObject*>(handle);
+  return handles.count(object) ? object : nullptr;
+}
+
+
+void ReleaseObject(KernelObject *object) {
+  if (--object->references == 0) {
+    delete object;
+  }
+}
+
+
+BOOL CloseHandle(HANDLE handle) {
+  KernelObject *object;
+  {
+    std::lock_guard<std::mutex> lock(handleLock);
+    object = static_cast<KernelObject*>(handle);
+    if (!handles.erase(object)) {
+      SetLastError(ERROR_INVALID_HANDLE);
+      return FALSE;
+    }
+  }
+  ReleaseObject(object);
+  return TRUE;
+}
+
+
+std::mutex& WaitLock() {
+  return waitLock;
+}
+
+
+void NotifyWaiters() {
+  waitCondition.notify_all();
+}
+
+
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL waitAll,
+                             DWORD milliseconds) {
+  if (!count || count > MAXIMUM_WAIT_OBJECTS) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return WAIT_FAILED;
+  }
+  std::vector<KernelObject*> objects(count);
+  for (DWORD i = 0; i < count; ++i) {
+    if (!(objects[i] = GetKernelObject(handles[i]))) {
+      SetLastError(ERROR_INVALID_HANDLE);
+      return WAIT_FAILED;
+    }
+  }
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(milliseconds);
+  std::unique_lock<std::mutex> lock(waitLock);
+  for (;;) {
+    if (waitAll) {
+      bool all = true;
+      for (auto *object : objects) {
+        all = all && object->IsSignaled();
+      }
+      if (all) {
+        for (auto *object : objects) {
+          object->OnWaitSatisfied();
+        }
+        return WAIT_OBJECT_0;
+      }
+    }
+    else {
+      for (DWORD i = 0; i < count; ++i) {
+        if (objects[i]->IsSignaled()) {
+          objects[i]->OnWaitSatisfied();
+          return WAIT_OBJECT_0 + i;
+        }
+      }
+    }
+
+    if (milliseconds == INFINITE) {
+      waitCondition.wait(lock);
+    }
+    else if (waitCondition.wait_until(lock, deadline) == std::cv_status::timeout &&
+             std::chrono::steady_clock::now() >= deadline) {
+      return WAIT_TIMEOUT;
+    }
+  }
+}
+
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds) {
+  return WaitForMultipleObjects(1, &handle, FALSE, milliseconds);
+}
+
+
+HANDLE CreateEventA(SECURITY_ATTRIBUTES*, BOOL manualReset, BOOL initialState,
+                    LPCSTR name) {
+  if (name) {
+    SetLastError(ERROR_NOT_SUPPORTED);  // Named events aren't needed
+    return nullptr;
+  }
+  SetLastError(ERROR_SUCCESS);
+  return NewHandle(new EventObject(manualReset != FALSE, initialState != FALSE));
+}
+
+
+static BOOL SetEventState(HANDLE event, bool signaled) {
+  auto *object = GetObject<EventObject>(event);
+  if (!object) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  std::lock_guard<std::mutex> lock(waitLock);
+  object->signaled = signaled;
+  if (signaled) {
+    NotifyWaiters();
+  }
+  return TRUE;
+}
+
+
+BOOL SetEvent(HANDLE event) {
+  return SetEventState(event, true);
+}
+
+
+BOOL ResetEvent(HANDLE event) {
+  return SetEventState(event, false);
+}
+
+
+// Completion ports
+
+// The port and key each associated socket completes to
+struct Association {
+  CompletionPortObject *port;
+  ULONG_PTR             key;
+};
+static std::mutex associationLock;
+static std::map<HANDLE, Association> associations;
+
+
+HANDLE CreateIoCompletionPort(HANDLE file, HANDLE existingPort, ULONG_PTR key,
+                              DWORD) {
+  if (file == INVALID_HANDLE_VALUE) {
+    if (existingPort) {
+      SetLastError(ERROR_INVALID_PARAMETER);
+      return nullptr;
+    }
+    return NewHandle(new CompletionPortObject());
+  }
+
+  auto *port = GetObject<CompletionPortObject>(existingPort);
+  if (!port) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(associationLock);
+  if (associations.count(file)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return nullptr;
+  }
+  ++port->references;
+  associations[file] = { port, key };
+  return existingPort;
+}
+
+
+BOOL GetQueuedCompletionStatus(HANDLE port, LPDWORD bytes, PULONG_PTR key,
+                               OVERLAPPED **overlapped, DWORD milliseconds) {
+  *overlapped = nullptr;
+  auto *object = GetObject<CompletionPortObject>(port);
+  if (!object) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(milliseconds);
+  std::unique_lock<std::mutex> lock(waitLock);
+  while (object->packets.empty()) {
+    if (milliseconds == INFINITE) {
+      waitCondition.wait(lock);
+    }
+    else if (waitCondition.wait_until(lock, deadline) == std::cv_status::timeout &&
+             std::chrono::steady_clock::now() >= deadline) {
+      SetLastError(WAIT_TIMEOUT);
+      return FALSE;
+    }
+  }
+
+  CompletionPortObject::Packet packet = object->packets.front();
+  object->packets.pop_front();
+  *bytes      = packet.bytes;
+  *key        = packet.key;
+  *overlapped = packet.overlapped;
+  if (packet.error) {
+    SetLastError(packet.error);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+BOOL PostQueuedCompletionStatus(HANDLE port, DWORD bytes, ULONG_PTR key,
+                                OVERLAPPED *overlapped) {
+  auto *object = GetObject<CompletionPortObject>(port);
+  if (!object) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  PostCompletion(object, { bytes, key, overlapped, ERROR_SUCCESS });
+  return TRUE;
+}
+
+
+void PostCompletion(CompletionPortObject *port,
+                    const CompletionPortObject::Packet &packet) {
+  std::lock_guard<std::mutex> lock(waitLock);
+  port->packets.push_back(packet);
+  NotifyWaiters();
+}
+
+
+CompletionPortObject* GetCompletionPort(HANDLE file, ULONG_PTR *key) {
+  std::lock_guard<std::mutex> lock(associationLock);
+  auto it = associations.find(file);
+  if (it == associations.end()) {
+    return nullptr;
+  }
+  ++it->second.port->references;
+  *key = it->second.key;
+  return it->second.port;
+}
+
+
+void DissociateCompletionPort(HANDLE file) {
+  CompletionPortObject *port = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(associationLock);
+    auto it = associations.find(file);
+    if (it != associations.end()) {
+      port = it->second.port;
+      associations.erase(it);
+    }
+  }
+  if (port) {
+    ReleaseObject(port);
+  }
+}
+
+
+// Files
+
+namespace {
+
+class FileObject : public KernelObject {
+public:
+  explicit FileObject(int _fd) : fd(_fd) {}
+  virtual ~FileObject() { close(fd); }
+
+  int fd;
+};
+
+} // anonymous namespace
+
+
+HANDLE CreateFileA(LPCSTR fileName, DWORD desiredAccess, DWORD,
+                   SECURITY_ATTRIBUTES*, DWORD creationDisposition, DWORD, HANDLE) {
+  int flags = (desiredAccess & GENERIC_WRITE) ?
+              ((desiredAccess & GENERIC_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+  if (creationDisposition == CREATE_ALWAYS) {
+    flags |= O_CREAT | O_TRUNC;
+  }
+  else if (creationDisposition != OPEN_EXISTING) {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  int fd = open(fileName, flags | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    SetLastError((errno == ENOENT) ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_DENIED);
+    return INVALID_HANDLE_VALUE;
+  }
+  return NewHandle(new FileObject(fd));
+}
+
+
+BOOL ReadFile(HANDLE file, LPVOID buffer, DWORD bytesToRead, LPDWORD bytesRead,
+              OVERLAPPED *overlapped) {
+  auto *object = GetObject<FileObject>(file);
+  if (!object || overlapped) {
+    SetLastError(object ? ERROR_NOT_SUPPORTED : ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  // Like ReadFile, fill the buffer unless the end of the file comes first
+  DWORD total = 0;
+  while (total < bytesToRead) {
+    ssize_t result = read(object->fd, static_cast<char*>(buffer) + total,
+                          bytesToRead - total);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      if (result < 0) {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return FALSE;
+      }
+      break;
+    }
+    total += static_cast<DWORD>(result);
+  }
+  if (bytesRead) {
+    *bytesRead = total;
+  }
+  return TRUE;
+}
+
+
+BOOL WriteFile(HANDLE file, LPCVOID buffer, DWORD bytesToWrite, LPDWORD bytesWritten,
+               OVERLAPPED *overlapped) {
+  auto *object = GetObject<FileObject>(file);
+  if (!object || overlapped) {
+    SetLastError(object ? ERROR_NOT_SUPPORTED : ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  DWORD total = 0;
+  while (total < bytesToWrite) {
+    ssize_t result = write(object->fd, static_cast<const char*>(buffer) + total,
+                           bytesToWrite - total);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0) {
+      SetLastError(ERROR_ACCESS_DENIED);
+      return FALSE;
+    }
+    total += static_cast<DWORD>(result);
+  }
+  if (bytesWritten) {
+    *bytesWritten = total;
+  }
+  return TRUE;
+}
+
+
+// Profiles
+
+// Reads the file in full each call, as Windows does. Lines before the first
+// section, comments and lines without '=' are left out.
+DWORD GetPrivateProfileSectionA(LPCSTR appName, LPSTR returnedString, DWORD size,
+                                LPCSTR fileName) {
+  if (!returnedString || size < 2) {
+    return 0;
+  }
+  std::string path(fileName ? fileName : "");
+  std::replace(path.begin(), path.end(), '\\', '/');
+
+  std::string result;
+  FILE *file = fopen(path.c_str(), "r");
+  if (file) {
+    bool inSection = false;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+      std::string text(line);
+      text.erase(text.find_last_not_of("\r\n") + 1);
+      size_t first = text.find_first_not_of(" \t");
+      if (first == std::string::npos || text[first] == ';') {
+        continue;
+      }
+      if (text[first] == '[') {
+        size_t close = text.find(']', first);
+        inSection = appName && close != std::string::npos &&
+                    _stricmp(text.substr(first + 1, close - first - 1).c_str(),
+                             appName) == 0;
+      }
+      else if (inSection && text.find('=') != std::string::npos) {
+        result += text.substr(first);
+        result += '\0';
+      }
+    }
+    fclose(file);
+  }
+
+  // Truncated to fit, with the double terminator, like Windows
+  if (result.size() > size - 2) {
+    memcpy(returnedString, result.data(), size - 2);
+    returnedString[size - 2] = '\0';
+    returnedString[size - 1] = '\0';
+    return size - 2;
+  }
+  memcpy(returnedString, result.data(), result.size());
+  returnedString[result.size()] = '\0';
+  if (result.empty()) {
+    returnedString[1] = '\0';
+  }
+  return static_cast<DWORD>(result.size());
+}
+
+
+// Change notifications
+
+namespace {
+
+// Signaled by a thread that watches the directory with inotify
+class ChangeNotificationObject : public KernelObject {
+public:
+  explicit ChangeNotificationObject(int _fd) : fd(_fd), signaled(false), stop(false) {
+    thread = std::thread([this]() { Watch(); });
+  }
+  virtual ~ChangeNotificationObject() {
+    stop = true;
+    thread.join();
+    close(fd);
+  }
+
+  virtual bool IsSignaled() { return signaled; }
+
+  void Watch() {
+    while (!stop) {
+      pollfd watched = { fd, POLLIN, 0 };
+      if (poll(&watched, 1, 20) <= 0) {
+        continue;
+      }
+      char events[4096];
+      if (read(fd, events, sizeof(events)) > 0) {
+        std::lock_guard<std::mutex> lock(WaitLock());
+        signaled = true;
+        NotifyWaiters();
+      }
+    }
+  }
+
+  int fd;
+  bool signaled;  // Guarded by WaitLock()
+  std::atomic<bool> stop;
+  std::thread thread;
+};
+
+} // anonymous namespace
+
+
+HANDLE FindFirstChangeNotificationA(LPCSTR pathName, BOOL watchSubtree, DWORD filter) {
+  if (!pathName || watchSubtree || filter != FILE_NOTIFY_CHANGE_LAST_WRITE) {
+    SetLastError(pathName ? ERROR_NOT_SUPPORTED : ERROR_INVALID_PARAMETER);
+    return INVALID_HANDLE_VALUE;
+  }
+  std::string path(pathName);
+  std::replace(path.begin(), path.end(), '\\', '/');
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE |
+                                                    IN_MOVED_TO | IN_CREATE) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    SetLastError(ERROR_PATH_NOT_FOUND);
+    return INVALID_HANDLE_VALUE;
+  }
+  return NewHandle(new ChangeNotificationObject(fd));
+}
+
+
+// Waits for the next change; those since the last signal count as one
+BOOL FindNextChangeNotification(HANDLE changeHandle) {
+  auto *object = GetObject<ChangeNotificationObject>(changeHandle);
+  if (!object) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  std::lock_guard<std::mutex> lock(WaitLock());
+  object->signaled = false;
+  return TRUE;
+}
+
+
+BOOL FindCloseChangeNotification(HANDLE changeHandle) {
+  if (!GetObject<ChangeNotificationObject>(changeHandle)) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  return CloseHandle(changeHandle);
+}
+
+
+// File mappings
+
+namespace {
+
+class MappingObject : public KernelObject {
+public:
+  MappingObject(int _fd, const std::string &_name) : fd(_fd), name(_name) {}
+  virtual ~MappingObject() {
+    close(fd);
+    if (!name.empty()) {
+      shm_unlink(name.c_str());
+    }
+  }
+
+  int         fd;
+  std::string name;  // Of the shared memory, if this handle created it
+};
+
+} // anonymous namespace
+
+static std::mutex viewLock;
+static std::map<const void*, size_t> views;  // Sizes by base address
+
+
+// Shared memory names have one leading slash and no others
+static std::string SharedMemoryName(LPCSTR name) {
+  std::string result = std::string("/") + name;
+  std::replace(result.begin() + 1, result.end(), '\\', '.');
+  std::replace(result.begin() + 1, result.end(), '/', '.');
+  return result;
+}
+
+
+HANDLE CreateFileMappingA(HANDLE file, SECURITY_ATTRIBUTES*, DWORD protect,
+                          DWORD maximumSizeHigh, DWORD maximumSizeLow, LPCSTR name) {
+  off_t size = (static_cast<off_t>(maximumSizeHigh) << 32) | maximumSizeLow;
+  if (protect != PAGE_READWRITE && protect != PAGE_READONLY) {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return nullptr;
+  }
+
+  int fd;
+  std::string sharedName;
+  bool existed = false;
+  if (file == INVALID_HANDLE_VALUE) {
+    // Backed by the paging file, as shared memory
+    if (size == 0) {
+      SetLastError(ERROR_INVALID_PARAMETER);
+      return nullptr;
+    }
+    if (name) {
+      sharedName = SharedMemoryName(name);
+      fd = shm_open(sharedName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd < 0 && errno == EEXIST) {
+        existed = true;
+        sharedName.clear();
+        fd = shm_open(SharedMemoryName(name).c_str(), O_RDWR, 0600);
+      }
+    }
+    else {
+      char path[] = "/tmp/ShimMappingXXXXXX";
+      if ((fd = mkstemp(path)) >= 0) {
+        unlink(path);
+      }
+    }
+  }
+  else {
+    auto *object = GetObject<FileObject>(file);
+    if (!object) {
+      SetLastError(ERROR_INVALID_HANDLE);
+      return nullptr;
+    }
+    fd = dup(object->fd);
+  }
+  if (fd < 0) {
+    SetLastError(ERROR_ACCESS_DENIED);
+    return nullptr;
+  }
+
+  // Like Windows, grow the file to the size of the mapping
+  struct stat status;
+  if (fstat(fd, &status) != 0 || (size > status.st_size && ftruncate(fd, size) != 0) ||
+      (size == 0 && status.st_size == 0)) {
+    close(fd);
+    if (!sharedName.empty()) {
+      shm_unlink(sharedName.c_str());
+    }
+    SetLastError(ERROR_ACCESS_DENIED);
+    return nullptr;
+  }
+
+  HANDLE mapping = NewHandle(new MappingObject(fd, sharedName));
+  SetLastError(existed ? ERROR_ALREADY_EXISTS : ERROR_SUCCESS);
+  return mapping;
+}
+
+
+HANDLE OpenFileMappingA(DWORD desiredAccess, BOOL, LPCSTR name) {
+  if (!name) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return nullptr;
+  }
+  int fd = shm_open(SharedMemoryName(name).c_str(),
+                    (desiredAccess & FILE_MAP_WRITE) ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0) {
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return nullptr;
+  }
+  return NewHandle(new MappingObject(fd, std::string()));
+}
+
+
+LPVOID MapViewOfFile(HANDLE mapping, DWORD desiredAccess, DWORD fileOffsetHigh,
+                     DWORD fileOffsetLow, size_t bytesToMap) {
+  auto *object = GetObject<MappingObject>(mapping);
+  if (!object) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return nullptr;
+  }
+  off_t offset = (static_cast<off_t>(fileOffsetHigh) << 32) | fileOffsetLow;
+  struct stat status;
+  if (fstat(object->fd, &status) != 0 || offset > status.st_size) {
+    SetLastError(ERROR_ACCESS_DENIED);
+    return nullptr;
+  }
+  if (bytesToMap == 0) {
+    bytesToMap = static_cast<size_t>(status.st_size - offset);
+  }
+
+  int protection = PROT_READ | ((desiredAccess & FILE_MAP_WRITE) ? PROT_WRITE : 0);
+  void *view = mmap(nullptr, bytesToMap, protection, MAP_SHARED, object->fd, offset);
+  if (view == MAP_FAILED) {
+    SetLastError(ERROR_ACCESS_DENIED);
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(viewLock);
+  views[view] = bytesToMap;
+  return view;
+}
+
+
+BOOL UnmapViewOfFile(LPCVOID baseAddress) {
+  std::lock_guard<std::mutex> lock(viewLock);
+  auto it = views.find(baseAddress);
+  if (it == views.end()) {
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+  munmap(const_cast<void*>(it->first), it->second);
+  views.erase(it);
+  return TRUE;
+}
+
+
+BOOL FlushViewOfFile(LPCVOID baseAddress, size_t bytesToFlush) {
+  std::lock_guard<std::mutex> lock(viewLock);
+  auto it = views.upper_bound(baseAddress);
+  if (it == views.begin()) {
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+  --it;
+  auto *view = static_cast<const char*>(it->first);
+  auto *base = static_cast<const char*>(baseAddress);
+  if (base >= view + it->second) {
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+  // msync wants the start of a page
+  size_t pageOffset = (base - view) % sysconf(_SC_PAGESIZE),
+         length     = bytesToFlush ? bytesToFlush : it->second - (base - view);
+  return msync(const_cast<char*>(base - pageOffset), length + pageOffset,
+               MS_SYNC) == 0;
+}
+
+
+// Threads
+
+namespace {
+
+class ThreadObject : public KernelObject {
+public:
+  virtual bool IsSignaled() { return exited; }
+
+  LPTHREAD_START_ROUTINE startAddress;
+  LPVOID parameter;
+  bool   exited;
+  DWORD  exitCode;
+};
+
+} // anonymous namespace
+
+static std::atomic<DWORD> nextThreadId(1);
+static thread_local DWORD threadId = 0;
+
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES*, SIZE_T, LPTHREAD_START_ROUTINE startAddress,
+                    LPVOID parameter, DWORD creationFlags, LPDWORD threadIdOut) {
+  if (!startAddress || creationFlags) {
+    SetLastError(ERROR_INVALID_PARAMETER);  // CREATE_SUSPENDED isn't supported
+    return nullptr;
+  }
+
+  auto *thread = new ThreadObject;
+  thread->startAddress = startAddress;
+  thread->parameter    = parameter;
+  thread->exited       = false;
+  thread->exitCode     = 259;  // STILL_ACTIVE
+  ++thread->references;
+
+  DWORD id = nextThreadId++;
+  if (threadIdOut) {
+    *threadIdOut = id;
+  }
+  HANDLE handle = NewHandle(thread);
+  std::thread([thread, id]() {
+    threadId = id;
+    DWORD exitCode = thread->startAddress(thread->parameter);
+    {
+      std::lock_guard<std::mutex> lock(waitLock);
+      thread->exitCode = exitCode;
+      thread->exited   = true;
+      NotifyWaiters();
+    }
+    ReleaseObject(thread);
+  }).detach();
+  return handle;
+}
+
+
+BOOL GetExitCodeThread(HANDLE thread, LPDWORD exitCode) {
+  auto *object = GetObject<ThreadObject>(thread);
+  if (!object || !exitCode) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  std::lock_guard<std::mutex> lock(waitLock);
+  *exitCode = object->exitCode;
+  return TRUE;
+}
+
+
+DWORD GetCurrentProcessId() {
+  return static_cast<DWORD>(getpid());
+}
+
+
+DWORD GetCurrentThreadId() {
+  if (!threadId) {
+    threadId = nextThreadId++;
+  }
+  return threadId;
+}
+
+
+void Sleep(DWORD milliseconds) {
+  if (milliseconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+  }
+  else {
+    std::this_thread::yield();
+  }
+}
+
+
+// Registered waits
+
+namespace {
+
+class WaitObject : public KernelObject {
+public:
+  HANDLE      cancel;
+  std::thread thread;
+};
+
+} // anonymous namespace
+
+
+BOOL RegisterWaitForSingleObject(HANDLE *newWaitObject, HANDLE object,
+                                 WAITORTIMERCALLBACK callback, PVOID context,
+                                 ULONG milliseconds, ULONG flags) {
+  if (!newWaitObject || !callback || !GetKernelObject(object)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+
+  auto *wait = new WaitObject;
+  wait->cancel = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+  HANDLE cancel = wait->cancel;
+  wait->thread = std::thread([=]() {
+    HANDLE waitFor[] = { cancel, object };
+    for (;;) {
+      DWORD result = WaitForMultipleObjects(2, waitFor, FALSE, milliseconds);
+      if (result != WAIT_OBJECT_0 + 1 && result != WAIT_TIMEOUT) {
+        break;
+      }
+      callback(context, result == WAIT_TIMEOUT);
+      if (flags & WT_EXECUTEONLYONCE) {
+        break;
+      }
+    }
+  });
+  *newWaitObject = NewHandle(wait);
+  return TRUE;
+}
+
+
+// Always waits for a running callback to return, unless called from it
+BOOL UnregisterWaitEx(HANDLE waitHandle, HANDLE completionEvent) {
+  auto *wait = GetObject<WaitObject>(waitHandle);
+  if (!wait) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+
+  SetEvent(wait->cancel);
+  if (wait->thread.get_id() == std::this_thread::get_id()) {
+    wait->thread.detach();
+  }
+  else {
+    wait->thread.join();
+  }
+  if (completionEvent && completionEvent != INVALID_HANDLE_VALUE) {
+    SetEvent(completionEvent);
+  }
+  CloseHandle(wait->cancel);
+  return CloseHandle(waitHandle);
+}
+
+// Slim reader/writer locks and condition variables. Their state is allocated on
+// first use, as both are initialized by zeroing.
+
+namespace {
+
+struct RwLockState {
+  std::mutex              lock;
+  std::condition_variable released;
+  int  readers        = 0;
+  int  waitingWriters = 0;
+  bool writer         = false;
+};
+
+struct ConditionState {
+  std::mutex              lock;
+  std::condition_variable changed;
+  ULONGLONG wakeups = 0;
+};
+
+} // anonymous namespace
+
+template <class T>
+static T* GetState(PVOID *slot) {
+  T *state = static_cast<T*>(__atomic_load_n(slot, __ATOMIC_ACQUIRE));
+  if (!state) {
+    T *created = new T;
+    PVOID expected = nullptr;
+    if (__atomic_compare_exchange_n(slot, &expected, created, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      state = created;
+    }
+    else {
+      delete created;
+      state = static_cast<T*>(expected);
+    }
+  }
+  return state;
+}
+
+
+void InitializeSRWLock(PSRWLOCK lock) {
+  lock->Ptr = nullptr;
+}
+
+
+void AcquireSRWLockExclusive(PSRWLOCK lock) {
+  auto *state = GetState<RwLockState>(&lock->Ptr);
+  std::unique_lock<std::mutex> guard(state->lock);
+  ++state->waitingWriters;
+  state->released.wait(guard, [state]() { return !state->writer && !state->readers; });
+  --state->waitingWriters;
+  state->writer = true;
+}
+
+
+void ReleaseSRWLockExclusive(PSRWLOCK lock) {
+  auto *state = GetState<RwLockState>(&lock->Ptr);
+  std::lock_guard<std::mutex> guard(state->lock);
+  state->writer = false;
+  state->released.notify_all();
+}
+
+
+// Writers waiting go first, so readers can't starve them
+void AcquireSRWLockShared(PSRWLOCK lock) {
+  auto *state = GetState<RwLockState>(&lock->Ptr);
+  std::unique_lock<std::mutex> guard(state->lock);
+  state->released.wait(guard, [state]() {
+    return !state->writer && !state->waitingWriters;
+  });
+  ++state->readers;
+}
+
+
+void ReleaseSRWLockShared(PSRWLOCK lock) {
+  auto *state = GetState<RwLockState>(&lock->Ptr);
+  std::lock_guard<std::mutex> guard(state->lock);
+  if (--state->readers == 0) {
+    state->released.notify_all();
+  }
+}
+
+
+void InitializeConditionVariable(PCONDITION_VARIABLE conditionVariable) {
+  conditionVariable->Ptr = nullptr;
+}
+
+
+BOOL SleepConditionVariableSRW(PCONDITION_VARIABLE conditionVariable, PSRWLOCK lock,
+                               DWORD milliseconds, ULONG flags) {
+  const bool shared = (flags & 1) != 0;  // CONDITION_VARIABLE_LOCKMODE_SHARED
+  auto *state = GetState<ConditionState>(&conditionVariable->Ptr);
+
+  bool woken;
+  {
+    // Taking the condition's lock before releasing the SRW lock means a wake after
+    // the release can't be missed
+    std::unique_lock<std::mutex> guard(state->lock);
+    ULONGLONG wakeups = state->wakeups;
+    shared ? ReleaseSRWLockShared(lock) : ReleaseSRWLockExclusive(lock);
+    auto isWoken = [state, wakeups]() { return state->wakeups != wakeups; };
+    if (milliseconds == INFINITE) {
+      state->changed.wait(guard, isWoken);
+      woken = true;
+    }
+    else {
+      woken = state->changed.wait_for(guard, std::chrono::milliseconds(milliseconds),
+                                      isWoken);
+    }
+  }
+
+  shared ? AcquireSRWLockShared(lock) : AcquireSRWLockExclusive(lock);
+  if (!woken) {
+    SetLastError(1460);  // ERROR_TIMEOUT
+  }
+  return woken;
+}
+
+
+void WakeConditionVariable(PCONDITION_VARIABLE conditionVariable) {
+  WakeAllConditionVariable(conditionVariable);  // Spurious wakes are allowed
+}
+
+
+void WakeAllConditionVariable(PCONDITION_VARIABLE conditionVariable) {
+  auto *state = GetState<ConditionState>(&conditionVariable->Ptr);
+  std::lock_guard<std::mutex> guard(state->lock);
+  ++state->wakeups;
+  state->changed.notify_all();
+}
+
+
+// Time
+
+static ULONGLONG MonotonicNanoseconds() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<ULONGLONG>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+static std::atomic<DWORD> tickCountOffset(0);
+
+DWORD GetTickCount() {
+  return static_cast<DWORD>(GetTickCount64()) + tickCountOffset;
+}
+
+
+void ShimSetTickCount(DWORD ticks) {
+  tickCountOffset = ticks - static_cast<DWORD>(GetTickCount64());
+}
+
+
+ULONGLONG GetTickCount64() {
+  return MonotonicNanoseconds() / 1000000;
+}
+
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count) {
+  count->QuadPart = static_cast<LONGLONG>(MonotonicNanoseconds());
+  return TRUE;
+}
+
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency) {
+  frequency->QuadPart = 1000000000;
+  return TRUE;
+}
+
+
+// 100ns intervals since 1601
+void GetSystemTimeAsFileTime(FILETIME *time) {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  ULONGLONG intervals = (static_cast<ULONGLONG>(now.tv_sec) + 11644473600ULL) *
+                        10000000 + now.tv_nsec / 100;
+  time->dwLowDateTime  = static_cast<DWORD>(intervals);
+  time->dwHighDateTime = static_cast<DWORD>(intervals >> 32);
+}
+
+
+// System information
+
+// The host name, truncated as NetBIOS names are
+BOOL GetComputerNameA(LPSTR buffer, DWORD *size) {
+  char name[256] = {};
+  if (gethostname(name, sizeof(name) - 1) != 0) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  size_t len = strnlen(name, MAX_COMPUTERNAME_LENGTH);
+  if (*size <= len) {
+    *size = static_cast<DWORD>(len + 1);
+    SetLastError(ERROR_INSUFFICIENT_BUFFER);
+    return FALSE;
+  }
+  memcpy(buffer, name, len);
+  buffer[len] = '\0';
+  *size = static_cast<DWORD>(len);
+  return TRUE;
+}
+
+
+// Every volume is the root file system, whose serial number is its device number
+BOOL GetVolumeInformationA(LPCSTR, LPSTR volumeName, DWORD volumeNameSize,
+                           DWORD *serialNumber, DWORD *maxComponentLength,
+                           DWORD *fileSystemFlags, LPSTR fileSystemName,
+                           DWORD fileSystemNameSize) {
+  struct stat root;
+  if (stat("/", &root) != 0) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  if (volumeName && volumeNameSize > 0) {
+    volumeName[0] = '\0';
+  }
+  if (serialNumber) {
+    *serialNumber = static_cast<DWORD>(root.st_dev);
+  }
+  if (maxComponentLength) {
+    *maxComponentLength = 255;
+  }
+  if (fileSystemFlags) {
+    *fileSystemFlags = 0;
+  }
+  if (fileSystemName && fileSystemNameSize > 0) {
+    fileSystemName[0] = '\0';
+  }
+  return TRUE;
+}
@@ -0,0 +1,309 @@
+// The POSIX half of the Winsock shim: sockets, with families, addresses and
+// options converted from Winsock's values
+
+#include "PosixSockets.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// Winsock's values, where they differ from Linux's
+const int wsAfInet6    = 23,
+          wsSolSocket  = 0xFFFF,
+          wsIpprotoIp  = 0,
+          wsIpprotoTcp = 6,
+          wsMsgOob     = 0x1,
+          wsMsgPeek    = 0x2;
+
+enum OptionValue {
+  valueInt,
+  valueTimeout,  // A DWORD of milliseconds
+  valueRaw       // The same structure on both
+};
+
+const struct {
+  int         wsLevel, wsName,
+              level,   name;
+  OptionValue value;
+} options[] = {
+  { wsSolSocket,  0x0004, SOL_SOCKET,  SO_REUSEADDR,       valueInt     },
+  { wsSolSocket,  0x0020, SOL_SOCKET,  SO_BROADCAST,       valueInt     },
+  { wsSolSocket,  0x1001, SOL_SOCKET,  SO_SNDBUF,          valueInt     },
+  { wsSolSocket,  0x1002, SOL_SOCKET,  SO_RCVBUF,          valueInt     },
+  { wsSolSocket,  0x1005, SOL_SOCKET,  SO_SNDTIMEO,        valueTimeout },
+  { wsSolSocket,  0x1006, SOL_SOCKET,  SO_RCVTIMEO,        valueTimeout },
+  { wsSolSocket,  0x1008, SOL_SOCKET,  SO_TYPE,            valueInt     },
+  { wsIpprotoIp,  3,      IPPROTO_IP,  IP_TOS,             valueInt     },
+  { wsIpprotoIp,  9,      IPPROTO_IP,  IP_MULTICAST_IF,    valueRaw     },
+  { wsIpprotoIp,  10,     IPPROTO_IP,  IP_MULTICAST_TTL,   valueInt     },
+  { wsIpprotoIp,  11,     IPPROTO_IP,  IP_MULTICAST_LOOP,  valueInt     },
+  { wsIpprotoIp,  12,     IPPROTO_IP,  IP_ADD_MEMBERSHIP,  valueRaw     },
+  { wsIpprotoIp,  13,     IPPROTO_IP,  IP_DROP_MEMBERSHIP, valueRaw     },
+  { wsIpprotoTcp, 0x0001, IPPROTO_TCP, TCP_NODELAY,        valueInt     }
+};
+
+} // anonymous namespace
+
+
+static int ToFamily(int wsFamily) {
+  return (wsFamily == wsAfInet6) ? AF_INET6 : wsFamily;
+}
+
+
+static bool ToAddress(const void *address, int len, sockaddr_storage *out,
+                      socklen_t *outLen) {
+  if (len < static_cast<int>(sizeof(sa_family_t)) ||
+      len > static_cast<int>(sizeof(*out))) {
+    errno = EFAULT;
+    return false;
+  }
+  memcpy(out, address, len);
+  out->ss_family = ToFamily(out->ss_family);
+  *outLen = len;
+  return true;
+}
+
+
+static void FromAddress(const sockaddr_storage &address, socklen_t len, void *out,
+                        int *outLen) {
+  sockaddr_storage copy = address;
+  if (copy.ss_family == AF_INET6) {
+    copy.ss_family = wsAfInet6;
+  }
+  int size = (static_cast<int>(len) < *outLen) ? static_cast<int>(len) : *outLen;
+  memcpy(out, &copy, size);
+  *outLen = static_cast<int>(len);
+}
+
+
+static int ToFlags(int wsFlags) {
+  return ((wsFlags & wsMsgOob) ? MSG_OOB : 0) | ((wsFlags & wsMsgPeek) ? MSG_PEEK : 0) |
+         ((wsFlags & Posix::dontWait) ? MSG_DONTWAIT : 0);
+}
+
+
+int Posix::Socket(int family, int type, int protocol) {
+  return socket(ToFamily(family), type | SOCK_CLOEXEC, protocol);
+}
+
+
+int Posix::Bind(int fd, const void *address, int addressLen) {
+  sockaddr_storage native;
+  socklen_t nativeLen;
+  return ToAddress(address, addressLen, &native, &nativeLen) ?
+         bind(fd, reinterpret_cast<sockaddr*>(&native), nativeLen) : -1;
+}
+
+
+int Posix::Connect(int fd, const void *address, int addressLen) {
+  sockaddr_storage native;
+  socklen_t nativeLen;
+  if (!ToAddress(address, addressLen, &native, &nativeLen)) {
+    return -1;
+  }
+  int result;
+  while ((result = connect(fd, reinterpret_cast<sockaddr*>(&native), nativeLen)) < 0 &&
+         errno == EINTR) {}
+  return result;
+}
+
+
+int Posix::GetSockName(int fd, void *address, int *addressLen) {
+  sockaddr_storage native;
+  socklen_t nativeLen = sizeof(native);
+  if (getsockname(fd, reinterpret_cast<sockaddr*>(&native), &nativeLen) < 0) {
+    return -1;
+  }
+  FromAddress(native, nativeLen, address, addressLen);
+  return 0;
+}
+
+
+int Posix::Close(int fd) {
+  return close(fd);
+}
+
+
+int Posix::Send(int fd, const void *buf, int len, int flags, const void *to,
+                int toLen) {
+  sockaddr_storage native;
+  socklen_t nativeLen = 0;
+  if (to && !ToAddress(to, toLen, &native, &nativeLen)) {
+    return -1;
+  }
+  ssize_t result;
+  while ((result = sendto(fd, buf, len, ToFlags(flags) | MSG_NOSIGNAL,
+                          to ? reinterpret_cast<sockaddr*>(&native) : nullptr,
+                          nativeLen)) < 0 && errno == EINTR) {}
+  return static_cast<int>(result);
+}
+
+
+int Posix::Receive(int fd, void *buf, int len, int flags, void *from, int *fromLen) {
+  sockaddr_storage native;
+  iovec data = { buf, static_cast<size_t>(len) };
+  msghdr message = {};
+  message.msg_name    = &native;
+  message.msg_namelen = sizeof(native);
+  message.msg_iov     = &data;
+  message.msg_iovlen  = 1;
+
+  ssize_t result;
+  while ((result = recvmsg(fd, &message, ToFlags(flags))) < 0 && errno == EINTR) {}
+  if (result < 0) {
+    return -1;
+  }
+  if (from && fromLen) {
+    FromAddress(native, message.msg_namelen, from, fromLen);
+  }
+  if (message.msg_flags & MSG_TRUNC) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return static_cast<int>(result);
+}
+
+
+int Posix::SetNonBlocking(int fd, bool nonBlocking) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+
+int Posix::BytesReadable(int fd, int *bytes) {
+  return ioctl(fd, FIONREAD, bytes);
+}
+
+
+int Posix::SetOption(int fd, int level, int name, const void *value, int len) {
+  for (const auto &option : options) {
+    if (option.wsLevel != level || option.wsName != name) {
+      continue;
+    }
+    switch (option.value) {
+    case valueInt: {
+      int native = 0;
+      memcpy(&native, value, (len < 4) ? len : 4);
+      return setsockopt(fd, option.level, option.name, &native, sizeof(native));
+    }
+    case valueTimeout: {
+      unsigned int ms = 0;
+      memcpy(&ms, value, (len < 4) ? len : 4);
+      timeval native = { static_cast<time_t>(ms / 1000),
+                         static_cast<suseconds_t>(ms % 1000 * 1000) };
+      return setsockopt(fd, option.level, option.name, &native, sizeof(native));
+    }
+    default:
+      return setsockopt(fd, option.level, option.name, value, len);
+    }
+  }
+  errno = ENOPROTOOPT;
+  return -1;
+}
+
+
+int Posix::GetOption(int fd, int level, int name, void *value, int *len) {
+  for (const auto &option : options) {
+    if (option.wsLevel != level || option.wsName != name) {
+      continue;
+    }
+    if (option.value == valueRaw) {
+      socklen_t nativeLen = *len;
+      int result = getsockopt(fd, option.level, option.name, value, &nativeLen);
+      *len = nativeLen;
+      return result;
+    }
+
+    int native = 0;
+    timeval timeout = {};
+    socklen_t nativeLen = (option.value == valueTimeout) ? sizeof(timeout) :
+                                                           sizeof(native);
+    void *nativeValue = (option.value == valueTimeout) ?
+                        static_cast<void*>(&timeout) : &native;
+    if (*len < 4) {
+      errno = EFAULT;
+      return -1;
+    }
+    if (getsockopt(fd, option.level, option.name, nativeValue, &nativeLen) < 0) {
+      return -1;
+    }
+    if (option.value == valueTimeout) {
+      native = static_cast<int>(timeout.tv_sec * 1000 + timeout.tv_usec / 1000);
+    }
+    memcpy(value, &native, 4);
+    *len = 4;
+    return 0;
+  }
+  errno = ENOPROTOOPT;
+  return -1;
+}
+
+
+int Posix::Poll(PollEntry *entries, int count, int timeoutMs) {
+  std::vector<pollfd> fds(count);
+  for (int i = 0; i < count; ++i) {
+    fds[i].fd     = entries[i].fd;
+    fds[i].events = (entries[i].read   ? POLLIN  : 0) |
+                    (entries[i].write  ? POLLOUT : 0) |
+                    (entries[i].except ? POLLPRI : 0);
+  }
+
+  int result;
+  while ((result = poll(fds.data(), count, timeoutMs)) < 0 && errno == EINTR) {}
+  if (result < 0) {
+    return -1;
+  }
+
+  int ready = 0;
+  for (int i = 0; i < count; ++i) {
+    short revents = fds[i].revents;
+    if (revents & POLLNVAL) {
+      errno = ENOTSOCK;
+      return -1;
+    }
+    // Errors and hangups are reported by the next receive, as with select
+    entries[i].read   = entries[i].read && (revents & (POLLIN | POLLERR | POLLHUP));
+    entries[i].write  = entries[i].write && (revents & (POLLOUT | POLLERR));
+    entries[i].except = entries[i].except && (revents & POLLPRI);
+    ready += (entries[i].read || entries[i].write || entries[i].except) ? 1 : 0;
+  }
+  return ready;
+}
+
+
+int Posix::AddressToString(int family, const void *address, char *text, int size) {
+  return inet_ntop(ToFamily(family), address, text, size) ? 0 : -1;
+}
+
+
+int Posix::StringToAddress(int family, const char *text, void *address) {
+  return inet_pton(ToFamily(family), text, address);
+}
+
+
+int Posix::ResolveIpv4(const char *host, const char *port, void *address) {
+  addrinfo hints = {},
+           *info = nullptr;
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &info) != 0 || !info) {
+    return -1;
+  }
+  memcpy(address, info->ai_addr, sizeof(sockaddr_in));
+  freeaddrinfo(info);
+  return 0;
+}
@@ -0,0 +1,50 @@
+
+#ifndef SHIM_POSIXSOCKETS_H
+#define SHIM_POSIXSOCKETS_H
+
+// The POSIX half of the Winsock shim. Winsock's declarations clash with POSIX's,
+// so the two halves are separate translation units with only plain types between
+// them. Families, addresses and options are passed with Winsock's values and
+// layout. Failures return -1 with errno set.
+
+namespace Posix {
+
+int Socket(int family, int type, int protocol);
+int Bind(int fd, const void *address, int addressLen);
+int Connect(int fd, const void *address, int addressLen);
+int GetSockName(int fd, void *address, int *addressLen);
+int Close(int fd);
+
+// Not a Winsock flag: doesn't block even on a blocking socket
+const int dontWait = 0x10000;
+
+// Datagrams that don't fit in len fail with EMSGSIZE, as with Winsock
+int Send(int fd, const void *buf, int len, int flags, const void *to, int toLen);
+int Receive(int fd, void *buf, int len, int flags, void *from, int *fromLen);
+
+int SetNonBlocking(int fd, bool nonBlocking);
+int BytesReadable(int fd, int *bytes);
+int SetOption(int fd, int level, int name, const void *value, int len);
+int GetOption(int fd, int level, int name, void *value, int *len);
+
+// Set what to wait for, and get back what is ready
+struct PollEntry {
+  int  fd;
+  bool read,
+       write,
+       except;
+};
+
+// Waits up to timeoutMs, or forever if negative, for any entry to be ready.
+// Returns the number of ready entries.
+int Poll(PollEntry *entries, int count, int timeoutMs);
+
+int AddressToString(int family, const void *address, char *text, int size);
+int StringToAddress(int family, const char *text, void *address);
+// Resolves a host name and port to the first IPv4 address, a sockaddr_in of 16
+// bytes. Returns 0, or -1 if the name doesn't resolve.
+int ResolveIpv4(const char *host, const char *port, void *address);
+
+} // namespace Posix
+
+#endif
@@ -0,0 +1,32 @@
+
+#ifndef SHIM_H
+#define SHIM_H
+
+// Test-side controls of the Win32 shim, which has no loader of its own
+
+#include <windows.h>
+
+// Makes a PE image mapped by the test known as a loaded module, as if the loader
+// had mapped it: GetModuleHandle and GetModuleHandleEx find it, toolhelp snapshots
+// list it, and DLL notification callbacks are told about it.
+void ShimAddModule(HMODULE module, SIZE_T size, const char *name);
+void ShimRemoveModule(HMODULE module);
+
+// Makes GetModuleHandle(nullptr) return module, as if it were the executable, or
+// the test program itself again if nullptr. The test program is an ELF image and
+// has no PE headers to read.
+void ShimSetExecutable(HMODULE module);
+
+// Makes GetTickCount return ticks now and count on from there, as if Windows had
+// been up that long, e.g. to see it wrap around. GetTickCount64 is unaffected.
+void ShimSetTickCount(DWORD ticks);
+
+// Applies rtnetlink messages (links, IPv4 addresses and routes, and their removal)
+// to the network the IP helper functions report, as if the kernel had sent them.
+// Change notifications are delivered before it returns. Returns false if a
+// message is malformed; the ones before it are still applied.
+bool ShimApplyNetlink(const void *messages, size_t size);
+// Forgets all interfaces, addresses and routes, without notifying anyone
+void ShimResetNetwork();
+
+#endif
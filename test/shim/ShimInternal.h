@@ -0,0 +1,91 @@
+
+#ifndef SHIM_INTERNAL_H
+#define SHIM_INTERNAL_H
+
+// Kernel objects shared between the shim's translation units
+
+#include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// What handles point to. References are held by handles, and by threads while they
+// run. All waits are served by one lock and condition variable, which is simple
+// and fast enough for tests.
+class KernelObject {
+public:
+  KernelObject() : references(1) {}
+  virtual ~KernelObject() {}
+
+  // Called with WaitLock() held
+  virtual bool IsSignaled() { return false; }
+  virtual void OnWaitSatisfied() {}
+
+  std::atomic<int> references;
+};
+
+// Returns the object for a handle, or nullptr if it isn't an open handle of type T
+template <class T>
+T* GetObject(HANDLE handle);
+KernelObject* GetKernelObject(HANDLE handle);
+
+HANDLE NewHandle(KernelObject *object);
+void   ReleaseObject(KernelObject *object);
+
+std::mutex& WaitLock();
+// Wakes waiters after an object was signaled; must hold WaitLock()
+void NotifyWaiters();
+
+class EventObject : public KernelObject {
+public:
+  EventObject(bool _manualReset, bool initialState)
+    : manualReset(_manualReset), signaled(initialState) {}
+
+  virtual bool IsSignaled() { return signaled; }
+  virtual void OnWaitSatisfied() { signaled = manualReset; }
+
+  bool manualReset,
+       signaled;
+};
+
+// A completion port's finished I/O, in the order it finished. Guarded by
+// WaitLock(), like the signaled state of other objects.
+class CompletionPortObject : public KernelObject {
+public:
+  struct Packet {
+    DWORD       bytes;
+    ULONG_PTR   key;
+    OVERLAPPED *overlapped;
+    DWORD       error;
+  };
+
+  virtual bool IsSignaled() { return !packets.empty(); }
+
+  std::deque<Packet> packets;
+};
+
+// Queues a packet on the port and wakes its waiters
+void PostCompletion(CompletionPortObject *port,
+                    const CompletionPortObject::Packet &packet);
+// Gets the port a socket was associated with, with a reference the caller releases,
+// or nullptr
+CompletionPortObject* GetCompletionPort(HANDLE file, ULONG_PTR *key);
+// Forgets the socket's port, when the socket is closed
+void DissociateCompletionPort(HANDLE file);
+
+// Makes GetModuleHandle find a stand-in for a system DLL by name, and
+// GetProcAddress look its exports up in a table that must outlive the program.
+// Called by the shim's translation units as they're initialized.
+struct StandInExport {
+  const char *name;
+  void       *function;
+};
+void AddStandInDll(const char *name, const StandInExport *exports, size_t count);
+
+template <class T>
+T* GetObject(HANDLE handle) {
+  return dynamic_cast<T*>(GetKernelObject(handle));
+}
+
+#endif
@@ -0,0 +1,574 @@
+// Winsock functions of the Win32 shim, on POSIX sockets through PosixSockets.cpp
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+#include "PosixSockets.h"
+#include "ShimInternal.h"
+#include <errno.h>
+#include <string.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static thread_local int lastSocketError = 0;
+
+// A thread per socket given to WSAEventSelect, signaling its event while the
+// socket is readable. Only FD_READ is supported.
+struct EventSelect {
+  EventObject      *event;
+  std::atomic<bool> stop;
+  std::thread       thread;
+};
+static std::mutex selectLock;
+static std::map<SOCKET, std::unique_ptr<EventSelect>> eventSelects;
+
+// Overlapped receives on a socket associated with a completion port, served in the
+// order they were posted by a thread per socket that polls it
+struct OverlappedReceive {
+  WSABUF      buffer;
+  sockaddr   *from;
+  LPINT       fromLen;
+  OVERLAPPED *overlapped;
+};
+struct OverlappedSocket {
+  CompletionPortObject         *port;
+  ULONG_PTR                     key;
+  std::mutex                    lock;
+  std::condition_variable       posted;
+  std::deque<OverlappedReceive> pending;
+  bool                          stop;
+  std::thread                   thread;
+};
+static std::mutex overlappedLock;
+static std::map<SOCKET, std::unique_ptr<OverlappedSocket>> overlappedSockets;
+
+static void StopEventSelect(SOCKET s);
+static void ServeReceives(SOCKET s, OverlappedSocket *sock);
+static int  CancelReceives(OverlappedSocket *sock, OVERLAPPED *overlapped);
+static void StopOverlapped(SOCKET s);
+
+
+int WSAGetLastError() {
+  return lastSocketError;
+}
+
+
+void WSASetLastError(int error) {
+  lastSocketError = error;
+}
+
+
+static int Fail(int error) {
+  WSASetLastError(error);
+  return SOCKET_ERROR;
+}
+
+
+// Fails with the Winsock error for errno, after a POSIX call failed
+static int FailWithErrno() {
+  switch (errno) {
+  case EINTR:         return Fail(WSAEINTR);
+  case EBADF:
+  case ENOTSOCK:      return Fail(WSAENOTSOCK);
+  case EACCES:
+  case EPERM:         return Fail(WSAEACCES);
+  case EFAULT:        return Fail(WSAEFAULT);
+  case EMFILE:
+  case ENFILE:        return Fail(WSAEMFILE);
+  case EAGAIN:
+  case EINPROGRESS:   return Fail(WSAEWOULDBLOCK);
+  case EMSGSIZE:      return Fail(WSAEMSGSIZE);
+  case ENOPROTOOPT:
+  case EOPNOTSUPP:    return Fail(WSAEOPNOTSUPP);
+  case EAFNOSUPPORT:  return Fail(WSAEAFNOSUPPORT);
+  case EADDRINUSE:    return Fail(WSAEADDRINUSE);
+  case EADDRNOTAVAIL: return Fail(WSAEADDRNOTAVAIL);
+  case ENETUNREACH:   return Fail(WSAENETUNREACH);
+  case ECONNRESET:    return Fail(WSAECONNRESET);
+  case ENOBUFS:
+  case ENOMEM:        return Fail(WSAENOBUFS);
+  case ENOTCONN:      return Fail(WSAENOTCONN);
+  case ETIMEDOUT:     return Fail(WSAETIMEDOUT);
+  case ECONNREFUSED:  return Fail(WSAECONNREFUSED);
+  case EHOSTUNREACH:  return Fail(WSAEHOSTUNREACH);
+  default:            return Fail(WSAEINVAL);
+  }
+}
+
+
+static int Check(int result) {
+  return (result < 0) ? FailWithErrno() : result;
+}
+
+
+int WSAStartup(WORD versionRequested, WSADATA *data) {
+  if (!data) {
+    return WSAEFAULT;
+  }
+  memset(data, 0, sizeof(*data));
+  data->wVersion     = versionRequested;
+  data->wHighVersion = MAKEWORD(2, 2);
+  strcpy_s(data->szDescription, "NetHelper test shim");
+  return 0;
+}
+
+
+int WSACleanup() {
+  return 0;
+}
+
+
+SOCKET socket(int family, int type, int protocol) {
+  int fd = Posix::Socket(family, type, protocol);
+  if (fd < 0) {
+    FailWithErrno();
+    return INVALID_SOCKET;
+  }
+  return static_cast<SOCKET>(fd);
+}
+
+
+int bind(SOCKET s, const sockaddr *name, int nameLen) {
+  return Check(Posix::Bind(static_cast<int>(s), name, nameLen));
+}
+
+
+int connect(SOCKET s, const sockaddr *name, int nameLen) {
+  return Check(Posix::Connect(static_cast<int>(s), name, nameLen));
+}
+
+
+int getsockname(SOCKET s, sockaddr *name, int *nameLen) {
+  return Check(Posix::GetSockName(static_cast<int>(s), name, nameLen));
+}
+
+
+int closesocket(SOCKET s) {
+  StopEventSelect(s);
+  StopOverlapped(s);
+  return Check(Posix::Close(static_cast<int>(s)));
+}
+
+
+int send(SOCKET s, const char *buf, int len, int flags) {
+  return Check(Posix::Send(static_cast<int>(s), buf, len, flags, nullptr, 0));
+}
+
+
+int recv(SOCKET s, char *buf, int len, int flags) {
+  return Check(Posix::Receive(static_cast<int>(s), buf, len, flags, nullptr, nullptr));
+}
+
+
+int sendto(SOCKET s, const char *buf, int len, int flags, const sockaddr *to,
+           int toLen) {
+  return Check(Posix::Send(static_cast<int>(s), buf, len, flags, to, toLen));
+}
+
+
+int recvfrom(SOCKET s, char *buf, int len, int flags, sockaddr *from, int *fromLen) {
+  return Check(Posix::Receive(static_cast<int>(s), buf, len, flags, from, fromLen));
+}
+
+
+int __WSAFDIsSet(SOCKET s, fd_set *set) {
+  for (u_int i = 0; i < set->fd_count; ++i) {
+    if (set->fd_array[i] == s) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+int select(int, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+           const timeval *timeout) {
+  // Each socket is polled once, for everything it was passed for
+  std::vector<Posix::PollEntry> entries;
+  auto add = [&entries](fd_set *set, bool Posix::PollEntry::*wanted) {
+    for (u_int i = 0; set && i < set->fd_count; ++i) {
+      auto it = entries.begin();
+      while (it != entries.end() && it->fd != static_cast<int>(set->fd_array[i])) {
+        ++it;
+      }
+      if (it == entries.end()) {
+        entries.push_back({ static_cast<int>(set->fd_array[i]), false, false, false });
+        it = entries.end() - 1;
+      }
+      (*it).*wanted = true;
+    }
+  };
+  add(readfds,   &Posix::PollEntry::read);
+  add(writefds,  &Posix::PollEntry::write);
+  add(exceptfds, &Posix::PollEntry::except);
+  if (entries.empty()) {
+    return Fail(WSAEINVAL);
+  }
+
+  int timeoutMs = -1;
+  if (timeout) {
+    timeoutMs = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+  }
+  if (Posix::Poll(entries.data(), static_cast<int>(entries.size()), timeoutMs) < 0) {
+    return FailWithErrno();
+  }
+
+  int ready = 0;
+  auto keep = [&entries, &ready](fd_set *set, bool Posix::PollEntry::*wanted) {
+    if (!set) {
+      return;
+    }
+    fd_set result = {};
+    for (u_int i = 0; i < set->fd_count; ++i) {
+      for (const auto &entry : entries) {
+        if (entry.fd == static_cast<int>(set->fd_array[i]) && entry.*wanted) {
+          result.fd_array[result.fd_count++] = set->fd_array[i];
+          ++ready;
+        }
+      }
+    }
+    *set = result;
+  };
+  keep(readfds,   &Posix::PollEntry::read);
+  keep(writefds,  &Posix::PollEntry::write);
+  keep(exceptfds, &Posix::PollEntry::except);
+  return ready;
+}
+
+
+int ioctlsocket(SOCKET s, long cmd, u_long *argp) {
+  if (!argp) {
+    return Fail(WSAEFAULT);
+  }
+  if (cmd == FIONBIO) {
+    return Check(Posix::SetNonBlocking(static_cast<int>(s), *argp != 0));
+  }
+  if (cmd == FIONREAD) {
+    int bytes = 0;
+    if (Posix::BytesReadable(static_cast<int>(s), &bytes) < 0) {
+      return FailWithErrno();
+    }
+    *argp = static_cast<u_long>(bytes);
+    return 0;
+  }
+  return Fail(WSAEINVAL);
+}
+
+
+int setsockopt(SOCKET s, int level, int name, const char *value, int len) {
+  if (!value) {
+    return Fail(WSAEFAULT);
+  }
+  return Check(Posix::SetOption(static_cast<int>(s), level, name, value, len));
+}
+
+
+int getsockopt(SOCKET s, int level, int name, char *value, int *len) {
+  if (!value || !len) {
+    return Fail(WSAEFAULT);
+  }
+  return Check(Posix::GetOption(static_cast<int>(s), level, name, value, len));
+}
+
+
+int WSAIoctl(SOCKET s, DWORD code, LPVOID, DWORD, LPVOID, DWORD, LPDWORD bytesReturned,
+             WSAOVERLAPPED *overlapped, LPWSAOVERLAPPED_COMPLETION_ROUTINE) {
+  if (overlapped) {
+    return Fail(WSAEOPNOTSUPP);
+  }
+  int type = 0,
+      len  = sizeof(type);
+  if (Posix::GetOption(static_cast<int>(s), SOL_SOCKET, SO_TYPE, &type, &len) < 0) {
+    return FailWithErrno();
+  }
+  if (code == SIO_UDP_CONNRESET && type == SOCK_DGRAM) {
+    // Linux never reports ICMP port unreachable on unconnected UDP sockets
+    if (bytesReturned) {
+      *bytesReturned = 0;
+    }
+    return 0;
+  }
+  return Fail(WSAEOPNOTSUPP);
+}
+
+
+WSAEVENT WSACreateEvent() {
+  return NewHandle(new EventObject(true, false));
+}
+
+
+BOOL WSACloseEvent(WSAEVENT event) {
+  return CloseHandle(event);
+}
+
+
+BOOL WSASetEvent(WSAEVENT event) {
+  return SetEvent(event);
+}
+
+
+BOOL WSAResetEvent(WSAEVENT event) {
+  return ResetEvent(event);
+}
+
+
+int WSAEventSelect(SOCKET s, WSAEVENT event, long networkEvents) {
+  StopEventSelect(s);
+  if (!networkEvents) {
+    return 0;
+  }
+  EventObject *object = GetObject<EventObject>(event);
+  if (!object || (networkEvents & ~FD_READ)) {
+    return Fail(object ? WSAEOPNOTSUPP : WSAEINVAL);
+  }
+  // As with Winsock, the socket becomes non-blocking
+  if (Posix::SetNonBlocking(static_cast<int>(s), true) < 0) {
+    return FailWithErrno();
+  }
+
+  ++object->references;
+  auto *watcher = new EventSelect();
+  watcher->event  = object;
+  watcher->stop   = false;
+  watcher->thread = std::thread([s, watcher] {
+    while (!watcher->stop) {
+      Posix::PollEntry entry = { static_cast<int>(s), true, false, false };
+      if (Posix::Poll(&entry, 1, 10) <= 0 || !entry.read) {
+        continue;
+      }
+      bool wasSignaled;
+      {
+        std::lock_guard<std::mutex> guard(WaitLock());
+        wasSignaled = watcher->event->signaled;
+        watcher->event->signaled = true;
+        NotifyWaiters();
+      }
+      // Still readable until the owner receives, so don't spin meanwhile
+      if (wasSignaled) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  });
+  std::lock_guard<std::mutex> guard(selectLock);
+  eventSelects[s].reset(watcher);
+  return 0;
+}
+
+
+static void StopEventSelect(SOCKET s) {
+  std::unique_ptr<EventSelect> watcher;
+  {
+    std::lock_guard<std::mutex> guard(selectLock);
+    auto it = eventSelects.find(s);
+    if (it == eventSelects.end()) {
+      return;
+    }
+    watcher = std::move(it->second);
+    eventSelects.erase(it);
+  }
+  watcher->stop = true;
+  watcher->thread.join();
+  ReleaseObject(watcher->event);
+}
+
+
+int WSARecvFrom(SOCKET s, LPWSABUF buffers, DWORD bufferCount, LPDWORD bytesReceived,
+                LPDWORD flags, sockaddr *from, LPINT fromLen, LPWSAOVERLAPPED overlapped,
+                LPWSAOVERLAPPED_COMPLETION_ROUTINE completionRoutine) {
+  if (!buffers || bufferCount != 1 || !flags) {
+    return Fail(WSAEINVAL);
+  }
+  if (!overlapped) {
+    int result = recvfrom(s, buffers->buf, buffers->len, *flags, from, fromLen);
+    if (result >= 0 && bytesReceived) {
+      *bytesReceived = result;
+    }
+    return (result >= 0) ? 0 : SOCKET_ERROR;
+  }
+
+  ULONG_PTR key;
+  CompletionPortObject *port = GetCompletionPort(reinterpret_cast<HANDLE>(s), &key);
+  if (!port || completionRoutine || *flags != 0) {
+    if (port) {
+      ReleaseObject(port);
+    }
+    return Fail(WSAEOPNOTSUPP);
+  }
+
+  OverlappedSocket *sock;
+  {
+    std::lock_guard<std::mutex> guard(overlappedLock);
+    std::unique_ptr<OverlappedSocket> &entry = overlappedSockets[s];
+    if (!entry) {
+      entry.reset(new OverlappedSocket());
+      entry->port = port;
+      entry->key  = key;
+      entry->stop = false;
+      entry->thread = std::thread(ServeReceives, s, entry.get());
+    }
+    else {
+      ReleaseObject(port);
+    }
+    sock = entry.get();
+  }
+
+  // Always completes through the port, even if a datagram is waiting already
+  std::lock_guard<std::mutex> guard(sock->lock);
+  sock->pending.push_back({ *buffers, from, fromLen, overlapped });
+  sock->posted.notify_one();
+  return Fail(WSA_IO_PENDING);
+}
+
+
+// Only sockets do overlapped I/O in the shim
+BOOL CancelIoEx(HANDLE file, OVERLAPPED *overlapped) {
+  OverlappedSocket *sock = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(overlappedLock);
+    auto it = overlappedSockets.find(reinterpret_cast<SOCKET>(file));
+    if (it != overlappedSockets.end()) {
+      sock = it->second.get();
+    }
+  }
+  if (!sock || CancelReceives(sock, overlapped) == 0) {
+    SetLastError(ERROR_NOT_FOUND);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+static void ServeReceives(SOCKET s, OverlappedSocket *sock) {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(sock->lock);
+      sock->posted.wait(guard, [sock] { return sock->stop || !sock->pending.empty(); });
+      if (sock->stop) {
+        return;
+      }
+    }
+
+    // Polled with a timeout, to notice a stop or a cancel. Then completes receives
+    // until the socket runs dry, as the kernel would for a burst.
+    Posix::PollEntry entry = { static_cast<int>(s), true, false, false };
+    if (Posix::Poll(&entry, 1, 10) <= 0 || !entry.read) {
+      continue;
+    }
+    for (;;) {
+      std::lock_guard<std::mutex> guard(sock->lock);
+      if (sock->pending.empty()) {
+        break;
+      }
+      OverlappedReceive &receive = sock->pending.front();
+      int result = Posix::Receive(static_cast<int>(s), receive.buffer.buf,
+                                  receive.buffer.len, Posix::dontWait, receive.from,
+                                  receive.fromLen);
+      if (result < 0 && errno == EAGAIN) {
+        break;
+      }
+      DWORD error = (result < 0) ? (FailWithErrno(), WSAGetLastError()) : 0;
+      PostCompletion(sock->port, { static_cast<DWORD>((result > 0) ? result : 0),
+                                   sock->key, receive.overlapped, error });
+      sock->pending.pop_front();
+    }
+  }
+}
+
+
+// Completes the socket's receives as aborted, or just the given one. Returns the
+// number cancelled.
+static int CancelReceives(OverlappedSocket *sock, OVERLAPPED *overlapped) {
+  std::lock_guard<std::mutex> guard(sock->lock);
+  int cancelled = 0;
+  for (auto it = sock->pending.begin(); it != sock->pending.end();) {
+    if (!overlapped || it->overlapped == overlapped) {
+      PostCompletion(sock->port, { 0, sock->key, it->overlapped,
+                                   ERROR_OPERATION_ABORTED });
+      it = sock->pending.erase(it);
+      ++cancelled;
+    }
+    else {
+      ++it;
+    }
+  }
+  return cancelled;
+}
+
+
+// Closing a socket aborts its receives, and ends its association with the port
+static void StopOverlapped(SOCKET s) {
+  std::unique_ptr<OverlappedSocket> sock;
+  {
+    std::lock_guard<std::mutex> guard(overlappedLock);
+    auto it = overlappedSockets.find(s);
+    if (it != overlappedSockets.end()) {
+      sock = std::move(it->second);
+      overlappedSockets.erase(it);
+    }
+  }
+  if (sock) {
+    {
+      std::lock_guard<std::mutex> guard(sock->lock);
+      sock->stop = true;
+      sock->posted.notify_one();
+    }
+    sock->thread.join();
+    CancelReceives(sock.get(), nullptr);
+    ReleaseObject(sock->port);
+  }
+  DissociateCompletionPort(reinterpret_cast<HANDLE>(s));
+}
+
+
+int inet_pton(int family, const char *text, void *address) {
+  if (family != AF_INET && family != AF_INET6) {
+    return Fail(WSAEAFNOSUPPORT);
+  }
+  return Posix::StringToAddress(family, text, address);
+}
+
+
+const char* inet_ntop(int family, const void *address, char *text, size_t size) {
+  if (Posix::AddressToString(family, address, text, static_cast<int>(size)) < 0) {
+    FailWithErrno();
+    return nullptr;
+  }
+  return text;
+}
+
+
+// A result and its address, in one allocation that starts with the result
+struct AddrInfoBlock {
+  addrinfo    info;
+  sockaddr_in address;
+};
+
+
+int getaddrinfo(const char *node, const char *service, const addrinfo *hints,
+                addrinfo **result) {
+  if (hints && hints->ai_family != AF_INET && hints->ai_family != AF_UNSPEC) {
+    return EAI_FAMILY;
+  }
+  AddrInfoBlock *block = new AddrInfoBlock();
+  if (Posix::ResolveIpv4(node, service, &block->address) != 0) {
+    delete block;
+    return EAI_NONAME;
+  }
+  if (hints) {
+    block->info.ai_socktype = hints->ai_socktype;
+    block->info.ai_protocol = hints->ai_protocol;
+  }
+  block->info.ai_family  = AF_INET;
+  block->info.ai_addrlen = sizeof(block->address);
+  block->info.ai_addr    = reinterpret_cast<sockaddr*>(&block->address);
+  *result = &block->info;
+  return 0;
+}
+
+
+void freeaddrinfo(addrinfo *info) {
+  delete reinterpret_cast<AddrInfoBlock*>(info);
+}
@@ -0,0 +1,139 @@
+
+#ifndef SHIM_IPHLPAPI_H
+#define SHIM_IPHLPAPI_H
+
+// The IP helper functions modules call, over the interface, address and route
+// tables Iphlpapi.cpp keeps from the rtnetlink messages tests feed it. The Vista
+// notification functions aren't declared, as modules find them with
+// GetProcAddress; the stand-in iphlpapi.dll exports them.
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <time.h>
+
+typedef ULONG  IPAddr;
+typedef ULONG  IPMask;
+typedef ULONG  NET_IFINDEX;
+typedef USHORT ADDRESS_FAMILY;
+
+#define MAX_ADAPTER_NAME_LENGTH        256
+#define MAX_ADAPTER_DESCRIPTION_LENGTH 128
+#define MAX_ADAPTER_ADDRESS_LENGTH     8
+
+struct IP_ADDRESS_STRING {
+  char String[4 * 4];
+};
+typedef IP_ADDRESS_STRING IP_MASK_STRING;
+
+struct IP_ADDR_STRING {
+  IP_ADDR_STRING    *Next;
+  IP_ADDRESS_STRING  IpAddress;
+  IP_MASK_STRING     IpMask;
+  DWORD              Context;
+};
+
+struct IP_ADAPTER_INFO {
+  IP_ADAPTER_INFO *Next;
+  DWORD            ComboIndex;
+  char             AdapterName[MAX_ADAPTER_NAME_LENGTH + 4];
+  char             Description[MAX_ADAPTER_DESCRIPTION_LENGTH + 4];
+  UINT             AddressLength;
+  BYTE             Address[MAX_ADAPTER_ADDRESS_LENGTH];
+  DWORD            Index;
+  UINT             Type;
+  UINT             DhcpEnabled;
+  IP_ADDR_STRING  *CurrentIpAddress;
+  IP_ADDR_STRING   IpAddressList;
+  IP_ADDR_STRING   GatewayList;
+  IP_ADDR_STRING   DhcpServer;
+  BOOL             HaveWins;
+  IP_ADDR_STRING   PrimaryWinsServer;
+  IP_ADDR_STRING   SecondaryWinsServer;
+  time_t           LeaseObtained;
+  time_t           LeaseExpires;
+};
+
+DWORD GetNumberOfInterfaces(PDWORD count);
+ULONG GetAdaptersInfo(IP_ADAPTER_INFO *adapterInfo, PULONG size);
+DWORD GetBestInterface(IPAddr destination, PDWORD bestIndex);
+
+struct MIB_IPADDRROW {
+  DWORD          dwAddr;
+  DWORD          dwIndex;
+  DWORD          dwMask;
+  DWORD          dwBCastAddr;
+  DWORD          dwReasmSize;
+  unsigned short unused1;
+  unsigned short wType;
+};
+
+struct MIB_IPADDRTABLE {
+  DWORD         dwNumEntries;
+  MIB_IPADDRROW table[1];
+};
+typedef MIB_IPADDRTABLE *PMIB_IPADDRTABLE;
+
+// The addresses of adapters that are up. The order argument is ignored.
+ULONG GetIpAddrTable(PMIB_IPADDRTABLE table, PULONG size, BOOL order);
+
+// Signals overlapped->hEvent once, the next time an address is added or removed
+DWORD NotifyAddrChange(HANDLE *handle, OVERLAPPED *overlapped);
+BOOL  CancelIPChangeNotify(OVERLAPPED *overlapped);
+
+
+// Rows of the Vista IP helper tables, with only the fields the shim fills in
+
+union SOCKADDR_INET {
+  sockaddr_in    Ipv4;
+  sockaddr_in6   Ipv6;
+  ADDRESS_FAMILY si_family;
+};
+
+struct IP_ADDRESS_PREFIX {
+  SOCKADDR_INET Prefix;
+  UCHAR         PrefixLength;
+};
+
+enum MIB_NOTIFICATION_TYPE {
+  MibParameterNotification,
+  MibAddInstance,
+  MibDeleteInstance,
+  MibInitialNotification
+};
+
+struct MIB_IPINTERFACE_ROW {
+  ADDRESS_FAMILY Family;
+  NET_IFINDEX    InterfaceIndex;
+  BOOLEAN        Connected;
+};
+typedef MIB_IPINTERFACE_ROW *PMIB_IPINTERFACE_ROW;
+
+struct MIB_UNICASTIPADDRESS_ROW {
+  SOCKADDR_INET Address;
+  NET_IFINDEX   InterfaceIndex;
+  UCHAR         OnLinkPrefixLength;
+};
+typedef MIB_UNICASTIPADDRESS_ROW *PMIB_UNICASTIPADDRESS_ROW;
+
+struct MIB_IPFORWARD_ROW2 {
+  NET_IFINDEX       InterfaceIndex;
+  IP_ADDRESS_PREFIX DestinationPrefix;
+  SOCKADDR_INET     NextHop;
+  ULONG             Metric;
+};
+typedef MIB_IPFORWARD_ROW2 *PMIB_IPFORWARD_ROW2;
+
+struct MIB_IPFORWARD_TABLE2 {
+  ULONG              NumEntries;
+  MIB_IPFORWARD_ROW2 Table[1];
+};
+typedef MIB_IPFORWARD_TABLE2 *PMIB_IPFORWARD_TABLE2;
+
+typedef void (WINAPI *PIPINTERFACE_CHANGE_CALLBACK)(PVOID context,
+  PMIB_IPINTERFACE_ROW row, MIB_NOTIFICATION_TYPE type);
+typedef void (WINAPI *PUNICAST_IPADDRESS_CHANGE_CALLBACK)(PVOID context,
+  PMIB_UNICASTIPADDRESS_ROW row, MIB_NOTIFICATION_TYPE type);
+typedef void (WINAPI *PIPFORWARD_CHANGE_CALLBACK)(PVOID context,
+  PMIB_IPFORWARD_ROW2 row, MIB_NOTIFICATION_TYPE type);
+
+#endif
@@ -0,0 +1,9 @@
+
+#ifndef SHIM_MSTCPIP_H
+#define SHIM_MSTCPIP_H
+
+#include <winsock2.h>
+
+#define SIO_UDP_CONNRESET 0x9800000C
+
+#endif
@@ -0,0 +1,29 @@
+
+#ifndef SHIM_TLHELP32_H
+#define SHIM_TLHELP32_H
+
+#include <windows.h>
+
+#define TH32CS_SNAPMODULE   0x00000008
+#define TH32CS_SNAPMODULE32 0x00000010
+#define MAX_MODULE_NAME32   255
+
+struct MODULEENTRY32 {
+  DWORD   dwSize;
+  DWORD   th32ModuleID;
+  DWORD   th32ProcessID;
+  DWORD   GlblcntUsage;
+  DWORD   ProccntUsage;
+  BYTE   *modBaseAddr;
+  DWORD   modBaseSize;
+  HMODULE hModule;
+  char    szModule[MAX_MODULE_NAME32 + 1];
+  char    szExePath[260];
+};
+
+// Snapshots list the modules registered with ShimAddModule
+HANDLE CreateToolhelp32Snapshot(DWORD flags, DWORD processId);
+BOOL   Module32First(HANDLE snapshot, MODULEENTRY32 *entry);
+BOOL   Module32Next(HANDLE snapshot, MODULEENTRY32 *entry);
+
+#endif
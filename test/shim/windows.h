@@ -0,0 +1,579 @@
+
+#ifndef SHIM_WINDOWS_H
+#define SHIM_WINDOWS_H
+
+// The subset of the Win32 API NetHelper uses, implemented on Linux so its modules
+// can be built and tested there. Only x86-64 is supported.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define _WIN64
+
+#define WINAPI
+#define CALLBACK
+#define NTAPI
+#define APIENTRY
+#define __stdcall
+#define __cdecl
+#define __fastcall
+#define __thiscall
+#define __declspec(x)
+
+#define CONST const
+#define VOID  void
+#define TRUE  1
+#define FALSE 0
+
+typedef uint8_t   BYTE,  UCHAR, BOOLEAN;
+typedef uint16_t  WORD,  USHORT;
+typedef uint32_t  DWORD, ULONG, UINT;
+typedef int16_t   SHORT;
+typedef int32_t   LONG, INT, INT32;
+typedef int64_t   LONGLONG, LONG64, __int64;
+typedef uint64_t  ULONGLONG, ULONG64, DWORD64;
+typedef uintptr_t ULONG_PTR, UINT_PTR, DWORD_PTR, SIZE_T;
+typedef intptr_t  LONG_PTR;
+typedef int       BOOL;
+typedef char      CHAR;
+typedef long      HRESULT;
+
+typedef void       *PVOID, *LPVOID, *HANDLE, *HWND;
+typedef const void *LPCVOID;
+typedef char       *LPSTR;
+typedef const char *LPCSTR;
+typedef BYTE       *PBYTE, *LPBYTE;
+typedef DWORD      *PDWORD, *LPDWORD;
+typedef ULONG      *PULONG;
+typedef ULONG_PTR  *PULONG_PTR;
+typedef INT        *LPINT;
+
+// Module handles are their image's base address
+struct HINSTANCE__ { int unused; };
+typedef HINSTANCE__ *HINSTANCE, *HMODULE;
+
+#define MAKEWORD(a, b) static_cast<WORD>(static_cast<BYTE>(a) | \
+  (static_cast<WORD>(static_cast<BYTE>(b)) << 8))
+#define LOWORD(l)      static_cast<WORD>(static_cast<DWORD_PTR>(l) & 0xFFFF)
+#define HIWORD(l)      static_cast<WORD>(static_cast<DWORD_PTR>(l) >> 16)
+#define _countof(a)    (sizeof(a) / sizeof((a)[0]))
+
+#define INFINITE             0xFFFFFFFF
+#define MAXDWORD             0xFFFFFFFF
+#define INVALID_HANDLE_VALUE reinterpret_cast<HANDLE>(static_cast<LONG_PTR>(-1))
+
+#define ERROR_SUCCESS             0L
+#define NO_ERROR                  0L
+#define ERROR_FILE_NOT_FOUND      2L
+#define ERROR_PATH_NOT_FOUND      3L
+#define ERROR_ACCESS_DENIED       5L
+#define ERROR_INVALID_HANDLE      6L
+#define ERROR_NOT_ENOUGH_MEMORY   8L
+#define ERROR_NOT_SUPPORTED       50L
+#define ERROR_INVALID_PARAMETER   87L
+#define ERROR_BUFFER_OVERFLOW     111L
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_ALREADY_EXISTS      183L
+#define ERROR_MOD_NOT_FOUND       126L
+#define ERROR_NO_DATA             232L
+#define ERROR_INVALID_ADDRESS     487L
+#define ERROR_OPERATION_ABORTED   995L
+#define ERROR_IO_PENDING          997L
+#define ERROR_NOT_FOUND           1168L
+
+
+// Errors and debug output
+
+DWORD GetLastError();
+void  SetLastError(DWORD error);
+void  OutputDebugStringA(LPCSTR text);
+
+
+// Memory
+
+#define PAGE_NOACCESS          0x01
+#define PAGE_READONLY          0x02
+#define PAGE_READWRITE         0x04
+#define PAGE_EXECUTE           0x10
+#define PAGE_EXECUTE_READ      0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+
+#define MEM_COMMIT  0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+#define MEM_FREE    0x10000
+#define MEM_PRIVATE 0x20000
+#define MEM_IMAGE   0x1000000
+
+struct MEMORY_BASIC_INFORMATION {
+  PVOID  BaseAddress;
+  PVOID  AllocationBase;
+  DWORD  AllocationProtect;
+  SIZE_T RegionSize;
+  DWORD  State;
+  DWORD  Protect;
+  DWORD  Type;
+};
+
+struct SYSTEM_INFO {
+  WORD      wProcessorArchitecture;
+  WORD      wReserved;
+  DWORD     dwPageSize;
+  LPVOID    lpMinimumApplicationAddress;
+  LPVOID    lpMaximumApplicationAddress;
+  DWORD_PTR dwActiveProcessorMask;
+  DWORD     dwNumberOfProcessors;
+  DWORD     dwProcessorType;
+  DWORD     dwAllocationGranularity;
+  WORD      wProcessorLevel;
+  WORD      wProcessorRevision;
+};
+
+LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect);
+BOOL   VirtualFree(LPVOID address, SIZE_T size, DWORD freeType);
+BOOL   VirtualProtect(LPVOID address, SIZE_T size, DWORD newProtect,
+                      PDWORD oldProtect);
+SIZE_T VirtualQuery(LPCVOID address, MEMORY_BASIC_INFORMATION *buffer, SIZE_T length);
+void   GetSystemInfo(SYSTEM_INFO *info);
+HANDLE GetCurrentProcess();
+BOOL   FlushInstructionCache(HANDLE process, LPCVOID address, SIZE_T size);
+
+
+// Modules
+
+#define GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT 0x2
+#define GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS       0x4
+
+HMODULE GetModuleHandleA(LPCSTR moduleName);
+BOOL    GetModuleHandleExA(DWORD flags, LPCSTR moduleName, HMODULE *module);
+void*   GetProcAddress(HMODULE module, LPCSTR procName);
+#define GetModuleHandle GetModuleHandleA
+
+
+// Processes, threads and synchronization
+
+#define WAIT_OBJECT_0        0x00000000L
+#define WAIT_ABANDONED       0x00000080L
+#define WAIT_TIMEOUT         258L
+#define WAIT_FAILED          0xFFFFFFFF
+#define MAXIMUM_WAIT_OBJECTS 64
+
+struct SECURITY_ATTRIBUTES;
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID parameter);
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES *attributes, SIZE_T stackSize,
+                    LPTHREAD_START_ROUTINE startAddress, LPVOID parameter,
+                    DWORD creationFlags, LPDWORD threadId);
+BOOL   GetExitCodeThread(HANDLE thread, LPDWORD exitCode);
+DWORD  GetCurrentProcessId();
+DWORD  GetCurrentThreadId();
+void   Sleep(DWORD milliseconds);
+
+HANDLE CreateEventA(SECURITY_ATTRIBUTES *attributes, BOOL manualReset,
+                    BOOL initialState, LPCSTR name);
+BOOL   SetEvent(HANDLE event);
+BOOL   ResetEvent(HANDLE event);
+DWORD  WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+DWORD  WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL waitAll,
+                              DWORD milliseconds);
+BOOL   CloseHandle(HANDLE handle);
+#define CreateEvent CreateEventA
+
+struct SRWLOCK { PVOID Ptr; };
+typedef SRWLOCK *PSRWLOCK;
+#define SRWLOCK_INIT { nullptr }
+
+void InitializeSRWLock(PSRWLOCK lock);
+void AcquireSRWLockExclusive(PSRWLOCK lock);
+void ReleaseSRWLockExclusive(PSRWLOCK lock);
+void AcquireSRWLockShared(PSRWLOCK lock);
+void ReleaseSRWLockShared(PSRWLOCK lock);
+
+// Callbacks run on a thread of their own per registration, rather than a pool's.
+// Only WT_EXECUTEONLYONCE changes anything.
+#define WT_EXECUTEDEFAULT  0x00
+#define WT_EXECUTEONLYONCE 0x08
+
+typedef void (CALLBACK *WAITORTIMERCALLBACK)(PVOID context, BOOLEAN timedOut);
+
+BOOL RegisterWaitForSingleObject(HANDLE *newWaitObject, HANDLE object,
+                                 WAITORTIMERCALLBACK callback, PVOID context,
+                                 ULONG milliseconds, ULONG flags);
+BOOL UnregisterWaitEx(HANDLE waitHandle, HANDLE completionEvent);
+
+struct CONDITION_VARIABLE { PVOID Ptr; };
+typedef CONDITION_VARIABLE *PCONDITION_VARIABLE;
+#define CONDITION_VARIABLE_INIT { nullptr }
+
+void InitializeConditionVariable(PCONDITION_VARIABLE conditionVariable);
+BOOL SleepConditionVariableSRW(PCONDITION_VARIABLE conditionVariable, PSRWLOCK lock,
+                               DWORD milliseconds, ULONG flags);
+void WakeConditionVariable(PCONDITION_VARIABLE conditionVariable);
+void WakeAllConditionVariable(PCONDITION_VARIABLE conditionVariable);
+
+
+// Files
+
+#define GENERIC_READ          0x80000000
+#define GENERIC_WRITE         0x40000000
+#define FILE_SHARE_READ       0x1
+#define FILE_SHARE_WRITE      0x2
+#define CREATE_ALWAYS         2
+#define OPEN_EXISTING         3
+#define FILE_ATTRIBUTE_NORMAL 0x80
+
+// IP helper notifications and overlapped socket receives complete through
+// OVERLAPPED; file I/O is synchronous
+struct OVERLAPPED {
+  ULONG_PTR Internal;
+  ULONG_PTR InternalHigh;
+  union {
+    struct {
+      DWORD Offset;
+      DWORD OffsetHigh;
+    };
+    PVOID Pointer;
+  };
+  HANDLE hEvent;
+};
+
+HANDLE CreateFileA(LPCSTR fileName, DWORD desiredAccess, DWORD shareMode,
+                   SECURITY_ATTRIBUTES *attributes, DWORD creationDisposition,
+                   DWORD flagsAndAttributes, HANDLE templateFile);
+BOOL   ReadFile(HANDLE file, LPVOID buffer, DWORD bytesToRead, LPDWORD bytesRead,
+                OVERLAPPED *overlapped);
+BOOL   WriteFile(HANDLE file, LPCVOID buffer, DWORD bytesToWrite,
+                 LPDWORD bytesWritten, OVERLAPPED *overlapped);
+#define CreateFile CreateFileA
+
+// Profile files, read in full each call as Windows does. Paths may use backslashes.
+DWORD GetPrivateProfileSectionA(LPCSTR appName, LPSTR returnedString, DWORD size,
+                                LPCSTR fileName);
+#define GetPrivateProfileSection GetPrivateProfileSectionA
+
+// Directory change notifications, on inotify. Only FILE_NOTIFY_CHANGE_LAST_WRITE
+// is supported, and subtrees aren't watched.
+#define FILE_NOTIFY_CHANGE_LAST_WRITE 0x10
+HANDLE FindFirstChangeNotificationA(LPCSTR pathName, BOOL watchSubtree, DWORD filter);
+BOOL   FindNextChangeNotification(HANDLE changeHandle);
+BOOL   FindCloseChangeNotification(HANDLE changeHandle);
+#define FindFirstChangeNotification FindFirstChangeNotificationA
+
+// Completion ports. Sockets are the only handles that can be associated with one,
+// and only WSARecvFrom completes through them. Closing a port that still has
+// waiters isn't supported.
+HANDLE CreateIoCompletionPort(HANDLE file, HANDLE existingPort, ULONG_PTR key,
+                              DWORD concurrentThreads);
+BOOL   GetQueuedCompletionStatus(HANDLE port, LPDWORD bytes, PULONG_PTR key,
+                                 OVERLAPPED **overlapped, DWORD milliseconds);
+BOOL   PostQueuedCompletionStatus(HANDLE port, DWORD bytes, ULONG_PTR key,
+                                  OVERLAPPED *overlapped);
+BOOL   CancelIoEx(HANDLE file, OVERLAPPED *overlapped);
+
+// File mappings, on mmap. Named ones are POSIX shared memory, which only this
+// process can open by name, and which goes away when its creator closes it.
+#define FILE_MAP_WRITE      0x2
+#define FILE_MAP_READ       0x4
+#define FILE_MAP_ALL_ACCESS 0xF001F
+
+HANDLE CreateFileMappingA(HANDLE file, SECURITY_ATTRIBUTES *attributes,
+                          DWORD protect, DWORD maximumSizeHigh,
+                          DWORD maximumSizeLow, LPCSTR name);
+HANDLE OpenFileMappingA(DWORD desiredAccess, BOOL inheritHandle, LPCSTR name);
+LPVOID MapViewOfFile(HANDLE mapping, DWORD desiredAccess, DWORD fileOffsetHigh,
+                     DWORD fileOffsetLow, size_t bytesToMap);
+BOOL   UnmapViewOfFile(LPCVOID baseAddress);
+BOOL   FlushViewOfFile(LPCVOID baseAddress, size_t bytesToFlush);
+#define CreateFileMapping CreateFileMappingA
+#define OpenFileMapping   OpenFileMappingA
+
+
+// Interlocked operations, which are full barriers as on Windows
+
+inline LONG InterlockedIncrement(volatile LONG *p) {
+  return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedDecrement(volatile LONG *p) {
+  return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedExchange(volatile LONG *p, LONG value) {
+  return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedExchangeAdd(volatile LONG *p, LONG value) {
+  return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedCompareExchange(volatile LONG *p, LONG exchange,
+                                       LONG comparand) {
+  __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST,
+                              __ATOMIC_SEQ_CST);
+  return comparand;
+}
+inline LONG64 InterlockedIncrement64(volatile LONG64 *p) {
+  return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+inline LONG64 InterlockedExchange64(volatile LONG64 *p, LONG64 value) {
+  return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+inline LONG64 InterlockedExchangeAdd64(volatile LONG64 *p, LONG64 value) {
+  return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+}
+inline LONG64 InterlockedCompareExchange64(volatile LONG64 *p, LONG64 exchange,
+                                           LONG64 comparand) {
+  __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST,
+                              __ATOMIC_SEQ_CST);
+  return comparand;
+}
+inline PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID value) {
+  return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile *p, PVOID exchange,
+                                               PVOID comparand) {
+  __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST,
+                              __ATOMIC_SEQ_CST);
+  return comparand;
+}
+inline void MemoryBarrier()   { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+inline void YieldProcessor()  { __builtin_ia32_pause(); }
+inline void _ReadWriteBarrier() { __asm__ __volatile__ ("" ::: "memory"); }
+
+
+// Time
+
+union LARGE_INTEGER {
+  struct {
+    DWORD LowPart;
+    LONG  HighPart;
+  };
+  LONGLONG QuadPart;
+};
+
+struct FILETIME {
+  DWORD dwLowDateTime;
+  DWORD dwHighDateTime;
+};
+
+DWORD     GetTickCount();
+ULONGLONG GetTickCount64();
+BOOL      QueryPerformanceCounter(LARGE_INTEGER *count);
+BOOL      QueryPerformanceFrequency(LARGE_INTEGER *frequency);
+void      GetSystemTimeAsFileTime(FILETIME *time);
+
+
+// System information
+
+#define MAX_COMPUTERNAME_LENGTH 15
+
+BOOL GetComputerNameA(LPSTR buffer, DWORD *size);
+BOOL GetVolumeInformationA(LPCSTR rootPath, LPSTR volumeName, DWORD volumeNameSize,
+                           DWORD *serialNumber, DWORD *maxComponentLength,
+                           DWORD *fileSystemFlags, LPSTR fileSystemName,
+                           DWORD fileSystemNameSize);
+
+
+// C runtime extensions
+
+inline int _stricmp(const char *a, const char *b) {
+  return strcasecmp(a, b);
+}
+inline int _strnicmp(const char *a, const char *b, size_t n) {
+  return strncasecmp(a, b, n);
+}
+
+inline int strcpy_s(char *dest, size_t size, const char *source) {
+  size_t length = strlen(source);
+  if (!dest || length >= size) {
+    if (dest && size) {
+      dest[0] = '\0';
+    }
+    return 34;  // ERANGE
+  }
+  memcpy(dest, source, length + 1);
+  return 0;
+}
+template <size_t Size>
+int strcpy_s(char (&dest)[Size], const char *source) {
+  return strcpy_s(dest, Size, source);
+}
+
+inline int strcat_s(char *dest, size_t size, const char *source) {
+  size_t length = strnlen(dest, size);
+  return (length < size) ? strcpy_s(dest + length, size - length, source) : 22;
+}
+
+inline int sprintf_s(char *buffer, size_t size, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = vsnprintf(buffer, size, format, args);
+  va_end(args);
+  if (result < 0 || static_cast<size_t>(result) >= size) {
+    if (size) {
+      buffer[0] = '\0';
+    }
+    return -1;
+  }
+  return result;
+}
+template <size_t Size>
+int sprintf_s(char (&buffer)[Size], const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = vsnprintf(buffer, Size, format, args);
+  va_end(args);
+  if (result < 0 || static_cast<size_t>(result) >= Size) {
+    buffer[0] = '\0';
+    return -1;
+  }
+  return result;
+}
+
+
+// Portable executable images
+
+#define IMAGE_DOS_SIGNATURE           0x5A4D
+#define IMAGE_NT_SIGNATURE            0x00004550
+#define IMAGE_NT_OPTIONAL_HDR32_MAGIC 0x10B
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC 0x20B
+#define IMAGE_FILE_MACHINE_I386       0x014C
+#define IMAGE_FILE_MACHINE_AMD64      0x8664
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES 16
+
+#define IMAGE_DIRECTORY_ENTRY_EXPORT    0
+#define IMAGE_DIRECTORY_ENTRY_IMPORT    1
+#define IMAGE_DIRECTORY_ENTRY_BASERELOC 5
+#define IMAGE_DIRECTORY_ENTRY_IAT       12
+
+#define IMAGE_REL_BASED_ABSOLUTE 0
+#define IMAGE_REL_BASED_HIGHLOW  3
+#define IMAGE_REL_BASED_DIR64    10
+
+#define IMAGE_SCN_CNT_CODE               0x00000020
+#define IMAGE_SCN_CNT_INITIALIZED_DATA   0x00000040
+#define IMAGE_SCN_CNT_UNINITIALIZED_DATA 0x00000080
+#define IMAGE_SCN_MEM_EXECUTE            0x20000000
+#define IMAGE_SCN_MEM_READ               0x40000000
+#define IMAGE_SCN_MEM_WRITE              0x80000000
+
+#define IMAGE_ORDINAL_FLAG \
+  (static_cast<ULONG_PTR>(1) << (sizeof(ULONG_PTR) * 8 - 1))
+#define IMAGE_SNAP_BY_ORDINAL(o) (((o) & IMAGE_ORDINAL_FLAG) != 0)
+#define IMAGE_ORDINAL(o)         ((o) & 0xFFFF)
+
+#pragma pack(push, 4)
+struct IMAGE_DOS_HEADER {
+  WORD e_magic;
+  WORD e_cblp, e_cp, e_crlc, e_cparhdr, e_minalloc, e_maxalloc, e_ss, e_sp, e_csum,
+       e_ip, e_cs, e_lfarlc, e_ovno, e_res[4], e_oemid, e_oeminfo, e_res2[10];
+  LONG e_lfanew;
+};
+
+struct IMAGE_FILE_HEADER {
+  WORD  Machine;
+  WORD  NumberOfSections;
+  DWORD TimeDateStamp;
+  DWORD PointerToSymbolTable;
+  DWORD NumberOfSymbols;
+  WORD  SizeOfOptionalHeader;
+  WORD  Characteristics;
+};
+
+struct IMAGE_DATA_DIRECTORY {
+  DWORD VirtualAddress;
+  DWORD Size;
+};
+
+struct IMAGE_OPTIONAL_HEADER32 {
+  WORD  Magic;
+  BYTE  MajorLinkerVersion, MinorLinkerVersion;
+  DWORD SizeOfCode, SizeOfInitializedData, SizeOfUninitializedData,
+        AddressOfEntryPoint, BaseOfCode, BaseOfData, ImageBase, SectionAlignment,
+        FileAlignment;
+  WORD  MajorOperatingSystemVersion, MinorOperatingSystemVersion, MajorImageVersion,
+        MinorImageVersion, MajorSubsystemVersion, MinorSubsystemVersion;
+  DWORD Win32VersionValue, SizeOfImage, SizeOfHeaders, CheckSum;
+  WORD  Subsystem, DllCharacteristics;
+  DWORD SizeOfStackReserve, SizeOfStackCommit, SizeOfHeapReserve, SizeOfHeapCommit,
+        LoaderFlags, NumberOfRvaAndSizes;
+  IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+};
+
+struct IMAGE_OPTIONAL_HEADER64 {
+  WORD      Magic;
+  BYTE      MajorLinkerVersion, MinorLinkerVersion;
+  DWORD     SizeOfCode, SizeOfInitializedData, SizeOfUninitializedData,
+            AddressOfEntryPoint, BaseOfCode;
+  ULONGLONG ImageBase;
+  DWORD     SectionAlignment, FileAlignment;
+  WORD      MajorOperatingSystemVersion, MinorOperatingSystemVersion,
+            MajorImageVersion, MinorImageVersion, MajorSubsystemVersion,
+            MinorSubsystemVersion;
+  DWORD     Win32VersionValue, SizeOfImage, SizeOfHeaders, CheckSum;
+  WORD      Subsystem, DllCharacteristics;
+  ULONGLONG SizeOfStackReserve, SizeOfStackCommit, SizeOfHeapReserve,
+            SizeOfHeapCommit;
+  DWORD     LoaderFlags, NumberOfRvaAndSizes;
+  IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+};
+
+struct IMAGE_NT_HEADERS32 {
+  DWORD                   Signature;
+  IMAGE_FILE_HEADER       FileHeader;
+  IMAGE_OPTIONAL_HEADER32 OptionalHeader;
+};
+
+struct IMAGE_NT_HEADERS64 {
+  DWORD                   Signature;
+  IMAGE_FILE_HEADER       FileHeader;
+  IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+};
+typedef IMAGE_OPTIONAL_HEADER64 IMAGE_OPTIONAL_HEADER;
+typedef IMAGE_NT_HEADERS64      IMAGE_NT_HEADERS;
+
+struct IMAGE_SECTION_HEADER {
+  BYTE Name[8];
+  union {
+    DWORD PhysicalAddress;
+    DWORD VirtualSize;
+  } Misc;
+  DWORD VirtualAddress, SizeOfRawData, PointerToRawData, PointerToRelocations,
+        PointerToLinenumbers;
+  WORD  NumberOfRelocations, NumberOfLinenumbers;
+  DWORD Characteristics;
+};
+
+#define IMAGE_FIRST_SECTION(ntHeaders) reinterpret_cast<IMAGE_SECTION_HEADER*>( \
+  reinterpret_cast<ULONG_PTR>(ntHeaders) + \
+  offsetof(IMAGE_NT_HEADERS, OptionalHeader) + \
+  (ntHeaders)->FileHeader.SizeOfOptionalHeader)
+
+struct IMAGE_BASE_RELOCATION {
+  DWORD VirtualAddress;
+  DWORD SizeOfBlock;
+};
+
+struct IMAGE_IMPORT_DESCRIPTOR {
+  union {
+    DWORD Characteristics;
+    DWORD OriginalFirstThunk;
+  };
+  DWORD TimeDateStamp, ForwarderChain, Name, FirstThunk;
+};
+
+struct IMAGE_IMPORT_BY_NAME {
+  WORD Hint;
+  CHAR Name[1];
+};
+#pragma pack(pop)
+
+// The native width, as the loader leaves the IAT of an image for this process
+struct IMAGE_THUNK_DATA {
+  union {
+    ULONG_PTR ForwarderString, Function, Ordinal, AddressOfData;
+  } u1;
+};
+
+#endif
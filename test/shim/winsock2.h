@@ -0,0 +1,216 @@
+
+#ifndef SHIM_WINSOCK2_H
+#define SHIM_WINSOCK2_H
+
+// Winsock, backed by POSIX sockets. Socket handles are file descriptors.
+
+#include <windows.h>
+#include <sys/select.h>  // Its fd_set, timeval and FD_ macros are replaced below
+
+typedef UINT_PTR       SOCKET;
+typedef unsigned char  u_char;
+typedef unsigned short u_short;
+typedef unsigned int   u_int;
+// 32 bits as on Windows, unlike the u_long of glibc's <sys/types.h>
+#define u_long ULONG
+
+#define INVALID_SOCKET (static_cast<SOCKET>(~0))
+#define SOCKET_ERROR   (-1)
+
+#define AF_UNSPEC   0
+#define AF_INET     2
+#define AF_INET6    23
+#define SOCK_STREAM 1
+#define SOCK_DGRAM  2
+#define IPPROTO_IP  0
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+
+#define SOL_SOCKET   0xFFFF
+#define SO_REUSEADDR 0x0004
+#define SO_BROADCAST 0x0020
+#define SO_SNDBUF    0x1001
+#define SO_RCVBUF    0x1002
+#define SO_SNDTIMEO  0x1005
+#define SO_RCVTIMEO  0x1006
+#define SO_ERROR     0x1007
+#define SO_TYPE      0x1008
+#define TCP_NODELAY  0x0001
+
+#define MSG_OOB  0x1
+#define MSG_PEEK 0x2
+
+#define FIONREAD static_cast<long>(0x4004667F)
+#define FIONBIO  static_cast<long>(0x8004667E)
+
+struct in_addr {
+  union {
+    struct { u_char s_b1, s_b2, s_b3, s_b4; } S_un_b;
+    u_long S_addr;
+  } S_un;
+};
+#define s_addr S_un.S_addr
+
+#define INADDR_ANY       static_cast<u_long>(0x00000000)
+#define INADDR_LOOPBACK  0x7F000001
+#define INADDR_BROADCAST static_cast<u_long>(0xFFFFFFFF)
+#define INADDR_NONE      0xFFFFFFFF
+
+struct sockaddr {
+  u_short sa_family;
+  char    sa_data[14];
+};
+
+struct sockaddr_in {
+  short   sin_family;
+  u_short sin_port;
+  in_addr sin_addr;
+  char    sin_zero[8];
+};
+
+#undef htons
+#undef ntohs
+#undef htonl
+#undef ntohl
+inline u_short htons(u_short value) { return __builtin_bswap16(value); }
+inline u_short ntohs(u_short value) { return __builtin_bswap16(value); }
+inline u_long  htonl(u_long value)  { return __builtin_bswap32(value); }
+inline u_long  ntohl(u_long value)  { return __builtin_bswap32(value); }
+
+// Winsock's fd_set is a count and an array of sockets
+#define fd_set  WinsockFdSet
+#define timeval WinsockTimeval
+#undef  FD_SETSIZE
+#undef  FD_ZERO
+#undef  FD_SET
+#undef  FD_CLR
+#undef  FD_ISSET
+#define FD_SETSIZE 64
+
+struct fd_set {
+  u_int  fd_count;
+  SOCKET fd_array[FD_SETSIZE];
+};
+
+struct timeval {
+  LONG tv_sec;
+  LONG tv_usec;
+};
+
+int __WSAFDIsSet(SOCKET s, fd_set *set);
+
+#define FD_ZERO(set) ((set)->fd_count = 0)
+#define FD_ISSET(s, set) __WSAFDIsSet(static_cast<SOCKET>(s), (set))
+#define FD_SET(s, set) do { \
+    u_int i_; \
+    for (i_ = 0; i_ < (set)->fd_count; ++i_) { \
+      if ((set)->fd_array[i_] == (s)) break; \
+    } \
+    if (i_ == (set)->fd_count && (set)->fd_count < FD_SETSIZE) { \
+      (set)->fd_array[(set)->fd_count++] = (s); \
+    } \
+  } while (0)
+#define FD_CLR(s, set) do { \
+    for (u_int i_ = 0; i_ < (set)->fd_count; ++i_) { \
+      if ((set)->fd_array[i_] == (s)) { \
+        (set)->fd_array[i_] = (set)->fd_array[--(set)->fd_count]; \
+        break; \
+      } \
+    } \
+  } while (0)
+
+// Network events of WSAEventSelect
+#define FD_READ    0x01
+#define FD_WRITE   0x02
+#define FD_OOB     0x04
+#define FD_ACCEPT  0x08
+#define FD_CONNECT 0x10
+#define FD_CLOSE   0x20
+
+typedef HANDLE WSAEVENT;
+#define WSA_INVALID_EVENT nullptr
+#define WSA_IO_PENDING    ERROR_IO_PENDING
+
+#define WSAEINTR          10004L
+#define WSAEBADF          10009L
+#define WSAEACCES         10013L
+#define WSAEFAULT         10014L
+#define WSAEINVAL         10022L
+#define WSAEMFILE         10024L
+#define WSAEWOULDBLOCK    10035L
+#define WSAEINPROGRESS    10036L
+#define WSAENOTSOCK       10038L
+#define WSAEMSGSIZE       10040L
+#define WSAEOPNOTSUPP     10045L
+#define WSAEAFNOSUPPORT   10047L
+#define WSAEADDRINUSE     10048L
+#define WSAEADDRNOTAVAIL  10049L
+#define WSAENETUNREACH    10051L
+#define WSAECONNRESET     10054L
+#define WSAENOBUFS        10055L
+#define WSAENOTCONN       10057L
+#define WSAETIMEDOUT      10060L
+#define WSAECONNREFUSED   10061L
+#define WSAEHOSTUNREACH   10065L
+#define WSANOTINITIALISED 10093L
+
+struct WSADATA {
+  WORD wVersion;
+  WORD wHighVersion;
+  char szDescription[257];
+  char szSystemStatus[129];
+  unsigned short iMaxSockets;
+  unsigned short iMaxUdpDg;
+  char *lpVendorInfo;
+};
+typedef WSADATA *LPWSADATA;
+
+typedef OVERLAPPED WSAOVERLAPPED, *LPWSAOVERLAPPED;
+
+struct WSABUF {
+  ULONG len;
+  char *buf;
+};
+typedef WSABUF *LPWSABUF;
+typedef void (CALLBACK *LPWSAOVERLAPPED_COMPLETION_ROUTINE)(
+  DWORD error, DWORD bytes, WSAOVERLAPPED *overlapped, DWORD flags);
+
+int  WSAStartup(WORD versionRequested, WSADATA *data);
+int  WSACleanup();
+int  WSAGetLastError();
+void WSASetLastError(int error);
+
+SOCKET socket(int family, int type, int protocol);
+int    bind(SOCKET s, const sockaddr *name, int nameLen);
+int    connect(SOCKET s, const sockaddr *name, int nameLen);
+int    getsockname(SOCKET s, sockaddr *name, int *nameLen);
+int    closesocket(SOCKET s);
+int    send(SOCKET s, const char *buf, int len, int flags);
+int    recv(SOCKET s, char *buf, int len, int flags);
+int    sendto(SOCKET s, const char *buf, int len, int flags, const sockaddr *to,
+              int toLen);
+int    recvfrom(SOCKET s, char *buf, int len, int flags, sockaddr *from, int *fromLen);
+int    select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+              const timeval *timeout);
+int    ioctlsocket(SOCKET s, long cmd, u_long *argp);
+int    setsockopt(SOCKET s, int level, int name, const char *value, int len);
+int    getsockopt(SOCKET s, int level, int name, char *value, int *len);
+int    WSAIoctl(SOCKET s, DWORD code, LPVOID in, DWORD inLen, LPVOID out,
+                DWORD outLen, LPDWORD bytesReturned, WSAOVERLAPPED *overlapped,
+                LPWSAOVERLAPPED_COMPLETION_ROUTINE completionRoutine);
+
+WSAEVENT WSACreateEvent();
+BOOL     WSACloseEvent(WSAEVENT event);
+BOOL     WSASetEvent(WSAEVENT event);
+BOOL     WSAResetEvent(WSAEVENT event);
+// Only FD_READ is supported
+int      WSAEventSelect(SOCKET s, WSAEVENT event, long networkEvents);
+
+// Overlapped receives complete through the completion port the socket is
+// associated with; completion routines aren't supported
+int      WSARecvFrom(SOCKET s, LPWSABUF buffers, DWORD bufferCount,
+                     LPDWORD bytesReceived, LPDWORD flags, sockaddr *from,
+                     LPINT fromLen, LPWSAOVERLAPPED overlapped,
+                     LPWSAOVERLAPPED_COMPLETION_ROUTINE completionRoutine);
+
+#endif
@@ -0,0 +1,77 @@
+
+#ifndef SHIM_WS2TCPIP_H
+#define SHIM_WS2TCPIP_H
+
+#include <winsock2.h>
+
+#define INET_ADDRSTRLEN  22
+#define INET6_ADDRSTRLEN 65
+
+struct in6_addr {
+  union {
+    u_char  Byte[16];
+    u_short Word[8];
+  } u;
+};
+#define s6_addr  u.Byte
+#define s6_words u.Word
+
+struct sockaddr_in6 {
+  short    sin6_family;
+  u_short  sin6_port;
+  u_long   sin6_flowinfo;
+  in6_addr sin6_addr;
+  u_long   sin6_scope_id;
+};
+
+// Big enough for any address family, as Winsock's is
+struct sockaddr_storage {
+  short     ss_family;
+  char      ssPad1[6];
+  long long ssAlign;
+  char      ssPad2[112];
+};
+
+inline bool IN6_IS_ADDR_V4MAPPED(const in6_addr *address) {
+  return address->s6_words[0] == 0 && address->s6_words[1] == 0 &&
+         address->s6_words[2] == 0 && address->s6_words[3] == 0 &&
+         address->s6_words[4] == 0 && address->s6_words[5] == 0xFFFF;
+}
+
+#define IP_TOS             3
+#define IP_MULTICAST_IF    9
+#define IP_MULTICAST_TTL   10
+#define IP_MULTICAST_LOOP  11
+#define IP_ADD_MEMBERSHIP  12
+#define IP_DROP_MEMBERSHIP 13
+
+struct ip_mreq {
+  in_addr imr_multiaddr;
+  in_addr imr_interface;
+};
+
+int         inet_pton(int family, const char *text, void *address);
+const char* inet_ntop(int family, const void *address, char *text, size_t size);
+
+#define WSAHOST_NOT_FOUND 11001L
+#define EAI_NONAME        WSAHOST_NOT_FOUND
+#define EAI_FAMILY        WSAEAFNOSUPPORT
+
+struct addrinfo {
+  int       ai_flags;
+  int       ai_family;
+  int       ai_socktype;
+  int       ai_protocol;
+  size_t    ai_addrlen;
+  char     *ai_canonname;
+  sockaddr *ai_addr;
+  addrinfo *ai_next;
+};
+typedef addrinfo ADDRINFOA;
+
+// IPv4 only, with the first address the name resolves to
+int  getaddrinfo(const char *node, const char *service, const addrinfo *hints,
+                 addrinfo **result);
+void freeaddrinfo(addrinfo *info);
+
+#endif